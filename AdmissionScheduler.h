@@ -0,0 +1,197 @@
+#ifndef PASSTHROUGHAPP_ADMISSIONSCHEDULER_H
+#define PASSTHROUGHAPP_ADMISSIONSCHEDULER_H
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+// Limits how many targets run at once, overall and per host, so that a
+// page with hundreds of images doesn't hold up its scripts and style
+// sheets.
+//
+// With AdmissionStartPolicy (see SinkPolicy.h), a request that finds the
+// limits reached doesn't start its target. It waits in a queue ordered by
+// the priority the client set through IInternetPriority, higher first,
+// then by the kind of resource its URL names, and then by arrival:
+// documents, style sheets, scripts, anything else, images. SetPriority
+// moves a waiting request to its new place in the queue.
+//
+// A target holds its slot from the time it is started until the client
+// reads the end of the data, or the request fails, is aborted or is
+// terminated. The first waiting request whose host is below its limit
+// then takes the slot. It is started on its own thread: the scheduler
+// asks the request's client sink to Switch, and the target is started
+// from the Continue that follows.
+
+namespace PassthroughAPP
+{
+
+struct AdmissionSchedulerStatistics
+{
+	// Requests started at once, and requests that had to wait
+	LONG cAdmitted;
+	LONG cQueued;
+	// Waiting requests moved ahead by SetPriority
+	LONG cPromoted;
+	// Targets running, and requests waiting
+	LONG cActive;
+	LONG cWaiting;
+};
+
+// In the order waiting requests of the same priority are started
+enum AdmissionClass
+{
+	AdmissionClassDocument,
+	AdmissionClassStyle,
+	AdmissionClassScript,
+	AdmissionClassOther,
+	AdmissionClassImage
+};
+
+class CAdmissionScheduler;
+
+namespace Detail
+{
+
+enum
+{
+	cAdmissionHostBuckets = 64
+};
+
+// The requests to a host, waiting or running. Allocated in one block with
+// its name, in lower case
+struct AdmissionHost
+{
+	AdmissionHost* pNext;
+	DWORD dwHash;
+	const WCHAR* pchHost;
+	ULONG cchHost;
+	ULONG cActive;
+	// Waiting or running
+	ULONG cTickets;
+};
+
+// A request's place with the scheduler, owned by the start policy.
+// Reference counted by the policy, and by the scheduler while it asks the
+// request's sink to Switch
+class AdmissionTicket
+{
+public:
+	void AddRef();
+	void Release();
+
+	// Running, or allowed to start
+	bool IsAdmitted() const;
+	// What the scheduler passes to Switch
+	PROTOCOLDATA* GetProtocolData();
+
+private:
+	friend class ::PassthroughAPP::CAdmissionScheduler;
+
+	enum State
+	{
+		stateWaiting,
+		stateAdmitted,
+		stateLeft
+	};
+
+	AdmissionTicket();
+
+	// Not copyable
+	AdmissionTicket(const AdmissionTicket&);
+	AdmissionTicket& operator=(const AdmissionTicket&);
+
+	LONG m_lRef;
+	// The scheduler's, guarded by it
+	State m_state;
+	AdmissionHost* m_pHost;
+	LONG m_nPriority;
+	AdmissionClass m_admissionClass;
+	ULONG m_nSequence;
+	AdmissionTicket* m_pPrev;
+	AdmissionTicket* m_pNext;
+	// The sink to Switch, while waiting
+	CComPtr<IInternetProtocolSink> m_spSink;
+	PROTOCOLDATA m_protocolData;
+};
+
+// The kind of resource a URL names, going by the extension of its path.
+// A path without one is taken for a document
+AdmissionClass GetAdmissionClass(const WCHAR* pchExtension,
+	ULONG cchExtension);
+// Splits szUrl into the host, and the extension of the path without the
+// dot. Both are empty if there is none
+void ParseAdmissionUrl(LPCWSTR szUrl, ULONG* pichHost, ULONG* pcchHost,
+	ULONG* pichExtension, ULONG* pcchExtension);
+
+} // end namespace PassthroughAPP::Detail
+
+// Must outlive the requests using it. All methods can be called from any
+// thread
+class CAdmissionScheduler
+{
+public:
+	CAdmissionScheduler();
+	~CAdmissionScheduler();
+
+	// The most targets running at once, 24 by default, and the most to one
+	// host, 6 by default. 0 for no limit
+	void SetMaxActive(ULONG cMaxActive);
+	void SetMaxActivePerHost(ULONG cMaxActivePerHost);
+
+	// Returns an AddRef'ed ticket for a request to pchHost, with S_OK if
+	// its target can start now, or S_FALSE if it waits. A waiting request
+	// is started by its sink being asked to Switch with the ticket's
+	// protocol data
+	HRESULT Enter(const WCHAR* pchHost, ULONG cchHost, LONG nPriority,
+		AdmissionClass admissionClass, IInternetProtocolSink* pOIProtSink,
+		Detail::AdmissionTicket** ppTicket);
+	// Moves a waiting request to its place for nPriority
+	void SetPriority(Detail::AdmissionTicket* pTicket, LONG nPriority);
+	// The request stops waiting or running, which may let others start.
+	// Does nothing the second time
+	void Leave(Detail::AdmissionTicket* pTicket);
+
+	void GetStatistics(AdmissionSchedulerStatistics* pStats) const;
+
+private:
+	// Not copyable
+	CAdmissionScheduler(const CAdmissionScheduler&);
+	CAdmissionScheduler& operator=(const CAdmissionScheduler&);
+
+	Detail::AdmissionHost* FindHost(const WCHAR* pchHost, ULONG cchHost,
+		DWORD dwHash) const;
+	HRESULT AddHost(const WCHAR* pchHost, ULONG cchHost, DWORD dwHash,
+		Detail::AdmissionHost** ppHost);
+	void ReleaseHost(Detail::AdmissionHost* pHost);
+	static DWORD HashHost(const WCHAR* pchHost, ULONG cchHost);
+
+	bool CanStart(const Detail::AdmissionHost* pHost) const;
+	// Whether pTicket1 goes before pTicket2
+	static bool IsBefore(const Detail::AdmissionTicket* pTicket1,
+		const Detail::AdmissionTicket* pTicket2);
+	void Enqueue(Detail::AdmissionTicket* pTicket);
+	void Dequeue(Detail::AdmissionTicket* pTicket);
+	// Admits the first waiting request that can start. Returns it
+	// AddRef'ed with its sink, or 0
+	Detail::AdmissionTicket* AdmitNext(IInternetProtocolSink** ppSink);
+	// Starts waiting requests while there are free slots
+	void Dispatch();
+
+	mutable CComAutoCriticalSection m_cs;
+	ULONG m_cMaxActive;
+	ULONG m_cMaxActivePerHost;
+	ULONG m_nNextSequence;
+	// Waiting requests, in the order they start. Queues are short enough
+	// for a list
+	Detail::AdmissionTicket* m_pFirstWaiting;
+	Detail::AdmissionTicket* m_pLastWaiting;
+	Detail::AdmissionHost* m_pBuckets[Detail::cAdmissionHostBuckets];
+	AdmissionSchedulerStatistics m_stats;
+};
+
+} // end namespace PassthroughAPP
+
+#include "AdmissionScheduler.inl"
+
+#endif // PASSTHROUGHAPP_ADMISSIONSCHEDULER_H
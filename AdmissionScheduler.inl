@@ -0,0 +1,558 @@
+#ifndef PASSTHROUGHAPP_ADMISSIONSCHEDULER_INL
+#define PASSTHROUGHAPP_ADMISSIONSCHEDULER_INL
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+#ifndef PASSTHROUGHAPP_ADMISSIONSCHEDULER_H
+	#error AdmissionScheduler.inl requires AdmissionScheduler.h to be included first
+#endif
+
+namespace PassthroughAPP
+{
+
+namespace Detail
+{
+
+// ===== AdmissionTicket =====
+
+inline AdmissionTicket::AdmissionTicket() :
+	m_lRef(1), m_state(stateLeft), m_pHost(0), m_nPriority(0),
+	m_admissionClass(AdmissionClassOther), m_nSequence(0), m_pPrev(0),
+	m_pNext(0)
+{
+	memset(&m_protocolData, 0, sizeof(m_protocolData));
+	// Have the client post it to the request's thread even when the slot
+	// frees up on that thread, rather than start the target from within
+	// another request's call
+	m_protocolData.grfFlags = PI_FORCE_ASYNC;
+}
+
+inline void AdmissionTicket::AddRef()
+{
+	InterlockedIncrement(&m_lRef);
+}
+
+inline void AdmissionTicket::Release()
+{
+	if (!InterlockedDecrement(&m_lRef))
+	{
+		delete this;
+	}
+}
+
+inline bool AdmissionTicket::IsAdmitted() const
+{
+	return m_state == stateAdmitted;
+}
+
+inline PROTOCOLDATA* AdmissionTicket::GetProtocolData()
+{
+	return &m_protocolData;
+}
+
+// ===== Functions =====
+
+inline AdmissionClass GetAdmissionClass(const WCHAR* pchExtension,
+	ULONG cchExtension)
+{
+	if (cchExtension && *pchExtension == L'.')
+	{
+		++pchExtension;
+		--cchExtension;
+	}
+	if (!cchExtension)
+	{
+		return AdmissionClassDocument;
+	}
+
+	static const struct
+	{
+		LPCWSTR szExtension;
+		AdmissionClass admissionClass;
+	} extensions[] =
+	{
+		{L"htm", AdmissionClassDocument},
+		{L"html", AdmissionClassDocument},
+		{L"xhtml", AdmissionClassDocument},
+		{L"asp", AdmissionClassDocument},
+		{L"aspx", AdmissionClassDocument},
+		{L"php", AdmissionClassDocument},
+		{L"css", AdmissionClassStyle},
+		{L"js", AdmissionClassScript},
+		{L"mjs", AdmissionClassScript},
+		{L"png", AdmissionClassImage},
+		{L"gif", AdmissionClassImage},
+		{L"jpg", AdmissionClassImage},
+		{L"jpeg", AdmissionClassImage},
+		{L"webp", AdmissionClassImage},
+		{L"svg", AdmissionClassImage},
+		{L"ico", AdmissionClassImage},
+		{L"bmp", AdmissionClassImage}
+	};
+	for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); ++i)
+	{
+		LPCWSTR szExtension = extensions[i].szExtension;
+		ULONG ich = 0;
+		while (ich < cchExtension && szExtension[ich])
+		{
+			WCHAR ch = pchExtension[ich];
+			if (ch >= L'A' && ch <= L'Z')
+			{
+				ch += L'a' - L'A';
+			}
+			if (ch != szExtension[ich])
+			{
+				break;
+			}
+			++ich;
+		}
+		if (ich == cchExtension && !szExtension[ich])
+		{
+			return extensions[i].admissionClass;
+		}
+	}
+	return AdmissionClassOther;
+}
+
+inline void ParseAdmissionUrl(LPCWSTR szUrl, ULONG* pichHost,
+	ULONG* pcchHost, ULONG* pichExtension, ULONG* pcchExtension)
+{
+	ATLASSERT(szUrl != 0);
+	ATLASSERT(pichHost != 0);
+	ATLASSERT(pcchHost != 0);
+	ATLASSERT(pichExtension != 0);
+	ATLASSERT(pcchExtension != 0);
+
+	*pichHost = 0;
+	*pcchHost = 0;
+	*pichExtension = 0;
+	*pcchExtension = 0;
+
+	// The scheme ends at the first colon, before anything else delimiting
+	ULONG ich = 0;
+	while (szUrl[ich] && szUrl[ich] != L':' && szUrl[ich] != L'/' &&
+		szUrl[ich] != L'?' && szUrl[ich] != L'#')
+	{
+		++ich;
+	}
+	if (szUrl[ich] != L':' || !ich)
+	{
+		return;
+	}
+	++ich;
+
+	if (szUrl[ich] == L'/' && szUrl[ich + 1] == L'/')
+	{
+		ich += 2;
+		ULONG ichHost = ich;
+		while (szUrl[ich] && szUrl[ich] != L'/' && szUrl[ich] != L'?' &&
+			szUrl[ich] != L'#')
+		{
+			if (szUrl[ich] == L'@')
+			{
+				ichHost = ich + 1;
+			}
+			++ich;
+		}
+		ULONG ichEnd = ichHost;
+		if (szUrl[ichHost] == L'[')
+		{
+			while (ichEnd < ich && szUrl[ichEnd] != L']')
+			{
+				++ichEnd;
+			}
+			if (ichEnd < ich)
+			{
+				++ichEnd;
+			}
+		}
+		else
+		{
+			while (ichEnd < ich && szUrl[ichEnd] != L':')
+			{
+				++ichEnd;
+			}
+		}
+		*pichHost = ichHost;
+		*pcchHost = ichEnd - ichHost;
+	}
+
+	// The extension of the last segment of the path
+	ULONG ichDot = 0;
+	while (szUrl[ich] && szUrl[ich] != L'?' && szUrl[ich] != L'#')
+	{
+		if (szUrl[ich] == L'/')
+		{
+			ichDot = 0;
+		}
+		else if (szUrl[ich] == L'.')
+		{
+			ichDot = ich;
+		}
+		++ich;
+	}
+	if (ichDot)
+	{
+		*pichExtension = ichDot + 1;
+		*pcchExtension = ich - ichDot - 1;
+	}
+}
+
+} // end namespace PassthroughAPP::Detail
+
+// ===== CAdmissionScheduler =====
+
+inline CAdmissionScheduler::CAdmissionScheduler() :
+	m_cMaxActive(24), m_cMaxActivePerHost(6), m_nNextSequence(0),
+	m_pFirstWaiting(0), m_pLastWaiting(0)
+{
+	memset(m_pBuckets, 0, sizeof(m_pBuckets));
+	memset(&m_stats, 0, sizeof(m_stats));
+}
+
+inline CAdmissionScheduler::~CAdmissionScheduler()
+{
+	// Requests must not outlive the scheduler
+	ATLASSERT(m_stats.cActive == 0);
+	ATLASSERT(m_stats.cWaiting == 0);
+}
+
+inline void CAdmissionScheduler::SetMaxActive(ULONG cMaxActive)
+{
+	{
+		CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+		m_cMaxActive = cMaxActive;
+	}
+	Dispatch();
+}
+
+inline void CAdmissionScheduler::SetMaxActivePerHost(ULONG cMaxActivePerHost)
+{
+	{
+		CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+		m_cMaxActivePerHost = cMaxActivePerHost;
+	}
+	Dispatch();
+}
+
+inline HRESULT CAdmissionScheduler::Enter(const WCHAR* pchHost,
+	ULONG cchHost, LONG nPriority, AdmissionClass admissionClass,
+	IInternetProtocolSink* pOIProtSink, Detail::AdmissionTicket** ppTicket)
+{
+	ATLASSERT(pchHost != 0 || !cchHost);
+	ATLASSERT(pOIProtSink != 0);
+	ATLASSERT(ppTicket != 0);
+	if (!pOIProtSink || !ppTicket)
+	{
+		return E_POINTER;
+	}
+	*ppTicket = 0;
+
+	Detail::AdmissionTicket* pTicket = 0;
+	ATLTRY(pTicket = new Detail::AdmissionTicket)
+	if (!pTicket)
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	DWORD dwHash = HashHost(pchHost, cchHost);
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	Detail::AdmissionHost* pHost = FindHost(pchHost, cchHost, dwHash);
+	if (!pHost)
+	{
+		HRESULT hr = AddHost(pchHost, cchHost, dwHash, &pHost);
+		if (FAILED(hr))
+		{
+			lock.Unlock();
+			pTicket->Release();
+			return hr;
+		}
+	}
+	++pHost->cTickets;
+	pTicket->m_pHost = pHost;
+	pTicket->m_nPriority = nPriority;
+	pTicket->m_admissionClass = admissionClass;
+	pTicket->m_nSequence = m_nNextSequence++;
+	*ppTicket = pTicket;
+
+	if (CanStart(pHost))
+	{
+		pTicket->m_state = Detail::AdmissionTicket::stateAdmitted;
+		++pHost->cActive;
+		++m_stats.cActive;
+		++m_stats.cAdmitted;
+		return S_OK;
+	}
+	pTicket->m_state = Detail::AdmissionTicket::stateWaiting;
+	pTicket->m_spSink = pOIProtSink;
+	Enqueue(pTicket);
+	++m_stats.cWaiting;
+	++m_stats.cQueued;
+	return S_FALSE;
+}
+
+inline void CAdmissionScheduler::SetPriority(Detail::AdmissionTicket* pTicket,
+	LONG nPriority)
+{
+	ATLASSERT(pTicket != 0);
+
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	LONG nOldPriority = pTicket->m_nPriority;
+	pTicket->m_nPriority = nPriority;
+	if (pTicket->m_state != Detail::AdmissionTicket::stateWaiting ||
+		nPriority == nOldPriority)
+	{
+		return;
+	}
+	Detail::AdmissionTicket* pPrev = pTicket->m_pPrev;
+	Dequeue(pTicket);
+	Enqueue(pTicket);
+	if (pTicket->m_pPrev != pPrev && nPriority > nOldPriority)
+	{
+		++m_stats.cPromoted;
+	}
+}
+
+inline void CAdmissionScheduler::Leave(Detail::AdmissionTicket* pTicket)
+{
+	ATLASSERT(pTicket != 0);
+
+	{
+		CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+		switch (pTicket->m_state)
+		{
+		case Detail::AdmissionTicket::stateWaiting:
+			Dequeue(pTicket);
+			--m_stats.cWaiting;
+			break;
+		case Detail::AdmissionTicket::stateAdmitted:
+			--pTicket->m_pHost->cActive;
+			--m_stats.cActive;
+			break;
+		case Detail::AdmissionTicket::stateLeft:
+			return;
+		}
+		pTicket->m_state = Detail::AdmissionTicket::stateLeft;
+		pTicket->m_spSink.Release();
+		ReleaseHost(pTicket->m_pHost);
+		pTicket->m_pHost = 0;
+	}
+	Dispatch();
+}
+
+inline void CAdmissionScheduler::GetStatistics(
+	AdmissionSchedulerStatistics* pStats) const
+{
+	ATLASSERT(pStats != 0);
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	*pStats = m_stats;
+}
+
+inline Detail::AdmissionHost* CAdmissionScheduler::FindHost(
+	const WCHAR* pchHost, ULONG cchHost, DWORD dwHash) const
+{
+	for (Detail::AdmissionHost* pHost =
+			m_pBuckets[dwHash % Detail::cAdmissionHostBuckets];
+		pHost; pHost = pHost->pNext)
+	{
+		if (pHost->dwHash != dwHash || pHost->cchHost != cchHost)
+		{
+			continue;
+		}
+		ULONG ich = 0;
+		while (ich < cchHost)
+		{
+			WCHAR ch = pchHost[ich];
+			if (ch >= L'A' && ch <= L'Z')
+			{
+				ch += L'a' - L'A';
+			}
+			if (ch != pHost->pchHost[ich])
+			{
+				break;
+			}
+			++ich;
+		}
+		if (ich == cchHost)
+		{
+			return pHost;
+		}
+	}
+	return 0;
+}
+
+inline HRESULT CAdmissionScheduler::AddHost(const WCHAR* pchHost,
+	ULONG cchHost, DWORD dwHash, Detail::AdmissionHost** ppHost)
+{
+	BYTE* pb = 0;
+	ATLTRY(pb = new BYTE[sizeof(Detail::AdmissionHost) +
+		static_cast<SIZE_T>(cchHost) * sizeof(WCHAR)])
+	if (!pb)
+	{
+		return E_OUTOFMEMORY;
+	}
+	Detail::AdmissionHost* pHost =
+		reinterpret_cast<Detail::AdmissionHost*>(pb);
+	WCHAR* pch = reinterpret_cast<WCHAR*>(pHost + 1);
+	for (ULONG ich = 0; ich < cchHost; ++ich)
+	{
+		WCHAR ch = pchHost[ich];
+		if (ch >= L'A' && ch <= L'Z')
+		{
+			ch += L'a' - L'A';
+		}
+		pch[ich] = ch;
+	}
+	Detail::AdmissionHost** ppBucket =
+		&m_pBuckets[dwHash % Detail::cAdmissionHostBuckets];
+	pHost->pNext = *ppBucket;
+	pHost->dwHash = dwHash;
+	pHost->pchHost = pch;
+	pHost->cchHost = cchHost;
+	pHost->cActive = 0;
+	pHost->cTickets = 0;
+	*ppBucket = pHost;
+	*ppHost = pHost;
+	return S_OK;
+}
+
+inline void CAdmissionScheduler::ReleaseHost(Detail::AdmissionHost* pHost)
+{
+	ATLASSERT(pHost != 0 && pHost->cTickets > 0);
+	if (--pHost->cTickets)
+	{
+		return;
+	}
+	Detail::AdmissionHost** ppHost =
+		&m_pBuckets[pHost->dwHash % Detail::cAdmissionHostBuckets];
+	while (*ppHost != pHost)
+	{
+		ppHost = &(*ppHost)->pNext;
+	}
+	*ppHost = pHost->pNext;
+	delete[] reinterpret_cast<BYTE*>(pHost);
+}
+
+inline DWORD CAdmissionScheduler::HashHost(const WCHAR* pchHost,
+	ULONG cchHost)
+{
+	// FNV-1a over the host folded to lower case
+	DWORD dwHash = 2166136261U;
+	for (ULONG ich = 0; ich < cchHost; ++ich)
+	{
+		WCHAR ch = pchHost[ich];
+		if (ch >= L'A' && ch <= L'Z')
+		{
+			ch += L'a' - L'A';
+		}
+		dwHash = (dwHash ^ static_cast<DWORD>(ch)) * 16777619U;
+	}
+	return dwHash;
+}
+
+inline bool CAdmissionScheduler::CanStart(
+	const Detail::AdmissionHost* pHost) const
+{
+	return (!m_cMaxActive ||
+			static_cast<ULONG>(m_stats.cActive) < m_cMaxActive) &&
+		(!m_cMaxActivePerHost || pHost->cActive < m_cMaxActivePerHost);
+}
+
+inline bool CAdmissionScheduler::IsBefore(
+	const Detail::AdmissionTicket* pTicket1,
+	const Detail::AdmissionTicket* pTicket2)
+{
+	if (pTicket1->m_nPriority != pTicket2->m_nPriority)
+	{
+		return pTicket1->m_nPriority > pTicket2->m_nPriority;
+	}
+	if (pTicket1->m_admissionClass != pTicket2->m_admissionClass)
+	{
+		return pTicket1->m_admissionClass < pTicket2->m_admissionClass;
+	}
+	// Sequence numbers may wrap around
+	return static_cast<LONG>(pTicket1->m_nSequence -
+		pTicket2->m_nSequence) < 0;
+}
+
+inline void CAdmissionScheduler::Enqueue(Detail::AdmissionTicket* pTicket)
+{
+	// Most requests go last, so look from the end
+	Detail::AdmissionTicket* pPrev = m_pLastWaiting;
+	while (pPrev && IsBefore(pTicket, pPrev))
+	{
+		pPrev = pPrev->m_pPrev;
+	}
+	Detail::AdmissionTicket* pNext = pPrev ? pPrev->m_pNext : m_pFirstWaiting;
+	pTicket->m_pPrev = pPrev;
+	pTicket->m_pNext = pNext;
+	(pPrev ? pPrev->m_pNext : m_pFirstWaiting) = pTicket;
+	(pNext ? pNext->m_pPrev : m_pLastWaiting) = pTicket;
+}
+
+inline void CAdmissionScheduler::Dequeue(Detail::AdmissionTicket* pTicket)
+{
+	(pTicket->m_pPrev ? pTicket->m_pPrev->m_pNext : m_pFirstWaiting) =
+		pTicket->m_pNext;
+	(pTicket->m_pNext ? pTicket->m_pNext->m_pPrev : m_pLastWaiting) =
+		pTicket->m_pPrev;
+	pTicket->m_pPrev = 0;
+	pTicket->m_pNext = 0;
+}
+
+inline Detail::AdmissionTicket* CAdmissionScheduler::AdmitNext(
+	IInternetProtocolSink** ppSink)
+{
+	ATLASSERT(ppSink != 0);
+
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	if (m_cMaxActive && static_cast<ULONG>(m_stats.cActive) >= m_cMaxActive)
+	{
+		return 0;
+	}
+	for (Detail::AdmissionTicket* pTicket = m_pFirstWaiting; pTicket;
+		pTicket = pTicket->m_pNext)
+	{
+		if (!CanStart(pTicket->m_pHost))
+		{
+			continue;
+		}
+		Dequeue(pTicket);
+		pTicket->m_state = Detail::AdmissionTicket::stateAdmitted;
+		++pTicket->m_pHost->cActive;
+		++m_stats.cActive;
+		--m_stats.cWaiting;
+		*ppSink = pTicket->m_spSink.Detach();
+		pTicket->AddRef();
+		return pTicket;
+	}
+	return 0;
+}
+
+inline void CAdmissionScheduler::Dispatch()
+{
+	for (;;)
+	{
+		CComPtr<IInternetProtocolSink> spSink;
+		Detail::AdmissionTicket* pTicket = AdmitNext(&spSink);
+		if (!pTicket)
+		{
+			break;
+		}
+		// The request's Continue starts its target. If the request is
+		// terminated first, it gives the slot back when it leaves
+		HRESULT hr = spSink->Switch(pTicket->GetProtocolData());
+		if (FAILED(hr))
+		{
+			Leave(pTicket);
+			spSink->ReportResult(hr, 0, 0);
+		}
+		pTicket->Release();
+	}
+}
+
+} // end namespace PassthroughAPP
+
+#endif // PASSTHROUGHAPP_ADMISSIONSCHEDULER_INL
@@ -0,0 +1,135 @@
+#ifndef PASSTHROUGHAPP_BODYFILTER_H
+#define PASSTHROUGHAPP_BODYFILTER_H
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+// Filters that see, and possibly rewrite, response bodies as the client
+// reads them. See BodyFilterStartPolicy in SinkPolicy.h.
+//
+// A CBodyFilterChain runs the filters of one request in the order they
+// were added. Data is pulled through it by Read, one chunk at a time, so
+// no filter ever holds the whole body unless it chooses to. Between two
+// filters that modify the body sits a buffer of fixed size; the last one
+// writes straight into the client's buffer. Filters that only inspect the
+// body get no buffer of their own: they are shown the data wherever it
+// lies, so a chain of inspectors only passes the client's buffer along.
+
+#include <vector>
+
+namespace PassthroughAPP
+{
+
+class CBodyFilter
+{
+public:
+	virtual ~CBodyFilter();
+
+	// Return true if the filter only looks at the body. Such a filter is
+	// shown the data in place through Inspect, and Process is never called
+	virtual bool IsInspectOnly() const;
+
+	// Shown every chunk passing by, and called once more with bEnd set and
+	// no data after the last one. An error fails the request
+	virtual HRESULT Inspect(const BYTE* pb, ULONG cb, bool bEnd);
+
+	// Consumes up to cbIn bytes from pbIn and writes up to cbOut bytes to
+	// pbOut, returning how much of each it used. Once bEnd is set, pbIn
+	// holds the last of the input, and the filter writes out whatever it
+	// kept back, returning S_FALSE when it is done. Input the filter can't
+	// use yet is offered again with more data behind it, so a filter must
+	// make progress once the buffer before it is full. An error fails the
+	// request. Copies by default
+	virtual HRESULT Process(const BYTE* pbIn, ULONG cbIn, ULONG* pcbUsed,
+		BYTE* pbOut, ULONG cbOut, ULONG* pcbWritten, bool bEnd);
+};
+
+namespace Detail
+{
+
+// A filter that modifies the body, followed by the inspectors that see its
+// output. The first stage stands for the target and has no filter
+struct BodyFilterStage
+{
+	CBodyFilter* pFilter;
+	size_t iFirstInspector;
+	size_t cInspectors;
+	// The stage's output not yet used by the next one, from ibStart to
+	// ibEnd. Unused by the last stage
+	BYTE* pbBuffer;
+	ULONG ibStart;
+	ULONG ibEnd;
+	bool bEnded;
+};
+
+} // end namespace PassthroughAPP::Detail
+
+class CBodyFilterChain
+{
+public:
+	CBodyFilterChain();
+	~CBodyFilterChain();
+
+	// Takes ownership of pFilter, even if it fails. Only before the first
+	// Read
+	HRESULT Add(CBodyFilter* pFilter);
+	bool IsEmpty() const;
+	// Whether some filter may change the length of the body
+	bool IsModifying() const;
+
+	// The size of the buffer between two modifying filters, 16 KB by
+	// default. Only before the first Read
+	void SetBufferSize(ULONG cbBuffer);
+
+	// Reads the filtered body, pulling data from source.Read, which has
+	// the signature of IInternetProtocol::Read. Returns what the source
+	// does, or what a filter fails with
+	template <class Source>
+	HRESULT Read(Source& source, void* pv, ULONG cb, ULONG* pcbRead);
+
+	// Maps the progress reported by the target to the filtered body: bytes
+	// the filters are done with count at the length the filters gave them,
+	// the rest, including what waits in the buffers, at their own. Never
+	// goes backwards. Expected on the thread calling Read
+	void MapProgress(ULONG* pulProgress, ULONG* pulProgressMax);
+
+	// Bytes read from the source, and returned to the client
+	ULONGLONG GetBytesIn() const;
+	ULONGLONG GetBytesOut() const;
+
+private:
+	// Not copyable
+	CBodyFilterChain(const CBodyFilterChain&);
+	CBodyFilterChain& operator=(const CBodyFilterChain&);
+
+	HRESULT Prepare();
+	// Fills pbOut with the output of the stage iStage. Returns S_FALSE once
+	// the stage has nothing more to give, and E_PENDING if it has nothing
+	// yet
+	template <class Source>
+	HRESULT Fill(Source& source, size_t iStage, BYTE* pbOut, ULONG cbOut,
+		ULONG* pcbWritten);
+	// Tops up the buffer of the stage iStage
+	template <class Source>
+	HRESULT Refill(Source& source, size_t iStage);
+	HRESULT Inspect(size_t iStage, const BYTE* pb, ULONG cb, bool bEnd);
+	static ULONG Clamp(ULONGLONG ul);
+
+	std::vector<CBodyFilter*> m_filters;
+	std::vector<Detail::BodyFilterStage> m_stages;
+	ULONG m_cbBuffer;
+	bool m_bPrepared;
+	bool m_bModifying;
+	// Once set, every Read returns it
+	HRESULT m_hrFailure;
+	ULONGLONG m_cbIn;
+	ULONGLONG m_cbOut;
+	ULONG m_ulLastProgress;
+};
+
+} // end namespace PassthroughAPP
+
+#include "BodyFilter.inl"
+
+#endif // PASSTHROUGHAPP_BODYFILTER_H
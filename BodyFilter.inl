@@ -0,0 +1,411 @@
+#ifndef PASSTHROUGHAPP_BODYFILTER_INL
+#define PASSTHROUGHAPP_BODYFILTER_INL
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+#ifndef PASSTHROUGHAPP_BODYFILTER_H
+	#error BodyFilter.inl requires BodyFilter.h to be included first
+#endif
+
+namespace PassthroughAPP
+{
+
+// ===== CBodyFilter =====
+
+inline CBodyFilter::~CBodyFilter()
+{
+}
+
+inline bool CBodyFilter::IsInspectOnly() const
+{
+	return false;
+}
+
+inline HRESULT CBodyFilter::Inspect(const BYTE* pb, ULONG cb, bool bEnd)
+{
+	return S_OK;
+}
+
+inline HRESULT CBodyFilter::Process(const BYTE* pbIn, ULONG cbIn,
+	ULONG* pcbUsed, BYTE* pbOut, ULONG cbOut, ULONG* pcbWritten, bool bEnd)
+{
+	ATLASSERT(pcbUsed != 0 && pcbWritten != 0);
+	ULONG cbCopy = (cbIn < cbOut) ? cbIn : cbOut;
+	if (cbCopy)
+	{
+		memcpy(pbOut, pbIn, cbCopy);
+	}
+	*pcbUsed = cbCopy;
+	*pcbWritten = cbCopy;
+	return (bEnd && cbCopy == cbIn) ? S_FALSE : S_OK;
+}
+
+// ===== CBodyFilterChain =====
+
+inline CBodyFilterChain::CBodyFilterChain() :
+	m_cbBuffer(16384), m_bPrepared(false), m_bModifying(false),
+	m_hrFailure(S_OK), m_cbIn(0), m_cbOut(0), m_ulLastProgress(0)
+{
+}
+
+inline CBodyFilterChain::~CBodyFilterChain()
+{
+	for (size_t i = 0; i < m_stages.size(); ++i)
+	{
+		delete[] m_stages[i].pbBuffer;
+	}
+	for (size_t i = 0; i < m_filters.size(); ++i)
+	{
+		delete m_filters[i];
+	}
+}
+
+inline HRESULT CBodyFilterChain::Add(CBodyFilter* pFilter)
+{
+	ATLASSERT(pFilter != 0);
+	if (!pFilter)
+	{
+		return E_POINTER;
+	}
+	ATLASSERT(!m_bPrepared);
+	if (m_bPrepared)
+	{
+		delete pFilter;
+		return E_UNEXPECTED;
+	}
+
+	size_t cFilters = m_filters.size();
+	ATLTRY(m_filters.push_back(pFilter))
+	if (m_filters.size() == cFilters)
+	{
+		delete pFilter;
+		return E_OUTOFMEMORY;
+	}
+	m_bModifying = m_bModifying || !pFilter->IsInspectOnly();
+	return S_OK;
+}
+
+inline bool CBodyFilterChain::IsEmpty() const
+{
+	return m_filters.empty();
+}
+
+inline bool CBodyFilterChain::IsModifying() const
+{
+	return m_bModifying;
+}
+
+inline void CBodyFilterChain::SetBufferSize(ULONG cbBuffer)
+{
+	ATLASSERT(!m_bPrepared);
+	ATLASSERT(cbBuffer != 0);
+	if (!m_bPrepared && cbBuffer)
+	{
+		m_cbBuffer = cbBuffer;
+	}
+}
+
+template <class Source>
+inline HRESULT CBodyFilterChain::Read(Source& source, void* pv, ULONG cb,
+	ULONG* pcbRead)
+{
+	if (pcbRead)
+	{
+		*pcbRead = 0;
+	}
+	if (!m_bPrepared)
+	{
+		m_hrFailure = Prepare();
+	}
+	if (FAILED(m_hrFailure))
+	{
+		return m_hrFailure;
+	}
+
+	ULONG cbRead = 0;
+	HRESULT hr = Fill(source, m_stages.size() - 1, static_cast<BYTE*>(pv),
+		cb, &cbRead);
+	m_cbOut += cbRead;
+	if (pcbRead)
+	{
+		*pcbRead = cbRead;
+	}
+	return hr;
+}
+
+inline void CBodyFilterChain::MapProgress(ULONG* pulProgress,
+	ULONG* pulProgressMax)
+{
+	ATLASSERT(pulProgress != 0 && pulProgressMax != 0);
+	if (!m_bModifying)
+	{
+		return;
+	}
+
+	// Data waiting in the buffers counts as not read yet
+	ULONGLONG cbIn = m_cbIn;
+	for (size_t i = 0; i < m_stages.size(); ++i)
+	{
+		cbIn -= m_stages[i].ibEnd - m_stages[i].ibStart;
+	}
+
+	ULONGLONG ullProgress = (*pulProgress > cbIn) ?
+		m_cbOut + (*pulProgress - cbIn) : m_cbOut;
+	if (ullProgress < m_ulLastProgress)
+	{
+		ullProgress = m_ulLastProgress;
+	}
+	*pulProgress = Clamp(ullProgress);
+	m_ulLastProgress = *pulProgress;
+
+	// 0 stands for an unknown length
+	if (*pulProgressMax)
+	{
+		ULONGLONG ullProgressMax = (*pulProgressMax > cbIn) ?
+			m_cbOut + (*pulProgressMax - cbIn) : m_cbOut;
+		if (ullProgressMax < ullProgress)
+		{
+			ullProgressMax = ullProgress;
+		}
+		*pulProgressMax = Clamp(ullProgressMax);
+	}
+}
+
+inline ULONGLONG CBodyFilterChain::GetBytesIn() const
+{
+	return m_cbIn;
+}
+
+inline ULONGLONG CBodyFilterChain::GetBytesOut() const
+{
+	return m_cbOut;
+}
+
+inline HRESULT CBodyFilterChain::Prepare()
+{
+	ATLASSERT(!m_bPrepared);
+	m_bPrepared = true;
+
+	Detail::BodyFilterStage stage = {0, 0, 0, 0, 0, 0, false};
+	ATLTRY(m_stages.push_back(stage))
+	for (size_t i = 0; i < m_filters.size() && !m_stages.empty(); ++i)
+	{
+		if (m_filters[i]->IsInspectOnly())
+		{
+			++m_stages.back().cInspectors;
+			continue;
+		}
+		stage.pFilter = m_filters[i];
+		stage.iFirstInspector = i + 1;
+		size_t cStages = m_stages.size();
+		ATLTRY(m_stages.push_back(stage))
+		if (m_stages.size() == cStages)
+		{
+			m_stages.clear();
+		}
+	}
+	if (m_stages.empty())
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	// The last stage writes to the client's buffer
+	for (size_t i = 0; i + 1 < m_stages.size(); ++i)
+	{
+		ATLTRY(m_stages[i].pbBuffer = new BYTE[m_cbBuffer])
+		if (!m_stages[i].pbBuffer)
+		{
+			return E_OUTOFMEMORY;
+		}
+	}
+	return S_OK;
+}
+
+template <class Source>
+inline HRESULT CBodyFilterChain::Fill(Source& source, size_t iStage,
+	BYTE* pbOut, ULONG cbOut, ULONG* pcbWritten)
+{
+	ATLASSERT(pcbWritten != 0);
+	*pcbWritten = 0;
+	Detail::BodyFilterStage& stage = m_stages[iStage];
+	if (stage.bEnded)
+	{
+		return S_FALSE;
+	}
+
+	HRESULT hr = S_OK;
+	ULONG cbWritten = 0;
+	if (!stage.pFilter)
+	{
+		// Straight from the target. Without modifying filters, pbOut is
+		// the client's buffer
+		hr = source.Read(pbOut, cbOut, &cbWritten);
+		if (FAILED(hr) && hr != E_PENDING)
+		{
+			return hr;
+		}
+		ATLASSERT(cbWritten <= cbOut);
+		m_cbIn += cbWritten;
+		bool bEnd = hr == S_FALSE;
+		HRESULT hrInspect = Inspect(iStage, pbOut, cbWritten, bEnd);
+		if (FAILED(hrInspect))
+		{
+			return hrInspect;
+		}
+		stage.bEnded = bEnd;
+		*pcbWritten = cbWritten;
+		return hr;
+	}
+
+	Detail::BodyFilterStage& input = m_stages[iStage - 1];
+	bool bPending = false;
+	while (cbWritten < cbOut)
+	{
+		if (input.ibStart == input.ibEnd && !input.bEnded)
+		{
+			hr = Refill(source, iStage - 1);
+			if (FAILED(hr) && hr != E_PENDING)
+			{
+				break;
+			}
+			if (input.ibStart == input.ibEnd && !input.bEnded)
+			{
+				bPending = true;
+				break;
+			}
+		}
+
+		ULONG cbAvailable = input.ibEnd - input.ibStart;
+		ULONG cbUsed = 0;
+		ULONG cbProduced = 0;
+		hr = stage.pFilter->Process(input.pbBuffer + input.ibStart,
+			cbAvailable, &cbUsed, pbOut + cbWritten, cbOut - cbWritten,
+			&cbProduced, input.bEnded);
+		if (FAILED(hr))
+		{
+			break;
+		}
+		ATLASSERT(cbUsed <= cbAvailable && cbProduced <= cbOut - cbWritten);
+		input.ibStart += cbUsed;
+		HRESULT hrInspect = Inspect(iStage, pbOut + cbWritten, cbProduced,
+			false);
+		cbWritten += cbProduced;
+		if (FAILED(hrInspect))
+		{
+			hr = hrInspect;
+			break;
+		}
+
+		if (hr == S_FALSE && input.bEnded && input.ibStart == input.ibEnd)
+		{
+			hr = Inspect(iStage, 0, 0, true);
+			if (FAILED(hr))
+			{
+				break;
+			}
+			stage.bEnded = true;
+			break;
+		}
+		if (cbUsed || cbProduced)
+		{
+			continue;
+		}
+		if (cbWritten)
+		{
+			// What is left of pbOut may be too small for the filter's next
+			// output, so hand out what it produced
+			break;
+		}
+
+		// The filter wants more input before it can go on
+		if (input.bEnded || (!input.ibStart && input.ibEnd == m_cbBuffer))
+		{
+			ATLASSERT(!"Body filter makes no progress");
+			hr = E_UNEXPECTED;
+			break;
+		}
+		ULONG cbBefore = input.ibEnd - input.ibStart;
+		hr = Refill(source, iStage - 1);
+		if (FAILED(hr) && hr != E_PENDING)
+		{
+			break;
+		}
+		if (input.ibEnd - input.ibStart == cbBefore && !input.bEnded)
+		{
+			bPending = true;
+			break;
+		}
+	}
+
+	*pcbWritten = cbWritten;
+	if (FAILED(hr) && hr != E_PENDING)
+	{
+		// Hand out what was produced first
+		m_hrFailure = hr;
+		return cbWritten ? S_OK : hr;
+	}
+	if (stage.bEnded)
+	{
+		return S_FALSE;
+	}
+	return (bPending && !cbWritten) ? E_PENDING : S_OK;
+}
+
+template <class Source>
+inline HRESULT CBodyFilterChain::Refill(Source& source, size_t iStage)
+{
+	Detail::BodyFilterStage& stage = m_stages[iStage];
+	ATLASSERT(stage.pbBuffer != 0);
+	if (stage.ibStart)
+	{
+		memmove(stage.pbBuffer, stage.pbBuffer + stage.ibStart,
+			stage.ibEnd - stage.ibStart);
+		stage.ibEnd -= stage.ibStart;
+		stage.ibStart = 0;
+	}
+	if (stage.ibEnd == m_cbBuffer)
+	{
+		return S_OK;
+	}
+
+	ULONG cbWritten = 0;
+	HRESULT hr = Fill(source, iStage, stage.pbBuffer + stage.ibEnd,
+		m_cbBuffer - stage.ibEnd, &cbWritten);
+	stage.ibEnd += cbWritten;
+	return hr;
+}
+
+inline HRESULT CBodyFilterChain::Inspect(size_t iStage, const BYTE* pb,
+	ULONG cb, bool bEnd)
+{
+	const Detail::BodyFilterStage& stage = m_stages[iStage];
+	for (size_t i = 0; i < stage.cInspectors; ++i)
+	{
+		CBodyFilter* pFilter = m_filters[stage.iFirstInspector + i];
+		HRESULT hr = S_OK;
+		if (cb)
+		{
+			hr = pFilter->Inspect(pb, cb, false);
+		}
+		if (SUCCEEDED(hr) && bEnd)
+		{
+			hr = pFilter->Inspect(0, 0, true);
+		}
+		if (FAILED(hr))
+		{
+			return hr;
+		}
+	}
+	return S_OK;
+}
+
+inline ULONG CBodyFilterChain::Clamp(ULONGLONG ul)
+{
+	return (ul > 0xFFFFFFFF) ? 0xFFFFFFFF : static_cast<ULONG>(ul);
+}
+
+} // end namespace PassthroughAPP
+
+#endif // PASSTHROUGHAPP_BODYFILTER_INL
@@ -0,0 +1,166 @@
+#ifndef PASSTHROUGHAPP_BODYSCANNER_H
+#define PASSTHROUGHAPP_BODYSCANNER_H
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+// Multi-pattern search over response bodies, for body filters (see
+// BodyFilter.h) that look for many strings at once in HTML or script.
+//
+// A CBodyPatternSet holds up to a few hundred byte strings, optionally
+// compared ignoring ASCII case. It is compiled once and can then be shared
+// by any number of threads. A CBodyScanner runs a set over a body chunk
+// by chunk, as a filter sees it, and reports every occurrence of every
+// pattern, including occurrences that straddle two or more chunks, each
+// with its offset from the start of the body.
+//
+// Patterns are spread over 8 buckets. The scanner looks at three adjacent
+// bytes per position and only compares the patterns of the buckets whose
+// first three bytes could start there, as told by the buckets of each byte
+// value. Built with AVX2 (/arch:AVX2, -mavx2) or SSSE3 (/arch:AVX,
+// -mssse3), 32 or 16 positions are checked at a time by looking up the
+// buckets of each half byte with a shuffle; otherwise, and with
+// PASSTHROUGHAPP_NO_SIMD defined, one at a time from tables of 256
+// entries. Both find the same matches.
+
+#include <algorithm>
+#include <vector>
+
+#if !defined(PASSTHROUGHAPP_NO_SIMD)
+	#if defined(__AVX2__)
+		#define PASSTHROUGHAPP_BODYSCANNER_AVX2
+		#include <immintrin.h>
+	#elif defined(__SSSE3__) || defined(__AVX__)
+		#define PASSTHROUGHAPP_BODYSCANNER_SSSE3
+		#include <tmmintrin.h>
+	#endif
+#endif
+
+namespace PassthroughAPP
+{
+
+namespace Detail
+{
+
+enum
+{
+	cBodyPatternBuckets = 8,
+	// Bytes at the start of each pattern that select candidates
+	cbBodyPatternPrefix = 3
+};
+
+struct BodyPattern
+{
+	// Into the set's pattern bytes, folded to lower case if the set
+	// ignores case
+	ULONG ib;
+	ULONG cb;
+	ULONG iPattern;
+};
+
+} // end namespace PassthroughAPP::Detail
+
+class CBodyPatternSet
+{
+public:
+	explicit CBodyPatternSet(bool bIgnoreCase = false);
+
+	// Patterns are numbered from 0 in the order they are added, and must
+	// be at least one byte long. Only before Compile
+	HRESULT Add(const BYTE* pb, ULONG cb);
+	HRESULT Add(LPCSTR sz);
+
+	// Prepares the set for scanning. Nothing can be added afterwards
+	HRESULT Compile();
+	bool IsCompiled() const;
+
+	ULONG GetCount() const;
+	// The length of the longest pattern
+	ULONG GetMaxLength() const;
+
+	// Reports the matches within pb[0..cb) as handler.OnMatch(iPattern,
+	// ibBase + offset of the match), in the order they start. Returns
+	// false if the handler did, to stop. See CBodyScanner for bodies that
+	// come in chunks
+	template <class Handler>
+	bool Find(const BYTE* pb, ULONG cb, ULONGLONG ibBase,
+		Handler& handler) const;
+
+private:
+	friend class CBodyScanner;
+
+	// Not copyable
+	CBodyPatternSet(const CBodyPatternSet&);
+	CBodyPatternSet& operator=(const CBodyPatternSet&);
+
+	static BYTE Fold(BYTE b);
+	// Reports the matches within pb[0..cb) starting before ibEndStart and
+	// ending after ibMinEnd, checking one position at a time
+	template <class Handler>
+	bool FindRange(const BYTE* pb, ULONG cb, ULONG ibStart, ULONG ibEndStart,
+		ULONG ibMinEnd, ULONGLONG ibBase, Handler& handler) const;
+	// Compares the patterns of the buckets in bBuckets against pb[ib..cb)
+	template <class Handler>
+	bool Verify(const BYTE* pb, ULONG cb, ULONG ib, BYTE bBuckets,
+		ULONG ibMinEnd, ULONGLONG ibBase, Handler& handler) const;
+
+	bool m_bIgnoreCase;
+	bool m_bCompiled;
+	std::vector<BYTE> m_bytes;
+	// Sorted by bucket once compiled
+	std::vector<Detail::BodyPattern> m_patterns;
+	ULONG m_cbMax;
+	// Patterns of bucket k are m_patterns[m_iBucket[k]..m_iBucket[k + 1])
+	ULONG m_iBucket[Detail::cBodyPatternBuckets + 1];
+	// The buckets a pattern may be in, given its byte at each offset of
+	// the prefix, or that it ends before that offset
+	BYTE m_bBuckets[Detail::cbBodyPatternPrefix][256];
+	BYTE m_bShort[Detail::cbBodyPatternPrefix];
+	// The same by half byte, ANDed together, for the shuffles
+	BYTE m_bLow[Detail::cbBodyPatternPrefix][16];
+	BYTE m_bHigh[Detail::cbBodyPatternPrefix][16];
+};
+
+// Scans one body. Not thread safe; use one per request
+class CBodyScanner
+{
+public:
+	CBodyScanner();
+	~CBodyScanner();
+
+	// pSet must be compiled, and outlive the scanner
+	HRESULT Init(const CBodyPatternSet* pSet);
+	// Starts over with a new body
+	void Reset();
+
+	// Scans the next chunk of the body. Matches are reported as
+	// handler.OnMatch(ULONG iPattern, ULONGLONG ibMatch), with ibMatch the
+	// offset of the match from the start of the body, once their last byte
+	// was scanned. The handler returns false to stop, which makes Scan
+	// return S_FALSE; the rest of the chunk is skipped
+	template <class Handler>
+	HRESULT Scan(const BYTE* pb, ULONG cb, Handler& handler);
+
+	// Bytes scanned since Init or Reset
+	ULONGLONG GetOffset() const;
+
+private:
+	// Not copyable
+	CBodyScanner(const CBodyScanner&);
+	CBodyScanner& operator=(const CBodyScanner&);
+
+	const CBodyPatternSet* m_pSet;
+	// The last bytes scanned, which matches ending in the next chunk may
+	// start with, followed by room for as many of the next chunk
+	BYTE* m_pbCarry;
+	ULONG m_cbCarry;
+	ULONG m_cbCarryMax;
+	ULONGLONG m_ibOffset;
+};
+
+} // end namespace PassthroughAPP
+
+#include "BodyScanner.inl"
+
+#endif // PASSTHROUGHAPP_BODYSCANNER_H
@@ -0,0 +1,525 @@
+#ifndef PASSTHROUGHAPP_BODYSCANNER_INL
+#define PASSTHROUGHAPP_BODYSCANNER_INL
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+#ifndef PASSTHROUGHAPP_BODYSCANNER_H
+	#error BodyScanner.inl requires BodyScanner.h to be included first
+#endif
+
+namespace PassthroughAPP
+{
+
+namespace Detail
+{
+
+#if defined(PASSTHROUGHAPP_BODYSCANNER_AVX2)
+
+typedef __m256i BodyScanVector;
+const ULONG cbBodyScanVector = 32;
+
+inline BodyScanVector LoadBodyScanVector(const BYTE* pb)
+{
+	return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pb));
+}
+
+// A table of 16 bytes in each lane
+inline BodyScanVector LoadBodyScanTable(const BYTE* pb)
+{
+	return _mm256_broadcastsi128_si256(_mm_loadu_si128(
+		reinterpret_cast<const __m128i*>(pb)));
+}
+
+// The buckets of each byte of v, as far as its half bytes tell
+inline BodyScanVector LookupBodyScanBuckets(BodyScanVector v,
+	BodyScanVector low, BodyScanVector high)
+{
+	const __m256i nibble = _mm256_set1_epi8(0x0F);
+	return _mm256_and_si256(
+		_mm256_shuffle_epi8(low, _mm256_and_si256(v, nibble)),
+		_mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi16(v, 4),
+			nibble)));
+}
+
+inline BodyScanVector AndBodyScanVectors(BodyScanVector v1,
+	BodyScanVector v2)
+{
+	return _mm256_and_si256(v1, v2);
+}
+
+// A bit for each byte of v that isn't 0
+inline DWORD GetBodyScanCandidates(BodyScanVector v)
+{
+	return ~static_cast<DWORD>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v,
+		_mm256_setzero_si256())));
+}
+
+#elif defined(PASSTHROUGHAPP_BODYSCANNER_SSSE3)
+
+typedef __m128i BodyScanVector;
+const ULONG cbBodyScanVector = 16;
+
+inline BodyScanVector LoadBodyScanVector(const BYTE* pb)
+{
+	return _mm_loadu_si128(reinterpret_cast<const __m128i*>(pb));
+}
+
+inline BodyScanVector LoadBodyScanTable(const BYTE* pb)
+{
+	return _mm_loadu_si128(reinterpret_cast<const __m128i*>(pb));
+}
+
+inline BodyScanVector LookupBodyScanBuckets(BodyScanVector v,
+	BodyScanVector low, BodyScanVector high)
+{
+	const __m128i nibble = _mm_set1_epi8(0x0F);
+	return _mm_and_si128(
+		_mm_shuffle_epi8(low, _mm_and_si128(v, nibble)),
+		_mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+}
+
+inline BodyScanVector AndBodyScanVectors(BodyScanVector v1,
+	BodyScanVector v2)
+{
+	return _mm_and_si128(v1, v2);
+}
+
+inline DWORD GetBodyScanCandidates(BodyScanVector v)
+{
+	return ~static_cast<DWORD>(_mm_movemask_epi8(_mm_cmpeq_epi8(v,
+		_mm_setzero_si128()))) & 0xFFFF;
+}
+
+#endif
+
+#if defined(PASSTHROUGHAPP_BODYSCANNER_AVX2) || \
+	defined(PASSTHROUGHAPP_BODYSCANNER_SSSE3)
+
+inline ULONG LowestBodyScanBit(DWORD dwMask)
+{
+	ATLASSERT(dwMask != 0);
+#ifdef _MSC_VER
+	unsigned long iBit;
+	_BitScanForward(&iBit, dwMask);
+	return iBit;
+#else
+	return __builtin_ctz(dwMask);
+#endif
+}
+
+#endif
+
+} // end namespace PassthroughAPP::Detail
+
+// ===== CBodyPatternSet =====
+
+inline CBodyPatternSet::CBodyPatternSet(bool bIgnoreCase) :
+	m_bIgnoreCase(bIgnoreCase), m_bCompiled(false), m_cbMax(0)
+{
+	memset(m_iBucket, 0, sizeof(m_iBucket));
+	memset(m_bBuckets, 0, sizeof(m_bBuckets));
+	memset(m_bShort, 0, sizeof(m_bShort));
+	memset(m_bLow, 0, sizeof(m_bLow));
+	memset(m_bHigh, 0, sizeof(m_bHigh));
+}
+
+inline HRESULT CBodyPatternSet::Add(const BYTE* pb, ULONG cb)
+{
+	ATLASSERT(pb != 0 && cb != 0);
+	if (!pb || !cb)
+	{
+		return E_INVALIDARG;
+	}
+	ATLASSERT(!m_bCompiled);
+	if (m_bCompiled)
+	{
+		return E_UNEXPECTED;
+	}
+
+	Detail::BodyPattern pattern;
+	pattern.ib = static_cast<ULONG>(m_bytes.size());
+	pattern.cb = cb;
+	pattern.iPattern = static_cast<ULONG>(m_patterns.size());
+	bool bAdded = false;
+	ATLTRY(m_bytes.insert(m_bytes.end(), pb, pb + cb);
+		m_patterns.push_back(pattern);
+		bAdded = true)
+	if (!bAdded)
+	{
+		m_bytes.resize(pattern.ib);
+		return E_OUTOFMEMORY;
+	}
+	if (m_bIgnoreCase)
+	{
+		for (ULONG i = 0; i < cb; ++i)
+		{
+			m_bytes[pattern.ib + i] = Fold(m_bytes[pattern.ib + i]);
+		}
+	}
+	if (cb > m_cbMax)
+	{
+		m_cbMax = cb;
+	}
+	return S_OK;
+}
+
+inline HRESULT CBodyPatternSet::Add(LPCSTR sz)
+{
+	ATLASSERT(sz != 0);
+	if (!sz)
+	{
+		return E_POINTER;
+	}
+	return Add(reinterpret_cast<const BYTE*>(sz),
+		static_cast<ULONG>(strlen(sz)));
+}
+
+inline HRESULT CBodyPatternSet::Compile()
+{
+	ATLASSERT(!m_bCompiled);
+	if (m_bCompiled)
+	{
+		return E_UNEXPECTED;
+	}
+
+	// Patterns with the same prefix share a bucket, and the different
+	// prefixes are dealt round the buckets in order
+	std::vector<DWORD> prefixes;
+	std::vector<DWORD> distinct;
+	std::vector<Detail::BodyPattern> sorted;
+	bool bAllocated = false;
+	ATLTRY(prefixes.resize(m_patterns.size());
+		distinct.reserve(m_patterns.size());
+		sorted.reserve(m_patterns.size());
+		bAllocated = true)
+	if (!bAllocated)
+	{
+		return E_OUTOFMEMORY;
+	}
+	for (size_t i = 0; i < m_patterns.size(); ++i)
+	{
+		const Detail::BodyPattern& pattern = m_patterns[i];
+		DWORD dwPrefix = 0;
+		for (ULONG j = 0; j < Detail::cbBodyPatternPrefix; ++j)
+		{
+			// 256 stands for the end of the pattern
+			dwPrefix = (dwPrefix << 9) |
+				(j < pattern.cb ? m_bytes[pattern.ib + j] : 256);
+		}
+		prefixes[i] = dwPrefix;
+	}
+	distinct.assign(prefixes.begin(), prefixes.end());
+	std::sort(distinct.begin(), distinct.end());
+	distinct.erase(std::unique(distinct.begin(), distinct.end()),
+		distinct.end());
+
+	for (ULONG iBucket = 0; iBucket < Detail::cBodyPatternBuckets; ++iBucket)
+	{
+		m_iBucket[iBucket] = static_cast<ULONG>(sorted.size());
+		BYTE bBucket = static_cast<BYTE>(1 << iBucket);
+		for (size_t i = 0; i < m_patterns.size(); ++i)
+		{
+			size_t iPrefix = std::lower_bound(distinct.begin(),
+				distinct.end(), prefixes[i]) - distinct.begin();
+			if (iPrefix % Detail::cBodyPatternBuckets != iBucket)
+			{
+				continue;
+			}
+			sorted.push_back(m_patterns[i]);
+
+			const Detail::BodyPattern& pattern = m_patterns[i];
+			for (ULONG j = 0; j < Detail::cbBodyPatternPrefix; ++j)
+			{
+				if (j >= pattern.cb)
+				{
+					// Whatever follows the pattern
+					m_bShort[j] |= bBucket;
+				}
+				for (int b = 0; b < 256; ++b)
+				{
+					if (j >= pattern.cb || (m_bIgnoreCase ?
+						Fold(static_cast<BYTE>(b)) : b) ==
+						m_bytes[pattern.ib + j])
+					{
+						m_bBuckets[j][b] |= bBucket;
+					}
+				}
+			}
+		}
+	}
+	m_iBucket[Detail::cBodyPatternBuckets] =
+		static_cast<ULONG>(sorted.size());
+	m_patterns.swap(sorted);
+
+	for (ULONG j = 0; j < Detail::cbBodyPatternPrefix; ++j)
+	{
+		for (int b = 0; b < 256; ++b)
+		{
+			m_bLow[j][b & 0x0F] |= m_bBuckets[j][b];
+			m_bHigh[j][b >> 4] |= m_bBuckets[j][b];
+		}
+	}
+	m_bCompiled = true;
+	return S_OK;
+}
+
+inline bool CBodyPatternSet::IsCompiled() const
+{
+	return m_bCompiled;
+}
+
+inline ULONG CBodyPatternSet::GetCount() const
+{
+	return static_cast<ULONG>(m_patterns.size());
+}
+
+inline ULONG CBodyPatternSet::GetMaxLength() const
+{
+	return m_cbMax;
+}
+
+template <class Handler>
+inline bool CBodyPatternSet::Find(const BYTE* pb, ULONG cb,
+	ULONGLONG ibBase, Handler& handler) const
+{
+	ATLASSERT(m_bCompiled);
+	if (m_patterns.empty())
+	{
+		return true;
+	}
+
+	ULONG ib = 0;
+#if defined(PASSTHROUGHAPP_BODYSCANNER_AVX2) || \
+	defined(PASSTHROUGHAPP_BODYSCANNER_SSSE3)
+	const Detail::BodyScanVector low0 =
+		Detail::LoadBodyScanTable(m_bLow[0]);
+	const Detail::BodyScanVector high0 =
+		Detail::LoadBodyScanTable(m_bHigh[0]);
+	const Detail::BodyScanVector low1 =
+		Detail::LoadBodyScanTable(m_bLow[1]);
+	const Detail::BodyScanVector high1 =
+		Detail::LoadBodyScanTable(m_bHigh[1]);
+	const Detail::BodyScanVector low2 =
+		Detail::LoadBodyScanTable(m_bLow[2]);
+	const Detail::BodyScanVector high2 =
+		Detail::LoadBodyScanTable(m_bHigh[2]);
+	// Each position needs the whole prefix after it
+	const ULONG cbBlock = Detail::cbBodyScanVector +
+		Detail::cbBodyPatternPrefix - 1;
+	for (; cb >= cbBlock && ib <= cb - cbBlock;
+		ib += Detail::cbBodyScanVector)
+	{
+		Detail::BodyScanVector buckets = Detail::AndBodyScanVectors(
+			Detail::AndBodyScanVectors(
+				Detail::LookupBodyScanBuckets(
+					Detail::LoadBodyScanVector(pb + ib), low0, high0),
+				Detail::LookupBodyScanBuckets(
+					Detail::LoadBodyScanVector(pb + ib + 1), low1, high1)),
+			Detail::LookupBodyScanBuckets(
+				Detail::LoadBodyScanVector(pb + ib + 2), low2, high2));
+		DWORD dwCandidates = Detail::GetBodyScanCandidates(buckets);
+		while (dwCandidates)
+		{
+			ULONG i = ib + Detail::LowestBodyScanBit(dwCandidates);
+			dwCandidates &= dwCandidates - 1;
+			// Half bytes only narrow it down
+			BYTE bBuckets = m_bBuckets[0][pb[i]] & m_bBuckets[1][pb[i + 1]] &
+				m_bBuckets[2][pb[i + 2]];
+			if (bBuckets && !Verify(pb, cb, i, bBuckets, 0, ibBase, handler))
+			{
+				return false;
+			}
+		}
+	}
+#endif
+	return FindRange(pb, cb, ib, cb, 0, ibBase, handler);
+}
+
+inline BYTE CBodyPatternSet::Fold(BYTE b)
+{
+	return (b >= 'A' && b <= 'Z') ? static_cast<BYTE>(b + ('a' - 'A')) : b;
+}
+
+template <class Handler>
+inline bool CBodyPatternSet::FindRange(const BYTE* pb, ULONG cb,
+	ULONG ibStart, ULONG ibEndStart, ULONG ibMinEnd, ULONGLONG ibBase,
+	Handler& handler) const
+{
+	ATLASSERT(ibEndStart <= cb);
+	for (ULONG i = ibStart; i < ibEndStart; ++i)
+	{
+		BYTE bBuckets = m_bBuckets[0][pb[i]];
+		for (ULONG j = 1; j < Detail::cbBodyPatternPrefix && bBuckets; ++j)
+		{
+			bBuckets &= (i + j < cb) ? m_bBuckets[j][pb[i + j]] :
+				m_bShort[j];
+		}
+		if (bBuckets &&
+			!Verify(pb, cb, i, bBuckets, ibMinEnd, ibBase, handler))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+template <class Handler>
+inline bool CBodyPatternSet::Verify(const BYTE* pb, ULONG cb, ULONG ib,
+	BYTE bBuckets, ULONG ibMinEnd, ULONGLONG ibBase, Handler& handler) const
+{
+	ULONG cbLeft = cb - ib;
+	for (ULONG iBucket = 0; bBuckets; ++iBucket, bBuckets >>= 1)
+	{
+		if (!(bBuckets & 1))
+		{
+			continue;
+		}
+		for (ULONG i = m_iBucket[iBucket]; i < m_iBucket[iBucket + 1]; ++i)
+		{
+			const Detail::BodyPattern& pattern = m_patterns[i];
+			if (pattern.cb > cbLeft || ib + pattern.cb <= ibMinEnd)
+			{
+				continue;
+			}
+			const BYTE* pbPattern = &m_bytes[pattern.ib];
+			ULONG j = 0;
+			if (m_bIgnoreCase)
+			{
+				while (j < pattern.cb && Fold(pb[ib + j]) == pbPattern[j])
+				{
+					++j;
+				}
+			}
+			else
+			{
+				while (j < pattern.cb && pb[ib + j] == pbPattern[j])
+				{
+					++j;
+				}
+			}
+			if (j == pattern.cb &&
+				!handler.OnMatch(pattern.iPattern, ibBase + ib))
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// ===== CBodyScanner =====
+
+inline CBodyScanner::CBodyScanner() :
+	m_pSet(0), m_pbCarry(0), m_cbCarry(0), m_cbCarryMax(0), m_ibOffset(0)
+{
+}
+
+inline CBodyScanner::~CBodyScanner()
+{
+	delete[] m_pbCarry;
+}
+
+inline HRESULT CBodyScanner::Init(const CBodyPatternSet* pSet)
+{
+	ATLASSERT(pSet != 0);
+	if (!pSet)
+	{
+		return E_POINTER;
+	}
+	ATLASSERT(pSet->IsCompiled());
+	if (!pSet->IsCompiled())
+	{
+		return E_UNEXPECTED;
+	}
+
+	delete[] m_pbCarry;
+	m_pbCarry = 0;
+	m_pSet = 0;
+	Reset();
+
+	// A match ending in the next chunk starts in the last
+	// GetMaxLength() - 1 bytes at the most
+	ULONG cbCarryMax = pSet->GetMaxLength() ? pSet->GetMaxLength() - 1 : 0;
+	if (cbCarryMax)
+	{
+		ATLTRY(m_pbCarry = new BYTE[2 * cbCarryMax])
+		if (!m_pbCarry)
+		{
+			return E_OUTOFMEMORY;
+		}
+	}
+	m_cbCarryMax = cbCarryMax;
+	m_pSet = pSet;
+	return S_OK;
+}
+
+inline void CBodyScanner::Reset()
+{
+	m_cbCarry = 0;
+	m_ibOffset = 0;
+}
+
+template <class Handler>
+inline HRESULT CBodyScanner::Scan(const BYTE* pb, ULONG cb,
+	Handler& handler)
+{
+	ATLASSERT(m_pSet != 0);
+	if (!m_pSet)
+	{
+		return E_UNEXPECTED;
+	}
+	ATLASSERT(pb != 0 || !cb);
+	if (!cb)
+	{
+		return S_OK;
+	}
+
+	bool bGoOn = true;
+	ULONG cbHead = (cb < m_cbCarryMax) ? cb : m_cbCarryMax;
+	if (cbHead)
+	{
+		// Matches starting in the bytes carried over, found where the
+		// chunk completes them
+		memcpy(m_pbCarry + m_cbCarry, pb, cbHead);
+		if (m_cbCarry)
+		{
+			bGoOn = m_pSet->FindRange(m_pbCarry, m_cbCarry + cbHead, 0,
+				m_cbCarry, m_cbCarry, m_ibOffset - m_cbCarry, handler);
+		}
+	}
+	if (bGoOn)
+	{
+		bGoOn = m_pSet->Find(pb, cb, m_ibOffset, handler);
+	}
+
+	if (cb >= m_cbCarryMax)
+	{
+		if (m_cbCarryMax)
+		{
+			memcpy(m_pbCarry, pb + cb - m_cbCarryMax, m_cbCarryMax);
+		}
+		m_cbCarry = m_cbCarryMax;
+	}
+	else
+	{
+		// The chunk is all in the buffer already, behind what was carried
+		ULONG cbBuffered = m_cbCarry + cb;
+		ULONG cbKeep = (cbBuffered < m_cbCarryMax) ? cbBuffered :
+			m_cbCarryMax;
+		memmove(m_pbCarry, m_pbCarry + cbBuffered - cbKeep, cbKeep);
+		m_cbCarry = cbKeep;
+	}
+	m_ibOffset += cb;
+	return bGoOn ? S_OK : S_FALSE;
+}
+
+inline ULONGLONG CBodyScanner::GetOffset() const
+{
+	return m_ibOffset;
+}
+
+} // end namespace PassthroughAPP
+
+#endif // PASSTHROUGHAPP_BODYSCANNER_INL
@@ -0,0 +1,134 @@
+#ifndef PASSTHROUGHAPP_HASHEDCOMMAP_H
+#define PASSTHROUGHAPP_HASHEDCOMMAP_H
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+// AtlInternalQueryInterface compares the requested IID against every COM
+// map entry in turn before reaching the blind entries at the end of the
+// map, which is where the passthrough objects delegate unknown interfaces
+// to their target. urlmon queries these objects many times per binding,
+// mostly for interfaces they don't implement themselves.
+//
+// DECLARE_HASHED_COM_MAP() replaces that walk for one class. The leading
+// entries that carry an IID are indexed in an open-addressing hash table,
+// so a lookup costs one hash and usually one IID comparison. A miss jumps
+// straight to the first entry without an IID (blind, chain) and continues
+// from there exactly as ATL would, so the semantics of the map, including
+// the order of entries, are unchanged.
+//
+// IIDs are link-time constants, not compile-time ones, so the table is
+// built on first use, once per map, and published atomically. Until it
+// is, and for maps too large for the table, the lookup falls back to
+// the linear walk.
+//
+// A class deriving from one that uses DECLARE_HASHED_COM_MAP() inherits
+// its InternalQueryInterface, and with it the base's tables, even if it
+// has a COM map of its own. The tables are therefore kept per map: the
+// first HashedItfMap::cSlots maps that reach an InternalQueryInterface
+// get one, and any further ones are walked.
+//
+// Usage: put DECLARE_HASHED_COM_MAP() next to BEGIN_COM_MAP. To chain to
+// a base class that uses it as well, use COM_INTERFACE_ENTRY_CHAIN_HASHED
+// instead of COM_INTERFACE_ENTRY_CHAIN, as ATL's chaining always walks
+// the base map linearly.
+
+namespace PassthroughAPP
+{
+
+namespace Detail
+{
+
+struct HashedItfTable
+{
+	enum {cBuckets = 256, cMaxKeyed = cBuckets / 2};
+
+	// The map the table indexes
+	const _ATL_INTMAP_ENTRY* pEntries;
+	// 1-based indices of COM map entries, 0 marks an empty bucket
+	BYTE buckets[cBuckets];
+	// Index of the first entry without an IID; lookups that miss the
+	// table resume the linear walk there
+	DWORD_PTR iTail;
+};
+
+// The tables of the maps sharing an InternalQueryInterface. Meant to be a
+// function-level static, so that it is zero-initialized before any code
+// runs
+struct HashedItfMap
+{
+	enum {cSlots = 8};
+
+	struct Slot
+	{
+		HashedItfTable* pTable;
+		LONG lBuilding;
+		HashedItfTable table;
+	};
+
+	Slot slots[cSlots];
+};
+
+DWORD HashIID(REFIID iid);
+
+// A map too large for the table gets one without entries, which sends
+// every lookup down the linear walk, and false
+bool BuildHashedItfTable(const _ATL_INTMAP_ENTRY* pEntries,
+	HashedItfTable& table);
+
+const HashedItfTable* GetHashedItfTable(const _ATL_INTMAP_ENTRY* pEntries,
+	HashedItfMap& map);
+
+// The loop of AtlInternalQueryInterface, starting at an arbitrary entry
+HRESULT WINAPI WalkQueryInterface(void* pThis,
+	const _ATL_INTMAP_ENTRY* pEntries, REFIID iid, void** ppvObject);
+
+HRESULT WINAPI HashedQueryInterface(void* pThis,
+	const _ATL_INTMAP_ENTRY* pEntries, HashedItfMap& map, REFIID iid,
+	void** ppvObject);
+
+template <class Base>
+struct HashedChain
+{
+	static HRESULT WINAPI Chain(void* pv, REFIID iid, void** ppvObject,
+		DWORD_PTR dw);
+};
+
+} // end namespace PassthroughAPP::Detail
+
+} // end namespace PassthroughAPP
+
+// ATL's interface debugging hooks live in CComObjectRootBase's
+// InternalQueryInterface, so keep using it when they are enabled
+#if defined(_ATL_DEBUG_INTERFACES) || defined(_ATL_DEBUG_QI)
+
+	#define DECLARE_HASHED_COM_MAP()
+
+	#define COM_INTERFACE_ENTRY_CHAIN_HASHED(classname)\
+		COM_INTERFACE_ENTRY_CHAIN(classname)
+
+#else
+
+	// Hides CComObjectRootBase::InternalQueryInterface, which
+	// BEGIN_COM_MAP's _InternalQueryInterface calls
+	#define DECLARE_HASHED_COM_MAP() public:\
+		static HRESULT WINAPI InternalQueryInterface(void* pThis,\
+			const ::ATL::_ATL_INTMAP_ENTRY* pEntries, REFIID iid,\
+			void** ppvObject)\
+		{\
+			static ::PassthroughAPP::Detail::HashedItfMap map;\
+			return ::PassthroughAPP::Detail::HashedQueryInterface(\
+				pThis, pEntries, map, iid, ppvObject);\
+		}
+
+	#define COM_INTERFACE_ENTRY_CHAIN_HASHED(classname)\
+		{0,\
+		(DWORD_PTR)&::ATL::_CComChainData<classname, _ComMapClass>::data,\
+		::PassthroughAPP::Detail::HashedChain<classname>::Chain},
+
+#endif
+
+#include "HashedComMap.inl"
+
+#endif // PASSTHROUGHAPP_HASHEDCOMMAP_H
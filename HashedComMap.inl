@@ -0,0 +1,192 @@
+#ifndef PASSTHROUGHAPP_HASHEDCOMMAP_INL
+#define PASSTHROUGHAPP_HASHEDCOMMAP_INL
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+#ifndef PASSTHROUGHAPP_HASHEDCOMMAP_H
+	#error HashedComMap.inl requires HashedComMap.h to be included first
+#endif
+
+namespace PassthroughAPP
+{
+
+namespace Detail
+{
+
+inline DWORD HashIID(REFIID iid)
+{
+	const DWORD* pdw = reinterpret_cast<const DWORD*>(&iid);
+	// Fibonacci hashing; the top bits select the bucket
+	DWORD dwHash = (pdw[0] ^ pdw[1] ^ pdw[2] ^ pdw[3]) * 2654435761u;
+	return dwHash >> 24;
+}
+
+inline bool BuildHashedItfTable(const _ATL_INTMAP_ENTRY* pEntries,
+	HashedItfTable& table)
+{
+	ATLASSERT(pEntries != 0);
+	table.pEntries = pEntries;
+	memset(table.buckets, 0, sizeof(table.buckets));
+
+	DWORD_PTR i = 0;
+	for (; pEntries[i].pFunc && pEntries[i].piid; ++i)
+	{
+		if (i >= HashedItfTable::cMaxKeyed)
+		{
+			memset(table.buckets, 0, sizeof(table.buckets));
+			table.iTail = 0;
+			return false;
+		}
+
+		for (DWORD dwBucket = HashIID(*pEntries[i].piid);;
+			dwBucket = (dwBucket + 1) & (HashedItfTable::cBuckets - 1))
+		{
+			BYTE index = table.buckets[dwBucket];
+			if (!index)
+			{
+				table.buckets[dwBucket] = static_cast<BYTE>(i + 1);
+				break;
+			}
+			// The linear walk would stop at the first of duplicate IIDs
+			if (InlineIsEqualGUID(*pEntries[index - 1].piid,
+				*pEntries[i].piid))
+			{
+				break;
+			}
+		}
+	}
+	table.iTail = i;
+	return true;
+}
+
+inline const HashedItfTable* GetHashedItfTable(
+	const _ATL_INTMAP_ENTRY* pEntries, HashedItfMap& map)
+{
+	for (int i = 0; i < HashedItfMap::cSlots; ++i)
+	{
+		HashedItfMap::Slot& slot = map.slots[i];
+		// Readers only reach the table through the pointer they load, so
+		// the data dependency orders them after the publication below
+		HashedItfTable* pTable =
+			*static_cast<HashedItfTable* volatile*>(&slot.pTable);
+		if (pTable)
+		{
+			if (pTable->pEntries == pEntries)
+			{
+				return pTable;
+			}
+			continue;
+		}
+
+		// One thread builds the table, the others walk the map meanwhile,
+		// whichever map it is for, so that no map gets two slots
+		if (InterlockedCompareExchange(&slot.lBuilding, 1, 0) != 0)
+		{
+			return 0;
+		}
+		BuildHashedItfTable(pEntries, slot.table);
+		InterlockedCompareExchangePointer(
+			reinterpret_cast<void**>(&slot.pTable), &slot.table, 0);
+		return &slot.table;
+	}
+	// Out of slots
+	return 0;
+}
+
+inline HRESULT WINAPI WalkQueryInterface(void* pThis,
+	const _ATL_INTMAP_ENTRY* pEntries, REFIID iid, void** ppvObject)
+{
+	for (; pEntries->pFunc; ++pEntries)
+	{
+		BOOL bBlind = (pEntries->piid == 0);
+		if (bBlind || InlineIsEqualGUID(*pEntries->piid, iid))
+		{
+			if (pEntries->pFunc == _ATL_SIMPLEMAPENTRY)
+			{
+				ATLASSERT(!bBlind);
+				IUnknown* pUnk = reinterpret_cast<IUnknown*>(
+					static_cast<char*>(pThis) + pEntries->dw);
+				pUnk->AddRef();
+				*ppvObject = pUnk;
+				return S_OK;
+			}
+
+			HRESULT hr = pEntries->pFunc(pThis, iid, ppvObject,
+				pEntries->dw);
+			if (hr == S_OK || (!bBlind && FAILED(hr)))
+			{
+				return hr;
+			}
+		}
+	}
+	return E_NOINTERFACE;
+}
+
+inline HRESULT WINAPI HashedQueryInterface(void* pThis,
+	const _ATL_INTMAP_ENTRY* pEntries, HashedItfMap& map, REFIID iid,
+	void** ppvObject)
+{
+	ATLASSERT(pThis != 0);
+	ATLASSERT(pEntries != 0);
+	// First entry in the com map should be a simple map entry
+	ATLASSERT(pEntries->pFunc == _ATL_SIMPLEMAPENTRY);
+	if (!ppvObject)
+	{
+		return E_POINTER;
+	}
+	*ppvObject = 0;
+
+	if (InlineIsEqualUnknown(iid))
+	{
+		IUnknown* pUnk = reinterpret_cast<IUnknown*>(
+			static_cast<char*>(pThis) + pEntries->dw);
+		pUnk->AddRef();
+		*ppvObject = pUnk;
+		return S_OK;
+	}
+
+	const HashedItfTable* pTable = GetHashedItfTable(pEntries, map);
+	if (!pTable)
+	{
+		return WalkQueryInterface(pThis, pEntries, iid, ppvObject);
+	}
+
+	for (DWORD dwBucket = HashIID(iid);;
+		dwBucket = (dwBucket + 1) & (HashedItfTable::cBuckets - 1))
+	{
+		BYTE index = pTable->buckets[dwBucket];
+		if (!index)
+		{
+			// Not one of ours, skip to the blind entries
+			return WalkQueryInterface(pThis, pEntries + pTable->iTail, iid,
+				ppvObject);
+		}
+
+		const _ATL_INTMAP_ENTRY* pEntry = pEntries + index - 1;
+		if (InlineIsEqualGUID(*pEntry->piid, iid))
+		{
+			// Walking on from the match preserves ATL's handling of
+			// functions returning S_FALSE
+			return WalkQueryInterface(pThis, pEntry, iid, ppvObject);
+		}
+	}
+}
+
+// ===== HashedChain =====
+
+template <class Base>
+inline HRESULT WINAPI HashedChain<Base>::Chain(void* pv, REFIID iid,
+	void** ppvObject, DWORD_PTR dw)
+{
+	const _ATL_CHAINDATA* pcd = reinterpret_cast<const _ATL_CHAINDATA*>(dw);
+	void* p = static_cast<char*>(pv) + pcd->dwOffset;
+	return Base::InternalQueryInterface(p, pcd->pFunc(), iid, ppvObject);
+}
+
+} // end namespace PassthroughAPP::Detail
+
+} // end namespace PassthroughAPP
+
+#endif // PASSTHROUGHAPP_HASHEDCOMMAP_INL
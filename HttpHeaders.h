@@ -0,0 +1,184 @@
+#ifndef PASSTHROUGHAPP_HTTPHEADERS_H
+#define PASSTHROUGHAPP_HTTPHEADERS_H
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+// Read-only access to the headers handed to IHttpNegotiate, e.g.
+// szHeaders in BeginningTransaction and szResponseHeaders in OnResponse,
+// without copying them.
+//
+// A CHttpHeaderView indexes a block of CRLF separated headers in place:
+// it records where each name and value starts and how long it is, and a
+// hash of the name, in an array of fixed size within the view. Parsing
+// allocates nothing, and the view holds on to the block rather than a
+// copy, so the block must outlive it. A view declared on the stack of
+// OnResponse costs nothing but the scan of the headers.
+//
+// Names are compared ignoring ASCII case. Well known headers have their
+// hash computed ahead of time (see HttpHeaderId); other names are hashed
+// once per CHttpHeaderName. A lookup first checks a 64 bit summary of
+// the hashes present, so that asking for a header that isn't there is
+// usually decided without looking at the fields.
+//
+// Built with SSE2, which every x64 compiler and /arch:SSE2 provide, the
+// scan looks for line feeds and colons 16 bytes at a time; otherwise, or
+// with PASSTHROUGHAPP_NO_SIMD defined, one character at a time.
+
+#if !defined(PASSTHROUGHAPP_NO_SIMD)
+	#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || \
+		(defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+		#define PASSTHROUGHAPP_HTTPHEADERS_SSE2
+		#include <emmintrin.h>
+		#ifdef _MSC_VER
+			#include <intrin.h>
+		#endif
+	#endif
+#endif
+
+namespace PassthroughAPP
+{
+
+// Headers whose names are hashed ahead of time
+enum HttpHeaderId
+{
+	HttpHeaderAccept,
+	HttpHeaderAcceptEncoding,
+	HttpHeaderAcceptLanguage,
+	HttpHeaderAuthorization,
+	HttpHeaderCacheControl,
+	HttpHeaderConnection,
+	HttpHeaderContentDisposition,
+	HttpHeaderContentEncoding,
+	HttpHeaderContentLength,
+	HttpHeaderContentSecurityPolicy,
+	HttpHeaderContentType,
+	HttpHeaderCookie,
+	HttpHeaderDate,
+	HttpHeaderETag,
+	HttpHeaderExpires,
+	HttpHeaderHost,
+	HttpHeaderIfModifiedSince,
+	HttpHeaderIfNoneMatch,
+	HttpHeaderLastModified,
+	HttpHeaderLocation,
+	HttpHeaderPragma,
+	HttpHeaderReferer,
+	HttpHeaderSetCookie,
+	HttpHeaderTransferEncoding,
+	HttpHeaderUserAgent,
+	HttpHeaderVary,
+	HttpHeaderIdCount
+};
+
+namespace Detail
+{
+
+struct HttpKnownHeader
+{
+	LPCWSTR szName;
+	ULONG cchName;
+	DWORD dwHash;
+};
+
+// Offsets into the block of headers
+struct HttpHeaderField
+{
+	ULONG ichName;
+	ULONG cchName;
+	ULONG ichValue;
+	ULONG cchValue;
+	DWORD dwHash;
+};
+
+const HttpKnownHeader* GetHttpKnownHeaders();
+
+WCHAR FoldHttpHeaderChar(WCHAR ch);
+// FNV-1a over the name folded to lower case
+DWORD HashHttpHeaderName(const WCHAR* pch, ULONG cch);
+bool EqualHttpHeaderNames(const WCHAR* pch1, const WCHAR* pch2, ULONG cch);
+
+} // end namespace PassthroughAPP::Detail
+
+// A header name to look up, hashed once
+class CHttpHeaderName
+{
+public:
+	CHttpHeaderName(HttpHeaderId id);
+	// szName must outlive the object
+	CHttpHeaderName(LPCWSTR szName);
+	CHttpHeaderName(const WCHAR* pchName, ULONG cchName);
+
+	const WCHAR* GetName() const;
+	ULONG GetLength() const;
+	DWORD GetHash() const;
+
+private:
+	const WCHAR* m_pchName;
+	ULONG m_cchName;
+	DWORD m_dwHash;
+};
+
+// Indexes up to t_nMaxFields header fields. Not thread safe
+template <ULONG t_nMaxFields>
+class CHttpHeaderViewT
+{
+public:
+	CHttpHeaderViewT();
+
+	// Indexes the headers, which must stay unchanged for as long as the
+	// view is used. A response's status line comes first, if present;
+	// the headers end at the first empty line. A line starting with white
+	// space continues the value before it, line break included. Lines
+	// without a colon are skipped. Returns S_FALSE if there were more
+	// fields than the view holds; those past the limit are left out
+	HRESULT Parse(LPCWSTR szHeaders);
+	HRESULT Parse(const WCHAR* pchHeaders, ULONG cchHeaders);
+	void Clear();
+
+	// The status line of a response, without the line break. Returns
+	// false if the headers didn't start with one
+	bool GetStatusLine(const WCHAR** ppch, ULONG* pcch) const;
+
+	// The fields, in the order they appear. Names are as written, values
+	// without the white space around them
+	ULONG GetCount() const;
+	void GetField(ULONG iField, const WCHAR** ppchName, ULONG* pcchName,
+		const WCHAR** ppchValue, ULONG* pcchValue) const;
+
+	// The index of the first field named name at or after iStart, or
+	// GetCount() if there is none. Call again with the index plus one for
+	// headers that may repeat, such as Set-Cookie
+	ULONG Find(const CHttpHeaderName& name, ULONG iStart = 0) const;
+	// The value of the first field named name. Returns false if there is
+	// none
+	bool GetValue(const CHttpHeaderName& name, const WCHAR** ppch,
+		ULONG* pcch) const;
+
+private:
+	// Records the line pch[ichLine..ichEnd), ichEnd being its line feed or
+	// the end of the block, with its first colon at ichColon if it has
+	// one. Returns false to stop
+	bool AddLine(ULONG ichLine, ULONG ichColon, ULONG ichEnd);
+	static bool IsSpace(WCHAR ch);
+
+	const WCHAR* m_pchHeaders;
+	ULONG m_cchHeaders;
+	// 0 if there is none
+	ULONG m_cchStatusLine;
+	bool m_bTruncated;
+	// Bit dwHash % 64 is set for the hash of every name indexed
+	ULONGLONG m_ullHashes;
+	ULONG m_cFields;
+	Detail::HttpHeaderField m_fields[t_nMaxFields];
+};
+
+// Enough for all but unusual responses
+typedef CHttpHeaderViewT<64> CHttpHeaderView;
+
+} // end namespace PassthroughAPP
+
+#include "HttpHeaders.inl"
+
+#endif // PASSTHROUGHAPP_HTTPHEADERS_H
@@ -0,0 +1,451 @@
+#ifndef PASSTHROUGHAPP_HTTPHEADERS_INL
+#define PASSTHROUGHAPP_HTTPHEADERS_INL
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+#ifndef PASSTHROUGHAPP_HTTPHEADERS_H
+	#error HttpHeaders.inl requires HttpHeaders.h to be included first
+#endif
+
+namespace PassthroughAPP
+{
+
+namespace Detail
+{
+
+// In the order of HttpHeaderId. The hashes are those HashHttpHeaderName
+// computes
+inline const HttpKnownHeader* GetHttpKnownHeaders()
+{
+	static const HttpKnownHeader s_headers[HttpHeaderIdCount] =
+	{
+		{L"Accept", 6, 0x08247E29},
+		{L"Accept-Encoding", 15, 0xC9715A99},
+		{L"Accept-Language", 15, 0x75F67716},
+		{L"Authorization", 13, 0x913657BE},
+		{L"Cache-Control", 13, 0x50C8A4CD},
+		{L"Connection", 10, 0x38B99ED9},
+		{L"Content-Disposition", 19, 0xE7D03E5C},
+		{L"Content-Encoding", 16, 0x03E2ED88},
+		{L"Content-Length", 14, 0x4DF9451D},
+		{L"Content-Security-Policy", 23, 0x5D85A5DC},
+		{L"Content-Type", 12, 0xFCF70995},
+		{L"Cookie", 6, 0x77A740BF},
+		{L"Date", 4, 0xD472DC59},
+		{L"ETag", 4, 0x06C857C0},
+		{L"Expires", 7, 0x3E8EC783},
+		{L"Host", 4, 0xAFFEA56F},
+		{L"If-Modified-Since", 17, 0x83E879A9},
+		{L"If-None-Match", 13, 0x972B6177},
+		{L"Last-Modified", 13, 0xC0575A6B},
+		{L"Location", 8, 0x0BF5A9A6},
+		{L"Pragma", 6, 0x19FA4625},
+		{L"Referer", 7, 0xEC9AF966},
+		{L"Set-Cookie", 10, 0x6E2BE738},
+		{L"Transfer-Encoding", 17, 0xDDB4744C},
+		{L"User-Agent", 10, 0x24259BEE},
+		{L"Vary", 4, 0x40ABDE45}
+	};
+	return s_headers;
+}
+
+inline WCHAR FoldHttpHeaderChar(WCHAR ch)
+{
+	return (ch >= L'A' && ch <= L'Z') ?
+		static_cast<WCHAR>(ch + (L'a' - L'A')) : ch;
+}
+
+inline DWORD HashHttpHeaderName(const WCHAR* pch, ULONG cch)
+{
+	DWORD dwHash = 2166136261U;
+	for (ULONG i = 0; i < cch; ++i)
+	{
+		dwHash ^= static_cast<DWORD>(FoldHttpHeaderChar(pch[i]));
+		dwHash *= 16777619U;
+	}
+	return dwHash;
+}
+
+inline bool EqualHttpHeaderNames(const WCHAR* pch1, const WCHAR* pch2,
+	ULONG cch)
+{
+	for (ULONG i = 0; i < cch; ++i)
+	{
+		if (pch1[i] != pch2[i] &&
+			FoldHttpHeaderChar(pch1[i]) != FoldHttpHeaderChar(pch2[i]))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+#if defined(PASSTHROUGHAPP_HTTPHEADERS_SSE2)
+
+// WCHAR is 2 bytes on Windows, 4 with GCC and Clang elsewhere
+const ULONG cchHttpHeaderVector = 16 / sizeof(WCHAR);
+
+inline __m128i BroadcastHttpHeaderChar(WCHAR ch)
+{
+	return (sizeof(WCHAR) == 2) ? _mm_set1_epi16(static_cast<short>(ch)) :
+		_mm_set1_epi32(static_cast<int>(ch));
+}
+
+// A bit for each character of pch[0..cchHttpHeaderVector) that is ch1 or
+// ch2, in the place of its first byte
+inline DWORD FindHttpHeaderChars(const WCHAR* pch, __m128i ch1, __m128i ch2)
+{
+	__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pch));
+	__m128i found = (sizeof(WCHAR) == 2) ?
+		_mm_or_si128(_mm_cmpeq_epi16(v, ch1), _mm_cmpeq_epi16(v, ch2)) :
+		_mm_or_si128(_mm_cmpeq_epi32(v, ch1), _mm_cmpeq_epi32(v, ch2));
+	return static_cast<DWORD>(_mm_movemask_epi8(found)) &
+		((sizeof(WCHAR) == 2) ? 0x5555 : 0x1111);
+}
+
+inline ULONG LowestHttpHeaderBit(DWORD dwMask)
+{
+	ATLASSERT(dwMask != 0);
+#ifdef _MSC_VER
+	unsigned long iBit;
+	_BitScanForward(&iBit, dwMask);
+	return iBit;
+#else
+	return __builtin_ctz(dwMask);
+#endif
+}
+
+#endif
+
+} // end namespace PassthroughAPP::Detail
+
+// ===== CHttpHeaderName =====
+
+inline CHttpHeaderName::CHttpHeaderName(HttpHeaderId id)
+{
+	ATLASSERT(id >= 0 && id < HttpHeaderIdCount);
+	const Detail::HttpKnownHeader& header =
+		Detail::GetHttpKnownHeaders()[id];
+	ATLASSERT(header.dwHash ==
+		Detail::HashHttpHeaderName(header.szName, header.cchName));
+	m_pchName = header.szName;
+	m_cchName = header.cchName;
+	m_dwHash = header.dwHash;
+}
+
+inline CHttpHeaderName::CHttpHeaderName(LPCWSTR szName) :
+	m_pchName(szName), m_cchName(0)
+{
+	ATLASSERT(szName != 0);
+	if (szName)
+	{
+		m_cchName = static_cast<ULONG>(wcslen(szName));
+	}
+	m_dwHash = Detail::HashHttpHeaderName(m_pchName, m_cchName);
+}
+
+inline CHttpHeaderName::CHttpHeaderName(const WCHAR* pchName,
+		ULONG cchName) :
+	m_pchName(pchName), m_cchName(cchName),
+	m_dwHash(Detail::HashHttpHeaderName(pchName, cchName))
+{
+	ATLASSERT(pchName != 0 || !cchName);
+}
+
+inline const WCHAR* CHttpHeaderName::GetName() const
+{
+	return m_pchName;
+}
+
+inline ULONG CHttpHeaderName::GetLength() const
+{
+	return m_cchName;
+}
+
+inline DWORD CHttpHeaderName::GetHash() const
+{
+	return m_dwHash;
+}
+
+// ===== CHttpHeaderViewT =====
+
+template <ULONG t_nMaxFields>
+inline CHttpHeaderViewT<t_nMaxFields>::CHttpHeaderViewT()
+{
+	Clear();
+}
+
+template <ULONG t_nMaxFields>
+inline HRESULT CHttpHeaderViewT<t_nMaxFields>::Parse(LPCWSTR szHeaders)
+{
+	ATLASSERT(szHeaders != 0);
+	if (!szHeaders)
+	{
+		Clear();
+		return E_POINTER;
+	}
+	return Parse(szHeaders, static_cast<ULONG>(wcslen(szHeaders)));
+}
+
+template <ULONG t_nMaxFields>
+inline HRESULT CHttpHeaderViewT<t_nMaxFields>::Parse(
+	const WCHAR* pchHeaders, ULONG cchHeaders)
+{
+	Clear();
+	ATLASSERT(pchHeaders != 0 || !cchHeaders);
+	if (!pchHeaders && cchHeaders)
+	{
+		return E_POINTER;
+	}
+	m_pchHeaders = pchHeaders;
+	m_cchHeaders = cchHeaders;
+
+	// The line being scanned, and its first colon, or cchHeaders while it
+	// has none
+	ULONG ichLine = 0;
+	ULONG ichColon = cchHeaders;
+	bool bGoOn = true;
+	ULONG ich = 0;
+#if defined(PASSTHROUGHAPP_HTTPHEADERS_SSE2)
+	const __m128i lineFeed = Detail::BroadcastHttpHeaderChar(L'\n');
+	const __m128i colon = Detail::BroadcastHttpHeaderChar(L':');
+	for (; bGoOn && cchHeaders - ich >= Detail::cchHttpHeaderVector;
+		ich += Detail::cchHttpHeaderVector)
+	{
+		DWORD dwFound = Detail::FindHttpHeaderChars(pchHeaders + ich,
+			lineFeed, colon);
+		while (dwFound && bGoOn)
+		{
+			ULONG ichFound = ich +
+				Detail::LowestHttpHeaderBit(dwFound) / sizeof(WCHAR);
+			dwFound &= dwFound - 1;
+			if (pchHeaders[ichFound] == L':')
+			{
+				if (ichColon == cchHeaders)
+				{
+					ichColon = ichFound;
+				}
+				continue;
+			}
+			bGoOn = AddLine(ichLine, ichColon, ichFound);
+			ichLine = ichFound + 1;
+			ichColon = cchHeaders;
+		}
+	}
+#endif
+	for (; bGoOn && ich < cchHeaders; ++ich)
+	{
+		if (pchHeaders[ich] == L':')
+		{
+			if (ichColon == cchHeaders)
+			{
+				ichColon = ich;
+			}
+		}
+		else if (pchHeaders[ich] == L'\n')
+		{
+			bGoOn = AddLine(ichLine, ichColon, ich);
+			ichLine = ich + 1;
+			ichColon = cchHeaders;
+		}
+	}
+	// The last line need not end with a line break
+	if (bGoOn && ichLine < cchHeaders)
+	{
+		AddLine(ichLine, ichColon, cchHeaders);
+	}
+	return m_bTruncated ? S_FALSE : S_OK;
+}
+
+template <ULONG t_nMaxFields>
+inline void CHttpHeaderViewT<t_nMaxFields>::Clear()
+{
+	m_pchHeaders = 0;
+	m_cchHeaders = 0;
+	m_cchStatusLine = 0;
+	m_bTruncated = false;
+	m_ullHashes = 0;
+	m_cFields = 0;
+}
+
+template <ULONG t_nMaxFields>
+inline bool CHttpHeaderViewT<t_nMaxFields>::GetStatusLine(
+	const WCHAR** ppch, ULONG* pcch) const
+{
+	ATLASSERT(ppch != 0 && pcch != 0);
+	if (!m_cchStatusLine)
+	{
+		*ppch = 0;
+		*pcch = 0;
+		return false;
+	}
+	*ppch = m_pchHeaders;
+	*pcch = m_cchStatusLine;
+	return true;
+}
+
+template <ULONG t_nMaxFields>
+inline ULONG CHttpHeaderViewT<t_nMaxFields>::GetCount() const
+{
+	return m_cFields;
+}
+
+template <ULONG t_nMaxFields>
+inline void CHttpHeaderViewT<t_nMaxFields>::GetField(ULONG iField,
+	const WCHAR** ppchName, ULONG* pcchName, const WCHAR** ppchValue,
+	ULONG* pcchValue) const
+{
+	ATLASSERT(iField < m_cFields);
+	const Detail::HttpHeaderField& field = m_fields[iField];
+	if (ppchName)
+	{
+		*ppchName = m_pchHeaders + field.ichName;
+	}
+	if (pcchName)
+	{
+		*pcchName = field.cchName;
+	}
+	if (ppchValue)
+	{
+		*ppchValue = m_pchHeaders + field.ichValue;
+	}
+	if (pcchValue)
+	{
+		*pcchValue = field.cchValue;
+	}
+}
+
+template <ULONG t_nMaxFields>
+inline ULONG CHttpHeaderViewT<t_nMaxFields>::Find(
+	const CHttpHeaderName& name, ULONG iStart) const
+{
+	DWORD dwHash = name.GetHash();
+	if (!(m_ullHashes & (static_cast<ULONGLONG>(1) << (dwHash & 63))))
+	{
+		return m_cFields;
+	}
+	for (ULONG i = iStart; i < m_cFields; ++i)
+	{
+		const Detail::HttpHeaderField& field = m_fields[i];
+		if (field.dwHash == dwHash && field.cchName == name.GetLength() &&
+			Detail::EqualHttpHeaderNames(m_pchHeaders + field.ichName,
+				name.GetName(), field.cchName))
+		{
+			return i;
+		}
+	}
+	return m_cFields;
+}
+
+template <ULONG t_nMaxFields>
+inline bool CHttpHeaderViewT<t_nMaxFields>::GetValue(
+	const CHttpHeaderName& name, const WCHAR** ppch, ULONG* pcch) const
+{
+	ATLASSERT(ppch != 0 && pcch != 0);
+	ULONG iField = Find(name);
+	if (iField == m_cFields)
+	{
+		*ppch = 0;
+		*pcch = 0;
+		return false;
+	}
+	GetField(iField, 0, 0, ppch, pcch);
+	return true;
+}
+
+template <ULONG t_nMaxFields>
+inline bool CHttpHeaderViewT<t_nMaxFields>::AddLine(ULONG ichLine,
+	ULONG ichColon, ULONG ichEnd)
+{
+	const WCHAR* pch = m_pchHeaders;
+	ULONG ichLineEnd = ichEnd;
+	if (ichLineEnd > ichLine && pch[ichLineEnd - 1] == L'\r')
+	{
+		--ichLineEnd;
+	}
+	if (ichLineEnd == ichLine)
+	{
+		// The empty line after the headers
+		return false;
+	}
+
+	if (!ichLine && ichLineEnd - ichLine >= 5 &&
+		!wcsncmp(pch, L"HTTP/", 5))
+	{
+		m_cchStatusLine = ichLineEnd;
+		return true;
+	}
+
+	if (IsSpace(pch[ichLine]))
+	{
+		// Continues the value of the last field, if it was kept
+		if (m_cFields && !m_bTruncated)
+		{
+			Detail::HttpHeaderField& field = m_fields[m_cFields - 1];
+			while (ichLineEnd > ichLine && IsSpace(pch[ichLineEnd - 1]))
+			{
+				--ichLineEnd;
+			}
+			if (ichLineEnd > ichLine)
+			{
+				if (!field.cchValue)
+				{
+					// The value starts on this line
+					while (IsSpace(pch[ichLine]))
+					{
+						++ichLine;
+					}
+					field.ichValue = ichLine;
+				}
+				field.cchValue = ichLineEnd - field.ichValue;
+			}
+		}
+		return true;
+	}
+	if (ichColon >= ichLineEnd)
+	{
+		return true;
+	}
+
+	if (m_cFields == t_nMaxFields)
+	{
+		m_bTruncated = true;
+		return false;
+	}
+
+	ULONG ichNameEnd = ichColon;
+	while (ichNameEnd > ichLine && IsSpace(pch[ichNameEnd - 1]))
+	{
+		--ichNameEnd;
+	}
+	ULONG ichValue = ichColon + 1;
+	while (ichValue < ichLineEnd && IsSpace(pch[ichValue]))
+	{
+		++ichValue;
+	}
+	while (ichLineEnd > ichValue && IsSpace(pch[ichLineEnd - 1]))
+	{
+		--ichLineEnd;
+	}
+
+	Detail::HttpHeaderField& field = m_fields[m_cFields++];
+	field.ichName = ichLine;
+	field.cchName = ichNameEnd - ichLine;
+	field.ichValue = ichValue;
+	field.cchValue = ichLineEnd - ichValue;
+	field.dwHash = Detail::HashHttpHeaderName(pch + ichLine, field.cchName);
+	m_ullHashes |= static_cast<ULONGLONG>(1) << (field.dwHash & 63);
+	return true;
+}
+
+template <ULONG t_nMaxFields>
+inline bool CHttpHeaderViewT<t_nMaxFields>::IsSpace(WCHAR ch)
+{
+	return ch == L' ' || ch == L'\t';
+}
+
+} // end namespace PassthroughAPP
+
+#endif // PASSTHROUGHAPP_HTTPHEADERS_INL
@@ -0,0 +1,79 @@
+#ifndef PASSTHROUGHAPP_LOCALRESPONSE_H
+#define PASSTHROUGHAPP_LOCALRESPONSE_H
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+// Responses a protocol can serve by itself instead of starting the target,
+// e.g. for blocked requests. The whole response is reported to the client
+// sink from within Start/StartEx, and Read serves the body from memory.
+// See LocalResponseStartPolicy in SinkPolicy.h
+
+namespace PassthroughAPP
+{
+
+struct LocalResponse
+{
+	// Reported with BINDSTATUS_MIMETYPEAVAILABLE, unless 0
+	LPCWSTR szMimeType;
+	// Not copied, must stay valid for as long as the protocol can be read
+	const BYTE* pbBody;
+	ULONG cbBody;
+	// If not 0, the request is redirected there instead. Only used during
+	// Start/StartEx
+	LPCWSTR szRedirectUrl;
+	// If not 0, the object owning pbBody. The protocol holds a reference
+	// to it until it is destroyed, so that the body stays valid
+	IUnknown* punkBody;
+
+	// No data at all, the equivalent of an HTTP 204
+	static LocalResponse NoContent();
+	// A 1x1 transparent GIF
+	static LocalResponse TransparentGif();
+	// An empty script
+	static LocalResponse EmptyScript();
+	static LocalResponse Redirect(LPCWSTR szUrl);
+};
+
+namespace Detail
+{
+
+// The state of a protocol that answered locally. Like the target protocol,
+// it expects calls from a single thread, once started
+class LocalResponder
+{
+public:
+	LocalResponder();
+
+	bool IsActive() const;
+
+	HRESULT Start(const LocalResponse& response,
+		IInternetProtocolSink* pOIProtSink);
+
+	HRESULT Continue(PROTOCOLDATA* pProtocolData);
+	HRESULT Abort(HRESULT hrReason, DWORD dwOptions);
+	HRESULT Terminate(DWORD dwOptions);
+	HRESULT Suspend();
+	HRESULT Resume();
+	HRESULT Read(void* pv, ULONG cb, ULONG* pcbRead);
+	HRESULT Seek(LARGE_INTEGER dlibMove, DWORD dwOrigin,
+		ULARGE_INTEGER* plibNewPosition);
+	HRESULT LockRequest(DWORD dwOptions);
+	HRESULT UnlockRequest();
+
+private:
+	const BYTE* m_pbBody;
+	ULONG m_cbBody;
+	CComPtr<IUnknown> m_spBody;
+	ULONG m_cbRead;
+	bool m_bActive;
+};
+
+} // end namespace PassthroughAPP::Detail
+
+} // end namespace PassthroughAPP
+
+#include "LocalResponse.inl"
+
+#endif // PASSTHROUGHAPP_LOCALRESPONSE_H
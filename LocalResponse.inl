@@ -0,0 +1,176 @@
+#ifndef PASSTHROUGHAPP_LOCALRESPONSE_INL
+#define PASSTHROUGHAPP_LOCALRESPONSE_INL
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+#ifndef PASSTHROUGHAPP_LOCALRESPONSE_H
+	#error LocalResponse.inl requires LocalResponse.h to be included first
+#endif
+
+namespace PassthroughAPP
+{
+
+// ===== LocalResponse =====
+
+inline LocalResponse LocalResponse::NoContent()
+{
+	LocalResponse response = {0, 0, 0, 0, 0};
+	return response;
+}
+
+inline LocalResponse LocalResponse::TransparentGif()
+{
+	static const BYTE gif[] =
+	{
+		0x47, 0x49, 0x46, 0x38, 0x39, 0x61, 0x01, 0x00, 0x01, 0x00,
+		0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0x21,
+		0xF9, 0x04, 0x01, 0x00, 0x00, 0x00, 0x00, 0x2C, 0x00, 0x00,
+		0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x02, 0x02, 0x44,
+		0x01, 0x00, 0x3B
+	};
+	LocalResponse response = {L"image/gif", gif, sizeof(gif), 0, 0};
+	return response;
+}
+
+inline LocalResponse LocalResponse::EmptyScript()
+{
+	LocalResponse response = {L"application/javascript", 0, 0, 0, 0};
+	return response;
+}
+
+inline LocalResponse LocalResponse::Redirect(LPCWSTR szUrl)
+{
+	ATLASSERT(szUrl != 0);
+	LocalResponse response = {0, 0, 0, szUrl, 0};
+	return response;
+}
+
+namespace Detail
+{
+
+// ===== LocalResponder =====
+
+inline LocalResponder::LocalResponder() :
+	m_pbBody(0), m_cbBody(0), m_cbRead(0), m_bActive(false)
+{
+}
+
+inline bool LocalResponder::IsActive() const
+{
+	return m_bActive;
+}
+
+inline HRESULT LocalResponder::Start(const LocalResponse& response,
+	IInternetProtocolSink* pOIProtSink)
+{
+	ATLASSERT(pOIProtSink != 0);
+	if (!pOIProtSink)
+	{
+		return E_POINTER;
+	}
+	ATLASSERT(!m_bActive);
+	if (m_bActive)
+	{
+		return E_UNEXPECTED;
+	}
+
+	// Set up before reporting anything, the sink reads from within
+	// ReportData
+	m_pbBody = response.pbBody;
+	m_cbBody = response.pbBody ? response.cbBody : 0;
+	m_spBody = response.punkBody;
+	m_cbRead = 0;
+	m_bActive = true;
+
+	if (response.szRedirectUrl)
+	{
+		pOIProtSink->ReportResult(INET_E_REDIRECTING, 0,
+			response.szRedirectUrl);
+		return S_OK;
+	}
+
+	if (response.szMimeType)
+	{
+		pOIProtSink->ReportProgress(BINDSTATUS_MIMETYPEAVAILABLE,
+			response.szMimeType);
+	}
+	pOIProtSink->ReportData(BSCF_FIRSTDATANOTIFICATION |
+		BSCF_LASTDATANOTIFICATION | BSCF_DATAFULLYAVAILABLE,
+		m_cbBody, m_cbBody);
+	pOIProtSink->ReportResult(S_OK, 0, 0);
+	return S_OK;
+}
+
+inline HRESULT LocalResponder::Continue(PROTOCOLDATA* pProtocolData)
+{
+	// Nothing is ever passed to Switch
+	return E_UNEXPECTED;
+}
+
+inline HRESULT LocalResponder::Abort(HRESULT hrReason,
+	DWORD dwOptions)
+{
+	// The result has already been reported
+	return S_OK;
+}
+
+inline HRESULT LocalResponder::Terminate(DWORD dwOptions)
+{
+	return S_OK;
+}
+
+inline HRESULT LocalResponder::Suspend()
+{
+	return E_NOTIMPL;
+}
+
+inline HRESULT LocalResponder::Resume()
+{
+	return E_NOTIMPL;
+}
+
+inline HRESULT LocalResponder::Read(void* pv, ULONG cb, ULONG* pcbRead)
+{
+	ATLASSERT(pv != 0 || cb == 0);
+	if (!pv && cb)
+	{
+		return E_POINTER;
+	}
+
+	ULONG cbLeft = m_cbBody - m_cbRead;
+	ULONG cbRead = cb < cbLeft ? cb : cbLeft;
+	if (cbRead)
+	{
+		memcpy(pv, m_pbBody + m_cbRead, cbRead);
+		m_cbRead += cbRead;
+	}
+	if (pcbRead)
+	{
+		*pcbRead = cbRead;
+	}
+	return m_cbRead < m_cbBody ? S_OK : S_FALSE;
+}
+
+inline HRESULT LocalResponder::Seek(LARGE_INTEGER dlibMove,
+	DWORD dwOrigin, ULARGE_INTEGER* plibNewPosition)
+{
+	return E_NOTIMPL;
+}
+
+inline HRESULT LocalResponder::LockRequest(DWORD dwOptions)
+{
+	return S_OK;
+}
+
+inline HRESULT LocalResponder::UnlockRequest()
+{
+	return S_OK;
+}
+
+} // end namespace PassthroughAPP::Detail
+
+} // end namespace PassthroughAPP
+
+#endif // PASSTHROUGHAPP_LOCALRESPONSE_INL
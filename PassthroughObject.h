@@ -1,23 +1,45 @@
-#ifndef PASSTHROUGHAPP_PASSTHROUGHOBJECT_H
-#define PASSTHROUGHAPP_PASSTHROUGHOBJECT_H
-
-// {C38D254C-4C40-4192-A746-AC6FE519831E}
-extern "C" const __declspec(selectany) IID IID_IPassthroughObject =
-	{0xc38d254c, 0x4c40, 0x4192,
-		{0xa7, 0x46, 0xac, 0x6f, 0xe5, 0x19, 0x83, 0x1e}};
-
-struct
-__declspec(uuid("{C38D254C-4C40-4192-A746-AC6FE519831E}"))
-__declspec(novtable)
-IPassthroughObject : public IUnknown
-{
-	STDMETHOD(SetTargetUnknown)(IUnknown* punkTarget) = 0;
-};
-
-#if _ATL_VER < 0x700
-	#define InlineIsEqualGUID ::ATL::InlineIsEqualGUID
-#else
-	#define InlineIsEqualGUID ::InlineIsEqualGUID
-#endif
-
-#endif // PASSTHROUGHAPP_PASSTHROUGHOBJECT_H
+#ifndef PASSTHROUGHAPP_PASSTHROUGHOBJECT_H
+#define PASSTHROUGHAPP_PASSTHROUGHOBJECT_H
+
+// {C38D254C-4C40-4192-A746-AC6FE519831E}
+extern "C" const __declspec(selectany) IID IID_IPassthroughObject =
+	{0xc38d254c, 0x4c40, 0x4192,
+		{0xa7, 0x46, 0xac, 0x6f, 0xe5, 0x19, 0x83, 0x1e}};
+
+struct
+__declspec(uuid("{C38D254C-4C40-4192-A746-AC6FE519831E}"))
+__declspec(novtable)
+IPassthroughObject : public IUnknown
+{
+	STDMETHOD(SetTargetUnknown)(IUnknown* punkTarget) = 0;
+};
+
+// Passed to IPassthroughObject::SetTargetUnknown instead of the target
+// when its creation is deferred. The passthrough object calls CreateTarget
+// once it actually needs the target
+
+// {8C5A3E6B-2F41-4D7A-9B0E-5E3C71A2D4F9}
+extern "C" const __declspec(selectany) IID IID_IPassthroughTargetFactory =
+	{0x8c5a3e6b, 0x2f41, 0x4d7a,
+		{0x9b, 0x0e, 0x5e, 0x3c, 0x71, 0xa2, 0xd4, 0xf9}};
+
+struct
+__declspec(uuid("{8C5A3E6B-2F41-4D7A-9B0E-5E3C71A2D4F9}"))
+__declspec(novtable)
+IPassthroughTargetFactory : public IUnknown
+{
+	STDMETHOD(CreateTarget)(IUnknown** ppunkTarget) = 0;
+};
+
+#ifdef PASSTHROUGHAPP_PORTABLE
+	DECLARE_PORTABLE_UUIDOF(IPassthroughObject)
+	DECLARE_PORTABLE_UUIDOF(IPassthroughTargetFactory)
+#endif
+
+#if _ATL_VER < 0x700
+	#define InlineIsEqualGUID ::ATL::InlineIsEqualGUID
+#else
+	#define InlineIsEqualGUID ::InlineIsEqualGUID
+#endif
+
+#endif // PASSTHROUGHAPP_PASSTHROUGHOBJECT_H
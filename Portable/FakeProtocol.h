@@ -0,0 +1,301 @@
+#ifndef PASSTHROUGHAPP_FAKEPROTOCOL_H
+#define PASSTHROUGHAPP_FAKEPROTOCOL_H
+
+#if _MSC_VER > 1000
+#pragma once
+#endif // _MSC_VER > 1000
+
+#include <wctype.h>
+
+// Scripted stand-ins for the two parties a passthrough APP sits between:
+// the target protocol handler and the client (urlmon) protocol sink. They
+// only use the public urlmon interfaces, so they work equally well on top
+// of the real SDK and the portable headers in this directory, and allow
+// driving a complete request through CInternetProtocol without a network
+// or a browser. Like urlmon's apartment, they expect all calls on a single
+// thread.
+
+namespace PassthroughAPP
+{
+
+// Describes what CFakeTargetProtocol serves for every request
+struct FakeResponse
+{
+	FakeResponse();
+
+	const BYTE* pbBody;
+	ULONG cbBody;
+	// Bytes made available per ReportData notification, 0 for all at once
+	ULONG cbChunk;
+	LPCWSTR szMimeType;
+	// CRLF separated response headers returned by IWinInetHttpInfo
+	LPCWSTR szHeaders;
+	DWORD dwStatusCode;
+	// Result reported once all data has been delivered
+	HRESULT hrResult;
+	// If true, the whole response is delivered from within Start/StartEx.
+	// Otherwise the test drives delivery with DeliverResponse
+	bool bDeliverOnStart;
+};
+
+class ATL_NO_VTABLE CFakeTargetProtocol :
+	public CComObjectRootEx<CComMultiThreadModel>,
+	public IInternetProtocolEx,
+	public IInternetPriority,
+	public IWinInetHttpInfo
+{
+public:
+	CFakeTargetProtocol();
+
+BEGIN_COM_MAP(CFakeTargetProtocol)
+	COM_INTERFACE_ENTRY(IInternetProtocolEx)
+	COM_INTERFACE_ENTRY(IInternetProtocol)
+	COM_INTERFACE_ENTRY(IInternetProtocolRoot)
+	COM_INTERFACE_ENTRY(IInternetPriority)
+	COM_INTERFACE_ENTRY(IWinInetHttpInfo)
+	COM_INTERFACE_ENTRY(IWinInetInfo)
+END_COM_MAP()
+
+	void SetResponse(const FakeResponse& response);
+	// Reports MIME type, data notifications and the final result to the
+	// sink passed to Start/StartEx. Stops early if aborted
+	HRESULT DeliverResponse();
+
+	// IInternetProtocolRoot
+	STDMETHODIMP Start(
+		/* [in] */ LPCWSTR szUrl,
+		/* [in] */ IInternetProtocolSink *pOIProtSink,
+		/* [in] */ IInternetBindInfo *pOIBindInfo,
+		/* [in] */ DWORD grfPI,
+		/* [in] */ HANDLE_PTR dwReserved);
+
+	STDMETHODIMP Continue(
+		/* [in] */ PROTOCOLDATA *pProtocolData);
+
+	STDMETHODIMP Abort(
+		/* [in] */ HRESULT hrReason,
+		/* [in] */ DWORD dwOptions);
+
+	STDMETHODIMP Terminate(
+		/* [in] */ DWORD dwOptions);
+
+	STDMETHODIMP Suspend();
+
+	STDMETHODIMP Resume();
+
+	// IInternetProtocol
+	STDMETHODIMP Read(
+		/* [in, out] */ void *pv,
+		/* [in] */ ULONG cb,
+		/* [out] */ ULONG *pcbRead);
+
+	STDMETHODIMP Seek(
+		/* [in] */ LARGE_INTEGER dlibMove,
+		/* [in] */ DWORD dwOrigin,
+		/* [out] */ ULARGE_INTEGER *plibNewPosition);
+
+	STDMETHODIMP LockRequest(
+		/* [in] */ DWORD dwOptions);
+
+	STDMETHODIMP UnlockRequest();
+
+	// IInternetProtocolEx
+	STDMETHODIMP StartEx(
+		/* [in] */ IUri *pUri,
+		/* [in] */ IInternetProtocolSink *pOIProtSink,
+		/* [in] */ IInternetBindInfo *pOIBindInfo,
+		/* [in] */ DWORD grfPI,
+		/* [in] */ HANDLE_PTR dwReserved);
+
+	// IInternetPriority
+	STDMETHODIMP SetPriority(
+		/* [in] */ LONG nPriority);
+
+	STDMETHODIMP GetPriority(
+		/* [out] */ LONG *pnPriority);
+
+	// IWinInetInfo
+	STDMETHODIMP QueryOption(
+		/* [in] */ DWORD dwOption,
+		/* [in, out] */ LPVOID pBuffer,
+		/* [in, out] */ DWORD *pcbBuf);
+
+	// IWinInetHttpInfo
+	STDMETHODIMP QueryInfo(
+		/* [in] */ DWORD dwOption,
+		/* [in, out] */ LPVOID pBuffer,
+		/* [in, out] */ DWORD *pcbBuf,
+		/* [in, out] */ DWORD *pdwFlags,
+		/* [in, out] */ DWORD *pdwReserved);
+
+	void FinalRelease();
+
+	// Call counters, for verifying what the APP forwarded to the target
+	LONG m_cStart;
+	LONG m_cStartEx;
+	LONG m_cContinue;
+	LONG m_cRead;
+	LONG m_cAbort;
+	LONG m_cTerminate;
+	LONG m_cLockRequest;
+
+private:
+	HRESULT OnStart(IInternetProtocolSink* pOIProtSink,
+		IInternetBindInfo* pOIBindInfo);
+	HRESULT ReportResult(HRESULT hrResult);
+	// The value of a header in szHeaders, not terminated, or 0
+	LPCWSTR FindHeader(LPCWSTR szName, DWORD* pcchValue) const;
+
+	FakeResponse m_response;
+	// Bytes announced to the sink so far, and bytes consumed by Read
+	ULONG m_cbAvailable;
+	ULONG m_cbRead;
+	LONG m_nPriority;
+	bool m_bAborted;
+	bool m_bResultReported;
+	CComPtr<IInternetProtocolSink> m_spSink;
+	CComPtr<IInternetBindInfo> m_spBindInfo;
+};
+
+// Creates CFakeTargetProtocol instances serving the configured response.
+// Pass it to CMetaFactory::CreateInstance(IClassFactory*, IClassFactory**)
+// as the target class factory
+class ATL_NO_VTABLE CFakeTargetClassFactory :
+	public CComObjectRootEx<CComMultiThreadModel>,
+	public IClassFactory
+{
+public:
+	CFakeTargetClassFactory();
+
+BEGIN_COM_MAP(CFakeTargetClassFactory)
+	COM_INTERFACE_ENTRY(IClassFactory)
+END_COM_MAP()
+
+	static HRESULT Create(const FakeResponse& response,
+		CComObject<CFakeTargetClassFactory>** ppObj);
+
+	void SetResponse(const FakeResponse& response);
+
+	// IClassFactory
+	STDMETHODIMP CreateInstance(IUnknown* punkOuter, REFIID riid,
+		void** ppvObj);
+	STDMETHODIMP LockServer(BOOL fLock);
+
+	LONG m_cCreateInstance;
+	LONG m_cLock;
+	// The most recently created protocol, not AddRef'ed
+	CFakeTargetProtocol* m_pLastProtocol;
+
+private:
+	FakeResponse m_response;
+};
+
+// Plays the part of urlmon: supplies bind information, and reads the data
+// as soon as it is reported, the way a URL moniker binding does. Switch
+// continues at once on the thread that created the sink; from any other
+// thread, the protocol data waits for ContinuePending
+class ATL_NO_VTABLE CFakeClientSink :
+	public CComObjectRootEx<CComMultiThreadModel>,
+	public IInternetProtocolSink,
+	public IInternetBindInfoEx,
+	public IServiceProvider
+{
+public:
+	CFakeClientSink();
+
+BEGIN_COM_MAP(CFakeClientSink)
+	COM_INTERFACE_ENTRY(IInternetProtocolSink)
+	COM_INTERFACE_ENTRY(IInternetBindInfoEx)
+	COM_INTERFACE_ENTRY(IInternetBindInfo)
+	COM_INTERFACE_ENTRY(IServiceProvider)
+END_COM_MAP()
+
+	// The protocol to read from on ReportData. Not AddRef'ed, to avoid
+	// a reference cycle; call SetProtocol(0) before releasing it
+	void SetProtocol(IInternetProtocol* pProtocol);
+	void SetBindInfo(DWORD grfBINDF, DWORD dwBindVerb);
+	// Bytes requested per Read call, 0 to not read on ReportData at all
+	void SetReadSize(ULONG cbRead);
+	void Reset();
+
+	// IInternetProtocolSink
+	STDMETHODIMP Switch(
+		/* [in] */ PROTOCOLDATA *pProtocolData);
+
+	STDMETHODIMP ReportProgress(
+		/* [in] */ ULONG ulStatusCode,
+		/* [in] */ LPCWSTR szStatusText);
+
+	STDMETHODIMP ReportData(
+		/* [in] */ DWORD grfBSCF,
+		/* [in] */ ULONG ulProgress,
+		/* [in] */ ULONG ulProgressMax);
+
+	STDMETHODIMP ReportResult(
+		/* [in] */ HRESULT hrResult,
+		/* [in] */ DWORD dwError,
+		/* [in] */ LPCWSTR szResult);
+
+	// IInternetBindInfo
+	STDMETHODIMP GetBindInfo(
+		/* [out] */ DWORD *grfBINDF,
+		/* [in, out] */ BINDINFO *pbindinfo);
+
+	STDMETHODIMP GetBindString(
+		/* [in] */ ULONG ulStringType,
+		/* [in, out] */ LPOLESTR *ppwzStr,
+		/* [in] */ ULONG cEl,
+		/* [in, out] */ ULONG *pcElFetched);
+
+	// IInternetBindInfoEx
+	STDMETHODIMP GetBindInfoEx(
+		/* [out] */ DWORD *grfBINDF,
+		/* [in, out] */ BINDINFO *pbindinfo,
+		/* [out] */ DWORD *grfBINDF2,
+		/* [out] */ DWORD *pdwReserved);
+
+	// IServiceProvider
+	STDMETHODIMP QueryService(
+		/* [in] */ REFGUID guidService,
+		/* [in] */ REFIID riid,
+		/* [out] */ void** ppvObject);
+
+	// Reads everything currently available from the protocol. Returns the
+	// HRESULT of the last Read call
+	HRESULT ReadAvailable();
+	// Continues what Switch was called for from other threads, the way
+	// urlmon's message loop would. Returns the number of Continue calls
+	ULONG ContinuePending();
+
+	LONG m_cSwitch;
+	LONG m_cReportProgress;
+	LONG m_cReportData;
+	LONG m_cReportResult;
+	LONG m_cRead;
+	ULONG m_ulLastStatusCode;
+	HRESULT m_hrResult;
+	// Total bytes read and their FNV-1a hash, for comparing with the body
+	ULONG m_cbReceived;
+	DWORD m_dwBodyHash;
+
+	static DWORD HashBytes(const BYTE* pb, ULONG cb,
+		DWORD dwHash = 2166136261u);
+
+private:
+	IInternetProtocol* m_pProtocol;
+	DWORD m_grfBINDF;
+	DWORD m_dwBindVerb;
+	ULONG m_cbReadSize;
+	BYTE m_readBuffer[16384];
+	DWORD m_dwThreadId;
+	// Switched to from other threads
+	CComAutoCriticalSection m_csPending;
+	PROTOCOLDATA* m_apPending[16];
+	ULONG m_cPending;
+};
+
+} // end namespace PassthroughAPP
+
+#include "FakeProtocol.inl"
+
+#endif // PASSTHROUGHAPP_FAKEPROTOCOL_H
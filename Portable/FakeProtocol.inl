@@ -0,0 +1,687 @@
+#ifndef PASSTHROUGHAPP_FAKEPROTOCOL_INL
+#define PASSTHROUGHAPP_FAKEPROTOCOL_INL
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+#ifndef PASSTHROUGHAPP_FAKEPROTOCOL_H
+	#error FakeProtocol.inl requires FakeProtocol.h to be included first
+#endif
+
+namespace PassthroughAPP
+{
+
+// ===== FakeResponse =====
+
+inline FakeResponse::FakeResponse() :
+	pbBody(0), cbBody(0), cbChunk(0), szMimeType(L"text/html"),
+	szHeaders(0), dwStatusCode(200), hrResult(S_OK), bDeliverOnStart(true)
+{
+}
+
+// ===== CFakeTargetProtocol =====
+
+inline CFakeTargetProtocol::CFakeTargetProtocol() :
+	m_cStart(0), m_cStartEx(0), m_cContinue(0), m_cRead(0), m_cAbort(0),
+	m_cTerminate(0), m_cLockRequest(0), m_cbAvailable(0), m_cbRead(0),
+	m_nPriority(THREAD_PRIORITY_NORMAL), m_bAborted(false),
+	m_bResultReported(false)
+{
+}
+
+inline void CFakeTargetProtocol::SetResponse(const FakeResponse& response)
+{
+	m_response = response;
+}
+
+inline void CFakeTargetProtocol::FinalRelease()
+{
+	m_spSink.Release();
+	m_spBindInfo.Release();
+}
+
+inline HRESULT CFakeTargetProtocol::OnStart(
+	IInternetProtocolSink* pOIProtSink, IInternetBindInfo* pOIBindInfo)
+{
+	ATLASSERT(pOIProtSink != 0);
+	if (!pOIProtSink)
+	{
+		return E_POINTER;
+	}
+
+	// Exercise the bind info the way a real handler does
+	if (pOIBindInfo)
+	{
+		DWORD grfBINDF = 0;
+		BINDINFO bindInfo = {sizeof(BINDINFO)};
+		HRESULT hr = pOIBindInfo->GetBindInfo(&grfBINDF, &bindInfo);
+		if (FAILED(hr))
+		{
+			return hr;
+		}
+		ReleaseBindInfo(&bindInfo);
+	}
+
+	m_spSink = pOIProtSink;
+	m_spBindInfo = pOIBindInfo;
+	m_cbAvailable = 0;
+	m_cbRead = 0;
+	m_bAborted = false;
+	m_bResultReported = false;
+
+	return m_response.bDeliverOnStart ? DeliverResponse() : S_OK;
+}
+
+inline HRESULT CFakeTargetProtocol::DeliverResponse()
+{
+	ATLASSERT(m_spSink != 0);
+	if (!m_spSink)
+	{
+		return E_UNEXPECTED;
+	}
+
+	// The sink may terminate us from within any of the calls below
+	CComPtr<IInternetProtocolSink> spSink = m_spSink;
+
+	if (m_response.szMimeType)
+	{
+		spSink->ReportProgress(BINDSTATUS_MIMETYPEAVAILABLE,
+			m_response.szMimeType);
+	}
+
+	ULONG cbChunk = m_response.cbChunk ?
+		m_response.cbChunk : m_response.cbBody;
+	DWORD grfBSCF = BSCF_FIRSTDATANOTIFICATION;
+	do
+	{
+		if (m_bAborted)
+		{
+			return S_OK;
+		}
+
+		ULONG cbLeft = m_response.cbBody - m_cbAvailable;
+		m_cbAvailable += (cbChunk < cbLeft) ? cbChunk : cbLeft;
+		if (m_cbAvailable == m_response.cbBody)
+		{
+			grfBSCF |= BSCF_LASTDATANOTIFICATION | BSCF_DATAFULLYAVAILABLE;
+		}
+		spSink->ReportData(grfBSCF, m_cbAvailable, m_response.cbBody);
+		grfBSCF = BSCF_INTERMEDIATEDATANOTIFICATION;
+	}
+	while (m_cbAvailable < m_response.cbBody);
+
+	return m_bAborted ? S_OK : ReportResult(m_response.hrResult);
+}
+
+inline HRESULT CFakeTargetProtocol::ReportResult(HRESULT hrResult)
+{
+	if (m_bResultReported || !m_spSink)
+	{
+		return S_OK;
+	}
+	m_bResultReported = true;
+	CComPtr<IInternetProtocolSink> spSink = m_spSink;
+	return spSink->ReportResult(hrResult, 0, 0);
+}
+
+// IInternetProtocolRoot
+inline STDMETHODIMP CFakeTargetProtocol::Start(
+	/* [in] */ LPCWSTR szUrl,
+	/* [in] */ IInternetProtocolSink *pOIProtSink,
+	/* [in] */ IInternetBindInfo *pOIBindInfo,
+	/* [in] */ DWORD grfPI,
+	/* [in] */ HANDLE_PTR dwReserved)
+{
+	ATLASSERT(szUrl != 0);
+	++m_cStart;
+	return OnStart(pOIProtSink, pOIBindInfo);
+}
+
+inline STDMETHODIMP CFakeTargetProtocol::Continue(
+	/* [in] */ PROTOCOLDATA *pProtocolData)
+{
+	++m_cContinue;
+	return pProtocolData ? S_OK : E_POINTER;
+}
+
+inline STDMETHODIMP CFakeTargetProtocol::Abort(
+	/* [in] */ HRESULT hrReason,
+	/* [in] */ DWORD dwOptions)
+{
+	++m_cAbort;
+	m_bAborted = true;
+	return ReportResult(hrReason);
+}
+
+inline STDMETHODIMP CFakeTargetProtocol::Terminate(
+	/* [in] */ DWORD dwOptions)
+{
+	++m_cTerminate;
+	m_spSink.Release();
+	m_spBindInfo.Release();
+	return S_OK;
+}
+
+inline STDMETHODIMP CFakeTargetProtocol::Suspend()
+{
+	return E_NOTIMPL;
+}
+
+inline STDMETHODIMP CFakeTargetProtocol::Resume()
+{
+	return E_NOTIMPL;
+}
+
+// IInternetProtocol
+inline STDMETHODIMP CFakeTargetProtocol::Read(
+	/* [in, out] */ void *pv,
+	/* [in] */ ULONG cb,
+	/* [out] */ ULONG *pcbRead)
+{
+	ATLASSERT(pv != 0 || cb == 0);
+	++m_cRead;
+
+	ULONG cbLeft = m_cbAvailable - m_cbRead;
+	ULONG cbCopy = (cb < cbLeft) ? cb : cbLeft;
+	if (cbCopy)
+	{
+		memcpy(pv, m_response.pbBody + m_cbRead, cbCopy);
+		m_cbRead += cbCopy;
+	}
+	if (pcbRead)
+	{
+		*pcbRead = cbCopy;
+	}
+
+	if (m_cbRead == m_response.cbBody &&
+		m_cbAvailable == m_response.cbBody)
+	{
+		return S_FALSE;
+	}
+	if (m_bAborted)
+	{
+		return INET_E_DATA_NOT_AVAILABLE;
+	}
+	return cbCopy ? S_OK : E_PENDING;
+}
+
+inline STDMETHODIMP CFakeTargetProtocol::Seek(
+	/* [in] */ LARGE_INTEGER dlibMove,
+	/* [in] */ DWORD dwOrigin,
+	/* [out] */ ULARGE_INTEGER *plibNewPosition)
+{
+	return E_FAIL;
+}
+
+inline STDMETHODIMP CFakeTargetProtocol::LockRequest(
+	/* [in] */ DWORD dwOptions)
+{
+	++m_cLockRequest;
+	return S_OK;
+}
+
+inline STDMETHODIMP CFakeTargetProtocol::UnlockRequest()
+{
+	--m_cLockRequest;
+	return S_OK;
+}
+
+// IInternetProtocolEx
+inline STDMETHODIMP CFakeTargetProtocol::StartEx(
+	/* [in] */ IUri *pUri,
+	/* [in] */ IInternetProtocolSink *pOIProtSink,
+	/* [in] */ IInternetBindInfo *pOIBindInfo,
+	/* [in] */ DWORD grfPI,
+	/* [in] */ HANDLE_PTR dwReserved)
+{
+	ATLASSERT(pUri != 0);
+	if (!pUri)
+	{
+		return E_POINTER;
+	}
+	++m_cStartEx;
+	return OnStart(pOIProtSink, pOIBindInfo);
+}
+
+// IInternetPriority
+inline STDMETHODIMP CFakeTargetProtocol::SetPriority(
+	/* [in] */ LONG nPriority)
+{
+	m_nPriority = nPriority;
+	return S_OK;
+}
+
+inline STDMETHODIMP CFakeTargetProtocol::GetPriority(
+	/* [out] */ LONG *pnPriority)
+{
+	if (!pnPriority)
+	{
+		return E_POINTER;
+	}
+	*pnPriority = m_nPriority;
+	return S_OK;
+}
+
+// IWinInetInfo
+inline STDMETHODIMP CFakeTargetProtocol::QueryOption(
+	/* [in] */ DWORD dwOption,
+	/* [in, out] */ LPVOID pBuffer,
+	/* [in, out] */ DWORD *pcbBuf)
+{
+	return E_NOTIMPL;
+}
+
+// IWinInetHttpInfo
+inline STDMETHODIMP CFakeTargetProtocol::QueryInfo(
+	/* [in] */ DWORD dwOption,
+	/* [in, out] */ LPVOID pBuffer,
+	/* [in, out] */ DWORD *pcbBuf,
+	/* [in, out] */ DWORD *pdwFlags,
+	/* [in, out] */ DWORD *pdwReserved)
+{
+	if (!pcbBuf)
+	{
+		return E_POINTER;
+	}
+
+	DWORD dwLevel = dwOption & 0x0000FFFF;
+	if (dwLevel == HTTP_QUERY_STATUS_CODE &&
+		(dwOption & HTTP_QUERY_FLAG_NUMBER))
+	{
+		if (!pBuffer || *pcbBuf < sizeof(DWORD))
+		{
+			*pcbBuf = sizeof(DWORD);
+			return E_OUTOFMEMORY;
+		}
+		*static_cast<DWORD*>(pBuffer) = m_response.dwStatusCode;
+		*pcbBuf = sizeof(DWORD);
+		return S_OK;
+	}
+
+	LPCWSTR szValue = 0;
+	DWORD cch = 0;
+	if (dwLevel == HTTP_QUERY_RAW_HEADERS_CRLF)
+	{
+		szValue = m_response.szHeaders;
+	}
+	else if (dwLevel == HTTP_QUERY_CONTENT_TYPE)
+	{
+		szValue = m_response.szMimeType;
+	}
+	else if (dwLevel == HTTP_QUERY_CACHE_CONTROL)
+	{
+		szValue = FindHeader(L"Cache-Control", &cch);
+	}
+	if (!szValue)
+	{
+		// What WinInet reports for a missing header
+		return S_FALSE;
+	}
+
+	// WinInet returns narrow strings through this interface
+	if (!cch)
+	{
+		cch = static_cast<DWORD>(wcslen(szValue));
+	}
+	if (!pBuffer || *pcbBuf <= cch)
+	{
+		*pcbBuf = cch + 1;
+		return E_OUTOFMEMORY;
+	}
+	char* psz = static_cast<char*>(pBuffer);
+	for (DWORD i = 0; i < cch; ++i)
+	{
+		psz[i] = static_cast<char>(szValue[i]);
+	}
+	psz[cch] = 0;
+	*pcbBuf = cch;
+	return S_OK;
+}
+
+inline LPCWSTR CFakeTargetProtocol::FindHeader(LPCWSTR szName,
+	DWORD* pcchValue) const
+{
+	ATLASSERT(szName != 0);
+	ATLASSERT(pcchValue != 0);
+	*pcchValue = 0;
+
+	size_t cchName = wcslen(szName);
+	for (LPCWSTR pch = m_response.szHeaders; pch && *pch; )
+	{
+		LPCWSTR pchEnd = wcschr(pch, L'\r');
+		if (!pchEnd)
+		{
+			pchEnd = pch + wcslen(pch);
+		}
+		bool bMatch = static_cast<size_t>(pchEnd - pch) > cchName &&
+			pch[cchName] == L':';
+		for (size_t i = 0; bMatch && i < cchName; ++i)
+		{
+			bMatch = towlower(pch[i]) == towlower(szName[i]);
+		}
+		if (bMatch)
+		{
+			LPCWSTR pchValue = pch + cchName + 1;
+			while (pchValue < pchEnd && *pchValue == L' ')
+			{
+				++pchValue;
+			}
+			if (pchValue == pchEnd)
+			{
+				return 0;
+			}
+			*pcchValue = static_cast<DWORD>(pchEnd - pchValue);
+			return pchValue;
+		}
+		pch = *pchEnd ? pchEnd + 1 : pchEnd;
+		if (*pch == L'\n')
+		{
+			++pch;
+		}
+	}
+	return 0;
+}
+
+// ===== CFakeTargetClassFactory =====
+
+inline CFakeTargetClassFactory::CFakeTargetClassFactory() :
+	m_cCreateInstance(0), m_cLock(0), m_pLastProtocol(0)
+{
+}
+
+inline HRESULT CFakeTargetClassFactory::Create(
+	const FakeResponse& response,
+	CComObject<CFakeTargetClassFactory>** ppObj)
+{
+	ATLASSERT(ppObj != 0);
+	if (!ppObj)
+	{
+		return E_POINTER;
+	}
+
+	HRESULT hr = CComObject<CFakeTargetClassFactory>::CreateInstance(ppObj);
+	if (SUCCEEDED(hr))
+	{
+		(*ppObj)->SetResponse(response);
+	}
+	return hr;
+}
+
+inline void CFakeTargetClassFactory::SetResponse(
+	const FakeResponse& response)
+{
+	m_response = response;
+}
+
+inline STDMETHODIMP CFakeTargetClassFactory::CreateInstance(
+	IUnknown* punkOuter, REFIID riid, void** ppvObj)
+{
+	ATLASSERT(ppvObj != 0);
+	if (!ppvObj)
+	{
+		return E_POINTER;
+	}
+	*ppvObj = 0;
+
+	// The passthrough APP always creates its target unaggregated
+	if (punkOuter)
+	{
+		return CLASS_E_NOAGGREGATION;
+	}
+
+	CComObject<CFakeTargetProtocol>* pProtocol = 0;
+	HRESULT hr = CComObject<CFakeTargetProtocol>::CreateInstance(&pProtocol);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+	pProtocol->SetResponse(m_response);
+
+	CComPtr<IUnknown> spUnk = pProtocol->GetUnknown();
+	hr = spUnk->QueryInterface(riid, ppvObj);
+	if (SUCCEEDED(hr))
+	{
+		++m_cCreateInstance;
+		m_pLastProtocol = pProtocol;
+	}
+	return hr;
+}
+
+inline STDMETHODIMP CFakeTargetClassFactory::LockServer(BOOL fLock)
+{
+	if (fLock)
+	{
+		InterlockedIncrement(&m_cLock);
+	}
+	else
+	{
+		InterlockedDecrement(&m_cLock);
+	}
+	return S_OK;
+}
+
+// ===== CFakeClientSink =====
+
+inline CFakeClientSink::CFakeClientSink() :
+	m_pProtocol(0), m_grfBINDF(BINDF_ASYNCHRONOUS | BINDF_ASYNCSTORAGE |
+		BINDF_PULLDATA), m_dwBindVerb(BINDVERB_GET),
+	m_cbReadSize(sizeof(m_readBuffer)), m_dwThreadId(GetCurrentThreadId()),
+	m_cPending(0)
+{
+	Reset();
+}
+
+inline void CFakeClientSink::SetProtocol(IInternetProtocol* pProtocol)
+{
+	m_pProtocol = pProtocol;
+}
+
+inline void CFakeClientSink::SetBindInfo(DWORD grfBINDF, DWORD dwBindVerb)
+{
+	m_grfBINDF = grfBINDF;
+	m_dwBindVerb = dwBindVerb;
+}
+
+inline void CFakeClientSink::SetReadSize(ULONG cbRead)
+{
+	m_cbReadSize = (cbRead < sizeof(m_readBuffer)) ?
+		cbRead : sizeof(m_readBuffer);
+}
+
+inline void CFakeClientSink::Reset()
+{
+	m_cSwitch = 0;
+	m_cReportProgress = 0;
+	m_cReportData = 0;
+	m_cReportResult = 0;
+	m_cRead = 0;
+	m_ulLastStatusCode = 0;
+	m_hrResult = E_PENDING;
+	m_cbReceived = 0;
+	m_dwBodyHash = HashBytes(0, 0);
+}
+
+inline DWORD CFakeClientSink::HashBytes(const BYTE* pb, ULONG cb,
+	DWORD dwHash)
+{
+	for (ULONG i = 0; i < cb; ++i)
+	{
+		dwHash = (dwHash ^ pb[i]) * 16777619u;
+	}
+	return dwHash;
+}
+
+inline HRESULT CFakeClientSink::ReadAvailable()
+{
+	ATLASSERT(m_pProtocol != 0);
+	if (!m_pProtocol)
+	{
+		return E_UNEXPECTED;
+	}
+
+	HRESULT hr = S_OK;
+	do
+	{
+		ULONG cbRead = 0;
+		++m_cRead;
+		hr = m_pProtocol->Read(m_readBuffer, m_cbReadSize, &cbRead);
+		if (FAILED(hr) && hr != E_PENDING)
+		{
+			break;
+		}
+		m_dwBodyHash = HashBytes(m_readBuffer, cbRead, m_dwBodyHash);
+		m_cbReceived += cbRead;
+		if (!cbRead)
+		{
+			break;
+		}
+	}
+	while (hr == S_OK);
+	return hr;
+}
+
+inline ULONG CFakeClientSink::ContinuePending()
+{
+	ULONG cContinued = 0;
+	for (;;)
+	{
+		PROTOCOLDATA* pProtocolData = 0;
+		{
+			CComCritSecLock<CComAutoCriticalSection> lock(m_csPending);
+			if (!m_cPending)
+			{
+				break;
+			}
+			pProtocolData = m_apPending[0];
+			--m_cPending;
+			memmove(m_apPending, m_apPending + 1,
+				m_cPending * sizeof(m_apPending[0]));
+		}
+		if (m_pProtocol)
+		{
+			m_pProtocol->Continue(pProtocolData);
+			++cContinued;
+		}
+	}
+	return cContinued;
+}
+
+// IInternetProtocolSink
+inline STDMETHODIMP CFakeClientSink::Switch(
+	/* [in] */ PROTOCOLDATA *pProtocolData)
+{
+	InterlockedIncrement(&m_cSwitch);
+	if (GetCurrentThreadId() != m_dwThreadId)
+	{
+		CComCritSecLock<CComAutoCriticalSection> lock(m_csPending);
+		if (m_cPending == sizeof(m_apPending) / sizeof(m_apPending[0]))
+		{
+			return E_OUTOFMEMORY;
+		}
+		m_apPending[m_cPending++] = pProtocolData;
+		return S_OK;
+	}
+	// urlmon would post this to the apartment thread, which is the
+	// current one, so continue synchronously
+	return m_pProtocol ? m_pProtocol->Continue(pProtocolData) : S_OK;
+}
+
+inline STDMETHODIMP CFakeClientSink::ReportProgress(
+	/* [in] */ ULONG ulStatusCode,
+	/* [in] */ LPCWSTR szStatusText)
+{
+	++m_cReportProgress;
+	m_ulLastStatusCode = ulStatusCode;
+	return S_OK;
+}
+
+inline STDMETHODIMP CFakeClientSink::ReportData(
+	/* [in] */ DWORD grfBSCF,
+	/* [in] */ ULONG ulProgress,
+	/* [in] */ ULONG ulProgressMax)
+{
+	++m_cReportData;
+	if (m_pProtocol && m_cbReadSize)
+	{
+		ReadAvailable();
+	}
+	return S_OK;
+}
+
+inline STDMETHODIMP CFakeClientSink::ReportResult(
+	/* [in] */ HRESULT hrResult,
+	/* [in] */ DWORD dwError,
+	/* [in] */ LPCWSTR szResult)
+{
+	++m_cReportResult;
+	m_hrResult = hrResult;
+	return S_OK;
+}
+
+// IInternetBindInfo
+inline STDMETHODIMP CFakeClientSink::GetBindInfo(
+	/* [out] */ DWORD *grfBINDF,
+	/* [in, out] */ BINDINFO *pbindinfo)
+{
+	if (!grfBINDF || !pbindinfo || !pbindinfo->cbSize)
+	{
+		return E_INVALIDARG;
+	}
+
+	*grfBINDF = m_grfBINDF;
+	ULONG cbSize = pbindinfo->cbSize;
+	memset(pbindinfo, 0, cbSize);
+	pbindinfo->cbSize = cbSize;
+	pbindinfo->dwBindVerb = m_dwBindVerb;
+	return S_OK;
+}
+
+inline STDMETHODIMP CFakeClientSink::GetBindString(
+	/* [in] */ ULONG ulStringType,
+	/* [in, out] */ LPOLESTR *ppwzStr,
+	/* [in] */ ULONG cEl,
+	/* [in, out] */ ULONG *pcElFetched)
+{
+	return E_NOTIMPL;
+}
+
+// IInternetBindInfoEx
+inline STDMETHODIMP CFakeClientSink::GetBindInfoEx(
+	/* [out] */ DWORD *grfBINDF,
+	/* [in, out] */ BINDINFO *pbindinfo,
+	/* [out] */ DWORD *grfBINDF2,
+	/* [out] */ DWORD *pdwReserved)
+{
+	HRESULT hr = GetBindInfo(grfBINDF, pbindinfo);
+	if (SUCCEEDED(hr))
+	{
+		if (grfBINDF2)
+		{
+			*grfBINDF2 = 0;
+		}
+		if (pdwReserved)
+		{
+			*pdwReserved = 0;
+		}
+	}
+	return hr;
+}
+
+// IServiceProvider
+inline STDMETHODIMP CFakeClientSink::QueryService(
+	/* [in] */ REFGUID guidService,
+	/* [in] */ REFIID riid,
+	/* [out] */ void** ppvObject)
+{
+	if (!ppvObject)
+	{
+		return E_POINTER;
+	}
+	*ppvObject = 0;
+	return E_NOINTERFACE;
+}
+
+} // end namespace PassthroughAPP
+
+#endif // PASSTHROUGHAPP_FAKEPROTOCOL_INL
@@ -0,0 +1,649 @@
+#ifndef PASSTHROUGHAPP_PORTABLE_ATLBASE_H
+#define PASSTHROUGHAPP_PORTABLE_ATLBASE_H
+
+// Minimal stand-in for <atlbase.h>: smart pointers, thread models,
+// critical sections, the module lock count and CComObjectRootEx with
+// table driven QueryInterface. See windows.h in this directory for the
+// rationale.
+
+#include "windows.h"
+#include "urlmon.h"
+
+#include <assert.h>
+
+#define _ATL_VER 0x0C00
+
+#ifndef ATLASSERT
+	#define ATLASSERT(expr) assert(expr)
+#endif
+#define ATLASSUME(expr) ATLASSERT(expr)
+#define ATLENSURE_RETURN(expr) \
+	do { if (!(expr)) return E_FAIL; } while (0)
+#define ATLTRACE(...) ((void)0)
+#define ATLTRY(x) try { x; } catch (...) {}
+#define ATL_NO_VTABLE
+#define _T(x) x
+
+#define _ATL_PACKING 8
+#define offsetofclass(base, derived) \
+	((DWORD_PTR)(static_cast<base*>((derived*)_ATL_PACKING)) - _ATL_PACKING)
+
+#define _ATL_IIDOF(x) __uuidof(x)
+
+inline BOOL InlineIsEqualUnknown(REFGUID rguid1)
+{
+	return InlineIsEqualGUID(rguid1, IID_IUnknown);
+}
+
+namespace ATL
+{
+
+// ===== Critical sections =====
+
+class CComCriticalSection
+{
+public:
+	CComCriticalSection()
+	{
+		memset(&m_sec, 0, sizeof(m_sec));
+	}
+	HRESULT Lock()
+	{
+		EnterCriticalSection(&m_sec);
+		return S_OK;
+	}
+	HRESULT Unlock()
+	{
+		LeaveCriticalSection(&m_sec);
+		return S_OK;
+	}
+	HRESULT Init()
+	{
+		return InitializeCriticalSectionAndSpinCount(&m_sec, 0) ?
+			S_OK : E_OUTOFMEMORY;
+	}
+	HRESULT Term()
+	{
+		DeleteCriticalSection(&m_sec);
+		return S_OK;
+	}
+	CRITICAL_SECTION m_sec;
+};
+
+class CComAutoCriticalSection : public CComCriticalSection
+{
+public:
+	CComAutoCriticalSection()
+	{
+		CComCriticalSection::Init();
+	}
+	~CComAutoCriticalSection()
+	{
+		CComCriticalSection::Term();
+	}
+private:
+	CComAutoCriticalSection(const CComAutoCriticalSection&);
+	CComAutoCriticalSection& operator=(const CComAutoCriticalSection&);
+	HRESULT Init();
+	HRESULT Term();
+};
+
+class CComSafeDeleteCriticalSection : public CComCriticalSection
+{
+public:
+	CComSafeDeleteCriticalSection() : m_bInitialized(false)
+	{
+	}
+	~CComSafeDeleteCriticalSection()
+	{
+		if (m_bInitialized)
+		{
+			m_bInitialized = false;
+			CComCriticalSection::Term();
+		}
+	}
+	HRESULT Init()
+	{
+		ATLASSERT(!m_bInitialized);
+		HRESULT hr = CComCriticalSection::Init();
+		if (SUCCEEDED(hr))
+		{
+			m_bInitialized = true;
+		}
+		return hr;
+	}
+	HRESULT Term()
+	{
+		if (!m_bInitialized)
+		{
+			return S_OK;
+		}
+		m_bInitialized = false;
+		return CComCriticalSection::Term();
+	}
+	HRESULT Lock()
+	{
+		ATLASSERT(m_bInitialized);
+		return CComCriticalSection::Lock();
+	}
+private:
+	bool m_bInitialized;
+};
+
+class CComAutoDeleteCriticalSection : public CComSafeDeleteCriticalSection
+{
+private:
+	HRESULT Term();
+};
+
+class CComFakeCriticalSection
+{
+public:
+	HRESULT Lock() {return S_OK;}
+	HRESULT Unlock() {return S_OK;}
+	HRESULT Init() {return S_OK;}
+	HRESULT Term() {return S_OK;}
+};
+
+template <class TLock>
+class CComCritSecLock
+{
+public:
+	CComCritSecLock(TLock& cs, bool bInitialLock = true) :
+		m_cs(cs), m_bLocked(false)
+	{
+		if (bInitialLock)
+		{
+			Lock();
+		}
+	}
+	~CComCritSecLock()
+	{
+		if (m_bLocked)
+		{
+			Unlock();
+		}
+	}
+	HRESULT Lock()
+	{
+		ATLASSERT(!m_bLocked);
+		HRESULT hr = m_cs.Lock();
+		if (SUCCEEDED(hr))
+		{
+			m_bLocked = true;
+		}
+		return hr;
+	}
+	void Unlock()
+	{
+		ATLASSERT(m_bLocked);
+		m_cs.Unlock();
+		m_bLocked = false;
+	}
+private:
+	TLock& m_cs;
+	bool m_bLocked;
+
+	CComCritSecLock(const CComCritSecLock&);
+	CComCritSecLock& operator=(const CComCritSecLock&);
+};
+
+// ===== Thread models =====
+
+class CComMultiThreadModelNoCS
+{
+public:
+	static ULONG WINAPI Increment(LPLONG p) {return InterlockedIncrement(p);}
+	static ULONG WINAPI Decrement(LPLONG p) {return InterlockedDecrement(p);}
+	typedef CComFakeCriticalSection AutoCriticalSection;
+	typedef CComFakeCriticalSection AutoDeleteCriticalSection;
+	typedef CComFakeCriticalSection CriticalSection;
+	typedef CComMultiThreadModelNoCS ThreadModelNoCS;
+};
+
+class CComMultiThreadModel
+{
+public:
+	static ULONG WINAPI Increment(LPLONG p) {return InterlockedIncrement(p);}
+	static ULONG WINAPI Decrement(LPLONG p) {return InterlockedDecrement(p);}
+	typedef CComAutoCriticalSection AutoCriticalSection;
+	typedef CComAutoDeleteCriticalSection AutoDeleteCriticalSection;
+	typedef CComCriticalSection CriticalSection;
+	typedef CComMultiThreadModelNoCS ThreadModelNoCS;
+};
+
+class CComSingleThreadModel
+{
+public:
+	static ULONG WINAPI Increment(LPLONG p) {return ++(*p);}
+	static ULONG WINAPI Decrement(LPLONG p) {return --(*p);}
+	typedef CComFakeCriticalSection AutoCriticalSection;
+	typedef CComFakeCriticalSection AutoDeleteCriticalSection;
+	typedef CComFakeCriticalSection CriticalSection;
+	typedef CComSingleThreadModel ThreadModelNoCS;
+};
+
+typedef CComMultiThreadModel CComObjectThreadModel;
+typedef CComMultiThreadModel CComGlobalsThreadModel;
+
+// ===== Module =====
+
+class CAtlModule
+{
+public:
+	LONG Lock() {return InterlockedIncrement(&m_nLockCnt);}
+	LONG Unlock() {return InterlockedDecrement(&m_nLockCnt);}
+	LONG GetLockCount() {return m_nLockCnt;}
+
+	LONG m_nLockCnt;
+};
+
+// There is no DLL to host a real module, so the lock count lives in a
+// default instance. Assign _pAtlModule to use a different one.
+inline CAtlModule _AtlPortableModule;
+inline CAtlModule* _pAtlModule = &_AtlPortableModule;
+
+// ===== CComPtr =====
+
+template <class T>
+class CComPtr
+{
+public:
+	CComPtr() : p(0)
+	{
+	}
+	CComPtr(T* lp) : p(lp)
+	{
+		if (p)
+		{
+			p->AddRef();
+		}
+	}
+	CComPtr(const CComPtr<T>& lp) : p(lp.p)
+	{
+		if (p)
+		{
+			p->AddRef();
+		}
+	}
+	~CComPtr()
+	{
+		if (p)
+		{
+			p->Release();
+		}
+	}
+
+	operator T*() const {return p;}
+	T& operator*() const {ATLASSERT(p != 0); return *p;}
+	T** operator&() {ATLASSERT(p == 0); return &p;}
+	T* operator->() const {ATLASSERT(p != 0); return p;}
+	bool operator!() const {return p == 0;}
+	bool operator==(T* pT) const {return p == pT;}
+	bool operator!=(T* pT) const {return p != pT;}
+
+	T* operator=(T* lp)
+	{
+		if (lp != p)
+		{
+			if (lp)
+			{
+				lp->AddRef();
+			}
+			T* pOld = p;
+			p = lp;
+			if (pOld)
+			{
+				pOld->Release();
+			}
+		}
+		return p;
+	}
+	T* operator=(const CComPtr<T>& lp)
+	{
+		return *this = lp.p;
+	}
+
+	void Release()
+	{
+		T* pTemp = p;
+		if (pTemp)
+		{
+			p = 0;
+			pTemp->Release();
+		}
+	}
+	void Attach(T* p2)
+	{
+		if (p)
+		{
+			p->Release();
+		}
+		p = p2;
+	}
+	T* Detach()
+	{
+		T* pt = p;
+		p = 0;
+		return pt;
+	}
+	HRESULT CopyTo(T** ppT)
+	{
+		ATLASSERT(ppT != 0);
+		if (!ppT)
+		{
+			return E_POINTER;
+		}
+		*ppT = p;
+		if (p)
+		{
+			p->AddRef();
+		}
+		return S_OK;
+	}
+	template <class Q>
+	HRESULT QueryInterface(Q** pp) const
+	{
+		ATLASSERT(pp != 0);
+		return p->QueryInterface(__uuidof(Q), (void**)pp);
+	}
+
+	T* p;
+};
+
+template <class T, const IID* piid = &__uuidof(T)>
+class CComQIPtr : public CComPtr<T>
+{
+public:
+	CComQIPtr()
+	{
+	}
+	CComQIPtr(T* lp) : CComPtr<T>(lp)
+	{
+	}
+	CComQIPtr(const CComQIPtr<T, piid>& lp) : CComPtr<T>(lp.p)
+	{
+	}
+	CComQIPtr(IUnknown* lp)
+	{
+		if (lp)
+		{
+			lp->QueryInterface(*piid, (void**)&this->p);
+		}
+	}
+
+	T* operator=(T* lp)
+	{
+		return CComPtr<T>::operator=(lp);
+	}
+	T* operator=(const CComQIPtr<T, piid>& lp)
+	{
+		return CComPtr<T>::operator=(lp.p);
+	}
+	T* operator=(IUnknown* lp)
+	{
+		this->Release();
+		if (lp)
+		{
+			lp->QueryInterface(*piid, (void**)&this->p);
+		}
+		return this->p;
+	}
+};
+
+// ===== CComBSTR =====
+
+class CComBSTR
+{
+public:
+	CComBSTR() : m_str(0)
+	{
+	}
+	CComBSTR(LPCOLESTR pSrc) : m_str(SysAllocString(pSrc))
+	{
+	}
+	CComBSTR(int nSize, LPCOLESTR sz) : m_str(SysAllocStringLen(sz, nSize))
+	{
+	}
+	CComBSTR(const CComBSTR& src) :
+		m_str(SysAllocStringLen(src.m_str, src.Length()))
+	{
+	}
+	~CComBSTR()
+	{
+		SysFreeString(m_str);
+	}
+
+	CComBSTR& operator=(const CComBSTR& src)
+	{
+		if (m_str != src.m_str)
+		{
+			SysFreeString(m_str);
+			m_str = SysAllocStringLen(src.m_str, src.Length());
+		}
+		return *this;
+	}
+
+	operator BSTR() const {return m_str;}
+	BSTR* operator&() {ATLASSERT(m_str == 0); return &m_str;}
+	bool operator!() const {return m_str == 0;}
+	unsigned int Length() const {return SysStringLen(m_str);}
+	unsigned int ByteLength() const {return SysStringByteLen(m_str);}
+
+	void Empty()
+	{
+		SysFreeString(m_str);
+		m_str = 0;
+	}
+	void Attach(BSTR src)
+	{
+		SysFreeString(m_str);
+		m_str = src;
+	}
+	BSTR Detach()
+	{
+		BSTR s = m_str;
+		m_str = 0;
+		return s;
+	}
+	BSTR Copy() const
+	{
+		return m_str ? SysAllocStringLen(m_str, Length()) : 0;
+	}
+
+	BSTR m_str;
+};
+
+// ===== Interface maps =====
+
+typedef HRESULT (WINAPI _ATL_CREATORFUNC)(void* pv, REFIID riid,
+	LPVOID* ppv);
+typedef HRESULT (WINAPI _ATL_CREATORARGFUNC)(void* pv, REFIID riid,
+	LPVOID* ppv, DWORD_PTR dw);
+
+struct _ATL_INTMAP_ENTRY
+{
+	const IID* piid;
+	DWORD_PTR dw;
+	_ATL_CREATORARGFUNC* pFunc;
+};
+
+struct _ATL_CHAINDATA
+{
+	DWORD_PTR dwOffset;
+	const _ATL_INTMAP_ENTRY* (WINAPI *pFunc)();
+};
+
+#define _ATL_SIMPLEMAPENTRY ((::ATL::_ATL_CREATORARGFUNC*)1)
+
+inline HRESULT WINAPI AtlInternalQueryInterface(void* pThis,
+	const _ATL_INTMAP_ENTRY* pEntries, REFIID iid, void** ppvObject)
+{
+	ATLASSERT(pThis != 0);
+	ATLASSERT(pEntries != 0);
+	if (!pThis || !pEntries)
+	{
+		return E_INVALIDARG;
+	}
+	// First entry in the com map should be a simple map entry
+	ATLASSERT(pEntries->pFunc == _ATL_SIMPLEMAPENTRY);
+	if (!ppvObject)
+	{
+		return E_POINTER;
+	}
+	*ppvObject = 0;
+	if (InlineIsEqualUnknown(iid))
+	{
+		IUnknown* pUnk = (IUnknown*)((INT_PTR)pThis + pEntries->dw);
+		pUnk->AddRef();
+		*ppvObject = pUnk;
+		return S_OK;
+	}
+	while (pEntries->pFunc != 0)
+	{
+		BOOL bBlind = (pEntries->piid == 0);
+		if (bBlind || InlineIsEqualGUID(*(pEntries->piid), iid))
+		{
+			if (pEntries->pFunc == _ATL_SIMPLEMAPENTRY)
+			{
+				IUnknown* pUnk = (IUnknown*)((INT_PTR)pThis + pEntries->dw);
+				pUnk->AddRef();
+				*ppvObject = pUnk;
+				return S_OK;
+			}
+			HRESULT hRes = pEntries->pFunc(pThis, iid, ppvObject,
+				pEntries->dw);
+			if (hRes == S_OK || (!bBlind && FAILED(hRes)))
+			{
+				return hRes;
+			}
+		}
+		pEntries++;
+	}
+	return E_NOINTERFACE;
+}
+
+// ===== CComObjectRootBase / CComObjectRootEx =====
+
+class CComObjectRootBase
+{
+public:
+	CComObjectRootBase()
+	{
+		m_dwRef = 0L;
+	}
+
+	HRESULT FinalConstruct() {return S_OK;}
+	HRESULT _AtlFinalConstruct() {return S_OK;}
+	void FinalRelease() {}
+	void _AtlFinalRelease() {}
+
+	void SetVoid(void*) {}
+	void InternalFinalConstructAddRef() {}
+	void InternalFinalConstructRelease()
+	{
+		ATLASSERT(m_dwRef == 0);
+	}
+
+	static HRESULT WINAPI InternalQueryInterface(void* pThis,
+		const _ATL_INTMAP_ENTRY* pEntries, REFIID iid, void** ppvObject)
+	{
+		return AtlInternalQueryInterface(pThis, pEntries, iid, ppvObject);
+	}
+
+	ULONG OuterAddRef()
+	{
+		return m_pOuterUnknown->AddRef();
+	}
+	ULONG OuterRelease()
+	{
+		return m_pOuterUnknown->Release();
+	}
+	HRESULT OuterQueryInterface(REFIID iid, void** ppvObject)
+	{
+		return m_pOuterUnknown->QueryInterface(iid, ppvObject);
+	}
+
+	static HRESULT WINAPI _Chain(void* pv, REFIID iid, void** ppvObject,
+		DWORD_PTR dw)
+	{
+		_ATL_CHAINDATA* pcd = (_ATL_CHAINDATA*)dw;
+		void* p = (void*)((DWORD_PTR)pv + pcd->dwOffset);
+		return InternalQueryInterface(p, pcd->pFunc(), iid, ppvObject);
+	}
+
+	union
+	{
+		LONG m_dwRef;
+		IUnknown* m_pOuterUnknown;
+	};
+};
+
+template <class ThreadModel>
+class CComObjectLockT;
+
+template <class ThreadModel>
+class CComObjectRootEx : public CComObjectRootBase
+{
+public:
+	typedef ThreadModel _ThreadModel;
+	typedef typename _ThreadModel::AutoCriticalSection _CritSec;
+	typedef typename _ThreadModel::AutoDeleteCriticalSection _AutoDelCritSec;
+	typedef CComObjectLockT<_ThreadModel> ObjectLock;
+
+	ULONG InternalAddRef()
+	{
+		ATLASSERT(m_dwRef != -1L);
+		return _ThreadModel::Increment(&m_dwRef);
+	}
+	ULONG InternalRelease()
+	{
+		return _ThreadModel::Decrement(&m_dwRef);
+	}
+
+	HRESULT _AtlInitialConstruct()
+	{
+		return m_critsec.Init();
+	}
+	void Lock() {m_critsec.Lock();}
+	void Unlock() {m_critsec.Unlock();}
+private:
+	_AutoDelCritSec m_critsec;
+};
+
+template <class ThreadModel>
+class CComObjectLockT
+{
+public:
+	CComObjectLockT(CComObjectRootEx<ThreadModel>* p)
+	{
+		if (p)
+		{
+			p->Lock();
+		}
+		m_p = p;
+	}
+	~CComObjectLockT()
+	{
+		if (m_p)
+		{
+			m_p->Unlock();
+		}
+	}
+	CComObjectRootEx<ThreadModel>* m_p;
+};
+
+template <>
+class CComObjectLockT<CComSingleThreadModel>
+{
+public:
+	CComObjectLockT(CComObjectRootEx<CComSingleThreadModel>*) {}
+};
+
+typedef CComObjectRootEx<CComObjectThreadModel> CComObjectRoot;
+
+} // end namespace ATL
+
+using namespace ATL;
+
+#endif // PASSTHROUGHAPP_PORTABLE_ATLBASE_H
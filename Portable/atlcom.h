@@ -0,0 +1,467 @@
+#ifndef PASSTHROUGHAPP_PORTABLE_ATLCOM_H
+#define PASSTHROUGHAPP_PORTABLE_ATLCOM_H
+
+// Minimal stand-in for <atlcom.h>: interface and service maps, the
+// CComObject family, creators and CComClassFactory. See windows.h in this
+// directory for the rationale.
+
+#include "atlbase.h"
+
+// ===== Interface maps =====
+
+// Unlike ATL's own macros, these qualify every helper so that they can be
+// used in class templates with dependent bases under two-phase lookup
+#define BEGIN_COM_MAP(x) public: \
+	typedef x _ComMapClass; \
+	IUnknown* _GetRawUnknown() \
+	{ \
+		ATLASSERT(_GetEntries()[0].pFunc == _ATL_SIMPLEMAPENTRY); \
+		return (IUnknown*)((INT_PTR)this + _GetEntries()->dw); \
+	} \
+	IUnknown* GetUnknown() {return _GetRawUnknown();} \
+	HRESULT _InternalQueryInterface(REFIID iid, void** ppvObject) \
+	{ \
+		return this->InternalQueryInterface( \
+			this, _GetEntries(), iid, ppvObject); \
+	} \
+	static const ::ATL::_ATL_INTMAP_ENTRY* WINAPI _GetEntries() \
+	{ \
+		static const ::ATL::_ATL_INTMAP_ENTRY _entries[] = {
+
+#define END_COM_MAP() \
+			{0, 0, 0} \
+		}; \
+		return _entries; \
+	} \
+	STDMETHOD_(ULONG, AddRef)() = 0; \
+	STDMETHOD_(ULONG, Release)() = 0; \
+	STDMETHOD(QueryInterface)(REFIID, void**) = 0;
+
+#define COM_INTERFACE_ENTRY(x) \
+	{&_ATL_IIDOF(x), offsetofclass(x, _ComMapClass), _ATL_SIMPLEMAPENTRY},
+
+#define COM_INTERFACE_ENTRY_IID(iid, x) \
+	{&iid, offsetofclass(x, _ComMapClass), _ATL_SIMPLEMAPENTRY},
+
+#define COM_INTERFACE_ENTRY2(x, x2) \
+	{&_ATL_IIDOF(x), \
+	reinterpret_cast<DWORD_PTR>(static_cast<x*>(static_cast<x2*>( \
+		reinterpret_cast<_ComMapClass*>(8)))) - 8, \
+	_ATL_SIMPLEMAPENTRY},
+
+#define COM_INTERFACE_ENTRY_FUNC(iid, dw, func) \
+	{&iid, dw, func},
+
+#define COM_INTERFACE_ENTRY_FUNC_BLIND(dw, func) \
+	{0, dw, func},
+
+#define COM_INTERFACE_ENTRY_CHAIN(classname) \
+	{0, \
+	(DWORD_PTR)&::ATL::_CComChainData<classname, _ComMapClass>::data, \
+	::ATL::CComObjectRootBase::_Chain},
+
+// ===== Service maps =====
+
+#define BEGIN_SERVICE_MAP(x) public: \
+	HRESULT _InternalQueryService(REFGUID guidService, REFIID riid, \
+		void** ppvObject) \
+	{ \
+		ATLASSERT(ppvObject != 0); \
+		if (!ppvObject) \
+		{ \
+			return E_POINTER; \
+		} \
+		*ppvObject = 0;
+
+#define SERVICE_ENTRY(x) \
+		if (InlineIsEqualGUID(guidService, x)) \
+		{ \
+			return QueryInterface(riid, ppvObject); \
+		}
+
+#define END_SERVICE_MAP() \
+		return E_NOINTERFACE; \
+	}
+
+// ===== Aggregation declarations =====
+
+#define DECLARE_NOT_AGGREGATABLE(x) public: \
+	typedef ::ATL::CComCreator2< \
+		::ATL::CComCreator< ::ATL::CComObject<x> >, \
+		::ATL::CComFailCreator<CLASS_E_NOAGGREGATION> > _CreatorClass;
+
+#define DECLARE_AGGREGATABLE(x) public: \
+	typedef ::ATL::CComCreator2< \
+		::ATL::CComCreator< ::ATL::CComObject<x> >, \
+		::ATL::CComCreator< ::ATL::CComAggObject<x> > > _CreatorClass;
+
+#define DECLARE_ONLY_AGGREGATABLE(x) public: \
+	typedef ::ATL::CComCreator2< \
+		::ATL::CComFailCreator<E_FAIL>, \
+		::ATL::CComCreator< ::ATL::CComAggObject<x> > > _CreatorClass;
+
+namespace ATL
+{
+
+template <class base, class derived>
+class _CComChainData
+{
+public:
+	static _ATL_CHAINDATA data;
+};
+
+template <class base, class derived>
+_ATL_CHAINDATA _CComChainData<base, derived>::data =
+	{offsetofclass(base, derived), base::_GetEntries};
+
+// ===== CComObject family =====
+
+template <class Base>
+class CComObject : public Base
+{
+public:
+	typedef Base _BaseClass;
+
+	CComObject(void* = 0)
+	{
+		_pAtlModule->Lock();
+	}
+	virtual ~CComObject()
+	{
+		this->m_dwRef = -(0x7fffffff / 2);
+		this->FinalRelease();
+		_pAtlModule->Unlock();
+	}
+
+	STDMETHOD_(ULONG, AddRef)()
+	{
+		return this->InternalAddRef();
+	}
+	STDMETHOD_(ULONG, Release)()
+	{
+		ULONG l = this->InternalRelease();
+		if (l == 0)
+		{
+			delete this;
+		}
+		return l;
+	}
+	STDMETHOD(QueryInterface)(REFIID iid, void** ppvObject)
+	{
+		return this->_InternalQueryInterface(iid, ppvObject);
+	}
+	template <class Q>
+	HRESULT STDMETHODCALLTYPE QueryInterface(Q** pp)
+	{
+		return QueryInterface(__uuidof(Q), (void**)pp);
+	}
+
+	static HRESULT WINAPI CreateInstance(CComObject<Base>** pp);
+};
+
+template <class Base>
+inline HRESULT WINAPI CComObject<Base>::CreateInstance(CComObject<Base>** pp)
+{
+	ATLASSERT(pp != 0);
+	if (!pp)
+	{
+		return E_POINTER;
+	}
+	*pp = 0;
+
+	HRESULT hRes = E_OUTOFMEMORY;
+	CComObject<Base>* p = 0;
+	ATLTRY(p = new CComObject<Base>())
+	if (p != 0)
+	{
+		p->SetVoid(0);
+		p->InternalFinalConstructAddRef();
+		hRes = p->_AtlInitialConstruct();
+		if (SUCCEEDED(hRes))
+			hRes = p->FinalConstruct();
+		if (SUCCEEDED(hRes))
+			hRes = p->_AtlFinalConstruct();
+		p->InternalFinalConstructRelease();
+		if (hRes != S_OK)
+		{
+			delete p;
+			p = 0;
+		}
+	}
+	*pp = p;
+	return hRes;
+}
+
+template <class Base>
+class CComObjectNoLock : public Base
+{
+public:
+	typedef Base _BaseClass;
+
+	CComObjectNoLock(void* = 0)
+	{
+	}
+	virtual ~CComObjectNoLock()
+	{
+		this->m_dwRef = -(0x7fffffff / 2);
+		this->FinalRelease();
+	}
+
+	STDMETHOD_(ULONG, AddRef)()
+	{
+		return this->InternalAddRef();
+	}
+	STDMETHOD_(ULONG, Release)()
+	{
+		ULONG l = this->InternalRelease();
+		if (l == 0)
+		{
+			delete this;
+		}
+		return l;
+	}
+	STDMETHOD(QueryInterface)(REFIID iid, void** ppvObject)
+	{
+		return this->_InternalQueryInterface(iid, ppvObject);
+	}
+};
+
+template <class Base>
+class CComContainedObject : public Base
+{
+public:
+	typedef Base _BaseClass;
+
+	CComContainedObject(void* pv)
+	{
+		this->m_pOuterUnknown = (IUnknown*)pv;
+	}
+
+	STDMETHOD_(ULONG, AddRef)()
+	{
+		return this->OuterAddRef();
+	}
+	STDMETHOD_(ULONG, Release)()
+	{
+		return this->OuterRelease();
+	}
+	STDMETHOD(QueryInterface)(REFIID iid, void** ppvObject)
+	{
+		return this->OuterQueryInterface(iid, ppvObject);
+	}
+	template <class Q>
+	HRESULT STDMETHODCALLTYPE QueryInterface(Q** pp)
+	{
+		return QueryInterface(__uuidof(Q), (void**)pp);
+	}
+
+	IUnknown* GetControllingUnknown()
+	{
+		return this->m_pOuterUnknown;
+	}
+};
+
+template <class contained>
+class CComAggObject :
+	public IUnknown,
+	public CComObjectRootEx<typename contained::_ThreadModel::ThreadModelNoCS>
+{
+public:
+	typedef contained _BaseClass;
+
+	CComAggObject(void* pv) : m_contained(pv)
+	{
+		_pAtlModule->Lock();
+	}
+	virtual ~CComAggObject()
+	{
+		this->m_dwRef = -(0x7fffffff / 2);
+		FinalRelease();
+		_pAtlModule->Unlock();
+	}
+
+	HRESULT _AtlInitialConstruct()
+	{
+		HRESULT hr = m_contained._AtlInitialConstruct();
+		if (SUCCEEDED(hr))
+		{
+			hr = CComObjectRootEx<typename contained::_ThreadModel::
+				ThreadModelNoCS>::_AtlInitialConstruct();
+		}
+		return hr;
+	}
+	HRESULT FinalConstruct()
+	{
+		this->InternalAddRef();
+		HRESULT hr = m_contained.FinalConstruct();
+		if (SUCCEEDED(hr))
+		{
+			hr = m_contained._AtlFinalConstruct();
+		}
+		this->InternalRelease();
+		return hr;
+	}
+	void FinalRelease()
+	{
+		m_contained.FinalRelease();
+	}
+
+	STDMETHOD_(ULONG, AddRef)()
+	{
+		return this->InternalAddRef();
+	}
+	STDMETHOD_(ULONG, Release)()
+	{
+		ULONG l = this->InternalRelease();
+		if (l == 0)
+		{
+			delete this;
+		}
+		return l;
+	}
+	STDMETHOD(QueryInterface)(REFIID iid, void** ppvObject)
+	{
+		ATLASSERT(ppvObject != 0);
+		if (!ppvObject)
+		{
+			return E_POINTER;
+		}
+		*ppvObject = 0;
+
+		if (InlineIsEqualUnknown(iid))
+		{
+			*ppvObject = static_cast<IUnknown*>(this);
+			AddRef();
+			return S_OK;
+		}
+		return m_contained._InternalQueryInterface(iid, ppvObject);
+	}
+
+	CComContainedObject<contained> m_contained;
+};
+
+// ===== Creators =====
+
+template <class T1>
+class CComCreator
+{
+public:
+	static HRESULT WINAPI CreateInstance(void* pv, REFIID riid, LPVOID* ppv)
+	{
+		ATLASSERT(ppv != 0);
+		if (!ppv)
+		{
+			return E_POINTER;
+		}
+		*ppv = 0;
+
+		HRESULT hRes = E_OUTOFMEMORY;
+		T1* p = 0;
+		ATLTRY(p = new T1(pv))
+		if (p != 0)
+		{
+			p->SetVoid(pv);
+			p->InternalFinalConstructAddRef();
+			hRes = p->_AtlInitialConstruct();
+			if (SUCCEEDED(hRes))
+				hRes = p->FinalConstruct();
+			if (SUCCEEDED(hRes))
+				hRes = p->_AtlFinalConstruct();
+			p->InternalFinalConstructRelease();
+			if (hRes == S_OK)
+				hRes = p->QueryInterface(riid, ppv);
+			if (hRes != S_OK)
+				delete p;
+		}
+		return hRes;
+	}
+};
+
+template <HRESULT hr>
+class CComFailCreator
+{
+public:
+	static HRESULT WINAPI CreateInstance(void*, REFIID, LPVOID* ppv)
+	{
+		if (!ppv)
+		{
+			return E_POINTER;
+		}
+		*ppv = 0;
+		return hr;
+	}
+};
+
+template <class T1, class T2>
+class CComCreator2
+{
+public:
+	static HRESULT WINAPI CreateInstance(void* pv, REFIID riid, LPVOID* ppv)
+	{
+		ATLASSERT(ppv != 0);
+		return (pv == 0) ?
+			T1::CreateInstance(0, riid, ppv) :
+			T2::CreateInstance(pv, riid, ppv);
+	}
+};
+
+// ===== CComClassFactory =====
+
+class CComClassFactory :
+	public IClassFactory,
+	public CComObjectRootEx<CComGlobalsThreadModel>
+{
+public:
+	BEGIN_COM_MAP(CComClassFactory)
+		COM_INTERFACE_ENTRY(IClassFactory)
+	END_COM_MAP()
+
+	virtual ~CComClassFactory()
+	{
+	}
+
+	// IClassFactory
+	STDMETHOD(CreateInstance)(LPUNKNOWN pUnkOuter, REFIID riid, void** ppvObj)
+	{
+		ATLASSERT(m_pfnCreateInstance != 0);
+		HRESULT hRes = E_POINTER;
+		if (ppvObj != 0)
+		{
+			*ppvObj = 0;
+			// can't ask for anything other than IUnknown when aggregating
+			if ((pUnkOuter != 0) && !InlineIsEqualUnknown(riid))
+			{
+				hRes = CLASS_E_NOAGGREGATION;
+			}
+			else
+			{
+				hRes = m_pfnCreateInstance(pUnkOuter, riid, ppvObj);
+			}
+		}
+		return hRes;
+	}
+
+	STDMETHOD(LockServer)(BOOL fLock)
+	{
+		if (fLock)
+		{
+			_pAtlModule->Lock();
+		}
+		else
+		{
+			_pAtlModule->Unlock();
+		}
+		return S_OK;
+	}
+
+	void SetVoid(void* pv)
+	{
+		m_pfnCreateInstance = (_ATL_CREATORFUNC*)pv;
+	}
+
+	_ATL_CREATORFUNC* m_pfnCreateInstance;
+};
+
+} // end namespace ATL
+
+#endif // PASSTHROUGHAPP_PORTABLE_ATLCOM_H
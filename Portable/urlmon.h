@@ -0,0 +1,1005 @@
+#ifndef PASSTHROUGHAPP_PORTABLE_URLMON_H
+#define PASSTHROUGHAPP_PORTABLE_URLMON_H
+
+// Minimal stand-in for <urlmon.h> (plus the few <servprov.h> and
+// <wininet.h> definitions the toolkit relies on). See windows.h in this
+// directory for the rationale.
+
+#include "windows.h"
+
+#include <wctype.h>
+
+#include <string>
+
+// ===== Enumerations and flags =====
+
+typedef enum tagBINDSTATUS
+{
+	BINDSTATUS_FINDINGRESOURCE = 1,
+	BINDSTATUS_CONNECTING,
+	BINDSTATUS_REDIRECTING,
+	BINDSTATUS_BEGINDOWNLOADDATA,
+	BINDSTATUS_DOWNLOADINGDATA,
+	BINDSTATUS_ENDDOWNLOADDATA,
+	BINDSTATUS_BEGINDOWNLOADCOMPONENTS,
+	BINDSTATUS_INSTALLINGCOMPONENTS,
+	BINDSTATUS_ENDDOWNLOADCOMPONENTS,
+	BINDSTATUS_USINGCACHEDCOPY,
+	BINDSTATUS_SENDINGREQUEST,
+	BINDSTATUS_CLASSIDAVAILABLE,
+	BINDSTATUS_MIMETYPEAVAILABLE,
+	BINDSTATUS_CACHEFILENAMEAVAILABLE,
+	BINDSTATUS_BEGINSYNCOPERATION,
+	BINDSTATUS_ENDSYNCOPERATION,
+	BINDSTATUS_BEGINUPLOADDATA,
+	BINDSTATUS_UPLOADINGDATA,
+	BINDSTATUS_ENDUPLOADDATA,
+	BINDSTATUS_PROTOCOLCLASSID,
+	BINDSTATUS_ENCODING,
+	BINDSTATUS_VERIFIEDMIMETYPEAVAILABLE,
+	BINDSTATUS_CLASSINSTALLLOCATION,
+	BINDSTATUS_DECODING,
+	BINDSTATUS_LOADINGMIMEHANDLER,
+	BINDSTATUS_CONTENTDISPOSITIONATTACH,
+	BINDSTATUS_FILTERREPORTMIMETYPE,
+	BINDSTATUS_CLSIDCANINSTANTIATE,
+	BINDSTATUS_IUNKNOWNAVAILABLE,
+	BINDSTATUS_DIRECTBIND,
+	BINDSTATUS_RAWMIMETYPE,
+	BINDSTATUS_PROXYDETECTING,
+	BINDSTATUS_ACCEPTRANGES,
+	BINDSTATUS_COOKIE_SENT,
+	BINDSTATUS_COMPACT_POLICY_RECEIVED,
+	BINDSTATUS_COOKIE_SUPPRESSED,
+	BINDSTATUS_COOKIE_STATE_UNKNOWN,
+	BINDSTATUS_COOKIE_STATE_ACCEPT,
+	BINDSTATUS_COOKIE_STATE_REJECT,
+	BINDSTATUS_COOKIE_STATE_PROMPT,
+	BINDSTATUS_COOKIE_STATE_LEASH,
+	BINDSTATUS_COOKIE_STATE_DOWNGRADE,
+	BINDSTATUS_POLICY_HREF,
+	BINDSTATUS_P3P_HEADER,
+	BINDSTATUS_SESSION_COOKIE_RECEIVED,
+	BINDSTATUS_PERSISTENT_COOKIE_RECEIVED,
+	BINDSTATUS_SESSION_COOKIES_ALLOWED,
+	BINDSTATUS_CACHECONTROL,
+	BINDSTATUS_CONTENTDISPOSITIONFILENAME,
+	BINDSTATUS_MIMETEXTPLAINMISMATCH,
+	BINDSTATUS_PUBLISHERAVAILABLE,
+	BINDSTATUS_DISPLAYNAMEAVAILABLE,
+	BINDSTATUS_SSLUX_NAVBLOCKED,
+	BINDSTATUS_SERVER_MIMETYPEAVAILABLE,
+	BINDSTATUS_SNIFFED_CLASSIDAVAILABLE,
+	BINDSTATUS_64BIT_PROGRESS,
+	BINDSTATUS_LAST = BINDSTATUS_64BIT_PROGRESS,
+	BINDSTATUS_RESERVED_0,
+	BINDSTATUS_RESERVED_1,
+	BINDSTATUS_RESERVED_2,
+	BINDSTATUS_RESERVED_3,
+	BINDSTATUS_RESERVED_4,
+	BINDSTATUS_RESERVED_5,
+	BINDSTATUS_RESERVED_6,
+	BINDSTATUS_RESERVED_7,
+	BINDSTATUS_RESERVED_8,
+	BINDSTATUS_RESERVED_9,
+	BINDSTATUS_RESERVED_A,
+	BINDSTATUS_RESERVED_B,
+	BINDSTATUS_RESERVED_C,
+	BINDSTATUS_RESERVED_D,
+	BINDSTATUS_RESERVED_E,
+	BINDSTATUS_RESERVED_F,
+	BINDSTATUS_RESERVED_10,
+	BINDSTATUS_RESERVED_11,
+	BINDSTATUS_RESERVED_12,
+	BINDSTATUS_RESERVED_13,
+	BINDSTATUS_RESERVED_14,
+	BINDSTATUS_LAST_PRIVATE = BINDSTATUS_RESERVED_14
+} BINDSTATUS;
+
+typedef enum tagBSCF
+{
+	BSCF_FIRSTDATANOTIFICATION = 0x00000001,
+	BSCF_INTERMEDIATEDATANOTIFICATION = 0x00000002,
+	BSCF_LASTDATANOTIFICATION = 0x00000004,
+	BSCF_DATAFULLYAVAILABLE = 0x00000008,
+	BSCF_AVAILABLEDATASIZEUNKNOWN = 0x00000010,
+	BSCF_SKIPDRAINDATAFORFILEURLS = 0x00000020,
+	BSCF_64BITLENGTHDOWNLOAD = 0x00000040
+} BSCF;
+
+typedef enum _tagPI_FLAGS
+{
+	PI_PARSE_URL = 0x00000001,
+	PI_FILTER_MODE = 0x00000002,
+	PI_FORCE_ASYNC = 0x00000004,
+	PI_USE_WORKERTHREAD = 0x00000008,
+	PI_MIMEVERIFICATION = 0x00000010,
+	PI_CLSIDLOOKUP = 0x00000020,
+	PI_DATAPROGRESS = 0x00000040,
+	PI_SYNCHRONOUS = 0x00000080,
+	PI_APARTMENTTHREADED = 0x00000100,
+	PI_CLASSINSTALL = 0x00000200,
+	PI_PASSONBINDCTX = 0x00002000,
+	PI_NOMIMEHANDLER = 0x00008000,
+	PI_LOADAPPDIRECT = 0x00004000,
+	PD_FORCE_SWITCH = 0x00010000,
+	PI_PREFERDEFAULTHANDLER = 0x00020000
+} PI_FLAGS;
+
+typedef enum tagBINDVERB
+{
+	BINDVERB_GET = 0,
+	BINDVERB_POST = 1,
+	BINDVERB_PUT = 2,
+	BINDVERB_CUSTOM = 3,
+	BINDVERB_RESERVED1 = 4
+} BINDVERB;
+
+typedef enum tagBINDF
+{
+	BINDF_ASYNCHRONOUS = 0x00000001,
+	BINDF_ASYNCSTORAGE = 0x00000002,
+	BINDF_NOPROGRESSIVERENDERING = 0x00000004,
+	BINDF_OFFLINEOPERATION = 0x00000008,
+	BINDF_GETNEWESTVERSION = 0x00000010,
+	BINDF_NOWRITECACHE = 0x00000020,
+	BINDF_NEEDFILE = 0x00000040,
+	BINDF_PULLDATA = 0x00000080,
+	BINDF_IGNORESECURITYPROBLEM = 0x00000100,
+	BINDF_RESYNCHRONIZE = 0x00000200,
+	BINDF_HYPERLINK = 0x00000400,
+	BINDF_NO_UI = 0x00000800,
+	BINDF_SILENTOPERATION = 0x00001000,
+	BINDF_PRAGMA_NO_CACHE = 0x00002000,
+	BINDF_GETCLASSOBJECT = 0x00004000,
+	BINDF_FROMURLMON = 0x00010000,
+	BINDF_FWD_BACK = 0x00020000,
+	BINDF_FORMS_SUBMIT = 0x00040000,
+	BINDF_DIRECT_READ = 0x00080000
+} BINDF;
+
+typedef enum _tagPARSEACTION
+{
+	PARSE_CANONICALIZE = 1,
+	PARSE_FRIENDLY,
+	PARSE_SECURITY_URL,
+	PARSE_ROOTDOCUMENT,
+	PARSE_DOCUMENT,
+	PARSE_ANCHOR,
+	PARSE_ENCODE_IS_UNESCAPE,
+	PARSE_DECODE_IS_ESCAPE,
+	PARSE_PATH_FROM_URL,
+	PARSE_URL_FROM_PATH,
+	PARSE_MIME,
+	PARSE_SERVER,
+	PARSE_SCHEMA,
+	PARSE_SITE,
+	PARSE_DOMAIN,
+	PARSE_LOCATION,
+	PARSE_SECURITY_DOMAIN,
+	PARSE_ESCAPE,
+	PARSE_UNESCAPE
+} PARSEACTION;
+
+typedef enum _tagQUERYOPTION
+{
+	QUERY_EXPIRATION_DATE = 1,
+	QUERY_TIME_OF_LAST_CHANGE,
+	QUERY_CONTENT_ENCODING,
+	QUERY_CONTENT_TYPE,
+	QUERY_REFRESH,
+	QUERY_RECOMBINE,
+	QUERY_CAN_NAVIGATE,
+	QUERY_USES_NETWORK,
+	QUERY_IS_CACHED,
+	QUERY_IS_INSTALLEDENTRY,
+	QUERY_IS_CACHED_OR_MAPPED,
+	QUERY_USES_CACHE,
+	QUERY_IS_SECURE,
+	QUERY_IS_SAFE,
+	QUERY_USES_HISTORYFOLDER,
+	QUERY_IS_CACHED_AND_USABLE_OFFLINE
+} QUERYOPTION;
+
+typedef enum __MIDL_IUri_0001
+{
+	Uri_PROPERTY_ABSOLUTE_URI = 0,
+	Uri_PROPERTY_STRING_START = Uri_PROPERTY_ABSOLUTE_URI,
+	Uri_PROPERTY_AUTHORITY = 1,
+	Uri_PROPERTY_DISPLAY_URI = 2,
+	Uri_PROPERTY_DOMAIN = 3,
+	Uri_PROPERTY_EXTENSION = 4,
+	Uri_PROPERTY_FRAGMENT = 5,
+	Uri_PROPERTY_HOST = 6,
+	Uri_PROPERTY_PASSWORD = 7,
+	Uri_PROPERTY_PATH = 8,
+	Uri_PROPERTY_PATH_AND_QUERY = 9,
+	Uri_PROPERTY_QUERY = 10,
+	Uri_PROPERTY_RAW_URI = 11,
+	Uri_PROPERTY_SCHEME_NAME = 12,
+	Uri_PROPERTY_USER_INFO = 13,
+	Uri_PROPERTY_USER_NAME = 14,
+	Uri_PROPERTY_STRING_LAST = Uri_PROPERTY_USER_NAME,
+	Uri_PROPERTY_HOST_TYPE = 15,
+	Uri_PROPERTY_DWORD_START = Uri_PROPERTY_HOST_TYPE,
+	Uri_PROPERTY_PORT = 16,
+	Uri_PROPERTY_SCHEME = 17,
+	Uri_PROPERTY_ZONE = 18,
+	Uri_PROPERTY_DWORD_LAST = Uri_PROPERTY_ZONE
+} Uri_PROPERTY;
+
+typedef enum __MIDL_IUri_0002
+{
+	Uri_HOST_UNKNOWN = 0,
+	Uri_HOST_DNS,
+	Uri_HOST_IPV4,
+	Uri_HOST_IPV6,
+	Uri_HOST_IDN
+} Uri_HOST_TYPE;
+
+typedef enum _tagURL_SCHEME
+{
+	URL_SCHEME_INVALID = -1,
+	URL_SCHEME_UNKNOWN = 0,
+	URL_SCHEME_FTP,
+	URL_SCHEME_HTTP,
+	URL_SCHEME_GOPHER,
+	URL_SCHEME_MAILTO,
+	URL_SCHEME_NEWS,
+	URL_SCHEME_NNTP,
+	URL_SCHEME_TELNET,
+	URL_SCHEME_WAIS,
+	URL_SCHEME_FILE,
+	URL_SCHEME_MK,
+	URL_SCHEME_HTTPS
+} URL_SCHEME;
+
+// IInternetPriority priorities, as defined by <winbase.h>
+#define THREAD_PRIORITY_LOWEST (-2)
+#define THREAD_PRIORITY_BELOW_NORMAL (-1)
+#define THREAD_PRIORITY_NORMAL 0
+#define THREAD_PRIORITY_ABOVE_NORMAL 1
+#define THREAD_PRIORITY_HIGHEST 2
+
+// HttpQueryInfo levels and modifiers used with IWinInetHttpInfo::QueryInfo
+#define HTTP_QUERY_CONTENT_TYPE 1
+#define HTTP_QUERY_CONTENT_LENGTH 5
+#define HTTP_QUERY_STATUS_CODE 19
+#define HTTP_QUERY_STATUS_TEXT 20
+#define HTTP_QUERY_RAW_HEADERS 21
+#define HTTP_QUERY_RAW_HEADERS_CRLF 22
+#define HTTP_QUERY_REQUEST_METHOD 45
+#define HTTP_QUERY_CACHE_CONTROL 49
+#define HTTP_QUERY_FLAG_REQUEST_HEADERS 0x80000000
+#define HTTP_QUERY_FLAG_NUMBER 0x20000000
+
+// ===== Structures =====
+
+typedef struct _tagPROTOCOLDATA
+{
+	DWORD grfFlags;
+	DWORD dwState;
+	LPVOID pData;
+	ULONG cbData;
+} PROTOCOLDATA;
+
+typedef struct tagSTGMEDIUM
+{
+	DWORD tymed;
+	union
+	{
+		HANDLE hGlobal;
+		LPOLESTR lpszFileName;
+		IUnknown* pstm;
+	};
+	IUnknown* pUnkForRelease;
+} STGMEDIUM;
+
+#define TYMED_NULL 0
+
+typedef struct _tagBINDINFO
+{
+	ULONG cbSize;
+	LPWSTR szExtraInfo;
+	STGMEDIUM stgmedData;
+	DWORD grfBindInfoF;
+	DWORD dwBindVerb;
+	LPWSTR szCustomVerb;
+	DWORD cbstgmedData;
+	DWORD dwOptions;
+	DWORD dwOptionsFlags;
+	DWORD dwCodePage;
+	SECURITY_ATTRIBUTES securityAttributes;
+	IID iid;
+	IUnknown* pUnk;
+	DWORD dwReserved;
+} BINDINFO;
+
+inline void ReleaseBindInfo(BINDINFO* pbindinfo)
+{
+	if (!pbindinfo)
+	{
+		return;
+	}
+	CoTaskMemFree(pbindinfo->szExtraInfo);
+	CoTaskMemFree(pbindinfo->szCustomVerb);
+	if (pbindinfo->stgmedData.pUnkForRelease)
+	{
+		pbindinfo->stgmedData.pUnkForRelease->Release();
+	}
+	if (pbindinfo->pUnk)
+	{
+		pbindinfo->pUnk->Release();
+	}
+	ULONG cbSize = pbindinfo->cbSize;
+	memset(pbindinfo, 0, cbSize);
+	pbindinfo->cbSize = cbSize;
+}
+
+// ===== Interface identifiers =====
+
+DEFINE_GUID(IID_IServiceProvider,
+	0x6d5140c1, 0x7436, 0x11ce, 0x80, 0x34, 0x00, 0xaa, 0x00, 0x60, 0x09, 0xfa);
+DEFINE_GUID(IID_IInternetProtocolRoot,
+	0x79eac9e3, 0xbaf9, 0x11ce, 0x8c, 0x82, 0x00, 0xaa, 0x00, 0x4b, 0xa9, 0x0b);
+DEFINE_GUID(IID_IInternetProtocol,
+	0x79eac9e4, 0xbaf9, 0x11ce, 0x8c, 0x82, 0x00, 0xaa, 0x00, 0x4b, 0xa9, 0x0b);
+DEFINE_GUID(IID_IInternetProtocolEx,
+	0xc7a98e66, 0x1010, 0x492c, 0xa1, 0xc8, 0xc8, 0x09, 0xe1, 0xf7, 0x59, 0x05);
+DEFINE_GUID(IID_IInternetProtocolSink,
+	0x79eac9e5, 0xbaf9, 0x11ce, 0x8c, 0x82, 0x00, 0xaa, 0x00, 0x4b, 0xa9, 0x0b);
+DEFINE_GUID(IID_IInternetBindInfo,
+	0x79eac9e1, 0xbaf9, 0x11ce, 0x8c, 0x82, 0x00, 0xaa, 0x00, 0x4b, 0xa9, 0x0b);
+DEFINE_GUID(IID_IInternetBindInfoEx,
+	0xa3e015b7, 0xa82c, 0x4dcd, 0xa1, 0x50, 0x56, 0x9a, 0xee, 0xed, 0x36, 0xab);
+DEFINE_GUID(IID_IInternetProtocolInfo,
+	0x79eac9ec, 0xbaf9, 0x11ce, 0x8c, 0x82, 0x00, 0xaa, 0x00, 0x4b, 0xa9, 0x0b);
+DEFINE_GUID(IID_IInternetPriority,
+	0x79eac9eb, 0xbaf9, 0x11ce, 0x8c, 0x82, 0x00, 0xaa, 0x00, 0x4b, 0xa9, 0x0b);
+DEFINE_GUID(IID_IInternetThreadSwitch,
+	0x79eac9e8, 0xbaf9, 0x11ce, 0x8c, 0x82, 0x00, 0xaa, 0x00, 0x4b, 0xa9, 0x0b);
+DEFINE_GUID(IID_IWinInetInfo,
+	0x79eac9d6, 0xbafa, 0x11ce, 0x8c, 0x82, 0x00, 0xaa, 0x00, 0x4b, 0xa9, 0x0b);
+DEFINE_GUID(IID_IWinInetHttpInfo,
+	0x79eac9d8, 0xbafa, 0x11ce, 0x8c, 0x82, 0x00, 0xaa, 0x00, 0x4b, 0xa9, 0x0b);
+DEFINE_GUID(IID_IWinInetCacheHints,
+	0xdd1ec3b3, 0x8391, 0x4fdb, 0xa9, 0xe6, 0x34, 0x7c, 0x3c, 0xaa, 0xa7, 0xdd);
+DEFINE_GUID(IID_IWinInetCacheHints2,
+	0x7857aeac, 0xd31f, 0x49bf, 0x88, 0x4e, 0xdd, 0x46, 0xdf, 0x36, 0x78, 0x0a);
+DEFINE_GUID(IID_IUri,
+	0xa39ee748, 0x6a27, 0x4817, 0xa6, 0xf2, 0x13, 0x91, 0x4b, 0xef, 0x58, 0x90);
+DEFINE_GUID(IID_IUriContainer,
+	0xa158a630, 0xed6f, 0x45fb, 0xb9, 0x87, 0xf6, 0x86, 0x76, 0xf5, 0x77, 0x52);
+DEFINE_GUID(IID_IHttpNegotiate,
+	0x79eac9d2, 0xbaf9, 0x11ce, 0x8c, 0x82, 0x00, 0xaa, 0x00, 0x4b, 0xa9, 0x0b);
+
+DEFINE_GUID(CLSID_HttpProtocol,
+	0x79eac9e2, 0xbaf9, 0x11ce, 0x8c, 0x82, 0x00, 0xaa, 0x00, 0x4b, 0xa9, 0x0b);
+DEFINE_GUID(CLSID_HttpSProtocol,
+	0x79eac9e5, 0xbaf9, 0x11ce, 0x8c, 0x82, 0x00, 0xaa, 0x00, 0x4b, 0xa9, 0x0b);
+
+// ===== Interfaces =====
+
+struct IServiceProvider : public IUnknown
+{
+	STDMETHOD(QueryService)(REFGUID guidService, REFIID riid,
+		void** ppvObject) = 0;
+
+	template <class Q>
+	HRESULT STDMETHODCALLTYPE QueryService(REFGUID guidService, Q** pp)
+	{
+		return QueryService(guidService, __uuidof(Q), (void**)pp);
+	}
+};
+DECLARE_PORTABLE_UUIDOF(IServiceProvider)
+
+struct IUri : public IUnknown
+{
+	STDMETHOD(GetPropertyBSTR)(Uri_PROPERTY uriProp, BSTR* pbstrProperty,
+		DWORD dwFlags) = 0;
+	STDMETHOD(GetPropertyLength)(Uri_PROPERTY uriProp, DWORD* pcchProperty,
+		DWORD dwFlags) = 0;
+	STDMETHOD(GetPropertyDWORD)(Uri_PROPERTY uriProp, DWORD* pdwProperty,
+		DWORD dwFlags) = 0;
+	STDMETHOD(HasProperty)(Uri_PROPERTY uriProp, BOOL* pfHasProperty) = 0;
+	STDMETHOD(GetAbsoluteUri)(BSTR* pbstrAbsoluteUri) = 0;
+	STDMETHOD(GetAuthority)(BSTR* pbstrAuthority) = 0;
+	STDMETHOD(GetDisplayUri)(BSTR* pbstrDisplayString) = 0;
+	STDMETHOD(GetDomain)(BSTR* pbstrDomain) = 0;
+	STDMETHOD(GetExtension)(BSTR* pbstrExtension) = 0;
+	STDMETHOD(GetFragment)(BSTR* pbstrFragment) = 0;
+	STDMETHOD(GetHost)(BSTR* pbstrHost) = 0;
+	STDMETHOD(GetPassword)(BSTR* pbstrPassword) = 0;
+	STDMETHOD(GetPath)(BSTR* pbstrPath) = 0;
+	STDMETHOD(GetPathAndQuery)(BSTR* pbstrPathAndQuery) = 0;
+	STDMETHOD(GetQuery)(BSTR* pbstrQuery) = 0;
+	STDMETHOD(GetRawUri)(BSTR* pbstrRawUri) = 0;
+	STDMETHOD(GetSchemeName)(BSTR* pbstrSchemeName) = 0;
+	STDMETHOD(GetUserInfo)(BSTR* pbstrUserInfo) = 0;
+	STDMETHOD(GetUserName)(BSTR* pbstrUserName) = 0;
+	STDMETHOD(GetHostType)(DWORD* pdwHostType) = 0;
+	STDMETHOD(GetPort)(DWORD* pdwPort) = 0;
+	STDMETHOD(GetScheme)(DWORD* pdwScheme) = 0;
+	STDMETHOD(GetZone)(DWORD* pdwZone) = 0;
+	STDMETHOD(GetProperties)(LPDWORD pdwFlags) = 0;
+	STDMETHOD(IsEqual)(IUri* pUri, BOOL* pfEqual) = 0;
+};
+DECLARE_PORTABLE_UUIDOF(IUri)
+
+struct IUriContainer : public IUnknown
+{
+	STDMETHOD(GetIUri)(IUri** ppIUri) = 0;
+};
+DECLARE_PORTABLE_UUIDOF(IUriContainer)
+
+struct IInternetProtocolSink;
+struct IInternetBindInfo;
+
+struct IInternetProtocolRoot : public IUnknown
+{
+	STDMETHOD(Start)(LPCWSTR szUrl, IInternetProtocolSink* pOIProtSink,
+		IInternetBindInfo* pOIBindInfo, DWORD grfPI,
+		HANDLE_PTR dwReserved) = 0;
+	STDMETHOD(Continue)(PROTOCOLDATA* pProtocolData) = 0;
+	STDMETHOD(Abort)(HRESULT hrReason, DWORD dwOptions) = 0;
+	STDMETHOD(Terminate)(DWORD dwOptions) = 0;
+	STDMETHOD(Suspend)() = 0;
+	STDMETHOD(Resume)() = 0;
+};
+DECLARE_PORTABLE_UUIDOF(IInternetProtocolRoot)
+
+struct IInternetProtocol : public IInternetProtocolRoot
+{
+	STDMETHOD(Read)(void* pv, ULONG cb, ULONG* pcbRead) = 0;
+	STDMETHOD(Seek)(LARGE_INTEGER dlibMove, DWORD dwOrigin,
+		ULARGE_INTEGER* plibNewPosition) = 0;
+	STDMETHOD(LockRequest)(DWORD dwOptions) = 0;
+	STDMETHOD(UnlockRequest)() = 0;
+};
+DECLARE_PORTABLE_UUIDOF(IInternetProtocol)
+
+struct IInternetProtocolEx : public IInternetProtocol
+{
+	STDMETHOD(StartEx)(IUri* pUri, IInternetProtocolSink* pOIProtSink,
+		IInternetBindInfo* pOIBindInfo, DWORD grfPI,
+		HANDLE_PTR dwReserved) = 0;
+};
+DECLARE_PORTABLE_UUIDOF(IInternetProtocolEx)
+
+struct IInternetProtocolSink : public IUnknown
+{
+	STDMETHOD(Switch)(PROTOCOLDATA* pProtocolData) = 0;
+	STDMETHOD(ReportProgress)(ULONG ulStatusCode, LPCWSTR szStatusText) = 0;
+	STDMETHOD(ReportData)(DWORD grfBSCF, ULONG ulProgress,
+		ULONG ulProgressMax) = 0;
+	STDMETHOD(ReportResult)(HRESULT hrResult, DWORD dwError,
+		LPCWSTR szResult) = 0;
+};
+DECLARE_PORTABLE_UUIDOF(IInternetProtocolSink)
+
+struct IInternetBindInfo : public IUnknown
+{
+	STDMETHOD(GetBindInfo)(DWORD* grfBINDF, BINDINFO* pbindinfo) = 0;
+	STDMETHOD(GetBindString)(ULONG ulStringType, LPOLESTR* ppwzStr,
+		ULONG cEl, ULONG* pcElFetched) = 0;
+};
+DECLARE_PORTABLE_UUIDOF(IInternetBindInfo)
+
+struct IInternetBindInfoEx : public IInternetBindInfo
+{
+	STDMETHOD(GetBindInfoEx)(DWORD* grfBINDF, BINDINFO* pbindinfo,
+		DWORD* grfBINDF2, DWORD* pdwReserved) = 0;
+};
+DECLARE_PORTABLE_UUIDOF(IInternetBindInfoEx)
+
+struct IInternetProtocolInfo : public IUnknown
+{
+	STDMETHOD(ParseUrl)(LPCWSTR pwzUrl, PARSEACTION ParseAction,
+		DWORD dwParseFlags, LPWSTR pwzResult, DWORD cchResult,
+		DWORD* pcchResult, DWORD dwReserved) = 0;
+	STDMETHOD(CombineUrl)(LPCWSTR pwzBaseUrl, LPCWSTR pwzRelativeUrl,
+		DWORD dwCombineFlags, LPWSTR pwzResult, DWORD cchResult,
+		DWORD* pcchResult, DWORD dwReserved) = 0;
+	STDMETHOD(CompareUrl)(LPCWSTR pwzUrl1, LPCWSTR pwzUrl2,
+		DWORD dwCompareFlags) = 0;
+	STDMETHOD(QueryInfo)(LPCWSTR pwzUrl, QUERYOPTION QueryOption,
+		DWORD dwQueryFlags, LPVOID pBuffer, DWORD cbBuffer, DWORD* pcbBuf,
+		DWORD dwReserved) = 0;
+};
+DECLARE_PORTABLE_UUIDOF(IInternetProtocolInfo)
+
+struct IInternetPriority : public IUnknown
+{
+	STDMETHOD(SetPriority)(LONG nPriority) = 0;
+	STDMETHOD(GetPriority)(LONG* pnPriority) = 0;
+};
+DECLARE_PORTABLE_UUIDOF(IInternetPriority)
+
+struct IInternetThreadSwitch : public IUnknown
+{
+	STDMETHOD(Prepare)() = 0;
+	STDMETHOD(Continue)() = 0;
+};
+DECLARE_PORTABLE_UUIDOF(IInternetThreadSwitch)
+
+struct IWinInetInfo : public IUnknown
+{
+	STDMETHOD(QueryOption)(DWORD dwOption, LPVOID pBuffer,
+		DWORD* pcbBuf) = 0;
+};
+DECLARE_PORTABLE_UUIDOF(IWinInetInfo)
+
+struct IWinInetHttpInfo : public IWinInetInfo
+{
+	STDMETHOD(QueryInfo)(DWORD dwOption, LPVOID pBuffer, DWORD* pcbBuf,
+		DWORD* pdwFlags, DWORD* pdwReserved) = 0;
+};
+DECLARE_PORTABLE_UUIDOF(IWinInetHttpInfo)
+
+struct IWinInetCacheHints : public IUnknown
+{
+	STDMETHOD(SetCacheExtension)(LPCWSTR pwzExt, LPVOID pszCacheFile,
+		DWORD* pcbCacheFile, DWORD* pdwWinInetError,
+		DWORD* pdwReserved) = 0;
+};
+DECLARE_PORTABLE_UUIDOF(IWinInetCacheHints)
+
+struct IWinInetCacheHints2 : public IWinInetCacheHints
+{
+	STDMETHOD(SetCacheExtension2)(LPCWSTR pwzExt, WCHAR* pwzCacheFile,
+		DWORD* pcchCacheFile, DWORD* pdwWinInetError,
+		DWORD* pdwReserved) = 0;
+};
+DECLARE_PORTABLE_UUIDOF(IWinInetCacheHints2)
+
+struct IHttpNegotiate : public IUnknown
+{
+	STDMETHOD(BeginningTransaction)(LPCWSTR szURL, LPCWSTR szHeaders,
+		DWORD dwReserved, LPWSTR* pszAdditionalHeaders) = 0;
+	STDMETHOD(OnResponse)(DWORD dwResponseCode, LPCWSTR szResponseHeaders,
+		LPCWSTR szRequestHeaders, LPWSTR* pszAdditionalRequestHeaders) = 0;
+};
+DECLARE_PORTABLE_UUIDOF(IHttpNegotiate)
+
+// ===== CreateUri =====
+
+#define Uri_CREATE_CANONICALIZE 0x00000100
+
+#define Uri_HAS_ABSOLUTE_URI (1 << Uri_PROPERTY_ABSOLUTE_URI)
+#define Uri_HAS_AUTHORITY (1 << Uri_PROPERTY_AUTHORITY)
+#define Uri_HAS_DISPLAY_URI (1 << Uri_PROPERTY_DISPLAY_URI)
+#define Uri_HAS_DOMAIN (1 << Uri_PROPERTY_DOMAIN)
+#define Uri_HAS_EXTENSION (1 << Uri_PROPERTY_EXTENSION)
+#define Uri_HAS_FRAGMENT (1 << Uri_PROPERTY_FRAGMENT)
+#define Uri_HAS_HOST (1 << Uri_PROPERTY_HOST)
+#define Uri_HAS_PASSWORD (1 << Uri_PROPERTY_PASSWORD)
+#define Uri_HAS_PATH (1 << Uri_PROPERTY_PATH)
+#define Uri_HAS_PATH_AND_QUERY (1 << Uri_PROPERTY_PATH_AND_QUERY)
+#define Uri_HAS_QUERY (1 << Uri_PROPERTY_QUERY)
+#define Uri_HAS_RAW_URI (1 << Uri_PROPERTY_RAW_URI)
+#define Uri_HAS_SCHEME_NAME (1 << Uri_PROPERTY_SCHEME_NAME)
+#define Uri_HAS_USER_INFO (1 << Uri_PROPERTY_USER_INFO)
+#define Uri_HAS_USER_NAME (1 << Uri_PROPERTY_USER_NAME)
+#define Uri_HAS_HOST_TYPE (1 << Uri_PROPERTY_HOST_TYPE)
+#define Uri_HAS_PORT (1 << Uri_PROPERTY_PORT)
+#define Uri_HAS_SCHEME (1 << Uri_PROPERTY_SCHEME)
+#define Uri_HAS_ZONE (1 << Uri_PROPERTY_ZONE)
+
+// Hierarchical URIs only (scheme://[user[:password]@]host[:port]/path?query
+// #fragment). Scheme and host are lowercased; the domain is approximated by
+// the last two labels of a DNS host name instead of the public suffix list.
+class _PortableUri : public IUri
+{
+public:
+	_PortableUri() : m_cRef(1), m_dwPort(0), m_dwScheme(URL_SCHEME_UNKNOWN),
+		m_dwHostType(Uri_HOST_UNKNOWN), m_dwProperties(0)
+	{
+	}
+
+	HRESULT Parse(LPCWSTR szUri)
+	{
+		m_raw = szUri;
+		std::wstring::size_type posScheme = m_raw.find(L"://");
+		if (posScheme == std::wstring::npos || posScheme == 0)
+		{
+			return E_INVALIDARG;
+		}
+		m_schemeName = Lower(m_raw.substr(0, posScheme));
+
+		std::wstring::size_type posAuthority = posScheme + 3;
+		std::wstring::size_type posPath =
+			m_raw.find_first_of(L"/?#", posAuthority);
+		if (posPath == std::wstring::npos)
+		{
+			posPath = m_raw.size();
+		}
+		std::wstring authority =
+			m_raw.substr(posAuthority, posPath - posAuthority);
+
+		std::wstring::size_type posAt = authority.rfind(L'@');
+		if (posAt != std::wstring::npos)
+		{
+			m_userInfo = authority.substr(0, posAt);
+			authority.erase(0, posAt + 1);
+			std::wstring::size_type posColon = m_userInfo.find(L':');
+			m_userName = m_userInfo.substr(0, posColon);
+			if (posColon != std::wstring::npos)
+			{
+				m_password = m_userInfo.substr(posColon + 1);
+			}
+		}
+
+		std::wstring::size_type posPort = authority.rfind(L':');
+		if (posPort != std::wstring::npos)
+		{
+			m_dwPort = static_cast<DWORD>(
+				wcstoul(authority.c_str() + posPort + 1, 0, 10));
+			authority.erase(posPort);
+		}
+		m_host = Lower(authority);
+		if (m_host.empty())
+		{
+			return E_INVALIDARG;
+		}
+
+		std::wstring rest = m_raw.substr(posPath);
+		std::wstring::size_type posFragment = rest.find(L'#');
+		if (posFragment != std::wstring::npos)
+		{
+			m_fragment = rest.substr(posFragment);
+			rest.erase(posFragment);
+		}
+		std::wstring::size_type posQuery = rest.find(L'?');
+		if (posQuery != std::wstring::npos)
+		{
+			m_query = rest.substr(posQuery);
+			rest.erase(posQuery);
+		}
+		m_path = rest.empty() ? std::wstring(L"/") : rest;
+
+		std::wstring::size_type posSegment = m_path.rfind(L'/');
+		std::wstring::size_type posDot = m_path.rfind(L'.');
+		if (posDot != std::wstring::npos &&
+			(posSegment == std::wstring::npos || posDot > posSegment))
+		{
+			m_extension = m_path.substr(posDot);
+		}
+
+		if (m_schemeName == L"http")
+		{
+			m_dwScheme = URL_SCHEME_HTTP;
+		}
+		else if (m_schemeName == L"https")
+		{
+			m_dwScheme = URL_SCHEME_HTTPS;
+		}
+		else if (m_schemeName == L"ftp")
+		{
+			m_dwScheme = URL_SCHEME_FTP;
+		}
+		else if (m_schemeName == L"file")
+		{
+			m_dwScheme = URL_SCHEME_FILE;
+		}
+		bool bDefaultPort = (m_dwPort == 0);
+		if (bDefaultPort)
+		{
+			m_dwPort = (m_dwScheme == URL_SCHEME_HTTPS) ? 443 :
+				(m_dwScheme == URL_SCHEME_FTP) ? 21 : 80;
+		}
+
+		if (m_host.find_first_not_of(L"0123456789.") == std::wstring::npos)
+		{
+			m_dwHostType = Uri_HOST_IPV4;
+		}
+		else if (m_host[0] == L'[')
+		{
+			m_dwHostType = Uri_HOST_IPV6;
+		}
+		else
+		{
+			m_dwHostType = Uri_HOST_DNS;
+			std::wstring::size_type posLast = m_host.rfind(L'.');
+			if (posLast != std::wstring::npos && posLast > 0)
+			{
+				std::wstring::size_type posPrev =
+					m_host.rfind(L'.', posLast - 1);
+				m_domain = (posPrev == std::wstring::npos) ?
+					m_host : m_host.substr(posPrev + 1);
+			}
+		}
+
+		m_authority = m_host;
+		if (!bDefaultPort)
+		{
+			wchar_t szPort[16];
+			swprintf(szPort, 16, L":%u", static_cast<unsigned>(m_dwPort));
+			m_authority += szPort;
+		}
+		if (!m_userInfo.empty())
+		{
+			m_authority = m_userInfo + L"@" + m_authority;
+		}
+		m_absolute = m_schemeName + L"://" + m_authority + m_path +
+			m_query + m_fragment;
+
+		m_dwProperties = Uri_HAS_ABSOLUTE_URI | Uri_HAS_AUTHORITY |
+			Uri_HAS_DISPLAY_URI | Uri_HAS_HOST | Uri_HAS_PATH |
+			Uri_HAS_PATH_AND_QUERY | Uri_HAS_RAW_URI | Uri_HAS_SCHEME_NAME |
+			Uri_HAS_HOST_TYPE | Uri_HAS_PORT | Uri_HAS_SCHEME | Uri_HAS_ZONE;
+		if (!m_domain.empty())
+		{
+			m_dwProperties |= Uri_HAS_DOMAIN;
+		}
+		if (!m_extension.empty())
+		{
+			m_dwProperties |= Uri_HAS_EXTENSION;
+		}
+		if (!m_fragment.empty())
+		{
+			m_dwProperties |= Uri_HAS_FRAGMENT;
+		}
+		if (!m_query.empty())
+		{
+			m_dwProperties |= Uri_HAS_QUERY;
+		}
+		if (!m_userInfo.empty())
+		{
+			m_dwProperties |= Uri_HAS_USER_INFO | Uri_HAS_USER_NAME;
+		}
+		if (!m_password.empty())
+		{
+			m_dwProperties |= Uri_HAS_PASSWORD;
+		}
+		return S_OK;
+	}
+
+	// IUnknown
+	STDMETHOD(QueryInterface)(REFIID riid, void** ppvObject)
+	{
+		if (!ppvObject)
+		{
+			return E_POINTER;
+		}
+		if (InlineIsEqualGUID(riid, IID_IUnknown) ||
+			InlineIsEqualGUID(riid, IID_IUri))
+		{
+			*ppvObject = static_cast<IUri*>(this);
+			AddRef();
+			return S_OK;
+		}
+		*ppvObject = 0;
+		return E_NOINTERFACE;
+	}
+	STDMETHOD_(ULONG, AddRef)()
+	{
+		return InterlockedIncrement(&m_cRef);
+	}
+	STDMETHOD_(ULONG, Release)()
+	{
+		LONG cRef = InterlockedDecrement(&m_cRef);
+		if (!cRef)
+		{
+			delete this;
+		}
+		return cRef;
+	}
+
+	// IUri
+	STDMETHOD(GetPropertyBSTR)(Uri_PROPERTY uriProp, BSTR* pbstrProperty,
+		DWORD)
+	{
+		const std::wstring* pValue = GetString(uriProp);
+		if (!pValue)
+		{
+			return E_INVALIDARG;
+		}
+		return Copy(*pValue, pbstrProperty);
+	}
+	STDMETHOD(GetPropertyLength)(Uri_PROPERTY uriProp, DWORD* pcchProperty,
+		DWORD)
+	{
+		const std::wstring* pValue = GetString(uriProp);
+		if (!pValue || !pcchProperty)
+		{
+			return E_INVALIDARG;
+		}
+		*pcchProperty = static_cast<DWORD>(pValue->size());
+		return pValue->empty() ? S_FALSE : S_OK;
+	}
+	STDMETHOD(GetPropertyDWORD)(Uri_PROPERTY uriProp, DWORD* pdwProperty,
+		DWORD)
+	{
+		if (!pdwProperty)
+		{
+			return E_POINTER;
+		}
+		switch (uriProp)
+		{
+		case Uri_PROPERTY_HOST_TYPE: *pdwProperty = m_dwHostType; break;
+		case Uri_PROPERTY_PORT: *pdwProperty = m_dwPort; break;
+		case Uri_PROPERTY_SCHEME: *pdwProperty = m_dwScheme; break;
+		case Uri_PROPERTY_ZONE: *pdwProperty = 3; break;
+		default: return E_INVALIDARG;
+		}
+		return S_OK;
+	}
+	STDMETHOD(HasProperty)(Uri_PROPERTY uriProp, BOOL* pfHasProperty)
+	{
+		if (!pfHasProperty)
+		{
+			return E_POINTER;
+		}
+		*pfHasProperty = (m_dwProperties & (1 << uriProp)) != 0;
+		return S_OK;
+	}
+	STDMETHOD(GetAbsoluteUri)(BSTR* pbstr) {return Copy(m_absolute, pbstr);}
+	STDMETHOD(GetAuthority)(BSTR* pbstr) {return Copy(m_authority, pbstr);}
+	STDMETHOD(GetDisplayUri)(BSTR* pbstr) {return Copy(m_absolute, pbstr);}
+	STDMETHOD(GetDomain)(BSTR* pbstr) {return Copy(m_domain, pbstr);}
+	STDMETHOD(GetExtension)(BSTR* pbstr) {return Copy(m_extension, pbstr);}
+	STDMETHOD(GetFragment)(BSTR* pbstr) {return Copy(m_fragment, pbstr);}
+	STDMETHOD(GetHost)(BSTR* pbstr) {return Copy(m_host, pbstr);}
+	STDMETHOD(GetPassword)(BSTR* pbstr) {return Copy(m_password, pbstr);}
+	STDMETHOD(GetPath)(BSTR* pbstr) {return Copy(m_path, pbstr);}
+	STDMETHOD(GetPathAndQuery)(BSTR* pbstr)
+	{
+		return Copy(m_path + m_query, pbstr);
+	}
+	STDMETHOD(GetQuery)(BSTR* pbstr) {return Copy(m_query, pbstr);}
+	STDMETHOD(GetRawUri)(BSTR* pbstr) {return Copy(m_raw, pbstr);}
+	STDMETHOD(GetSchemeName)(BSTR* pbstr) {return Copy(m_schemeName, pbstr);}
+	STDMETHOD(GetUserInfo)(BSTR* pbstr) {return Copy(m_userInfo, pbstr);}
+	STDMETHOD(GetUserName)(BSTR* pbstr) {return Copy(m_userName, pbstr);}
+	STDMETHOD(GetHostType)(DWORD* pdw)
+	{
+		return GetPropertyDWORD(Uri_PROPERTY_HOST_TYPE, pdw, 0);
+	}
+	STDMETHOD(GetPort)(DWORD* pdw)
+	{
+		return GetPropertyDWORD(Uri_PROPERTY_PORT, pdw, 0);
+	}
+	STDMETHOD(GetScheme)(DWORD* pdw)
+	{
+		return GetPropertyDWORD(Uri_PROPERTY_SCHEME, pdw, 0);
+	}
+	STDMETHOD(GetZone)(DWORD* pdw)
+	{
+		return GetPropertyDWORD(Uri_PROPERTY_ZONE, pdw, 0);
+	}
+	STDMETHOD(GetProperties)(LPDWORD pdwFlags)
+	{
+		if (!pdwFlags)
+		{
+			return E_POINTER;
+		}
+		*pdwFlags = m_dwProperties;
+		return S_OK;
+	}
+	STDMETHOD(IsEqual)(IUri* pUri, BOOL* pfEqual)
+	{
+		if (!pUri || !pfEqual)
+		{
+			return E_POINTER;
+		}
+		BSTR bstrOther = 0;
+		HRESULT hr = pUri->GetAbsoluteUri(&bstrOther);
+		*pfEqual = SUCCEEDED(hr) && bstrOther &&
+			m_absolute == std::wstring(bstrOther, SysStringLen(bstrOther));
+		SysFreeString(bstrOther);
+		return S_OK;
+	}
+
+private:
+	virtual ~_PortableUri()
+	{
+	}
+
+	static std::wstring Lower(const std::wstring& s)
+	{
+		std::wstring result(s);
+		for (std::wstring::size_type i = 0; i < result.size(); ++i)
+		{
+			result[i] = towlower(result[i]);
+		}
+		return result;
+	}
+
+	static HRESULT Copy(const std::wstring& value, BSTR* pbstr)
+	{
+		if (!pbstr)
+		{
+			return E_POINTER;
+		}
+		*pbstr = SysAllocStringLen(value.c_str(),
+			static_cast<UINT>(value.size()));
+		if (!*pbstr)
+		{
+			return E_OUTOFMEMORY;
+		}
+		return value.empty() ? S_FALSE : S_OK;
+	}
+
+	const std::wstring* GetString(Uri_PROPERTY uriProp) const
+	{
+		switch (uriProp)
+		{
+		case Uri_PROPERTY_ABSOLUTE_URI: return &m_absolute;
+		case Uri_PROPERTY_AUTHORITY: return &m_authority;
+		case Uri_PROPERTY_DISPLAY_URI: return &m_absolute;
+		case Uri_PROPERTY_DOMAIN: return &m_domain;
+		case Uri_PROPERTY_EXTENSION: return &m_extension;
+		case Uri_PROPERTY_FRAGMENT: return &m_fragment;
+		case Uri_PROPERTY_HOST: return &m_host;
+		case Uri_PROPERTY_PASSWORD: return &m_password;
+		case Uri_PROPERTY_PATH: return &m_path;
+		case Uri_PROPERTY_QUERY: return &m_query;
+		case Uri_PROPERTY_RAW_URI: return &m_raw;
+		case Uri_PROPERTY_SCHEME_NAME: return &m_schemeName;
+		case Uri_PROPERTY_USER_INFO: return &m_userInfo;
+		case Uri_PROPERTY_USER_NAME: return &m_userName;
+		default: return 0;
+		}
+	}
+
+	LONG m_cRef;
+	std::wstring m_raw;
+	std::wstring m_absolute;
+	std::wstring m_schemeName;
+	std::wstring m_authority;
+	std::wstring m_userInfo;
+	std::wstring m_userName;
+	std::wstring m_password;
+	std::wstring m_host;
+	std::wstring m_domain;
+	std::wstring m_path;
+	std::wstring m_extension;
+	std::wstring m_query;
+	std::wstring m_fragment;
+	DWORD m_dwPort;
+	DWORD m_dwScheme;
+	DWORD m_dwHostType;
+	DWORD m_dwProperties;
+};
+
+inline HRESULT CreateUri(LPCWSTR pwzURI, DWORD, DWORD_PTR, IUri** ppURI)
+{
+	if (!ppURI)
+	{
+		return E_POINTER;
+	}
+	*ppURI = 0;
+	if (!pwzURI)
+	{
+		return E_INVALIDARG;
+	}
+	_PortableUri* pUri = new (std::nothrow) _PortableUri;
+	if (!pUri)
+	{
+		return E_OUTOFMEMORY;
+	}
+	HRESULT hr = pUri->Parse(pwzURI);
+	if (FAILED(hr))
+	{
+		pUri->Release();
+		return hr;
+	}
+	*ppURI = pUri;
+	return S_OK;
+}
+
+// ===== urlmon error codes =====
+
+#define INET_E_INVALID_URL ((HRESULT)0x800C0002L)
+#define INET_E_NO_SESSION ((HRESULT)0x800C0003L)
+#define INET_E_CANNOT_CONNECT ((HRESULT)0x800C0004L)
+#define INET_E_RESOURCE_NOT_FOUND ((HRESULT)0x800C0005L)
+#define INET_E_OBJECT_NOT_FOUND ((HRESULT)0x800C0006L)
+#define INET_E_DATA_NOT_AVAILABLE ((HRESULT)0x800C0007L)
+#define INET_E_DOWNLOAD_FAILURE ((HRESULT)0x800C0008L)
+#define INET_E_USE_DEFAULT_PROTOCOLHANDLER ((HRESULT)0x800C0011L)
+#define INET_E_DEFAULT_ACTION INET_E_USE_DEFAULT_PROTOCOLHANDLER
+#define INET_E_REDIRECT_FAILED ((HRESULT)0x800C0014L)
+#define INET_E_REDIRECTING ((HRESULT)0x800C0106L)
+
+#endif // PASSTHROUGHAPP_PORTABLE_URLMON_H
@@ -0,0 +1,1230 @@
+#ifndef PASSTHROUGHAPP_PORTABLE_WINDOWS_H
+#define PASSTHROUGHAPP_PORTABLE_WINDOWS_H
+
+// Minimal stand-in for the parts of <windows.h> and <objbase.h> used by
+// the Passthrough APP headers. Together with the other headers in this
+// directory it lets the toolkit compile with GCC or Clang on platforms
+// without the Windows SDK, so that the templates can be exercised against
+// the fake protocol objects in FakeProtocol.h.
+//
+// Add this directory to the include path ahead of everything else, e.g.
+//     g++ -std=c++17 -I Portable -I . ...
+// so that <windows.h>, <urlmon.h>, <atlbase.h> and <atlcom.h> resolve here.
+//
+// Only what the toolkit needs is provided. Semantics follow the Windows SDK
+// where it matters for the toolkit (HRESULT values, reference counting,
+// interlocked operations, recursive critical sections); everything else is
+// deliberately left out.
+
+#ifdef _WIN32
+	#error The portable headers are not meant to be used on Windows
+#endif
+
+#define PASSTHROUGHAPP_PORTABLE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+// ===== Compiler extensions =====
+
+// __declspec(x) is mapped onto a family of helper macros so that
+// declarations written for MSVC keep compiling unchanged
+#define __declspec(x) _PORTABLE_DECLSPEC_##x
+#define _PORTABLE_DECLSPEC_selectany __attribute__((weak))
+#define _PORTABLE_DECLSPEC_novtable
+#define _PORTABLE_DECLSPEC_uuid(x)
+#define _PORTABLE_DECLSPEC_align(x) __attribute__((aligned(x)))
+#define _PORTABLE_DECLSPEC_noinline __attribute__((noinline))
+#define _PORTABLE_DECLSPEC_thread __thread
+
+#define __forceinline inline __attribute__((always_inline))
+
+#define WINAPI
+#define CALLBACK
+#define STDMETHODCALLTYPE
+#define STDAPICALLTYPE
+#define EXTERN_C extern "C"
+#define DECLSPEC_SELECTANY __declspec(selectany)
+
+#define STDMETHOD(method) virtual HRESULT STDMETHODCALLTYPE method
+#define STDMETHOD_(type, method) virtual type STDMETHODCALLTYPE method
+#define STDMETHODIMP HRESULT STDMETHODCALLTYPE
+#define STDMETHODIMP_(type) type STDMETHODCALLTYPE
+#define STDAPI EXTERN_C HRESULT STDAPICALLTYPE
+#define STDAPI_(type) EXTERN_C type STDAPICALLTYPE
+#define PURE = 0
+
+// ===== Basic types =====
+
+typedef int BOOL;
+typedef uint8_t BYTE;
+typedef BYTE BOOLEAN;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef int16_t SHORT;
+typedef uint16_t USHORT;
+typedef int INT;
+typedef unsigned int UINT;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef intptr_t INT_PTR;
+typedef uintptr_t UINT_PTR;
+typedef intptr_t LONG_PTR;
+typedef uintptr_t ULONG_PTR;
+typedef uintptr_t DWORD_PTR;
+typedef uintptr_t HANDLE_PTR;
+typedef size_t SIZE_T;
+typedef void* HANDLE;
+typedef LONG HRESULT;
+
+typedef BYTE* LPBYTE;
+typedef DWORD* LPDWORD;
+typedef LONG* LPLONG;
+typedef void* LPVOID;
+typedef void* PVOID;
+typedef const void* LPCVOID;
+
+typedef char CHAR;
+typedef CHAR* LPSTR;
+typedef const CHAR* LPCSTR;
+typedef wchar_t WCHAR;
+typedef WCHAR* LPWSTR;
+typedef const WCHAR* LPCWSTR;
+typedef WCHAR OLECHAR;
+typedef OLECHAR* LPOLESTR;
+typedef const OLECHAR* LPCOLESTR;
+typedef OLECHAR* BSTR;
+typedef CHAR TCHAR;
+typedef TCHAR* LPTSTR;
+typedef const TCHAR* LPCTSTR;
+
+#ifndef TRUE
+	#define TRUE 1
+#endif
+#ifndef FALSE
+	#define FALSE 0
+#endif
+
+typedef union _LARGE_INTEGER
+{
+	struct
+	{
+		DWORD LowPart;
+		LONG HighPart;
+	};
+	LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef union _ULARGE_INTEGER
+{
+	struct
+	{
+		DWORD LowPart;
+		DWORD HighPart;
+	};
+	ULONGLONG QuadPart;
+} ULARGE_INTEGER;
+
+typedef struct _FILETIME
+{
+	DWORD dwLowDateTime;
+	DWORD dwHighDateTime;
+} FILETIME;
+
+typedef struct _SECURITY_ATTRIBUTES
+{
+	DWORD nLength;
+	LPVOID lpSecurityDescriptor;
+	BOOL bInheritHandle;
+} SECURITY_ATTRIBUTES;
+
+#define MAKELONG(a, b) ((LONG)(((WORD)(a)) | ((DWORD)((WORD)(b))) << 16))
+#define LOWORD(l) ((WORD)((DWORD_PTR)(l) & 0xffff))
+#define HIWORD(l) ((WORD)((DWORD_PTR)(l) >> 16))
+
+// ===== HRESULT =====
+
+#define SUCCEEDED(hr) (((HRESULT)(hr)) >= 0)
+#define FAILED(hr) (((HRESULT)(hr)) < 0)
+#define HRESULT_FROM_WIN32(x) \
+	((HRESULT)(x) <= 0 ? ((HRESULT)(x)) : \
+		((HRESULT)(((x) & 0x0000FFFF) | (7 << 16) | 0x80000000)))
+
+#define S_OK ((HRESULT)0L)
+#define S_FALSE ((HRESULT)1L)
+#define E_NOTIMPL ((HRESULT)0x80004001L)
+#define E_NOINTERFACE ((HRESULT)0x80004002L)
+#define E_POINTER ((HRESULT)0x80004003L)
+#define E_ABORT ((HRESULT)0x80004004L)
+#define E_FAIL ((HRESULT)0x80004005L)
+#define E_PENDING ((HRESULT)0x8000000AL)
+#define E_UNEXPECTED ((HRESULT)0x8000FFFFL)
+#define E_ACCESSDENIED ((HRESULT)0x80070005L)
+#define E_HANDLE ((HRESULT)0x80070006L)
+#define E_OUTOFMEMORY ((HRESULT)0x8007000EL)
+#define E_INVALIDARG ((HRESULT)0x80070057L)
+#define CLASS_E_NOAGGREGATION ((HRESULT)0x80040110L)
+#define CLASS_E_CLASSNOTAVAILABLE ((HRESULT)0x80040111L)
+#define REGDB_E_CLASSNOTREG ((HRESULT)0x80040154L)
+#define CO_E_OBJNOTREG ((HRESULT)0x800401FBL)
+
+#define ERROR_SUCCESS 0L
+#define ERROR_FILE_NOT_FOUND 2L
+#define ERROR_ACCESS_DENIED 5L
+#define ERROR_INVALID_HANDLE 6L
+#define ERROR_NOT_ENOUGH_MEMORY 8L
+#define ERROR_WRITE_FAULT 29L
+#define ERROR_INVALID_PARAMETER 87L
+#define ERROR_INSUFFICIENT_BUFFER 122L
+#define ERROR_ALREADY_EXISTS 183L
+#define ERROR_HTTP_HEADER_NOT_FOUND 12150L
+
+// ===== GUID =====
+
+typedef struct _GUID
+{
+	DWORD Data1;
+	WORD Data2;
+	WORD Data3;
+	BYTE Data4[8];
+} GUID;
+
+typedef GUID IID;
+typedef GUID CLSID;
+typedef const GUID& REFGUID;
+typedef const IID& REFIID;
+typedef const CLSID& REFCLSID;
+
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+	EXTERN_C const GUID DECLSPEC_SELECTANY name = \
+		{l, w1, w2, {b1, b2, b3, b4, b5, b6, b7, b8}}
+
+inline BOOL InlineIsEqualGUID(REFGUID rguid1, REFGUID rguid2)
+{
+	return memcmp(&rguid1, &rguid2, sizeof(GUID)) == 0;
+}
+
+inline BOOL IsEqualGUID(REFGUID rguid1, REFGUID rguid2)
+{
+	return InlineIsEqualGUID(rguid1, rguid2);
+}
+
+#define IsEqualIID(riid1, riid2) IsEqualGUID(riid1, riid2)
+#define IsEqualCLSID(rclsid1, rclsid2) IsEqualGUID(rclsid1, rclsid2)
+
+inline bool operator==(REFGUID guidOne, REFGUID guidOther)
+{
+	return !!IsEqualGUID(guidOne, guidOther);
+}
+
+inline bool operator!=(REFGUID guidOne, REFGUID guidOther)
+{
+	return !(guidOne == guidOther);
+}
+
+DEFINE_GUID(GUID_NULL,
+	0x00000000, 0x0000, 0x0000, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
+#define CLSID_NULL GUID_NULL
+#define IID_NULL GUID_NULL
+
+// __uuidof(type) resolves through an explicit specialization of
+// _PortableUuidOf, declared for each interface with
+// DECLARE_PORTABLE_UUIDOF(itf) right after IID_itf is defined. The result
+// is a constant expression, so &__uuidof(itf) can be a template argument.
+template <class T>
+struct _PortableUuidOf;
+
+#define __uuidof(x) (::_PortableUuidOf<x>::iid)
+
+#define DECLARE_PORTABLE_UUIDOF(itf) \
+	template <> \
+	struct _PortableUuidOf<itf> \
+	{ \
+		static constexpr const IID& iid = IID_##itf; \
+	};
+
+// ===== Interlocked operations =====
+
+inline LONG InterlockedIncrement(LONG volatile* pAddend)
+{
+	return __atomic_add_fetch(pAddend, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedDecrement(LONG volatile* pAddend)
+{
+	return __atomic_sub_fetch(pAddend, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedExchange(LONG volatile* pTarget, LONG value)
+{
+	return __atomic_exchange_n(pTarget, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedExchangeAdd(LONG volatile* pAddend, LONG value)
+{
+	return __atomic_fetch_add(pAddend, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedCompareExchange(LONG volatile* pDestination,
+	LONG exchange, LONG comparand)
+{
+	__atomic_compare_exchange_n(pDestination, &comparand, exchange, false,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return comparand;
+}
+
+inline LONGLONG InterlockedIncrement64(LONGLONG volatile* pAddend)
+{
+	return __atomic_add_fetch(pAddend, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONGLONG InterlockedExchangeAdd64(LONGLONG volatile* pAddend,
+	LONGLONG value)
+{
+	return __atomic_fetch_add(pAddend, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONGLONG InterlockedCompareExchange64(
+	LONGLONG volatile* pDestination, LONGLONG exchange, LONGLONG comparand)
+{
+	__atomic_compare_exchange_n(pDestination, &comparand, exchange, false,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return comparand;
+}
+
+inline void* InterlockedExchangePointer(void* volatile* pTarget, void* value)
+{
+	return __atomic_exchange_n(pTarget, value, __ATOMIC_SEQ_CST);
+}
+
+inline void* InterlockedCompareExchangePointer(void* volatile* pDestination,
+	void* exchange, void* comparand)
+{
+	__atomic_compare_exchange_n(pDestination, &comparand, exchange, false,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return comparand;
+}
+
+#define MemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+// ===== Interlocked singly linked lists =====
+
+// Guarded by a spin lock rather than Windows' lock-free sequence/depth
+// header; behavior is the same, only slower under contention
+typedef struct _SLIST_ENTRY
+{
+	struct _SLIST_ENTRY* Next;
+} SLIST_ENTRY, *PSLIST_ENTRY;
+
+typedef struct _SLIST_HEADER
+{
+	PSLIST_ENTRY Next;
+	USHORT Depth;
+	LONG Lock;
+} SLIST_HEADER, *PSLIST_HEADER;
+
+#define MEMORY_ALLOCATION_ALIGNMENT (2 * sizeof(void*))
+
+inline void _PortableSListLock(PSLIST_HEADER pListHead)
+{
+	while (__atomic_exchange_n(&pListHead->Lock, 1, __ATOMIC_ACQUIRE))
+	{
+	}
+}
+
+inline void _PortableSListUnlock(PSLIST_HEADER pListHead)
+{
+	__atomic_store_n(&pListHead->Lock, 0, __ATOMIC_RELEASE);
+}
+
+inline void InitializeSListHead(PSLIST_HEADER pListHead)
+{
+	memset(pListHead, 0, sizeof(SLIST_HEADER));
+}
+
+inline PSLIST_ENTRY InterlockedPushEntrySList(PSLIST_HEADER pListHead,
+	PSLIST_ENTRY pListEntry)
+{
+	_PortableSListLock(pListHead);
+	PSLIST_ENTRY pFirst = pListHead->Next;
+	pListEntry->Next = pFirst;
+	pListHead->Next = pListEntry;
+	++pListHead->Depth;
+	_PortableSListUnlock(pListHead);
+	return pFirst;
+}
+
+inline PSLIST_ENTRY InterlockedPopEntrySList(PSLIST_HEADER pListHead)
+{
+	_PortableSListLock(pListHead);
+	PSLIST_ENTRY pFirst = pListHead->Next;
+	if (pFirst)
+	{
+		pListHead->Next = pFirst->Next;
+		--pListHead->Depth;
+	}
+	_PortableSListUnlock(pListHead);
+	return pFirst;
+}
+
+inline PSLIST_ENTRY InterlockedFlushSList(PSLIST_HEADER pListHead)
+{
+	_PortableSListLock(pListHead);
+	PSLIST_ENTRY pFirst = pListHead->Next;
+	pListHead->Next = 0;
+	pListHead->Depth = 0;
+	_PortableSListUnlock(pListHead);
+	return pFirst;
+}
+
+inline USHORT QueryDepthSList(PSLIST_HEADER pListHead)
+{
+	_PortableSListLock(pListHead);
+	USHORT depth = pListHead->Depth;
+	_PortableSListUnlock(pListHead);
+	return depth;
+}
+
+// ===== Threads =====
+
+// Numbered in the order threads first ask, never 0
+inline DWORD GetCurrentThreadId()
+{
+	static LONG volatile s_lLastThreadId = 0;
+	static thread_local DWORD dwThreadId = 0;
+	if (!dwThreadId)
+	{
+		dwThreadId = static_cast<DWORD>(
+			InterlockedIncrement(&s_lLastThreadId));
+	}
+	return dwThreadId;
+}
+
+inline BOOL SwitchToThread()
+{
+	std::this_thread::yield();
+	return TRUE;
+}
+
+// ===== Time =====
+
+// Milliseconds since some point in the past, wrapping around like the
+// real one
+inline DWORD GetTickCount()
+{
+	return static_cast<DWORD>(
+		std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// 100 nanosecond intervals since January 1, 1601 UTC
+inline void GetSystemTimeAsFileTime(FILETIME* lpSystemTimeAsFileTime)
+{
+	const ULONGLONG ullUnixEpoch = 116444736000000000ULL;
+	ULONGLONG ullTime = ullUnixEpoch + static_cast<ULONGLONG>(
+		std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count()) *
+		10;
+	lpSystemTimeAsFileTime->dwLowDateTime = static_cast<DWORD>(ullTime);
+	lpSystemTimeAsFileTime->dwHighDateTime =
+		static_cast<DWORD>(ullTime >> 32);
+}
+
+// ===== Thread pool =====
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID lpThreadParameter);
+
+#define WT_EXECUTEDEFAULT 0x00000000
+
+// Runs every work item on a thread of its own
+inline BOOL QueueUserWorkItem(LPTHREAD_START_ROUTINE Function, PVOID Context,
+	ULONG)
+{
+	try
+	{
+		std::thread(Function, Context).detach();
+	}
+	catch (...)
+	{
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// ===== Files and file mappings =====
+
+// Only what's needed to write files sequentially and map them read-only.
+// File and mapping handles both wrap a file descriptor; views are mmap'ed.
+// Backslashes in file names are taken as path separators
+
+#define INVALID_HANDLE_VALUE ((HANDLE)(LONG_PTR)-1)
+
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+#define FILE_SHARE_READ 0x00000001
+#define FILE_SHARE_WRITE 0x00000002
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define FILE_ATTRIBUTE_NORMAL 0x00000080
+#define PAGE_READONLY 0x02
+#define FILE_MAP_READ 0x0004
+#define MOVEFILE_REPLACE_EXISTING 0x00000001
+
+struct _PortableEvent;
+
+struct _PortableFileHandle
+{
+	int fd;
+	// Size of the mapping, for mapping handles
+	ULONGLONG cbMapping;
+	// For event handles, whose fd is -1, see Events below
+	_PortableEvent* pEvent;
+};
+
+inline DWORD& _PortableLastError()
+{
+	static thread_local DWORD dwLastError = ERROR_SUCCESS;
+	return dwLastError;
+}
+
+inline DWORD GetLastError()
+{
+	return _PortableLastError();
+}
+
+inline void SetLastError(DWORD dwErrCode)
+{
+	_PortableLastError() = dwErrCode;
+}
+
+inline void _PortableSetLastErrorFromErrno()
+{
+	switch (errno)
+	{
+	case ENOENT: SetLastError(ERROR_FILE_NOT_FOUND); break;
+	case EACCES: case EPERM: SetLastError(ERROR_ACCESS_DENIED); break;
+	case EBADF: SetLastError(ERROR_INVALID_HANDLE); break;
+	case ENOMEM: SetLastError(ERROR_NOT_ENOUGH_MEMORY); break;
+	case EINVAL: SetLastError(ERROR_INVALID_PARAMETER); break;
+	default: SetLastError(ERROR_WRITE_FAULT); break;
+	}
+}
+
+inline std::string _PortableFileName(LPCWSTR lpFileName)
+{
+	std::string fileName;
+	for (LPCWSTR p = lpFileName; *p; ++p)
+	{
+		// Only ASCII names are supported
+		fileName += *p == L'\\' ? '/' : static_cast<char>(*p);
+	}
+	return fileName;
+}
+
+inline HANDLE CreateFileW(LPCWSTR lpFileName, DWORD dwDesiredAccess, DWORD,
+	SECURITY_ATTRIBUTES*, DWORD dwCreationDisposition, DWORD, HANDLE)
+{
+	std::string fileName = _PortableFileName(lpFileName);
+
+	int flags = (dwDesiredAccess & GENERIC_WRITE) ?
+		((dwDesiredAccess & GENERIC_READ) ? O_RDWR : O_WRONLY) : O_RDONLY;
+	if (dwCreationDisposition == CREATE_ALWAYS)
+	{
+		flags |= O_CREAT | O_TRUNC;
+	}
+	int fd = open(fileName.c_str(), flags | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		_PortableSetLastErrorFromErrno();
+		return INVALID_HANDLE_VALUE;
+	}
+	_PortableFileHandle* pHandle = new _PortableFileHandle;
+	pHandle->fd = fd;
+	pHandle->cbMapping = 0;
+	pHandle->pEvent = 0;
+	return pHandle;
+}
+
+inline void _PortableDeleteEvent(_PortableEvent* pEvent);
+
+inline BOOL CloseHandle(HANDLE hObject)
+{
+	if (!hObject || hObject == INVALID_HANDLE_VALUE)
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+	_PortableFileHandle* pHandle = static_cast<_PortableFileHandle*>(hObject);
+	if (pHandle->pEvent)
+	{
+		_PortableDeleteEvent(pHandle->pEvent);
+	}
+	else
+	{
+		close(pHandle->fd);
+	}
+	delete pHandle;
+	return TRUE;
+}
+
+#define DUPLICATE_SAME_ACCESS 0x00000002
+
+typedef HANDLE* LPHANDLE;
+
+// The only process there is
+inline HANDLE GetCurrentProcess()
+{
+	return reinterpret_cast<HANDLE>(static_cast<LONG_PTR>(-1));
+}
+
+// File handles within the current process only
+inline BOOL DuplicateHandle(HANDLE, HANDLE hSourceHandle, HANDLE,
+	LPHANDLE lpTargetHandle, DWORD, BOOL, DWORD dwOptions)
+{
+	_PortableFileHandle* pSource =
+		static_cast<_PortableFileHandle*>(hSourceHandle);
+	if (dwOptions != DUPLICATE_SAME_ACCESS || pSource->pEvent)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	int fd = dup(pSource->fd);
+	if (fd < 0)
+	{
+		_PortableSetLastErrorFromErrno();
+		return FALSE;
+	}
+	_PortableFileHandle* pHandle = new _PortableFileHandle;
+	pHandle->fd = fd;
+	pHandle->cbMapping = pSource->cbMapping;
+	pHandle->pEvent = 0;
+	*lpTargetHandle = pHandle;
+	return TRUE;
+}
+
+inline BOOL GetFileSizeEx(HANDLE hFile, LARGE_INTEGER* lpFileSize)
+{
+	struct stat st;
+	if (fstat(static_cast<_PortableFileHandle*>(hFile)->fd, &st) != 0)
+	{
+		_PortableSetLastErrorFromErrno();
+		return FALSE;
+	}
+	lpFileSize->QuadPart = st.st_size;
+	return TRUE;
+}
+
+inline BOOL WriteFile(HANDLE hFile, LPCVOID lpBuffer,
+	DWORD nNumberOfBytesToWrite, LPDWORD lpNumberOfBytesWritten, LPVOID)
+{
+	const BYTE* pb = static_cast<const BYTE*>(lpBuffer);
+	DWORD cbWritten = 0;
+	while (cbWritten < nNumberOfBytesToWrite)
+	{
+		ssize_t cb = write(static_cast<_PortableFileHandle*>(hFile)->fd,
+			pb + cbWritten, nNumberOfBytesToWrite - cbWritten);
+		if (cb < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			_PortableSetLastErrorFromErrno();
+			break;
+		}
+		cbWritten += static_cast<DWORD>(cb);
+	}
+	if (lpNumberOfBytesWritten)
+	{
+		*lpNumberOfBytesWritten = cbWritten;
+	}
+	return cbWritten == nNumberOfBytesToWrite;
+}
+
+inline BOOL FlushFileBuffers(HANDLE hFile)
+{
+	if (fsync(static_cast<_PortableFileHandle*>(hFile)->fd) != 0)
+	{
+		_PortableSetLastErrorFromErrno();
+		return FALSE;
+	}
+	return TRUE;
+}
+
+inline BOOL DeleteFileW(LPCWSTR lpFileName)
+{
+	if (unlink(_PortableFileName(lpFileName).c_str()) != 0)
+	{
+		_PortableSetLastErrorFromErrno();
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// rename always replaces the target
+inline BOOL MoveFileExW(LPCWSTR lpExistingFileName, LPCWSTR lpNewFileName,
+	DWORD dwFlags)
+{
+	if (!(dwFlags & MOVEFILE_REPLACE_EXISTING) &&
+		access(_PortableFileName(lpNewFileName).c_str(), F_OK) == 0)
+	{
+		SetLastError(ERROR_ALREADY_EXISTS);
+		return FALSE;
+	}
+	if (rename(_PortableFileName(lpExistingFileName).c_str(),
+		_PortableFileName(lpNewFileName).c_str()) != 0)
+	{
+		_PortableSetLastErrorFromErrno();
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// Read-only mappings of a whole file only; the name is ignored
+inline HANDLE CreateFileMappingW(HANDLE hFile, SECURITY_ATTRIBUTES*,
+	DWORD flProtect, DWORD dwMaximumSizeHigh, DWORD dwMaximumSizeLow,
+	LPCWSTR)
+{
+	LARGE_INTEGER cbFile;
+	if (flProtect != PAGE_READONLY || dwMaximumSizeHigh || dwMaximumSizeLow)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return 0;
+	}
+	if (!GetFileSizeEx(hFile, &cbFile))
+	{
+		return 0;
+	}
+	int fd = dup(static_cast<_PortableFileHandle*>(hFile)->fd);
+	if (fd < 0)
+	{
+		_PortableSetLastErrorFromErrno();
+		return 0;
+	}
+	_PortableFileHandle* pHandle = new _PortableFileHandle;
+	pHandle->fd = fd;
+	pHandle->cbMapping = cbFile.QuadPart;
+	pHandle->pEvent = 0;
+	return pHandle;
+}
+
+// munmap needs the size of the view, which UnmapViewOfFile doesn't get
+inline std::map<LPCVOID, SIZE_T>& _PortableViews(std::mutex** ppMutex)
+{
+	static std::mutex mutex;
+	static std::map<LPCVOID, SIZE_T> views;
+	*ppMutex = &mutex;
+	return views;
+}
+
+inline LPVOID MapViewOfFile(HANDLE hFileMappingObject, DWORD dwDesiredAccess,
+	DWORD dwFileOffsetHigh, DWORD dwFileOffsetLow,
+	SIZE_T dwNumberOfBytesToMap)
+{
+	_PortableFileHandle* pHandle =
+		static_cast<_PortableFileHandle*>(hFileMappingObject);
+	if (dwDesiredAccess != FILE_MAP_READ || dwFileOffsetHigh ||
+		dwFileOffsetLow || dwNumberOfBytesToMap > pHandle->cbMapping ||
+		!pHandle->cbMapping)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return 0;
+	}
+	SIZE_T cb = dwNumberOfBytesToMap ? dwNumberOfBytesToMap :
+		static_cast<SIZE_T>(pHandle->cbMapping);
+	void* pv = mmap(0, cb, PROT_READ, MAP_SHARED, pHandle->fd, 0);
+	if (pv == MAP_FAILED)
+	{
+		_PortableSetLastErrorFromErrno();
+		return 0;
+	}
+
+	std::mutex* pMutex = 0;
+	std::map<LPCVOID, SIZE_T>& views = _PortableViews(&pMutex);
+	std::lock_guard<std::mutex> lock(*pMutex);
+	views[pv] = cb;
+	return pv;
+}
+
+inline BOOL UnmapViewOfFile(LPCVOID lpBaseAddress)
+{
+	std::mutex* pMutex = 0;
+	std::map<LPCVOID, SIZE_T>& views = _PortableViews(&pMutex);
+	std::lock_guard<std::mutex> lock(*pMutex);
+	std::map<LPCVOID, SIZE_T>::iterator it = views.find(lpBaseAddress);
+	if (it == views.end())
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	munmap(const_cast<void*>(lpBaseAddress), it->second);
+	views.erase(it);
+	return TRUE;
+}
+
+// ===== Events =====
+
+// Unnamed events, waited for one at a time. Their handles are closed with
+// CloseHandle like the others
+
+#define INFINITE 0xFFFFFFFF
+#define WAIT_OBJECT_0 0x00000000L
+#define WAIT_TIMEOUT 0x00000102L
+#define WAIT_FAILED 0xFFFFFFFF
+
+struct _PortableEvent
+{
+	std::mutex mutex;
+	std::condition_variable signaled;
+	bool bManualReset;
+	bool bSignaled;
+};
+
+inline void _PortableDeleteEvent(_PortableEvent* pEvent)
+{
+	delete pEvent;
+}
+
+inline HANDLE CreateEventW(SECURITY_ATTRIBUTES*, BOOL bManualReset,
+	BOOL bInitialState, LPCWSTR lpName)
+{
+	if (lpName)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return 0;
+	}
+	_PortableEvent* pEvent = new(std::nothrow) _PortableEvent;
+	_PortableFileHandle* pHandle = new(std::nothrow) _PortableFileHandle;
+	if (!pEvent || !pHandle)
+	{
+		delete pEvent;
+		delete pHandle;
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return 0;
+	}
+	pEvent->bManualReset = bManualReset != FALSE;
+	pEvent->bSignaled = bInitialState != FALSE;
+	pHandle->fd = -1;
+	pHandle->cbMapping = 0;
+	pHandle->pEvent = pEvent;
+	return pHandle;
+}
+
+inline BOOL SetEvent(HANDLE hEvent)
+{
+	_PortableEvent* pEvent =
+		static_cast<_PortableFileHandle*>(hEvent)->pEvent;
+	std::lock_guard<std::mutex> lock(pEvent->mutex);
+	pEvent->bSignaled = true;
+	pEvent->signaled.notify_all();
+	return TRUE;
+}
+
+inline BOOL ResetEvent(HANDLE hEvent)
+{
+	_PortableEvent* pEvent =
+		static_cast<_PortableFileHandle*>(hEvent)->pEvent;
+	std::lock_guard<std::mutex> lock(pEvent->mutex);
+	pEvent->bSignaled = false;
+	return TRUE;
+}
+
+inline DWORD WaitForSingleObject(HANDLE hHandle, DWORD dwMilliseconds)
+{
+	_PortableEvent* pEvent =
+		static_cast<_PortableFileHandle*>(hHandle)->pEvent;
+	if (!pEvent)
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return WAIT_FAILED;
+	}
+	std::unique_lock<std::mutex> lock(pEvent->mutex);
+	if (dwMilliseconds == INFINITE)
+	{
+		pEvent->signaled.wait(lock, [pEvent] {return pEvent->bSignaled;});
+	}
+	else if (!pEvent->signaled.wait_for(lock,
+		std::chrono::milliseconds(dwMilliseconds),
+		[pEvent] {return pEvent->bSignaled;}))
+	{
+		return WAIT_TIMEOUT;
+	}
+	if (!pEvent->bManualReset)
+	{
+		pEvent->bSignaled = false;
+	}
+	return WAIT_OBJECT_0;
+}
+
+// ===== Timer queue timers =====
+
+// One-shot timers on the default queue, each waiting on a thread of its
+// own. Deleting a timer with INVALID_HANDLE_VALUE for the completion event
+// waits for its callback, if running; with 0, it doesn't
+
+typedef HANDLE* PHANDLE;
+typedef void (CALLBACK *WAITORTIMERCALLBACK)(PVOID lpParameter,
+	BOOLEAN TimerOrWaitFired);
+
+#define WT_EXECUTEONLYONCE 0x00000008
+
+struct _PortableTimer
+{
+	std::mutex mutex;
+	std::condition_variable deleted;
+	bool bDeleted;
+	// Held by the handle and by the thread
+	LONG lRef;
+	std::thread thread;
+};
+
+inline void _PortableReleaseTimer(_PortableTimer* pTimer)
+{
+	if (!InterlockedDecrement(&pTimer->lRef))
+	{
+		delete pTimer;
+	}
+}
+
+inline void _PortableRunTimer(_PortableTimer* pTimer,
+	WAITORTIMERCALLBACK Callback, PVOID Parameter, DWORD DueTime)
+{
+	bool bDeleted = false;
+	{
+		std::unique_lock<std::mutex> lock(pTimer->mutex);
+		bDeleted = pTimer->deleted.wait_for(lock,
+			std::chrono::milliseconds(DueTime),
+			[pTimer] {return pTimer->bDeleted;});
+	}
+	if (!bDeleted)
+	{
+		Callback(Parameter, TRUE);
+	}
+	_PortableReleaseTimer(pTimer);
+}
+
+inline BOOL CreateTimerQueueTimer(PHANDLE phNewTimer, HANDLE TimerQueue,
+	WAITORTIMERCALLBACK Callback, PVOID Parameter, DWORD DueTime,
+	DWORD Period, ULONG)
+{
+	if (TimerQueue || Period)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	_PortableTimer* pTimer = new(std::nothrow) _PortableTimer;
+	if (!pTimer)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return FALSE;
+	}
+	pTimer->bDeleted = false;
+	pTimer->lRef = 2;
+	try
+	{
+		pTimer->thread = std::thread(_PortableRunTimer, pTimer, Callback,
+			Parameter, DueTime);
+	}
+	catch (...)
+	{
+		delete pTimer;
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return FALSE;
+	}
+	*phNewTimer = pTimer;
+	return TRUE;
+}
+
+inline BOOL DeleteTimerQueueTimer(HANDLE TimerQueue, HANDLE Timer,
+	HANDLE CompletionEvent)
+{
+	_PortableTimer* pTimer = static_cast<_PortableTimer*>(Timer);
+	{
+		std::lock_guard<std::mutex> lock(pTimer->mutex);
+		pTimer->bDeleted = true;
+		pTimer->deleted.notify_all();
+	}
+	if (CompletionEvent == INVALID_HANDLE_VALUE)
+	{
+		pTimer->thread.join();
+	}
+	else
+	{
+		pTimer->thread.detach();
+	}
+	_PortableReleaseTimer(pTimer);
+	return TRUE;
+}
+
+// ===== Critical sections =====
+
+// Like its Windows counterpart, a critical section may be entered
+// recursively by the owning thread
+typedef struct _CRITICAL_SECTION
+{
+	std::recursive_mutex* pMutex;
+} CRITICAL_SECTION, *LPCRITICAL_SECTION;
+
+inline void InitializeCriticalSection(LPCRITICAL_SECTION pcs)
+{
+	pcs->pMutex = new std::recursive_mutex;
+}
+
+inline BOOL InitializeCriticalSectionAndSpinCount(LPCRITICAL_SECTION pcs,
+	DWORD)
+{
+	pcs->pMutex = new (std::nothrow) std::recursive_mutex;
+	return pcs->pMutex != 0;
+}
+
+inline void DeleteCriticalSection(LPCRITICAL_SECTION pcs)
+{
+	delete pcs->pMutex;
+	pcs->pMutex = 0;
+}
+
+inline void EnterCriticalSection(LPCRITICAL_SECTION pcs)
+{
+	pcs->pMutex->lock();
+}
+
+inline BOOL TryEnterCriticalSection(LPCRITICAL_SECTION pcs)
+{
+	return pcs->pMutex->try_lock();
+}
+
+inline void LeaveCriticalSection(LPCRITICAL_SECTION pcs)
+{
+	pcs->pMutex->unlock();
+}
+
+// ===== IUnknown and IClassFactory =====
+
+DEFINE_GUID(IID_IUnknown,
+	0x00000000, 0x0000, 0x0000, 0xc0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46);
+DEFINE_GUID(IID_IClassFactory,
+	0x00000001, 0x0000, 0x0000, 0xc0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46);
+
+struct IUnknown
+{
+	STDMETHOD(QueryInterface)(REFIID riid, void** ppvObject) = 0;
+	STDMETHOD_(ULONG, AddRef)() = 0;
+	STDMETHOD_(ULONG, Release)() = 0;
+
+	template <class Q>
+	HRESULT STDMETHODCALLTYPE QueryInterface(Q** pp)
+	{
+		return QueryInterface(__uuidof(Q), (void**)pp);
+	}
+};
+DECLARE_PORTABLE_UUIDOF(IUnknown)
+
+typedef IUnknown* LPUNKNOWN;
+
+struct IClassFactory : public IUnknown
+{
+	STDMETHOD(CreateInstance)(IUnknown* pUnkOuter, REFIID riid,
+		void** ppvObject) = 0;
+	STDMETHOD(LockServer)(BOOL fLock) = 0;
+};
+DECLARE_PORTABLE_UUIDOF(IClassFactory)
+
+// ===== Task memory and BSTR =====
+
+inline LPVOID CoTaskMemAlloc(SIZE_T cb)
+{
+	return malloc(cb);
+}
+
+inline LPVOID CoTaskMemRealloc(LPVOID pv, SIZE_T cb)
+{
+	return realloc(pv, cb);
+}
+
+inline void CoTaskMemFree(LPVOID pv)
+{
+	free(pv);
+}
+
+// A BSTR is preceded by its length in bytes and followed by a terminator
+inline BSTR SysAllocStringLen(const OLECHAR* psz, UINT cch)
+{
+	UINT* pcb = static_cast<UINT*>(
+		malloc(sizeof(UINT) + (cch + 1) * sizeof(OLECHAR)));
+	if (!pcb)
+	{
+		return 0;
+	}
+	*pcb = cch * sizeof(OLECHAR);
+	BSTR bstr = reinterpret_cast<BSTR>(pcb + 1);
+	if (psz)
+	{
+		memcpy(bstr, psz, cch * sizeof(OLECHAR));
+	}
+	bstr[cch] = 0;
+	return bstr;
+}
+
+inline BSTR SysAllocString(const OLECHAR* psz)
+{
+	return psz ? SysAllocStringLen(psz, static_cast<UINT>(wcslen(psz))) : 0;
+}
+
+inline void SysFreeString(BSTR bstr)
+{
+	if (bstr)
+	{
+		free(reinterpret_cast<UINT*>(bstr) - 1);
+	}
+}
+
+inline UINT SysStringLen(BSTR bstr)
+{
+	return bstr ? reinterpret_cast<UINT*>(bstr)[-1] / sizeof(OLECHAR) : 0;
+}
+
+inline UINT SysStringByteLen(BSTR bstr)
+{
+	return bstr ? reinterpret_cast<UINT*>(bstr)[-1] : 0;
+}
+
+// ===== Class object registration =====
+
+// There is no registry; class objects are only visible to CoGetClassObject
+// after CoRegisterClassObject has been called in this process
+
+#define CLSCTX_INPROC_SERVER 0x1
+#define CLSCTX_INPROC_HANDLER 0x2
+#define CLSCTX_LOCAL_SERVER 0x4
+#define CLSCTX_REMOTE_SERVER 0x10
+#define CLSCTX_INPROC (CLSCTX_INPROC_SERVER | CLSCTX_INPROC_HANDLER)
+#define CLSCTX_ALL (CLSCTX_INPROC_SERVER | CLSCTX_INPROC_HANDLER | \
+	CLSCTX_LOCAL_SERVER | CLSCTX_REMOTE_SERVER)
+
+#define REGCLS_SINGLEUSE 0
+#define REGCLS_MULTIPLEUSE 1
+
+struct _PortableClassObjectEntry
+{
+	CLSID clsid;
+	IUnknown* punk;
+	DWORD dwRegister;
+};
+
+struct _PortableClassObjectTable
+{
+	std::mutex lock;
+	std::vector<_PortableClassObjectEntry> entries;
+	DWORD dwNextRegister;
+
+	static _PortableClassObjectTable& Get()
+	{
+		static _PortableClassObjectTable table;
+		return table;
+	}
+};
+
+#define COINIT_MULTITHREADED 0x0
+
+// There are no apartments here
+inline HRESULT CoInitializeEx(LPVOID, DWORD)
+{
+	return S_OK;
+}
+
+inline void CoUninitialize()
+{
+}
+
+inline HRESULT CoRegisterClassObject(REFCLSID rclsid, IUnknown* pUnk,
+	DWORD, DWORD, LPDWORD lpdwRegister)
+{
+	if (!pUnk || !lpdwRegister)
+	{
+		return E_INVALIDARG;
+	}
+	_PortableClassObjectTable& table = _PortableClassObjectTable::Get();
+	std::lock_guard<std::mutex> lock(table.lock);
+	_PortableClassObjectEntry entry = {rclsid, pUnk, ++table.dwNextRegister};
+	table.entries.push_back(entry);
+	pUnk->AddRef();
+	*lpdwRegister = entry.dwRegister;
+	return S_OK;
+}
+
+inline HRESULT CoRevokeClassObject(DWORD dwRegister)
+{
+	IUnknown* punk = 0;
+	{
+		_PortableClassObjectTable& table = _PortableClassObjectTable::Get();
+		std::lock_guard<std::mutex> lock(table.lock);
+		for (size_t i = 0; i < table.entries.size(); ++i)
+		{
+			if (table.entries[i].dwRegister == dwRegister)
+			{
+				punk = table.entries[i].punk;
+				table.entries.erase(table.entries.begin() + i);
+				break;
+			}
+		}
+	}
+	if (!punk)
+	{
+		return CO_E_OBJNOTREG;
+	}
+	punk->Release();
+	return S_OK;
+}
+
+inline HRESULT CoGetClassObject(REFCLSID rclsid, DWORD, LPVOID,
+	REFIID riid, LPVOID* ppv)
+{
+	if (!ppv)
+	{
+		return E_POINTER;
+	}
+	*ppv = 0;
+	IUnknown* punk = 0;
+	{
+		_PortableClassObjectTable& table = _PortableClassObjectTable::Get();
+		std::lock_guard<std::mutex> lock(table.lock);
+		for (size_t i = 0; i < table.entries.size(); ++i)
+		{
+			if (InlineIsEqualGUID(table.entries[i].clsid, rclsid))
+			{
+				punk = table.entries[i].punk;
+				punk->AddRef();
+				break;
+			}
+		}
+	}
+	if (!punk)
+	{
+		return REGDB_E_CLASSNOTREG;
+	}
+	HRESULT hr = punk->QueryInterface(riid, ppv);
+	punk->Release();
+	return hr;
+}
+
+#endif // PASSTHROUGHAPP_PORTABLE_WINDOWS_H
@@ -1,80 +1,191 @@
-#ifndef PASSTHROUGHAPP_PROTOCOLCF_H
-#define PASSTHROUGHAPP_PROTOCOLCF_H
-
-#if _MSC_VER > 1000
-#pragma once
-#endif // _MSC_VER > 1000
-
-namespace PassthroughAPP
-{
-
-namespace Detail
-{
-// A bit of template metaprogramming allows to avoid requiring
-// the protocol class to either derive from CComCoClass or explicitly
-// specify DECLARE_*AGGREGATABLE macro. If the class does it, the declared
-// behavior is used, otherwise the default behavior is as if
-// DECLARE_AGGREGATABLE is specified
-
-// If T has a typedef _CreatorClass, Derived would pick it from its base.
-// If T does not define _CreatorClass, the definition is picked from the next
-// enclosing scope, which is ChooseCreatorClass::_CreatorClass, or Default
-template <typename T, typename Default>
-struct ChooseCreatorClass
-{
-	typedef Default _CreatorClass;
-	struct Derived : private T
-	{
-		typedef _CreatorClass CreatorClass;
-	};
-	typedef typename Derived::CreatorClass CreatorClass;
-};
-
-} // end namespace PassthroughAPP::Detail
-
-class ATL_NO_VTABLE CComClassFactoryProtocol :
-	public CComClassFactory
-{
-	typedef CComClassFactory BaseClass;
-public:
-	STDMETHODIMP CreateInstance(IUnknown* punkOuter, REFIID riid,
-		void** ppvObj);
-
-	HRESULT CreateInstanceTarget(IUnknown** ppTargetProtocol);
-
-	HRESULT GetTargetClassFactory(IClassFactory** ppCF);
-	HRESULT SetTargetClassFactory(IClassFactory* pCF);
-	HRESULT SetTargetCLSID(REFCLSID clsid, DWORD clsContext = CLSCTX_ALL);
-
-	void FinalRelease();
-private:
-	CComPtr<IClassFactory> m_spTargetCF;
-};
-
-template <class Factory, class Protocol,
-	class FactoryComObject = CComObjectNoLock<Factory> >
-struct CMetaFactory
-{
-	typedef
-		CComCreator2<CComCreator<CComObject<Protocol> >,
-			CComCreator<CComAggObject<Protocol> > >
-	DefaultCreatorClass;
-
-	typedef typename
-		Detail::ChooseCreatorClass<Protocol, DefaultCreatorClass>::CreatorClass
-			CreatorClass;
-
-	// returns a non-AddRef'ed pointer to FactoryComObject, already initialized
-	// with Protocol's creator function, via ppObj [out] parameter
-	static HRESULT CreateInstance(Factory** ppObj);
-
-	static HRESULT CreateInstance(IClassFactory* pTargetCF,
-		IClassFactory** ppCF);
-	static HRESULT CreateInstance(REFCLSID clsidTarget, IClassFactory** ppCF);
-};
-
-} // end namespace PassthroughAPP
-
-#include "ProtocolCF.inl"
-
-#endif // PASSTHROUGHAPP_PROTOCOLCF_H
+#ifndef PASSTHROUGHAPP_PROTOCOLCF_H
+#define PASSTHROUGHAPP_PROTOCOLCF_H
+
+#if _MSC_VER > 1000
+#pragma once
+#endif // _MSC_VER > 1000
+
+#include "PassthroughObject.h"
+
+namespace PassthroughAPP
+{
+
+namespace Detail
+{
+// A bit of template metaprogramming allows to avoid requiring
+// the protocol class to either derive from CComCoClass or explicitly
+// specify DECLARE_*AGGREGATABLE macro. If the class does it, the declared
+// behavior is used, otherwise the default behavior is as if
+// DECLARE_AGGREGATABLE is specified
+
+#if defined(_MSC_VER) && _MSC_VER < 1310
+
+// If T has a typedef _CreatorClass, Derived would pick it from its base.
+// If T does not define _CreatorClass, the definition is picked from the next
+// enclosing scope, which is ChooseCreatorClass::_CreatorClass, or Default
+template <typename T, typename Default>
+struct ChooseCreatorClass
+{
+	typedef Default _CreatorClass;
+	struct Derived : private T
+	{
+		typedef _CreatorClass CreatorClass;
+	};
+	typedef typename Derived::CreatorClass CreatorClass;
+};
+
+#else
+
+// Compilers with two-phase name lookup never look into the dependent base
+// for the trick above, and would silently pick Default. Detect
+// T::_CreatorClass with SFINAE instead
+template <typename T, typename Default, bool hasCreatorClass>
+struct SelectCreatorClass
+{
+	typedef Default CreatorClass;
+};
+
+template <typename T, typename Default>
+struct SelectCreatorClass<T, Default, true>
+{
+	typedef typename T::_CreatorClass CreatorClass;
+};
+
+template <typename T, typename Default>
+struct ChooseCreatorClass
+{
+	template <typename U>
+	static char (&HasCreatorClass(typename U::_CreatorClass*))[2];
+	template <typename U>
+	static char HasCreatorClass(...);
+
+	typedef typename SelectCreatorClass<T, Default,
+		sizeof(HasCreatorClass<T>(0)) == 2>::CreatorClass CreatorClass;
+};
+
+#endif
+
+// A target protocol created ahead of time
+struct PooledTarget
+{
+	// Must be first, entries are cast back to PooledTarget
+	SLIST_ENTRY entry;
+	IUnknown* punkTarget;
+	// Pool generation at creation time. Targets created before the target
+	// class factory was last replaced are discarded
+	LONG lGeneration;
+};
+
+} // end namespace PassthroughAPP::Detail
+
+struct TargetPoolStatistics
+{
+	// Targets handed out from the pool, and created on demand because the
+	// pool was empty
+	LONG cHits;
+	LONG cMisses;
+	// Targets currently in the pool
+	LONG cPooled;
+};
+
+class ATL_NO_VTABLE CComClassFactoryProtocol :
+	public CComClassFactory,
+	public IPassthroughTargetFactory
+{
+	typedef CComClassFactory BaseClass;
+public:
+	CComClassFactoryProtocol();
+
+	BEGIN_COM_MAP(CComClassFactoryProtocol)
+		COM_INTERFACE_ENTRY(IClassFactory)
+		COM_INTERFACE_ENTRY(IPassthroughTargetFactory)
+	END_COM_MAP()
+
+	STDMETHODIMP CreateInstance(IUnknown* punkOuter, REFIID riid,
+		void** ppvObj);
+
+	HRESULT CreateInstanceTarget(IUnknown** ppTargetProtocol);
+
+	// Takes no lock: CreateInstance calls it for every request, from any
+	// binding thread
+	HRESULT GetTargetClassFactory(IClassFactory** ppCF);
+	// Releases the factory it replaces before returning, after waiting for
+	// the GetTargetClassFactory calls that may have loaded it to finish
+	HRESULT SetTargetClassFactory(IClassFactory* pCF);
+	HRESULT SetTargetCLSID(REFCLSID clsid, DWORD clsContext = CLSCTX_ALL);
+
+	// If set, CreateInstance hands the new object this factory instead of
+	// a target protocol, and the object creates the target only when it
+	// forwards a call to it. Set it before registering the factory
+	void SetDeferTargetCreation(bool bDefer);
+
+	// Keeps up to cTargets target protocols created ahead of time, for
+	// CreateInstanceTarget to hand out. The pool is refilled on a thread
+	// pool thread, so the target class factory must allow creating
+	// objects there. 0, the default, turns the pool off and releases the
+	// targets in it
+	HRESULT SetTargetPoolSize(LONG cTargets);
+	void GetTargetPoolStatistics(TargetPoolStatistics* pStats);
+
+	// IPassthroughTargetFactory
+	STDMETHODIMP CreateTarget(IUnknown** ppunkTarget);
+
+	void FinalRelease();
+private:
+	HRESULT CreateNewTarget(IUnknown** ppTargetProtocol,
+		LONG* plGeneration);
+	bool PopPooledTarget(IUnknown** ppTargetProtocol);
+	// Returns once every GetTargetClassFactory that may have loaded the
+	// previous target class factory has AddRef'ed it
+	void WaitForTargetCFReaders();
+	void ScheduleRefill();
+	void Refill();
+	void DrainTargetPool();
+	static DWORD WINAPI RefillProc(LPVOID pv);
+
+	SLIST_HEADER m_targetPool;
+	LONG m_cTargetPoolSize;
+	LONG m_cPooled;
+	LONG m_cPoolHits;
+	LONG m_cPoolMisses;
+	LONG m_lPoolGeneration;
+	LONG m_lRefillQueued;
+
+	// Replaced atomically by SetTargetClassFactory
+	CComPtr<IClassFactory> m_spTargetCF;
+	// GetTargetClassFactory calls in progress, counted in the slot of the
+	// epoch they started in. SetTargetClassFactory moves the epoch on and
+	// waits for the previous slot to drain before releasing the factory
+	// it replaced
+	LONG m_lReaderEpoch;
+	LONG m_cReaders[2];
+	bool m_bDeferTarget;
+};
+
+template <class Factory, class Protocol,
+	class FactoryComObject = CComObjectNoLock<Factory> >
+struct CMetaFactory
+{
+	typedef
+		CComCreator2<CComCreator<CComObject<Protocol> >,
+			CComCreator<CComAggObject<Protocol> > >
+	DefaultCreatorClass;
+
+	typedef typename
+		Detail::ChooseCreatorClass<Protocol, DefaultCreatorClass>::CreatorClass
+			CreatorClass;
+
+	// returns a non-AddRef'ed pointer to FactoryComObject, already initialized
+	// with Protocol's creator function, via ppObj [out] parameter
+	static HRESULT CreateInstance(Factory** ppObj);
+
+	static HRESULT CreateInstance(IClassFactory* pTargetCF,
+		IClassFactory** ppCF);
+	static HRESULT CreateInstance(REFCLSID clsidTarget, IClassFactory** ppCF);
+};
+
+} // end namespace PassthroughAPP
+
+#include "ProtocolCF.inl"
+
+#endif // PASSTHROUGHAPP_PROTOCOLCF_H
@@ -1,241 +1,515 @@
-#ifndef PASSTHROUGHAPP_PROTOCOLCF_INL
-#define PASSTHROUGHAPP_PROTOCOLCF_INL
-
-#if _MSC_VER > 1000
-#pragma once
-#endif // _MSC_VER > 1000
-
-#ifndef PASSTHROUGHAPP_PROTOCOLCF_H
-	#error ProtocolCF.inl requires ProtocolCF.h to be included first
-#endif
-
-#include "PassthroughObject.h"
-
-namespace PassthroughAPP
-{
-
-// ===== CComClassFactoryProtocol =====
-
-inline STDMETHODIMP CComClassFactoryProtocol::CreateInstance(
-	IUnknown* punkOuter, REFIID riid, void** ppvObj)
-{
-	ATLASSERT(ppvObj != 0);
-	if (!ppvObj)
-	{
-		return E_POINTER;
-	}
-	*ppvObj = 0;
-
-	CComPtr<IUnknown> spUnkTarget;
-	HRESULT hr = CreateInstanceTarget(&spUnkTarget);
-	ATLASSERT(SUCCEEDED(hr) && spUnkTarget != 0);
-
-	CComPtr<IUnknown> spUnkObject;
-	if (SUCCEEDED(hr))
-	{
-		hr = BaseClass::CreateInstance(punkOuter, riid,
-			reinterpret_cast<void**>(&spUnkObject));
-		ATLASSERT(SUCCEEDED(hr) && spUnkObject != 0);
-	}
-
-	if (SUCCEEDED(hr))
-	{
-		CComPtr<IPassthroughObject> spPassthroughObj;
-		hr = spUnkObject->QueryInterface(&spPassthroughObj);
-		ATLASSERT(SUCCEEDED(hr) && spPassthroughObj != 0);
-		if (SUCCEEDED(hr))
-		{
-			hr = spPassthroughObj->SetTargetUnknown(spUnkTarget);
-			ATLASSERT(SUCCEEDED(hr));
-		}
-	}
-
-	if (SUCCEEDED(hr))
-	{
-		*ppvObj = spUnkObject.Detach();
-	}
-	return hr;
-}
-
-inline HRESULT CComClassFactoryProtocol::CreateInstanceTarget(
-	IUnknown** ppTargetProtocol)
-{
-	ATLASSERT(ppTargetProtocol != 0);
-	if (!ppTargetProtocol)
-	{
-		return E_POINTER;
-	}
-	*ppTargetProtocol = 0;
-
-	CComPtr<IClassFactory> spTargetCF;
-	HRESULT hr = GetTargetClassFactory(&spTargetCF);
-	ATLASSERT(SUCCEEDED(hr) && spTargetCF != 0);
-	if (SUCCEEDED(hr))
-	{
-		hr = spTargetCF->CreateInstance(0, IID_IInternetProtocolRoot,
-			reinterpret_cast<void**>(ppTargetProtocol));
-		ATLASSERT(SUCCEEDED(hr) && *ppTargetProtocol != 0);
-	}
-	return hr;
-}
-
-inline HRESULT CComClassFactoryProtocol::GetTargetClassFactory(
-	IClassFactory** ppCF)
-{
-	ObjectLock lock(this);
-	return m_spTargetCF.CopyTo(ppCF);
-}
-
-inline HRESULT CComClassFactoryProtocol::SetTargetClassFactory(
-	IClassFactory* pCF)
-{
-	HRESULT hr = (pCF ? pCF->LockServer(TRUE) : S_OK);
-	if (SUCCEEDED(hr))
-	{
-		ObjectLock lock(this);
-		if (m_spTargetCF)
-		{
-			// LockServer(FALSE) is assumed to always succeed. Otherwise,
-			// it is impossible to implement correct semantics
-			HRESULT hr1 = m_spTargetCF->LockServer(FALSE);
-			hr1;
-			ATLASSERT(SUCCEEDED(hr1));
-		}
-		m_spTargetCF = pCF;
-	}
-	return hr;
-}
-
-inline HRESULT CComClassFactoryProtocol::SetTargetCLSID(REFCLSID clsid,
-	DWORD clsContext)
-{
-	CComPtr<IClassFactory> spTargetCF;
-	HRESULT hr = CoGetClassObject(clsid, clsContext, 0, IID_IClassFactory,
-		reinterpret_cast<void**>(&spTargetCF));
-	ATLASSERT(SUCCEEDED(hr) && spTargetCF != 0);
-	if (SUCCEEDED(hr))
-	{
-		hr = SetTargetClassFactory(spTargetCF);
-		ATLASSERT(SUCCEEDED(hr));
-	}
-	return hr;
-}
-
-inline void CComClassFactoryProtocol::FinalRelease()
-{
-	// No need to be thread safe here
-	if (m_spTargetCF)
-	{
-		// LockServer(FALSE) is assumed to always succeed.
-		HRESULT hr = m_spTargetCF->LockServer(FALSE);
-		hr;
-		ATLASSERT(SUCCEEDED(hr));
-
-		m_spTargetCF.Release();
-	}
-}
-
-// ===== CMetaFactory =====
-
-template <class Factory, class Protocol, class FactoryComObject>
-inline HRESULT CMetaFactory<Factory, Protocol, FactoryComObject>::
-	CreateInstance(Factory** ppObj)
-{
-	ATLASSERT(ppObj != 0);
-	if (!ppObj)
-	{
-		return E_POINTER;
-	}
-
-	HRESULT hr = E_OUTOFMEMORY;
-	void* pv = static_cast<void*>(CreatorClass::CreateInstance);
-	FactoryComObject* p = 0;
-	ATLTRY(p = new FactoryComObject(pv))
-	if (p != NULL)
-	{
-		p->SetVoid(pv);
-		p->InternalFinalConstructAddRef();
-		// MG: Updated to conform to more recent ATL version.
-		hr = p->_AtlInitialConstruct();
-		if (SUCCEEDED(hr))
-			hr = p->FinalConstruct();
-		if (SUCCEEDED(hr))
-			hr = p->_AtlFinalConstruct();
-		p->InternalFinalConstructRelease();
-		if (FAILED(hr))
-		{
-			delete p;
-			p = 0;
-		}
-	}
-	*ppObj = p;
-	return hr;
-}
-
-template <class Factory, class Protocol, class FactoryComObject>
-inline HRESULT CMetaFactory<Factory, Protocol, FactoryComObject>::
-	CreateInstance(IClassFactory* pTargetCF, IClassFactory** ppCF)
-{
-	if (!ppCF)
-	{
-		return E_POINTER;
-	}
-	*ppCF = 0;
-
-	Factory* pObj = 0;
-	HRESULT hr = CreateInstance(&pObj);
-	ATLASSERT(SUCCEEDED(hr) && pObj != 0);
-	if (SUCCEEDED(hr))
-	{
-		pObj->AddRef();
-
-		hr = pObj->SetTargetClassFactory(pTargetCF);
-		ATLASSERT(SUCCEEDED(hr));
-
-		if (SUCCEEDED(hr))
-		{
-			hr = pObj->QueryInterface(IID_IClassFactory,
-				reinterpret_cast<void**>(ppCF));
-			ATLASSERT(SUCCEEDED(hr) && *ppCF != 0);
-		}
-
-		pObj->Release();
-	}
-	return hr;
-}
-
-template <class Factory, class Protocol, class FactoryComObject>
-inline HRESULT CMetaFactory<Factory, Protocol, FactoryComObject>::
-	CreateInstance(REFCLSID clsidTarget, IClassFactory** ppCF)
-{
-	if (!ppCF)
-	{
-		return E_POINTER;
-	}
-	*ppCF = 0;
-
-	Factory* pObj = 0;
-	HRESULT hr = CreateInstance(&pObj);
-	ATLASSERT(SUCCEEDED(hr) && pObj != 0);
-	if (SUCCEEDED(hr))
-	{
-		pObj->AddRef();
-
-		hr = pObj->SetTargetCLSID(clsidTarget);
-		ATLASSERT(SUCCEEDED(hr));
-
-		if (SUCCEEDED(hr))
-		{
-			hr = pObj->QueryInterface(IID_IClassFactory,
-				reinterpret_cast<void**>(ppCF));
-			ATLASSERT(SUCCEEDED(hr) && *ppCF != 0);
-		}
-
-		pObj->Release();
-	}
-	return hr;
-}
-
-} // end namespace PassthroughAPP
-
-#endif // PASSTHROUGHAPP_PROTOCOLCF_INL
+#ifndef PASSTHROUGHAPP_PROTOCOLCF_INL
+#define PASSTHROUGHAPP_PROTOCOLCF_INL
+
+#if _MSC_VER > 1000
+#pragma once
+#endif // _MSC_VER > 1000
+
+#ifndef PASSTHROUGHAPP_PROTOCOLCF_H
+	#error ProtocolCF.inl requires ProtocolCF.h to be included first
+#endif
+
+#include "PassthroughObject.h"
+
+namespace PassthroughAPP
+{
+
+// ===== CComClassFactoryProtocol =====
+
+inline CComClassFactoryProtocol::CComClassFactoryProtocol() :
+	m_cTargetPoolSize(0), m_cPooled(0), m_cPoolHits(0), m_cPoolMisses(0),
+	m_lPoolGeneration(0), m_lRefillQueued(0), m_lReaderEpoch(0),
+	m_bDeferTarget(false)
+{
+	InitializeSListHead(&m_targetPool);
+	m_cReaders[0] = 0;
+	m_cReaders[1] = 0;
+}
+
+inline STDMETHODIMP CComClassFactoryProtocol::CreateInstance(
+	IUnknown* punkOuter, REFIID riid, void** ppvObj)
+{
+	ATLASSERT(ppvObj != 0);
+	if (!ppvObj)
+	{
+		return E_POINTER;
+	}
+	*ppvObj = 0;
+
+	CComPtr<IUnknown> spUnkTarget;
+	HRESULT hr = S_OK;
+	if (m_bDeferTarget)
+	{
+		spUnkTarget = static_cast<IPassthroughTargetFactory*>(this);
+	}
+	else
+	{
+		hr = CreateInstanceTarget(&spUnkTarget);
+		ATLASSERT(SUCCEEDED(hr) && spUnkTarget != 0);
+	}
+
+	CComPtr<IUnknown> spUnkObject;
+	if (SUCCEEDED(hr))
+	{
+		hr = BaseClass::CreateInstance(punkOuter, riid,
+			reinterpret_cast<void**>(&spUnkObject));
+		ATLASSERT(SUCCEEDED(hr) && spUnkObject != 0);
+	}
+
+	if (SUCCEEDED(hr))
+	{
+		CComPtr<IPassthroughObject> spPassthroughObj;
+		hr = spUnkObject->QueryInterface(&spPassthroughObj);
+		ATLASSERT(SUCCEEDED(hr) && spPassthroughObj != 0);
+		if (SUCCEEDED(hr))
+		{
+			hr = spPassthroughObj->SetTargetUnknown(spUnkTarget);
+			ATLASSERT(SUCCEEDED(hr));
+		}
+	}
+
+	if (SUCCEEDED(hr))
+	{
+		*ppvObj = spUnkObject.Detach();
+	}
+	return hr;
+}
+
+inline HRESULT CComClassFactoryProtocol::CreateInstanceTarget(
+	IUnknown** ppTargetProtocol)
+{
+	ATLASSERT(ppTargetProtocol != 0);
+	if (!ppTargetProtocol)
+	{
+		return E_POINTER;
+	}
+	*ppTargetProtocol = 0;
+
+	if (m_cTargetPoolSize > 0)
+	{
+		bool bHit = PopPooledTarget(ppTargetProtocol);
+		InterlockedIncrement(bHit ? &m_cPoolHits : &m_cPoolMisses);
+		ScheduleRefill();
+		if (bHit)
+		{
+			return S_OK;
+		}
+	}
+	return CreateNewTarget(ppTargetProtocol, 0);
+}
+
+inline HRESULT CComClassFactoryProtocol::CreateNewTarget(
+	IUnknown** ppTargetProtocol, LONG* plGeneration)
+{
+	ATLASSERT(ppTargetProtocol != 0);
+	*ppTargetProtocol = 0;
+
+	// Read the generation before the factory, see PooledTarget
+	if (plGeneration)
+	{
+		*plGeneration = *static_cast<volatile LONG*>(&m_lPoolGeneration);
+	}
+
+	CComPtr<IClassFactory> spTargetCF;
+	HRESULT hr = GetTargetClassFactory(&spTargetCF);
+	ATLASSERT(SUCCEEDED(hr) && spTargetCF != 0);
+	if (SUCCEEDED(hr))
+	{
+		hr = spTargetCF->CreateInstance(0, IID_IInternetProtocolRoot,
+			reinterpret_cast<void**>(ppTargetProtocol));
+		ATLASSERT(SUCCEEDED(hr) && *ppTargetProtocol != 0);
+	}
+	return hr;
+}
+
+inline bool CComClassFactoryProtocol::PopPooledTarget(
+	IUnknown** ppTargetProtocol)
+{
+	LONG lGeneration = *static_cast<volatile LONG*>(&m_lPoolGeneration);
+	PSLIST_ENTRY pEntry;
+	while ((pEntry = InterlockedPopEntrySList(&m_targetPool)) != 0)
+	{
+		InterlockedDecrement(&m_cPooled);
+		Detail::PooledTarget* pPooled =
+			reinterpret_cast<Detail::PooledTarget*>(pEntry);
+		IUnknown* punkTarget = pPooled->punkTarget;
+		bool bCurrent = (pPooled->lGeneration == lGeneration);
+		delete pPooled;
+
+		if (bCurrent)
+		{
+			*ppTargetProtocol = punkTarget;
+			return true;
+		}
+		// Created by a target class factory since replaced
+		punkTarget->Release();
+	}
+	return false;
+}
+
+inline void CComClassFactoryProtocol::ScheduleRefill()
+{
+	if (m_cPooled >= m_cTargetPoolSize)
+	{
+		return;
+	}
+	// One refill at a time
+	if (InterlockedCompareExchange(&m_lRefillQueued, 1, 0) != 0)
+	{
+		return;
+	}
+
+	// The work item keeps the factory alive, and the module loaded, which
+	// the factory itself, typically a CComObjectNoLock, doesn't
+	static_cast<IClassFactory*>(this)->AddRef();
+#if _ATL_VER < 0x700
+	_Module.Lock();
+#else
+	_pAtlModule->Lock();
+#endif
+	if (!QueueUserWorkItem(RefillProc, this, WT_EXECUTEDEFAULT))
+	{
+		InterlockedExchange(&m_lRefillQueued, 0);
+		static_cast<IClassFactory*>(this)->Release();
+#if _ATL_VER < 0x700
+		_Module.Unlock();
+#else
+		_pAtlModule->Unlock();
+#endif
+	}
+}
+
+inline void CComClassFactoryProtocol::Refill()
+{
+	bool bFailed = false;
+	for (;;)
+	{
+		while (!bFailed && m_cPooled < m_cTargetPoolSize)
+		{
+			Detail::PooledTarget* pPooled = 0;
+			ATLTRY(pPooled = new Detail::PooledTarget)
+			HRESULT hr = pPooled ? CreateNewTarget(&pPooled->punkTarget,
+				&pPooled->lGeneration) : E_OUTOFMEMORY;
+			if (FAILED(hr))
+			{
+				delete pPooled;
+				bFailed = true;
+				break;
+			}
+
+			InterlockedPushEntrySList(&m_targetPool, &pPooled->entry);
+			InterlockedIncrement(&m_cPooled);
+		}
+
+		InterlockedExchange(&m_lRefillQueued, 0);
+		// A target taken between the pool filling up and the flag being
+		// cleared scheduled no refill, as this one was still queued. Take
+		// over for it, unless another refill already did
+		if (bFailed || m_cPooled >= m_cTargetPoolSize ||
+			InterlockedCompareExchange(&m_lRefillQueued, 1, 0) != 0)
+		{
+			break;
+		}
+	}
+}
+
+inline DWORD WINAPI CComClassFactoryProtocol::RefillProc(LPVOID pv)
+{
+	ATLASSERT(pv != 0);
+	CComClassFactoryProtocol* pThis =
+		static_cast<CComClassFactoryProtocol*>(pv);
+
+	HRESULT hr = CoInitializeEx(0, COINIT_MULTITHREADED);
+	pThis->Refill();
+	if (SUCCEEDED(hr))
+	{
+		CoUninitialize();
+	}
+
+	static_cast<IClassFactory*>(pThis)->Release();
+#if _ATL_VER < 0x700
+	_Module.Unlock();
+#else
+	_pAtlModule->Unlock();
+#endif
+	return 0;
+}
+
+inline void CComClassFactoryProtocol::DrainTargetPool()
+{
+	PSLIST_ENTRY pEntry = InterlockedFlushSList(&m_targetPool);
+	while (pEntry)
+	{
+		Detail::PooledTarget* pPooled =
+			reinterpret_cast<Detail::PooledTarget*>(pEntry);
+		pEntry = pEntry->Next;
+
+		InterlockedDecrement(&m_cPooled);
+		pPooled->punkTarget->Release();
+		delete pPooled;
+	}
+}
+
+inline HRESULT CComClassFactoryProtocol::SetTargetPoolSize(LONG cTargets)
+{
+	if (cTargets < 0)
+	{
+		return E_INVALIDARG;
+	}
+
+	InterlockedExchange(&m_cTargetPoolSize, cTargets);
+	if (cTargets)
+	{
+		ScheduleRefill();
+	}
+	else
+	{
+		DrainTargetPool();
+	}
+	return S_OK;
+}
+
+inline void CComClassFactoryProtocol::GetTargetPoolStatistics(
+	TargetPoolStatistics* pStats)
+{
+	ATLASSERT(pStats != 0);
+	pStats->cHits = m_cPoolHits;
+	pStats->cMisses = m_cPoolMisses;
+	pStats->cPooled = m_cPooled;
+}
+
+inline HRESULT CComClassFactoryProtocol::GetTargetClassFactory(
+	IClassFactory** ppCF)
+{
+	ATLASSERT(ppCF != 0);
+	if (!ppCF)
+	{
+		return E_POINTER;
+	}
+
+	// The factory loaded here may be replaced right away. Being counted
+	// as a reader keeps SetTargetClassFactory from releasing it before it
+	// is AddRef'ed
+	LONG* pcReaders = &m_cReaders[
+		*static_cast<volatile LONG*>(&m_lReaderEpoch) & 1];
+	InterlockedIncrement(pcReaders);
+	IClassFactory* pCF = *static_cast<IClassFactory* volatile*>(
+		&m_spTargetCF.p);
+	if (pCF)
+	{
+		pCF->AddRef();
+	}
+	InterlockedDecrement(pcReaders);
+	*ppCF = pCF;
+	return S_OK;
+}
+
+inline void CComClassFactoryProtocol::WaitForTargetCFReaders()
+{
+	// A reader counted in a slot after the wait below saw it empty loads
+	// the factory after it was replaced. Moving the epoch on first keeps
+	// new readers out of the slot waited for, so the wait is bounded by
+	// the few instructions between a reader's load and its AddRef. Both
+	// slots are waited for, as a reader may have read the epoch long
+	// before counting itself in
+	for (int i = 0; i < 2; ++i)
+	{
+		LONG lEpoch = InterlockedIncrement(&m_lReaderEpoch);
+		volatile LONG* pcReaders = &m_cReaders[(lEpoch - 1) & 1];
+		while (*pcReaders)
+		{
+			SwitchToThread();
+		}
+	}
+}
+
+inline HRESULT CComClassFactoryProtocol::SetTargetClassFactory(
+	IClassFactory* pCF)
+{
+	HRESULT hr = (pCF ? pCF->LockServer(TRUE) : S_OK);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+	if (pCF)
+	{
+		pCF->AddRef();
+	}
+
+	{
+		// Only serializes writers, readers never take the lock
+		ObjectLock lock(this);
+		IClassFactory* pOldCF = static_cast<IClassFactory*>(
+			InterlockedExchangePointer(
+				reinterpret_cast<void**>(&m_spTargetCF.p), pCF));
+		if (pOldCF)
+		{
+			// LockServer(FALSE) is assumed to always succeed. Otherwise,
+			// it is impossible to implement correct semantics
+			HRESULT hr1 = pOldCF->LockServer(FALSE);
+			hr1;
+			ATLASSERT(SUCCEEDED(hr1));
+
+			WaitForTargetCFReaders();
+			pOldCF->Release();
+		}
+
+		// Pooled targets come from the old factory
+		InterlockedIncrement(&m_lPoolGeneration);
+	}
+
+	if (m_cTargetPoolSize > 0)
+	{
+		DrainTargetPool();
+		ScheduleRefill();
+	}
+	return S_OK;
+}
+
+inline HRESULT CComClassFactoryProtocol::SetTargetCLSID(REFCLSID clsid,
+	DWORD clsContext)
+{
+	CComPtr<IClassFactory> spTargetCF;
+	HRESULT hr = CoGetClassObject(clsid, clsContext, 0, IID_IClassFactory,
+		reinterpret_cast<void**>(&spTargetCF));
+	ATLASSERT(SUCCEEDED(hr) && spTargetCF != 0);
+	if (SUCCEEDED(hr))
+	{
+		hr = SetTargetClassFactory(spTargetCF);
+		ATLASSERT(SUCCEEDED(hr));
+	}
+	return hr;
+}
+
+inline void CComClassFactoryProtocol::SetDeferTargetCreation(bool bDefer)
+{
+	m_bDeferTarget = bDefer;
+}
+
+inline STDMETHODIMP CComClassFactoryProtocol::CreateTarget(
+	IUnknown** ppunkTarget)
+{
+	return CreateInstanceTarget(ppunkTarget);
+}
+
+inline void CComClassFactoryProtocol::FinalRelease()
+{
+	// No need to be thread safe here. A pending refill holds a reference,
+	// so none is running
+	DrainTargetPool();
+
+	if (m_spTargetCF)
+	{
+		// LockServer(FALSE) is assumed to always succeed.
+		HRESULT hr = m_spTargetCF->LockServer(FALSE);
+		hr;
+		ATLASSERT(SUCCEEDED(hr));
+
+		m_spTargetCF.Release();
+	}
+}
+
+// ===== CMetaFactory =====
+
+template <class Factory, class Protocol, class FactoryComObject>
+inline HRESULT CMetaFactory<Factory, Protocol, FactoryComObject>::
+	CreateInstance(Factory** ppObj)
+{
+	ATLASSERT(ppObj != 0);
+	if (!ppObj)
+	{
+		return E_POINTER;
+	}
+
+	HRESULT hr = E_OUTOFMEMORY;
+	void* pv = reinterpret_cast<void*>(&CreatorClass::CreateInstance);
+	FactoryComObject* p = 0;
+	ATLTRY(p = new FactoryComObject(pv))
+	if (p != NULL)
+	{
+		p->SetVoid(pv);
+		p->InternalFinalConstructAddRef();
+		// MG: Updated to conform to more recent ATL version.
+		hr = p->_AtlInitialConstruct();
+		if (SUCCEEDED(hr))
+			hr = p->FinalConstruct();
+		if (SUCCEEDED(hr))
+			hr = p->_AtlFinalConstruct();
+		p->InternalFinalConstructRelease();
+		if (FAILED(hr))
+		{
+			delete p;
+			p = 0;
+		}
+	}
+	*ppObj = p;
+	return hr;
+}
+
+template <class Factory, class Protocol, class FactoryComObject>
+inline HRESULT CMetaFactory<Factory, Protocol, FactoryComObject>::
+	CreateInstance(IClassFactory* pTargetCF, IClassFactory** ppCF)
+{
+	if (!ppCF)
+	{
+		return E_POINTER;
+	}
+	*ppCF = 0;
+
+	Factory* pObj = 0;
+	HRESULT hr = CreateInstance(&pObj);
+	ATLASSERT(SUCCEEDED(hr) && pObj != 0);
+	if (SUCCEEDED(hr))
+	{
+		pObj->AddRef();
+
+		hr = pObj->SetTargetClassFactory(pTargetCF);
+		ATLASSERT(SUCCEEDED(hr));
+
+		if (SUCCEEDED(hr))
+		{
+			hr = pObj->QueryInterface(IID_IClassFactory,
+				reinterpret_cast<void**>(ppCF));
+			ATLASSERT(SUCCEEDED(hr) && *ppCF != 0);
+		}
+
+		pObj->Release();
+	}
+	return hr;
+}
+
+template <class Factory, class Protocol, class FactoryComObject>
+inline HRESULT CMetaFactory<Factory, Protocol, FactoryComObject>::
+	CreateInstance(REFCLSID clsidTarget, IClassFactory** ppCF)
+{
+	if (!ppCF)
+	{
+		return E_POINTER;
+	}
+	*ppCF = 0;
+
+	Factory* pObj = 0;
+	HRESULT hr = CreateInstance(&pObj);
+	ATLASSERT(SUCCEEDED(hr) && pObj != 0);
+	if (SUCCEEDED(hr))
+	{
+		pObj->AddRef();
+
+		hr = pObj->SetTargetCLSID(clsidTarget);
+		ATLASSERT(SUCCEEDED(hr));
+
+		if (SUCCEEDED(hr))
+		{
+			hr = pObj->QueryInterface(IID_IClassFactory,
+				reinterpret_cast<void**>(ppCF));
+			ATLASSERT(SUCCEEDED(hr) && *ppCF != 0);
+		}
+
+		pObj->Release();
+	}
+	return hr;
+}
+
+} // end namespace PassthroughAPP
+
+#endif // PASSTHROUGHAPP_PROTOCOLCF_INL
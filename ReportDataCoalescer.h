@@ -0,0 +1,88 @@
+#ifndef PASSTHROUGHAPP_REPORTDATACOALESCER_H
+#define PASSTHROUGHAPP_REPORTDATACOALESCER_H
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+// Fewer ReportData calls to the client. A target reading from the network
+// reports every packet that arrives, and the client answers each
+// notification by reading whatever is there. With coalescing on, a sink
+// holds back notifications that only report more data until enough bytes
+// or time have added up since the last one it forwarded, so that the
+// client reads fewer, larger chunks.
+//
+// Notifications flagged BSCF_FIRSTDATANOTIFICATION,
+// BSCF_LASTDATANOTIFICATION, BSCF_DATAFULLYAVAILABLE or
+// BSCF_AVAILABLEDATASIZEUNKNOWN are always forwarded at once, and stand for
+// any notification held back before them. One still held back when the
+// target reports its result is forwarded before the result. One held back
+// for the whole delay without the target reporting again is forwarded
+// from the request's thread: the sink arms a timer, asks the client to
+// Switch when it fires, and forwards the notification from Continue.
+//
+// See CReportDataCoalescingSink in SinkPolicy.h
+
+namespace PassthroughAPP
+{
+
+struct ReportDataStatistics
+{
+	// Notifications reported by the target, and forwarded to the client
+	LONG cReported;
+	LONG cForwarded;
+};
+
+namespace Detail
+{
+
+// Like the target protocol, it expects notifications from one thread at a
+// time
+class ReportDataCoalescer
+{
+public:
+	ReportDataCoalescer();
+
+	// Both 0 turns coalescing off, which is the default. Either 0 leaves
+	// that threshold out
+	void SetThresholds(ULONG cbMinProgress, DWORD dwMaxDelay);
+	// Forgets the previous request. The thresholds are kept
+	void Reset();
+
+	// Returns true if the notification is to be forwarded now, false if
+	// it is held back
+	bool Report(DWORD grfBSCF, ULONG ulProgress, ULONG ulProgressMax);
+	// Returns true and the notification held back, if any, to forward
+	// before the result, or once it is due
+	bool Flush(DWORD* pgrfBSCF, ULONG* pulProgress, ULONG* pulProgressMax);
+	// Milliseconds until the notification held back is due, 0 if it is
+	// due now, or INFINITE if none is held back or there is no delay
+	DWORD GetFlushDelay() const;
+
+	void GetStatistics(ReportDataStatistics* pStats) const;
+
+private:
+	void OnForward(ULONG ulProgress);
+
+	ULONG m_cbMinProgress;
+	DWORD m_dwMaxDelay;
+
+	// As of the last notification forwarded
+	ULONG m_ulProgress;
+	DWORD m_dwTime;
+
+	bool m_bHeld;
+	DWORD m_grfHeld;
+	ULONG m_ulHeldProgress;
+	ULONG m_ulHeldProgressMax;
+
+	ReportDataStatistics m_stats;
+};
+
+} // end namespace PassthroughAPP::Detail
+
+} // end namespace PassthroughAPP
+
+#include "ReportDataCoalescer.inl"
+
+#endif // PASSTHROUGHAPP_REPORTDATACOALESCER_H
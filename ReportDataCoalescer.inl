@@ -0,0 +1,133 @@
+#ifndef PASSTHROUGHAPP_REPORTDATACOALESCER_INL
+#define PASSTHROUGHAPP_REPORTDATACOALESCER_INL
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+#ifndef PASSTHROUGHAPP_REPORTDATACOALESCER_H
+	#error ReportDataCoalescer.inl requires ReportDataCoalescer.h to be included first
+#endif
+
+namespace PassthroughAPP
+{
+
+namespace Detail
+{
+
+// ===== ReportDataCoalescer =====
+
+inline ReportDataCoalescer::ReportDataCoalescer() :
+	m_cbMinProgress(0), m_dwMaxDelay(0)
+{
+	Reset();
+}
+
+inline void ReportDataCoalescer::SetThresholds(ULONG cbMinProgress,
+	DWORD dwMaxDelay)
+{
+	m_cbMinProgress = cbMinProgress;
+	m_dwMaxDelay = dwMaxDelay;
+}
+
+inline void ReportDataCoalescer::Reset()
+{
+	m_ulProgress = 0;
+	m_dwTime = 0;
+	m_bHeld = false;
+	m_grfHeld = 0;
+	m_ulHeldProgress = 0;
+	m_ulHeldProgressMax = 0;
+	m_stats.cReported = 0;
+	m_stats.cForwarded = 0;
+}
+
+inline bool ReportDataCoalescer::Report(DWORD grfBSCF, ULONG ulProgress,
+	ULONG ulProgressMax)
+{
+	++m_stats.cReported;
+
+	const DWORD grfAtOnce = BSCF_FIRSTDATANOTIFICATION |
+		BSCF_LASTDATANOTIFICATION | BSCF_DATAFULLYAVAILABLE |
+		BSCF_AVAILABLEDATASIZEUNKNOWN;
+	bool bForward = (!m_cbMinProgress && !m_dwMaxDelay) ||
+		(grfBSCF & grfAtOnce) != 0;
+	// Progress going back, which targets don't normally report, is
+	// forwarded too
+	if (!bForward && m_cbMinProgress)
+	{
+		bForward = ulProgress < m_ulProgress ||
+			ulProgress - m_ulProgress >= m_cbMinProgress;
+	}
+	if (!bForward && m_dwMaxDelay)
+	{
+		bForward = GetTickCount() - m_dwTime >= m_dwMaxDelay;
+	}
+
+	if (bForward)
+	{
+		// Whatever was held back is reported by this one
+		m_bHeld = false;
+		OnForward(ulProgress);
+	}
+	else
+	{
+		m_bHeld = true;
+		m_grfHeld = grfBSCF;
+		m_ulHeldProgress = ulProgress;
+		m_ulHeldProgressMax = ulProgressMax;
+	}
+	return bForward;
+}
+
+inline bool ReportDataCoalescer::Flush(DWORD* pgrfBSCF, ULONG* pulProgress,
+	ULONG* pulProgressMax)
+{
+	ATLASSERT(pgrfBSCF != 0);
+	ATLASSERT(pulProgress != 0);
+	ATLASSERT(pulProgressMax != 0);
+
+	if (!m_bHeld)
+	{
+		return false;
+	}
+	m_bHeld = false;
+	*pgrfBSCF = m_grfHeld;
+	*pulProgress = m_ulHeldProgress;
+	*pulProgressMax = m_ulHeldProgressMax;
+	OnForward(m_ulHeldProgress);
+	return true;
+}
+
+inline DWORD ReportDataCoalescer::GetFlushDelay() const
+{
+	if (!m_bHeld || !m_dwMaxDelay)
+	{
+		return INFINITE;
+	}
+	DWORD dwElapsed = GetTickCount() - m_dwTime;
+	return dwElapsed < m_dwMaxDelay ? m_dwMaxDelay - dwElapsed : 0;
+}
+
+inline void ReportDataCoalescer::GetStatistics(
+	ReportDataStatistics* pStats) const
+{
+	ATLASSERT(pStats != 0);
+	*pStats = m_stats;
+}
+
+inline void ReportDataCoalescer::OnForward(ULONG ulProgress)
+{
+	++m_stats.cForwarded;
+	m_ulProgress = ulProgress;
+	if (m_dwMaxDelay)
+	{
+		m_dwTime = GetTickCount();
+	}
+}
+
+} // end namespace PassthroughAPP::Detail
+
+} // end namespace PassthroughAPP
+
+#endif // PASSTHROUGHAPP_REPORTDATACOALESCER_INL
@@ -0,0 +1,227 @@
+#ifndef PASSTHROUGHAPP_REQUESTCOALESCER_H
+#define PASSTHROUGHAPP_REQUESTCOALESCER_H
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+#ifndef PASSTHROUGHAPP_RESPONSECACHE_H
+	#error RequestCoalescer.h requires ResponseCache.h to be included first
+#endif
+
+// Shares one download between requests for the same URL that are in
+// flight at the same time, such as an image used several times on a page.
+//
+// With CoalescingStartPolicy (see SinkPolicy.h), the first GET request for
+// a URL becomes the leader and starts its target as usual. Requests for
+// the same URL started on the same thread before the leader's response is
+// complete become followers: their targets are never started. As the
+// leader's client reads the body, it is appended to a buffer shared by
+// all followers, and every follower is sent the same MIME type, data
+// notifications and result, and reads the body from the buffer.
+//
+// Followers are driven by the leader's reads, on the leader's thread,
+// which is why only requests started on the same thread are coalesced.
+// If the leader is aborted or terminated before its response is complete,
+// or the response isn't a 200 that may be shared (see IsSharableResponse
+// in ResponseCache.h), followers that haven't been sent anything yet
+// start their own target instead, and the others fail with
+// INET_E_DOWNLOAD_FAILURE. The buffer is bounded: once it would grow
+// beyond the limit, no more followers can join, the part every follower
+// has read is dropped, and followers lagging too far behind fail.
+
+namespace PassthroughAPP
+{
+
+struct RequestCoalescerStatistics
+{
+	// Requests that started their target, and requests that followed one
+	// of them instead
+	LONG cLeaders;
+	LONG cFollowers;
+	// Followers that started their own target after all, and followers
+	// that failed part way
+	LONG cRestarts;
+	LONG cFailures;
+};
+
+class CRequestCoalescer;
+
+namespace Detail
+{
+
+class CoalescedResponse;
+
+// The follower's side of a coalesced request, owned by the start policy
+class CoalescingFollower
+{
+public:
+	// Called once the response is given up on before the follower was
+	// sent anything, to start the follower's own target. The follower
+	// is already detached
+	typedef void (*RestartFunc)(void* pvContext);
+
+	CoalescingFollower();
+	~CoalescingFollower();
+
+	bool IsAttached() const;
+	// Sends pOIProtSink whatever the response already has to offer
+	void Attach(CoalescedResponse* pResponse,
+		IInternetProtocolSink* pOIProtSink, RestartFunc pfnRestart,
+		void* pvContext);
+	void Detach();
+	// Whether the result was reported to the sink
+	bool IsFinished() const;
+
+	HRESULT Read(void* pv, ULONG cb, ULONG* pcbRead);
+
+private:
+	friend class CoalescedResponse;
+
+	// Not copyable
+	CoalescingFollower(const CoalescingFollower&);
+	CoalescingFollower& operator=(const CoalescingFollower&);
+
+	bool HasReported() const;
+
+	CoalescedResponse* m_pResponse;
+	CoalescingFollower* m_pPrev;
+	CoalescingFollower* m_pNext;
+	CComPtr<IInternetProtocolSink> m_spSink;
+	RestartFunc m_pfnRestart;
+	void* m_pvContext;
+	// Offset of the next byte to read, from the start of the body
+	ULONG m_cbRead;
+	// What the sink was sent so far
+	ULONG m_cbReported;
+	bool m_bMimeReported;
+	bool m_bLastReported;
+	bool m_bResultReported;
+	// Set if this follower fell too far behind
+	HRESULT m_hrFailure;
+};
+
+// The response of a leader, as far as its client has read it. Reference
+// counted by the leader and the followers. Used on the leader's thread
+// only
+class CoalescedResponse
+{
+public:
+	void AddRef();
+	void Release();
+
+	// Called with the result of every Read of the leader's target
+	void OnLeaderRead(const void* pv, ULONG cbRead, HRESULT hrRead,
+		IInternetProtocol* pTargetProtocol);
+	// The leader goes away. Unless the response is complete, followers
+	// restart or fail
+	void Abandon();
+
+private:
+	friend class ::PassthroughAPP::CRequestCoalescer;
+	friend class CoalescingFollower;
+
+	enum State
+	{
+		// Before the leader's first Read
+		stateStarting,
+		stateSharing,
+		stateComplete,
+		stateFailed
+	};
+
+	CoalescedResponse(CRequestCoalescer* pCoalescer, DWORD dwHash,
+		DWORD dwThreadId, ULONG cbMax);
+	~CoalescedResponse();
+
+	// Sends the followers everything they haven't been sent yet
+	void Notify();
+
+	bool Begin(IInternetProtocol* pTargetProtocol);
+	void Append(const void* pv, ULONG cb);
+	void Finish(HRESULT hrResult);
+	// Takes the response out of the registry, so that no more followers
+	// join
+	void Close();
+	// Drops the part of the buffer every follower has read
+	void Trim();
+	void FailLaggingFollower();
+
+	void AddFollower(CoalescingFollower* pFollower);
+	void RemoveFollower(CoalescingFollower* pFollower);
+	// The first follower the response owes a notification, or 0
+	CoalescingFollower* FindPendingFollower() const;
+	// Sends pFollower its next notification
+	void NotifyFollower(CoalescingFollower* pFollower);
+	HRESULT ReadFor(CoalescingFollower* pFollower, void* pv, ULONG cb,
+		ULONG* pcbRead);
+
+	LONG m_lRef;
+	CRequestCoalescer* m_pCoalescer;
+	// Registry links, guarded by the coalescer
+	CoalescedResponse* m_pPrevRegistered;
+	CoalescedResponse* m_pNextRegistered;
+	bool m_bRegistered;
+	WCHAR* m_szUrl;
+	ULONG m_cchUrl;
+	DWORD m_dwHash;
+	DWORD m_dwThreadId;
+
+	State m_state;
+	HRESULT m_hrResult;
+	WCHAR* m_szMimeType;
+	// Holds the body from offset m_cbDiscarded up to m_cbTotal
+	BYTE* m_pbBuffer;
+	ULONG m_cbAllocated;
+	ULONG m_cbDiscarded;
+	ULONG m_cbTotal;
+	ULONG m_cbMax;
+	// Cleared once no follower needs the buffer any more
+	bool m_bBuffering;
+	CoalescingFollower* m_pFirstFollower;
+	CoalescingFollower* m_pLastFollower;
+};
+
+} // end namespace PassthroughAPP::Detail
+
+// Keeps track of the responses in flight that requests may follow. Must
+// outlive the requests using it. All methods can be called from any thread
+class CRequestCoalescer
+{
+public:
+	CRequestCoalescer();
+	~CRequestCoalescer();
+
+	// The most a response buffers for its followers, 1 MB by default.
+	// Applies to responses started afterwards
+	void SetMaxBufferSize(ULONG cbMax);
+	ULONG GetMaxBufferSize() const;
+
+	// Returns S_OK and an AddRef'ed response for the current thread to
+	// follow, or S_FALSE and a new AddRef'ed response for the caller to
+	// lead, which other requests for szUrl may join from now on
+	HRESULT Join(LPCWSTR szUrl, Detail::CoalescedResponse** ppResponse);
+
+	void GetStatistics(RequestCoalescerStatistics* pStats) const;
+
+private:
+	friend class Detail::CoalescedResponse;
+
+	// Not copyable
+	CRequestCoalescer(const CRequestCoalescer&);
+	CRequestCoalescer& operator=(const CRequestCoalescer&);
+
+	void Unregister(Detail::CoalescedResponse* pResponse);
+
+	mutable CComAutoCriticalSection m_cs;
+	// Few requests are in flight at once, so a list will do
+	Detail::CoalescedResponse* m_pFirstRegistered;
+	ULONG m_cbMaxBuffer;
+	RequestCoalescerStatistics m_stats;
+};
+
+} // end namespace PassthroughAPP
+
+#include "RequestCoalescer.inl"
+
+#endif // PASSTHROUGHAPP_REQUESTCOALESCER_H
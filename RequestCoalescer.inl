@@ -0,0 +1,699 @@
+#ifndef PASSTHROUGHAPP_REQUESTCOALESCER_INL
+#define PASSTHROUGHAPP_REQUESTCOALESCER_INL
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+#ifndef PASSTHROUGHAPP_REQUESTCOALESCER_H
+	#error RequestCoalescer.inl requires RequestCoalescer.h to be included first
+#endif
+
+namespace PassthroughAPP
+{
+
+namespace Detail
+{
+
+// ===== CoalescingFollower =====
+
+inline CoalescingFollower::CoalescingFollower() :
+	m_pResponse(0), m_pPrev(0), m_pNext(0), m_pfnRestart(0),
+	m_pvContext(0), m_cbRead(0), m_cbReported(0), m_bMimeReported(false),
+	m_bLastReported(false), m_bResultReported(false), m_hrFailure(S_OK)
+{
+}
+
+inline CoalescingFollower::~CoalescingFollower()
+{
+	Detach();
+}
+
+inline bool CoalescingFollower::IsAttached() const
+{
+	return m_pResponse != 0;
+}
+
+inline void CoalescingFollower::Attach(CoalescedResponse* pResponse,
+	IInternetProtocolSink* pOIProtSink, RestartFunc pfnRestart,
+	void* pvContext)
+{
+	ATLASSERT(pResponse != 0);
+	ATLASSERT(pOIProtSink != 0);
+	ATLASSERT(pfnRestart != 0);
+	ATLASSERT(!m_pResponse);
+
+	m_spSink = pOIProtSink;
+	m_pfnRestart = pfnRestart;
+	m_pvContext = pvContext;
+	m_cbRead = 0;
+	m_cbReported = 0;
+	m_bMimeReported = false;
+	m_bLastReported = false;
+	m_bResultReported = false;
+	m_hrFailure = S_OK;
+
+	m_pResponse = pResponse;
+	pResponse->AddRef();
+	pResponse->AddFollower(this);
+	pResponse->Notify();
+}
+
+inline void CoalescingFollower::Detach()
+{
+	CoalescedResponse* pResponse = m_pResponse;
+	if (!pResponse)
+	{
+		return;
+	}
+	pResponse->RemoveFollower(this);
+	m_pResponse = 0;
+	m_spSink.Release();
+	pResponse->Release();
+}
+
+inline bool CoalescingFollower::IsFinished() const
+{
+	return m_bResultReported;
+}
+
+inline HRESULT CoalescingFollower::Read(void* pv, ULONG cb, ULONG* pcbRead)
+{
+	if (pcbRead)
+	{
+		*pcbRead = 0;
+	}
+	ATLASSERT(m_pResponse != 0);
+	return m_pResponse ?
+		m_pResponse->ReadFor(this, pv, cb, pcbRead) :
+		E_UNEXPECTED;
+}
+
+inline bool CoalescingFollower::HasReported() const
+{
+	return m_bMimeReported || m_cbReported || m_bLastReported ||
+		m_bResultReported;
+}
+
+// ===== CoalescedResponse =====
+
+inline CoalescedResponse::CoalescedResponse(CRequestCoalescer* pCoalescer,
+	DWORD dwHash, DWORD dwThreadId, ULONG cbMax) :
+	m_lRef(1), m_pCoalescer(pCoalescer), m_pPrevRegistered(0),
+	m_pNextRegistered(0), m_bRegistered(false), m_szUrl(0), m_cchUrl(0),
+	m_dwHash(dwHash), m_dwThreadId(dwThreadId), m_state(stateStarting),
+	m_hrResult(S_OK), m_szMimeType(0), m_pbBuffer(0), m_cbAllocated(0),
+	m_cbDiscarded(0), m_cbTotal(0), m_cbMax(cbMax), m_bBuffering(true),
+	m_pFirstFollower(0), m_pLastFollower(0)
+{
+	ATLASSERT(pCoalescer != 0);
+}
+
+inline CoalescedResponse::~CoalescedResponse()
+{
+	ATLASSERT(!m_bRegistered);
+	ATLASSERT(!m_pFirstFollower);
+	delete[] m_szUrl;
+	delete[] m_szMimeType;
+	delete[] m_pbBuffer;
+}
+
+inline void CoalescedResponse::AddRef()
+{
+	InterlockedIncrement(&m_lRef);
+}
+
+inline void CoalescedResponse::Release()
+{
+	if (!InterlockedDecrement(&m_lRef))
+	{
+		delete this;
+	}
+}
+
+inline void CoalescedResponse::OnLeaderRead(const void* pv, ULONG cbRead,
+	HRESULT hrRead, IInternetProtocol* pTargetProtocol)
+{
+	if (m_state != stateStarting && m_state != stateSharing)
+	{
+		return;
+	}
+	if (hrRead != S_OK && hrRead != S_FALSE && hrRead != E_PENDING)
+	{
+		Finish(hrRead);
+		return;
+	}
+	if (m_state == stateStarting && !Begin(pTargetProtocol))
+	{
+		// Nothing was sent yet, so the followers can make their own
+		// request, which may well get a different response
+		Finish(INET_E_DOWNLOAD_FAILURE);
+		return;
+	}
+
+	Append(pv, cbRead);
+	if (m_state != stateSharing)
+	{
+		return;
+	}
+	if (hrRead == S_FALSE)
+	{
+		Finish(S_OK);
+	}
+	else
+	{
+		Notify();
+	}
+}
+
+inline void CoalescedResponse::Abandon()
+{
+	if (m_state == stateStarting || m_state == stateSharing)
+	{
+		Finish(INET_E_DOWNLOAD_FAILURE);
+	}
+	else
+	{
+		Close();
+	}
+}
+
+inline void CoalescedResponse::Notify()
+{
+	// Every notification may reenter, and followers may detach or go
+	// away in the middle, so look for the next one from scratch each time
+	AddRef();
+	for (;;)
+	{
+		CoalescingFollower* pFollower = FindPendingFollower();
+		if (!pFollower)
+		{
+			break;
+		}
+		NotifyFollower(pFollower);
+	}
+	Release();
+}
+
+inline bool CoalescedResponse::Begin(IInternetProtocol* pTargetProtocol)
+{
+	ATLASSERT(m_state == stateStarting);
+	ATLASSERT(pTargetProtocol != 0);
+
+	CComPtr<IWinInetHttpInfo> spHttpInfo;
+	if (FAILED(pTargetProtocol->QueryInterface(&spHttpInfo)))
+	{
+		return false;
+	}
+	DWORD dwStatusCode = 0;
+	DWORD cbStatusCode = sizeof(dwStatusCode);
+	HRESULT hr = spHttpInfo->QueryInfo(
+		HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER, &dwStatusCode,
+		&cbStatusCode, 0, 0);
+	if (hr != S_OK || dwStatusCode != 200)
+	{
+		return false;
+	}
+	// A response for the leader alone, or one that would have been
+	// different for another request, is left to the followers' own targets
+	WCHAR* szHeaders = 0;
+	hr = QueryHttpInfoString(spHttpInfo, HTTP_QUERY_RAW_HEADERS_CRLF,
+		&szHeaders);
+	if (hr != S_OK)
+	{
+		return false;
+	}
+	CHttpHeaderView headers;
+	bool bSharable = headers.Parse(szHeaders) == S_OK &&
+		IsSharableResponse(headers);
+	delete[] szHeaders;
+	if (!bSharable)
+	{
+		return false;
+	}
+	if (FAILED(QueryMimeType(spHttpInfo, &m_szMimeType)))
+	{
+		return false;
+	}
+
+	m_state = stateSharing;
+	return true;
+}
+
+inline void CoalescedResponse::Append(const void* pv, ULONG cb)
+{
+	if (!cb || !m_bBuffering)
+	{
+		return;
+	}
+	ATLASSERT(pv != 0);
+
+	ULONGLONG cbNeeded = static_cast<ULONGLONG>(m_cbTotal) -
+		m_cbDiscarded + cb;
+	if (cbNeeded > m_cbMax)
+	{
+		// Followers joining now would need the part about to be dropped
+		Close();
+		Trim();
+		for (;;)
+		{
+			cbNeeded = static_cast<ULONGLONG>(m_cbTotal) - m_cbDiscarded + cb;
+			if (cbNeeded <= m_cbMax)
+			{
+				break;
+			}
+			if (m_cbDiscarded == m_cbTotal)
+			{
+				// Even a single Read is too much
+				break;
+			}
+			FailLaggingFollower();
+			Trim();
+		}
+		if (m_cbDiscarded == m_cbTotal)
+		{
+			bool bNeeded = false;
+			for (CoalescingFollower* pFollower = m_pFirstFollower; pFollower;
+				pFollower = pFollower->m_pNext)
+			{
+				bNeeded = bNeeded || SUCCEEDED(pFollower->m_hrFailure);
+			}
+			if (!bNeeded)
+			{
+				m_bBuffering = false;
+				delete[] m_pbBuffer;
+				m_pbBuffer = 0;
+				m_cbAllocated = 0;
+				return;
+			}
+		}
+	}
+
+	if (cbNeeded > m_cbAllocated)
+	{
+		ULONGLONG cbAllocate = static_cast<ULONGLONG>(m_cbAllocated) * 2;
+		if (cbAllocate < 16384)
+		{
+			cbAllocate = 16384;
+		}
+		if (cbAllocate > m_cbMax)
+		{
+			cbAllocate = m_cbMax;
+		}
+		if (cbAllocate < cbNeeded)
+		{
+			cbAllocate = cbNeeded;
+		}
+		BYTE* pbBuffer = 0;
+		if (cbAllocate <= ULONG(-1))
+		{
+			ATLTRY(pbBuffer = new BYTE[static_cast<size_t>(cbAllocate)])
+		}
+		if (!pbBuffer)
+		{
+			Finish(E_OUTOFMEMORY);
+			return;
+		}
+		if (m_cbTotal > m_cbDiscarded)
+		{
+			memcpy(pbBuffer, m_pbBuffer, m_cbTotal - m_cbDiscarded);
+		}
+		delete[] m_pbBuffer;
+		m_pbBuffer = pbBuffer;
+		m_cbAllocated = static_cast<ULONG>(cbAllocate);
+	}
+
+	memcpy(m_pbBuffer + (m_cbTotal - m_cbDiscarded), pv, cb);
+	m_cbTotal += cb;
+}
+
+inline void CoalescedResponse::Finish(HRESULT hrResult)
+{
+	Close();
+	if (m_state == stateComplete || m_state == stateFailed)
+	{
+		return;
+	}
+	m_state = SUCCEEDED(hrResult) ? stateComplete : stateFailed;
+	m_hrResult = hrResult;
+	Notify();
+}
+
+inline void CoalescedResponse::Close()
+{
+	if (m_bRegistered)
+	{
+		m_pCoalescer->Unregister(this);
+	}
+}
+
+inline void CoalescedResponse::Trim()
+{
+	ATLASSERT(!m_bRegistered);
+	ULONG cbRead = m_cbTotal;
+	for (CoalescingFollower* pFollower = m_pFirstFollower; pFollower;
+		pFollower = pFollower->m_pNext)
+	{
+		if (SUCCEEDED(pFollower->m_hrFailure) && pFollower->m_cbRead < cbRead)
+		{
+			cbRead = pFollower->m_cbRead;
+		}
+	}
+	if (cbRead <= m_cbDiscarded)
+	{
+		return;
+	}
+	memmove(m_pbBuffer, m_pbBuffer + (cbRead - m_cbDiscarded),
+		m_cbTotal - cbRead);
+	m_cbDiscarded = cbRead;
+}
+
+inline void CoalescedResponse::FailLaggingFollower()
+{
+	CoalescingFollower* pLagging = 0;
+	for (CoalescingFollower* pFollower = m_pFirstFollower; pFollower;
+		pFollower = pFollower->m_pNext)
+	{
+		if (SUCCEEDED(pFollower->m_hrFailure) &&
+			(!pLagging || pFollower->m_cbRead < pLagging->m_cbRead))
+		{
+			pLagging = pFollower;
+		}
+	}
+	ATLASSERT(pLagging != 0);
+	if (pLagging)
+	{
+		// Reported by the next Notify
+		pLagging->m_hrFailure = INET_E_DOWNLOAD_FAILURE;
+	}
+}
+
+inline void CoalescedResponse::AddFollower(CoalescingFollower* pFollower)
+{
+	ATLASSERT(pFollower != 0);
+	pFollower->m_pPrev = m_pLastFollower;
+	pFollower->m_pNext = 0;
+	if (m_pLastFollower)
+	{
+		m_pLastFollower->m_pNext = pFollower;
+	}
+	else
+	{
+		m_pFirstFollower = pFollower;
+	}
+	m_pLastFollower = pFollower;
+}
+
+inline void CoalescedResponse::RemoveFollower(CoalescingFollower* pFollower)
+{
+	ATLASSERT(pFollower != 0);
+	if (pFollower->m_pPrev)
+	{
+		pFollower->m_pPrev->m_pNext = pFollower->m_pNext;
+	}
+	else
+	{
+		m_pFirstFollower = pFollower->m_pNext;
+	}
+	if (pFollower->m_pNext)
+	{
+		pFollower->m_pNext->m_pPrev = pFollower->m_pPrev;
+	}
+	else
+	{
+		m_pLastFollower = pFollower->m_pPrev;
+	}
+	pFollower->m_pPrev = 0;
+	pFollower->m_pNext = 0;
+}
+
+inline CoalescingFollower* CoalescedResponse::FindPendingFollower() const
+{
+	for (CoalescingFollower* pFollower = m_pFirstFollower; pFollower;
+		pFollower = pFollower->m_pNext)
+	{
+		if (pFollower->m_bResultReported)
+		{
+			continue;
+		}
+		if (FAILED(pFollower->m_hrFailure) || m_state == stateFailed ||
+			m_state == stateComplete)
+		{
+			return pFollower;
+		}
+		if (m_state == stateSharing &&
+			((m_szMimeType && !pFollower->m_bMimeReported) ||
+				pFollower->m_cbReported < m_cbTotal))
+		{
+			return pFollower;
+		}
+	}
+	return 0;
+}
+
+inline void CoalescedResponse::NotifyFollower(CoalescingFollower* pFollower)
+{
+	ATLASSERT(pFollower != 0);
+	ATLASSERT(!pFollower->m_bResultReported);
+
+	// The follower is updated before the call, which may detach it
+	CComPtr<IInternetProtocolSink> spSink = pFollower->m_spSink;
+	HRESULT hrFailure = FAILED(pFollower->m_hrFailure) ?
+		pFollower->m_hrFailure :
+		m_state == stateFailed ? m_hrResult : S_OK;
+	if (FAILED(hrFailure))
+	{
+		bool bReported = pFollower->HasReported();
+		pFollower->m_bResultReported = true;
+		if (!bReported)
+		{
+			CoalescingFollower::RestartFunc pfnRestart =
+				pFollower->m_pfnRestart;
+			void* pvContext = pFollower->m_pvContext;
+			pFollower->Detach();
+			InterlockedIncrement(&m_pCoalescer->m_stats.cRestarts);
+			pfnRestart(pvContext);
+		}
+		else
+		{
+			pFollower->m_hrFailure = hrFailure;
+			InterlockedIncrement(&m_pCoalescer->m_stats.cFailures);
+			spSink->ReportResult(hrFailure, 0, 0);
+		}
+		return;
+	}
+
+	if (m_szMimeType && !pFollower->m_bMimeReported)
+	{
+		pFollower->m_bMimeReported = true;
+		spSink->ReportProgress(BINDSTATUS_MIMETYPEAVAILABLE, m_szMimeType);
+		return;
+	}
+
+	bool bComplete = m_state == stateComplete;
+	if (pFollower->m_cbReported < m_cbTotal ||
+		(bComplete && !pFollower->m_bLastReported))
+	{
+		DWORD grfBSCF = pFollower->m_cbReported ?
+			BSCF_INTERMEDIATEDATANOTIFICATION :
+			BSCF_FIRSTDATANOTIFICATION;
+		if (bComplete)
+		{
+			grfBSCF |= BSCF_LASTDATANOTIFICATION | BSCF_DATAFULLYAVAILABLE;
+			pFollower->m_bLastReported = true;
+		}
+		pFollower->m_cbReported = m_cbTotal;
+		spSink->ReportData(grfBSCF, m_cbTotal, bComplete ? m_cbTotal : 0);
+		return;
+	}
+
+	ATLASSERT(bComplete);
+	pFollower->m_bResultReported = true;
+	spSink->ReportResult(S_OK, 0, 0);
+}
+
+inline HRESULT CoalescedResponse::ReadFor(CoalescingFollower* pFollower,
+	void* pv, ULONG cb, ULONG* pcbRead)
+{
+	ATLASSERT(pFollower != 0);
+	if (FAILED(pFollower->m_hrFailure))
+	{
+		return pFollower->m_hrFailure;
+	}
+	if (!m_bBuffering)
+	{
+		return INET_E_DOWNLOAD_FAILURE;
+	}
+	ATLASSERT(pFollower->m_cbRead >= m_cbDiscarded);
+
+	ULONG cbCopy = m_cbTotal - pFollower->m_cbRead;
+	if (cbCopy > cb)
+	{
+		cbCopy = cb;
+	}
+	if (cbCopy)
+	{
+		if (!pv)
+		{
+			return E_POINTER;
+		}
+		memcpy(pv, m_pbBuffer + (pFollower->m_cbRead - m_cbDiscarded),
+			cbCopy);
+		pFollower->m_cbRead += cbCopy;
+	}
+	if (pcbRead)
+	{
+		*pcbRead = cbCopy;
+	}
+
+	if (pFollower->m_cbRead < m_cbTotal)
+	{
+		return S_OK;
+	}
+	switch (m_state)
+	{
+	case stateComplete:
+		return S_FALSE;
+	case stateFailed:
+		return cbCopy ? S_OK : m_hrResult;
+	default:
+		return cbCopy ? S_OK : E_PENDING;
+	}
+}
+
+} // end namespace PassthroughAPP::Detail
+
+// ===== CRequestCoalescer =====
+
+inline CRequestCoalescer::CRequestCoalescer() :
+	m_pFirstRegistered(0), m_cbMaxBuffer(1024 * 1024)
+{
+	memset(&m_stats, 0, sizeof(m_stats));
+}
+
+inline CRequestCoalescer::~CRequestCoalescer()
+{
+	// The requests using the coalescer must be gone by now
+	ATLASSERT(!m_pFirstRegistered);
+}
+
+inline void CRequestCoalescer::SetMaxBufferSize(ULONG cbMax)
+{
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	m_cbMaxBuffer = cbMax;
+}
+
+inline ULONG CRequestCoalescer::GetMaxBufferSize() const
+{
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	return m_cbMaxBuffer;
+}
+
+inline HRESULT CRequestCoalescer::Join(LPCWSTR szUrl,
+	Detail::CoalescedResponse** ppResponse)
+{
+	ATLASSERT(ppResponse != 0);
+	if (!ppResponse)
+	{
+		return E_POINTER;
+	}
+	*ppResponse = 0;
+	ATLASSERT(szUrl != 0);
+	if (!szUrl)
+	{
+		return E_INVALIDARG;
+	}
+
+	ULONG cchUrl = CResponseCache::GetKeyLength(szUrl);
+	DWORD dwHash = CResponseCache::HashKey(szUrl, cchUrl);
+	DWORD dwThreadId = GetCurrentThreadId();
+
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	// Responses of other threads are only compared, never touched
+	for (Detail::CoalescedResponse* pResponse = m_pFirstRegistered;
+		pResponse; pResponse = pResponse->m_pNextRegistered)
+	{
+		if (pResponse->m_dwHash == dwHash &&
+			pResponse->m_dwThreadId == dwThreadId &&
+			pResponse->m_cchUrl == cchUrl &&
+			!wmemcmp(pResponse->m_szUrl, szUrl, cchUrl))
+		{
+			pResponse->AddRef();
+			++m_stats.cFollowers;
+			*ppResponse = pResponse;
+			return S_OK;
+		}
+	}
+
+	Detail::CoalescedResponse* pResponse = 0;
+	ATLTRY(pResponse = new Detail::CoalescedResponse(this, dwHash,
+		dwThreadId, m_cbMaxBuffer))
+	if (!pResponse)
+	{
+		return E_OUTOFMEMORY;
+	}
+	ATLTRY(pResponse->m_szUrl = new WCHAR[cchUrl + 1])
+	if (!pResponse->m_szUrl)
+	{
+		pResponse->Release();
+		return E_OUTOFMEMORY;
+	}
+	wmemcpy(pResponse->m_szUrl, szUrl, cchUrl);
+	pResponse->m_szUrl[cchUrl] = 0;
+	pResponse->m_cchUrl = cchUrl;
+
+	pResponse->m_pNextRegistered = m_pFirstRegistered;
+	if (m_pFirstRegistered)
+	{
+		m_pFirstRegistered->m_pPrevRegistered = pResponse;
+	}
+	m_pFirstRegistered = pResponse;
+	pResponse->m_bRegistered = true;
+	++m_stats.cLeaders;
+	*ppResponse = pResponse;
+	return S_FALSE;
+}
+
+inline void CRequestCoalescer::GetStatistics(
+	RequestCoalescerStatistics* pStats) const
+{
+	ATLASSERT(pStats != 0);
+	if (!pStats)
+	{
+		return;
+	}
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	*pStats = m_stats;
+}
+
+inline void CRequestCoalescer::Unregister(
+	Detail::CoalescedResponse* pResponse)
+{
+	ATLASSERT(pResponse != 0);
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	if (!pResponse->m_bRegistered)
+	{
+		return;
+	}
+	if (pResponse->m_pPrevRegistered)
+	{
+		pResponse->m_pPrevRegistered->m_pNextRegistered =
+			pResponse->m_pNextRegistered;
+	}
+	else
+	{
+		m_pFirstRegistered = pResponse->m_pNextRegistered;
+	}
+	if (pResponse->m_pNextRegistered)
+	{
+		pResponse->m_pNextRegistered->m_pPrevRegistered =
+			pResponse->m_pPrevRegistered;
+	}
+	pResponse->m_pPrevRegistered = 0;
+	pResponse->m_pNextRegistered = 0;
+	pResponse->m_bRegistered = false;
+}
+
+} // end namespace PassthroughAPP
+
+#endif // PASSTHROUGHAPP_REQUESTCOALESCER_INL
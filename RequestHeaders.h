@@ -0,0 +1,202 @@
+#ifndef PASSTHROUGHAPP_REQUESTHEADERS_H
+#define PASSTHROUGHAPP_REQUESTHEADERS_H
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+// Headers added to requests, returned from IHttpNegotiate::
+// BeginningTransaction as its additional headers.
+//
+// A CRequestHeaderRules holds the headers to add and which requests they
+// go to: all of them, those to a host and its subdomains, or those whose
+// URL starts with a prefix. Each header is formatted as its final
+// "Name: value" line when it is added, so building the block for a
+// request only copies lines, into one allocation of the right size.
+//
+// The headers for all requests and those picked by host only depend on
+// the origin of the URL. They are rendered once per origin and kept,
+// so that a request to an origin seen before copies a single block, plus
+// the lines of any prefix rules its URL matches. Each origin also keeps
+// the prefix rules its URLs can match, so that only those are checked. A
+// Render can be called from any thread.
+//
+// CRequestHeaderSinkWithSP is a sink that adds the headers of the rules
+// its derived class supplies to those of the client's IHttpNegotiate.
+
+#include <vector>
+
+#include "ProtocolImpl.h"
+
+namespace PassthroughAPP
+{
+
+struct RequestHeaderStatistics
+{
+	// Renders, and how many of them found their origin's block rendered
+	LONG cRenders;
+	LONG cOriginHits;
+	// Origin blocks currently kept
+	LONG cOrigins;
+};
+
+namespace Detail
+{
+
+enum RequestHeaderScope
+{
+	RequestHeaderAll,
+	RequestHeaderHost,
+	RequestHeaderUrlPrefix
+};
+
+enum
+{
+	cRequestHeaderBuckets = 64
+};
+
+struct RequestHeaderRule
+{
+	RequestHeaderScope scope;
+	// Into the rules' text
+	ULONG ichPattern;
+	ULONG cchPattern;
+	// The line added, CRLF included
+	ULONG ichLine;
+	ULONG cchLine;
+};
+
+// The lines of the rules that apply to every URL of an origin, and the
+// URL prefix rules that may. Allocated in one block with its strings
+struct RequestHeaderOrigin
+{
+	RequestHeaderOrigin* pNext;
+	DWORD dwHash;
+	const WCHAR* pchOrigin;
+	ULONG cchOrigin;
+	const WCHAR* pchLines;
+	ULONG cchLines;
+	// Indexes of the rules
+	const ULONG* piUrlRules;
+	ULONG cUrlRules;
+};
+
+// Splits szUrl into its origin, scheme://authority, and the host within
+// it. Both are empty if the URL has no authority
+void GetRequestHeaderOrigin(LPCWSTR szUrl, ULONG* pcchOrigin,
+	ULONG* pichHost, ULONG* pcchHost);
+// Compares ignoring ASCII case
+bool EqualRequestHeaderText(const WCHAR* pch1, const WCHAR* pch2,
+	ULONG cch);
+// Whether the host is the pattern or one of its subdomains
+bool MatchRequestHeaderHost(const WCHAR* pchHost, ULONG cchHost,
+	const WCHAR* pchPattern, ULONG cchPattern);
+
+} // end namespace PassthroughAPP::Detail
+
+class CRequestHeaderRules
+{
+public:
+	CRequestHeaderRules();
+	~CRequestHeaderRules();
+
+	// Adds szName: szValue to every request, to requests to szHost or its
+	// subdomains, or to requests whose URL starts with szPrefix, ignoring
+	// ASCII case. Headers are added in the order of the rules that apply.
+	// Names can't be empty or hold colons, and neither names nor values
+	// line breaks. Only before the first Render
+	HRESULT AddHeader(LPCWSTR szName, LPCWSTR szValue);
+	HRESULT AddHostHeader(LPCWSTR szHost, LPCWSTR szName, LPCWSTR szValue);
+	HRESULT AddUrlPrefixHeader(LPCWSTR szPrefix, LPCWSTR szName,
+		LPCWSTR szValue);
+
+	// The most origins whose blocks are kept, 256 by default. Once there
+	// are more, the blocks kept are dropped and rendered again as needed
+	void SetMaxOrigins(ULONG cMaxOrigins);
+
+	// Returns the headers for szUrl, following szHeaders if it isn't 0, in
+	// a string allocated with CoTaskMemAlloc, as BeginningTransaction
+	// returns them. Returns S_FALSE and 0 if no rule applies to szUrl, in
+	// which case szHeaders is all there is to add
+	HRESULT Render(LPCWSTR szUrl, LPCWSTR szHeaders,
+		LPWSTR* pszAdditionalHeaders);
+
+	void GetStatistics(RequestHeaderStatistics* pStats) const;
+
+private:
+	// Not copyable
+	CRequestHeaderRules(const CRequestHeaderRules&);
+	CRequestHeaderRules& operator=(const CRequestHeaderRules&);
+
+	HRESULT AddRule(Detail::RequestHeaderScope scope, LPCWSTR szPattern,
+		LPCWSTR szName, LPCWSTR szValue);
+	// Renders the block of the origin szUrl[0..cchOrigin)
+	HRESULT CreateOrigin(LPCWSTR szUrl, ULONG cchOrigin, DWORD dwHash,
+		ULONG ichHost, ULONG cchHost, Detail::RequestHeaderOrigin** ppOrigin);
+	Detail::RequestHeaderOrigin* FindOrigin(LPCWSTR szUrl, ULONG cchOrigin,
+		DWORD dwHash) const;
+	void ClearOrigins();
+	// Whether URLs of the origin szUrl[0..cchOrigin) can start with the
+	// rule's prefix
+	bool IsOriginUrlRule(const Detail::RequestHeaderRule& rule,
+		LPCWSTR szUrl, ULONG cchOrigin) const;
+	// The lines of the prefix rules of pOrigin szUrl matches are copied to
+	// pch, if it isn't 0. Returns their length
+	ULONG CopyUrlLines(const Detail::RequestHeaderOrigin* pOrigin,
+		LPCWSTR szUrl, ULONG cchUrl, WCHAR* pch) const;
+	static DWORD HashOrigin(LPCWSTR szUrl, ULONG cchOrigin);
+
+	// Rule patterns and lines
+	std::vector<WCHAR> m_text;
+	std::vector<Detail::RequestHeaderRule> m_rules;
+	bool m_bHasUrlRules;
+	bool m_bRendering;
+	ULONG m_cMaxOrigins;
+
+	mutable CComAutoCriticalSection m_cs;
+	Detail::RequestHeaderOrigin* m_pBuckets[Detail::cRequestHeaderBuckets];
+	RequestHeaderStatistics m_stats;
+};
+
+// A sink adding the headers of T's rules to every request. T implements
+//
+//	CRequestHeaderRules* GetRequestHeaderRules();
+//
+// returning 0 to add nothing. A T with a service map of its own lists
+// IID_IHttpNegotiate in it
+template <class T, class ThreadModel = CComMultiThreadModel>
+class CRequestHeaderSinkWithSP :
+	public CInternetProtocolSinkWithSP<T, ThreadModel>,
+	public IHttpNegotiate
+{
+	typedef CInternetProtocolSinkWithSP<T, ThreadModel> BaseClass;
+public:
+	DECLARE_HASHED_COM_MAP()
+	BEGIN_COM_MAP(CRequestHeaderSinkWithSP)
+		COM_INTERFACE_ENTRY(IHttpNegotiate)
+		COM_INTERFACE_ENTRY_CHAIN_HASHED(BaseClass)
+	END_COM_MAP()
+
+	BEGIN_SERVICE_MAP(CRequestHeaderSinkWithSP)
+		SERVICE_ENTRY(IID_IHttpNegotiate)
+	END_SERVICE_MAP()
+
+	// IHttpNegotiate
+	STDMETHODIMP BeginningTransaction(
+		/* [in] */ LPCWSTR szURL,
+		/* [in] */ LPCWSTR szHeaders,
+		/* [in] */ DWORD dwReserved,
+		/* [out] */ LPWSTR *pszAdditionalHeaders);
+
+	STDMETHODIMP OnResponse(
+		/* [in] */ DWORD dwResponseCode,
+		/* [in] */ LPCWSTR szResponseHeaders,
+		/* [in] */ LPCWSTR szRequestHeaders,
+		/* [out] */ LPWSTR *pszAdditionalRequestHeaders);
+};
+
+} // end namespace PassthroughAPP
+
+#include "RequestHeaders.inl"
+
+#endif // PASSTHROUGHAPP_REQUESTHEADERS_H
@@ -0,0 +1,568 @@
+#ifndef PASSTHROUGHAPP_REQUESTHEADERS_INL
+#define PASSTHROUGHAPP_REQUESTHEADERS_INL
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+#ifndef PASSTHROUGHAPP_REQUESTHEADERS_H
+	#error RequestHeaders.inl requires RequestHeaders.h to be included first
+#endif
+
+namespace PassthroughAPP
+{
+
+namespace Detail
+{
+
+inline void GetRequestHeaderOrigin(LPCWSTR szUrl, ULONG* pcchOrigin,
+	ULONG* pichHost, ULONG* pcchHost)
+{
+	ATLASSERT(szUrl != 0);
+	ATLASSERT(pcchOrigin != 0 && pichHost != 0 && pcchHost != 0);
+	*pcchOrigin = 0;
+	*pichHost = 0;
+	*pcchHost = 0;
+
+	ULONG ich = 0;
+	while (szUrl[ich] && szUrl[ich] != L':' && szUrl[ich] != L'/' &&
+		szUrl[ich] != L'?' && szUrl[ich] != L'#')
+	{
+		++ich;
+	}
+	if (!ich || szUrl[ich] != L':' || szUrl[ich + 1] != L'/' ||
+		szUrl[ich + 2] != L'/')
+	{
+		return;
+	}
+
+	ULONG ichAuthority = ich + 3;
+	ULONG ichEnd = ichAuthority;
+	ULONG ichHost = ichAuthority;
+	while (szUrl[ichEnd] && szUrl[ichEnd] != L'/' && szUrl[ichEnd] != L'?' &&
+		szUrl[ichEnd] != L'#')
+	{
+		if (szUrl[ichEnd] == L'@')
+		{
+			ichHost = ichEnd + 1;
+		}
+		++ichEnd;
+	}
+
+	ULONG ichHostEnd = ichHost;
+	if (ichHost < ichEnd && szUrl[ichHost] == L'[')
+	{
+		// An IPv6 address, brackets included
+		while (ichHostEnd < ichEnd && szUrl[ichHostEnd] != L']')
+		{
+			++ichHostEnd;
+		}
+		if (ichHostEnd < ichEnd)
+		{
+			++ichHostEnd;
+		}
+	}
+	else
+	{
+		while (ichHostEnd < ichEnd && szUrl[ichHostEnd] != L':')
+		{
+			++ichHostEnd;
+		}
+	}
+
+	*pcchOrigin = ichEnd;
+	*pichHost = ichHost;
+	*pcchHost = ichHostEnd - ichHost;
+}
+
+inline bool EqualRequestHeaderText(const WCHAR* pch1, const WCHAR* pch2,
+	ULONG cch)
+{
+	for (ULONG i = 0; i < cch; ++i)
+	{
+		WCHAR ch1 = pch1[i];
+		WCHAR ch2 = pch2[i];
+		if (ch1 != ch2 &&
+			((ch1 | 0x20) != (ch2 | 0x20) || (ch1 | 0x20) < L'a' ||
+				(ch1 | 0x20) > L'z'))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+inline bool MatchRequestHeaderHost(const WCHAR* pchHost, ULONG cchHost,
+	const WCHAR* pchPattern, ULONG cchPattern)
+{
+	if (cchHost < cchPattern || !EqualRequestHeaderText(
+		pchHost + cchHost - cchPattern, pchPattern, cchPattern))
+	{
+		return false;
+	}
+	return cchHost == cchPattern || pchHost[cchHost - cchPattern - 1] == L'.';
+}
+
+} // end namespace PassthroughAPP::Detail
+
+// ===== CRequestHeaderRules =====
+
+inline CRequestHeaderRules::CRequestHeaderRules() :
+	m_bHasUrlRules(false), m_bRendering(false), m_cMaxOrigins(256)
+{
+	memset(m_pBuckets, 0, sizeof(m_pBuckets));
+	memset(&m_stats, 0, sizeof(m_stats));
+}
+
+inline CRequestHeaderRules::~CRequestHeaderRules()
+{
+	ClearOrigins();
+}
+
+inline HRESULT CRequestHeaderRules::AddHeader(LPCWSTR szName,
+	LPCWSTR szValue)
+{
+	return AddRule(Detail::RequestHeaderAll, 0, szName, szValue);
+}
+
+inline HRESULT CRequestHeaderRules::AddHostHeader(LPCWSTR szHost,
+	LPCWSTR szName, LPCWSTR szValue)
+{
+	return AddRule(Detail::RequestHeaderHost, szHost, szName, szValue);
+}
+
+inline HRESULT CRequestHeaderRules::AddUrlPrefixHeader(LPCWSTR szPrefix,
+	LPCWSTR szName, LPCWSTR szValue)
+{
+	return AddRule(Detail::RequestHeaderUrlPrefix, szPrefix, szName, szValue);
+}
+
+inline void CRequestHeaderRules::SetMaxOrigins(ULONG cMaxOrigins)
+{
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	m_cMaxOrigins = cMaxOrigins;
+	if (static_cast<ULONG>(m_stats.cOrigins) > m_cMaxOrigins)
+	{
+		ClearOrigins();
+	}
+}
+
+inline HRESULT CRequestHeaderRules::Render(LPCWSTR szUrl, LPCWSTR szHeaders,
+	LPWSTR* pszAdditionalHeaders)
+{
+	ATLASSERT(szUrl != 0 && pszAdditionalHeaders != 0);
+	if (!szUrl || !pszAdditionalHeaders)
+	{
+		return E_POINTER;
+	}
+	*pszAdditionalHeaders = 0;
+
+	ULONG cchOrigin;
+	ULONG ichHost;
+	ULONG cchHost;
+	Detail::GetRequestHeaderOrigin(szUrl, &cchOrigin, &ichHost, &cchHost);
+	DWORD dwHash = HashOrigin(szUrl, cchOrigin);
+	ULONG cchUrl = m_bHasUrlRules ? static_cast<ULONG>(wcslen(szUrl)) : 0;
+
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	m_bRendering = true;
+	++m_stats.cRenders;
+	Detail::RequestHeaderOrigin* pOrigin = FindOrigin(szUrl, cchOrigin,
+		dwHash);
+	if (pOrigin)
+	{
+		++m_stats.cOriginHits;
+	}
+	else
+	{
+		lock.Unlock();
+		Detail::RequestHeaderOrigin* pNew = 0;
+		HRESULT hr = CreateOrigin(szUrl, cchOrigin, dwHash, ichHost, cchHost,
+			&pNew);
+		if (FAILED(hr))
+		{
+			return hr;
+		}
+		lock.Lock();
+		// Another thread may have rendered it meanwhile
+		pOrigin = FindOrigin(szUrl, cchOrigin, dwHash);
+		if (pOrigin)
+		{
+			delete[] reinterpret_cast<BYTE*>(pNew);
+		}
+		else
+		{
+			if (static_cast<ULONG>(m_stats.cOrigins) >= m_cMaxOrigins)
+			{
+				ClearOrigins();
+			}
+			Detail::RequestHeaderOrigin*& pBucket =
+				m_pBuckets[dwHash % Detail::cRequestHeaderBuckets];
+			pNew->pNext = pBucket;
+			pBucket = pNew;
+			++m_stats.cOrigins;
+			pOrigin = pNew;
+		}
+	}
+
+	ULONG cchUrlLines = CopyUrlLines(pOrigin, szUrl, cchUrl, 0);
+	ULONG cchLines = pOrigin->cchLines + cchUrlLines;
+	if (!cchLines)
+	{
+		return S_FALSE;
+	}
+	ULONG cchHeaders = szHeaders ? static_cast<ULONG>(wcslen(szHeaders)) : 0;
+	bool bLineBreak = cchHeaders && szHeaders[cchHeaders - 1] != L'\n';
+	SIZE_T cchTotal = static_cast<SIZE_T>(cchHeaders) + (bLineBreak ? 2 : 0) +
+		cchLines + 1;
+	WCHAR* sz = static_cast<WCHAR*>(CoTaskMemAlloc(cchTotal * sizeof(WCHAR)));
+	if (!sz)
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	WCHAR* pch = sz;
+	if (cchHeaders)
+	{
+		memcpy(pch, szHeaders, cchHeaders * sizeof(WCHAR));
+		pch += cchHeaders;
+	}
+	if (bLineBreak)
+	{
+		*pch++ = L'\r';
+		*pch++ = L'\n';
+	}
+	memcpy(pch, pOrigin->pchLines, pOrigin->cchLines * sizeof(WCHAR));
+	pch += pOrigin->cchLines;
+	pch += CopyUrlLines(pOrigin, szUrl, cchUrl, pch);
+	lock.Unlock();
+
+	*pch = 0;
+	ATLASSERT(static_cast<SIZE_T>(pch - sz) + 1 == cchTotal);
+	*pszAdditionalHeaders = sz;
+	return S_OK;
+}
+
+inline void CRequestHeaderRules::GetStatistics(
+	RequestHeaderStatistics* pStats) const
+{
+	ATLASSERT(pStats != 0);
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	*pStats = m_stats;
+}
+
+inline HRESULT CRequestHeaderRules::AddRule(Detail::RequestHeaderScope scope,
+	LPCWSTR szPattern, LPCWSTR szName, LPCWSTR szValue)
+{
+	ATLASSERT(szName != 0 && szValue != 0);
+	ATLASSERT(scope == Detail::RequestHeaderAll || szPattern != 0);
+	if (!szName || !szValue ||
+		(scope != Detail::RequestHeaderAll && !szPattern))
+	{
+		return E_POINTER;
+	}
+	ATLASSERT(!m_bRendering);
+	if (m_bRendering)
+	{
+		return E_UNEXPECTED;
+	}
+
+	ULONG cchPattern = szPattern ? static_cast<ULONG>(wcslen(szPattern)) : 0;
+	ULONG cchName = static_cast<ULONG>(wcslen(szName));
+	ULONG cchValue = static_cast<ULONG>(wcslen(szValue));
+	if (!cchName || wcspbrk(szName, L":\r\n") || wcspbrk(szValue, L"\r\n") ||
+		(scope != Detail::RequestHeaderAll && !cchPattern))
+	{
+		return E_INVALIDARG;
+	}
+
+	// pattern, then "name: value\r\n"
+	Detail::RequestHeaderRule rule;
+	rule.scope = scope;
+	rule.ichPattern = static_cast<ULONG>(m_text.size());
+	rule.cchPattern = cchPattern;
+	rule.ichLine = rule.ichPattern + cchPattern;
+	rule.cchLine = cchName + 2 + cchValue + 2;
+	size_t cRules = m_rules.size();
+	ATLTRY(m_text.resize(rule.ichLine + rule.cchLine))
+	if (m_text.size() == rule.ichLine + rule.cchLine)
+	{
+		ATLTRY(m_rules.push_back(rule))
+	}
+	if (m_rules.size() == cRules)
+	{
+		m_text.resize(rule.ichPattern);
+		return E_OUTOFMEMORY;
+	}
+
+	WCHAR* pch = &m_text[rule.ichPattern];
+	if (cchPattern)
+	{
+		memcpy(pch, szPattern, cchPattern * sizeof(WCHAR));
+		pch += cchPattern;
+	}
+	memcpy(pch, szName, cchName * sizeof(WCHAR));
+	pch += cchName;
+	*pch++ = L':';
+	*pch++ = L' ';
+	memcpy(pch, szValue, cchValue * sizeof(WCHAR));
+	pch += cchValue;
+	*pch++ = L'\r';
+	*pch++ = L'\n';
+	m_bHasUrlRules = m_bHasUrlRules ||
+		scope == Detail::RequestHeaderUrlPrefix;
+	return S_OK;
+}
+
+inline HRESULT CRequestHeaderRules::CreateOrigin(LPCWSTR szUrl,
+	ULONG cchOrigin, DWORD dwHash, ULONG ichHost, ULONG cchHost,
+	Detail::RequestHeaderOrigin** ppOrigin)
+{
+	ATLASSERT(ppOrigin != 0);
+	*ppOrigin = 0;
+
+	// Measure, then copy
+	ULONG cchLines = 0;
+	ULONG cUrlRules = 0;
+	WCHAR* pchLines = 0;
+	ULONG* piUrlRules = 0;
+	for (int iPass = 0; iPass < 2; ++iPass)
+	{
+		for (size_t i = 0; i < m_rules.size(); ++i)
+		{
+			const Detail::RequestHeaderRule& rule = m_rules[i];
+			if (rule.scope == Detail::RequestHeaderUrlPrefix)
+			{
+				if (!IsOriginUrlRule(rule, szUrl, cchOrigin))
+				{
+					continue;
+				}
+				if (iPass)
+				{
+					*piUrlRules++ = static_cast<ULONG>(i);
+				}
+				else
+				{
+					++cUrlRules;
+				}
+				continue;
+			}
+			if (rule.scope == Detail::RequestHeaderHost &&
+				!Detail::MatchRequestHeaderHost(szUrl + ichHost, cchHost,
+					&m_text[rule.ichPattern], rule.cchPattern))
+			{
+				continue;
+			}
+			if (iPass)
+			{
+				memcpy(pchLines, &m_text[rule.ichLine],
+					rule.cchLine * sizeof(WCHAR));
+				pchLines += rule.cchLine;
+			}
+			else
+			{
+				cchLines += rule.cchLine;
+			}
+		}
+		if (iPass)
+		{
+			break;
+		}
+
+		// The rule indexes, then the strings
+		BYTE* pb = 0;
+		ATLTRY(pb = new BYTE[sizeof(Detail::RequestHeaderOrigin) +
+			cUrlRules * sizeof(ULONG) +
+			(static_cast<SIZE_T>(cchOrigin) + cchLines) * sizeof(WCHAR)])
+		if (!pb)
+		{
+			return E_OUTOFMEMORY;
+		}
+		Detail::RequestHeaderOrigin* pOrigin =
+			reinterpret_cast<Detail::RequestHeaderOrigin*>(pb);
+		piUrlRules = reinterpret_cast<ULONG*>(pOrigin + 1);
+		WCHAR* pch = reinterpret_cast<WCHAR*>(piUrlRules + cUrlRules);
+		memcpy(pch, szUrl, cchOrigin * sizeof(WCHAR));
+		pOrigin->pNext = 0;
+		pOrigin->dwHash = dwHash;
+		pOrigin->pchOrigin = pch;
+		pOrigin->cchOrigin = cchOrigin;
+		pOrigin->pchLines = pch + cchOrigin;
+		pOrigin->cchLines = cchLines;
+		pOrigin->piUrlRules = piUrlRules;
+		pOrigin->cUrlRules = cUrlRules;
+		*ppOrigin = pOrigin;
+		if (!cchLines && !cUrlRules)
+		{
+			break;
+		}
+		pchLines = pch + cchOrigin;
+	}
+	return S_OK;
+}
+
+inline Detail::RequestHeaderOrigin* CRequestHeaderRules::FindOrigin(
+	LPCWSTR szUrl, ULONG cchOrigin, DWORD dwHash) const
+{
+	for (Detail::RequestHeaderOrigin* pOrigin =
+			m_pBuckets[dwHash % Detail::cRequestHeaderBuckets];
+		pOrigin; pOrigin = pOrigin->pNext)
+	{
+		if (pOrigin->dwHash == dwHash && pOrigin->cchOrigin == cchOrigin &&
+			Detail::EqualRequestHeaderText(pOrigin->pchOrigin, szUrl,
+				cchOrigin))
+		{
+			return pOrigin;
+		}
+	}
+	return 0;
+}
+
+inline void CRequestHeaderRules::ClearOrigins()
+{
+	for (ULONG i = 0; i < Detail::cRequestHeaderBuckets; ++i)
+	{
+		Detail::RequestHeaderOrigin* pOrigin = m_pBuckets[i];
+		while (pOrigin)
+		{
+			Detail::RequestHeaderOrigin* pNext = pOrigin->pNext;
+			delete[] reinterpret_cast<BYTE*>(pOrigin);
+			pOrigin = pNext;
+		}
+		m_pBuckets[i] = 0;
+	}
+	m_stats.cOrigins = 0;
+}
+
+inline bool CRequestHeaderRules::IsOriginUrlRule(
+	const Detail::RequestHeaderRule& rule, LPCWSTR szUrl,
+	ULONG cchOrigin) const
+{
+	ATLASSERT(rule.scope == Detail::RequestHeaderUrlPrefix);
+	// URLs without an authority share the one origin
+	if (!cchOrigin)
+	{
+		return true;
+	}
+	const WCHAR* pchPattern = &m_text[rule.ichPattern];
+	if (rule.cchPattern <= cchOrigin)
+	{
+		return Detail::EqualRequestHeaderText(pchPattern, szUrl,
+			rule.cchPattern);
+	}
+	// What follows the origin in a URL
+	WCHAR ch = pchPattern[cchOrigin];
+	return (ch == L'/' || ch == L'?' || ch == L'#') &&
+		Detail::EqualRequestHeaderText(pchPattern, szUrl, cchOrigin);
+}
+
+inline ULONG CRequestHeaderRules::CopyUrlLines(
+	const Detail::RequestHeaderOrigin* pOrigin, LPCWSTR szUrl, ULONG cchUrl,
+	WCHAR* pch) const
+{
+	ULONG cchLines = 0;
+	for (ULONG i = 0; i < pOrigin->cUrlRules; ++i)
+	{
+		const Detail::RequestHeaderRule& rule =
+			m_rules[pOrigin->piUrlRules[i]];
+		if (cchUrl < rule.cchPattern ||
+			!Detail::EqualRequestHeaderText(szUrl, &m_text[rule.ichPattern],
+				rule.cchPattern))
+		{
+			continue;
+		}
+		if (pch)
+		{
+			memcpy(pch + cchLines, &m_text[rule.ichLine],
+				rule.cchLine * sizeof(WCHAR));
+		}
+		cchLines += rule.cchLine;
+	}
+	return cchLines;
+}
+
+inline DWORD CRequestHeaderRules::HashOrigin(LPCWSTR szUrl, ULONG cchOrigin)
+{
+	// FNV-1a, ignoring ASCII case
+	DWORD dwHash = 2166136261u;
+	for (ULONG i = 0; i < cchOrigin; ++i)
+	{
+		WCHAR ch = szUrl[i];
+		if (ch >= L'A' && ch <= L'Z')
+		{
+			ch = static_cast<WCHAR>(ch + (L'a' - L'A'));
+		}
+		dwHash = (dwHash ^ static_cast<WORD>(ch)) * 16777619u;
+	}
+	return dwHash;
+}
+
+// ===== CRequestHeaderSinkWithSP =====
+
+template <class T, class ThreadModel>
+inline STDMETHODIMP CRequestHeaderSinkWithSP<T, ThreadModel>::
+	BeginningTransaction(
+	/* [in] */ LPCWSTR szURL,
+	/* [in] */ LPCWSTR szHeaders,
+	/* [in] */ DWORD dwReserved,
+	/* [out] */ LPWSTR *pszAdditionalHeaders)
+{
+	ATLASSERT(pszAdditionalHeaders != 0);
+	if (!pszAdditionalHeaders)
+	{
+		return E_POINTER;
+	}
+	*pszAdditionalHeaders = 0;
+
+	LPWSTR szClientHeaders = 0;
+	CComPtr<IHttpNegotiate> spHttpNegotiate;
+	if (SUCCEEDED(this->QueryServiceFromClient(&spHttpNegotiate)) &&
+		spHttpNegotiate)
+	{
+		HRESULT hr = spHttpNegotiate->BeginningTransaction(szURL, szHeaders,
+			dwReserved, &szClientHeaders);
+		if (FAILED(hr))
+		{
+			CoTaskMemFree(szClientHeaders);
+			return hr;
+		}
+	}
+
+	T* pT = static_cast<T*>(this);
+	CRequestHeaderRules* pRules = pT->GetRequestHeaderRules();
+	LPWSTR szAllHeaders = 0;
+	if (pRules && szURL &&
+		pRules->Render(szURL, szClientHeaders, &szAllHeaders) == S_OK)
+	{
+		CoTaskMemFree(szClientHeaders);
+		szClientHeaders = szAllHeaders;
+	}
+	// Failing to add ours leaves the client's headers as they were
+	*pszAdditionalHeaders = szClientHeaders;
+	return S_OK;
+}
+
+template <class T, class ThreadModel>
+inline STDMETHODIMP CRequestHeaderSinkWithSP<T, ThreadModel>::OnResponse(
+	/* [in] */ DWORD dwResponseCode,
+	/* [in] */ LPCWSTR szResponseHeaders,
+	/* [in] */ LPCWSTR szRequestHeaders,
+	/* [out] */ LPWSTR *pszAdditionalRequestHeaders)
+{
+	if (pszAdditionalRequestHeaders)
+	{
+		*pszAdditionalRequestHeaders = 0;
+	}
+	CComPtr<IHttpNegotiate> spHttpNegotiate;
+	if (SUCCEEDED(this->QueryServiceFromClient(&spHttpNegotiate)) &&
+		spHttpNegotiate)
+	{
+		return spHttpNegotiate->OnResponse(dwResponseCode, szResponseHeaders,
+			szRequestHeaders, pszAdditionalRequestHeaders);
+	}
+	return S_OK;
+}
+
+} // end namespace PassthroughAPP
+
+#endif // PASSTHROUGHAPP_REQUESTHEADERS_INL
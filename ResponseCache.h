@@ -0,0 +1,282 @@
+#ifndef PASSTHROUGHAPP_RESPONSECACHE_H
+#define PASSTHROUGHAPP_RESPONSECACHE_H
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+// An in-memory cache of complete responses, for resources a page asks for
+// over and over again, such as tracking pixels and shared scripts, which
+// WinInet would otherwise revalidate on every request.
+//
+// ResponseCacheStartPolicy (see SinkPolicy.h) captures the body of a GET
+// request as the client reads it through the APP, along with the response
+// headers, and stores it in a CResponseCache once the target reports the
+// end of the data. A later request for the same URL is answered from the
+// cache (see LocalResponse.h) without starting, or with deferred creation
+// even creating, the target.
+//
+// Entries are keyed by URL, without the fragment. Each entry is fresh for
+// as long as its response allows: its Cache-Control max-age, else its
+// Expires against its Date, else a tenth of the time since it was last
+// modified, up to a day. Responses with none of these, and responses that
+// are marked no-store, no-cache or private, vary with the request headers
+// or set cookies, aren't stored. Lookups drop entries past their lifetime
+// instead of revalidating them, so the request goes to the server and
+// stores the response anew.
+//
+// The cache holds entries up to a byte budget and evicts the least
+// recently used ones beyond it. An entry is immutable and reference
+// counted, so an evicted entry stays valid for the requests still reading
+// it. All methods can be called from any thread.
+//
+// A CResponseStore (see ResponseStore.h) attached with SetStore keeps
+// responses on disk across sessions. Entries found there aren't copied into
+// memory.
+
+#include <limits.h>
+#include <wctype.h>
+#include <new>
+
+#include "HttpHeaders.h"
+
+namespace PassthroughAPP
+{
+
+struct ResponseCacheStatistics
+{
+	// Lookups, and how many of them found an entry. Their ratio is the hit
+	// ratio
+	LONG cLookups;
+	LONG cHits;
+	// Entries stored, and entries evicted to stay within the budget
+	LONG cInsertions;
+	LONG cEvictions;
+	// Entries currently held, and the bytes they are charged
+	LONG cEntries;
+	ULONGLONG cbStored;
+	// Body bytes found by lookups, and stored by insertions
+	ULONGLONG cbHit;
+	ULONGLONG cbInserted;
+	// Hits found in the attached store rather than in memory
+	LONG cStoreHits;
+	// Entries in memory found past their freshness lifetime, and dropped
+	LONG cExpirations;
+};
+
+class CResponseCache;
+class CResponseStore;
+
+class CResponseCacheEntry :
+	public IUnknown
+{
+public:
+	LPCWSTR GetUrl() const;
+	// 0 if the response had no Content-Type
+	LPCWSTR GetMimeType() const;
+	// CRLF separated, as returned by HTTP_QUERY_RAW_HEADERS_CRLF
+	LPCWSTR GetHeaders() const;
+	const BYTE* GetBody() const;
+	ULONG GetBodySize() const;
+	// What the entry is charged against the cache's budget
+	ULONG GetSize() const;
+	// When the response stops being fresh, as a FILETIME in UTC
+	ULONGLONG GetExpires() const;
+
+	// IUnknown
+	STDMETHODIMP QueryInterface(REFIID riid, void** ppvObject);
+	STDMETHODIMP_(ULONG) AddRef();
+	STDMETHODIMP_(ULONG) Release();
+
+private:
+	friend class CResponseCache;
+	friend class CResponseStore;
+
+	CResponseCacheEntry();
+	~CResponseCacheEntry();
+
+	// Allocates the entry and its strings and body in one block
+	static HRESULT Create(LPCWSTR szUrl, ULONG cchUrl, DWORD dwHash,
+		LPCWSTR szMimeType, LPCWSTR szHeaders, const BYTE* pbBody,
+		ULONG cbBody, ULONGLONG ullExpires, CResponseCacheEntry** ppEntry);
+	// Points into the memory held by punkStorage instead of copying it.
+	// The strings must be terminated
+	static HRESULT CreateMapped(IUnknown* punkStorage, LPCWSTR szUrl,
+		ULONG cchUrl, DWORD dwHash, LPCWSTR szMimeType, LPCWSTR szHeaders,
+		const BYTE* pbBody, ULONG cbBody, ULONGLONG ullExpires,
+		CResponseCacheEntry** ppEntry);
+
+	LONG m_lRef;
+	ULONG m_cbSize;
+	DWORD m_dwHash;
+	ULONG m_cchUrl;
+	LPCWSTR m_szUrl;
+	LPCWSTR m_szMimeType;
+	LPCWSTR m_szHeaders;
+	const BYTE* m_pbBody;
+	ULONG m_cbBody;
+	ULONGLONG m_ullExpires;
+	IUnknown* m_punkStorage;
+
+	// Owned by the cache, under its lock
+	CResponseCacheEntry* m_pNextInBucket;
+	CResponseCacheEntry* m_pNewer;
+	CResponseCacheEntry* m_pOlder;
+};
+
+class CResponseCache
+{
+public:
+	CResponseCache();
+	~CResponseCache();
+
+	// The most bytes the entries are charged in total, 4 MB by default.
+	// Lowering it evicts entries right away
+	void SetCapacity(ULONGLONG cbCapacity);
+	// Larger bodies aren't stored, 256 KB by default
+	void SetMaxBodySize(ULONG cbMaxBody);
+	ULONG GetMaxBodySize() const;
+	// Lookups that miss in memory go on to pStore, and insertions and
+	// removals are passed on to it. Not AddRef'ed; attach it before using
+	// the cache, and detach it with SetStore(0) before it goes away
+	void SetStore(CResponseStore* pStore);
+
+	// Returns S_OK and an AddRef'ed entry, or S_FALSE if there is none or
+	// it is no longer fresh. A hit in memory makes the entry the most
+	// recently used
+	HRESULT Lookup(LPCWSTR szUrl, CResponseCacheEntry** ppEntry);
+	// Replaces any entry for the same URL with one that stays fresh for
+	// nLifetime seconds (see Detail::GetFreshnessLifetime). Returns
+	// S_FALSE if the response is too large to store, or nLifetime is 0
+	HRESULT Insert(LPCWSTR szUrl, LPCWSTR szMimeType, LPCWSTR szHeaders,
+		const BYTE* pbBody, ULONG cbBody, ULONG nLifetime);
+	// Returns S_FALSE if there was no entry for szUrl
+	HRESULT Remove(LPCWSTR szUrl);
+	// Only empties the memory, not the store
+	void Clear();
+
+	void GetStatistics(ResponseCacheStatistics* pStats) const;
+
+	// The length of the part of szUrl used as the key, and its hash
+	static ULONG GetKeyLength(LPCWSTR szUrl);
+	static DWORD HashKey(LPCWSTR szUrl, ULONG cchUrl);
+
+private:
+	// Not copyable
+	CResponseCache(const CResponseCache&);
+	CResponseCache& operator=(const CResponseCache&);
+
+	CResponseCacheEntry** FindSlot(LPCWSTR szUrl, ULONG cchUrl,
+		DWORD dwHash);
+	// Takes the entry out of its bucket and the recency list, leaving its
+	// reference to the caller
+	void RemoveEntry(CResponseCacheEntry** ppSlot);
+	void Unlink(CResponseCacheEntry* pEntry);
+	void PushNewest(CResponseCacheEntry* pEntry);
+	void Grow();
+	void EvictToCapacity();
+
+	mutable CComAutoCriticalSection m_cs;
+	CResponseCacheEntry** m_ppBuckets;
+	ULONG m_cBuckets;
+	CResponseCacheEntry* m_pNewest;
+	CResponseCacheEntry* m_pOldest;
+	ULONGLONG m_cbCapacity;
+	ULONG m_cbMaxBody;
+	CResponseStore* m_pStore;
+	ResponseCacheStatistics m_stats;
+};
+
+namespace Detail
+{
+
+// The body of a response as the client reads it, for storing it in a
+// CResponseCache once complete
+class ResponseCapture
+{
+public:
+	ResponseCapture();
+	~ResponseCapture();
+
+	bool IsActive() const;
+
+	HRESULT Begin(LPCWSTR szUrl, ULONG cbMax);
+	// Gives up on the response if it grows beyond cbMax
+	void Append(const void* pv, ULONG cb);
+	void End();
+
+	LPCWSTR GetUrl() const;
+	const BYTE* GetBody() const;
+	ULONG GetBodySize() const;
+
+private:
+	// Not copyable
+	ResponseCapture(const ResponseCapture&);
+	ResponseCapture& operator=(const ResponseCapture&);
+
+	WCHAR* m_szUrl;
+	BYTE* m_pbBody;
+	ULONG m_cbBody;
+	ULONG m_cbAllocated;
+	ULONG m_cbMax;
+};
+
+// Returns a string queried from IWinInetHttpInfo, allocated with new[],
+// or S_FALSE if the header is missing
+HRESULT QueryHttpInfoString(IWinInetHttpInfo* pHttpInfo, DWORD dwOption,
+	WCHAR** pszValue);
+// Returns the Content-Type without parameters, the way urlmon reports it,
+// allocated with new[], or S_FALSE if there is none
+HRESULT QueryMimeType(IWinInetHttpInfo* pHttpInfo, WCHAR** pszMimeType);
+
+// The current time, as a FILETIME in UTC
+ULONGLONG GetResponseCacheTime();
+
+enum
+{
+	cacheControlNoStore = 0x01,
+	cacheControlNoCache = 0x02,
+	cacheControlPrivate = 0x04,
+	cacheControlMaxAge = 0x08
+};
+
+struct CacheControl
+{
+	DWORD grfDirectives;
+	// Seconds, if grfDirectives has cacheControlMaxAge
+	ULONG nMaxAge;
+};
+
+// Adds the directives of a Cache-Control or Pragma value to
+// *pCacheControl: comma separated names, compared ignoring case, each
+// with an optional value that is a token or a quoted string. Directives
+// that don't concern a private cache are skipped. A max-age that isn't a
+// number counts as 0, and the lowest of several wins
+void ParseCacheControl(const WCHAR* pch, ULONG cch,
+	CacheControl* pCacheControl);
+// The directives of all Cache-Control headers, or of Pragma if there are
+// none
+void GetCacheControl(const CHttpHeaderView& headers,
+	CacheControl* pCacheControl);
+// Parses a date in any of the formats HTTP allows, e.g. "Sun, 06 Nov 1994
+// 08:49:37 GMT", into a FILETIME in UTC. Returns false if it isn't one
+bool ParseHttpDate(const WCHAR* pch, ULONG cch, ULONGLONG* pullTime);
+
+// Whether a response with these headers may be given to requests other
+// than the one that received it: not marked no-store, no-cache or
+// private, not varying with the request headers, and not setting cookies
+bool IsSharableResponse(const CHttpHeaderView& headers);
+// The seconds a response with these headers, received at ullNow, stays
+// fresh: its max-age, else its Expires less its Date, else a tenth of the
+// time since its Last-Modified up to a day, less the age it already had.
+// 0 if it has none left
+ULONG GetFreshnessLifetime(const CHttpHeaderView& headers, ULONGLONG ullNow);
+
+} // end namespace PassthroughAPP::Detail
+
+} // end namespace PassthroughAPP
+
+#include "ResponseStore.h"
+#include "ResponseCache.inl"
+
+#endif // PASSTHROUGHAPP_RESPONSECACHE_H
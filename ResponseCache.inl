@@ -0,0 +1,1127 @@
+#ifndef PASSTHROUGHAPP_RESPONSECACHE_INL
+#define PASSTHROUGHAPP_RESPONSECACHE_INL
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+#ifndef PASSTHROUGHAPP_RESPONSECACHE_H
+	#error ResponseCache.inl requires ResponseCache.h to be included first
+#endif
+
+namespace PassthroughAPP
+{
+
+// ===== CResponseCacheEntry =====
+
+inline CResponseCacheEntry::CResponseCacheEntry() :
+	m_lRef(1), m_cbSize(0), m_dwHash(0), m_cchUrl(0), m_szUrl(0),
+	m_szMimeType(0), m_szHeaders(0), m_pbBody(0), m_cbBody(0),
+	m_ullExpires(0), m_punkStorage(0), m_pNextInBucket(0), m_pNewer(0),
+	m_pOlder(0)
+{
+}
+
+inline CResponseCacheEntry::~CResponseCacheEntry()
+{
+	if (m_punkStorage)
+	{
+		m_punkStorage->Release();
+	}
+}
+
+inline HRESULT CResponseCacheEntry::Create(LPCWSTR szUrl, ULONG cchUrl,
+	DWORD dwHash, LPCWSTR szMimeType, LPCWSTR szHeaders, const BYTE* pbBody,
+	ULONG cbBody, ULONGLONG ullExpires, CResponseCacheEntry** ppEntry)
+{
+	ATLASSERT(szUrl != 0);
+	ATLASSERT(pbBody != 0 || cbBody == 0);
+	ATLASSERT(ppEntry != 0);
+	*ppEntry = 0;
+
+	size_t cchMimeType = szMimeType ? wcslen(szMimeType) + 1 : 0;
+	size_t cchHeaders = szHeaders ? wcslen(szHeaders) + 1 : 0;
+	size_t cchStrings = cchUrl + 1 + cchMimeType + cchHeaders;
+	size_t cbTotal = sizeof(CResponseCacheEntry) +
+		cchStrings * sizeof(WCHAR) + cbBody;
+	if (cchStrings > ULONG_MAX / sizeof(WCHAR) || cbTotal > ULONG_MAX)
+	{
+		return E_INVALIDARG;
+	}
+
+	void* pv = ::operator new(cbTotal, std::nothrow);
+	if (!pv)
+	{
+		return E_OUTOFMEMORY;
+	}
+	CResponseCacheEntry* pEntry = new(pv) CResponseCacheEntry;
+
+	WCHAR* pch = reinterpret_cast<WCHAR*>(pEntry + 1);
+	memcpy(pch, szUrl, cchUrl * sizeof(WCHAR));
+	pch[cchUrl] = 0;
+	pEntry->m_szUrl = pch;
+	pch += cchUrl + 1;
+	if (szMimeType)
+	{
+		memcpy(pch, szMimeType, cchMimeType * sizeof(WCHAR));
+		pEntry->m_szMimeType = pch;
+		pch += cchMimeType;
+	}
+	if (szHeaders)
+	{
+		memcpy(pch, szHeaders, cchHeaders * sizeof(WCHAR));
+		pEntry->m_szHeaders = pch;
+		pch += cchHeaders;
+	}
+	BYTE* pb = reinterpret_cast<BYTE*>(pch);
+	if (cbBody)
+	{
+		memcpy(pb, pbBody, cbBody);
+	}
+	pEntry->m_pbBody = pb;
+	pEntry->m_cbBody = cbBody;
+	pEntry->m_ullExpires = ullExpires;
+	pEntry->m_cchUrl = cchUrl;
+	pEntry->m_dwHash = dwHash;
+	pEntry->m_cbSize = static_cast<ULONG>(cbTotal);
+
+	*ppEntry = pEntry;
+	return S_OK;
+}
+
+inline HRESULT CResponseCacheEntry::CreateMapped(IUnknown* punkStorage,
+	LPCWSTR szUrl, ULONG cchUrl, DWORD dwHash, LPCWSTR szMimeType,
+	LPCWSTR szHeaders, const BYTE* pbBody, ULONG cbBody, ULONGLONG ullExpires,
+	CResponseCacheEntry** ppEntry)
+{
+	ATLASSERT(punkStorage != 0);
+	ATLASSERT(szUrl != 0 && !szUrl[cchUrl]);
+	ATLASSERT(pbBody != 0 || cbBody == 0);
+	ATLASSERT(ppEntry != 0);
+	*ppEntry = 0;
+
+	void* pv = ::operator new(sizeof(CResponseCacheEntry), std::nothrow);
+	if (!pv)
+	{
+		return E_OUTOFMEMORY;
+	}
+	CResponseCacheEntry* pEntry = new(pv) CResponseCacheEntry;
+	pEntry->m_szUrl = szUrl;
+	pEntry->m_szMimeType = szMimeType;
+	pEntry->m_szHeaders = szHeaders;
+	pEntry->m_pbBody = pbBody;
+	pEntry->m_cbBody = cbBody;
+	pEntry->m_ullExpires = ullExpires;
+	pEntry->m_cchUrl = cchUrl;
+	pEntry->m_dwHash = dwHash;
+	pEntry->m_cbSize = sizeof(CResponseCacheEntry);
+	pEntry->m_punkStorage = punkStorage;
+	punkStorage->AddRef();
+
+	*ppEntry = pEntry;
+	return S_OK;
+}
+
+inline LPCWSTR CResponseCacheEntry::GetUrl() const
+{
+	return m_szUrl;
+}
+
+inline LPCWSTR CResponseCacheEntry::GetMimeType() const
+{
+	return m_szMimeType;
+}
+
+inline LPCWSTR CResponseCacheEntry::GetHeaders() const
+{
+	return m_szHeaders;
+}
+
+inline const BYTE* CResponseCacheEntry::GetBody() const
+{
+	return m_pbBody;
+}
+
+inline ULONG CResponseCacheEntry::GetBodySize() const
+{
+	return m_cbBody;
+}
+
+inline ULONG CResponseCacheEntry::GetSize() const
+{
+	return m_cbSize;
+}
+
+inline ULONGLONG CResponseCacheEntry::GetExpires() const
+{
+	return m_ullExpires;
+}
+
+inline STDMETHODIMP CResponseCacheEntry::QueryInterface(REFIID riid,
+	void** ppvObject)
+{
+	ATLASSERT(ppvObject != 0);
+	if (!ppvObject)
+	{
+		return E_POINTER;
+	}
+	if (!InlineIsEqualGUID(riid, IID_IUnknown))
+	{
+		*ppvObject = 0;
+		return E_NOINTERFACE;
+	}
+	AddRef();
+	*ppvObject = static_cast<IUnknown*>(this);
+	return S_OK;
+}
+
+inline STDMETHODIMP_(ULONG) CResponseCacheEntry::AddRef()
+{
+	return InterlockedIncrement(&m_lRef);
+}
+
+inline STDMETHODIMP_(ULONG) CResponseCacheEntry::Release()
+{
+	LONG lRef = InterlockedDecrement(&m_lRef);
+	if (!lRef)
+	{
+		this->~CResponseCacheEntry();
+		::operator delete(this);
+	}
+	return lRef;
+}
+
+// ===== CResponseCache =====
+
+inline CResponseCache::CResponseCache() :
+	m_ppBuckets(0), m_cBuckets(0), m_pNewest(0), m_pOldest(0),
+	m_cbCapacity(4 * 1024 * 1024), m_cbMaxBody(256 * 1024), m_pStore(0)
+{
+	memset(&m_stats, 0, sizeof(m_stats));
+}
+
+inline CResponseCache::~CResponseCache()
+{
+	Clear();
+	delete[] m_ppBuckets;
+}
+
+inline void CResponseCache::SetCapacity(ULONGLONG cbCapacity)
+{
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	m_cbCapacity = cbCapacity;
+	EvictToCapacity();
+}
+
+inline void CResponseCache::SetMaxBodySize(ULONG cbMaxBody)
+{
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	m_cbMaxBody = cbMaxBody;
+}
+
+inline ULONG CResponseCache::GetMaxBodySize() const
+{
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	return m_cbMaxBody;
+}
+
+inline void CResponseCache::SetStore(CResponseStore* pStore)
+{
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	m_pStore = pStore;
+}
+
+inline HRESULT CResponseCache::Lookup(LPCWSTR szUrl,
+	CResponseCacheEntry** ppEntry)
+{
+	ATLASSERT(szUrl != 0);
+	ATLASSERT(ppEntry != 0);
+	if (!szUrl || !ppEntry)
+	{
+		return E_POINTER;
+	}
+	*ppEntry = 0;
+
+	ULONG cchUrl = GetKeyLength(szUrl);
+	DWORD dwHash = HashKey(szUrl, cchUrl);
+	ULONGLONG ullNow = Detail::GetResponseCacheTime();
+
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	++m_stats.cLookups;
+	CResponseCacheEntry** ppSlot = FindSlot(szUrl, cchUrl, dwHash);
+	CResponseCacheEntry* pExpired = 0;
+	if (ppSlot && *ppSlot && (*ppSlot)->m_ullExpires <= ullNow)
+	{
+		pExpired = *ppSlot;
+		RemoveEntry(ppSlot);
+		++m_stats.cExpirations;
+	}
+	if (!ppSlot || !*ppSlot)
+	{
+		CResponseStore* pStore = m_pStore;
+		lock.Unlock();
+		if (pExpired)
+		{
+			pExpired->Release();
+		}
+		// The store reads from disk, so not under the lock. Its entries
+		// stay in the file cache rather than taking up memory here
+		if (!pStore || pStore->Lookup(szUrl, ppEntry) != S_OK)
+		{
+			return S_FALSE;
+		}
+		lock.Lock();
+		++m_stats.cHits;
+		++m_stats.cStoreHits;
+		m_stats.cbHit += (*ppEntry)->m_cbBody;
+		return S_OK;
+	}
+
+	CResponseCacheEntry* pEntry = *ppSlot;
+	if (pEntry != m_pNewest)
+	{
+		Unlink(pEntry);
+		PushNewest(pEntry);
+	}
+	++m_stats.cHits;
+	m_stats.cbHit += pEntry->m_cbBody;
+
+	pEntry->AddRef();
+	*ppEntry = pEntry;
+	return S_OK;
+}
+
+inline HRESULT CResponseCache::Insert(LPCWSTR szUrl, LPCWSTR szMimeType,
+	LPCWSTR szHeaders, const BYTE* pbBody, ULONG cbBody, ULONG nLifetime)
+{
+	ATLASSERT(szUrl != 0);
+	ATLASSERT(pbBody != 0 || cbBody == 0);
+	if (!szUrl || (!pbBody && cbBody))
+	{
+		return E_POINTER;
+	}
+	if (!nLifetime || cbBody > GetMaxBodySize())
+	{
+		return S_FALSE;
+	}
+
+	// Copy the response before taking the lock
+	ULONG cchUrl = GetKeyLength(szUrl);
+	DWORD dwHash = HashKey(szUrl, cchUrl);
+	ULONGLONG ullExpires = Detail::GetResponseCacheTime() +
+		nLifetime * 10000000ULL;
+	CResponseCacheEntry* pEntry = 0;
+	HRESULT hr = CResponseCacheEntry::Create(szUrl, cchUrl, dwHash,
+		szMimeType, szHeaders, pbBody, cbBody, ullExpires, &pEntry);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	CResponseStore* pStore = m_pStore;
+	CResponseCacheEntry* pOld = 0;
+	if (pEntry->m_cbSize > m_cbCapacity)
+	{
+		hr = S_FALSE;
+	}
+	else
+	{
+		if (m_stats.cEntries >= static_cast<LONG>(m_cBuckets))
+		{
+			Grow();
+		}
+		CResponseCacheEntry** ppSlot = FindSlot(szUrl, cchUrl, dwHash);
+		if (!ppSlot)
+		{
+			hr = E_OUTOFMEMORY;
+		}
+		else
+		{
+			pOld = *ppSlot;
+			if (pOld)
+			{
+				// Take the old entry's place in the bucket
+				RemoveEntry(ppSlot);
+			}
+			pEntry->m_pNextInBucket = *ppSlot;
+			*ppSlot = pEntry;
+			PushNewest(pEntry);
+			++m_stats.cEntries;
+			m_stats.cbStored += pEntry->m_cbSize;
+			++m_stats.cInsertions;
+			m_stats.cbInserted += cbBody;
+			pEntry = 0;
+
+			EvictToCapacity();
+		}
+	}
+	lock.Unlock();
+
+	if (pEntry)
+	{
+		pEntry->Release();
+	}
+	if (pOld)
+	{
+		pOld->Release();
+	}
+
+	// Written through, so that the store survives the process
+	if (pStore && pStore->Insert(szUrl, szMimeType, szHeaders, pbBody,
+		cbBody, ullExpires) == S_OK)
+	{
+		hr = S_OK;
+	}
+	return hr;
+}
+
+inline HRESULT CResponseCache::Remove(LPCWSTR szUrl)
+{
+	ATLASSERT(szUrl != 0);
+	if (!szUrl)
+	{
+		return E_POINTER;
+	}
+
+	ULONG cchUrl = GetKeyLength(szUrl);
+	DWORD dwHash = HashKey(szUrl, cchUrl);
+
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	CResponseStore* pStore = m_pStore;
+	CResponseCacheEntry** ppSlot = FindSlot(szUrl, cchUrl, dwHash);
+	CResponseCacheEntry* pEntry = ppSlot ? *ppSlot : 0;
+	if (pEntry)
+	{
+		RemoveEntry(ppSlot);
+	}
+	lock.Unlock();
+
+	HRESULT hr = S_FALSE;
+	if (pEntry)
+	{
+		pEntry->Release();
+		hr = S_OK;
+	}
+	if (pStore && pStore->Remove(szUrl) == S_OK)
+	{
+		hr = S_OK;
+	}
+	return hr;
+}
+
+inline void CResponseCache::Clear()
+{
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	CResponseCacheEntry* pEntry = m_pNewest;
+	m_pNewest = 0;
+	m_pOldest = 0;
+	if (m_ppBuckets)
+	{
+		memset(m_ppBuckets, 0, m_cBuckets * sizeof(m_ppBuckets[0]));
+	}
+	m_stats.cEntries = 0;
+	m_stats.cbStored = 0;
+	lock.Unlock();
+
+	while (pEntry)
+	{
+		CResponseCacheEntry* pOlder = pEntry->m_pOlder;
+		pEntry->Release();
+		pEntry = pOlder;
+	}
+}
+
+inline void CResponseCache::GetStatistics(
+	ResponseCacheStatistics* pStats) const
+{
+	ATLASSERT(pStats != 0);
+	if (!pStats)
+	{
+		return;
+	}
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	*pStats = m_stats;
+}
+
+inline ULONG CResponseCache::GetKeyLength(LPCWSTR szUrl)
+{
+	ATLASSERT(szUrl != 0);
+	// The fragment is never sent to the server
+	LPCWSTR pch = szUrl;
+	while (*pch && *pch != L'#')
+	{
+		++pch;
+	}
+	return static_cast<ULONG>(pch - szUrl);
+}
+
+inline DWORD CResponseCache::HashKey(LPCWSTR szUrl, ULONG cchUrl)
+{
+	// FNV-1a
+	DWORD dwHash = 2166136261u;
+	for (ULONG i = 0; i < cchUrl; ++i)
+	{
+		dwHash = (dwHash ^ static_cast<WORD>(szUrl[i])) * 16777619u;
+	}
+	return dwHash;
+}
+
+inline CResponseCacheEntry** CResponseCache::FindSlot(LPCWSTR szUrl,
+	ULONG cchUrl, DWORD dwHash)
+{
+	// Returns the link pointing at the entry for szUrl, or the null link
+	// ending its bucket if there is none
+	if (!m_cBuckets)
+	{
+		return 0;
+	}
+	CResponseCacheEntry** ppSlot = &m_ppBuckets[dwHash & (m_cBuckets - 1)];
+	while (*ppSlot)
+	{
+		CResponseCacheEntry* pEntry = *ppSlot;
+		if (pEntry->m_dwHash == dwHash && pEntry->m_cchUrl == cchUrl &&
+			!memcmp(pEntry->m_szUrl, szUrl, cchUrl * sizeof(WCHAR)))
+		{
+			break;
+		}
+		ppSlot = &pEntry->m_pNextInBucket;
+	}
+	return ppSlot;
+}
+
+inline void CResponseCache::RemoveEntry(CResponseCacheEntry** ppSlot)
+{
+	ATLASSERT(ppSlot != 0 && *ppSlot != 0);
+	CResponseCacheEntry* pEntry = *ppSlot;
+	*ppSlot = pEntry->m_pNextInBucket;
+	Unlink(pEntry);
+	--m_stats.cEntries;
+	m_stats.cbStored -= pEntry->m_cbSize;
+}
+
+inline void CResponseCache::Unlink(CResponseCacheEntry* pEntry)
+{
+	// Only from the recency list, the caller takes care of the bucket
+	ATLASSERT(pEntry != 0);
+	if (pEntry->m_pNewer)
+	{
+		pEntry->m_pNewer->m_pOlder = pEntry->m_pOlder;
+	}
+	else
+	{
+		ATLASSERT(m_pNewest == pEntry);
+		m_pNewest = pEntry->m_pOlder;
+	}
+	if (pEntry->m_pOlder)
+	{
+		pEntry->m_pOlder->m_pNewer = pEntry->m_pNewer;
+	}
+	else
+	{
+		ATLASSERT(m_pOldest == pEntry);
+		m_pOldest = pEntry->m_pNewer;
+	}
+	pEntry->m_pNewer = 0;
+	pEntry->m_pOlder = 0;
+}
+
+inline void CResponseCache::PushNewest(CResponseCacheEntry* pEntry)
+{
+	ATLASSERT(pEntry != 0);
+	pEntry->m_pNewer = 0;
+	pEntry->m_pOlder = m_pNewest;
+	if (m_pNewest)
+	{
+		m_pNewest->m_pNewer = pEntry;
+	}
+	else
+	{
+		m_pOldest = pEntry;
+	}
+	m_pNewest = pEntry;
+}
+
+inline void CResponseCache::Grow()
+{
+	ULONG cBuckets = m_cBuckets ? m_cBuckets * 2 : 64;
+	CResponseCacheEntry** ppBuckets = 0;
+	ATLTRY(ppBuckets = new CResponseCacheEntry*[cBuckets])
+	if (!ppBuckets)
+	{
+		// Longer chains, but still correct
+		return;
+	}
+	memset(ppBuckets, 0, cBuckets * sizeof(ppBuckets[0]));
+
+	for (CResponseCacheEntry* pEntry = m_pNewest; pEntry;
+		pEntry = pEntry->m_pOlder)
+	{
+		CResponseCacheEntry** ppSlot =
+			&ppBuckets[pEntry->m_dwHash & (cBuckets - 1)];
+		pEntry->m_pNextInBucket = *ppSlot;
+		*ppSlot = pEntry;
+	}
+
+	delete[] m_ppBuckets;
+	m_ppBuckets = ppBuckets;
+	m_cBuckets = cBuckets;
+}
+
+inline void CResponseCache::EvictToCapacity()
+{
+	while (m_stats.cbStored > m_cbCapacity && m_pOldest)
+	{
+		CResponseCacheEntry* pEntry = m_pOldest;
+		CResponseCacheEntry** ppSlot = FindSlot(pEntry->m_szUrl,
+			pEntry->m_cchUrl, pEntry->m_dwHash);
+		ATLASSERT(ppSlot != 0 && *ppSlot == pEntry);
+		RemoveEntry(ppSlot);
+		++m_stats.cEvictions;
+		// Freeing an entry makes no calls out of the cache, so it's safe
+		// under the lock
+		pEntry->Release();
+	}
+}
+
+namespace Detail
+{
+
+// ===== ResponseCapture =====
+
+inline ResponseCapture::ResponseCapture() :
+	m_szUrl(0), m_pbBody(0), m_cbBody(0), m_cbAllocated(0), m_cbMax(0)
+{
+}
+
+inline ResponseCapture::~ResponseCapture()
+{
+	End();
+}
+
+inline bool ResponseCapture::IsActive() const
+{
+	return m_szUrl != 0;
+}
+
+inline HRESULT ResponseCapture::Begin(LPCWSTR szUrl, ULONG cbMax)
+{
+	ATLASSERT(szUrl != 0);
+	if (!szUrl)
+	{
+		return E_POINTER;
+	}
+	End();
+
+	size_t cch = wcslen(szUrl) + 1;
+	ATLTRY(m_szUrl = new WCHAR[cch])
+	if (!m_szUrl)
+	{
+		return E_OUTOFMEMORY;
+	}
+	memcpy(m_szUrl, szUrl, cch * sizeof(WCHAR));
+	m_cbMax = cbMax;
+	return S_OK;
+}
+
+inline void ResponseCapture::Append(const void* pv, ULONG cb)
+{
+	if (!m_szUrl || !cb)
+	{
+		return;
+	}
+	ATLASSERT(pv != 0);
+	if (cb > m_cbMax - m_cbBody)
+	{
+		End();
+		return;
+	}
+
+	if (cb > m_cbAllocated - m_cbBody)
+	{
+		ULONG cbAllocate = m_cbAllocated ? m_cbAllocated : 4096;
+		while (cbAllocate < m_cbBody + cb && cbAllocate < m_cbMax)
+		{
+			cbAllocate = cbAllocate > m_cbMax / 2 ? m_cbMax : cbAllocate * 2;
+		}
+		if (cbAllocate < m_cbBody + cb)
+		{
+			cbAllocate = m_cbBody + cb;
+		}
+
+		BYTE* pbBody = 0;
+		ATLTRY(pbBody = new BYTE[cbAllocate])
+		if (!pbBody)
+		{
+			End();
+			return;
+		}
+		if (m_cbBody)
+		{
+			memcpy(pbBody, m_pbBody, m_cbBody);
+		}
+		delete[] m_pbBody;
+		m_pbBody = pbBody;
+		m_cbAllocated = cbAllocate;
+	}
+
+	memcpy(m_pbBody + m_cbBody, pv, cb);
+	m_cbBody += cb;
+}
+
+inline void ResponseCapture::End()
+{
+	delete[] m_szUrl;
+	m_szUrl = 0;
+	delete[] m_pbBody;
+	m_pbBody = 0;
+	m_cbBody = 0;
+	m_cbAllocated = 0;
+	m_cbMax = 0;
+}
+
+inline LPCWSTR ResponseCapture::GetUrl() const
+{
+	return m_szUrl;
+}
+
+inline const BYTE* ResponseCapture::GetBody() const
+{
+	return m_pbBody;
+}
+
+inline ULONG ResponseCapture::GetBodySize() const
+{
+	return m_cbBody;
+}
+
+inline HRESULT QueryHttpInfoString(IWinInetHttpInfo* pHttpInfo,
+	DWORD dwOption, WCHAR** pszValue)
+{
+	ATLASSERT(pHttpInfo != 0);
+	ATLASSERT(pszValue != 0);
+	*pszValue = 0;
+
+	// Most headers fit, larger ones take a second call. WinInet returns
+	// narrow strings through this interface
+	char buffer[512];
+	char* pszBuffer = buffer;
+	DWORD cbBuffer = sizeof(buffer);
+	HRESULT hr = pHttpInfo->QueryInfo(dwOption, pszBuffer, &cbBuffer, 0, 0);
+	if (FAILED(hr) && cbBuffer > sizeof(buffer))
+	{
+		DWORD cbAllocated = cbBuffer;
+		ATLTRY(pszBuffer = new char[cbAllocated])
+		if (!pszBuffer)
+		{
+			return E_OUTOFMEMORY;
+		}
+		hr = pHttpInfo->QueryInfo(dwOption, pszBuffer, &cbBuffer, 0, 0);
+		if (hr == S_OK && cbBuffer >= cbAllocated)
+		{
+			hr = E_UNEXPECTED;
+		}
+	}
+	else if (hr == S_OK && cbBuffer >= sizeof(buffer))
+	{
+		hr = E_UNEXPECTED;
+	}
+
+	if (hr == S_OK)
+	{
+		WCHAR* szValue = 0;
+		ATLTRY(szValue = new WCHAR[cbBuffer + 1])
+		if (szValue)
+		{
+			for (DWORD i = 0; i < cbBuffer; ++i)
+			{
+				szValue[i] = static_cast<BYTE>(pszBuffer[i]);
+			}
+			szValue[cbBuffer] = 0;
+			*pszValue = szValue;
+		}
+		else
+		{
+			hr = E_OUTOFMEMORY;
+		}
+	}
+	else if (SUCCEEDED(hr))
+	{
+		hr = S_FALSE;
+	}
+
+	if (pszBuffer != buffer)
+	{
+		delete[] pszBuffer;
+	}
+	return hr;
+}
+
+inline HRESULT QueryMimeType(IWinInetHttpInfo* pHttpInfo,
+	WCHAR** pszMimeType)
+{
+	ATLASSERT(pszMimeType != 0);
+	WCHAR* szMimeType = 0;
+	HRESULT hr = QueryHttpInfoString(pHttpInfo, HTTP_QUERY_CONTENT_TYPE,
+		&szMimeType);
+	*pszMimeType = 0;
+	if (hr != S_OK)
+	{
+		return hr;
+	}
+
+	WCHAR* pchEnd = wcschr(szMimeType, L';');
+	if (!pchEnd)
+	{
+		pchEnd = szMimeType + wcslen(szMimeType);
+	}
+	while (pchEnd > szMimeType && iswspace(pchEnd[-1]))
+	{
+		--pchEnd;
+	}
+	*pchEnd = 0;
+	if (!*szMimeType)
+	{
+		delete[] szMimeType;
+		return S_FALSE;
+	}
+	*pszMimeType = szMimeType;
+	return S_OK;
+}
+
+inline ULONGLONG GetResponseCacheTime()
+{
+	FILETIME ft;
+	GetSystemTimeAsFileTime(&ft);
+	return (static_cast<ULONGLONG>(ft.dwHighDateTime) << 32) |
+		ft.dwLowDateTime;
+}
+
+inline bool IsCacheControlSpace(WCHAR ch)
+{
+	return ch == L' ' || ch == L'\t';
+}
+
+// Digits only, saturating. Returns false if there are none or anything
+// else
+inline bool ParseCacheControlSeconds(const WCHAR* pch, ULONG cch,
+	ULONG* pnSeconds)
+{
+	ULONGLONG nSeconds = 0;
+	for (ULONG i = 0; i < cch; ++i)
+	{
+		if (pch[i] < L'0' || pch[i] > L'9')
+		{
+			return false;
+		}
+		nSeconds = nSeconds * 10 + (pch[i] - L'0');
+		if (nSeconds > ULONG_MAX)
+		{
+			nSeconds = ULONG_MAX;
+		}
+	}
+	*pnSeconds = static_cast<ULONG>(nSeconds);
+	return cch != 0;
+}
+
+inline void ParseCacheControl(const WCHAR* pch, ULONG cch,
+	CacheControl* pCacheControl)
+{
+	ATLASSERT(pch != 0 || cch == 0);
+	ATLASSERT(pCacheControl != 0);
+	ULONG i = 0;
+	while (i < cch)
+	{
+		while (i < cch && (pch[i] == L',' || IsCacheControlSpace(pch[i])))
+		{
+			++i;
+		}
+		ULONG ichName = i;
+		while (i < cch && pch[i] != L',' && pch[i] != L'=' &&
+			!IsCacheControlSpace(pch[i]))
+		{
+			++i;
+		}
+		ULONG cchName = i - ichName;
+		while (i < cch && IsCacheControlSpace(pch[i]))
+		{
+			++i;
+		}
+
+		ULONG ichValue = i;
+		ULONG cchValue = 0;
+		if (i < cch && pch[i] == L'=')
+		{
+			++i;
+			while (i < cch && IsCacheControlSpace(pch[i]))
+			{
+				++i;
+			}
+			if (i < cch && pch[i] == L'"')
+			{
+				// May hold commas, e.g. no-cache="Set-Cookie, Set-Cookie2"
+				ichValue = ++i;
+				while (i < cch && pch[i] != L'"')
+				{
+					i += (pch[i] == L'\\' && i + 1 < cch) ? 2 : 1;
+				}
+				cchValue = i - ichValue;
+				if (i < cch)
+				{
+					++i;
+				}
+			}
+			else
+			{
+				ichValue = i;
+				while (i < cch && pch[i] != L',' &&
+					!IsCacheControlSpace(pch[i]))
+				{
+					++i;
+				}
+				cchValue = i - ichValue;
+			}
+		}
+		// Skip whatever else is there up to the next directive
+		while (i < cch && pch[i] != L',')
+		{
+			++i;
+		}
+
+		const WCHAR* pchName = pch + ichName;
+		if (cchName == 8 && EqualHttpHeaderNames(pchName, L"no-store", 8))
+		{
+			pCacheControl->grfDirectives |= cacheControlNoStore;
+		}
+		// Even limited to some headers, e.g. no-cache="Set-Cookie"
+		else if (cchName == 8 &&
+			EqualHttpHeaderNames(pchName, L"no-cache", 8))
+		{
+			pCacheControl->grfDirectives |= cacheControlNoCache;
+		}
+		else if (cchName == 7 && EqualHttpHeaderNames(pchName, L"private", 7))
+		{
+			pCacheControl->grfDirectives |= cacheControlPrivate;
+		}
+		else if (cchName == 7 && EqualHttpHeaderNames(pchName, L"max-age", 7))
+		{
+			ULONG nMaxAge = 0;
+			ParseCacheControlSeconds(pch + ichValue, cchValue, &nMaxAge);
+			if (!(pCacheControl->grfDirectives & cacheControlMaxAge) ||
+				nMaxAge < pCacheControl->nMaxAge)
+			{
+				pCacheControl->nMaxAge = nMaxAge;
+			}
+			pCacheControl->grfDirectives |= cacheControlMaxAge;
+		}
+	}
+}
+
+inline void GetCacheControl(const CHttpHeaderView& headers,
+	CacheControl* pCacheControl)
+{
+	ATLASSERT(pCacheControl != 0);
+	pCacheControl->grfDirectives = 0;
+	pCacheControl->nMaxAge = 0;
+
+	CHttpHeaderName name(HttpHeaderCacheControl);
+	ULONG iField = headers.Find(name);
+	if (iField == headers.GetCount())
+	{
+		// HTTP/1.0 servers send Pragma: no-cache instead
+		name = CHttpHeaderName(HttpHeaderPragma);
+		iField = headers.Find(name);
+	}
+	for (; iField < headers.GetCount();
+		iField = headers.Find(name, iField + 1))
+	{
+		const WCHAR* pchValue = 0;
+		ULONG cchValue = 0;
+		headers.GetField(iField, 0, 0, &pchValue, &cchValue);
+		ParseCacheControl(pchValue, cchValue, pCacheControl);
+	}
+}
+
+inline bool ParseHttpDate(const WCHAR* pch, ULONG cch, ULONGLONG* pullTime)
+{
+	ATLASSERT(pch != 0 || cch == 0);
+	ATLASSERT(pullTime != 0);
+	*pullTime = 0;
+
+	// The three formats differ in order and separators, but each field
+	// can be told by its form: "Sun, 06 Nov 1994 08:49:37 GMT", "Sunday,
+	// 06-Nov-94 08:49:37 GMT" and "Sun Nov  6 08:49:37 1994"
+	static const WCHAR szMonths[] = L"janfebmaraprmayjunjulaugsepoctnovdec";
+	int nDay = -1;
+	int nMonth = -1;
+	int nYear = -1;
+	int nSeconds = -1;
+	ULONG i = 0;
+	while (i < cch)
+	{
+		while (i < cch && (pch[i] == L' ' || pch[i] == L',' ||
+			pch[i] == L'-'))
+		{
+			++i;
+		}
+		ULONG ichToken = i;
+		ULONG cDigits = 0;
+		ULONG cColons = 0;
+		while (i < cch && pch[i] != L' ' && pch[i] != L',' &&
+			pch[i] != L'-')
+		{
+			cDigits += (pch[i] >= L'0' && pch[i] <= L'9');
+			cColons += (pch[i] == L':');
+			++i;
+		}
+		ULONG cchToken = i - ichToken;
+		const WCHAR* pchToken = pch + ichToken;
+		if (!cchToken)
+		{
+			continue;
+		}
+
+		if (cColons == 2 && cDigits == 6 && cchToken == 8 && nSeconds < 0)
+		{
+			int nHour = (pchToken[0] - L'0') * 10 + (pchToken[1] - L'0');
+			int nMinute = (pchToken[3] - L'0') * 10 + (pchToken[4] - L'0');
+			int nSecond = (pchToken[6] - L'0') * 10 + (pchToken[7] - L'0');
+			if (pchToken[2] != L':' || pchToken[5] != L':' || nHour > 23 ||
+				nMinute > 59 || nSecond > 60)
+			{
+				return false;
+			}
+			nSeconds = (nHour * 60 + nMinute) * 60 + nSecond;
+		}
+		else if (cDigits == cchToken && cchToken <= 4 && !cColons)
+		{
+			int nValue = 0;
+			for (ULONG j = 0; j < cchToken; ++j)
+			{
+				nValue = nValue * 10 + (pchToken[j] - L'0');
+			}
+			if (nDay < 0 && cchToken <= 2)
+			{
+				nDay = nValue;
+			}
+			else if (nYear < 0 && (cchToken == 2 || cchToken == 4))
+			{
+				// Two digit years are from RFC 850 dates
+				nYear = cchToken == 4 ? nValue :
+					nValue + (nValue < 70 ? 2000 : 1900);
+			}
+			else
+			{
+				return false;
+			}
+		}
+		else if (cchToken == 3 && !cDigits && nMonth < 0)
+		{
+			// Also sees the day of the week and GMT, which match no month
+			for (int iMonth = 0; iMonth < 12; ++iMonth)
+			{
+				if (EqualHttpHeaderNames(pchToken, szMonths + iMonth * 3, 3))
+				{
+					nMonth = iMonth + 1;
+					break;
+				}
+			}
+		}
+		else if (cDigits)
+		{
+			return false;
+		}
+	}
+	if (nDay < 1 || nMonth < 0 || nYear < 1601 || nSeconds < 0)
+	{
+		return false;
+	}
+	static const int rgnDaysBefore[] =
+		{0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334, 365};
+	bool bLeap = (nYear % 4 == 0 && nYear % 100 != 0) || nYear % 400 == 0;
+	if (nDay > rgnDaysBefore[nMonth] - rgnDaysBefore[nMonth - 1] +
+		(bLeap && nMonth == 2))
+	{
+		return false;
+	}
+
+	// Days since January 1, 1601, which starts a 400 year cycle
+	int nYears = nYear - 1601;
+	ULONGLONG nDays = static_cast<ULONGLONG>(nYears) * 365 + nYears / 4 -
+		nYears / 100 + nYears / 400 + rgnDaysBefore[nMonth - 1] +
+		(bLeap && nMonth > 2) + nDay - 1;
+	*pullTime = (nDays * 86400 + nSeconds) * 10000000ULL;
+	return true;
+}
+
+inline bool IsSharableResponse(const CHttpHeaderView& headers)
+{
+	CacheControl cacheControl;
+	GetCacheControl(headers, &cacheControl);
+	const DWORD grfUnsharable = cacheControlNoStore | cacheControlNoCache |
+		cacheControlPrivate;
+	return !(cacheControl.grfDirectives & grfUnsharable) &&
+		headers.Find(HttpHeaderVary) == headers.GetCount() &&
+		headers.Find(HttpHeaderSetCookie) == headers.GetCount();
+}
+
+inline ULONG GetFreshnessLifetime(const CHttpHeaderView& headers,
+	ULONGLONG ullNow)
+{
+	const ULONGLONG ullSecond = 10000000;
+	const WCHAR* pch = 0;
+	ULONG cch = 0;
+	ULONGLONG ullDate = 0;
+	bool bDate = headers.GetValue(HttpHeaderDate, &pch, &cch) &&
+		ParseHttpDate(pch, cch, &ullDate);
+
+	CacheControl cacheControl;
+	GetCacheControl(headers, &cacheControl);
+	ULONGLONG nLifetime = 0;
+	ULONGLONG ullTime = 0;
+	if (cacheControl.grfDirectives & cacheControlMaxAge)
+	{
+		nLifetime = cacheControl.nMaxAge;
+	}
+	else if (headers.GetValue(HttpHeaderExpires, &pch, &cch))
+	{
+		// An Expires that isn't a date, such as 0, means already expired
+		if (ParseHttpDate(pch, cch, &ullTime))
+		{
+			ULONGLONG ullFrom = bDate ? ullDate : ullNow;
+			nLifetime = ullTime > ullFrom ?
+				(ullTime - ullFrom) / ullSecond : 0;
+		}
+	}
+	else if (headers.GetValue(HttpHeaderLastModified, &pch, &cch) &&
+		ParseHttpDate(pch, cch, &ullTime))
+	{
+		ULONGLONG ullFrom = bDate ? ullDate : ullNow;
+		nLifetime = ullTime < ullFrom ?
+			(ullFrom - ullTime) / ullSecond / 10 : 0;
+		if (nLifetime > 24 * 60 * 60)
+		{
+			nLifetime = 24 * 60 * 60;
+		}
+	}
+
+	// The response may have spent time in other caches, or on the way
+	ULONG nAgeHeader = 0;
+	if (headers.GetValue(CHttpHeaderName(L"Age"), &pch, &cch))
+	{
+		ParseCacheControlSeconds(pch, cch, &nAgeHeader);
+	}
+	ULONGLONG nAge = nAgeHeader;
+	if (bDate && ullNow > ullDate && (ullNow - ullDate) / ullSecond > nAge)
+	{
+		nAge = (ullNow - ullDate) / ullSecond;
+	}
+	nLifetime = nLifetime > nAge ? nLifetime - nAge : 0;
+	return nLifetime < ULONG_MAX ? static_cast<ULONG>(nLifetime) : ULONG_MAX;
+}
+
+} // end namespace PassthroughAPP::Detail
+
+} // end namespace PassthroughAPP
+
+#endif // PASSTHROUGHAPP_RESPONSECACHE_INL
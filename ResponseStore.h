@@ -0,0 +1,319 @@
+#ifndef PASSTHROUGHAPP_RESPONSESTORE_H
+#define PASSTHROUGHAPP_RESPONSESTORE_H
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+#ifndef PASSTHROUGHAPP_RESPONSECACHE_H
+	#error ResponseStore.h requires ResponseCache.h to be included first
+#endif
+
+// A disk-backed store of complete responses, which outlives the process
+// that filled it. Attached to a CResponseCache with SetStore, it answers
+// the lookups that miss in memory, and receives every response stored in
+// the cache.
+//
+// Responses are appended to segment files in a directory. Segments are
+// mapped read-only, and entries found in the store point into the mapping
+// instead of holding a copy, so a response served from the store is read
+// straight from the file cache into the client's buffer. Once a segment
+// reaches its maximum size a new one is started. Replaced and removed
+// records stay behind as dead space; segments that are mostly dead are
+// compacted by copying their live records to the current segment, and
+// deleted once no entry refers to them any more.
+//
+// The index is an open addressing hash table over the URL keys, kept in
+// memory and saved to the directory by Flush and Close, and in the
+// background once enough records were appended since. Open loads it
+// instead of scanning the segments. Records appended after the last save
+// are lost if the process ends without one, which is harmless for a
+// cache. Every record found through the index is checked against its key
+// and the bounds of its segment before it is used, so a damaged file is
+// treated as a miss rather than misread. All methods can be called from
+// any thread.
+//
+// Insert only appends. Compacting segments and saving the index happen in
+// a thread pool work item, which takes the lock for one record at a time,
+// so that neither holds up the thread reading the response, nor the
+// lookups of other requests for long.
+
+#include <vector>
+
+namespace PassthroughAPP
+{
+
+struct ResponseStoreStatistics
+{
+	// Lookups, and how many of them found a record
+	LONG cLookups;
+	LONG cHits;
+	LONG cEntries;
+	LONG cSegments;
+	// Bytes in the segments, and how many of them belong to live records
+	ULONGLONG cbUsed;
+	ULONGLONG cbLive;
+	// Segments compacted and deleted
+	LONG cCompactions;
+};
+
+namespace Detail
+{
+
+enum
+{
+	responseStoreMagic = 0x53525450, // "PTRS"
+	responseStoreIndexMagic = 0x49525450, // "PTRI"
+	responseStoreRecordMagic = 0x52525450, // "PTRR"
+	responseStoreVersion = 2
+};
+
+struct ResponseStoreFileHeader
+{
+	DWORD dwMagic;
+	DWORD dwVersion;
+	DWORD iSegment;
+	DWORD dwReserved;
+};
+
+// Followed by the URL and its terminator, the MIME type and the headers,
+// each including their terminator, and the body, padded to 8 bytes.
+// ullExpires is as returned by CResponseCacheEntry::GetExpires
+struct ResponseStoreRecord
+{
+	DWORD dwMagic;
+	DWORD cbRecord;
+	DWORD dwHash;
+	DWORD cchUrl;
+	DWORD cchMimeType;
+	DWORD cchHeaders;
+	DWORD cbBody;
+	DWORD dwReserved;
+	ULONGLONG ullExpires;
+};
+
+// Followed by cSegments ResponseStoreSegmentInfo and cSlots
+// ResponseStoreSlot
+struct ResponseStoreIndexHeader
+{
+	DWORD dwMagic;
+	DWORD dwVersion;
+	DWORD cSegments;
+	DWORD cSlots;
+	DWORD iNextSegment;
+	DWORD dwReserved;
+};
+
+struct ResponseStoreSegmentInfo
+{
+	DWORD iSegment;
+	DWORD cbUsed;
+};
+
+// iSegment is 0 for an empty slot, segment numbers start at 1
+struct ResponseStoreSlot
+{
+	DWORD dwHash;
+	DWORD iSegment;
+	DWORD dwOffset;
+	DWORD cbRecord;
+};
+
+struct ResponseStoreChunk
+{
+	const void* pv;
+	DWORD cb;
+};
+
+HRESULT WriteResponseStoreChunks(HANDLE hFile,
+	const ResponseStoreChunk* pChunks, int cChunks);
+
+// The name of a segment file, deleted with the last reference to it if
+// the segment was dropped
+class ResponseStoreFile
+{
+public:
+	static HRESULT Create(LPCWSTR szPath, ResponseStoreFile** ppFile);
+
+	void AddRef();
+	void Release();
+
+	LPCWSTR GetPath() const;
+	void DeleteOnRelease();
+
+private:
+	ResponseStoreFile();
+	~ResponseStoreFile();
+
+	LONG m_lRef;
+	LONG volatile m_lDelete;
+	WCHAR* m_szPath;
+};
+
+// A read-only view of a file, as far as it was written when mapped.
+// Entries found in the store hold a reference to the view of their segment
+class ResponseStoreView :
+	public IUnknown
+{
+public:
+	// pFile may be 0
+	static HRESULT Create(HANDLE hFile, ResponseStoreFile* pFile,
+		ResponseStoreView** ppView);
+
+	const BYTE* GetData() const;
+	DWORD GetSize() const;
+
+	// IUnknown
+	STDMETHODIMP QueryInterface(REFIID riid, void** ppvObject);
+	STDMETHODIMP_(ULONG) AddRef();
+	STDMETHODIMP_(ULONG) Release();
+
+private:
+	ResponseStoreView();
+	virtual ~ResponseStoreView();
+
+	LONG m_lRef;
+	const BYTE* m_pbView;
+	DWORD m_cbView;
+	ResponseStoreFile* m_pFile;
+};
+
+struct ResponseStoreSegment
+{
+	DWORD iSegment;
+	DWORD cbUsed;
+	DWORD cbLive;
+	ResponseStoreFile* pFile;
+	// 0 until needed, and may end before records appended since
+	ResponseStoreView* pView;
+};
+
+} // end namespace PassthroughAPP::Detail
+
+class CResponseStore
+{
+public:
+	CResponseStore();
+	~CResponseStore();
+
+	// Opens the store kept in szDirectory, which must exist, loading the
+	// index saved by the last Flush. A missing or damaged index leaves
+	// the store empty
+	HRESULT Open(LPCWSTR szDirectory);
+	// Waits for background work, and saves the index. Entries already
+	// found stay valid
+	void Close();
+	// Saves the index, so that the next Open finds all records appended
+	// so far. The lock is only held while the index is copied
+	HRESULT Flush();
+
+	// A new segment is started once the current one would grow beyond
+	// cbMaxSegment, 16 MB by default. Larger responses aren't stored
+	void SetMaxSegmentSize(DWORD cbMaxSegment);
+	// Segments where live records take up less than dwPercent of the
+	// space are compacted, 50 by default. 0 turns compaction off
+	void SetCompactionThreshold(DWORD dwPercent);
+	// The index is saved in the background once cRecords were appended
+	// since it was last saved, 256 by default. 0 leaves saving it to Flush
+	// and Close
+	void SetFlushThreshold(DWORD cRecords);
+
+	// Returns S_OK and an AddRef'ed entry pointing into the segment, or
+	// S_FALSE if there is none. A record no longer fresh is removed
+	HRESULT Lookup(LPCWSTR szUrl, CResponseCacheEntry** ppEntry);
+	// Replaces any record for the same URL with one that is fresh until
+	// ullExpires, a FILETIME in UTC. Returns S_FALSE if the response is
+	// too large to store
+	HRESULT Insert(LPCWSTR szUrl, LPCWSTR szMimeType, LPCWSTR szHeaders,
+		const BYTE* pbBody, ULONG cbBody, ULONGLONG ullExpires);
+	// Returns S_FALSE if there was no record for szUrl
+	HRESULT Remove(LPCWSTR szUrl);
+	// Compacts the segments below the threshold right away. Happens in
+	// the background whenever a new segment is started
+	HRESULT Compact();
+
+	void GetStatistics(ResponseStoreStatistics* pStats) const;
+
+private:
+	// Not copyable
+	CResponseStore(const CResponseStore&);
+	CResponseStore& operator=(const CResponseStore&);
+
+	HRESULT LoadIndex();
+	HRESULT SaveIndex(
+		const std::vector<Detail::ResponseStoreSegmentInfo>& segments,
+		const std::vector<Detail::ResponseStoreSlot>& slots,
+		DWORD iNextSegment);
+	// Forgets all segments and slots, but not the directory
+	void Release();
+
+	// Allocated with new[]
+	HRESULT GetPath(LPCWSTR szName, WCHAR** pszPath) const;
+	HRESULT GetSegmentPath(DWORD iSegment, WCHAR** pszPath) const;
+	size_t FindSegment(DWORD iSegment) const;
+	HRESULT StartSegment();
+	void SealSegment();
+	void DropSegment(size_t iSegmentPos);
+	HRESULT Append(const Detail::ResponseStoreChunk* pChunks, int cChunks,
+		DWORD cbRecord, Detail::ResponseStoreSlot* pSlot);
+
+	// The record a slot points to, after checking it against the key if
+	// szUrl isn't 0. Returns S_FALSE if the key doesn't match, and fails if
+	// the record is damaged
+	HRESULT GetRecord(const Detail::ResponseStoreSlot& slot, LPCWSTR szUrl,
+		ULONG cchUrl, Detail::ResponseStoreView** ppView,
+		const Detail::ResponseStoreRecord** ppRecord);
+	HRESULT GetView(size_t iSegmentPos, DWORD cbNeeded,
+		Detail::ResponseStoreView** ppView);
+
+	// Drops the slots on the way whose records turn out to be damaged
+	bool FindSlot(LPCWSTR szUrl, ULONG cchUrl, DWORD dwHash, size_t* piSlot);
+	HRESULT InsertSlot(const Detail::ResponseStoreSlot& slot);
+	void RemoveSlot(size_t iSlot);
+	HRESULT GrowSlots();
+	void ReleaseRecord(const Detail::ResponseStoreSlot& slot);
+
+	// Copies the live records of the segment forward, one per lock, and
+	// drops it. Called with m_csMaintenance held, and m_cs not
+	HRESULT CompactSegment(DWORD iSegment);
+
+	// Queues Maintain unless it already is. Called with m_cs held;
+	// returns false if it can't be queued
+	bool ScheduleMaintenance();
+	// Compacts and saves the index as needed
+	void Maintain();
+	static DWORD WINAPI MaintenanceProc(LPVOID pv);
+
+	mutable CComAutoCriticalSection m_cs;
+	// Held by Flush and compaction, which take m_cs only briefly, so that
+	// only one of them runs at a time. Taken before m_cs
+	CComAutoCriticalSection m_csMaintenance;
+	WCHAR* m_szDirectory;
+	// The segment being appended to, if any, is the last one
+	std::vector<Detail::ResponseStoreSegment> m_segments;
+	HANDLE m_hActive;
+	DWORD m_iNextSegment;
+	std::vector<Detail::ResponseStoreSlot> m_slots;
+	DWORD m_cEntries;
+	DWORD m_cbMaxSegment;
+	DWORD m_dwCompactPercent;
+	DWORD m_cFlushThreshold;
+	// Records appended since the index was last copied for saving
+	DWORD m_cUnflushed;
+	bool m_bMaintenanceQueued;
+	// Set by Close, to stop background work early and keep more from
+	// being queued
+	bool m_bClosing;
+	// Work items queued or running, and an event set while there are none
+	LONG m_cMaintenance;
+	HANDLE m_hMaintenanceIdle;
+	LONG m_cLookups;
+	LONG m_cHits;
+	LONG m_cCompactions;
+};
+
+} // end namespace PassthroughAPP
+
+#include "ResponseStore.inl"
+
+#endif // PASSTHROUGHAPP_RESPONSESTORE_H
@@ -0,0 +1,1430 @@
+#ifndef PASSTHROUGHAPP_RESPONSESTORE_INL
+#define PASSTHROUGHAPP_RESPONSESTORE_INL
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+#ifndef PASSTHROUGHAPP_RESPONSESTORE_H
+	#error ResponseStore.inl requires ResponseStore.h to be included first
+#endif
+
+namespace PassthroughAPP
+{
+
+namespace Detail
+{
+
+inline HRESULT WriteResponseStoreChunks(HANDLE hFile,
+	const ResponseStoreChunk* pChunks, int cChunks)
+{
+	ATLASSERT(hFile != INVALID_HANDLE_VALUE);
+	ATLASSERT(pChunks != 0 || cChunks == 0);
+	for (int i = 0; i < cChunks; ++i)
+	{
+		if (!pChunks[i].cb)
+		{
+			continue;
+		}
+		DWORD cbWritten = 0;
+		if (!WriteFile(hFile, pChunks[i].pv, pChunks[i].cb, &cbWritten, 0))
+		{
+			return HRESULT_FROM_WIN32(GetLastError());
+		}
+		if (cbWritten != pChunks[i].cb)
+		{
+			return E_FAIL;
+		}
+	}
+	return S_OK;
+}
+
+// ===== ResponseStoreFile =====
+
+inline ResponseStoreFile::ResponseStoreFile() :
+	m_lRef(1), m_lDelete(0), m_szPath(0)
+{
+}
+
+inline ResponseStoreFile::~ResponseStoreFile()
+{
+	delete[] m_szPath;
+}
+
+inline HRESULT ResponseStoreFile::Create(LPCWSTR szPath,
+	ResponseStoreFile** ppFile)
+{
+	ATLASSERT(szPath != 0);
+	ATLASSERT(ppFile != 0);
+	*ppFile = 0;
+
+	ResponseStoreFile* pFile = 0;
+	ATLTRY(pFile = new ResponseStoreFile)
+	if (!pFile)
+	{
+		return E_OUTOFMEMORY;
+	}
+	size_t cch = wcslen(szPath) + 1;
+	ATLTRY(pFile->m_szPath = new WCHAR[cch])
+	if (!pFile->m_szPath)
+	{
+		delete pFile;
+		return E_OUTOFMEMORY;
+	}
+	memcpy(pFile->m_szPath, szPath, cch * sizeof(WCHAR));
+
+	*ppFile = pFile;
+	return S_OK;
+}
+
+inline void ResponseStoreFile::AddRef()
+{
+	InterlockedIncrement(&m_lRef);
+}
+
+inline void ResponseStoreFile::Release()
+{
+	if (!InterlockedDecrement(&m_lRef))
+	{
+		if (m_lDelete)
+		{
+			// Nothing maps the file any more
+			DeleteFileW(m_szPath);
+		}
+		delete this;
+	}
+}
+
+inline LPCWSTR ResponseStoreFile::GetPath() const
+{
+	return m_szPath;
+}
+
+inline void ResponseStoreFile::DeleteOnRelease()
+{
+	InterlockedExchange(&m_lDelete, 1);
+}
+
+// ===== ResponseStoreView =====
+
+inline ResponseStoreView::ResponseStoreView() :
+	m_lRef(1), m_pbView(0), m_cbView(0), m_pFile(0)
+{
+}
+
+inline ResponseStoreView::~ResponseStoreView()
+{
+	if (m_pbView)
+	{
+		UnmapViewOfFile(m_pbView);
+	}
+	if (m_pFile)
+	{
+		m_pFile->Release();
+	}
+}
+
+inline HRESULT ResponseStoreView::Create(HANDLE hFile,
+	ResponseStoreFile* pFile, ResponseStoreView** ppView)
+{
+	ATLASSERT(hFile != INVALID_HANDLE_VALUE);
+	ATLASSERT(ppView != 0);
+	*ppView = 0;
+
+	LARGE_INTEGER cbFile;
+	if (!GetFileSizeEx(hFile, &cbFile))
+	{
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	// Empty files can't be mapped, and offsets are 32-bit
+	if (cbFile.QuadPart <= 0 || cbFile.HighPart)
+	{
+		return E_INVALIDARG;
+	}
+
+	ResponseStoreView* pView = 0;
+	ATLTRY(pView = new ResponseStoreView)
+	if (!pView)
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	HRESULT hr = S_OK;
+	HANDLE hMapping = CreateFileMappingW(hFile, 0, PAGE_READONLY, 0, 0, 0);
+	if (!hMapping)
+	{
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	else
+	{
+		pView->m_pbView = static_cast<const BYTE*>(
+			MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0));
+		if (!pView->m_pbView)
+		{
+			hr = HRESULT_FROM_WIN32(GetLastError());
+		}
+		// The view keeps the mapping alive
+		CloseHandle(hMapping);
+	}
+	if (FAILED(hr))
+	{
+		delete pView;
+		return hr;
+	}
+
+	pView->m_cbView = static_cast<DWORD>(cbFile.QuadPart);
+	pView->m_pFile = pFile;
+	if (pFile)
+	{
+		pFile->AddRef();
+	}
+	*ppView = pView;
+	return S_OK;
+}
+
+inline const BYTE* ResponseStoreView::GetData() const
+{
+	return m_pbView;
+}
+
+inline DWORD ResponseStoreView::GetSize() const
+{
+	return m_cbView;
+}
+
+inline STDMETHODIMP ResponseStoreView::QueryInterface(REFIID riid,
+	void** ppvObject)
+{
+	ATLASSERT(ppvObject != 0);
+	if (!ppvObject)
+	{
+		return E_POINTER;
+	}
+	if (!InlineIsEqualGUID(riid, IID_IUnknown))
+	{
+		*ppvObject = 0;
+		return E_NOINTERFACE;
+	}
+	AddRef();
+	*ppvObject = static_cast<IUnknown*>(this);
+	return S_OK;
+}
+
+inline STDMETHODIMP_(ULONG) ResponseStoreView::AddRef()
+{
+	return InterlockedIncrement(&m_lRef);
+}
+
+inline STDMETHODIMP_(ULONG) ResponseStoreView::Release()
+{
+	LONG lRef = InterlockedDecrement(&m_lRef);
+	if (!lRef)
+	{
+		delete this;
+	}
+	return lRef;
+}
+
+} // end namespace PassthroughAPP::Detail
+
+// ===== CResponseStore =====
+
+inline CResponseStore::CResponseStore() :
+	m_szDirectory(0), m_hActive(INVALID_HANDLE_VALUE), m_iNextSegment(1),
+	m_cEntries(0), m_cbMaxSegment(16 * 1024 * 1024), m_dwCompactPercent(50),
+	m_cFlushThreshold(256), m_cUnflushed(0), m_bMaintenanceQueued(false),
+	m_bClosing(false), m_cMaintenance(0), m_cLookups(0), m_cHits(0),
+	m_cCompactions(0)
+{
+	// Without it, maintenance runs on the thread that inserts
+	m_hMaintenanceIdle = CreateEventW(0, TRUE, TRUE, 0);
+}
+
+inline CResponseStore::~CResponseStore()
+{
+	Close();
+	if (m_hMaintenanceIdle)
+	{
+		CloseHandle(m_hMaintenanceIdle);
+	}
+}
+
+inline HRESULT CResponseStore::Open(LPCWSTR szDirectory)
+{
+	ATLASSERT(szDirectory != 0);
+	if (!szDirectory)
+	{
+		return E_POINTER;
+	}
+
+	Close();
+	CComCritSecLock<CComAutoCriticalSection> lockMaintenance(
+		m_csMaintenance);
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+
+	size_t cch = wcslen(szDirectory) + 1;
+	ATLTRY(m_szDirectory = new WCHAR[cch])
+	if (!m_szDirectory)
+	{
+		return E_OUTOFMEMORY;
+	}
+	memcpy(m_szDirectory, szDirectory, cch * sizeof(WCHAR));
+
+	if (FAILED(LoadIndex()))
+	{
+		// Start over. New segments overwrite the old files
+		Release();
+		m_iNextSegment = 1;
+	}
+	return S_OK;
+}
+
+inline void CResponseStore::Close()
+{
+	{
+		CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+		if (!m_szDirectory)
+		{
+			return;
+		}
+		m_bClosing = true;
+	}
+	if (m_hMaintenanceIdle)
+	{
+		WaitForSingleObject(m_hMaintenanceIdle, INFINITE);
+	}
+
+	CComCritSecLock<CComAutoCriticalSection> lockMaintenance(
+		m_csMaintenance);
+	Flush();
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	Release();
+	delete[] m_szDirectory;
+	m_szDirectory = 0;
+	m_iNextSegment = 1;
+	m_cUnflushed = 0;
+	m_bClosing = false;
+}
+
+inline HRESULT CResponseStore::Flush()
+{
+	// A later copy of the index mustn't be overwritten by an earlier one
+	CComCritSecLock<CComAutoCriticalSection> lockMaintenance(
+		m_csMaintenance);
+	std::vector<Detail::ResponseStoreSegmentInfo> segments;
+	std::vector<Detail::ResponseStoreSlot> slots;
+	DWORD iNextSegment = 0;
+	HANDLE hActive = INVALID_HANDLE_VALUE;
+	{
+		CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+		if (!m_szDirectory)
+		{
+			return E_UNEXPECTED;
+		}
+		ATLTRY(segments.resize(m_segments.size()))
+		ATLTRY(slots.reserve(m_cEntries))
+		if (segments.size() != m_segments.size() ||
+			slots.capacity() < m_cEntries)
+		{
+			return E_OUTOFMEMORY;
+		}
+		for (size_t i = 0; i < m_segments.size(); ++i)
+		{
+			segments[i].iSegment = m_segments[i].iSegment;
+			segments[i].cbUsed = m_segments[i].cbUsed;
+		}
+		for (size_t i = 0; i < m_slots.size(); ++i)
+		{
+			if (m_slots[i].iSegment)
+			{
+				slots.push_back(m_slots[i]);
+			}
+		}
+		iNextSegment = m_iNextSegment;
+		// Sealing the segment closes m_hActive
+		if (m_hActive != INVALID_HANDLE_VALUE &&
+			!DuplicateHandle(GetCurrentProcess(), m_hActive,
+				GetCurrentProcess(), &hActive, 0, FALSE,
+				DUPLICATE_SAME_ACCESS))
+		{
+			return HRESULT_FROM_WIN32(GetLastError());
+		}
+		m_cUnflushed = 0;
+	}
+
+	// The records must be on disk before an index pointing at them
+	if (hActive != INVALID_HANDLE_VALUE)
+	{
+		BOOL bFlushed = FlushFileBuffers(hActive);
+		DWORD dwError = GetLastError();
+		CloseHandle(hActive);
+		if (!bFlushed)
+		{
+			return HRESULT_FROM_WIN32(dwError);
+		}
+	}
+	return SaveIndex(segments, slots, iNextSegment);
+}
+
+inline void CResponseStore::SetMaxSegmentSize(DWORD cbMaxSegment)
+{
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	m_cbMaxSegment = cbMaxSegment;
+}
+
+inline void CResponseStore::SetCompactionThreshold(DWORD dwPercent)
+{
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	m_dwCompactPercent = dwPercent < 100 ? dwPercent : 100;
+}
+
+inline void CResponseStore::SetFlushThreshold(DWORD cRecords)
+{
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	m_cFlushThreshold = cRecords;
+}
+
+inline HRESULT CResponseStore::Lookup(LPCWSTR szUrl,
+	CResponseCacheEntry** ppEntry)
+{
+	ATLASSERT(szUrl != 0);
+	ATLASSERT(ppEntry != 0);
+	if (!szUrl || !ppEntry)
+	{
+		return E_POINTER;
+	}
+	*ppEntry = 0;
+
+	ULONG cchUrl = CResponseCache::GetKeyLength(szUrl);
+	DWORD dwHash = CResponseCache::HashKey(szUrl, cchUrl);
+	ULONGLONG ullNow = Detail::GetResponseCacheTime();
+
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	++m_cLookups;
+	size_t iSlot = 0;
+	if (!FindSlot(szUrl, cchUrl, dwHash, &iSlot))
+	{
+		return S_FALSE;
+	}
+
+	Detail::ResponseStoreView* pView = 0;
+	const Detail::ResponseStoreRecord* pRecord = 0;
+	HRESULT hr = GetRecord(m_slots[iSlot], szUrl, cchUrl, &pView, &pRecord);
+	if (hr != S_OK)
+	{
+		return FAILED(hr) ? hr : E_UNEXPECTED;
+	}
+	if (pRecord->ullExpires <= ullNow)
+	{
+		pView->Release();
+		RemoveSlot(iSlot);
+		return S_FALSE;
+	}
+
+	LPCWSTR szRecordUrl = reinterpret_cast<LPCWSTR>(pRecord + 1);
+	LPCWSTR pch = szRecordUrl + pRecord->cchUrl + 1;
+	LPCWSTR szMimeType = 0;
+	if (pRecord->cchMimeType)
+	{
+		szMimeType = pch;
+		pch += pRecord->cchMimeType;
+	}
+	LPCWSTR szHeaders = 0;
+	if (pRecord->cchHeaders)
+	{
+		szHeaders = pch;
+		pch += pRecord->cchHeaders;
+	}
+	hr = CResponseCacheEntry::CreateMapped(pView, szRecordUrl, cchUrl,
+		dwHash, szMimeType, szHeaders, reinterpret_cast<const BYTE*>(pch),
+		pRecord->cbBody, pRecord->ullExpires, ppEntry);
+	pView->Release();
+	if (SUCCEEDED(hr))
+	{
+		++m_cHits;
+	}
+	return hr;
+}
+
+inline HRESULT CResponseStore::Insert(LPCWSTR szUrl, LPCWSTR szMimeType,
+	LPCWSTR szHeaders, const BYTE* pbBody, ULONG cbBody,
+	ULONGLONG ullExpires)
+{
+	ATLASSERT(szUrl != 0);
+	ATLASSERT(pbBody != 0 || cbBody == 0);
+	if (!szUrl || (!pbBody && cbBody))
+	{
+		return E_POINTER;
+	}
+
+	Detail::ResponseStoreRecord record;
+	memset(&record, 0, sizeof(record));
+	record.dwMagic = Detail::responseStoreRecordMagic;
+	record.ullExpires = ullExpires;
+	ULONG cchUrl = CResponseCache::GetKeyLength(szUrl);
+	record.dwHash = CResponseCache::HashKey(szUrl, cchUrl);
+	record.cchUrl = cchUrl;
+	size_t cchMimeType = szMimeType ? wcslen(szMimeType) + 1 : 0;
+	size_t cchHeaders = szHeaders ? wcslen(szHeaders) + 1 : 0;
+	ULONGLONG cbRecord = sizeof(record) +
+		(static_cast<ULONGLONG>(cchUrl) + 1 + cchMimeType + cchHeaders) *
+		sizeof(WCHAR) + cbBody;
+	cbRecord = (cbRecord + 7) & ~static_cast<ULONGLONG>(7);
+
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	if (!m_szDirectory || m_bClosing)
+	{
+		return E_UNEXPECTED;
+	}
+	if (m_cbMaxSegment < sizeof(Detail::ResponseStoreFileHeader) ||
+		cbRecord > m_cbMaxSegment - sizeof(Detail::ResponseStoreFileHeader))
+	{
+		return S_FALSE;
+	}
+	record.cbRecord = static_cast<DWORD>(cbRecord);
+	record.cchMimeType = static_cast<DWORD>(cchMimeType);
+	record.cchHeaders = static_cast<DWORD>(cchHeaders);
+	record.cbBody = cbBody;
+
+	static const BYTE padding[8] = {0};
+	static const WCHAR chNull = 0;
+	Detail::ResponseStoreChunk chunks[] =
+	{
+		{&record, sizeof(record)},
+		{szUrl, static_cast<DWORD>(cchUrl * sizeof(WCHAR))},
+		{&chNull, sizeof(chNull)},
+		{szMimeType, static_cast<DWORD>(cchMimeType * sizeof(WCHAR))},
+		{szHeaders, static_cast<DWORD>(cchHeaders * sizeof(WCHAR))},
+		{pbBody, cbBody},
+		{padding, 0}
+	};
+	const int cChunks = sizeof(chunks) / sizeof(chunks[0]);
+	DWORD cbUnpadded = 0;
+	for (int i = 0; i < cChunks - 1; ++i)
+	{
+		cbUnpadded += chunks[i].cb;
+	}
+	chunks[cChunks - 1].cb = record.cbRecord - cbUnpadded;
+
+	DWORD iActive = m_hActive != INVALID_HANDLE_VALUE ?
+		m_segments.back().iSegment : 0;
+	Detail::ResponseStoreSlot slot;
+	HRESULT hr = Append(chunks, cChunks, record.cbRecord, &slot);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+	slot.dwHash = record.dwHash;
+
+	size_t iSlot = 0;
+	if (FindSlot(szUrl, cchUrl, record.dwHash, &iSlot))
+	{
+		ReleaseRecord(m_slots[iSlot]);
+		m_slots[iSlot] = slot;
+	}
+	else
+	{
+		hr = InsertSlot(slot);
+		if (FAILED(hr))
+		{
+			ReleaseRecord(slot);
+			return hr;
+		}
+	}
+
+	++m_cUnflushed;
+
+	// A segment was sealed to make room, and may be worth compacting
+	bool bSealed = slot.iSegment != iActive && iActive;
+	bool bFlush = m_cFlushThreshold && m_cUnflushed >= m_cFlushThreshold;
+	if ((bSealed || bFlush) && !m_bMaintenanceQueued &&
+		!ScheduleMaintenance())
+	{
+		lock.Unlock();
+		Maintain();
+	}
+	return S_OK;
+}
+
+inline HRESULT CResponseStore::Remove(LPCWSTR szUrl)
+{
+	ATLASSERT(szUrl != 0);
+	if (!szUrl)
+	{
+		return E_POINTER;
+	}
+
+	ULONG cchUrl = CResponseCache::GetKeyLength(szUrl);
+	DWORD dwHash = CResponseCache::HashKey(szUrl, cchUrl);
+
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	size_t iSlot = 0;
+	if (!FindSlot(szUrl, cchUrl, dwHash, &iSlot))
+	{
+		return S_FALSE;
+	}
+	RemoveSlot(iSlot);
+	return S_OK;
+}
+
+inline HRESULT CResponseStore::Compact()
+{
+	CComCritSecLock<CComAutoCriticalSection> lockMaintenance(
+		m_csMaintenance);
+	HRESULT hr = S_OK;
+	bool bCompacted = false;
+	// Segments are numbered in the order they were started, and the ones
+	// compaction starts come after the one it works on
+	DWORD iLastSegment = 0;
+	for (;;)
+	{
+		DWORD iSegment = 0;
+		{
+			CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+			if (!m_szDirectory)
+			{
+				return E_UNEXPECTED;
+			}
+			for (size_t i = 0; i < m_segments.size() && !iSegment; ++i)
+			{
+				const Detail::ResponseStoreSegment& segment = m_segments[i];
+				bool bActive = m_hActive != INVALID_HANDLE_VALUE &&
+					i == m_segments.size() - 1;
+				if (segment.iSegment > iLastSegment && !bActive &&
+					static_cast<ULONGLONG>(segment.cbLive) * 100 <
+						static_cast<ULONGLONG>(segment.cbUsed) *
+							m_dwCompactPercent)
+				{
+					iSegment = segment.iSegment;
+				}
+			}
+		}
+		if (!iSegment)
+		{
+			break;
+		}
+		iLastSegment = iSegment;
+
+		HRESULT hrSegment = CompactSegment(iSegment);
+		if (hrSegment == E_ABORT)
+		{
+			// Closing
+			return hrSegment;
+		}
+		if (FAILED(hrSegment))
+		{
+			if (SUCCEEDED(hr))
+			{
+				hr = hrSegment;
+			}
+			continue;
+		}
+		bCompacted = true;
+	}
+
+	if (bCompacted)
+	{
+		// Don't leave an index behind that points at deleted segments
+		Flush();
+	}
+	return hr;
+}
+
+inline void CResponseStore::GetStatistics(
+	ResponseStoreStatistics* pStats) const
+{
+	ATLASSERT(pStats != 0);
+	if (!pStats)
+	{
+		return;
+	}
+	CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+	memset(pStats, 0, sizeof(*pStats));
+	pStats->cLookups = m_cLookups;
+	pStats->cHits = m_cHits;
+	pStats->cEntries = static_cast<LONG>(m_cEntries);
+	pStats->cSegments = static_cast<LONG>(m_segments.size());
+	for (size_t i = 0; i < m_segments.size(); ++i)
+	{
+		pStats->cbUsed += m_segments[i].cbUsed;
+		pStats->cbLive += m_segments[i].cbLive;
+	}
+	pStats->cCompactions = m_cCompactions;
+}
+
+inline HRESULT CResponseStore::LoadIndex()
+{
+	WCHAR* szPath = 0;
+	HRESULT hr = GetPath(L"index.dat", &szPath);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+	HANDLE hFile = CreateFileW(szPath, GENERIC_READ, FILE_SHARE_READ, 0,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	delete[] szPath;
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	Detail::ResponseStoreView* pView = 0;
+	hr = Detail::ResponseStoreView::Create(hFile, 0, &pView);
+	CloseHandle(hFile);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+
+	const Detail::ResponseStoreIndexHeader* pHeader =
+		reinterpret_cast<const Detail::ResponseStoreIndexHeader*>(
+			pView->GetData());
+	if (pView->GetSize() < sizeof(*pHeader) ||
+		pHeader->dwMagic != Detail::responseStoreIndexMagic ||
+		pHeader->dwVersion != Detail::responseStoreVersion ||
+		sizeof(*pHeader) +
+			static_cast<ULONGLONG>(pHeader->cSegments) *
+				sizeof(Detail::ResponseStoreSegmentInfo) +
+			static_cast<ULONGLONG>(pHeader->cSlots) *
+				sizeof(Detail::ResponseStoreSlot) > pView->GetSize())
+	{
+		pView->Release();
+		return E_INVALIDARG;
+	}
+	const Detail::ResponseStoreSegmentInfo* pInfos =
+		reinterpret_cast<const Detail::ResponseStoreSegmentInfo*>(pHeader + 1);
+	const Detail::ResponseStoreSlot* pSlots =
+		reinterpret_cast<const Detail::ResponseStoreSlot*>(
+			pInfos + pHeader->cSegments);
+
+	for (DWORD i = 0; i < pHeader->cSegments && SUCCEEDED(hr); ++i)
+	{
+		// Ascending, for FindSegment
+		Detail::ResponseStoreSegment segment = {pInfos[i].iSegment,
+			pInfos[i].cbUsed, 0, 0, 0};
+		if (!segment.iSegment || segment.iSegment >= pHeader->iNextSegment ||
+			(i && segment.iSegment <= pInfos[i - 1].iSegment) ||
+			segment.cbUsed < sizeof(Detail::ResponseStoreFileHeader))
+		{
+			hr = E_INVALIDARG;
+			break;
+		}
+		hr = GetSegmentPath(segment.iSegment, &szPath);
+		if (SUCCEEDED(hr))
+		{
+			hr = Detail::ResponseStoreFile::Create(szPath, &segment.pFile);
+			delete[] szPath;
+		}
+		if (SUCCEEDED(hr))
+		{
+			size_t cSegments = m_segments.size();
+			ATLTRY(m_segments.push_back(segment))
+			if (m_segments.size() == cSegments)
+			{
+				segment.pFile->Release();
+				hr = E_OUTOFMEMORY;
+			}
+		}
+	}
+
+	for (DWORD i = 0; i < pHeader->cSlots && SUCCEEDED(hr); ++i)
+	{
+		const Detail::ResponseStoreSlot& slot = pSlots[i];
+		size_t iSegmentPos = FindSegment(slot.iSegment);
+		if (iSegmentPos == static_cast<size_t>(-1) ||
+			slot.dwOffset < sizeof(Detail::ResponseStoreFileHeader) ||
+			slot.cbRecord < sizeof(Detail::ResponseStoreRecord) ||
+			static_cast<ULONGLONG>(slot.dwOffset) + slot.cbRecord >
+				m_segments[iSegmentPos].cbUsed)
+		{
+			hr = E_INVALIDARG;
+			break;
+		}
+		hr = InsertSlot(slot);
+		if (SUCCEEDED(hr))
+		{
+			m_segments[iSegmentPos].cbLive += slot.cbRecord;
+		}
+	}
+
+	if (SUCCEEDED(hr))
+	{
+		m_iNextSegment = pHeader->iNextSegment;
+	}
+	pView->Release();
+	return hr;
+}
+
+inline HRESULT CResponseStore::SaveIndex(
+	const std::vector<Detail::ResponseStoreSegmentInfo>& segments,
+	const std::vector<Detail::ResponseStoreSlot>& slots, DWORD iNextSegment)
+{
+	ATLASSERT(m_szDirectory != 0);
+
+	WCHAR* szTempPath = 0;
+	WCHAR* szPath = 0;
+	HRESULT hr = GetPath(L"index.tmp", &szTempPath);
+	if (SUCCEEDED(hr))
+	{
+		hr = GetPath(L"index.dat", &szPath);
+	}
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	if (SUCCEEDED(hr))
+	{
+		hFile = CreateFileW(szTempPath, GENERIC_WRITE, 0, 0, CREATE_ALWAYS,
+			FILE_ATTRIBUTE_NORMAL, 0);
+		if (hFile == INVALID_HANDLE_VALUE)
+		{
+			hr = HRESULT_FROM_WIN32(GetLastError());
+		}
+	}
+
+	if (SUCCEEDED(hr))
+	{
+		Detail::ResponseStoreIndexHeader header;
+		memset(&header, 0, sizeof(header));
+		header.dwMagic = Detail::responseStoreIndexMagic;
+		header.dwVersion = Detail::responseStoreVersion;
+		header.cSegments = static_cast<DWORD>(segments.size());
+		header.cSlots = static_cast<DWORD>(slots.size());
+		header.iNextSegment = iNextSegment;
+		Detail::ResponseStoreChunk chunks[] =
+		{
+			{&header, sizeof(header)},
+			{segments.empty() ? 0 : &segments[0],
+				static_cast<DWORD>(segments.size() * sizeof(segments[0]))},
+			{slots.empty() ? 0 : &slots[0],
+				static_cast<DWORD>(slots.size() * sizeof(slots[0]))}
+		};
+		hr = Detail::WriteResponseStoreChunks(hFile, chunks,
+			sizeof(chunks) / sizeof(chunks[0]));
+	}
+
+	if (SUCCEEDED(hr) && !FlushFileBuffers(hFile))
+	{
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	if (hFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(hFile);
+	}
+	// Replace the old index only once the new one is complete
+	if (SUCCEEDED(hr) &&
+		!MoveFileExW(szTempPath, szPath, MOVEFILE_REPLACE_EXISTING))
+	{
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	delete[] szTempPath;
+	delete[] szPath;
+	return hr;
+}
+
+inline void CResponseStore::Release()
+{
+	if (m_hActive != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_hActive);
+		m_hActive = INVALID_HANDLE_VALUE;
+	}
+	for (size_t i = 0; i < m_segments.size(); ++i)
+	{
+		if (m_segments[i].pView)
+		{
+			m_segments[i].pView->Release();
+		}
+		m_segments[i].pFile->Release();
+	}
+	m_segments.clear();
+	m_slots.clear();
+	m_cEntries = 0;
+}
+
+inline HRESULT CResponseStore::GetPath(LPCWSTR szName, WCHAR** pszPath) const
+{
+	ATLASSERT(m_szDirectory != 0);
+	ATLASSERT(szName != 0);
+	ATLASSERT(pszPath != 0);
+	*pszPath = 0;
+
+	size_t cchDirectory = wcslen(m_szDirectory);
+	bool bSeparator = cchDirectory &&
+		m_szDirectory[cchDirectory - 1] != L'\\' &&
+		m_szDirectory[cchDirectory - 1] != L'/';
+	size_t cchName = wcslen(szName) + 1;
+	WCHAR* szPath = 0;
+	ATLTRY(szPath = new WCHAR[cchDirectory + bSeparator + cchName])
+	if (!szPath)
+	{
+		return E_OUTOFMEMORY;
+	}
+	memcpy(szPath, m_szDirectory, cchDirectory * sizeof(WCHAR));
+	if (bSeparator)
+	{
+		szPath[cchDirectory] = L'\\';
+	}
+	memcpy(szPath + cchDirectory + bSeparator, szName,
+		cchName * sizeof(WCHAR));
+	*pszPath = szPath;
+	return S_OK;
+}
+
+inline HRESULT CResponseStore::GetSegmentPath(DWORD iSegment,
+	WCHAR** pszPath) const
+{
+	// seg0000002a.dat
+	WCHAR szName[] = L"seg00000000.dat";
+	for (int i = 10; i >= 3; --i, iSegment >>= 4)
+	{
+		szName[i] = L"0123456789abcdef"[iSegment & 0xf];
+	}
+	return GetPath(szName, pszPath);
+}
+
+inline size_t CResponseStore::FindSegment(DWORD iSegment) const
+{
+	// Segments are kept in the order they were started
+	size_t iLow = 0;
+	size_t iHigh = m_segments.size();
+	while (iLow < iHigh)
+	{
+		size_t iMiddle = iLow + (iHigh - iLow) / 2;
+		if (m_segments[iMiddle].iSegment < iSegment)
+		{
+			iLow = iMiddle + 1;
+		}
+		else
+		{
+			iHigh = iMiddle;
+		}
+	}
+	if (iLow < m_segments.size() && m_segments[iLow].iSegment == iSegment)
+	{
+		return iLow;
+	}
+	return static_cast<size_t>(-1);
+}
+
+inline HRESULT CResponseStore::StartSegment()
+{
+	ATLASSERT(m_hActive == INVALID_HANDLE_VALUE);
+
+	Detail::ResponseStoreSegment segment = {m_iNextSegment,
+		sizeof(Detail::ResponseStoreFileHeader), 0, 0, 0};
+	WCHAR* szPath = 0;
+	HRESULT hr = GetSegmentPath(segment.iSegment, &szPath);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+	hr = Detail::ResponseStoreFile::Create(szPath, &segment.pFile);
+	if (FAILED(hr))
+	{
+		delete[] szPath;
+		return hr;
+	}
+	HANDLE hFile = CreateFileW(szPath, GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+	delete[] szPath;
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	if (SUCCEEDED(hr))
+	{
+		Detail::ResponseStoreFileHeader header;
+		memset(&header, 0, sizeof(header));
+		header.dwMagic = Detail::responseStoreMagic;
+		header.dwVersion = Detail::responseStoreVersion;
+		header.iSegment = segment.iSegment;
+		Detail::ResponseStoreChunk chunk = {&header, sizeof(header)};
+		hr = Detail::WriteResponseStoreChunks(hFile, &chunk, 1);
+	}
+	if (SUCCEEDED(hr))
+	{
+		size_t cSegments = m_segments.size();
+		ATLTRY(m_segments.push_back(segment))
+		if (m_segments.size() == cSegments)
+		{
+			hr = E_OUTOFMEMORY;
+		}
+	}
+
+	if (FAILED(hr))
+	{
+		if (hFile != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(hFile);
+		}
+		segment.pFile->DeleteOnRelease();
+		segment.pFile->Release();
+		return hr;
+	}
+	m_hActive = hFile;
+	++m_iNextSegment;
+	return S_OK;
+}
+
+inline void CResponseStore::SealSegment()
+{
+	// Views already mapped stay valid, later ones are opened read-only
+	if (m_hActive != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_hActive);
+		m_hActive = INVALID_HANDLE_VALUE;
+	}
+}
+
+inline void CResponseStore::DropSegment(size_t iSegmentPos)
+{
+	ATLASSERT(iSegmentPos < m_segments.size());
+	Detail::ResponseStoreSegment& segment = m_segments[iSegmentPos];
+	ATLASSERT(m_hActive == INVALID_HANDLE_VALUE ||
+		iSegmentPos != m_segments.size() - 1);
+	// Entries still reading the segment keep the file until they're done
+	segment.pFile->DeleteOnRelease();
+	if (segment.pView)
+	{
+		segment.pView->Release();
+	}
+	segment.pFile->Release();
+	m_segments.erase(m_segments.begin() + iSegmentPos);
+}
+
+inline HRESULT CResponseStore::Append(
+	const Detail::ResponseStoreChunk* pChunks, int cChunks, DWORD cbRecord,
+	Detail::ResponseStoreSlot* pSlot)
+{
+	ATLASSERT(pSlot != 0);
+	ATLASSERT(cbRecord <=
+		m_cbMaxSegment - sizeof(Detail::ResponseStoreFileHeader));
+
+	if (m_hActive != INVALID_HANDLE_VALUE &&
+		cbRecord > m_cbMaxSegment - m_segments.back().cbUsed)
+	{
+		SealSegment();
+	}
+	if (m_hActive == INVALID_HANDLE_VALUE)
+	{
+		HRESULT hr = StartSegment();
+		if (FAILED(hr))
+		{
+			return hr;
+		}
+	}
+
+	Detail::ResponseStoreSegment& segment = m_segments.back();
+	HRESULT hr = Detail::WriteResponseStoreChunks(m_hActive, pChunks,
+		cChunks);
+	if (FAILED(hr))
+	{
+		// Where the file ends is anyone's guess now, so continue in a new
+		// segment. Nothing refers to the partial record
+		SealSegment();
+		return hr;
+	}
+
+	pSlot->dwHash = 0;
+	pSlot->iSegment = segment.iSegment;
+	pSlot->dwOffset = segment.cbUsed;
+	pSlot->cbRecord = cbRecord;
+	segment.cbUsed += cbRecord;
+	segment.cbLive += cbRecord;
+	return S_OK;
+}
+
+inline HRESULT CResponseStore::GetRecord(
+	const Detail::ResponseStoreSlot& slot, LPCWSTR szUrl, ULONG cchUrl,
+	Detail::ResponseStoreView** ppView,
+	const Detail::ResponseStoreRecord** ppRecord)
+{
+	ATLASSERT(ppView != 0);
+	*ppView = 0;
+	if (ppRecord)
+	{
+		*ppRecord = 0;
+	}
+
+	size_t iSegmentPos = FindSegment(slot.iSegment);
+	if (iSegmentPos == static_cast<size_t>(-1) || (slot.dwOffset & 7) ||
+		slot.cbRecord < sizeof(Detail::ResponseStoreRecord) ||
+		slot.dwOffset < sizeof(Detail::ResponseStoreFileHeader) ||
+		slot.dwOffset > m_segments[iSegmentPos].cbUsed ||
+		slot.cbRecord > m_segments[iSegmentPos].cbUsed - slot.dwOffset)
+	{
+		return E_INVALIDARG;
+	}
+	Detail::ResponseStoreView* pView = 0;
+	HRESULT hr = GetView(iSegmentPos, slot.dwOffset + slot.cbRecord, &pView);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+
+	// Everything the record says about itself has to fit in the slot
+	const Detail::ResponseStoreRecord* pRecord =
+		reinterpret_cast<const Detail::ResponseStoreRecord*>(
+			pView->GetData() + slot.dwOffset);
+	LPCWSTR szRecordUrl = reinterpret_cast<LPCWSTR>(pRecord + 1);
+	ULONGLONG cchStrings = static_cast<ULONGLONG>(pRecord->cchUrl) + 1 +
+		pRecord->cchMimeType + pRecord->cchHeaders;
+	if (pRecord->dwMagic != Detail::responseStoreRecordMagic ||
+		pRecord->cbRecord != slot.cbRecord ||
+		pRecord->dwHash != slot.dwHash ||
+		sizeof(*pRecord) + cchStrings * sizeof(WCHAR) + pRecord->cbBody >
+			slot.cbRecord ||
+		szRecordUrl[pRecord->cchUrl] ||
+		(pRecord->cchMimeType &&
+			szRecordUrl[pRecord->cchUrl + pRecord->cchMimeType]) ||
+		(pRecord->cchHeaders && szRecordUrl[cchStrings - 1]))
+	{
+		pView->Release();
+		return E_INVALIDARG;
+	}
+
+	if (szUrl && (pRecord->cchUrl != cchUrl ||
+		memcmp(szRecordUrl, szUrl, cchUrl * sizeof(WCHAR))))
+	{
+		pView->Release();
+		return S_FALSE;
+	}
+
+	*ppView = pView;
+	if (ppRecord)
+	{
+		*ppRecord = pRecord;
+	}
+	return S_OK;
+}
+
+inline HRESULT CResponseStore::GetView(size_t iSegmentPos, DWORD cbNeeded,
+	Detail::ResponseStoreView** ppView)
+{
+	ATLASSERT(iSegmentPos < m_segments.size());
+	ATLASSERT(ppView != 0);
+	*ppView = 0;
+
+	Detail::ResponseStoreSegment& segment = m_segments[iSegmentPos];
+	if (cbNeeded > segment.cbUsed)
+	{
+		return E_INVALIDARG;
+	}
+	if (!segment.pView || segment.pView->GetSize() < cbNeeded)
+	{
+		// Map the segment again, as far as it's written by now
+		bool bActive = m_hActive != INVALID_HANDLE_VALUE &&
+			iSegmentPos == m_segments.size() - 1;
+		HANDLE hFile = m_hActive;
+		if (!bActive)
+		{
+			hFile = CreateFileW(segment.pFile->GetPath(), GENERIC_READ,
+				FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+			if (hFile == INVALID_HANDLE_VALUE)
+			{
+				return HRESULT_FROM_WIN32(GetLastError());
+			}
+		}
+		Detail::ResponseStoreView* pView = 0;
+		HRESULT hr = Detail::ResponseStoreView::Create(hFile, segment.pFile,
+			&pView);
+		if (!bActive)
+		{
+			CloseHandle(hFile);
+		}
+		if (FAILED(hr))
+		{
+			return hr;
+		}
+
+		const Detail::ResponseStoreFileHeader* pHeader =
+			reinterpret_cast<const Detail::ResponseStoreFileHeader*>(
+				pView->GetData());
+		if (pView->GetSize() < segment.cbUsed ||
+			pHeader->dwMagic != Detail::responseStoreMagic ||
+			pHeader->dwVersion != Detail::responseStoreVersion ||
+			pHeader->iSegment != segment.iSegment)
+		{
+			pView->Release();
+			return E_INVALIDARG;
+		}
+
+		// Entries found before keep the old view
+		if (segment.pView)
+		{
+			segment.pView->Release();
+		}
+		segment.pView = pView;
+	}
+
+	segment.pView->AddRef();
+	*ppView = segment.pView;
+	return S_OK;
+}
+
+inline bool CResponseStore::FindSlot(LPCWSTR szUrl, ULONG cchUrl,
+	DWORD dwHash, size_t* piSlot)
+{
+	ATLASSERT(piSlot != 0);
+	if (m_slots.empty())
+	{
+		return false;
+	}
+	size_t nMask = m_slots.size() - 1;
+	size_t iSlot = dwHash & nMask;
+	while (m_slots[iSlot].iSegment)
+	{
+		if (m_slots[iSlot].dwHash == dwHash)
+		{
+			Detail::ResponseStoreView* pView = 0;
+			HRESULT hr = GetRecord(m_slots[iSlot], szUrl, cchUrl, &pView, 0);
+			if (hr == S_OK)
+			{
+				pView->Release();
+				*piSlot = iSlot;
+				return true;
+			}
+			if (FAILED(hr))
+			{
+				// The slot is now taken by the next one in the probe
+				// sequence, if any
+				RemoveSlot(iSlot);
+				continue;
+			}
+		}
+		iSlot = (iSlot + 1) & nMask;
+	}
+	return false;
+}
+
+inline HRESULT CResponseStore::InsertSlot(
+	const Detail::ResponseStoreSlot& slot)
+{
+	ATLASSERT(slot.iSegment != 0);
+	// At most half full, to keep probe sequences short
+	if ((static_cast<size_t>(m_cEntries) + 1) * 2 > m_slots.size())
+	{
+		HRESULT hr = GrowSlots();
+		if (FAILED(hr))
+		{
+			return hr;
+		}
+	}
+	size_t nMask = m_slots.size() - 1;
+	size_t iSlot = slot.dwHash & nMask;
+	while (m_slots[iSlot].iSegment)
+	{
+		iSlot = (iSlot + 1) & nMask;
+	}
+	m_slots[iSlot] = slot;
+	++m_cEntries;
+	return S_OK;
+}
+
+inline void CResponseStore::RemoveSlot(size_t iSlot)
+{
+	ATLASSERT(iSlot < m_slots.size() && m_slots[iSlot].iSegment);
+	ReleaseRecord(m_slots[iSlot]);
+
+	// Move later slots of the probe sequence back into the hole, unless
+	// that would put them before their home slot
+	size_t nMask = m_slots.size() - 1;
+	size_t iHole = iSlot;
+	for (size_t i = (iSlot + 1) & nMask; m_slots[i].iSegment;
+		i = (i + 1) & nMask)
+	{
+		size_t iHome = m_slots[i].dwHash & nMask;
+		if (((i - iHome) & nMask) >= ((i - iHole) & nMask))
+		{
+			m_slots[iHole] = m_slots[i];
+			iHole = i;
+		}
+	}
+	memset(&m_slots[iHole], 0, sizeof(m_slots[iHole]));
+	--m_cEntries;
+}
+
+inline HRESULT CResponseStore::GrowSlots()
+{
+	size_t cSlots = m_slots.empty() ? 64 : m_slots.size() * 2;
+	std::vector<Detail::ResponseStoreSlot> slots;
+	ATLTRY(slots.resize(cSlots))
+	if (slots.size() != cSlots)
+	{
+		return E_OUTOFMEMORY;
+	}
+	memset(&slots[0], 0, cSlots * sizeof(slots[0]));
+
+	size_t nMask = cSlots - 1;
+	for (size_t i = 0; i < m_slots.size(); ++i)
+	{
+		if (!m_slots[i].iSegment)
+		{
+			continue;
+		}
+		size_t iSlot = m_slots[i].dwHash & nMask;
+		while (slots[iSlot].iSegment)
+		{
+			iSlot = (iSlot + 1) & nMask;
+		}
+		slots[iSlot] = m_slots[i];
+	}
+	m_slots.swap(slots);
+	return S_OK;
+}
+
+inline void CResponseStore::ReleaseRecord(
+	const Detail::ResponseStoreSlot& slot)
+{
+	// Its bytes in the segment are dead from now on
+	size_t iSegmentPos = FindSegment(slot.iSegment);
+	if (iSegmentPos != static_cast<size_t>(-1))
+	{
+		DWORD& cbLive = m_segments[iSegmentPos].cbLive;
+		cbLive -= slot.cbRecord < cbLive ? slot.cbRecord : cbLive;
+	}
+}
+
+inline HRESULT CResponseStore::CompactSegment(DWORD iSegment)
+{
+	// Copy the live records verbatim, in passes over the slots until one
+	// finds none left. Between records, lookups and insertions may move
+	// slots around, or replace records
+	for (bool bCopied = true; bCopied; )
+	{
+		bCopied = false;
+		size_t iSlot = 0;
+		for (;;)
+		{
+			CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+			if (!m_szDirectory || m_bClosing)
+			{
+				return E_ABORT;
+			}
+			size_t iSegmentPos = FindSegment(iSegment);
+			if (iSegmentPos == static_cast<size_t>(-1))
+			{
+				return S_OK;
+			}
+			while (iSlot < m_slots.size() &&
+				m_slots[iSlot].iSegment != iSegment)
+			{
+				++iSlot;
+			}
+			if (iSlot == m_slots.size())
+			{
+				if (!bCopied)
+				{
+					DropSegment(iSegmentPos);
+					++m_cCompactions;
+				}
+				break;
+			}
+
+			// Appending only adds segments after this one
+			Detail::ResponseStoreSlot& slot = m_slots[iSlot];
+			Detail::ResponseStoreView* pView = 0;
+			HRESULT hr = GetRecord(slot, 0, 0, &pView, 0);
+			if (FAILED(hr))
+			{
+				// Keep the segment for the records not copied yet
+				return hr;
+			}
+			Detail::ResponseStoreChunk chunk =
+				{pView->GetData() + slot.dwOffset, slot.cbRecord};
+			Detail::ResponseStoreSlot newSlot;
+			hr = Append(&chunk, 1, slot.cbRecord, &newSlot);
+			pView->Release();
+			if (FAILED(hr))
+			{
+				return hr;
+			}
+			ReleaseRecord(slot);
+			newSlot.dwHash = slot.dwHash;
+			slot = newSlot;
+			bCopied = true;
+			++iSlot;
+		}
+	}
+	return S_OK;
+}
+
+inline bool CResponseStore::ScheduleMaintenance()
+{
+	if (!m_hMaintenanceIdle)
+	{
+		return false;
+	}
+
+	// The work item keeps the module loaded. The store itself waits for
+	// it in Close
+#if _ATL_VER < 0x700
+	_Module.Lock();
+#else
+	_pAtlModule->Lock();
+#endif
+	if (!QueueUserWorkItem(MaintenanceProc, this, WT_EXECUTEDEFAULT))
+	{
+#if _ATL_VER < 0x700
+		_Module.Unlock();
+#else
+		_pAtlModule->Unlock();
+#endif
+		return false;
+	}
+	m_bMaintenanceQueued = true;
+	if (m_cMaintenance++ == 0)
+	{
+		ResetEvent(m_hMaintenanceIdle);
+	}
+	return true;
+}
+
+inline void CResponseStore::Maintain()
+{
+	{
+		CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+		// Records appended from now on queue another round
+		m_bMaintenanceQueued = false;
+		if (!m_szDirectory || m_bClosing)
+		{
+			return;
+		}
+	}
+
+	Compact();
+	bool bFlush = false;
+	{
+		CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+		bFlush = m_szDirectory && !m_bClosing && m_cFlushThreshold &&
+			m_cUnflushed >= m_cFlushThreshold;
+	}
+	if (bFlush)
+	{
+		Flush();
+	}
+}
+
+inline DWORD WINAPI CResponseStore::MaintenanceProc(LPVOID pv)
+{
+	ATLASSERT(pv != 0);
+	CResponseStore* pThis = static_cast<CResponseStore*>(pv);
+	pThis->Maintain();
+
+	{
+		CComCritSecLock<CComAutoCriticalSection> lock(pThis->m_cs);
+		if (--pThis->m_cMaintenance == 0)
+		{
+			// Close may destroy the store as soon as the lock is left
+			SetEvent(pThis->m_hMaintenanceIdle);
+		}
+	}
+#if _ATL_VER < 0x700
+	_Module.Unlock();
+#else
+	_pAtlModule->Unlock();
+#endif
+	return 0;
+}
+
+} // end namespace PassthroughAPP
+
+#endif // PASSTHROUGHAPP_RESPONSESTORE_INL
@@ -1,177 +1,1008 @@
-#ifndef PASSTHROUGHAPP_SINKPOLICY_H
-#define PASSTHROUGHAPP_SINKPOLICY_H
-
-#if _MSC_VER > 1000
-	#pragma once
-#endif // _MSC_VER > 1000
-
-namespace PassthroughAPP
-{
-
-// A sink policy class should implement OnStart with the prototype shown
-// below, presumably by eventually forwarding to pTargetProtocol->Start,
-// possibly with different parameters
-
-class NoSinkStartPolicy
-{
-public:
-	HRESULT OnStart(LPCWSTR szUrl, IInternetProtocolSink *pOIProtSink,
-		IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved,
-		IInternetProtocol* pTargetProtocol) const;
-
-	HRESULT OnStartEx(IUri *pUri, IInternetProtocolSink *pOIProtSink,
-		IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved,
-		IInternetProtocolEx* pTargetProtocol) const;
-};
-
-template <class Base>
-class CComObjectSharedRef : public Base
-{
-public:
-	typedef Base ContainedObject;
-
-	CComObjectSharedRef(IUnknown* punkRefCount, IUnknown* = 0);
-#ifdef _ATL_DEBUG_INTERFACES
-	~CComObjectSharedRef();
-#endif
-
-	STDMETHODIMP QueryInterface(REFIID iid, void** ppvObject);
-
-	template <class Q>
-	HRESULT STDMETHODCALLTYPE QueryInterface(Q** pp)
-	{
-		return QueryInterface(__uuidof(Q), (void**)pp);
-	}
-
-	STDMETHODIMP_(ULONG) AddRef();
-	STDMETHODIMP_(ULONG) Release();
-
-	Base* GetContainedObject();
-	static CComObjectSharedRef* GetThisObject(const Base* pBase);
-private:
-	IUnknown* m_punkRefCount;
-};
-
-template <class Contained>
-class CComPolyObjectSharedRef :
-	public IUnknown,
-	public CComObjectRootEx<typename Contained::_ThreadModel::ThreadModelNoCS>
-{
-public:
-	typedef Contained ContainedObject;
-
-	typedef typename Contained::_ThreadModel _ThreadModel;
-
-	CComPolyObjectSharedRef(IUnknown* punkRefCount, IUnknown* punkOuter);
-#ifdef _ATL_DEBUG_INTERFACES
-	~CComPolyObjectSharedRef();
-#endif
-
-	HRESULT FinalConstruct();
-	void FinalRelease();
-
-	STDMETHODIMP QueryInterface(REFIID iid, void** ppvObject);
-
-	template <class Q>
-	HRESULT STDMETHODCALLTYPE QueryInterface(Q** pp)
-	{
-		return QueryInterface(__uuidof(Q), (void**)pp);
-	}
-
-	STDMETHODIMP_(ULONG) AddRef();
-	STDMETHODIMP_(ULONG) Release();
-
-	IUnknown* GetControllingUnknown();
-
-	Contained* GetContainedObject();
-	static CComPolyObjectSharedRef* GetThisObject(const Contained* pContained);
-
-	CComContainedObject<Contained> m_contained;
-private:
-	IUnknown* m_punkRefCount;
-};
-
-template <class T, class ThreadModel>
-class CComObjectRefCount :
-	public IUnknown,
-	public CComObjectRootEx<typename ThreadModel::ThreadModelNoCS>
-{
-	STDMETHODIMP QueryInterface(REFIID iid, void** ppvObject);
-	STDMETHODIMP_(ULONG) AddRef();
-	STDMETHODIMP_(ULONG) Release();
-};
-
-template <class ProtocolObject, class SinkObject>
-class CComObjectProtSink :
-	public ProtocolObject
-{
-public:
-	typedef typename ProtocolObject::ContainedObject Protocol;
-	typedef typename SinkObject::ContainedObject Sink;
-
-	CComObjectProtSink(void* pv);
-	~CComObjectProtSink();
-
-	HRESULT FinalConstruct();
-	void FinalRelease();
-
-	static Protocol* GetProtocol(const Sink* pSink);
-	static Sink* GetSink(const Protocol* pProtocol);
-
-	SinkObject m_sink;
-
-	typedef CComObjectRefCount<CComObjectProtSink,
-		typename ProtocolObject::_ThreadModel> RefCountObject;
-	RefCountObject m_refCount;
-};
-
-#define DECLARE_NOT_AGGREGATABLE_PROTSINK(Protocol, Sink) public: \
-	typedef ::PassthroughAPP::CComObjectProtSink< \
-		::PassthroughAPP::CComObjectSharedRef<Protocol>, \
-		::PassthroughAPP::CComObjectSharedRef<Sink> > \
-	ComObjectClass; \
-	typedef CComCreator2<CComCreator<ComObjectClass>, \
-		CComFailCreator<CLASS_E_NOAGGREGATION> > _CreatorClass;
-
-#define DECLARE_ONLY_AGGREGATABLE_PROTSINK(Protocol, Sink) public: \
-	typedef ::PassthroughAPP::CComObjectProtSink< \
-		::PassthroughAPP::CComPolyObjectSharedRef<Protocol>, \
-		::PassthroughAPP::CComObjectSharedRef<Sink> > \
-	ComObjectClass; \
-	typedef CComCreator2<CComFailCreator<E_FAIL>, \
-		CComCreator<ComObjectClass> > _CreatorClass;
-
-#define DECLARE_AGGREGATABLE_PROTSINK(Protocol, Sink) public: \
-	typedef ::PassthroughAPP::CComObjectProtSink< \
-		::PassthroughAPP::CComPolyObjectSharedRef<Protocol>, \
-		::PassthroughAPP::CComObjectSharedRef<Sink> > \
-	ComObjectClass; \
-	typedef CComCreator<ComObjectClass> _CreatorClass;
-
-
-template <class Protocol, class Sink>
-class CustomSinkStartPolicy
-{
-public:
-	DECLARE_AGGREGATABLE_PROTSINK(Protocol, Sink)
-
-	HRESULT OnStart(LPCWSTR szUrl,
-		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
-		DWORD grfPI, HANDLE_PTR dwReserved,
-		IInternetProtocol* pTargetProtocol) const;
-
-	HRESULT OnStartEx(IUri* pUri,
-		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
-		DWORD grfPI, HANDLE_PTR dwReserved,
-		IInternetProtocolEx* pTargetProtocol) const;
-
-	static Sink* GetSink(const Protocol* pProtocol);
-	Sink* GetSink() const;
-	static Protocol* GetProtocol(const Sink* pSink);
-};
-
-} // end namespace PassthroughAPP
-
-#include "SinkPolicy.inl"
-
-#endif // PASSTHROUGHAPP_SINKPOLICY_H
+#ifndef PASSTHROUGHAPP_SINKPOLICY_H
+#define PASSTHROUGHAPP_SINKPOLICY_H
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+#include <new>
+
+#include "LocalResponse.h"
+#include "ReportDataCoalescer.h"
+#include "ResponseCache.h"
+#include "RequestCoalescer.h"
+#include "BodyFilter.h"
+#include "AdmissionScheduler.h"
+
+namespace PassthroughAPP
+{
+
+// A sink policy class should implement OnStart with the prototype shown
+// below, presumably by eventually forwarding to pTargetProtocol->Start,
+// possibly with different parameters
+
+class NoSinkStartPolicy
+{
+public:
+	HRESULT OnStart(LPCWSTR szUrl, IInternetProtocolSink *pOIProtSink,
+		IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved,
+		IInternetProtocol* pTargetProtocol) const;
+
+	HRESULT OnStartEx(IUri *pUri, IInternetProtocolSink *pOIProtSink,
+		IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved,
+		IInternetProtocolEx* pTargetProtocol) const;
+
+	// Called instead of OnStart/OnStartEx when target creation is deferred
+	// (see CComClassFactoryProtocol::SetDeferTargetCreation) and the target
+	// doesn't exist yet. Return S_FALSE to create the target and go on with
+	// OnStart/OnStartEx. Anything else is returned from Start/StartEx as is,
+	// and the target is never created
+	HRESULT OnStartDeferred(LPCWSTR szUrl, IInternetProtocolSink *pOIProtSink,
+		IInternetBindInfo *pOIBindInfo, DWORD grfPI,
+		HANDLE_PTR dwReserved) const;
+
+	HRESULT OnStartExDeferred(IUri *pUri, IInternetProtocolSink *pOIProtSink,
+		IInternetBindInfo *pOIBindInfo, DWORD grfPI,
+		HANDLE_PTR dwReserved) const;
+
+	// Called for every Read of a request that wasn't answered locally,
+	// presumably forwarding to pTargetProtocol->Read. pcbRead may be 0
+	HRESULT OnRead(void* pv, ULONG cb, ULONG* pcbRead,
+		IInternetProtocol* pTargetProtocol) const;
+
+	// Called for Abort and Terminate of a request that wasn't answered
+	// locally, presumably forwarding to pTargetProtocol
+	HRESULT OnAbort(HRESULT hrReason, DWORD dwOptions,
+		IInternetProtocol* pTargetProtocol) const;
+	HRESULT OnTerminate(DWORD dwOptions,
+		IInternetProtocol* pTargetProtocol) const;
+
+	// Called for Continue of a request that wasn't answered locally, with
+	// data either the target or the policy passed to Switch, presumably
+	// forwarding the target's to pTargetProtocol
+	HRESULT OnContinue(PROTOCOLDATA* pProtocolData,
+		IInternetProtocol* pTargetProtocol) const;
+
+	// Called for IInternetPriority::SetPriority, presumably forwarding to
+	// pTargetPriority. That is 0 while a deferred target doesn't exist yet;
+	// the APP sets the last priority on the target once it creates it
+	HRESULT OnSetPriority(LONG nPriority,
+		IInternetPriority* pTargetPriority) const;
+
+	// Whether the policy answered the request itself, in which case
+	// CInternetProtocol has GetLocalResponder serve it instead of calling
+	// the methods above. Never, here
+	bool IsRespondingLocally() const;
+	Detail::LocalResponder* GetLocalResponder() const;
+};
+
+namespace Detail
+{
+
+#ifdef PASSTHROUGHAPP_SINGLE_REFCOUNT
+
+// By default, each part of a CComObjectProtSink keeps its own reference
+// count, used to release its target pointers when it drops to zero, on
+// top of the count of the whole object in CComObjectRefCount. Every
+// AddRef and Release thus makes two interlocked operations, one of them
+// through a virtual call.
+//
+// With PASSTHROUGHAPP_SINGLE_REFCOUNT defined, both counts live in one
+// 64-bit word instead: the protocol part's count, the sink part's count,
+// and a pin count that keeps the object alive while a part whose count
+// dropped to zero releases its target pointers. One interlocked
+// operation drives both.
+
+class PackedRefCount;
+
+class PackedRefPart
+{
+public:
+	ULONG AddRef();
+	// Returns the part's remaining count. When that drops to zero, the
+	// object is pinned and *pbPinned set; the caller then releases the
+	// part's resources and calls Unpin, which may destroy the object
+	ULONG Release(bool* pbPinned);
+	void Unpin();
+
+	PackedRefCount* m_pRefCount;
+	int m_nShift;
+};
+
+class PackedRefCount
+{
+public:
+	enum
+	{
+		shiftProtocol = 0,
+		shiftSink = 21,
+		shiftPin = 42,
+		cFieldBits = 21
+	};
+
+	typedef void (*DestroyFunc)(PackedRefCount* pRefCount);
+
+	explicit PackedRefCount(DestroyFunc pfnDestroy);
+
+	void Pin();
+	// Returns true if that was the last reference to the object
+	bool Unpin();
+
+	PackedRefPart m_protocolPart;
+	PackedRefPart m_sinkPart;
+	LONGLONG m_llRef;
+	DestroyFunc m_pfnDestroy;
+};
+
+typedef PackedRefPart RefCountPart;
+
+#else
+
+// Drives the count of one part. Each reference to the part also holds
+// one to the object. m_plRef points to the count in the part's
+// CComObjectRootEx, or, when the layout policy moves the counts away from
+// the part's pointers, to m_lRef, next to the count of the whole object
+class SharedRefPart
+{
+public:
+	ULONG AddRef();
+	// Same contract as PackedRefPart::Release. Here the pin is the
+	// reference to the object that the part's last reference held
+	ULONG Release(bool* pbPinned);
+	void Unpin();
+
+	IUnknown* m_pObject;
+	LONG* m_plRef;
+	LONG m_lRef;
+};
+
+typedef SharedRefPart RefCountPart;
+
+#endif // PASSTHROUGHAPP_SINGLE_REFCOUNT
+
+} // end namespace PassthroughAPP::Detail
+
+template <class Base>
+class CComObjectSharedRef : public Base
+{
+public:
+	typedef Base ContainedObject;
+
+	CComObjectSharedRef(Detail::RefCountPart* pRefCount, IUnknown* = 0);
+#ifdef _ATL_DEBUG_INTERFACES
+	~CComObjectSharedRef();
+#endif
+
+	STDMETHODIMP QueryInterface(REFIID iid, void** ppvObject);
+
+	template <class Q>
+	HRESULT STDMETHODCALLTYPE QueryInterface(Q** pp)
+	{
+		return QueryInterface(__uuidof(Q), (void**)pp);
+	}
+
+	STDMETHODIMP_(ULONG) AddRef();
+	STDMETHODIMP_(ULONG) Release();
+
+	Base* GetContainedObject();
+	static CComObjectSharedRef* GetThisObject(const Base* pBase);
+private:
+	Detail::RefCountPart* m_pRefCount;
+};
+
+template <class Contained>
+class CComPolyObjectSharedRef :
+	public IUnknown,
+	public CComObjectRootEx<typename Contained::_ThreadModel::ThreadModelNoCS>
+{
+public:
+	typedef Contained ContainedObject;
+
+	typedef typename Contained::_ThreadModel _ThreadModel;
+
+	CComPolyObjectSharedRef(Detail::RefCountPart* pRefCount,
+		IUnknown* punkOuter);
+#ifdef _ATL_DEBUG_INTERFACES
+	~CComPolyObjectSharedRef();
+#endif
+
+	HRESULT FinalConstruct();
+	void FinalRelease();
+
+	STDMETHODIMP QueryInterface(REFIID iid, void** ppvObject);
+
+	template <class Q>
+	HRESULT STDMETHODCALLTYPE QueryInterface(Q** pp)
+	{
+		return QueryInterface(__uuidof(Q), (void**)pp);
+	}
+
+	STDMETHODIMP_(ULONG) AddRef();
+	STDMETHODIMP_(ULONG) Release();
+
+	IUnknown* GetControllingUnknown();
+
+	Contained* GetContainedObject();
+	static CComPolyObjectSharedRef* GetThisObject(const Contained* pContained);
+
+	CComContainedObject<Contained> m_contained;
+private:
+	Detail::RefCountPart* m_pRefCount;
+};
+
+// Holds the reference count of a CComObjectProtSink, and the parts'
+// SharedRefPart. With PASSTHROUGHAPP_SINGLE_REFCOUNT, or a layout policy
+// that moves the counts, it holds every count, and the parts'
+// CComObjectRootEx counts go unused
+template <class T, class ThreadModel>
+class CComObjectRefCount :
+#ifdef PASSTHROUGHAPP_SINGLE_REFCOUNT
+	public Detail::PackedRefCount,
+#else
+	public IUnknown,
+#endif
+	public CComObjectRootEx<typename ThreadModel::ThreadModelNoCS>
+{
+#ifdef PASSTHROUGHAPP_SINGLE_REFCOUNT
+public:
+	CComObjectRefCount();
+
+	// Used by CComObjectProtSink to keep the object alive during
+	// FinalConstruct. Never destroys it
+	ULONG InternalAddRef();
+	ULONG InternalRelease();
+private:
+	static void Destroy(Detail::PackedRefCount* pRefCount);
+#else
+public:
+	CComObjectRefCount();
+
+	STDMETHODIMP QueryInterface(REFIID iid, void** ppvObject);
+	STDMETHODIMP_(ULONG) AddRef();
+	STDMETHODIMP_(ULONG) Release();
+
+	Detail::SharedRefPart m_protocolPart;
+	Detail::SharedRefPart m_sinkPart;
+#endif
+};
+
+// Allocation policies for CComObjectProtSink. Allocate returns 0 on
+// failure
+
+class HeapAllocPolicy
+{
+public:
+	static void* Allocate(size_t cb);
+	static void Free(void* pv);
+};
+
+struct PoolStatistics
+{
+	// Allocations served from the free list, and from the heap
+	LONG cHits;
+	LONG cMisses;
+	// Blocks currently in use, and the most ever in use at once
+	LONG cOutstanding;
+	LONG cHighWater;
+	// Blocks on the free list
+	LONG cFree;
+};
+
+// Keeps freed blocks on an interlocked free list shared by all threads,
+// so that once the pool has grown to the working set, creating a request
+// makes no heap calls. There is one pool per Tag, and a Tag must only be
+// used for objects of one size; the DECLARE_*_PROTSINK_POOLED macros use
+// the protocol class
+template <class Tag>
+class PooledAllocPolicy
+{
+public:
+	static void* Allocate(size_t cb);
+	static void Free(void* pv);
+
+	static void GetStatistics(PoolStatistics* pStats);
+	// Blocks freed while the free list holds cMaxFree blocks go back to
+	// the heap
+	static void SetMaxFree(LONG cMaxFree);
+	// Returns all free blocks to the heap, e.g. before the module unloads
+	static void Trim();
+
+private:
+	static SLIST_HEADER s_freeList;
+	static LONG s_cMaxFree;
+	static LONG s_cHits;
+	static LONG s_cMisses;
+	static LONG s_cOutstanding;
+	static LONG s_cHighWater;
+	static LONG s_cFree;
+};
+
+// Layout policies for CComObjectProtSink. The parts read their target
+// pointers on every forwarded call, while the reference counts are written
+// on every AddRef and Release, typically from both the thread that started
+// the binding and urlmon's worker thread. CompactLayout leaves each part's
+// count in the part, next to its pointers. CacheLineLayout moves the
+// parts' counts to m_refCount and puts a cache line of padding on either
+// side of it, so that the writes don't evict the lines holding the
+// pointers from the readers' caches.
+
+#ifndef PASSTHROUGHAPP_CACHE_LINE_SIZE
+	#define PASSTHROUGHAPP_CACHE_LINE_SIZE 64
+#endif
+
+class CompactLayout
+{
+public:
+	enum {cbRefCountPadding = 0, bMovePartCounts = false};
+};
+
+class CacheLineLayout
+{
+public:
+	enum
+	{
+		cbRefCountPadding = PASSTHROUGHAPP_CACHE_LINE_SIZE,
+		bMovePartCounts = true
+	};
+};
+
+namespace Detail
+{
+
+template <int cbPadding>
+struct Padding
+{
+	BYTE m_padding[cbPadding];
+};
+
+// Base with cbPadding bytes before and after it
+template <class Base, int cbPadding>
+class PaddedRefCount :
+	private Padding<cbPadding>,
+	public Base
+{
+private:
+	BYTE m_paddingAfter[cbPadding];
+};
+
+template <class Base>
+class PaddedRefCount<Base, 0> :
+	public Base
+{
+};
+
+} // end namespace PassthroughAPP::Detail
+
+template <class ProtocolObject, class SinkObject,
+	class AllocPolicy = HeapAllocPolicy, class LayoutPolicy = CompactLayout>
+class CComObjectProtSink :
+	public ProtocolObject
+{
+public:
+	typedef typename ProtocolObject::ContainedObject Protocol;
+	typedef typename SinkObject::ContainedObject Sink;
+
+	CComObjectProtSink(void* pv);
+	~CComObjectProtSink();
+
+	// CComObjectRefCount deletes the object through these. The nothrow
+	// forms are what ATL's creators use
+	static void* operator new(size_t cb) throw();
+	static void* operator new(size_t cb, const std::nothrow_t&) throw();
+	static void operator delete(void* pv);
+	static void operator delete(void* pv, const std::nothrow_t&);
+
+	HRESULT FinalConstruct();
+	void FinalRelease();
+
+	static Protocol* GetProtocol(const Sink* pSink);
+	static Sink* GetSink(const Protocol* pProtocol);
+
+	typedef CComObjectRefCount<CComObjectProtSink,
+		typename ProtocolObject::_ThreadModel> RefCountObject;
+	typedef Detail::PaddedRefCount<RefCountObject,
+		LayoutPolicy::cbRefCountPadding> RefCountSlot;
+
+	static CComObjectProtSink* GetThisObject(
+		const RefCountObject* pRefCount);
+
+	SinkObject m_sink;
+	RefCountSlot m_refCount;
+};
+
+#define DECLARE_NOT_AGGREGATABLE_PROTSINK(Protocol, Sink) public: \
+	typedef ::PassthroughAPP::CComObjectProtSink< \
+		::PassthroughAPP::CComObjectSharedRef<Protocol>, \
+		::PassthroughAPP::CComObjectSharedRef<Sink> > \
+	ComObjectClass; \
+	typedef CComCreator2<CComCreator<ComObjectClass>, \
+		CComFailCreator<CLASS_E_NOAGGREGATION> > _CreatorClass;
+
+#define DECLARE_ONLY_AGGREGATABLE_PROTSINK(Protocol, Sink) public: \
+	typedef ::PassthroughAPP::CComObjectProtSink< \
+		::PassthroughAPP::CComPolyObjectSharedRef<Protocol>, \
+		::PassthroughAPP::CComObjectSharedRef<Sink> > \
+	ComObjectClass; \
+	typedef CComCreator2<CComFailCreator<E_FAIL>, \
+		CComCreator<ComObjectClass> > _CreatorClass;
+
+#define DECLARE_AGGREGATABLE_PROTSINK(Protocol, Sink) public: \
+	typedef ::PassthroughAPP::CComObjectProtSink< \
+		::PassthroughAPP::CComPolyObjectSharedRef<Protocol>, \
+		::PassthroughAPP::CComObjectSharedRef<Sink> > \
+	ComObjectClass; \
+	typedef CComCreator<ComObjectClass> _CreatorClass;
+
+// Same as above, but protocol/sink objects are allocated from
+// PooledAllocPolicy<Protocol>
+
+#define DECLARE_NOT_AGGREGATABLE_PROTSINK_POOLED(Protocol, Sink) public: \
+	typedef ::PassthroughAPP::CComObjectProtSink< \
+		::PassthroughAPP::CComObjectSharedRef<Protocol>, \
+		::PassthroughAPP::CComObjectSharedRef<Sink>, \
+		::PassthroughAPP::PooledAllocPolicy<Protocol> > \
+	ComObjectClass; \
+	typedef CComCreator2<CComCreator<ComObjectClass>, \
+		CComFailCreator<CLASS_E_NOAGGREGATION> > _CreatorClass;
+
+#define DECLARE_ONLY_AGGREGATABLE_PROTSINK_POOLED(Protocol, Sink) public: \
+	typedef ::PassthroughAPP::CComObjectProtSink< \
+		::PassthroughAPP::CComPolyObjectSharedRef<Protocol>, \
+		::PassthroughAPP::CComObjectSharedRef<Sink>, \
+		::PassthroughAPP::PooledAllocPolicy<Protocol> > \
+	ComObjectClass; \
+	typedef CComCreator2<CComFailCreator<E_FAIL>, \
+		CComCreator<ComObjectClass> > _CreatorClass;
+
+#define DECLARE_AGGREGATABLE_PROTSINK_POOLED(Protocol, Sink) public: \
+	typedef ::PassthroughAPP::CComObjectProtSink< \
+		::PassthroughAPP::CComPolyObjectSharedRef<Protocol>, \
+		::PassthroughAPP::CComObjectSharedRef<Sink>, \
+		::PassthroughAPP::PooledAllocPolicy<Protocol> > \
+	ComObjectClass; \
+	typedef CComCreator<ComObjectClass> _CreatorClass;
+
+// Same as above, with explicit allocation and layout policies, e.g.
+// DECLARE_AGGREGATABLE_PROTSINK_EX(CMyAPP, CMySink,
+//     PassthroughAPP::PooledAllocPolicy<CMyAPP>,
+//     PassthroughAPP::CacheLineLayout)
+
+#define DECLARE_NOT_AGGREGATABLE_PROTSINK_EX(Protocol, Sink, AllocPolicy, \
+		LayoutPolicy) public: \
+	typedef ::PassthroughAPP::CComObjectProtSink< \
+		::PassthroughAPP::CComObjectSharedRef<Protocol>, \
+		::PassthroughAPP::CComObjectSharedRef<Sink>, \
+		AllocPolicy, LayoutPolicy > \
+	ComObjectClass; \
+	typedef CComCreator2<CComCreator<ComObjectClass>, \
+		CComFailCreator<CLASS_E_NOAGGREGATION> > _CreatorClass;
+
+#define DECLARE_ONLY_AGGREGATABLE_PROTSINK_EX(Protocol, Sink, AllocPolicy, \
+		LayoutPolicy) public: \
+	typedef ::PassthroughAPP::CComObjectProtSink< \
+		::PassthroughAPP::CComPolyObjectSharedRef<Protocol>, \
+		::PassthroughAPP::CComObjectSharedRef<Sink>, \
+		AllocPolicy, LayoutPolicy > \
+	ComObjectClass; \
+	typedef CComCreator2<CComFailCreator<E_FAIL>, \
+		CComCreator<ComObjectClass> > _CreatorClass;
+
+#define DECLARE_AGGREGATABLE_PROTSINK_EX(Protocol, Sink, AllocPolicy, \
+		LayoutPolicy) public: \
+	typedef ::PassthroughAPP::CComObjectProtSink< \
+		::PassthroughAPP::CComPolyObjectSharedRef<Protocol>, \
+		::PassthroughAPP::CComObjectSharedRef<Sink>, \
+		AllocPolicy, LayoutPolicy > \
+	ComObjectClass; \
+	typedef CComCreator<ComObjectClass> _CreatorClass;
+
+
+template <class Protocol, class Sink>
+class CustomSinkStartPolicy
+{
+public:
+	DECLARE_AGGREGATABLE_PROTSINK(Protocol, Sink)
+
+	HRESULT OnStart(LPCWSTR szUrl,
+		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved,
+		IInternetProtocol* pTargetProtocol) const;
+
+	HRESULT OnStartEx(IUri* pUri,
+		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved,
+		IInternetProtocolEx* pTargetProtocol) const;
+
+	// See NoSinkStartPolicy
+	HRESULT OnStartDeferred(LPCWSTR szUrl,
+		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved) const;
+
+	HRESULT OnStartExDeferred(IUri* pUri,
+		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved) const;
+
+	HRESULT OnRead(void* pv, ULONG cb, ULONG* pcbRead,
+		IInternetProtocol* pTargetProtocol) const;
+
+	HRESULT OnAbort(HRESULT hrReason, DWORD dwOptions,
+		IInternetProtocol* pTargetProtocol) const;
+	HRESULT OnTerminate(DWORD dwOptions,
+		IInternetProtocol* pTargetProtocol) const;
+
+	HRESULT OnContinue(PROTOCOLDATA* pProtocolData,
+		IInternetProtocol* pTargetProtocol) const;
+	HRESULT OnSetPriority(LONG nPriority,
+		IInternetPriority* pTargetPriority) const;
+
+	// See NoSinkStartPolicy
+	bool IsRespondingLocally() const;
+	Detail::LocalResponder* GetLocalResponder() const;
+
+	static Sink* GetSink(const Protocol* pProtocol);
+	Sink* GetSink() const;
+	static Protocol* GetProtocol(const Sink* pSink);
+};
+
+namespace Detail
+{
+
+// What the start policies below need to know about a request. A policy
+// that can't find out, or can't do its part for lack of memory, passes
+// the request on to BasePolicy rather than failing it
+
+// The request's BINDF flags and verb
+HRESULT GetBindVerb(IInternetBindInfo* pOIBindInfo, DWORD* pgrfBINDF,
+	DWORD* pdwBindVerb);
+// Whether grfBINDF asks for the newest version, past any cache
+bool IsReload(DWORD grfBINDF);
+// The URL of a request started with one of szUrl and pUri. The one pUri
+// gives is kept in *pbstrUrl, which *pszUrl then points into
+HRESULT GetRequestUrl(LPCWSTR szUrl, IUri* pUri, BSTR* pbstrUrl,
+	LPCWSTR* pszUrl);
+
+// The arguments of a Start/StartEx a policy holds back, for starting
+// BasePolicy with later, once the request was sent nothing in between
+class DeferredStart
+{
+public:
+	DeferredStart();
+
+	// Whether a request can be held back at all. Filters get their data
+	// from dwReserved, which doesn't outlive Start
+	static bool CanDefer(DWORD grfPI, HANDLE_PTR dwReserved);
+
+	// Keeps the arguments, with exactly one of szUrl and pUri set
+	HRESULT Defer(LPCWSTR szUrl, IUri* pUri,
+		IInternetProtocolSink* pOIProtSink, IInternetBindInfo* pOIBindInfo,
+		DWORD grfPI);
+	bool IsDeferred() const;
+	// Drops the arguments
+	void Cancel();
+	// Drops the arguments and reports hrReason to the sink, the way the
+	// target would have
+	void Abort(HRESULT hrReason);
+	// Drops the arguments and starts pPolicy's target with them, reporting
+	// a failure to the sink. Returns S_FALSE if nothing was deferred.
+	// pProtocol is kept alive meanwhile, since starting the target may get
+	// the request terminated and released
+	template <class BasePolicy, class Protocol>
+	HRESULT Start(const BasePolicy* pPolicy, Protocol* pProtocol);
+
+private:
+	// Not copyable
+	DeferredStart(const DeferredStart&);
+	DeferredStart& operator=(const DeferredStart&);
+
+	CComBSTR m_bstrUrl;
+	CComPtr<IUri> m_spUri;
+	CComPtr<IInternetProtocolSink> m_spSink;
+	CComPtr<IInternetBindInfo> m_spBindInfo;
+	DWORD m_grfPI;
+};
+
+// The part of the policies below that answer requests themselves: once
+// RespondLocally is called, the request is served from a LocalResponder
+// rather than by BasePolicy and the target
+template <class BasePolicy>
+class LocalResponderPolicy :
+	public BasePolicy
+{
+public:
+	bool IsRespondingLocally() const;
+	LocalResponder* GetLocalResponder() const;
+
+protected:
+	// Reports response to pOIProtSink, in place of starting the target
+	HRESULT RespondLocally(const LocalResponse& response,
+		IInternetProtocolSink* pOIProtSink) const;
+
+private:
+	mutable LocalResponder m_responder;
+};
+
+} // end namespace PassthroughAPP::Detail
+
+// Answers some requests locally (see LocalResponse.h) and passes the
+// rest on to BasePolicy. Protocol decides which, by implementing
+//
+//     HRESULT GetLocalResponse(LPCWSTR szUrl, IUri* pUri,
+//         LocalResponse* pResponse) const;
+//
+// with exactly one of szUrl and pUri set. It returns S_OK to serve
+// *pResponse, S_FALSE to start the target as usual, or an error to fail
+// the request. Combined with deferred target creation, the target of a
+// request answered locally is never even created
+template <class Protocol, class BasePolicy = NoSinkStartPolicy>
+class LocalResponseStartPolicy :
+	public Detail::LocalResponderPolicy<BasePolicy>
+{
+public:
+	LocalResponseStartPolicy();
+
+	HRESULT OnStart(LPCWSTR szUrl,
+		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved,
+		IInternetProtocol* pTargetProtocol) const;
+
+	HRESULT OnStartEx(IUri* pUri,
+		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved,
+		IInternetProtocolEx* pTargetProtocol) const;
+
+	HRESULT OnStartDeferred(LPCWSTR szUrl,
+		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved) const;
+
+	HRESULT OnStartExDeferred(IUri* pUri,
+		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved) const;
+
+private:
+	// S_FALSE if the request isn't answered locally
+	HRESULT TryRespondLocally(LPCWSTR szUrl, IUri* pUri,
+		IInternetProtocolSink* pOIProtSink) const;
+
+	// Set once Protocol chose not to answer locally, so that OnStart
+	// following OnStartDeferred doesn't ask again
+	mutable bool m_bDeclined;
+};
+
+// Answers GET requests from a CResponseCache (see ResponseCache.h) when it
+// holds their URL, and stores the responses to the others as the client
+// reads them, then passes them on to BasePolicy. Protocol supplies the
+// cache by implementing
+//
+//     CResponseCache* GetResponseCache() const;
+//
+// returning 0 to leave a request alone. Requests for the newest version
+// (a reload) and requests that need a file (BINDF_NEEDFILE) skip the
+// lookup but refresh the entry, and requests with BINDF_NOWRITECACHE
+// aren't stored. Only status 200 responses the cache may share and that
+// have a freshness lifetime are stored (see ResponseCache.h), once Read
+// reports the end of the data. A request answered from the cache doesn't
+// expose IWinInetHttpInfo; the stored headers are available from the entry
+template <class Protocol, class BasePolicy = NoSinkStartPolicy>
+class ResponseCacheStartPolicy :
+	public Detail::LocalResponderPolicy<BasePolicy>
+{
+public:
+	ResponseCacheStartPolicy();
+
+	HRESULT OnStart(LPCWSTR szUrl,
+		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved,
+		IInternetProtocol* pTargetProtocol) const;
+
+	HRESULT OnStartEx(IUri* pUri,
+		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved,
+		IInternetProtocolEx* pTargetProtocol) const;
+
+	HRESULT OnStartDeferred(LPCWSTR szUrl,
+		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved) const;
+
+	HRESULT OnStartExDeferred(IUri* pUri,
+		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved) const;
+
+	HRESULT OnRead(void* pv, ULONG cb, ULONG* pcbRead,
+		IInternetProtocol* pTargetProtocol) const;
+
+private:
+	// S_FALSE if the request isn't answered from the cache. Otherwise
+	// starts capturing the response, if it may be stored
+	HRESULT TryRespondFromCache(LPCWSTR szUrl, IUri* pUri,
+		IInternetProtocolSink* pOIProtSink,
+		IInternetBindInfo* pOIBindInfo) const;
+	void StoreResponse(IInternetProtocol* pTargetProtocol) const;
+
+	mutable Detail::ResponseCapture m_capture;
+	// Set once the cache was consulted, so that OnStart following
+	// OnStartDeferred doesn't look up again
+	mutable bool m_bLookedUp;
+};
+
+// Coalesces concurrent GET requests for the same URL through a
+// CRequestCoalescer (see RequestCoalescer.h): a request started while
+// another one for the URL is in flight on the same thread follows it
+// instead of starting its own target. Protocol supplies the coalescer by
+// implementing
+//
+//     CRequestCoalescer* GetRequestCoalescer() const;
+//
+// returning 0 to leave a request alone. Reloads neither lead nor follow.
+// A follower's target is created but not started, unless the leader goes
+// away before the follower was sent anything; until then, interfaces
+// passed through to the target, such as IWinInetHttpInfo, only reach the
+// unstarted target
+template <class Protocol, class BasePolicy = NoSinkStartPolicy>
+class CoalescingStartPolicy :
+	public BasePolicy
+{
+public:
+	CoalescingStartPolicy();
+	~CoalescingStartPolicy();
+
+	HRESULT OnStart(LPCWSTR szUrl,
+		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved,
+		IInternetProtocol* pTargetProtocol) const;
+
+	HRESULT OnStartEx(IUri* pUri,
+		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved,
+		IInternetProtocolEx* pTargetProtocol) const;
+
+	HRESULT OnRead(void* pv, ULONG cb, ULONG* pcbRead,
+		IInternetProtocol* pTargetProtocol) const;
+
+	HRESULT OnAbort(HRESULT hrReason, DWORD dwOptions,
+		IInternetProtocol* pTargetProtocol) const;
+	HRESULT OnTerminate(DWORD dwOptions,
+		IInternetProtocol* pTargetProtocol) const;
+
+private:
+	// S_OK if the request follows another one, S_FALSE if it starts its
+	// target, possibly as a leader
+	HRESULT TryFollow(LPCWSTR szUrl, IUri* pUri,
+		IInternetProtocolSink* pOIProtSink, IInternetBindInfo* pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved) const;
+	// Starts the target of a follower the leader left behind
+	static void Restart(void* pvContext);
+	void EndLeading() const;
+
+	mutable Detail::CoalescedResponse* m_pLeading;
+	mutable Detail::CoalescingFollower m_follower;
+	// A follower's Start, for Restart
+	mutable Detail::DeferredStart m_start;
+};
+
+// Holds back requests passed on to BasePolicy while their host, or all
+// hosts together, have as many targets running as a CAdmissionScheduler
+// (see AdmissionScheduler.h) allows. A request that has to wait returns
+// from Start/StartEx at once, and its target is started later from
+// Continue, on the request's thread. Protocol supplies the scheduler by
+// implementing
+//
+//     CAdmissionScheduler* GetAdmissionScheduler() const;
+//
+// returning 0 to leave a request alone. The priority set through
+// IInternetPriority, before or after Start, orders the waiting requests.
+// Synchronous requests and filters always start at once and aren't
+// counted. LocalResponseStartPolicy, ResponseCacheStartPolicy and
+// CoalescingStartPolicy go in front of this policy, so that requests that
+// never start their target don't take a slot
+template <class Protocol, class BasePolicy = NoSinkStartPolicy>
+class AdmissionStartPolicy :
+	public BasePolicy
+{
+public:
+	AdmissionStartPolicy();
+	~AdmissionStartPolicy();
+
+	HRESULT OnStart(LPCWSTR szUrl,
+		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved,
+		IInternetProtocol* pTargetProtocol) const;
+
+	HRESULT OnStartEx(IUri* pUri,
+		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved,
+		IInternetProtocolEx* pTargetProtocol) const;
+
+	HRESULT OnRead(void* pv, ULONG cb, ULONG* pcbRead,
+		IInternetProtocol* pTargetProtocol) const;
+
+	HRESULT OnAbort(HRESULT hrReason, DWORD dwOptions,
+		IInternetProtocol* pTargetProtocol) const;
+	HRESULT OnTerminate(DWORD dwOptions,
+		IInternetProtocol* pTargetProtocol) const;
+
+	HRESULT OnContinue(PROTOCOLDATA* pProtocolData,
+		IInternetProtocol* pTargetProtocol) const;
+	HRESULT OnSetPriority(LONG nPriority,
+		IInternetPriority* pTargetPriority) const;
+
+private:
+	// S_OK if the request waits, S_FALSE if it starts its target now
+	HRESULT TryWait(LPCWSTR szUrl, IUri* pUri,
+		IInternetProtocolSink* pOIProtSink, IInternetBindInfo* pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved) const;
+	// Starts the target of a waiting request once it is admitted
+	void StartWaiting() const;
+	void Leave() const;
+
+	mutable CAdmissionScheduler* m_pScheduler;
+	// Kept until the request is destroyed, so that Continue can tell its
+	// protocol data even after the request left
+	mutable Detail::AdmissionTicket* m_pTicket;
+	mutable LONG m_nPriority;
+	// A waiting request's Start, deferred while the request waits
+	mutable Detail::DeferredStart m_start;
+};
+
+// Runs the body of every request passed on to BasePolicy through a
+// CBodyFilterChain (see BodyFilter.h) as the client reads it. Protocol
+// adds the filters by implementing
+//
+//     HRESULT AddBodyFilters(LPCWSTR szUrl, IUri* pUri,
+//         CBodyFilterChain* pChain) const;
+//
+// with exactly one of szUrl and pUri set, adding none to leave the body
+// alone. An error fails the request. Requests answered locally aren't
+// filtered, so ResponseCacheStartPolicy goes in front of this policy to
+// store and answer with filtered bodies. Filters that change the length of
+// the body also need CBodyFilterSinkTM as the sink, to keep the progress
+// reported to the client in line with what it reads
+template <class Protocol, class BasePolicy = NoSinkStartPolicy>
+class BodyFilterStartPolicy :
+	public BasePolicy
+{
+public:
+	BodyFilterStartPolicy();
+
+	HRESULT OnStart(LPCWSTR szUrl,
+		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved,
+		IInternetProtocol* pTargetProtocol) const;
+
+	HRESULT OnStartEx(IUri* pUri,
+		IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+		DWORD grfPI, HANDLE_PTR dwReserved,
+		IInternetProtocolEx* pTargetProtocol) const;
+
+	HRESULT OnRead(void* pv, ULONG cb, ULONG* pcbRead,
+		IInternetProtocol* pTargetProtocol) const;
+
+	CBodyFilterChain* GetBodyFilterChain() const;
+
+private:
+	// The source the chain reads from
+	class TargetReader
+	{
+	public:
+		TargetReader(const BodyFilterStartPolicy* pPolicy,
+			IInternetProtocol* pTargetProtocol);
+		HRESULT Read(void* pv, ULONG cb, ULONG* pcbRead);
+
+	private:
+		const BodyFilterStartPolicy* m_pPolicy;
+		IInternetProtocol* m_pTargetProtocol;
+	};
+
+	HRESULT AddFilters(LPCWSTR szUrl, IUri* pUri) const;
+
+	mutable CBodyFilterChain m_chain;
+	// Set once Protocol added its filters
+	mutable bool m_bFiltersAdded;
+};
+
+// A sink mapping the progress the target reports in ReportData to the body
+// filtered by BodyFilterStartPolicy, e.g.
+//
+//     class CMyAPP;
+//     typedef PassthroughAPP::CBodyFilterSinkTM<CMyAPP> CMySink;
+//     typedef PassthroughAPP::BodyFilterStartPolicy<CMyAPP,
+//         PassthroughAPP::CustomSinkStartPolicy<CMyAPP, CMySink> >
+//         CMyStartPolicy;
+//
+// Progress is only an estimate where the filters haven't seen the data
+// yet, as the part not read so far is counted at its unfiltered length
+template <class Protocol, class ThreadModel = CComMultiThreadModel>
+class CBodyFilterSinkTM :
+	public CInternetProtocolSinkTM<ThreadModel>
+{
+	typedef CInternetProtocolSinkTM<ThreadModel> BaseClass;
+public:
+	// IInternetProtocolSink
+	STDMETHODIMP ReportData(
+		/* [in] */ DWORD grfBSCF,
+		/* [in] */ ULONG ulProgress,
+		/* [in] */ ULONG ulProgressMax);
+};
+
+// A sink holding back ReportData notifications that only report more data,
+// until cbMinProgress bytes or dwMaxDelay milliseconds have added up since
+// the last one forwarded (see ReportDataCoalescer.h). It extends BaseSink,
+// and needs ReportDataCoalescingStartPolicy to start it, e.g.
+//
+//     class CMySink :
+//         public PassthroughAPP::CReportDataCoalescingSink<
+//             PassthroughAPP::CInternetProtocolSinkWithSP<CMySink> >
+//     {
+//     };
+//
+//     class CMyAPP;
+//     typedef PassthroughAPP::ReportDataCoalescingStartPolicy<CMyAPP,
+//         CMySink> CMyStartPolicy;
+template <class BaseSink>
+class CReportDataCoalescingSink :
+	public BaseSink
+{
+public:
+	CReportDataCoalescingSink();
+	~CReportDataCoalescingSink();
+
+	// Off by default. Call before the target reports data, e.g. from
+	// OnStart
+	void SetReportDataCoalescing(ULONG cbMinProgress, DWORD dwMaxDelay);
+	void GetReportDataStatistics(ReportDataStatistics* pStats) const;
+
+	// A notification held back for dwMaxDelay is forwarded from the
+	// request's Continue, which the sink asks the client for with Switch.
+	// Returns true if pProtocolData was the sink's, which the target
+	// mustn't see
+	bool ContinueReportData(PROTOCOLDATA* pProtocolData);
+	// Called when the request is terminated
+	void CancelReportDataFlush();
+
+	// Hides BaseSink's, to stop the timer before the client sink goes
+	void ReleaseAll();
+
+	// IInternetProtocolSink
+	STDMETHODIMP ReportData(
+		/* [in] */ DWORD grfBSCF,
+		/* [in] */ ULONG ulProgress,
+		/* [in] */ ULONG ulProgressMax);
+
+	STDMETHODIMP ReportResult(
+		/* [in] */ HRESULT hrResult,
+		/* [in] */ DWORD dwError,
+		/* [in] */ LPCWSTR szResult);
+
+private:
+	void ScheduleReportDataFlush();
+	static void CALLBACK ReportDataTimerProc(PVOID pvContext,
+		BOOLEAN bTimerFired);
+
+	Detail::ReportDataCoalescer m_reportDataCoalescer;
+	// Passed to Switch once a notification is held back for too long,
+	// from a timer queue timer. The timer is only created and deleted on
+	// the request's thread, and deleted before the client sink is released
+	PROTOCOLDATA m_reportDataProtocolData;
+	HANDLE m_hReportDataTimer;
+};
+
+// CustomSinkStartPolicy for a Sink derived from CReportDataCoalescingSink:
+// hands the sink the Continue it asked the client for, and stops its timer
+// when the request is terminated
+template <class Protocol, class Sink>
+class ReportDataCoalescingStartPolicy :
+	public CustomSinkStartPolicy<Protocol, Sink>
+{
+	typedef CustomSinkStartPolicy<Protocol, Sink> BaseClass;
+public:
+	HRESULT OnTerminate(DWORD dwOptions,
+		IInternetProtocol* pTargetProtocol) const;
+
+	HRESULT OnContinue(PROTOCOLDATA* pProtocolData,
+		IInternetProtocol* pTargetProtocol) const;
+};
+
+} // end namespace PassthroughAPP
+
+#include "SinkPolicy.inl"
+
+#endif // PASSTHROUGHAPP_SINKPOLICY_H
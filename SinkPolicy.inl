@@ -1,456 +1,2123 @@
-#ifndef PASSTHROUGHAPP_SINKPOLICY_INL
-#define PASSTHROUGHAPP_SINKPOLICY_INL
-
-#if _MSC_VER > 1000
-	#pragma once
-#endif // _MSC_VER > 1000
-
-#ifndef PASSTHROUGHAPP_SINKPOLICY_H
-	#error SinkPolicy.inl requires SinkPolicy.h to be included first
-#endif
-
-namespace PassthroughAPP
-{
-
-// ===== NoSinkStartPolicy =====
-
-inline HRESULT NoSinkStartPolicy::OnStart(LPCWSTR szUrl,
-	IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
-	DWORD grfPI, HANDLE_PTR dwReserved,
-	IInternetProtocol* pTargetProtocol) const
-{
-	ATLASSERT(pTargetProtocol != 0);
-	return pTargetProtocol->Start(szUrl, pOIProtSink, pOIBindInfo,
-		grfPI, dwReserved);
-}
-
-inline HRESULT NoSinkStartPolicy::OnStartEx(IUri* pUri,
-	IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
-	DWORD grfPI, HANDLE_PTR dwReserved,
-	IInternetProtocolEx* pTargetProtocol) const
-{
-	ATLASSERT(pTargetProtocol != 0);
-	return pTargetProtocol->StartEx(pUri, pOIProtSink, pOIBindInfo,
-		grfPI, dwReserved);
-}
-
-// ===== CComObjectSharedRef =====
-
-template<class Base>
-inline CComObjectSharedRef<Base>::
-	CComObjectSharedRef(IUnknown* punkRefCount, IUnknown*) :
-		m_punkRefCount(punkRefCount)
-{
-	ATLASSERT(punkRefCount != 0);
-}
-
-#ifdef _ATL_DEBUG_INTERFACES
-template<class Base>
-inline CComObjectSharedRef<Base>::~CComObjectSharedRef()
-{
-#if _ATL_VER < 0x700
-	_Module.DeleteNonAddRefThunk(_GetRawUnknown());
-#else
-	_AtlDebugInterfacesModule.DeleteNonAddRefThunk(_GetRawUnknown());
-#endif
-}
-#endif // _ATL_DEBUG_INTERFACES
-
-template<class Base>
-inline STDMETHODIMP CComObjectSharedRef<Base>::QueryInterface(REFIID iid,
-	void** ppvObject)
-{
-	return _InternalQueryInterface(iid, ppvObject);
-}
-
-template<class Base>
-inline STDMETHODIMP_(ULONG) CComObjectSharedRef<Base>::AddRef()
-{
-	if (m_punkRefCount)
-	{
-		m_punkRefCount->AddRef();
-	}
-	return InternalAddRef();
-}
-
-template<class Base>
-inline STDMETHODIMP_(ULONG) CComObjectSharedRef<Base>::Release()
-{
-	ULONG l = InternalRelease();
-	if (!l)
-	{
-		ReleaseAll();
-	}
-	if (m_punkRefCount)
-	{
-		m_punkRefCount->Release();
-	}
-	return l;
-}
-
-template<class Base>
-inline Base* CComObjectSharedRef<Base>::GetContainedObject()
-{
-	return this;
-}
-
-template<class Base>
-inline CComObjectSharedRef<Base>* CComObjectSharedRef<Base>::
-	GetThisObject(const Base* pBase)
-{
-	ATLASSERT(pBase != 0);
-	return const_cast<CComObjectSharedRef<Base>*>(
-		static_cast<const CComObjectSharedRef<Base>*>(pBase));
-}
-
-// ===== CComPolyObjectSharedRef =====
-
-template <class Contained>
-inline CComPolyObjectSharedRef<Contained>::
-	CComPolyObjectSharedRef(IUnknown* punkRefCount, IUnknown* punkOuter) :
-		m_contained(punkOuter ? punkOuter : this),
-		m_punkRefCount(punkRefCount)
-{
-	ATLASSERT(punkRefCount != 0);
-}
-
-#ifdef _ATL_DEBUG_INTERFACES
-template <class Contained>
-inline	CComPolyObjectSharedRef<Contained>::~CComPolyObjectSharedRef()
-{
-#if _ATL_VER < 0x700
-	_Module.DeleteNonAddRefThunk(this);
-#else
-	_AtlDebugInterfacesModule.DeleteNonAddRefThunk(this);
-#endif
-}
-#endif // _ATL_DEBUG_INTERFACES
-
-template <class Contained>
-inline HRESULT CComPolyObjectSharedRef<Contained>::FinalConstruct()
-{
-	InternalAddRef();
-	CComObjectRootEx<Contained::_ThreadModel::ThreadModelNoCS>::
-		FinalConstruct();
-	HRESULT hr;
-#if _ATL_VER >= 0x800
-	hr = m_contained._AtlInitialConstruct();
-	if (SUCCEEDED(hr))
-#endif
-		hr = m_contained.FinalConstruct();
-#if _ATL_VER >= 0x800
-	if (SUCCEEDED(hr))
-		hr = m_contained._AtlFinalConstruct();
-#endif
-	InternalRelease();
-	return hr;
-}
-
-template <class Contained>
-inline void CComPolyObjectSharedRef<Contained>::FinalRelease()
-{
-	CComObjectRootEx<Contained::_ThreadModel::ThreadModelNoCS>::
-		FinalRelease();
-	m_contained.FinalRelease();
-}
-
-template <class Contained>
-inline STDMETHODIMP CComPolyObjectSharedRef<Contained>::QueryInterface(
-	REFIID iid, void** ppvObject)
-{
-	ATLASSERT(ppvObject != 0);
-	if (!ppvObject)
-	{
-		return E_POINTER;
-	}
-	*ppvObject = NULL;
-
-	HRESULT hr = S_OK;
-	if (InlineIsEqualUnknown(iid))
-	{
-		if (ppvObject == NULL)
-		{
-			return E_POINTER;
-		}
-		*ppvObject = static_cast<IUnknown*>(this);
-		AddRef();
-#ifdef _ATL_DEBUG_INTERFACES
-#if _ATL_VER < 0x700
-		_Module.AddThunk((IUnknown**)ppvObject, (LPCTSTR)Contained::_GetEntries()[-1].dw, iid);
-#else
-		_AtlDebugInterfacesModule.AddThunk((IUnknown**)ppvObject, (LPCTSTR)Contained::_GetEntries()[-1].dw, iid);
-#endif
-#endif // _ATL_DEBUG_INTERFACES
-	}
-	else
-	{
-		hr = m_contained._InternalQueryInterface(iid, ppvObject);
-	}
-	return hr;
-}
-
-template <class Contained>
-inline STDMETHODIMP_(ULONG) CComPolyObjectSharedRef<Contained>::AddRef()
-{
-	if (m_punkRefCount)
-	{
-		m_punkRefCount->AddRef();
-	}
-	return InternalAddRef();
-}
-
-template <class Contained>
-inline STDMETHODIMP_(ULONG) CComPolyObjectSharedRef<Contained>::Release()
-{
-	ULONG l = InternalRelease();
-	if (!l)
-	{
-		m_contained.ReleaseAll();
-	}
-	if (m_punkRefCount)
-	{
-		m_punkRefCount->Release();
-	}
-	return l;
-}
-
-template <class Contained>
-inline IUnknown* CComPolyObjectSharedRef<Contained>::GetControllingUnknown()
-{
-	return m_contained.GetControllingUnknown();
-}
-
-template <class Contained>
-Contained* CComPolyObjectSharedRef<Contained>::GetContainedObject()
-{
-	return &m_contained;
-}
-
-template<class Contained>
-inline CComPolyObjectSharedRef<Contained>* CComPolyObjectSharedRef<Contained>::
-	GetThisObject(const Contained* pContained)
-{
-	ATLASSERT(pContained != 0);
-	const CComContainedObject<Contained>* pContainedObject =
-		static_cast<const CComContainedObject<Contained>*>(pContained);
-	return reinterpret_cast<CComPolyObjectSharedRef<Contained>*>(
-		reinterpret_cast<DWORD_PTR>(pContainedObject) -
-			offsetof(CComPolyObjectSharedRef<Contained>, m_contained));
-}
-
-// ===== CComObjectRefCount =====
-
-template <class T, class ThreadModel>
-inline STDMETHODIMP CComObjectRefCount<T, ThreadModel>::
-	QueryInterface(REFIID iid, void** ppvObject)
-{
-	ATLASSERT(false && _T("CComObjectRefCount: QueryInterface should never be called"));
-	return E_NOTIMPL;
-}
-
-template <class T, class ThreadModel>
-inline STDMETHODIMP_(ULONG) CComObjectRefCount<T, ThreadModel>::AddRef()
-{
-	return InternalAddRef();
-}
-
-template <class T, class ThreadModel>
-inline STDMETHODIMP_(ULONG) CComObjectRefCount<T, ThreadModel>::Release()
-{
-	ULONG l = InternalRelease();
-	if (l == 0)
-	{
-		T* pT = reinterpret_cast<T*>(
-			reinterpret_cast<DWORD_PTR>(this) - offsetof(T, m_refCount));
-		delete pT;
-	}
-	return l;
-}
-
-// ===== CComObjectProtSink =====
-
-template <class ProtocolObject, class SinkObject>
-inline CComObjectProtSink<ProtocolObject, SinkObject>::
-	CComObjectProtSink(void* pv) :
-		ProtocolObject(&m_refCount, static_cast<IUnknown*>(pv)),
-		m_sink(&m_refCount)
-{
-#if _ATL_VER < 0x700
-	_Module.Lock();
-#else
-	_pAtlModule->Lock();
-#endif
-}
-
-template <class ProtocolObject, class SinkObject>
-inline CComObjectProtSink<ProtocolObject, SinkObject>::
-	~CComObjectProtSink()
-{
-	m_refCount.m_dwRef = 1;
-	FinalRelease();
-#if _ATL_VER < 0x700
-#ifdef _ATL_DEBUG_INTERFACES
-	_Module.DeleteNonAddRefThunk(this);
-#endif
-	_Module.Unlock();
-#else // _ATL_VER >= 0x700
-#ifdef _ATL_DEBUG_INTERFACES
-	_AtlDebugInterfacesModule.DeleteNonAddRefThunk(this);
-#endif
-	_pAtlModule->Unlock();
-#endif
-}
-
-template <class ProtocolObject, class SinkObject>
-inline HRESULT CComObjectProtSink<ProtocolObject, SinkObject>::
-	FinalConstruct()
-{
-	m_refCount.InternalAddRef();
-	m_refCount.FinalConstruct();
-	HRESULT hr = ProtocolObject::FinalConstruct();
-	HRESULT hrSink;
-#if _ATL_VER >= 0x800
-	hrSink = m_sink._AtlInitialConstruct();
-	if (SUCCEEDED(hrSink))
-#endif
-		hrSink = m_sink.FinalConstruct();
-#if _ATL_VER >= 0x800
-	if (SUCCEEDED(hrSink))
-		hrSink = m_sink._AtlFinalConstruct();
-#endif
-	if (SUCCEEDED(hr) && FAILED(hrSink))
-	{
-		hr = hrSink;
-	}
-	m_refCount.InternalRelease();
-	return hr;
-}
-
-template <class ProtocolObject, class SinkObject>
-inline void CComObjectProtSink<ProtocolObject, SinkObject>::
-	FinalRelease()
-{
-	m_sink.FinalRelease();
-	ProtocolObject::FinalRelease();
-	m_refCount.FinalRelease();
-}
-
-template <class ProtocolObject, class SinkObject>
-inline typename CComObjectProtSink<ProtocolObject, SinkObject>::Protocol*
-CComObjectProtSink<ProtocolObject, SinkObject>::
-	GetProtocol(const typename CComObjectProtSink<ProtocolObject, SinkObject>::Sink* pSink)
-{
-	ATLASSERT(pSink != 0);
-	const SinkObject* pSinkObject = SinkObject::GetThisObject(pSink);
-	CComObjectProtSink* pThis = reinterpret_cast<CComObjectProtSink*>(
-		reinterpret_cast<DWORD_PTR>(pSinkObject) -
-			offsetof(CComObjectProtSink, m_sink));
-	return pThis->ProtocolObject::GetContainedObject();
-}
-
-template <class ProtocolObject, class SinkObject>
-inline typename CComObjectProtSink<ProtocolObject, SinkObject>::Sink*
-CComObjectProtSink<ProtocolObject, SinkObject>::
-	GetSink(const typename CComObjectProtSink<ProtocolObject, SinkObject>::Protocol* pProtocol)
-{
-	ATLASSERT(pProtocol != 0);
-	const ProtocolObject* pProtocolObject =
-		ProtocolObject::GetThisObject(pProtocol);
-	CComObjectProtSink* pThis = const_cast<CComObjectProtSink*>(
-		static_cast<const CComObjectProtSink*>(pProtocolObject));
-	return pThis->m_sink.GetContainedObject();
-}
-
-// ===== CustomSinkStartPolicy =====
-
-template <class Protocol, class Sink>
-inline HRESULT CustomSinkStartPolicy<Protocol, Sink>::OnStart(LPCWSTR szUrl,
-	IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
-	DWORD grfPI, HANDLE_PTR dwReserved,
-	IInternetProtocol* pTargetProtocol) const
-{
-	ATLASSERT(pTargetProtocol != 0);
-
-	Sink* pSink = GetSink(static_cast<const Protocol*>(this));
-	HRESULT hr = pSink->OnStart(szUrl, pOIProtSink, pOIBindInfo, grfPI,
-		dwReserved, pTargetProtocol);
-
-	CComPtr<IInternetProtocolSink> spSink;
-	CComPtr<IInternetBindInfo> spBindInfo;
-	if (SUCCEEDED(hr))
-	{
-		hr = pSink->QueryInterface(IID_IInternetProtocolSink,
-			reinterpret_cast<void**>(&spSink));
-		ATLASSERT(SUCCEEDED(hr) && spSink != 0);
-	}
-	if (SUCCEEDED(hr))
-	{
-		hr = pSink->QueryInterface(IID_IInternetBindInfo,
-			reinterpret_cast<void**>(&spBindInfo));
-		ATLASSERT(SUCCEEDED(hr) && spBindInfo != 0);
-	}
-	if (SUCCEEDED(hr))
-	{
-		hr = pTargetProtocol->Start(szUrl, spSink, spBindInfo, grfPI,
-			dwReserved);
-	}
-	return hr;
-}
-
-template <class Protocol, class Sink>
-inline HRESULT CustomSinkStartPolicy<Protocol, Sink>::OnStartEx(IUri* pUri,
-	IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
-	DWORD grfPI, HANDLE_PTR dwReserved,
-	IInternetProtocolEx* pTargetProtocol) const
-{
-	ATLASSERT(pTargetProtocol != 0);
-
-	Sink* pSink = GetSink(static_cast<const Protocol*>(this));
-	HRESULT hr = pSink->OnStartEx(pUri, pOIProtSink, pOIBindInfo, grfPI,
-		dwReserved, pTargetProtocol);
-
-	CComPtr<IInternetProtocolSink> spSink;
-	CComPtr<IInternetBindInfo> spBindInfo;
-	if (SUCCEEDED(hr))
-	{
-		hr = pSink->QueryInterface(IID_IInternetProtocolSink,
-			reinterpret_cast<void**>(&spSink));
-		ATLASSERT(SUCCEEDED(hr) && spSink != 0);
-	}
-	if (SUCCEEDED(hr))
-	{
-		hr = pSink->QueryInterface(IID_IInternetBindInfo,
-			reinterpret_cast<void**>(&spBindInfo));
-		ATLASSERT(SUCCEEDED(hr) && spBindInfo != 0);
-	}
-	if (SUCCEEDED(hr))
-	{
-		hr = pTargetProtocol->StartEx(pUri, spSink, spBindInfo, grfPI,
-			dwReserved);
-	}
-	return hr;
-}
-
-template <class Protocol, class Sink>
-inline Sink* CustomSinkStartPolicy<Protocol, Sink>::GetSink(
-	const Protocol* pProtocol)
-{
-	return Protocol::ComObjectClass::GetSink(pProtocol);
-}
-
-template <class Protocol, class Sink>
-inline Sink* CustomSinkStartPolicy<Protocol, Sink>::GetSink() const
-{
-	return GetSink(static_cast<const Protocol*>(this));
-}
-
-template <class Protocol, class Sink>
-inline Protocol* CustomSinkStartPolicy<Protocol, Sink>::GetProtocol(
-	const Sink* pSink)
-{
-	return Protocol::ComObjectClass::GetProtocol(pSink);
-}
-
-} // end namespace PassthroughAPP
-
-#endif // PASSTHROUGHAPP_SINKPOLICY_INL
+#ifndef PASSTHROUGHAPP_SINKPOLICY_INL
+#define PASSTHROUGHAPP_SINKPOLICY_INL
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+#ifndef PASSTHROUGHAPP_SINKPOLICY_H
+	#error SinkPolicy.inl requires SinkPolicy.h to be included first
+#endif
+
+namespace PassthroughAPP
+{
+
+// ===== NoSinkStartPolicy =====
+
+inline HRESULT NoSinkStartPolicy::OnStart(LPCWSTR szUrl,
+	IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+	DWORD grfPI, HANDLE_PTR dwReserved,
+	IInternetProtocol* pTargetProtocol) const
+{
+	ATLASSERT(pTargetProtocol != 0);
+	return pTargetProtocol->Start(szUrl, pOIProtSink, pOIBindInfo,
+		grfPI, dwReserved);
+}
+
+inline HRESULT NoSinkStartPolicy::OnStartEx(IUri* pUri,
+	IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+	DWORD grfPI, HANDLE_PTR dwReserved,
+	IInternetProtocolEx* pTargetProtocol) const
+{
+	ATLASSERT(pTargetProtocol != 0);
+	return pTargetProtocol->StartEx(pUri, pOIProtSink, pOIBindInfo,
+		grfPI, dwReserved);
+}
+
+inline HRESULT NoSinkStartPolicy::OnStartDeferred(LPCWSTR szUrl,
+	IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+	DWORD grfPI, HANDLE_PTR dwReserved) const
+{
+	return S_FALSE;
+}
+
+inline HRESULT NoSinkStartPolicy::OnStartExDeferred(IUri* pUri,
+	IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+	DWORD grfPI, HANDLE_PTR dwReserved) const
+{
+	return S_FALSE;
+}
+
+inline HRESULT NoSinkStartPolicy::OnRead(void* pv, ULONG cb, ULONG* pcbRead,
+	IInternetProtocol* pTargetProtocol) const
+{
+	ATLASSERT(pTargetProtocol != 0);
+	return pTargetProtocol->Read(pv, cb, pcbRead);
+}
+
+inline HRESULT NoSinkStartPolicy::OnAbort(HRESULT hrReason, DWORD dwOptions,
+	IInternetProtocol* pTargetProtocol) const
+{
+	ATLASSERT(pTargetProtocol != 0);
+	return pTargetProtocol->Abort(hrReason, dwOptions);
+}
+
+inline HRESULT NoSinkStartPolicy::OnTerminate(DWORD dwOptions,
+	IInternetProtocol* pTargetProtocol) const
+{
+	ATLASSERT(pTargetProtocol != 0);
+	return pTargetProtocol->Terminate(dwOptions);
+}
+
+inline HRESULT NoSinkStartPolicy::OnContinue(PROTOCOLDATA* pProtocolData,
+	IInternetProtocol* pTargetProtocol) const
+{
+	ATLASSERT(pTargetProtocol != 0);
+	return pTargetProtocol->Continue(pProtocolData);
+}
+
+inline HRESULT NoSinkStartPolicy::OnSetPriority(LONG nPriority,
+	IInternetPriority* pTargetPriority) const
+{
+	return pTargetPriority ? pTargetPriority->SetPriority(nPriority) : S_OK;
+}
+
+inline bool NoSinkStartPolicy::IsRespondingLocally() const
+{
+	return false;
+}
+
+inline Detail::LocalResponder* NoSinkStartPolicy::GetLocalResponder() const
+{
+	return 0;
+}
+
+namespace Detail
+{
+
+#ifdef PASSTHROUGHAPP_SINGLE_REFCOUNT
+
+// ===== PackedRefPart =====
+
+inline ULONG PackedRefPart::AddRef()
+{
+	ATLASSERT(m_pRefCount != 0);
+	LONGLONG llUnit = static_cast<LONGLONG>(1) << m_nShift;
+	LONGLONG llRef =
+		InterlockedExchangeAdd64(&m_pRefCount->m_llRef, llUnit) + llUnit;
+	return static_cast<ULONG>((llRef >> m_nShift) &
+		((1 << PackedRefCount::cFieldBits) - 1));
+}
+
+inline ULONG PackedRefPart::Release(bool* pbPinned)
+{
+	ATLASSERT(m_pRefCount != 0);
+	ATLASSERT(pbPinned != 0);
+	LONGLONG llUnit = static_cast<LONGLONG>(1) << m_nShift;
+	LONGLONG llPin = static_cast<LONGLONG>(1) << PackedRefCount::shiftPin;
+
+	LONGLONG llRef = m_pRefCount->m_llRef;
+	for (;;)
+	{
+		LONGLONG llPart = (llRef >> m_nShift) &
+			((1 << PackedRefCount::cFieldBits) - 1);
+		ATLASSERT(llPart != 0);
+
+		// The last reference to the part turns into a pin in the same
+		// operation, so that the object outlives the part's ReleaseAll
+		LONGLONG llNew = llRef - llUnit + (llPart == 1 ? llPin : 0);
+		LONGLONG llPrevious = InterlockedCompareExchange64(
+			&m_pRefCount->m_llRef, llNew, llRef);
+		if (llPrevious == llRef)
+		{
+			*pbPinned = (llPart == 1);
+			return static_cast<ULONG>(llPart - 1);
+		}
+		llRef = llPrevious;
+	}
+}
+
+inline void PackedRefPart::Unpin()
+{
+	ATLASSERT(m_pRefCount != 0);
+	if (m_pRefCount->Unpin())
+	{
+		m_pRefCount->m_pfnDestroy(m_pRefCount);
+	}
+}
+
+// ===== PackedRefCount =====
+
+inline PackedRefCount::PackedRefCount(DestroyFunc pfnDestroy) :
+	m_llRef(0), m_pfnDestroy(pfnDestroy)
+{
+	ATLASSERT(pfnDestroy != 0);
+	m_protocolPart.m_pRefCount = this;
+	m_protocolPart.m_nShift = shiftProtocol;
+	m_sinkPart.m_pRefCount = this;
+	m_sinkPart.m_nShift = shiftSink;
+}
+
+inline void PackedRefCount::Pin()
+{
+	InterlockedExchangeAdd64(&m_llRef,
+		static_cast<LONGLONG>(1) << shiftPin);
+}
+
+inline bool PackedRefCount::Unpin()
+{
+	LONGLONG llPin = static_cast<LONGLONG>(1) << shiftPin;
+	return InterlockedExchangeAdd64(&m_llRef, -llPin) == llPin;
+}
+
+#else
+
+// ===== SharedRefPart =====
+
+inline ULONG SharedRefPart::AddRef()
+{
+	ATLASSERT(m_pObject != 0);
+	m_pObject->AddRef();
+	return InterlockedIncrement(m_plRef);
+}
+
+inline ULONG SharedRefPart::Release(bool* pbPinned)
+{
+	ATLASSERT(m_pObject != 0);
+	ATLASSERT(pbPinned != 0);
+	ULONG l = InterlockedDecrement(m_plRef);
+	*pbPinned = (l == 0);
+	if (l)
+	{
+		m_pObject->Release();
+	}
+	return l;
+}
+
+inline void SharedRefPart::Unpin()
+{
+	ATLASSERT(m_pObject != 0);
+	m_pObject->Release();
+}
+
+#endif // PASSTHROUGHAPP_SINGLE_REFCOUNT
+
+} // end namespace PassthroughAPP::Detail
+
+// ===== CComObjectSharedRef =====
+
+template<class Base>
+inline CComObjectSharedRef<Base>::
+	CComObjectSharedRef(Detail::RefCountPart* pRefCount, IUnknown*) :
+		m_pRefCount(pRefCount)
+{
+	ATLASSERT(pRefCount != 0);
+}
+
+#ifdef _ATL_DEBUG_INTERFACES
+template<class Base>
+inline CComObjectSharedRef<Base>::~CComObjectSharedRef()
+{
+#if _ATL_VER < 0x700
+	_Module.DeleteNonAddRefThunk(_GetRawUnknown());
+#else
+	_AtlDebugInterfacesModule.DeleteNonAddRefThunk(_GetRawUnknown());
+#endif
+}
+#endif // _ATL_DEBUG_INTERFACES
+
+template<class Base>
+inline STDMETHODIMP CComObjectSharedRef<Base>::QueryInterface(REFIID iid,
+	void** ppvObject)
+{
+	return this->_InternalQueryInterface(iid, ppvObject);
+}
+
+template<class Base>
+inline STDMETHODIMP_(ULONG) CComObjectSharedRef<Base>::AddRef()
+{
+	return m_pRefCount->AddRef();
+}
+
+template<class Base>
+inline STDMETHODIMP_(ULONG) CComObjectSharedRef<Base>::Release()
+{
+	bool bPinned = false;
+	ULONG l = m_pRefCount->Release(&bPinned);
+	if (bPinned)
+	{
+		this->ReleaseAll();
+		m_pRefCount->Unpin();
+	}
+	return l;
+}
+
+template<class Base>
+inline Base* CComObjectSharedRef<Base>::GetContainedObject()
+{
+	return this;
+}
+
+template<class Base>
+inline CComObjectSharedRef<Base>* CComObjectSharedRef<Base>::
+	GetThisObject(const Base* pBase)
+{
+	ATLASSERT(pBase != 0);
+	return const_cast<CComObjectSharedRef<Base>*>(
+		static_cast<const CComObjectSharedRef<Base>*>(pBase));
+}
+
+// ===== CComPolyObjectSharedRef =====
+
+template <class Contained>
+inline CComPolyObjectSharedRef<Contained>::
+	CComPolyObjectSharedRef(Detail::RefCountPart* pRefCount,
+		IUnknown* punkOuter) :
+		m_contained(punkOuter ? punkOuter : this),
+		m_pRefCount(pRefCount)
+{
+	ATLASSERT(pRefCount != 0);
+}
+
+#ifdef _ATL_DEBUG_INTERFACES
+template <class Contained>
+inline	CComPolyObjectSharedRef<Contained>::~CComPolyObjectSharedRef()
+{
+#if _ATL_VER < 0x700
+	_Module.DeleteNonAddRefThunk(this);
+#else
+	_AtlDebugInterfacesModule.DeleteNonAddRefThunk(this);
+#endif
+}
+#endif // _ATL_DEBUG_INTERFACES
+
+template <class Contained>
+inline HRESULT CComPolyObjectSharedRef<Contained>::FinalConstruct()
+{
+	this->InternalAddRef();
+	CComObjectRootEx<typename Contained::_ThreadModel::ThreadModelNoCS>::
+		FinalConstruct();
+	HRESULT hr;
+#if _ATL_VER >= 0x800
+	hr = m_contained._AtlInitialConstruct();
+	if (SUCCEEDED(hr))
+#endif
+		hr = m_contained.FinalConstruct();
+#if _ATL_VER >= 0x800
+	if (SUCCEEDED(hr))
+		hr = m_contained._AtlFinalConstruct();
+#endif
+	this->InternalRelease();
+	return hr;
+}
+
+template <class Contained>
+inline void CComPolyObjectSharedRef<Contained>::FinalRelease()
+{
+	CComObjectRootEx<typename Contained::_ThreadModel::ThreadModelNoCS>::
+		FinalRelease();
+	m_contained.FinalRelease();
+}
+
+template <class Contained>
+inline STDMETHODIMP CComPolyObjectSharedRef<Contained>::QueryInterface(
+	REFIID iid, void** ppvObject)
+{
+	ATLASSERT(ppvObject != 0);
+	if (!ppvObject)
+	{
+		return E_POINTER;
+	}
+	*ppvObject = NULL;
+
+	HRESULT hr = S_OK;
+	if (InlineIsEqualUnknown(iid))
+	{
+		if (ppvObject == NULL)
+		{
+			return E_POINTER;
+		}
+		*ppvObject = static_cast<IUnknown*>(this);
+		AddRef();
+#ifdef _ATL_DEBUG_INTERFACES
+#if _ATL_VER < 0x700
+		_Module.AddThunk((IUnknown**)ppvObject, (LPCTSTR)Contained::_GetEntries()[-1].dw, iid);
+#else
+		_AtlDebugInterfacesModule.AddThunk((IUnknown**)ppvObject, (LPCTSTR)Contained::_GetEntries()[-1].dw, iid);
+#endif
+#endif // _ATL_DEBUG_INTERFACES
+	}
+	else
+	{
+		hr = m_contained._InternalQueryInterface(iid, ppvObject);
+	}
+	return hr;
+}
+
+template <class Contained>
+inline STDMETHODIMP_(ULONG) CComPolyObjectSharedRef<Contained>::AddRef()
+{
+	return m_pRefCount->AddRef();
+}
+
+template <class Contained>
+inline STDMETHODIMP_(ULONG) CComPolyObjectSharedRef<Contained>::Release()
+{
+	bool bPinned = false;
+	ULONG l = m_pRefCount->Release(&bPinned);
+	if (bPinned)
+	{
+		m_contained.ReleaseAll();
+		m_pRefCount->Unpin();
+	}
+	return l;
+}
+
+template <class Contained>
+inline IUnknown* CComPolyObjectSharedRef<Contained>::GetControllingUnknown()
+{
+	return m_contained.GetControllingUnknown();
+}
+
+template <class Contained>
+Contained* CComPolyObjectSharedRef<Contained>::GetContainedObject()
+{
+	return &m_contained;
+}
+
+template<class Contained>
+inline CComPolyObjectSharedRef<Contained>* CComPolyObjectSharedRef<Contained>::
+	GetThisObject(const Contained* pContained)
+{
+	ATLASSERT(pContained != 0);
+	const CComContainedObject<Contained>* pContainedObject =
+		static_cast<const CComContainedObject<Contained>*>(pContained);
+	return reinterpret_cast<CComPolyObjectSharedRef<Contained>*>(
+		reinterpret_cast<DWORD_PTR>(pContainedObject) -
+			offsetof(CComPolyObjectSharedRef<Contained>, m_contained));
+}
+
+// ===== CComObjectRefCount =====
+
+#ifdef PASSTHROUGHAPP_SINGLE_REFCOUNT
+
+template <class T, class ThreadModel>
+inline CComObjectRefCount<T, ThreadModel>::CComObjectRefCount() :
+	Detail::PackedRefCount(&Destroy)
+{
+}
+
+template <class T, class ThreadModel>
+inline ULONG CComObjectRefCount<T, ThreadModel>::InternalAddRef()
+{
+	this->Pin();
+	return 1;
+}
+
+template <class T, class ThreadModel>
+inline ULONG CComObjectRefCount<T, ThreadModel>::InternalRelease()
+{
+	// Unlike the parts' Release, leaves the object alive at zero, as
+	// CComObjectRootEx::InternalRelease does
+	return this->Unpin() ? 0 : 1;
+}
+
+template <class T, class ThreadModel>
+inline void CComObjectRefCount<T, ThreadModel>::Destroy(
+	Detail::PackedRefCount* pRefCount)
+{
+	delete T::GetThisObject(static_cast<CComObjectRefCount*>(pRefCount));
+}
+
+#else
+
+template <class T, class ThreadModel>
+inline CComObjectRefCount<T, ThreadModel>::CComObjectRefCount()
+{
+	m_protocolPart.m_pObject = this;
+	m_protocolPart.m_plRef = &m_protocolPart.m_lRef;
+	m_protocolPart.m_lRef = 0;
+	m_sinkPart.m_pObject = this;
+	m_sinkPart.m_plRef = &m_sinkPart.m_lRef;
+	m_sinkPart.m_lRef = 0;
+}
+
+template <class T, class ThreadModel>
+inline STDMETHODIMP CComObjectRefCount<T, ThreadModel>::
+	QueryInterface(REFIID iid, void** ppvObject)
+{
+	ATLASSERT(false && _T("CComObjectRefCount: QueryInterface should never be called"));
+	return E_NOTIMPL;
+}
+
+template <class T, class ThreadModel>
+inline STDMETHODIMP_(ULONG) CComObjectRefCount<T, ThreadModel>::AddRef()
+{
+	return this->InternalAddRef();
+}
+
+template <class T, class ThreadModel>
+inline STDMETHODIMP_(ULONG) CComObjectRefCount<T, ThreadModel>::Release()
+{
+	ULONG l = this->InternalRelease();
+	if (l == 0)
+	{
+		delete T::GetThisObject(this);
+	}
+	return l;
+}
+
+#endif // PASSTHROUGHAPP_SINGLE_REFCOUNT
+
+// ===== HeapAllocPolicy =====
+
+inline void* HeapAllocPolicy::Allocate(size_t cb)
+{
+	return ::operator new(cb, std::nothrow);
+}
+
+inline void HeapAllocPolicy::Free(void* pv)
+{
+	::operator delete(pv);
+}
+
+// ===== PooledAllocPolicy =====
+
+// All zeros is the initialized state of an SLIST_HEADER, so static
+// initialization is enough and there is no first-use race
+template <class Tag>
+SLIST_HEADER PooledAllocPolicy<Tag>::s_freeList;
+
+template <class Tag>
+LONG PooledAllocPolicy<Tag>::s_cMaxFree = 64;
+
+template <class Tag>
+LONG PooledAllocPolicy<Tag>::s_cHits = 0;
+
+template <class Tag>
+LONG PooledAllocPolicy<Tag>::s_cMisses = 0;
+
+template <class Tag>
+LONG PooledAllocPolicy<Tag>::s_cOutstanding = 0;
+
+template <class Tag>
+LONG PooledAllocPolicy<Tag>::s_cHighWater = 0;
+
+template <class Tag>
+LONG PooledAllocPolicy<Tag>::s_cFree = 0;
+
+template <class Tag>
+inline void* PooledAllocPolicy<Tag>::Allocate(size_t cb)
+{
+	ATLASSERT(cb >= sizeof(SLIST_ENTRY));
+
+	void* pv = InterlockedPopEntrySList(&s_freeList);
+	if (pv)
+	{
+		InterlockedDecrement(&s_cFree);
+		InterlockedIncrement(&s_cHits);
+	}
+	else
+	{
+		pv = ::operator new(cb, std::nothrow);
+		if (!pv)
+		{
+			return 0;
+		}
+		// Interlocked lists require aligned entries; heap blocks are
+		ATLASSERT((reinterpret_cast<DWORD_PTR>(pv) &
+			(MEMORY_ALLOCATION_ALIGNMENT - 1)) == 0);
+		InterlockedIncrement(&s_cMisses);
+	}
+
+	LONG cOutstanding = InterlockedIncrement(&s_cOutstanding);
+	LONG cHighWater = s_cHighWater;
+	while (cOutstanding > cHighWater)
+	{
+		LONG cPrevious = InterlockedCompareExchange(&s_cHighWater,
+			cOutstanding, cHighWater);
+		if (cPrevious == cHighWater)
+		{
+			break;
+		}
+		cHighWater = cPrevious;
+	}
+	return pv;
+}
+
+template <class Tag>
+inline void PooledAllocPolicy<Tag>::Free(void* pv)
+{
+	if (!pv)
+	{
+		return;
+	}
+
+	InterlockedDecrement(&s_cOutstanding);
+	if (InterlockedIncrement(&s_cFree) <= s_cMaxFree)
+	{
+		InterlockedPushEntrySList(&s_freeList,
+			static_cast<PSLIST_ENTRY>(pv));
+	}
+	else
+	{
+		InterlockedDecrement(&s_cFree);
+		::operator delete(pv);
+	}
+}
+
+template <class Tag>
+inline void PooledAllocPolicy<Tag>::GetStatistics(PoolStatistics* pStats)
+{
+	ATLASSERT(pStats != 0);
+	pStats->cHits = s_cHits;
+	pStats->cMisses = s_cMisses;
+	pStats->cOutstanding = s_cOutstanding;
+	pStats->cHighWater = s_cHighWater;
+	pStats->cFree = s_cFree;
+}
+
+template <class Tag>
+inline void PooledAllocPolicy<Tag>::SetMaxFree(LONG cMaxFree)
+{
+	ATLASSERT(cMaxFree >= 0);
+	InterlockedExchange(&s_cMaxFree, cMaxFree);
+}
+
+template <class Tag>
+inline void PooledAllocPolicy<Tag>::Trim()
+{
+	PSLIST_ENTRY pEntry = InterlockedFlushSList(&s_freeList);
+	while (pEntry)
+	{
+		PSLIST_ENTRY pNext = pEntry->Next;
+		::operator delete(pEntry);
+		InterlockedDecrement(&s_cFree);
+		pEntry = pNext;
+	}
+}
+
+// ===== CComObjectProtSink =====
+
+template <class ProtocolObject, class SinkObject, class AllocPolicy,
+	class LayoutPolicy>
+inline CComObjectProtSink<ProtocolObject, SinkObject, AllocPolicy, LayoutPolicy>::
+	CComObjectProtSink(void* pv) :
+		ProtocolObject(&m_refCount.m_protocolPart,
+			static_cast<IUnknown*>(pv)),
+		m_sink(&m_refCount.m_sinkPart)
+{
+#ifndef PASSTHROUGHAPP_SINGLE_REFCOUNT
+	if (!LayoutPolicy::bMovePartCounts)
+	{
+		m_refCount.m_protocolPart.m_plRef = &this->m_dwRef;
+		m_refCount.m_sinkPart.m_plRef = &m_sink.m_dwRef;
+	}
+#endif
+#if _ATL_VER < 0x700
+	_Module.Lock();
+#else
+	_pAtlModule->Lock();
+#endif
+}
+
+template <class ProtocolObject, class SinkObject, class AllocPolicy,
+	class LayoutPolicy>
+inline CComObjectProtSink<ProtocolObject, SinkObject, AllocPolicy, LayoutPolicy>::
+	~CComObjectProtSink()
+{
+	m_refCount.m_dwRef = 1;
+	FinalRelease();
+#if _ATL_VER < 0x700
+#ifdef _ATL_DEBUG_INTERFACES
+	_Module.DeleteNonAddRefThunk(this);
+#endif
+	_Module.Unlock();
+#else // _ATL_VER >= 0x700
+#ifdef _ATL_DEBUG_INTERFACES
+	_AtlDebugInterfacesModule.DeleteNonAddRefThunk(this);
+#endif
+	_pAtlModule->Unlock();
+#endif
+}
+
+template <class ProtocolObject, class SinkObject, class AllocPolicy,
+	class LayoutPolicy>
+inline void* CComObjectProtSink<ProtocolObject, SinkObject, AllocPolicy, LayoutPolicy>::
+	operator new(size_t cb) throw()
+{
+	return AllocPolicy::Allocate(cb);
+}
+
+template <class ProtocolObject, class SinkObject, class AllocPolicy,
+	class LayoutPolicy>
+inline void* CComObjectProtSink<ProtocolObject, SinkObject, AllocPolicy, LayoutPolicy>::
+	operator new(size_t cb, const std::nothrow_t&) throw()
+{
+	return AllocPolicy::Allocate(cb);
+}
+
+template <class ProtocolObject, class SinkObject, class AllocPolicy,
+	class LayoutPolicy>
+inline void CComObjectProtSink<ProtocolObject, SinkObject, AllocPolicy, LayoutPolicy>::
+	operator delete(void* pv)
+{
+	AllocPolicy::Free(pv);
+}
+
+template <class ProtocolObject, class SinkObject, class AllocPolicy,
+	class LayoutPolicy>
+inline void CComObjectProtSink<ProtocolObject, SinkObject, AllocPolicy, LayoutPolicy>::
+	operator delete(void* pv, const std::nothrow_t&)
+{
+	AllocPolicy::Free(pv);
+}
+
+template <class ProtocolObject, class SinkObject, class AllocPolicy,
+	class LayoutPolicy>
+inline HRESULT CComObjectProtSink<ProtocolObject, SinkObject, AllocPolicy, LayoutPolicy>::
+	FinalConstruct()
+{
+	m_refCount.InternalAddRef();
+	m_refCount.FinalConstruct();
+	HRESULT hr = ProtocolObject::FinalConstruct();
+	HRESULT hrSink;
+#if _ATL_VER >= 0x800
+	hrSink = m_sink._AtlInitialConstruct();
+	if (SUCCEEDED(hrSink))
+#endif
+		hrSink = m_sink.FinalConstruct();
+#if _ATL_VER >= 0x800
+	if (SUCCEEDED(hrSink))
+		hrSink = m_sink._AtlFinalConstruct();
+#endif
+	if (SUCCEEDED(hr) && FAILED(hrSink))
+	{
+		hr = hrSink;
+	}
+	m_refCount.InternalRelease();
+	return hr;
+}
+
+template <class ProtocolObject, class SinkObject, class AllocPolicy,
+	class LayoutPolicy>
+inline void CComObjectProtSink<ProtocolObject, SinkObject, AllocPolicy, LayoutPolicy>::
+	FinalRelease()
+{
+	m_sink.FinalRelease();
+	ProtocolObject::FinalRelease();
+	m_refCount.FinalRelease();
+}
+
+template <class ProtocolObject, class SinkObject, class AllocPolicy,
+	class LayoutPolicy>
+inline typename CComObjectProtSink<ProtocolObject, SinkObject, AllocPolicy, LayoutPolicy>::Protocol*
+CComObjectProtSink<ProtocolObject, SinkObject, AllocPolicy, LayoutPolicy>::
+	GetProtocol(const typename CComObjectProtSink<ProtocolObject, SinkObject, AllocPolicy, LayoutPolicy>::Sink* pSink)
+{
+	ATLASSERT(pSink != 0);
+	const SinkObject* pSinkObject = SinkObject::GetThisObject(pSink);
+	CComObjectProtSink* pThis = reinterpret_cast<CComObjectProtSink*>(
+		reinterpret_cast<DWORD_PTR>(pSinkObject) -
+			offsetof(CComObjectProtSink, m_sink));
+	return pThis->ProtocolObject::GetContainedObject();
+}
+
+template <class ProtocolObject, class SinkObject, class AllocPolicy,
+	class LayoutPolicy>
+inline typename CComObjectProtSink<ProtocolObject, SinkObject, AllocPolicy, LayoutPolicy>::Sink*
+CComObjectProtSink<ProtocolObject, SinkObject, AllocPolicy, LayoutPolicy>::
+	GetSink(const typename CComObjectProtSink<ProtocolObject, SinkObject, AllocPolicy, LayoutPolicy>::Protocol* pProtocol)
+{
+	ATLASSERT(pProtocol != 0);
+	const ProtocolObject* pProtocolObject =
+		ProtocolObject::GetThisObject(pProtocol);
+	CComObjectProtSink* pThis = const_cast<CComObjectProtSink*>(
+		static_cast<const CComObjectProtSink*>(pProtocolObject));
+	return pThis->m_sink.GetContainedObject();
+}
+
+template <class ProtocolObject, class SinkObject, class AllocPolicy,
+	class LayoutPolicy>
+inline CComObjectProtSink<ProtocolObject, SinkObject, AllocPolicy, LayoutPolicy>*
+CComObjectProtSink<ProtocolObject, SinkObject, AllocPolicy, LayoutPolicy>::
+	GetThisObject(const typename CComObjectProtSink<ProtocolObject, SinkObject, AllocPolicy, LayoutPolicy>::RefCountObject* pRefCount)
+{
+	ATLASSERT(pRefCount != 0);
+	// The layout policy may put padding in front of RefCountObject
+	const RefCountSlot* pSlot = static_cast<const RefCountSlot*>(pRefCount);
+	return reinterpret_cast<CComObjectProtSink*>(
+		reinterpret_cast<DWORD_PTR>(pSlot) -
+			offsetof(CComObjectProtSink, m_refCount));
+}
+
+// ===== CustomSinkStartPolicy =====
+
+template <class Protocol, class Sink>
+inline HRESULT CustomSinkStartPolicy<Protocol, Sink>::OnStart(LPCWSTR szUrl,
+	IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+	DWORD grfPI, HANDLE_PTR dwReserved,
+	IInternetProtocol* pTargetProtocol) const
+{
+	ATLASSERT(pTargetProtocol != 0);
+
+	Sink* pSink = GetSink(static_cast<const Protocol*>(this));
+	HRESULT hr = pSink->OnStart(szUrl, pOIProtSink, pOIBindInfo, grfPI,
+		dwReserved, pTargetProtocol);
+
+	CComPtr<IInternetProtocolSink> spSink;
+	CComPtr<IInternetBindInfo> spBindInfo;
+	if (SUCCEEDED(hr))
+	{
+		hr = pSink->QueryInterface(IID_IInternetProtocolSink,
+			reinterpret_cast<void**>(&spSink));
+		ATLASSERT(SUCCEEDED(hr) && spSink != 0);
+	}
+	if (SUCCEEDED(hr))
+	{
+		hr = pSink->QueryInterface(IID_IInternetBindInfo,
+			reinterpret_cast<void**>(&spBindInfo));
+		ATLASSERT(SUCCEEDED(hr) && spBindInfo != 0);
+	}
+	if (SUCCEEDED(hr))
+	{
+		hr = pTargetProtocol->Start(szUrl, spSink, spBindInfo, grfPI,
+			dwReserved);
+	}
+	return hr;
+}
+
+template <class Protocol, class Sink>
+inline HRESULT CustomSinkStartPolicy<Protocol, Sink>::OnStartEx(IUri* pUri,
+	IInternetProtocolSink *pOIProtSink, IInternetBindInfo *pOIBindInfo,
+	DWORD grfPI, HANDLE_PTR dwReserved,
+	IInternetProtocolEx* pTargetProtocol) const
+{
+	ATLASSERT(pTargetProtocol != 0);
+
+	Sink* pSink = GetSink(static_cast<const Protocol*>(this));
+	HRESULT hr = pSink->OnStartEx(pUri, pOIProtSink, pOIBindInfo, grfPI,
+		dwReserved, pTargetProtocol);
+
+	CComPtr<IInternetProtocolSink> spSink;
+	CComPtr<IInternetBindInfo> spBindInfo;
+	if (SUCCEEDED(hr))
+	{
+		hr = pSink->QueryInterface(IID_IInternetProtocolSink,
+			reinterpret_cast<void**>(&spSink));
+		ATLASSERT(SUCCEEDED(hr) && spSink != 0);
+	}
+	if (SUCCEEDED(hr))
+	{
+		hr = pSink->QueryInterface(IID_IInternetBindInfo,
+			reinterpret_cast<void**>(&spBindInfo));
+		ATLASSERT(SUCCEEDED(hr) && spBindInfo != 0);
+	}
+	if (SUCCEEDED(hr))
+	{
+		hr = pTargetProtocol->StartEx(pUri, spSink, spBindInfo, grfPI,
+			dwReserved);
+	}
+	return hr;
+}
+
+template <class Protocol, class Sink>
+inline HRESULT CustomSinkStartPolicy<Protocol, Sink>::OnStartDeferred(
+	LPCWSTR szUrl, IInternetProtocolSink *pOIProtSink,
+	IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved) const
+{
+	return S_FALSE;
+}
+
+template <class Protocol, class Sink>
+inline HRESULT CustomSinkStartPolicy<Protocol, Sink>::OnStartExDeferred(
+	IUri* pUri, IInternetProtocolSink *pOIProtSink,
+	IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved) const
+{
+	return S_FALSE;
+}
+
+template <class Protocol, class Sink>
+inline HRESULT CustomSinkStartPolicy<Protocol, Sink>::OnRead(void* pv,
+	ULONG cb, ULONG* pcbRead, IInternetProtocol* pTargetProtocol) const
+{
+	ATLASSERT(pTargetProtocol != 0);
+	return pTargetProtocol->Read(pv, cb, pcbRead);
+}
+
+template <class Protocol, class Sink>
+inline HRESULT CustomSinkStartPolicy<Protocol, Sink>::OnAbort(
+	HRESULT hrReason, DWORD dwOptions,
+	IInternetProtocol* pTargetProtocol) const
+{
+	ATLASSERT(pTargetProtocol != 0);
+	return pTargetProtocol->Abort(hrReason, dwOptions);
+}
+
+template <class Protocol, class Sink>
+inline HRESULT CustomSinkStartPolicy<Protocol, Sink>::OnTerminate(
+	DWORD dwOptions, IInternetProtocol* pTargetProtocol) const
+{
+	ATLASSERT(pTargetProtocol != 0);
+	return pTargetProtocol->Terminate(dwOptions);
+}
+
+template <class Protocol, class Sink>
+inline HRESULT CustomSinkStartPolicy<Protocol, Sink>::OnContinue(
+	PROTOCOLDATA* pProtocolData, IInternetProtocol* pTargetProtocol) const
+{
+	ATLASSERT(pTargetProtocol != 0);
+	return pTargetProtocol->Continue(pProtocolData);
+}
+
+template <class Protocol, class Sink>
+inline HRESULT CustomSinkStartPolicy<Protocol, Sink>::OnSetPriority(
+	LONG nPriority, IInternetPriority* pTargetPriority) const
+{
+	return pTargetPriority ? pTargetPriority->SetPriority(nPriority) : S_OK;
+}
+
+template <class Protocol, class Sink>
+inline bool CustomSinkStartPolicy<Protocol, Sink>::IsRespondingLocally() const
+{
+	return false;
+}
+
+template <class Protocol, class Sink>
+inline Detail::LocalResponder*
+	CustomSinkStartPolicy<Protocol, Sink>::GetLocalResponder() const
+{
+	return 0;
+}
+
+template <class Protocol, class Sink>
+inline Sink* CustomSinkStartPolicy<Protocol, Sink>::GetSink(
+	const Protocol* pProtocol)
+{
+	return Protocol::ComObjectClass::GetSink(pProtocol);
+}
+
+template <class Protocol, class Sink>
+inline Sink* CustomSinkStartPolicy<Protocol, Sink>::GetSink() const
+{
+	return GetSink(static_cast<const Protocol*>(this));
+}
+
+template <class Protocol, class Sink>
+inline Protocol* CustomSinkStartPolicy<Protocol, Sink>::GetProtocol(
+	const Sink* pSink)
+{
+	return Protocol::ComObjectClass::GetProtocol(pSink);
+}
+
+namespace Detail
+{
+
+// ===== Start policy helpers =====
+
+inline HRESULT GetBindVerb(IInternetBindInfo* pOIBindInfo, DWORD* pgrfBINDF,
+	DWORD* pdwBindVerb)
+{
+	ATLASSERT(pOIBindInfo != 0);
+	ATLASSERT(pgrfBINDF != 0);
+	ATLASSERT(pdwBindVerb != 0);
+	*pgrfBINDF = 0;
+	BINDINFO bindInfo;
+	memset(&bindInfo, 0, sizeof(bindInfo));
+	bindInfo.cbSize = sizeof(bindInfo);
+	HRESULT hr = pOIBindInfo->GetBindInfo(pgrfBINDF, &bindInfo);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+	*pdwBindVerb = bindInfo.dwBindVerb;
+	ReleaseBindInfo(&bindInfo);
+	return S_OK;
+}
+
+inline bool IsReload(DWORD grfBINDF)
+{
+	return (grfBINDF & (BINDF_GETNEWESTVERSION | BINDF_RESYNCHRONIZE |
+		BINDF_PRAGMA_NO_CACHE)) != 0;
+}
+
+inline HRESULT GetRequestUrl(LPCWSTR szUrl, IUri* pUri, BSTR* pbstrUrl,
+	LPCWSTR* pszUrl)
+{
+	ATLASSERT(pbstrUrl != 0);
+	ATLASSERT(pszUrl != 0);
+	if (pUri)
+	{
+		HRESULT hr = pUri->GetAbsoluteUri(pbstrUrl);
+		if (FAILED(hr))
+		{
+			return hr;
+		}
+		szUrl = *pbstrUrl;
+	}
+	else
+	{
+		ATLASSERT(szUrl != 0);
+	}
+	*pszUrl = szUrl;
+	return szUrl ? S_OK : E_UNEXPECTED;
+}
+
+// ===== DeferredStart =====
+
+inline DeferredStart::DeferredStart() :
+	m_grfPI(0)
+{
+}
+
+inline bool DeferredStart::CanDefer(DWORD grfPI, HANDLE_PTR dwReserved)
+{
+	return !dwReserved && !(grfPI & PI_FILTER_MODE);
+}
+
+inline HRESULT DeferredStart::Defer(LPCWSTR szUrl, IUri* pUri,
+	IInternetProtocolSink* pOIProtSink, IInternetBindInfo* pOIBindInfo,
+	DWORD grfPI)
+{
+	ATLASSERT(!IsDeferred());
+	ATLASSERT(pOIProtSink != 0);
+	if (pUri)
+	{
+		m_spUri = pUri;
+	}
+	else
+	{
+		ATLASSERT(szUrl != 0);
+		m_bstrUrl = szUrl;
+		if (!m_bstrUrl)
+		{
+			return E_OUTOFMEMORY;
+		}
+	}
+	m_spSink = pOIProtSink;
+	m_spBindInfo = pOIBindInfo;
+	m_grfPI = grfPI;
+	return S_OK;
+}
+
+inline bool DeferredStart::IsDeferred() const
+{
+	return m_spSink != 0;
+}
+
+inline void DeferredStart::Cancel()
+{
+	m_bstrUrl.Empty();
+	m_spUri.Release();
+	m_spSink.Release();
+	m_spBindInfo.Release();
+}
+
+inline void DeferredStart::Abort(HRESULT hrReason)
+{
+	CComPtr<IInternetProtocolSink> spSink;
+	spSink.Attach(m_spSink.Detach());
+	Cancel();
+	if (spSink)
+	{
+		spSink->ReportResult(hrReason, 0, 0);
+	}
+}
+
+template <class BasePolicy, class Protocol>
+inline HRESULT DeferredStart::Start(const BasePolicy* pPolicy,
+	Protocol* pProtocol)
+{
+	ATLASSERT(pPolicy != 0);
+	ATLASSERT(pProtocol != 0);
+	if (!IsDeferred())
+	{
+		return S_FALSE;
+	}
+	CComPtr<IUnknown> spKeepAlive(pProtocol->GetUnknown());
+
+	CComPtr<IInternetProtocolSink> spSink;
+	spSink.Attach(m_spSink.Detach());
+	CComPtr<IInternetBindInfo> spBindInfo;
+	spBindInfo.Attach(m_spBindInfo.Detach());
+	CComPtr<IUri> spUri;
+	spUri.Attach(m_spUri.Detach());
+	CComBSTR bstrUrl;
+	bstrUrl.Attach(m_bstrUrl.Detach());
+
+	HRESULT hr = E_UNEXPECTED;
+	if (spUri)
+	{
+		if (pProtocol->m_spInternetProtocolEx)
+		{
+			hr = pPolicy->OnStartEx(spUri, spSink, spBindInfo, m_grfPI, 0,
+				pProtocol->m_spInternetProtocolEx);
+		}
+	}
+	else if (pProtocol->m_spInternetProtocol)
+	{
+		hr = pPolicy->OnStart(bstrUrl, spSink, spBindInfo, m_grfPI, 0,
+			pProtocol->m_spInternetProtocol);
+	}
+	if (FAILED(hr))
+	{
+		spSink->ReportResult(hr, 0, 0);
+	}
+	return hr;
+}
+
+// ===== LocalResponderPolicy =====
+
+template <class BasePolicy>
+inline bool LocalResponderPolicy<BasePolicy>::IsRespondingLocally() const
+{
+	return m_responder.IsActive() || BasePolicy::IsRespondingLocally();
+}
+
+template <class BasePolicy>
+inline LocalResponder* LocalResponderPolicy<BasePolicy>::GetLocalResponder()
+	const
+{
+	return m_responder.IsActive() ?
+		&m_responder : BasePolicy::GetLocalResponder();
+}
+
+template <class BasePolicy>
+inline HRESULT LocalResponderPolicy<BasePolicy>::RespondLocally(
+	const LocalResponse& response, IInternetProtocolSink* pOIProtSink) const
+{
+	return m_responder.Start(response, pOIProtSink);
+}
+
+} // end namespace PassthroughAPP::Detail
+
+// ===== LocalResponseStartPolicy =====
+
+template <class Protocol, class BasePolicy>
+inline LocalResponseStartPolicy<Protocol, BasePolicy>::
+	LocalResponseStartPolicy() :
+	m_bDeclined(false)
+{
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT LocalResponseStartPolicy<Protocol, BasePolicy>::OnStart(
+	LPCWSTR szUrl, IInternetProtocolSink *pOIProtSink,
+	IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved,
+	IInternetProtocol* pTargetProtocol) const
+{
+	HRESULT hr = TryRespondLocally(szUrl, 0, pOIProtSink);
+	if (hr != S_FALSE)
+	{
+		return hr;
+	}
+	return BasePolicy::OnStart(szUrl, pOIProtSink, pOIBindInfo, grfPI,
+		dwReserved, pTargetProtocol);
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT LocalResponseStartPolicy<Protocol, BasePolicy>::OnStartEx(
+	IUri* pUri, IInternetProtocolSink *pOIProtSink,
+	IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved,
+	IInternetProtocolEx* pTargetProtocol) const
+{
+	HRESULT hr = TryRespondLocally(0, pUri, pOIProtSink);
+	if (hr != S_FALSE)
+	{
+		return hr;
+	}
+	return BasePolicy::OnStartEx(pUri, pOIProtSink, pOIBindInfo, grfPI,
+		dwReserved, pTargetProtocol);
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT LocalResponseStartPolicy<Protocol, BasePolicy>::
+	OnStartDeferred(LPCWSTR szUrl, IInternetProtocolSink *pOIProtSink,
+	IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved) const
+{
+	HRESULT hr = TryRespondLocally(szUrl, 0, pOIProtSink);
+	if (hr != S_FALSE)
+	{
+		return hr;
+	}
+	return BasePolicy::OnStartDeferred(szUrl, pOIProtSink, pOIBindInfo,
+		grfPI, dwReserved);
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT LocalResponseStartPolicy<Protocol, BasePolicy>::
+	OnStartExDeferred(IUri* pUri, IInternetProtocolSink *pOIProtSink,
+	IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved) const
+{
+	HRESULT hr = TryRespondLocally(0, pUri, pOIProtSink);
+	if (hr != S_FALSE)
+	{
+		return hr;
+	}
+	return BasePolicy::OnStartExDeferred(pUri, pOIProtSink, pOIBindInfo,
+		grfPI, dwReserved);
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT LocalResponseStartPolicy<Protocol, BasePolicy>::
+	TryRespondLocally(LPCWSTR szUrl, IUri* pUri,
+	IInternetProtocolSink* pOIProtSink) const
+{
+	if (m_bDeclined)
+	{
+		return S_FALSE;
+	}
+
+	const Protocol* pProtocol = static_cast<const Protocol*>(this);
+	LocalResponse response = LocalResponse::NoContent();
+	HRESULT hr = pProtocol->GetLocalResponse(szUrl, pUri, &response);
+	if (hr == S_FALSE)
+	{
+		m_bDeclined = true;
+		return S_FALSE;
+	}
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+
+	hr = this->RespondLocally(response, pOIProtSink);
+	// Anything but S_FALSE ends Start
+	return hr == S_FALSE ? S_OK : hr;
+}
+
+// ===== ResponseCacheStartPolicy =====
+
+template <class Protocol, class BasePolicy>
+inline ResponseCacheStartPolicy<Protocol, BasePolicy>::
+	ResponseCacheStartPolicy() :
+	m_bLookedUp(false)
+{
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT ResponseCacheStartPolicy<Protocol, BasePolicy>::OnStart(
+	LPCWSTR szUrl, IInternetProtocolSink *pOIProtSink,
+	IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved,
+	IInternetProtocol* pTargetProtocol) const
+{
+	HRESULT hr = TryRespondFromCache(szUrl, 0, pOIProtSink, pOIBindInfo);
+	if (hr != S_FALSE)
+	{
+		return hr;
+	}
+	hr = BasePolicy::OnStart(szUrl, pOIProtSink, pOIBindInfo, grfPI,
+		dwReserved, pTargetProtocol);
+	if (FAILED(hr))
+	{
+		m_capture.End();
+	}
+	return hr;
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT ResponseCacheStartPolicy<Protocol, BasePolicy>::OnStartEx(
+	IUri* pUri, IInternetProtocolSink *pOIProtSink,
+	IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved,
+	IInternetProtocolEx* pTargetProtocol) const
+{
+	HRESULT hr = TryRespondFromCache(0, pUri, pOIProtSink, pOIBindInfo);
+	if (hr != S_FALSE)
+	{
+		return hr;
+	}
+	hr = BasePolicy::OnStartEx(pUri, pOIProtSink, pOIBindInfo, grfPI,
+		dwReserved, pTargetProtocol);
+	if (FAILED(hr))
+	{
+		m_capture.End();
+	}
+	return hr;
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT ResponseCacheStartPolicy<Protocol, BasePolicy>::
+	OnStartDeferred(LPCWSTR szUrl, IInternetProtocolSink *pOIProtSink,
+	IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved) const
+{
+	HRESULT hr = TryRespondFromCache(szUrl, 0, pOIProtSink, pOIBindInfo);
+	if (hr != S_FALSE)
+	{
+		return hr;
+	}
+	hr = BasePolicy::OnStartDeferred(szUrl, pOIProtSink, pOIBindInfo,
+		grfPI, dwReserved);
+	if (hr != S_FALSE)
+	{
+		// The target won't be started
+		m_capture.End();
+	}
+	return hr;
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT ResponseCacheStartPolicy<Protocol, BasePolicy>::
+	OnStartExDeferred(IUri* pUri, IInternetProtocolSink *pOIProtSink,
+	IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved) const
+{
+	HRESULT hr = TryRespondFromCache(0, pUri, pOIProtSink, pOIBindInfo);
+	if (hr != S_FALSE)
+	{
+		return hr;
+	}
+	hr = BasePolicy::OnStartExDeferred(pUri, pOIProtSink, pOIBindInfo,
+		grfPI, dwReserved);
+	if (hr != S_FALSE)
+	{
+		m_capture.End();
+	}
+	return hr;
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT ResponseCacheStartPolicy<Protocol, BasePolicy>::OnRead(
+	void* pv, ULONG cb, ULONG* pcbRead,
+	IInternetProtocol* pTargetProtocol) const
+{
+	ULONG cbRead = 0;
+	HRESULT hr = BasePolicy::OnRead(pv, cb, &cbRead, pTargetProtocol);
+	if (pcbRead)
+	{
+		*pcbRead = cbRead;
+	}
+
+	if (m_capture.IsActive())
+	{
+		if (hr == S_OK || hr == S_FALSE || hr == E_PENDING)
+		{
+			m_capture.Append(pv, cbRead);
+		}
+		else
+		{
+			m_capture.End();
+		}
+		if (hr == S_FALSE && m_capture.IsActive())
+		{
+			StoreResponse(pTargetProtocol);
+			m_capture.End();
+		}
+	}
+	return hr;
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT ResponseCacheStartPolicy<Protocol, BasePolicy>::
+	TryRespondFromCache(LPCWSTR szUrl, IUri* pUri,
+	IInternetProtocolSink* pOIProtSink, IInternetBindInfo* pOIBindInfo) const
+{
+	if (m_bLookedUp)
+	{
+		return S_FALSE;
+	}
+	m_bLookedUp = true;
+
+	const Protocol* pProtocol = static_cast<const Protocol*>(this);
+	CResponseCache* pCache = pProtocol->GetResponseCache();
+	if (!pCache || !pOIBindInfo)
+	{
+		return S_FALSE;
+	}
+
+	DWORD grfBINDF = 0;
+	DWORD dwBindVerb = 0;
+	CComBSTR bstrUrl;
+	if (FAILED(Detail::GetBindVerb(pOIBindInfo, &grfBINDF, &dwBindVerb)) ||
+		dwBindVerb != BINDVERB_GET ||
+		FAILED(Detail::GetRequestUrl(szUrl, pUri, &bstrUrl, &szUrl)))
+	{
+		return S_FALSE;
+	}
+
+	// Requests that need a file expect BINDSTATUS_CACHEFILENAMEAVAILABLE,
+	// which answers from the cache never report
+	if (!Detail::IsReload(grfBINDF) && !(grfBINDF & BINDF_NEEDFILE))
+	{
+		CComPtr<CResponseCacheEntry> spEntry;
+		if (pCache->Lookup(szUrl, &spEntry) == S_OK)
+		{
+			// The protocol keeps the entry alive while it serves the body
+			LocalResponse response = {spEntry->GetMimeType(),
+				spEntry->GetBody(), spEntry->GetBodySize(), 0, spEntry};
+			HRESULT hr = this->RespondLocally(response, pOIProtSink);
+			return hr == S_FALSE ? S_OK : hr;
+		}
+	}
+
+	if (!(grfBINDF & BINDF_NOWRITECACHE))
+	{
+		m_capture.Begin(szUrl, pCache->GetMaxBodySize());
+	}
+	return S_FALSE;
+}
+
+template <class Protocol, class BasePolicy>
+inline void ResponseCacheStartPolicy<Protocol, BasePolicy>::StoreResponse(
+	IInternetProtocol* pTargetProtocol) const
+{
+	ATLASSERT(pTargetProtocol != 0);
+	CResponseCache* pCache =
+		static_cast<const Protocol*>(this)->GetResponseCache();
+	if (!pCache)
+	{
+		return;
+	}
+
+	CComPtr<IWinInetHttpInfo> spHttpInfo;
+	if (FAILED(pTargetProtocol->QueryInterface(&spHttpInfo)))
+	{
+		return;
+	}
+
+	DWORD dwStatusCode = 0;
+	DWORD cbStatusCode = sizeof(dwStatusCode);
+	HRESULT hr = spHttpInfo->QueryInfo(
+		HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER, &dwStatusCode,
+		&cbStatusCode, 0, 0);
+	if (hr != S_OK || dwStatusCode != 200)
+	{
+		return;
+	}
+
+	// Without headers there is no telling how long the response is fresh
+	WCHAR* szHeaders = 0;
+	hr = Detail::QueryHttpInfoString(spHttpInfo, HTTP_QUERY_RAW_HEADERS_CRLF,
+		&szHeaders);
+	if (hr != S_OK)
+	{
+		return;
+	}
+	// Headers past what the view holds could forbid storing the response
+	CHttpHeaderView headers;
+	ULONG nLifetime = 0;
+	if (headers.Parse(szHeaders) == S_OK &&
+		Detail::IsSharableResponse(headers))
+	{
+		nLifetime = Detail::GetFreshnessLifetime(headers,
+			Detail::GetResponseCacheTime());
+	}
+
+	if (nLifetime)
+	{
+		WCHAR* szMimeType = 0;
+		Detail::QueryMimeType(spHttpInfo, &szMimeType);
+		pCache->Insert(m_capture.GetUrl(), szMimeType, szHeaders,
+			m_capture.GetBody(), m_capture.GetBodySize(), nLifetime);
+		delete[] szMimeType;
+	}
+	delete[] szHeaders;
+}
+
+// ===== CoalescingStartPolicy =====
+
+template <class Protocol, class BasePolicy>
+inline CoalescingStartPolicy<Protocol, BasePolicy>::CoalescingStartPolicy() :
+	m_pLeading(0)
+{
+}
+
+template <class Protocol, class BasePolicy>
+inline CoalescingStartPolicy<Protocol, BasePolicy>::~CoalescingStartPolicy()
+{
+	EndLeading();
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT CoalescingStartPolicy<Protocol, BasePolicy>::OnStart(
+	LPCWSTR szUrl, IInternetProtocolSink *pOIProtSink,
+	IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved,
+	IInternetProtocol* pTargetProtocol) const
+{
+	HRESULT hr = TryFollow(szUrl, 0, pOIProtSink, pOIBindInfo, grfPI,
+		dwReserved);
+	if (hr != S_FALSE)
+	{
+		return hr;
+	}
+	hr = BasePolicy::OnStart(szUrl, pOIProtSink, pOIBindInfo, grfPI,
+		dwReserved, pTargetProtocol);
+	if (FAILED(hr))
+	{
+		EndLeading();
+	}
+	return hr;
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT CoalescingStartPolicy<Protocol, BasePolicy>::OnStartEx(
+	IUri* pUri, IInternetProtocolSink *pOIProtSink,
+	IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved,
+	IInternetProtocolEx* pTargetProtocol) const
+{
+	HRESULT hr = TryFollow(0, pUri, pOIProtSink, pOIBindInfo, grfPI,
+		dwReserved);
+	if (hr != S_FALSE)
+	{
+		return hr;
+	}
+	hr = BasePolicy::OnStartEx(pUri, pOIProtSink, pOIBindInfo, grfPI,
+		dwReserved, pTargetProtocol);
+	if (FAILED(hr))
+	{
+		EndLeading();
+	}
+	return hr;
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT CoalescingStartPolicy<Protocol, BasePolicy>::OnRead(
+	void* pv, ULONG cb, ULONG* pcbRead,
+	IInternetProtocol* pTargetProtocol) const
+{
+	if (m_follower.IsAttached())
+	{
+		return m_follower.Read(pv, cb, pcbRead);
+	}
+
+	ULONG cbRead = 0;
+	HRESULT hr = BasePolicy::OnRead(pv, cb, &cbRead, pTargetProtocol);
+	if (pcbRead)
+	{
+		*pcbRead = cbRead;
+	}
+	if (m_pLeading)
+	{
+		// The followers' notifications may terminate the leader, which
+		// releases m_pLeading
+		Detail::CoalescedResponse* pResponse = m_pLeading;
+		pResponse->AddRef();
+		pResponse->OnLeaderRead(pv, cbRead, hr, pTargetProtocol);
+		pResponse->Release();
+	}
+	return hr;
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT CoalescingStartPolicy<Protocol, BasePolicy>::OnAbort(
+	HRESULT hrReason, DWORD dwOptions,
+	IInternetProtocol* pTargetProtocol) const
+{
+	if (m_follower.IsAttached())
+	{
+		// The target was never started
+		bool bFinished = m_follower.IsFinished();
+		m_follower.Detach();
+		if (bFinished)
+		{
+			m_start.Cancel();
+		}
+		else
+		{
+			m_start.Abort(hrReason);
+		}
+		return S_OK;
+	}
+	EndLeading();
+	return BasePolicy::OnAbort(hrReason, dwOptions, pTargetProtocol);
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT CoalescingStartPolicy<Protocol, BasePolicy>::OnTerminate(
+	DWORD dwOptions, IInternetProtocol* pTargetProtocol) const
+{
+	if (m_follower.IsAttached())
+	{
+		m_follower.Detach();
+		m_start.Cancel();
+		return S_OK;
+	}
+	EndLeading();
+	return BasePolicy::OnTerminate(dwOptions, pTargetProtocol);
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT CoalescingStartPolicy<Protocol, BasePolicy>::TryFollow(
+	LPCWSTR szUrl, IUri* pUri, IInternetProtocolSink* pOIProtSink,
+	IInternetBindInfo* pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved) const
+{
+	if (m_pLeading || m_follower.IsAttached())
+	{
+		return S_FALSE;
+	}
+
+	const Protocol* pProtocol = static_cast<const Protocol*>(this);
+	CRequestCoalescer* pCoalescer = pProtocol->GetRequestCoalescer();
+	if (!pCoalescer || !pOIProtSink || !pOIBindInfo ||
+		!Detail::DeferredStart::CanDefer(grfPI, dwReserved))
+	{
+		return S_FALSE;
+	}
+
+	DWORD grfBINDF = 0;
+	DWORD dwBindVerb = 0;
+	if (FAILED(Detail::GetBindVerb(pOIBindInfo, &grfBINDF, &dwBindVerb)) ||
+		dwBindVerb != BINDVERB_GET || Detail::IsReload(grfBINDF))
+	{
+		return S_FALSE;
+	}
+	CComBSTR bstrUrl;
+	LPCWSTR szRequestUrl = 0;
+	if (FAILED(Detail::GetRequestUrl(szUrl, pUri, &bstrUrl, &szRequestUrl)))
+	{
+		return S_FALSE;
+	}
+
+	Detail::CoalescedResponse* pResponse = 0;
+	HRESULT hr = pCoalescer->Join(szRequestUrl, &pResponse);
+	if (FAILED(hr))
+	{
+		return S_FALSE;
+	}
+	if (hr == S_FALSE)
+	{
+		m_pLeading = pResponse;
+		return S_FALSE;
+	}
+	if (FAILED(m_start.Defer(szUrl, pUri, pOIProtSink, pOIBindInfo,
+		grfPI)))
+	{
+		pResponse->Release();
+		return S_FALSE;
+	}
+	// Attach may already report to the sink
+	m_follower.Attach(pResponse, pOIProtSink, Restart,
+		const_cast<CoalescingStartPolicy*>(this));
+	pResponse->Release();
+	return S_OK;
+}
+
+template <class Protocol, class BasePolicy>
+inline void CoalescingStartPolicy<Protocol, BasePolicy>::Restart(
+	void* pvContext)
+{
+	CoalescingStartPolicy* pThis =
+		static_cast<CoalescingStartPolicy*>(pvContext);
+	ATLASSERT(pThis != 0);
+	pThis->m_start.Start(static_cast<const BasePolicy*>(pThis),
+		static_cast<Protocol*>(pThis));
+}
+
+template <class Protocol, class BasePolicy>
+inline void CoalescingStartPolicy<Protocol, BasePolicy>::EndLeading() const
+{
+	Detail::CoalescedResponse* pResponse = m_pLeading;
+	if (pResponse)
+	{
+		m_pLeading = 0;
+		pResponse->Abandon();
+		pResponse->Release();
+	}
+}
+
+// ===== AdmissionStartPolicy =====
+
+template <class Protocol, class BasePolicy>
+inline AdmissionStartPolicy<Protocol, BasePolicy>::AdmissionStartPolicy() :
+	m_pScheduler(0), m_pTicket(0), m_nPriority(0)
+{
+}
+
+template <class Protocol, class BasePolicy>
+inline AdmissionStartPolicy<Protocol, BasePolicy>::~AdmissionStartPolicy()
+{
+	Leave();
+	if (m_pTicket)
+	{
+		m_pTicket->Release();
+	}
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT AdmissionStartPolicy<Protocol, BasePolicy>::OnStart(
+	LPCWSTR szUrl, IInternetProtocolSink *pOIProtSink,
+	IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved,
+	IInternetProtocol* pTargetProtocol) const
+{
+	HRESULT hr = TryWait(szUrl, 0, pOIProtSink, pOIBindInfo, grfPI,
+		dwReserved);
+	if (hr != S_FALSE)
+	{
+		return hr;
+	}
+	hr = BasePolicy::OnStart(szUrl, pOIProtSink, pOIBindInfo, grfPI,
+		dwReserved, pTargetProtocol);
+	if (FAILED(hr))
+	{
+		Leave();
+	}
+	return hr;
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT AdmissionStartPolicy<Protocol, BasePolicy>::OnStartEx(
+	IUri* pUri, IInternetProtocolSink *pOIProtSink,
+	IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved,
+	IInternetProtocolEx* pTargetProtocol) const
+{
+	HRESULT hr = TryWait(0, pUri, pOIProtSink, pOIBindInfo, grfPI,
+		dwReserved);
+	if (hr != S_FALSE)
+	{
+		return hr;
+	}
+	hr = BasePolicy::OnStartEx(pUri, pOIProtSink, pOIBindInfo, grfPI,
+		dwReserved, pTargetProtocol);
+	if (FAILED(hr))
+	{
+		Leave();
+	}
+	return hr;
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT AdmissionStartPolicy<Protocol, BasePolicy>::OnRead(
+	void* pv, ULONG cb, ULONG* pcbRead,
+	IInternetProtocol* pTargetProtocol) const
+{
+	if (m_start.IsDeferred())
+	{
+		// Nothing was reported yet
+		if (pcbRead)
+		{
+			*pcbRead = 0;
+		}
+		return E_PENDING;
+	}
+	HRESULT hr = BasePolicy::OnRead(pv, cb, pcbRead, pTargetProtocol);
+	if (hr == S_FALSE || (FAILED(hr) && hr != E_PENDING))
+	{
+		// The target is done, or won't get any further
+		Leave();
+	}
+	return hr;
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT AdmissionStartPolicy<Protocol, BasePolicy>::OnAbort(
+	HRESULT hrReason, DWORD dwOptions,
+	IInternetProtocol* pTargetProtocol) const
+{
+	if (m_start.IsDeferred())
+	{
+		// The target was never started
+		Leave();
+		m_start.Abort(hrReason);
+		return S_OK;
+	}
+	Leave();
+	return BasePolicy::OnAbort(hrReason, dwOptions, pTargetProtocol);
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT AdmissionStartPolicy<Protocol, BasePolicy>::OnTerminate(
+	DWORD dwOptions, IInternetProtocol* pTargetProtocol) const
+{
+	if (m_start.IsDeferred())
+	{
+		m_start.Cancel();
+		Leave();
+		return S_OK;
+	}
+	Leave();
+	return BasePolicy::OnTerminate(dwOptions, pTargetProtocol);
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT AdmissionStartPolicy<Protocol, BasePolicy>::OnContinue(
+	PROTOCOLDATA* pProtocolData, IInternetProtocol* pTargetProtocol) const
+{
+	if (m_pTicket && pProtocolData == m_pTicket->GetProtocolData())
+	{
+		StartWaiting();
+		return S_OK;
+	}
+	return BasePolicy::OnContinue(pProtocolData, pTargetProtocol);
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT AdmissionStartPolicy<Protocol, BasePolicy>::OnSetPriority(
+	LONG nPriority, IInternetPriority* pTargetPriority) const
+{
+	m_nPriority = nPriority;
+	if (m_pTicket)
+	{
+		m_pScheduler->SetPriority(m_pTicket, nPriority);
+	}
+	// The target keeps it too, for when it runs
+	return BasePolicy::OnSetPriority(nPriority, pTargetPriority);
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT AdmissionStartPolicy<Protocol, BasePolicy>::TryWait(
+	LPCWSTR szUrl, IUri* pUri, IInternetProtocolSink* pOIProtSink,
+	IInternetBindInfo* pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved) const
+{
+	if (m_pTicket)
+	{
+		return S_FALSE;
+	}
+
+	const Protocol* pProtocol = static_cast<const Protocol*>(this);
+	CAdmissionScheduler* pScheduler = pProtocol->GetAdmissionScheduler();
+	if (!pScheduler || !pOIProtSink || !pOIBindInfo ||
+		!Detail::DeferredStart::CanDefer(grfPI, dwReserved) ||
+		(grfPI & PI_SYNCHRONOUS))
+	{
+		return S_FALSE;
+	}
+
+	DWORD grfBINDF = 0;
+	DWORD dwBindVerb = 0;
+	if (FAILED(Detail::GetBindVerb(pOIBindInfo, &grfBINDF, &dwBindVerb)))
+	{
+		return S_FALSE;
+	}
+	CComBSTR bstrUrl;
+	LPCWSTR szRequestUrl = 0;
+	if (FAILED(Detail::GetRequestUrl(szUrl, pUri, &bstrUrl, &szRequestUrl)))
+	{
+		return S_FALSE;
+	}
+	ULONG ichHost = 0;
+	ULONG cchHost = 0;
+	ULONG ichExtension = 0;
+	ULONG cchExtension = 0;
+	Detail::ParseAdmissionUrl(szRequestUrl, &ichHost, &cchHost,
+		&ichExtension, &cchExtension);
+	// Form posts and the like are what the user waits for
+	AdmissionClass admissionClass = dwBindVerb != BINDVERB_GET ?
+		AdmissionClassDocument :
+		Detail::GetAdmissionClass(szRequestUrl + ichExtension, cchExtension);
+
+	HRESULT hr = pScheduler->Enter(szRequestUrl + ichHost, cchHost,
+		m_nPriority, admissionClass, pOIProtSink, &m_pTicket);
+	if (FAILED(hr))
+	{
+		return S_FALSE;
+	}
+	m_pScheduler = pScheduler;
+	if (hr == S_OK)
+	{
+		return S_FALSE;
+	}
+	if (FAILED(m_start.Defer(szUrl, pUri, pOIProtSink, pOIBindInfo,
+		grfPI)))
+	{
+		Leave();
+		return S_FALSE;
+	}
+	return S_OK;
+}
+
+template <class Protocol, class BasePolicy>
+inline void AdmissionStartPolicy<Protocol, BasePolicy>::StartWaiting() const
+{
+	// Terminated, or started already
+	if (!m_start.IsDeferred() || !m_pTicket->IsAdmitted())
+	{
+		return;
+	}
+	Protocol* pProtocol =
+		static_cast<Protocol*>(const_cast<AdmissionStartPolicy*>(this));
+	// For the Leave below
+	CComPtr<IUnknown> spKeepAlive(pProtocol->GetUnknown());
+	if (FAILED(m_start.Start(static_cast<const BasePolicy*>(this),
+		pProtocol)))
+	{
+		// Leaving twice does no harm, should the failure have terminated
+		// the request already
+		Leave();
+	}
+}
+
+template <class Protocol, class BasePolicy>
+inline void AdmissionStartPolicy<Protocol, BasePolicy>::Leave() const
+{
+	if (m_pTicket)
+	{
+		m_pScheduler->Leave(m_pTicket);
+	}
+}
+
+// ===== BodyFilterStartPolicy =====
+
+template <class Protocol, class BasePolicy>
+inline BodyFilterStartPolicy<Protocol, BasePolicy>::BodyFilterStartPolicy() :
+	m_bFiltersAdded(false)
+{
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT BodyFilterStartPolicy<Protocol, BasePolicy>::OnStart(
+	LPCWSTR szUrl, IInternetProtocolSink *pOIProtSink,
+	IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved,
+	IInternetProtocol* pTargetProtocol) const
+{
+	HRESULT hr = AddFilters(szUrl, 0);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+	return BasePolicy::OnStart(szUrl, pOIProtSink, pOIBindInfo, grfPI,
+		dwReserved, pTargetProtocol);
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT BodyFilterStartPolicy<Protocol, BasePolicy>::OnStartEx(
+	IUri* pUri, IInternetProtocolSink *pOIProtSink,
+	IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved,
+	IInternetProtocolEx* pTargetProtocol) const
+{
+	HRESULT hr = AddFilters(0, pUri);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+	return BasePolicy::OnStartEx(pUri, pOIProtSink, pOIBindInfo, grfPI,
+		dwReserved, pTargetProtocol);
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT BodyFilterStartPolicy<Protocol, BasePolicy>::OnRead(
+	void* pv, ULONG cb, ULONG* pcbRead,
+	IInternetProtocol* pTargetProtocol) const
+{
+	if (m_chain.IsEmpty())
+	{
+		return BasePolicy::OnRead(pv, cb, pcbRead, pTargetProtocol);
+	}
+	TargetReader reader(this, pTargetProtocol);
+	return m_chain.Read(reader, pv, cb, pcbRead);
+}
+
+template <class Protocol, class BasePolicy>
+inline CBodyFilterChain*
+	BodyFilterStartPolicy<Protocol, BasePolicy>::GetBodyFilterChain() const
+{
+	return &m_chain;
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT BodyFilterStartPolicy<Protocol, BasePolicy>::AddFilters(
+	LPCWSTR szUrl, IUri* pUri) const
+{
+	if (m_bFiltersAdded)
+	{
+		return S_OK;
+	}
+	m_bFiltersAdded = true;
+	const Protocol* pT = static_cast<const Protocol*>(this);
+	HRESULT hr = pT->AddBodyFilters(szUrl, pUri, &m_chain);
+	return FAILED(hr) ? hr : S_OK;
+}
+
+template <class Protocol, class BasePolicy>
+inline BodyFilterStartPolicy<Protocol, BasePolicy>::TargetReader::
+	TargetReader(const BodyFilterStartPolicy* pPolicy,
+	IInternetProtocol* pTargetProtocol) :
+	m_pPolicy(pPolicy), m_pTargetProtocol(pTargetProtocol)
+{
+}
+
+template <class Protocol, class BasePolicy>
+inline HRESULT BodyFilterStartPolicy<Protocol, BasePolicy>::TargetReader::
+	Read(void* pv, ULONG cb, ULONG* pcbRead)
+{
+	return m_pPolicy->BasePolicy::OnRead(pv, cb, pcbRead, m_pTargetProtocol);
+}
+
+// ===== CBodyFilterSinkTM =====
+
+template <class Protocol, class ThreadModel>
+inline STDMETHODIMP CBodyFilterSinkTM<Protocol, ThreadModel>::ReportData(
+	/* [in] */ DWORD grfBSCF,
+	/* [in] */ ULONG ulProgress,
+	/* [in] */ ULONG ulProgressMax)
+{
+	Protocol* pProtocol = Protocol::ComObjectClass::GetProtocol(this);
+	ATLASSERT(pProtocol != 0);
+	pProtocol->GetBodyFilterChain()->MapProgress(&ulProgress,
+		&ulProgressMax);
+	return BaseClass::ReportData(grfBSCF, ulProgress, ulProgressMax);
+}
+
+// ===== CReportDataCoalescingSink =====
+
+template <class BaseSink>
+inline CReportDataCoalescingSink<BaseSink>::CReportDataCoalescingSink() :
+	m_hReportDataTimer(0)
+{
+	memset(&m_reportDataProtocolData, 0, sizeof(m_reportDataProtocolData));
+	// Have the client post it to the request's thread, as the timer fires
+	// on another one
+	m_reportDataProtocolData.grfFlags = PI_FORCE_ASYNC;
+}
+
+template <class BaseSink>
+inline CReportDataCoalescingSink<BaseSink>::~CReportDataCoalescingSink()
+{
+	CancelReportDataFlush();
+}
+
+template <class BaseSink>
+inline void CReportDataCoalescingSink<BaseSink>::SetReportDataCoalescing(
+	ULONG cbMinProgress, DWORD dwMaxDelay)
+{
+	m_reportDataCoalescer.SetThresholds(cbMinProgress, dwMaxDelay);
+}
+
+template <class BaseSink>
+inline void CReportDataCoalescingSink<BaseSink>::GetReportDataStatistics(
+	ReportDataStatistics* pStats) const
+{
+	m_reportDataCoalescer.GetStatistics(pStats);
+}
+
+template <class BaseSink>
+inline bool CReportDataCoalescingSink<BaseSink>::ContinueReportData(
+	PROTOCOLDATA* pProtocolData)
+{
+	if (pProtocolData != &m_reportDataProtocolData)
+	{
+		return false;
+	}
+	// The timer has fired. Its callback may still be returning from
+	// Switch, but no longer needs the sink
+	if (m_hReportDataTimer)
+	{
+		DeleteTimerQueueTimer(0, m_hReportDataTimer, 0);
+		m_hReportDataTimer = 0;
+	}
+	if (!this->m_spInternetProtocolSink)
+	{
+		return true;
+	}
+	// Something forwarded since the timer was set may have put it off
+	DWORD dwDelay = m_reportDataCoalescer.GetFlushDelay();
+	if (dwDelay && dwDelay != INFINITE)
+	{
+		ScheduleReportDataFlush();
+		return true;
+	}
+	DWORD grfBSCF;
+	ULONG ulProgress;
+	ULONG ulProgressMax;
+	if (m_reportDataCoalescer.Flush(&grfBSCF, &ulProgress, &ulProgressMax))
+	{
+		BaseSink::ReportData(grfBSCF, ulProgress, ulProgressMax);
+	}
+	return true;
+}
+
+template <class BaseSink>
+inline void CReportDataCoalescingSink<BaseSink>::CancelReportDataFlush()
+{
+	if (m_hReportDataTimer)
+	{
+		// Waits for the timer's callback, should it be running
+		DeleteTimerQueueTimer(0, m_hReportDataTimer, INVALID_HANDLE_VALUE);
+		m_hReportDataTimer = 0;
+	}
+}
+
+template <class BaseSink>
+inline void CReportDataCoalescingSink<BaseSink>::ReleaseAll()
+{
+	CancelReportDataFlush();
+	BaseSink::ReleaseAll();
+}
+
+template <class BaseSink>
+inline STDMETHODIMP CReportDataCoalescingSink<BaseSink>::ReportData(
+	/* [in] */ DWORD grfBSCF,
+	/* [in] */ ULONG ulProgress,
+	/* [in] */ ULONG ulProgressMax)
+{
+	if (this->m_spInternetProtocolSink &&
+		!m_reportDataCoalescer.Report(grfBSCF, ulProgress, ulProgressMax))
+	{
+		ScheduleReportDataFlush();
+		return S_OK;
+	}
+	return BaseSink::ReportData(grfBSCF, ulProgress, ulProgressMax);
+}
+
+template <class BaseSink>
+inline STDMETHODIMP CReportDataCoalescingSink<BaseSink>::ReportResult(
+	/* [in] */ HRESULT hrResult,
+	/* [in] */ DWORD dwError,
+	/* [in] */ LPCWSTR szResult)
+{
+	CancelReportDataFlush();
+	DWORD grfBSCF;
+	ULONG ulProgress;
+	ULONG ulProgressMax;
+	if (this->m_spInternetProtocolSink &&
+		m_reportDataCoalescer.Flush(&grfBSCF, &ulProgress, &ulProgressMax))
+	{
+		BaseSink::ReportData(grfBSCF, ulProgress, ulProgressMax);
+	}
+	return BaseSink::ReportResult(hrResult, dwError, szResult);
+}
+
+template <class BaseSink>
+inline void CReportDataCoalescingSink<BaseSink>::ScheduleReportDataFlush()
+{
+	if (m_hReportDataTimer)
+	{
+		return;
+	}
+	DWORD dwDelay = m_reportDataCoalescer.GetFlushDelay();
+	if (dwDelay == INFINITE)
+	{
+		return;
+	}
+	// Without a timer, the notification waits for the next one as before
+	if (!CreateTimerQueueTimer(&m_hReportDataTimer, 0, ReportDataTimerProc,
+		this, dwDelay, 0, WT_EXECUTEONLYONCE))
+	{
+		m_hReportDataTimer = 0;
+	}
+}
+
+template <class BaseSink>
+inline void CALLBACK CReportDataCoalescingSink<BaseSink>::ReportDataTimerProc(
+	PVOID pvContext, BOOLEAN bTimerFired)
+{
+	CReportDataCoalescingSink* pThis =
+		static_cast<CReportDataCoalescingSink*>(pvContext);
+	ATLASSERT(pThis != 0);
+	// Once Switch has the request continue, the timer may be deleted
+	// without waiting for this callback, and the client sink released
+	CComPtr<IInternetProtocolSink> spSink = pThis->m_spInternetProtocolSink;
+	spSink->Switch(&pThis->m_reportDataProtocolData);
+}
+
+// ===== ReportDataCoalescingStartPolicy =====
+
+template <class Protocol, class Sink>
+inline HRESULT ReportDataCoalescingStartPolicy<Protocol, Sink>::OnTerminate(
+	DWORD dwOptions, IInternetProtocol* pTargetProtocol) const
+{
+	this->GetSink()->CancelReportDataFlush();
+	return BaseClass::OnTerminate(dwOptions, pTargetProtocol);
+}
+
+template <class Protocol, class Sink>
+inline HRESULT ReportDataCoalescingStartPolicy<Protocol, Sink>::OnContinue(
+	PROTOCOLDATA* pProtocolData, IInternetProtocol* pTargetProtocol) const
+{
+	if (this->GetSink()->ContinueReportData(pProtocolData))
+	{
+		return S_OK;
+	}
+	return BaseClass::OnContinue(pProtocolData, pTargetProtocol);
+}
+
+} // end namespace PassthroughAPP
+
+#endif // PASSTHROUGHAPP_SINKPOLICY_INL
@@ -0,0 +1,364 @@
+#ifndef PASSTHROUGHAPP_URLRULES_H
+#define PASSTHROUGHAPP_URLRULES_H
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+// URL rule matching for start policies that block, redirect or pass
+// requests based on large filter lists.
+//
+// Rules come in two kinds. A host rule matches a host name and all of its
+// subdomains: "example.com" matches "example.com" and "ads.example.com",
+// but not "badexample.com". A substring rule matches any URL containing
+// the pattern. Both are case insensitive and limited to ASCII; hosts are
+// expected in their punycode form.
+//
+// CUrlRuleSetBuilder compiles the rules into an image: a suffix trie over
+// host names, and an Aho-Corasick automaton over the substring patterns,
+// laid out in one block of memory without pointers. CUrlRuleSet matches
+// a URL against the image in a single pass over the host and a single pass
+// over the URL, independent of the number of rules.
+//
+// The image can be saved to a file, e.g. by a tool that compiles the
+// filter lists offline, and mapped read-only in place of building it at
+// startup. Loading a mapped image only checks its header; it involves no
+// parsing and no allocation, and processes mapping the same file share
+// its pages. Images are versioned, and an image of another version or
+// byte order is refused rather than misread.
+//
+// The image also carries a Bloom filter over the host rules, which lets
+// most URLs skip the host lookup after probing one cache line per label
+// of their host. If there are no substring rules, such URLs are rejected
+// without looking at anything but the host. Counting how many lookups it
+// avoids takes two interlocked increments on a line shared by all threads
+// matching against the rule set, so it is only compiled in when
+// PASSTHROUGHAPP_URLRULE_STATISTICS is defined.
+//
+// CUrlRuleStore holds the rule set in use and lets a new one be published
+// while requests are being matched against the old one. Readers never
+// lock: each takes a CUrlRuleSnapshot of whichever rule set is current,
+// and a rule set replaced by a newer one is deleted as soon as the last
+// snapshot of it is released.
+//
+// When several rules match, the one with the strongest action wins, in
+// the order UrlRuleAllow, UrlRuleRedirect, UrlRuleBlock. Between rules
+// with the same action, the one added first wins. dwData is not
+// interpreted, e.g. it can index a table of redirection targets.
+
+#include <math.h>
+#include <vector>
+
+namespace PassthroughAPP
+{
+
+enum UrlRuleAction
+{
+	UrlRuleBlock = 1,
+	UrlRuleRedirect = 2,
+	UrlRuleAllow = 3
+};
+
+struct UrlRuleMatch
+{
+	DWORD dwAction;
+	DWORD dwData;
+};
+
+struct UrlRulePrefilterStatistics
+{
+	// Host lookups that went through the prefilter, and those of them it
+	// answered on its own
+	LONG cLookups;
+	LONG cAvoided;
+};
+
+class CUrlRuleSet;
+
+namespace Detail
+{
+
+// Image layout. All offsets are in bytes from the start of the image,
+// all indices of rules are 1-based, 0 meaning none
+
+struct UrlRuleImageHeader
+{
+	DWORD dwMagic;
+	DWORD dwVersion;
+	DWORD cbImage;
+	DWORD cRules;
+	DWORD offRules;
+	DWORD cHostNodes;
+	DWORD offHostNodes;
+	DWORD cHostEdges;
+	DWORD offHostEdges;
+	DWORD cTextNodes;
+	DWORD offTextNodes;
+	DWORD cTextEdges;
+	DWORD offTextEdges;
+	// Host prefilter, 0 blocks if there is none
+	DWORD cBloomBlocks;
+	DWORD cBloomHashes;
+	DWORD offBloom;
+};
+
+struct UrlRule
+{
+	DWORD dwAction;
+	DWORD dwData;
+};
+
+// Node 0 is the root of each automaton
+struct UrlRuleNode
+{
+	DWORD iFirstEdge;
+	DWORD cEdges;
+	// Aho-Corasick failure link, unused in the host trie
+	DWORD iFail;
+	// Best rule ending here. In the automaton, this includes the rules
+	// ending at the nodes along the failure links
+	DWORD iRule;
+};
+
+// Edges of a node are sorted by ch
+struct UrlRuleEdge
+{
+	DWORD ch;
+	DWORD iNode;
+};
+
+enum
+{
+	// 'PTUR'
+	urlRuleImageMagic = 0x52555450,
+	urlRuleImageVersion = 2,
+	// Each key sets bits in a single cache line sized block
+	cbUrlRuleBloomBlock = 64,
+	maxUrlRuleBloomHashes = 16
+};
+
+// Lower case ASCII, 0 for anything that can't be part of a rule
+BYTE FoldUrlChar(WCHAR ch);
+
+// Returns false if szUrl has no authority component
+bool FindUrlHost(LPCWSTR szUrl, LPCWSTR* ppHost, DWORD* pcchHost);
+
+// Host rules are keyed on the host name folded and reversed, so that the
+// key of each label suffix of a host is a prefix of the next one
+ULONGLONG HashUrlHostChar(ULONGLONG hash, BYTE ch);
+const ULONGLONG urlHostHashSeed = 14695981039346656037ULL;
+
+void SetUrlRuleBloomBits(BYTE* pBloom, DWORD cBlocks, DWORD cHashes,
+	ULONGLONG hash);
+bool TestUrlRuleBloomBits(const BYTE* pBloom, DWORD cBlocks, DWORD cHashes,
+	ULONGLONG hash);
+
+// Returns whichever of the two rules wins
+DWORD BetterUrlRule(const UrlRule* pRules, DWORD iRule1, DWORD iRule2);
+
+struct UrlRuleStoreSlot
+{
+	CUrlRuleSet* volatile pRuleSet;
+	// Snapshots of pRuleSet taken while it was current but released
+	// after it was replaced, counted negative. Publish adds the snapshots
+	// outstanding when it was replaced, so it drops to 0 with the last
+	LONG volatile lRef;
+};
+
+// Builder-side node of either automaton
+struct UrlRuleBuildNode
+{
+	std::vector<UrlRuleEdge> edges;
+	DWORD iFail;
+	DWORD iRule;
+};
+
+} // end namespace PassthroughAPP::Detail
+
+class CUrlRuleSet
+{
+public:
+	CUrlRuleSet();
+	~CUrlRuleSet();
+
+	// Takes ownership of an image allocated with new BYTE[], as produced
+	// by CUrlRuleSetBuilder
+	HRESULT AttachImage(BYTE* pbImage, DWORD cbImage);
+	// Maps an image file saved by SaveImage. Don't overwrite a file while
+	// it is mapped; write new images to a new file instead
+	HRESULT MapImage(LPCWSTR szFileName);
+	HRESULT SaveImage(LPCWSTR szFileName) const;
+	void Free();
+	bool IsEmpty() const;
+
+	// Return S_OK and fill *pMatch if a rule matches, S_FALSE otherwise
+	HRESULT Match(LPCWSTR szUrl, UrlRuleMatch* pMatch) const;
+	HRESULT Match(IUri* pUri, UrlRuleMatch* pMatch) const;
+
+	const BYTE* GetImage() const;
+	DWORD GetImageSize() const;
+
+	// E_NOTIMPL, with zero counts, unless PASSTHROUGHAPP_URLRULE_STATISTICS
+	// is defined
+	HRESULT GetPrefilterStatistics(
+		UrlRulePrefilterStatistics* pStatistics) const;
+
+private:
+	// Validates the header, so that matching can rely on the sections
+	// lying within the image
+	static bool IsValidImage(const BYTE* pbImage, DWORD cbImage);
+	void Attach(const BYTE* pbImage, DWORD cbImage, bool bMapped);
+
+	HRESULT GetMatch(DWORD iRule, UrlRuleMatch* pMatch) const;
+	bool HasTextRules() const;
+	// Consults the prefilter before MatchHost
+	DWORD LookupHost(LPCWSTR pHost, DWORD cchHost) const;
+	bool MayMatchHost(LPCWSTR pHost, DWORD cchHost) const;
+	DWORD MatchHost(LPCWSTR pHost, DWORD cchHost) const;
+	DWORD MatchText(LPCWSTR szUrl) const;
+	static DWORD FindEdge(const Detail::UrlRuleEdge* pEdges, DWORD cEdges,
+		const Detail::UrlRuleNode& node, BYTE ch);
+
+	// Not copyable
+	CUrlRuleSet(const CUrlRuleSet&);
+	CUrlRuleSet& operator=(const CUrlRuleSet&);
+
+	const BYTE* m_pbImage;
+	DWORD m_cbImage;
+	// The image is either a mapped view or allocated with new BYTE[]
+	bool m_bMapped;
+	const Detail::UrlRuleImageHeader* m_pHeader;
+	const Detail::UrlRule* m_pRules;
+	const Detail::UrlRuleNode* m_pHostNodes;
+	const Detail::UrlRuleEdge* m_pHostEdges;
+	const Detail::UrlRuleNode* m_pTextNodes;
+	const Detail::UrlRuleEdge* m_pTextEdges;
+	const BYTE* m_pBloom;
+#ifdef PASSTHROUGHAPP_URLRULE_STATISTICS
+	mutable LONG volatile m_cPrefilterLookups;
+	mutable LONG volatile m_cPrefilterAvoided;
+#endif
+};
+
+class CUrlRuleSetBuilder
+{
+public:
+	CUrlRuleSetBuilder();
+
+	// Return E_INVALIDARG for empty or non-ASCII patterns
+	HRESULT AddHostRule(LPCWSTR szHost, DWORD dwAction, DWORD dwData = 0);
+	HRESULT AddSubstringRule(LPCWSTR szPattern, DWORD dwAction,
+		DWORD dwData = 0);
+
+	// Sizes the host prefilter for roughly this rate of false positives
+	// per label suffix probed, 1% by default. 0 leaves the prefilter out
+	HRESULT SetPrefilterFalsePositiveRate(double dRate);
+
+	// Compiles the rules added so far into pRuleSet. The builder can be
+	// reused afterwards; Reset keeps the prefilter setting
+	HRESULT Build(CUrlRuleSet* pRuleSet);
+	void Reset();
+
+private:
+	static bool FoldPattern(LPCWSTR szPattern, std::vector<BYTE>& pattern);
+	DWORD AddRule(DWORD dwAction, DWORD dwData);
+	static void Insert(std::vector<Detail::UrlRuleBuildNode>& nodes,
+		const std::vector<BYTE>& pattern, DWORD iRule,
+		const std::vector<Detail::UrlRule>& rules);
+	static DWORD FindChild(const Detail::UrlRuleBuildNode& node, BYTE ch);
+	static void GetBreadthFirstOrder(
+		const std::vector<Detail::UrlRuleBuildNode>& nodes,
+		std::vector<DWORD>& order);
+	void ComputeFailureLinks(const std::vector<DWORD>& order);
+	static DWORD CountEdges(
+		const std::vector<Detail::UrlRuleBuildNode>& nodes);
+	static void EmitNodes(const std::vector<Detail::UrlRuleBuildNode>& nodes,
+		const std::vector<DWORD>& order,
+		Detail::UrlRuleNode* pNodes, Detail::UrlRuleEdge* pEdges);
+
+	std::vector<Detail::UrlRule> m_rules;
+	std::vector<Detail::UrlRuleBuildNode> m_hostNodes;
+	std::vector<Detail::UrlRuleBuildNode> m_textNodes;
+	std::vector<ULONGLONG> m_hostHashes;
+	double m_dPrefilterRate;
+};
+
+class CUrlRuleStore;
+
+// Keeps the rule set that was current when it was taken alive until
+// released. Meant to be held for the duration of a call such as OnStart,
+// not stored with the request
+class CUrlRuleSnapshot
+{
+public:
+	CUrlRuleSnapshot();
+	~CUrlRuleSnapshot();
+
+	void Release();
+	// 0 if no rule set was published
+	const CUrlRuleSet* Get() const;
+	const CUrlRuleSet* operator->() const;
+
+private:
+	friend class CUrlRuleStore;
+
+	// Not copyable
+	CUrlRuleSnapshot(const CUrlRuleSnapshot&);
+	CUrlRuleSnapshot& operator=(const CUrlRuleSnapshot&);
+
+	CUrlRuleStore* m_pStore;
+	DWORD m_iSlot;
+	const CUrlRuleSet* m_pRuleSet;
+};
+
+class CUrlRuleStore
+{
+public:
+	CUrlRuleStore();
+	// There must be no snapshots left
+	~CUrlRuleStore();
+
+	// Makes pRuleSet, allocated with new, current and takes ownership of
+	// it. 0 removes the current rule set. Publishing is serialized, but
+	// doesn't wait for readers. Returns E_PENDING, leaving pRuleSet to
+	// the caller, if all slots are taken by rule sets still in use
+	HRESULT Publish(CUrlRuleSet* pRuleSet);
+
+	void GetSnapshot(CUrlRuleSnapshot* pSnapshot);
+
+	// Match against the current rule set, S_FALSE if there is none
+	HRESULT Match(LPCWSTR szUrl, UrlRuleMatch* pMatch);
+	HRESULT Match(IUri* pUri, UrlRuleMatch* pMatch);
+
+	// Rule sets are kept in slots, the current one being identified along
+	// with its number of snapshots in a single LONG. Slot 0 stands for no
+	// rule set
+	enum
+	{
+		cSlotBits = 5,
+		cSlots = 1 << cSlotBits,
+		cReaderBits = 32 - cSlotBits
+	};
+
+private:
+	friend class CUrlRuleSnapshot;
+
+	static DWORD GetSlot(LONG lState);
+	static DWORD GetReaders(LONG lState);
+	void ReleaseSlot(DWORD iSlot);
+	void FreeSlot(DWORD iSlot);
+
+	// Not copyable
+	CUrlRuleStore(const CUrlRuleStore&);
+	CUrlRuleStore& operator=(const CUrlRuleStore&);
+
+	LONG volatile m_lState;
+	Detail::UrlRuleStoreSlot m_slots[cSlots];
+	CComAutoCriticalSection m_csPublish;
+};
+
+} // end namespace PassthroughAPP
+
+#include "UrlRules.inl"
+
+#endif // PASSTHROUGHAPP_URLRULES_H
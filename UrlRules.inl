@@ -0,0 +1,1225 @@
+#ifndef PASSTHROUGHAPP_URLRULES_INL
+#define PASSTHROUGHAPP_URLRULES_INL
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+#ifndef PASSTHROUGHAPP_URLRULES_H
+	#error UrlRules.inl requires UrlRules.h to be included first
+#endif
+
+namespace PassthroughAPP
+{
+
+namespace Detail
+{
+
+const DWORD urlRuleNoNode = 0xFFFFFFFF;
+
+inline BYTE FoldUrlChar(WCHAR ch)
+{
+	if (ch >= L'A' && ch <= L'Z')
+	{
+		return static_cast<BYTE>(ch - L'A' + 'a');
+	}
+	return (ch > 0 && ch < 0x80) ? static_cast<BYTE>(ch) : 0;
+}
+
+inline bool FindUrlHost(LPCWSTR szUrl, LPCWSTR* ppHost, DWORD* pcchHost)
+{
+	ATLASSERT(szUrl != 0);
+	ATLASSERT(ppHost != 0);
+	ATLASSERT(pcchHost != 0);
+
+	LPCWSTR p = szUrl;
+	while (*p && *p != L':' && *p != L'/' && *p != L'?' && *p != L'#')
+	{
+		++p;
+	}
+	if (p[0] != L':' || p[1] != L'/' || p[2] != L'/')
+	{
+		return false;
+	}
+	p += 3;
+
+	LPCWSTR pAuthorityEnd = p;
+	while (*pAuthorityEnd && *pAuthorityEnd != L'/' &&
+		*pAuthorityEnd != L'?' && *pAuthorityEnd != L'#' &&
+		*pAuthorityEnd != L'\\')
+	{
+		++pAuthorityEnd;
+	}
+
+	// Skip user info
+	LPCWSTR pHost = p;
+	for (LPCWSTR q = p; q < pAuthorityEnd; ++q)
+	{
+		if (*q == L'@')
+		{
+			pHost = q + 1;
+		}
+	}
+
+	LPCWSTR pHostEnd = pHost;
+	if (*pHost == L'[')
+	{
+		while (pHostEnd < pAuthorityEnd && *pHostEnd != L']')
+		{
+			++pHostEnd;
+		}
+		if (pHostEnd < pAuthorityEnd)
+		{
+			++pHostEnd;
+		}
+	}
+	else
+	{
+		while (pHostEnd < pAuthorityEnd && *pHostEnd != L':')
+		{
+			++pHostEnd;
+		}
+	}
+
+	*ppHost = pHost;
+	*pcchHost = static_cast<DWORD>(pHostEnd - pHost);
+	return true;
+}
+
+inline ULONGLONG HashUrlHostChar(ULONGLONG hash, BYTE ch)
+{
+	// FNV-1a
+	return (hash ^ ch) * 1099511628211ULL;
+}
+
+inline void GetUrlRuleBloomProbe(DWORD cBlocks, ULONGLONG hash,
+	DWORD* piBlock, DWORD* pdwBit, DWORD* pdwStep)
+{
+	// FNV has weak low bits, mix them first
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDULL;
+	hash ^= hash >> 33;
+	hash *= 0xC4CEB9FE1A85EC53ULL;
+	hash ^= hash >> 33;
+
+	*piBlock = static_cast<DWORD>(
+		((hash & 0xFFFFFFFF) * static_cast<ULONGLONG>(cBlocks)) >> 32);
+	*pdwBit = static_cast<DWORD>(hash >> 32);
+	*pdwStep = static_cast<DWORD>(hash >> 41) | 1;
+}
+
+inline void SetUrlRuleBloomBits(BYTE* pBloom, DWORD cBlocks, DWORD cHashes,
+	ULONGLONG hash)
+{
+	DWORD iBlock, dwBit, dwStep;
+	GetUrlRuleBloomProbe(cBlocks, hash, &iBlock, &dwBit, &dwStep);
+	BYTE* pBlock = pBloom + iBlock * cbUrlRuleBloomBlock;
+	for (DWORD i = 0; i < cHashes; ++i, dwBit += dwStep)
+	{
+		DWORD iBit = dwBit % (cbUrlRuleBloomBlock * 8);
+		pBlock[iBit / 8] |= static_cast<BYTE>(1 << (iBit % 8));
+	}
+}
+
+inline bool TestUrlRuleBloomBits(const BYTE* pBloom, DWORD cBlocks,
+	DWORD cHashes, ULONGLONG hash)
+{
+	DWORD iBlock, dwBit, dwStep;
+	GetUrlRuleBloomProbe(cBlocks, hash, &iBlock, &dwBit, &dwStep);
+	const BYTE* pBlock = pBloom + iBlock * cbUrlRuleBloomBlock;
+	for (DWORD i = 0; i < cHashes; ++i, dwBit += dwStep)
+	{
+		DWORD iBit = dwBit % (cbUrlRuleBloomBlock * 8);
+		if (!(pBlock[iBit / 8] & (1 << (iBit % 8))))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+inline DWORD BetterUrlRule(const UrlRule* pRules, DWORD iRule1, DWORD iRule2)
+{
+	if (!iRule1)
+	{
+		return iRule2;
+	}
+	if (!iRule2)
+	{
+		return iRule1;
+	}
+	DWORD dwAction1 = pRules[iRule1 - 1].dwAction;
+	DWORD dwAction2 = pRules[iRule2 - 1].dwAction;
+	if (dwAction1 != dwAction2)
+	{
+		return dwAction1 > dwAction2 ? iRule1 : iRule2;
+	}
+	return iRule1 < iRule2 ? iRule1 : iRule2;
+}
+
+} // end namespace PassthroughAPP::Detail
+
+// ===== CUrlRuleSet =====
+
+inline CUrlRuleSet::CUrlRuleSet() :
+	m_pbImage(0), m_cbImage(0), m_bMapped(false), m_pHeader(0), m_pRules(0),
+	m_pHostNodes(0), m_pHostEdges(0), m_pTextNodes(0), m_pTextEdges(0),
+	m_pBloom(0)
+{
+#ifdef PASSTHROUGHAPP_URLRULE_STATISTICS
+	m_cPrefilterLookups = 0;
+	m_cPrefilterAvoided = 0;
+#endif
+}
+
+inline CUrlRuleSet::~CUrlRuleSet()
+{
+	Free();
+}
+
+inline HRESULT CUrlRuleSet::AttachImage(BYTE* pbImage, DWORD cbImage)
+{
+	ATLASSERT(pbImage != 0);
+	if (!pbImage)
+	{
+		return E_POINTER;
+	}
+	if (!IsValidImage(pbImage, cbImage))
+	{
+		return E_INVALIDARG;
+	}
+
+	Free();
+	Attach(pbImage, cbImage, false);
+	return S_OK;
+}
+
+inline HRESULT CUrlRuleSet::MapImage(LPCWSTR szFileName)
+{
+	ATLASSERT(szFileName != 0);
+	if (!szFileName)
+	{
+		return E_POINTER;
+	}
+
+	HANDLE hFile = CreateFileW(szFileName, GENERIC_READ, FILE_SHARE_READ, 0,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	HRESULT hr = S_OK;
+	const BYTE* pbView = 0;
+	LARGE_INTEGER cbFile;
+	if (!GetFileSizeEx(hFile, &cbFile))
+	{
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	else if (cbFile.QuadPart < static_cast<LONGLONG>(
+			sizeof(Detail::UrlRuleImageHeader)) ||
+		cbFile.QuadPart > 0xFFFFFFFF)
+	{
+		hr = E_INVALIDARG;
+	}
+	else
+	{
+		HANDLE hMapping = CreateFileMappingW(hFile, 0, PAGE_READONLY, 0, 0, 0);
+		if (!hMapping)
+		{
+			hr = HRESULT_FROM_WIN32(GetLastError());
+		}
+		else
+		{
+			pbView = static_cast<const BYTE*>(
+				MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0));
+			if (!pbView)
+			{
+				hr = HRESULT_FROM_WIN32(GetLastError());
+			}
+			// The view keeps the mapping alive
+			CloseHandle(hMapping);
+		}
+	}
+	CloseHandle(hFile);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+
+	DWORD cbImage = static_cast<DWORD>(cbFile.QuadPart);
+	if (!IsValidImage(pbView, cbImage))
+	{
+		UnmapViewOfFile(pbView);
+		return E_INVALIDARG;
+	}
+
+	Free();
+	Attach(pbView, cbImage, true);
+	return S_OK;
+}
+
+inline HRESULT CUrlRuleSet::SaveImage(LPCWSTR szFileName) const
+{
+	ATLASSERT(szFileName != 0);
+	if (!szFileName)
+	{
+		return E_POINTER;
+	}
+	if (IsEmpty())
+	{
+		return E_UNEXPECTED;
+	}
+
+	HANDLE hFile = CreateFileW(szFileName, GENERIC_WRITE, 0, 0,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	HRESULT hr = S_OK;
+	DWORD cbWritten = 0;
+	if (!WriteFile(hFile, m_pbImage, m_cbImage, &cbWritten, 0))
+	{
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	else if (cbWritten != m_cbImage)
+	{
+		hr = E_FAIL;
+	}
+	CloseHandle(hFile);
+	return hr;
+}
+
+inline void CUrlRuleSet::Attach(const BYTE* pbImage, DWORD cbImage,
+	bool bMapped)
+{
+	ATLASSERT(m_pbImage == 0);
+
+	m_pbImage = pbImage;
+	m_cbImage = cbImage;
+	m_bMapped = bMapped;
+	m_pHeader = reinterpret_cast<const Detail::UrlRuleImageHeader*>(pbImage);
+	m_pRules = reinterpret_cast<const Detail::UrlRule*>(
+		pbImage + m_pHeader->offRules);
+	m_pHostNodes = reinterpret_cast<const Detail::UrlRuleNode*>(
+		pbImage + m_pHeader->offHostNodes);
+	m_pHostEdges = reinterpret_cast<const Detail::UrlRuleEdge*>(
+		pbImage + m_pHeader->offHostEdges);
+	m_pTextNodes = reinterpret_cast<const Detail::UrlRuleNode*>(
+		pbImage + m_pHeader->offTextNodes);
+	m_pTextEdges = reinterpret_cast<const Detail::UrlRuleEdge*>(
+		pbImage + m_pHeader->offTextEdges);
+	m_pBloom = m_pHeader->cBloomBlocks ? pbImage + m_pHeader->offBloom : 0;
+}
+
+inline void CUrlRuleSet::Free()
+{
+	if (m_bMapped)
+	{
+		UnmapViewOfFile(m_pbImage);
+	}
+	else
+	{
+		delete [] m_pbImage;
+	}
+	m_pbImage = 0;
+	m_cbImage = 0;
+	m_bMapped = false;
+	m_pHeader = 0;
+	m_pRules = 0;
+	m_pHostNodes = 0;
+	m_pHostEdges = 0;
+	m_pTextNodes = 0;
+	m_pTextEdges = 0;
+	m_pBloom = 0;
+}
+
+inline bool CUrlRuleSet::IsEmpty() const
+{
+	return m_pHeader == 0;
+}
+
+inline HRESULT CUrlRuleSet::Match(LPCWSTR szUrl, UrlRuleMatch* pMatch) const
+{
+	ATLASSERT(szUrl != 0);
+	ATLASSERT(pMatch != 0);
+	if (!szUrl || !pMatch)
+	{
+		return E_POINTER;
+	}
+	if (IsEmpty())
+	{
+		return S_FALSE;
+	}
+
+	DWORD iRule = 0;
+	LPCWSTR pHost = 0;
+	DWORD cchHost = 0;
+	if (Detail::FindUrlHost(szUrl, &pHost, &cchHost))
+	{
+		iRule = LookupHost(pHost, cchHost);
+	}
+	if (HasTextRules())
+	{
+		iRule = Detail::BetterUrlRule(m_pRules, iRule, MatchText(szUrl));
+	}
+	return GetMatch(iRule, pMatch);
+}
+
+inline HRESULT CUrlRuleSet::Match(IUri* pUri, UrlRuleMatch* pMatch) const
+{
+	ATLASSERT(pUri != 0);
+	ATLASSERT(pMatch != 0);
+	if (!pUri || !pMatch)
+	{
+		return E_POINTER;
+	}
+	if (IsEmpty())
+	{
+		return S_FALSE;
+	}
+
+	// Only build the whole URL if substring rules need it
+	CComBSTR bstrHost;
+	HRESULT hr = pUri->GetHost(&bstrHost);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+	DWORD iRule = 0;
+	if (bstrHost)
+	{
+		iRule = LookupHost(bstrHost, bstrHost.Length());
+	}
+
+	if (HasTextRules())
+	{
+		CComBSTR bstrUrl;
+		hr = pUri->GetAbsoluteUri(&bstrUrl);
+		if (FAILED(hr))
+		{
+			return hr;
+		}
+		if (bstrUrl)
+		{
+			iRule = Detail::BetterUrlRule(m_pRules, iRule,
+				MatchText(bstrUrl));
+		}
+	}
+	return GetMatch(iRule, pMatch);
+}
+
+inline const BYTE* CUrlRuleSet::GetImage() const
+{
+	return m_pbImage;
+}
+
+inline DWORD CUrlRuleSet::GetImageSize() const
+{
+	return m_cbImage;
+}
+
+inline HRESULT CUrlRuleSet::GetPrefilterStatistics(
+	UrlRulePrefilterStatistics* pStatistics) const
+{
+	ATLASSERT(pStatistics != 0);
+	if (!pStatistics)
+	{
+		return E_POINTER;
+	}
+#ifdef PASSTHROUGHAPP_URLRULE_STATISTICS
+	pStatistics->cLookups = m_cPrefilterLookups;
+	pStatistics->cAvoided = m_cPrefilterAvoided;
+	return S_OK;
+#else
+	pStatistics->cLookups = 0;
+	pStatistics->cAvoided = 0;
+	return E_NOTIMPL;
+#endif
+}
+
+inline HRESULT CUrlRuleSet::GetMatch(DWORD iRule, UrlRuleMatch* pMatch) const
+{
+	if (!iRule)
+	{
+		return S_FALSE;
+	}
+	pMatch->dwAction = m_pRules[iRule - 1].dwAction;
+	pMatch->dwData = m_pRules[iRule - 1].dwData;
+	return S_OK;
+}
+
+inline bool CUrlRuleSet::HasTextRules() const
+{
+	return m_pHeader->cTextNodes > 1;
+}
+
+inline bool CUrlRuleSet::IsValidImage(const BYTE* pbImage, DWORD cbImage)
+{
+	typedef Detail::UrlRuleImageHeader Header;
+	if (cbImage < sizeof(Header) ||
+		reinterpret_cast<DWORD_PTR>(pbImage) % sizeof(DWORD))
+	{
+		return false;
+	}
+
+	const Header* pHeader = reinterpret_cast<const Header*>(pbImage);
+	if (pHeader->dwMagic != Detail::urlRuleImageMagic ||
+		pHeader->dwVersion != Detail::urlRuleImageVersion ||
+		pHeader->cbImage != cbImage ||
+		!pHeader->cHostNodes || !pHeader->cTextNodes)
+	{
+		return false;
+	}
+
+	if (pHeader->cBloomBlocks && (!pHeader->cBloomHashes ||
+		pHeader->cBloomHashes > Detail::maxUrlRuleBloomHashes))
+	{
+		return false;
+	}
+
+	const DWORD offsets[] = {pHeader->offRules, pHeader->offHostNodes,
+		pHeader->offHostEdges, pHeader->offTextNodes, pHeader->offTextEdges,
+		pHeader->offBloom};
+	const ULONGLONG sizes[] = {
+		static_cast<ULONGLONG>(pHeader->cRules) * sizeof(Detail::UrlRule),
+		static_cast<ULONGLONG>(pHeader->cHostNodes) *
+			sizeof(Detail::UrlRuleNode),
+		static_cast<ULONGLONG>(pHeader->cHostEdges) *
+			sizeof(Detail::UrlRuleEdge),
+		static_cast<ULONGLONG>(pHeader->cTextNodes) *
+			sizeof(Detail::UrlRuleNode),
+		static_cast<ULONGLONG>(pHeader->cTextEdges) *
+			sizeof(Detail::UrlRuleEdge),
+		static_cast<ULONGLONG>(pHeader->cBloomBlocks) *
+			Detail::cbUrlRuleBloomBlock};
+	for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); ++i)
+	{
+		if (offsets[i] % sizeof(DWORD) || offsets[i] < sizeof(Header) ||
+			offsets[i] + sizes[i] > cbImage)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Indices read from the image are range checked as they are used, so that
+// a damaged image can produce wrong matches, but not wild reads
+
+inline DWORD CUrlRuleSet::FindEdge(const Detail::UrlRuleEdge* pEdges,
+	DWORD cEdges, const Detail::UrlRuleNode& node, BYTE ch)
+{
+	if (node.cEdges > cEdges || node.iFirstEdge > cEdges - node.cEdges)
+	{
+		return Detail::urlRuleNoNode;
+	}
+
+	DWORD iLow = node.iFirstEdge;
+	DWORD iHigh = node.iFirstEdge + node.cEdges;
+	while (iLow < iHigh)
+	{
+		DWORD iMid = iLow + (iHigh - iLow) / 2;
+		if (pEdges[iMid].ch < ch)
+		{
+			iLow = iMid + 1;
+		}
+		else if (pEdges[iMid].ch > ch)
+		{
+			iHigh = iMid;
+		}
+		else
+		{
+			return pEdges[iMid].iNode;
+		}
+	}
+	return Detail::urlRuleNoNode;
+}
+
+inline DWORD CUrlRuleSet::LookupHost(LPCWSTR pHost, DWORD cchHost) const
+{
+	if (m_pBloom)
+	{
+#ifdef PASSTHROUGHAPP_URLRULE_STATISTICS
+		InterlockedIncrement(&m_cPrefilterLookups);
+#endif
+		if (!MayMatchHost(pHost, cchHost))
+		{
+#ifdef PASSTHROUGHAPP_URLRULE_STATISTICS
+			InterlockedIncrement(&m_cPrefilterAvoided);
+#endif
+			return 0;
+		}
+	}
+	return MatchHost(pHost, cchHost);
+}
+
+inline bool CUrlRuleSet::MayMatchHost(LPCWSTR pHost, DWORD cchHost) const
+{
+	// Probe the key of every label suffix, the way MatchHost walks them
+	ULONGLONG hash = Detail::urlHostHashSeed;
+	for (DWORD i = cchHost; i-- > 0; )
+	{
+		BYTE ch = Detail::FoldUrlChar(pHost[i]);
+		if (!ch)
+		{
+			break;
+		}
+		hash = Detail::HashUrlHostChar(hash, ch);
+		if ((i == 0 || pHost[i - 1] == L'.') &&
+			Detail::TestUrlRuleBloomBits(m_pBloom, m_pHeader->cBloomBlocks,
+				m_pHeader->cBloomHashes, hash))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+inline DWORD CUrlRuleSet::MatchHost(LPCWSTR pHost, DWORD cchHost) const
+{
+	const Detail::UrlRuleImageHeader& header = *m_pHeader;
+	DWORD iRule = 0;
+	DWORD iNode = 0;
+	// Walk the host backwards, a rule matches where a label starts
+	for (DWORD i = cchHost; i-- > 0; )
+	{
+		BYTE ch = Detail::FoldUrlChar(pHost[i]);
+		const Detail::UrlRuleNode& node = m_pHostNodes[iNode];
+		if (!ch)
+		{
+			break;
+		}
+		iNode = FindEdge(m_pHostEdges, header.cHostEdges, node, ch);
+		if (iNode >= header.cHostNodes)
+		{
+			break;
+		}
+
+		DWORD iNodeRule = m_pHostNodes[iNode].iRule;
+		if (iNodeRule && iNodeRule <= header.cRules &&
+			(i == 0 || pHost[i - 1] == L'.'))
+		{
+			iRule = Detail::BetterUrlRule(m_pRules, iRule, iNodeRule);
+		}
+	}
+	return iRule;
+}
+
+inline DWORD CUrlRuleSet::MatchText(LPCWSTR szUrl) const
+{
+	const Detail::UrlRuleImageHeader& header = *m_pHeader;
+	DWORD iRule = 0;
+	DWORD iNode = 0;
+	for (LPCWSTR p = szUrl; *p; ++p)
+	{
+		BYTE ch = Detail::FoldUrlChar(*p);
+		if (!ch)
+		{
+			iNode = 0;
+			continue;
+		}
+
+		for (;;)
+		{
+			const Detail::UrlRuleNode& node = m_pTextNodes[iNode];
+			DWORD iNext = FindEdge(m_pTextEdges, header.cTextEdges, node, ch);
+			if (iNext < header.cTextNodes)
+			{
+				iNode = iNext;
+				break;
+			}
+			if (!iNode || node.iFail >= iNode)
+			{
+				// The builder numbers nodes breadth first, so failure
+				// links, which lead to shallower nodes, always lead to
+				// lower numbers. Anything else ends the chain
+				iNode = 0;
+				break;
+			}
+			iNode = node.iFail;
+		}
+
+		DWORD iNodeRule = m_pTextNodes[iNode].iRule;
+		if (iNodeRule && iNodeRule <= header.cRules)
+		{
+			iRule = Detail::BetterUrlRule(m_pRules, iRule, iNodeRule);
+		}
+	}
+	return iRule;
+}
+
+// ===== CUrlRuleSetBuilder =====
+
+inline CUrlRuleSetBuilder::CUrlRuleSetBuilder() :
+	m_dPrefilterRate(0.01)
+{
+	Reset();
+}
+
+inline HRESULT CUrlRuleSetBuilder::SetPrefilterFalsePositiveRate(double dRate)
+{
+	if (!(dRate >= 0 && dRate < 1))
+	{
+		return E_INVALIDARG;
+	}
+	m_dPrefilterRate = dRate;
+	return S_OK;
+}
+
+inline void CUrlRuleSetBuilder::Reset()
+{
+	Detail::UrlRuleBuildNode root;
+	root.iFail = 0;
+	root.iRule = 0;
+
+	m_rules.clear();
+	m_hostHashes.clear();
+	m_hostNodes.assign(1, root);
+	m_textNodes.assign(1, root);
+}
+
+inline HRESULT CUrlRuleSetBuilder::AddHostRule(LPCWSTR szHost,
+	DWORD dwAction, DWORD dwData)
+{
+	ATLASSERT(szHost != 0);
+	if (!szHost)
+	{
+		return E_POINTER;
+	}
+	// "*.example.com" and ".example.com" mean the same as "example.com"
+	if (szHost[0] == L'*' && szHost[1] == L'.')
+	{
+		++szHost;
+	}
+	if (szHost[0] == L'.')
+	{
+		++szHost;
+	}
+
+	std::vector<BYTE> pattern;
+	if (dwAction < UrlRuleBlock || dwAction > UrlRuleAllow ||
+		!FoldPattern(szHost, pattern))
+	{
+		return E_INVALIDARG;
+	}
+
+	// The trie is keyed on reversed host names
+	std::vector<BYTE> reversed(pattern.rbegin(), pattern.rend());
+	ULONGLONG hash = Detail::urlHostHashSeed;
+	for (size_t i = 0; i < reversed.size(); ++i)
+	{
+		hash = Detail::HashUrlHostChar(hash, reversed[i]);
+	}
+	m_hostHashes.push_back(hash);
+
+	DWORD iRule = AddRule(dwAction, dwData);
+	Insert(m_hostNodes, reversed, iRule, m_rules);
+	return S_OK;
+}
+
+inline HRESULT CUrlRuleSetBuilder::AddSubstringRule(LPCWSTR szPattern,
+	DWORD dwAction, DWORD dwData)
+{
+	ATLASSERT(szPattern != 0);
+	if (!szPattern)
+	{
+		return E_POINTER;
+	}
+
+	std::vector<BYTE> pattern;
+	if (dwAction < UrlRuleBlock || dwAction > UrlRuleAllow ||
+		!FoldPattern(szPattern, pattern))
+	{
+		return E_INVALIDARG;
+	}
+
+	DWORD iRule = AddRule(dwAction, dwData);
+	Insert(m_textNodes, pattern, iRule, m_rules);
+	return S_OK;
+}
+
+inline HRESULT CUrlRuleSetBuilder::Build(CUrlRuleSet* pRuleSet)
+{
+	ATLASSERT(pRuleSet != 0);
+	if (!pRuleSet)
+	{
+		return E_POINTER;
+	}
+
+	std::vector<DWORD> hostOrder;
+	std::vector<DWORD> textOrder;
+	GetBreadthFirstOrder(m_hostNodes, hostOrder);
+	GetBreadthFirstOrder(m_textNodes, textOrder);
+	ComputeFailureLinks(textOrder);
+
+	typedef Detail::UrlRuleImageHeader Header;
+	DWORD cHostEdges = CountEdges(m_hostNodes);
+	DWORD cTextEdges = CountEdges(m_textNodes);
+
+	// Bits per key and number of hashes of a classic Bloom filter. Keeping
+	// each key in one block costs a little accuracy for one cache miss
+	ULONGLONG cBloomBlocks = 0;
+	DWORD cBloomHashes = 0;
+	if (m_dPrefilterRate > 0 && !m_hostHashes.empty())
+	{
+		const double dLn2 = 0.69314718055994531;
+		double dBitsPerKey = -log(m_dPrefilterRate) / (dLn2 * dLn2);
+		cBloomHashes = static_cast<DWORD>(dBitsPerKey * dLn2 + 0.5);
+		if (cBloomHashes < 1)
+		{
+			cBloomHashes = 1;
+		}
+		if (cBloomHashes > Detail::maxUrlRuleBloomHashes)
+		{
+			cBloomHashes = Detail::maxUrlRuleBloomHashes;
+		}
+		const double dBlockBits = Detail::cbUrlRuleBloomBlock * 8;
+		cBloomBlocks = static_cast<ULONGLONG>(
+			ceil(m_hostHashes.size() * dBitsPerKey / dBlockBits));
+		if (cBloomBlocks < 1)
+		{
+			cBloomBlocks = 1;
+		}
+	}
+
+	ULONGLONG cbImage = sizeof(Header);
+	ULONGLONG offRules = cbImage;
+	cbImage += m_rules.size() * sizeof(Detail::UrlRule);
+	ULONGLONG offHostNodes = cbImage;
+	cbImage += m_hostNodes.size() * sizeof(Detail::UrlRuleNode);
+	ULONGLONG offHostEdges = cbImage;
+	cbImage += cHostEdges * sizeof(Detail::UrlRuleEdge);
+	ULONGLONG offTextNodes = cbImage;
+	cbImage += m_textNodes.size() * sizeof(Detail::UrlRuleNode);
+	ULONGLONG offTextEdges = cbImage;
+	cbImage += cTextEdges * sizeof(Detail::UrlRuleEdge);
+	// Align the blocks to cache lines, at least in a mapped image
+	cbImage = (cbImage + Detail::cbUrlRuleBloomBlock - 1) &
+		~static_cast<ULONGLONG>(Detail::cbUrlRuleBloomBlock - 1);
+	ULONGLONG offBloom = cbImage;
+	cbImage += cBloomBlocks * Detail::cbUrlRuleBloomBlock;
+	if (cbImage > 0xFFFFFFFF)
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	BYTE* pbImage = 0;
+	ATLTRY(pbImage = new BYTE[static_cast<size_t>(cbImage)])
+	if (!pbImage)
+	{
+		return E_OUTOFMEMORY;
+	}
+	memset(pbImage, 0, static_cast<size_t>(cbImage));
+
+	Header* pHeader = reinterpret_cast<Header*>(pbImage);
+	pHeader->dwMagic = Detail::urlRuleImageMagic;
+	pHeader->dwVersion = Detail::urlRuleImageVersion;
+	pHeader->cbImage = static_cast<DWORD>(cbImage);
+	pHeader->cRules = static_cast<DWORD>(m_rules.size());
+	pHeader->offRules = static_cast<DWORD>(offRules);
+	pHeader->cHostNodes = static_cast<DWORD>(m_hostNodes.size());
+	pHeader->offHostNodes = static_cast<DWORD>(offHostNodes);
+	pHeader->cHostEdges = cHostEdges;
+	pHeader->offHostEdges = static_cast<DWORD>(offHostEdges);
+	pHeader->cTextNodes = static_cast<DWORD>(m_textNodes.size());
+	pHeader->offTextNodes = static_cast<DWORD>(offTextNodes);
+	pHeader->cTextEdges = cTextEdges;
+	pHeader->offTextEdges = static_cast<DWORD>(offTextEdges);
+	pHeader->cBloomBlocks = static_cast<DWORD>(cBloomBlocks);
+	pHeader->cBloomHashes = cBloomHashes;
+	pHeader->offBloom = static_cast<DWORD>(offBloom);
+
+	if (!m_rules.empty())
+	{
+		memcpy(pbImage + offRules, &m_rules[0],
+			m_rules.size() * sizeof(Detail::UrlRule));
+	}
+	EmitNodes(m_hostNodes, hostOrder,
+		reinterpret_cast<Detail::UrlRuleNode*>(pbImage + offHostNodes),
+		reinterpret_cast<Detail::UrlRuleEdge*>(pbImage + offHostEdges));
+	EmitNodes(m_textNodes, textOrder,
+		reinterpret_cast<Detail::UrlRuleNode*>(pbImage + offTextNodes),
+		reinterpret_cast<Detail::UrlRuleEdge*>(pbImage + offTextEdges));
+	for (size_t i = 0; i < m_hostHashes.size() && cBloomBlocks; ++i)
+	{
+		Detail::SetUrlRuleBloomBits(pbImage + offBloom,
+			static_cast<DWORD>(cBloomBlocks), cBloomHashes, m_hostHashes[i]);
+	}
+
+	HRESULT hr = pRuleSet->AttachImage(pbImage,
+		static_cast<DWORD>(cbImage));
+	ATLASSERT(SUCCEEDED(hr));
+	if (FAILED(hr))
+	{
+		delete [] pbImage;
+	}
+	return hr;
+}
+
+inline bool CUrlRuleSetBuilder::FoldPattern(LPCWSTR szPattern,
+	std::vector<BYTE>& pattern)
+{
+	pattern.clear();
+	for (LPCWSTR p = szPattern; *p; ++p)
+	{
+		BYTE ch = Detail::FoldUrlChar(*p);
+		if (!ch)
+		{
+			return false;
+		}
+		pattern.push_back(ch);
+	}
+	return !pattern.empty();
+}
+
+inline DWORD CUrlRuleSetBuilder::AddRule(DWORD dwAction, DWORD dwData)
+{
+	Detail::UrlRule rule = {dwAction, dwData};
+	m_rules.push_back(rule);
+	return static_cast<DWORD>(m_rules.size());
+}
+
+inline DWORD CUrlRuleSetBuilder::FindChild(
+	const Detail::UrlRuleBuildNode& node, BYTE ch)
+{
+	// Edges are few per node except near the root, where lookups are
+	// rare compared to inserting
+	for (size_t i = 0; i < node.edges.size(); ++i)
+	{
+		if (node.edges[i].ch == ch)
+		{
+			return node.edges[i].iNode;
+		}
+	}
+	return Detail::urlRuleNoNode;
+}
+
+inline void CUrlRuleSetBuilder::Insert(
+	std::vector<Detail::UrlRuleBuildNode>& nodes,
+	const std::vector<BYTE>& pattern, DWORD iRule,
+	const std::vector<Detail::UrlRule>& rules)
+{
+	DWORD iNode = 0;
+	for (size_t i = 0; i < pattern.size(); ++i)
+	{
+		DWORD iChild = FindChild(nodes[iNode], pattern[i]);
+		if (iChild == Detail::urlRuleNoNode)
+		{
+			iChild = static_cast<DWORD>(nodes.size());
+			Detail::UrlRuleBuildNode child;
+			child.iFail = 0;
+			child.iRule = 0;
+			nodes.push_back(child);
+
+			// Keep edges sorted for the binary search in the image
+			std::vector<Detail::UrlRuleEdge>& edges = nodes[iNode].edges;
+			Detail::UrlRuleEdge edge = {pattern[i], iChild};
+			std::vector<Detail::UrlRuleEdge>::iterator it = edges.begin();
+			while (it != edges.end() && it->ch < edge.ch)
+			{
+				++it;
+			}
+			edges.insert(it, edge);
+		}
+		iNode = iChild;
+	}
+	nodes[iNode].iRule =
+		Detail::BetterUrlRule(&rules[0], nodes[iNode].iRule, iRule);
+}
+
+inline void CUrlRuleSetBuilder::GetBreadthFirstOrder(
+	const std::vector<Detail::UrlRuleBuildNode>& nodes,
+	std::vector<DWORD>& order)
+{
+	order.clear();
+	order.reserve(nodes.size());
+	order.push_back(0);
+	for (size_t iHead = 0; iHead < order.size(); ++iHead)
+	{
+		const Detail::UrlRuleBuildNode& node = nodes[order[iHead]];
+		for (size_t i = 0; i < node.edges.size(); ++i)
+		{
+			order.push_back(node.edges[i].iNode);
+		}
+	}
+}
+
+inline void CUrlRuleSetBuilder::ComputeFailureLinks(
+	const std::vector<DWORD>& order)
+{
+	// Breadth first, so that failure links, which lead to shallower
+	// nodes, are final by the time they are followed
+	for (size_t iOrder = 0; iOrder < order.size(); ++iOrder)
+	{
+		DWORD iNode = order[iOrder];
+		for (size_t i = 0; i < m_textNodes[iNode].edges.size(); ++i)
+		{
+			const Detail::UrlRuleEdge& edge = m_textNodes[iNode].edges[i];
+			DWORD iFail = 0;
+			if (iNode)
+			{
+				for (DWORD iState = m_textNodes[iNode].iFail;;
+					iState = m_textNodes[iState].iFail)
+				{
+					DWORD iNext = FindChild(m_textNodes[iState],
+						static_cast<BYTE>(edge.ch));
+					if (iNext != Detail::urlRuleNoNode)
+					{
+						iFail = iNext;
+						break;
+					}
+					if (!iState)
+					{
+						break;
+					}
+				}
+			}
+
+			Detail::UrlRuleBuildNode& child = m_textNodes[edge.iNode];
+			child.iFail = iFail;
+			if (!m_rules.empty())
+			{
+				child.iRule = Detail::BetterUrlRule(&m_rules[0],
+					child.iRule, m_textNodes[iFail].iRule);
+			}
+		}
+	}
+}
+
+inline DWORD CUrlRuleSetBuilder::CountEdges(
+	const std::vector<Detail::UrlRuleBuildNode>& nodes)
+{
+	DWORD cEdges = 0;
+	for (size_t i = 0; i < nodes.size(); ++i)
+	{
+		cEdges += static_cast<DWORD>(nodes[i].edges.size());
+	}
+	return cEdges;
+}
+
+inline void CUrlRuleSetBuilder::EmitNodes(
+	const std::vector<Detail::UrlRuleBuildNode>& nodes,
+	const std::vector<DWORD>& order,
+	Detail::UrlRuleNode* pNodes, Detail::UrlRuleEdge* pEdges)
+{
+	// Nodes are numbered in breadth first order in the image
+	std::vector<DWORD> newIndex(nodes.size());
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		newIndex[order[i]] = static_cast<DWORD>(i);
+	}
+
+	DWORD iEdge = 0;
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		const Detail::UrlRuleBuildNode& node = nodes[order[i]];
+		pNodes[i].iFirstEdge = iEdge;
+		pNodes[i].cEdges = static_cast<DWORD>(node.edges.size());
+		pNodes[i].iFail = newIndex[node.iFail];
+		pNodes[i].iRule = node.iRule;
+		for (size_t j = 0; j < node.edges.size(); ++j)
+		{
+			pEdges[iEdge].ch = node.edges[j].ch;
+			pEdges[iEdge].iNode = newIndex[node.edges[j].iNode];
+			++iEdge;
+		}
+	}
+}
+
+// ===== CUrlRuleSnapshot =====
+
+inline CUrlRuleSnapshot::CUrlRuleSnapshot() :
+	m_pStore(0), m_iSlot(0), m_pRuleSet(0)
+{
+}
+
+inline CUrlRuleSnapshot::~CUrlRuleSnapshot()
+{
+	Release();
+}
+
+inline void CUrlRuleSnapshot::Release()
+{
+	if (m_pStore)
+	{
+		m_pStore->ReleaseSlot(m_iSlot);
+	}
+	m_pStore = 0;
+	m_iSlot = 0;
+	m_pRuleSet = 0;
+}
+
+inline const CUrlRuleSet* CUrlRuleSnapshot::Get() const
+{
+	return m_pRuleSet;
+}
+
+inline const CUrlRuleSet* CUrlRuleSnapshot::operator->() const
+{
+	ATLASSERT(m_pRuleSet != 0);
+	return m_pRuleSet;
+}
+
+// ===== CUrlRuleStore =====
+
+inline CUrlRuleStore::CUrlRuleStore() :
+	m_lState(0)
+{
+	memset(m_slots, 0, sizeof(m_slots));
+}
+
+inline CUrlRuleStore::~CUrlRuleStore()
+{
+	ATLASSERT(GetReaders(m_lState) == 0);
+	for (DWORD i = 1; i < cSlots; ++i)
+	{
+		ATLASSERT(m_slots[i].pRuleSet == 0 || i == GetSlot(m_lState));
+		delete m_slots[i].pRuleSet;
+	}
+}
+
+inline DWORD CUrlRuleStore::GetSlot(LONG lState)
+{
+	return static_cast<DWORD>(lState) >> cReaderBits;
+}
+
+inline DWORD CUrlRuleStore::GetReaders(LONG lState)
+{
+	return static_cast<DWORD>(lState) & ((1u << cReaderBits) - 1);
+}
+
+inline HRESULT CUrlRuleStore::Publish(CUrlRuleSet* pRuleSet)
+{
+	CComCritSecLock<CComAutoCriticalSection> lock(m_csPublish);
+
+	DWORD iSlot = 0;
+	if (pRuleSet)
+	{
+		DWORD iCurrent = GetSlot(m_lState);
+		for (iSlot = 1; iSlot < cSlots; ++iSlot)
+		{
+			if (iSlot != iCurrent && !m_slots[iSlot].pRuleSet)
+			{
+				break;
+			}
+		}
+		if (iSlot == cSlots)
+		{
+			return E_PENDING;
+		}
+
+		// Nobody else touches a free slot
+		m_slots[iSlot].lRef = 0;
+		m_slots[iSlot].pRuleSet = pRuleSet;
+	}
+
+	LONG lOld = InterlockedExchange(&m_lState,
+		static_cast<LONG>(iSlot << cReaderBits));
+	DWORD iOld = GetSlot(lOld);
+	if (iOld)
+	{
+		// Snapshots released from now on count down to 0
+		LONG cReaders = static_cast<LONG>(GetReaders(lOld));
+		if (InterlockedExchangeAdd(&m_slots[iOld].lRef, cReaders) +
+			cReaders == 0)
+		{
+			FreeSlot(iOld);
+		}
+	}
+	return S_OK;
+}
+
+inline void CUrlRuleStore::GetSnapshot(CUrlRuleSnapshot* pSnapshot)
+{
+	ATLASSERT(pSnapshot != 0);
+	pSnapshot->Release();
+
+	for (;;)
+	{
+		LONG lState = m_lState;
+		DWORD iSlot = GetSlot(lState);
+		if (!iSlot)
+		{
+			// Nothing to keep alive
+			return;
+		}
+		if (GetReaders(lState) == (1u << cReaderBits) - 1)
+		{
+			continue;
+		}
+		if (InterlockedCompareExchange(&m_lState, lState + 1, lState) ==
+			lState)
+		{
+			// The slot can't be freed, let alone reused, until released
+			pSnapshot->m_pStore = this;
+			pSnapshot->m_iSlot = iSlot;
+			pSnapshot->m_pRuleSet = m_slots[iSlot].pRuleSet;
+			return;
+		}
+	}
+}
+
+inline void CUrlRuleStore::ReleaseSlot(DWORD iSlot)
+{
+	ATLASSERT(iSlot > 0 && iSlot < cSlots);
+
+	// While the rule set is current, its snapshots are counted in
+	// m_lState. A slot can't be reused while a snapshot of it is held, so
+	// if it is current, it is still the same rule set
+	for (;;)
+	{
+		LONG lState = m_lState;
+		if (GetSlot(lState) != iSlot)
+		{
+			break;
+		}
+		ATLASSERT(GetReaders(lState) > 0);
+		if (InterlockedCompareExchange(&m_lState, lState - 1, lState) ==
+			lState)
+		{
+			return;
+		}
+	}
+
+	if (InterlockedDecrement(&m_slots[iSlot].lRef) == 0)
+	{
+		FreeSlot(iSlot);
+	}
+}
+
+inline void CUrlRuleStore::FreeSlot(DWORD iSlot)
+{
+	CUrlRuleSet* pRuleSet = m_slots[iSlot].pRuleSet;
+	InterlockedExchangePointer(
+		reinterpret_cast<void* volatile*>(&m_slots[iSlot].pRuleSet), 0);
+	delete pRuleSet;
+}
+
+inline HRESULT CUrlRuleStore::Match(LPCWSTR szUrl, UrlRuleMatch* pMatch)
+{
+	CUrlRuleSnapshot snapshot;
+	GetSnapshot(&snapshot);
+	if (!snapshot.Get())
+	{
+		return S_FALSE;
+	}
+	return snapshot->Match(szUrl, pMatch);
+}
+
+inline HRESULT CUrlRuleStore::Match(IUri* pUri, UrlRuleMatch* pMatch)
+{
+	CUrlRuleSnapshot snapshot;
+	GetSnapshot(&snapshot);
+	if (!snapshot.Get())
+	{
+		return S_FALSE;
+	}
+	return snapshot->Match(pUri, pMatch);
+}
+
+} // end namespace PassthroughAPP
+
+#endif // PASSTHROUGHAPP_URLRULES_INL
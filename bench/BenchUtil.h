@@ -0,0 +1,149 @@
+#ifndef PASSTHROUGHAPP_BENCH_BENCHUTIL_H
+#define PASSTHROUGHAPP_BENCH_BENCHUTIL_H
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+// Timing helpers shared by the benchmarks. A benchmark runs a callback
+// doing a given number of calls several times and reports the fastest
+// run, per call. With --quick on the command line every count is cut
+// down a hundredfold, for running the benchmarks as tests.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+
+#if defined(_M_IX86) || defined(_M_X64)
+	#include <intrin.h>
+	#define PASSTHROUGHAPP_BENCH_RDTSC
+#elif defined(__i386__) || defined(__x86_64__)
+	#include <x86intrin.h>
+	#define PASSTHROUGHAPP_BENCH_RDTSC
+#endif
+
+namespace PassthroughAPP
+{
+
+namespace Bench
+{
+
+inline double GetNanoseconds()
+{
+	return static_cast<double>(
+		std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// 0 where there is no time stamp counter
+inline unsigned long long GetCycles()
+{
+#ifdef PASSTHROUGHAPP_BENCH_RDTSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+struct BenchResult
+{
+	double dNsPerCall;
+	double dCyclesPerCall;
+};
+
+class CBenchRunner
+{
+public:
+	CBenchRunner(int argc, char** argv) :
+		m_nDivisor(1), m_cRuns(5)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			if (!strcmp(argv[i], "--quick"))
+			{
+				m_nDivisor = 100;
+				m_cRuns = 1;
+			}
+		}
+	}
+
+	bool IsQuick() const
+	{
+		return m_nDivisor != 1;
+	}
+
+	// cCalls cut down for --quick, at least 1
+	unsigned long Scale(unsigned long cCalls) const
+	{
+		cCalls /= m_nDivisor;
+		return cCalls ? cCalls : 1;
+	}
+
+	void PrintHeader(const char* szTitle) const
+	{
+		printf("\n%s\n%-44s %10s %12s %12s %12s\n", szTitle, "", "ns/call",
+			"calls/s", "cycles/call", "cycles/byte");
+	}
+
+	// Calls fn(cCalls), which makes cCalls calls, and prints the fastest
+	// run. cbPerCall is the number of bytes a call moves, 0 if none
+	template <class Fn>
+	BenchResult Run(const char* szName, unsigned long cCalls,
+		unsigned long cbPerCall, Fn fn) const
+	{
+		return Run(szName, cCalls, cbPerCall, [](unsigned long) {}, fn);
+	}
+
+	// The same, calling setup(cCalls) before each run without timing it
+	template <class Setup, class Fn>
+	BenchResult Run(const char* szName, unsigned long cCalls,
+		unsigned long cbPerCall, Setup setup, Fn fn) const
+	{
+		cCalls = Scale(cCalls);
+		BenchResult best = {0, 0};
+		for (unsigned long iRun = 0; iRun < m_cRuns; ++iRun)
+		{
+			setup(cCalls);
+			unsigned long long ullCycles = GetCycles();
+			double dStart = GetNanoseconds();
+			fn(cCalls);
+			double dNs = GetNanoseconds() - dStart;
+			ullCycles = GetCycles() - ullCycles;
+			BenchResult result = {dNs / cCalls,
+				static_cast<double>(ullCycles) / cCalls};
+			if (!iRun || result.dNsPerCall < best.dNsPerCall)
+			{
+				best = result;
+			}
+		}
+		Print(szName, best, cbPerCall);
+		return best;
+	}
+
+	void Print(const char* szName, const BenchResult& result,
+		unsigned long cbPerCall) const
+	{
+		printf("%-44s %10.2f %12.0f", szName, result.dNsPerCall,
+			result.dNsPerCall > 0 ? 1e9 / result.dNsPerCall : 0.0);
+		if (result.dCyclesPerCall > 0)
+		{
+			printf(" %12.1f", result.dCyclesPerCall);
+			if (cbPerCall)
+			{
+				printf(" %12.3f", result.dCyclesPerCall / cbPerCall);
+			}
+		}
+		printf("\n");
+	}
+
+private:
+	unsigned long m_nDivisor;
+	unsigned long m_cRuns;
+};
+
+} // end namespace PassthroughAPP::Bench
+
+} // end namespace PassthroughAPP
+
+#endif // PASSTHROUGHAPP_BENCH_BENCHUTIL_H
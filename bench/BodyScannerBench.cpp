@@ -0,0 +1,314 @@
+// CBodyScanner over a synthetic 4 MB HTML corpus of pages with markup,
+// inline script and text, generated from a fixed seed so that runs
+// compare: sets of 8, 64 and 256 patterns, matching and ignoring case, the
+// body coming in chunks of different sizes, and a search per pattern with
+// std::search for comparison. Prints GB/s and the number of matches for
+// each, which have to be the same in every build. The scanner is built
+// the way this program is; the BodyScannerBenchSsse3 and
+// BodyScannerBenchAvx2 builds show what SIMD does.
+
+#include <atlbase.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "BodyScanner.h"
+#include "bench/BenchUtil.h"
+
+using namespace PassthroughAPP;
+using namespace PassthroughAPP::Bench;
+
+namespace
+{
+
+const ULONG cbCorpus = 4 * 1024 * 1024;
+
+#if defined(PASSTHROUGHAPP_BODYSCANNER_AVX2)
+const char szScanner[] = "AVX2";
+#elif defined(PASSTHROUGHAPP_BODYSCANNER_SSSE3)
+const char szScanner[] = "SSSE3";
+#else
+const char szScanner[] = "scalar";
+#endif
+
+class CRandom
+{
+public:
+	explicit CRandom(DWORD dwSeed) : m_dwState(dwSeed) {}
+
+	DWORD Next(DWORD dwBound)
+	{
+		m_dwState = m_dwState * 1664525 + 1013904223;
+		return (m_dwState >> 8) % dwBound;
+	}
+
+	std::string Word(DWORD cchMin, DWORD cchMax)
+	{
+		std::string word;
+		for (DWORD cch = cchMin + Next(cchMax - cchMin + 1); cch; --cch)
+		{
+			word += static_cast<char>('a' + Next(26));
+		}
+		return word;
+	}
+
+private:
+	DWORD m_dwState;
+};
+
+// What body rewriters look for, found in the corpus now and then
+const char* const g_rgszCommon[] = {"<script", "</head>", "</body>",
+	"document.write", "googletag", "doubleclick.net", "<iframe",
+	"tracker.js"};
+const ULONG cCommon = sizeof(g_rgszCommon) / sizeof(g_rgszCommon[0]);
+
+const char* const g_rgszTags[] = {"div", "span", "p", "li", "td", "a",
+	"section", "em"};
+const ULONG cTags = sizeof(g_rgszTags) / sizeof(g_rgszTags[0]);
+
+// Pages of markup with links, images, inline script and text, and now and
+// then the common patterns, in mixed case
+std::string MakeCorpus()
+{
+	CRandom random(20);
+	std::string corpus;
+	corpus.reserve(cbCorpus + 4096);
+	while (corpus.size() < cbCorpus)
+	{
+		corpus += "<!DOCTYPE html>\n<html><head><title>";
+		corpus += random.Word(4, 10) + " " + random.Word(4, 10);
+		corpus += "</title>\n<link rel=\"stylesheet\" href=\"/css/";
+		corpus += random.Word(3, 8) + ".css\">\n";
+		if (random.Next(2))
+		{
+			corpus += random.Next(2) ? "<SCRIPT" : "<script";
+			corpus += " src=\"https://cdn.example.com/tracker.js\"></script>\n";
+		}
+		corpus += "</head>\n<body class=\"" + random.Word(3, 8) + "\">\n";
+		for (DWORD cElements = 200 + random.Next(200); cElements;
+			--cElements)
+		{
+			const char* szTag = g_rgszTags[random.Next(cTags)];
+			corpus += std::string("<") + szTag + " class=\"" +
+				random.Word(3, 10) + "-" + random.Word(3, 10) + "\">";
+			switch (random.Next(8))
+			{
+			case 0:
+				corpus += "<a href=\"https://www." + random.Word(4, 10) +
+					".com/" + random.Word(3, 12) + "/" + random.Word(3, 12) +
+					".html\">" + random.Word(3, 10) + "</a>";
+				break;
+			case 1:
+				corpus += "<img src=\"/img/" + random.Word(4, 12) +
+					".png\" width=\"120\" height=\"80\" alt=\"\">";
+				break;
+			case 2:
+				corpus += "<script>var " + random.Word(2, 6) + " = " +
+					random.Word(4, 10) + "(\"" + random.Word(3, 8) +
+					"\");";
+				if (!random.Next(4))
+				{
+					corpus += random.Next(2) ? " document.write(" :
+						" googletag.cmd.push(";
+					corpus += random.Word(3, 8) + ");";
+				}
+				corpus += "</script>";
+				break;
+			case 3:
+				if (!random.Next(4))
+				{
+					corpus += "<iframe src=\"https://ad.doubleclick.net/";
+					corpus += random.Word(6, 12) + "\"></iframe>";
+				}
+				break;
+			default:
+				for (DWORD cWords = 5 + random.Next(30); cWords; --cWords)
+				{
+					corpus += random.Word(1, 10) + " ";
+				}
+				break;
+			}
+			corpus += std::string("</") + szTag + ">\n";
+		}
+		corpus += "</body></html>\n";
+	}
+	corpus.resize(cbCorpus);
+	return corpus;
+}
+
+// The common patterns, then words of the corpus's alphabet, some of which
+// it contains
+std::vector<std::string> MakePatterns(ULONG cPatterns)
+{
+	CRandom random(cPatterns);
+	std::vector<std::string> patterns(g_rgszCommon,
+		g_rgszCommon + std::min(cPatterns, cCommon));
+	while (patterns.size() < cPatterns)
+	{
+		patterns.push_back(random.Word(4, 12));
+	}
+	return patterns;
+}
+
+struct MatchCounter
+{
+	ULONGLONG cMatches;
+
+	bool OnMatch(ULONG /*iPattern*/, ULONGLONG /*ibMatch*/)
+	{
+		++cMatches;
+		return true;
+	}
+};
+
+struct Result
+{
+	std::string name;
+	double dGBPerSecond;
+	ULONGLONG cMatches;
+};
+
+// Scans the corpus cbChunk bytes at a time
+bool BenchScanner(const CBenchRunner& runner, const std::string& corpus,
+	ULONG cPatterns, bool bIgnoreCase, ULONG cbChunk,
+	std::vector<Result>* pResults)
+{
+	CBodyPatternSet set(bIgnoreCase);
+	std::vector<std::string> patterns = MakePatterns(cPatterns);
+	for (size_t i = 0; i < patterns.size(); ++i)
+	{
+		if (FAILED(set.Add(patterns[i].c_str())))
+		{
+			return false;
+		}
+	}
+	CBodyScanner scanner;
+	if (FAILED(set.Compile()) || FAILED(scanner.Init(&set)))
+	{
+		return false;
+	}
+
+	char szName[64];
+	sprintf(szName, "%lu patterns%s, %lu byte chunks",
+		static_cast<unsigned long>(cPatterns),
+		bIgnoreCase ? " ignoring case" : "",
+		static_cast<unsigned long>(cbChunk));
+	const BYTE* pb = reinterpret_cast<const BYTE*>(corpus.data());
+	MatchCounter counter = {0};
+	// Large sets take much longer
+	BenchResult result = runner.Run(szName, 800 / cPatterns, cbCorpus,
+		[&](unsigned long cCalls)
+		{
+			for (unsigned long i = 0; i < cCalls; ++i)
+			{
+				counter.cMatches = 0;
+				scanner.Reset();
+				for (ULONG ib = 0; ib < cbCorpus; ib += cbChunk)
+				{
+					scanner.Scan(pb + ib, std::min(cbChunk, cbCorpus - ib),
+						counter);
+				}
+			}
+		});
+	Result r = {szName, cbCorpus / result.dNsPerCall, counter.cMatches};
+	pResults->push_back(r);
+	return true;
+}
+
+// Searches the whole corpus once per pattern, matching case
+void BenchSearch(const CBenchRunner& runner, const std::string& corpus,
+	ULONG cPatterns, std::vector<Result>* pResults)
+{
+	std::vector<std::string> patterns = MakePatterns(cPatterns);
+	char szName[64];
+	sprintf(szName, "%lu patterns, std::search per pattern",
+		static_cast<unsigned long>(cPatterns));
+	ULONGLONG cMatches = 0;
+	BenchResult result = runner.Run(szName, 80 / cPatterns, cbCorpus,
+		[&](unsigned long cCalls)
+		{
+			for (unsigned long i = 0; i < cCalls; ++i)
+			{
+				cMatches = 0;
+				for (size_t iPattern = 0; iPattern < patterns.size();
+					++iPattern)
+				{
+					const std::string& pattern = patterns[iPattern];
+					std::string::const_iterator it = corpus.begin();
+					for (;;)
+					{
+						it = std::search(it, corpus.end(), pattern.begin(),
+							pattern.end());
+						if (it == corpus.end())
+						{
+							break;
+						}
+						++cMatches;
+						++it;
+					}
+				}
+			}
+		});
+	Result r = {szName, cbCorpus / result.dNsPerCall, cMatches};
+	pResults->push_back(r);
+}
+
+} // end anonymous namespace
+
+int main(int argc, char** argv)
+{
+#if defined(__GNUC__) && defined(PASSTHROUGHAPP_BODYSCANNER_AVX2)
+	if (!__builtin_cpu_supports("avx2"))
+	{
+		printf("Built for AVX2, which this processor doesn't have\n");
+		return 0;
+	}
+#endif
+	CBenchRunner runner(argc, argv);
+	std::string corpus = MakeCorpus();
+	std::vector<Result> results;
+	bool bOk = true;
+
+	char szTitle[64];
+	sprintf(szTitle, "Scanning 4 MB of HTML, %s scanner", szScanner);
+	runner.PrintHeader(szTitle);
+	static const ULONG rgcPatterns[] = {8, 64, 256};
+	for (size_t i = 0; i < sizeof(rgcPatterns) / sizeof(rgcPatterns[0]);
+		++i)
+	{
+		bOk &= BenchScanner(runner, corpus, rgcPatterns[i], false, 16384,
+			&results);
+		bOk &= BenchScanner(runner, corpus, rgcPatterns[i], true, 16384,
+			&results);
+	}
+	// Packets as they come off the network, and large buffers
+	bOk &= BenchScanner(runner, corpus, 64, true, 1460, &results);
+	bOk &= BenchScanner(runner, corpus, 64, true, 262144, &results);
+
+	runner.PrintHeader("Searching 4 MB of HTML for one pattern at a time");
+	std::vector<Result> searches;
+	BenchSearch(runner, corpus, 8, &searches);
+	BenchSearch(runner, corpus, 64, &searches);
+	// Every match is reported once, however the body is split
+	bOk &= results[0].cMatches == searches[0].cMatches &&
+		results[2].cMatches == searches[1].cMatches &&
+		results[6].cMatches == results[3].cMatches &&
+		results[7].cMatches == results[3].cMatches;
+	results.insert(results.end(), searches.begin(), searches.end());
+
+	printf("\n%-44s %10s %12s\n", "", "GB/s", "matches");
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		printf("%-44s %10.2f %12llu\n", results[i].name.c_str(),
+			results[i].dGBPerSecond,
+			static_cast<unsigned long long>(results[i].cMatches));
+	}
+
+	if (!bOk)
+	{
+		printf("\nA scan failed or found different matches\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,161 @@
+// CComClassFactoryProtocol::CreateInstance hammered from several threads
+// at once, as urlmon's binding threads do, with and without deferred
+// target creation, and while another thread keeps replacing the target
+// class factory. Times are wall clock per call, over all threads.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "ProtocolImpl.h"
+#include "ProtocolCF.h"
+#include "Portable/FakeProtocol.h"
+#include "bench/BenchUtil.h"
+
+using namespace PassthroughAPP;
+using namespace PassthroughAPP::Bench;
+
+namespace
+{
+
+class CBenchAPP :
+	public CInternetProtocol<NoSinkStartPolicy>
+{
+};
+
+typedef CMetaFactory<CComClassFactoryProtocol, CBenchAPP> MetaFactory;
+
+void CreateInstances(IClassFactory* pCF, unsigned long cCalls, bool* pbOk)
+{
+	for (unsigned long i = 0; i < cCalls; ++i)
+	{
+		IInternetProtocol* pProtocol = 0;
+		if (FAILED(pCF->CreateInstance(0, IID_IInternetProtocol,
+			reinterpret_cast<void**>(&pProtocol))))
+		{
+			*pbOk = false;
+			return;
+		}
+		pProtocol->Release();
+	}
+}
+
+// Splits cCalls between cThreads threads, the calling one included
+bool CreateInstancesOn(IClassFactory* pCF, unsigned long cCalls,
+	unsigned cThreads)
+{
+	std::vector<std::thread> threads;
+	// Not vector<bool>, each thread writes its own
+	std::vector<char> results(cThreads, 1);
+	for (unsigned i = 1; i < cThreads; ++i)
+	{
+		threads.push_back(std::thread([&, i]()
+		{
+			bool bOk = true;
+			CreateInstances(pCF, cCalls / cThreads, &bOk);
+			results[i] = bOk;
+		}));
+	}
+	bool bOk = true;
+	CreateInstances(pCF, cCalls / cThreads, &bOk);
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		threads[i].join();
+	}
+	for (unsigned i = 1; i < cThreads; ++i)
+	{
+		bOk &= (results[i] != 0);
+	}
+	return bOk;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char** argv)
+{
+	CBenchRunner runner(argc, argv);
+	unsigned cMaxThreads = std::thread::hardware_concurrency();
+	if (cMaxThreads < 4)
+	{
+		cMaxThreads = 4;
+	}
+	printf("%u hardware threads\n", std::thread::hardware_concurrency());
+
+	FakeResponse response;
+	CComObject<CFakeTargetClassFactory>* pTargetCF = 0;
+	CFakeTargetClassFactory::Create(response, &pTargetCF);
+	CComPtr<IClassFactory> spTargetCF = pTargetCF;
+	CComObject<CFakeTargetClassFactory>* pOtherTargetCF = 0;
+	CFakeTargetClassFactory::Create(response, &pOtherTargetCF);
+	CComPtr<IClassFactory> spOtherTargetCF = pOtherTargetCF;
+
+	bool bOk = true;
+	char szName[64];
+	for (int iDefer = 0; iDefer < 2; ++iDefer)
+	{
+		CComClassFactoryProtocol* pFactory = 0;
+		if (FAILED(MetaFactory::CreateInstance(&pFactory)))
+		{
+			printf("Creating the factory failed\n");
+			return 1;
+		}
+		CComPtr<IClassFactory> spCF = pFactory;
+		pFactory->SetTargetClassFactory(spTargetCF);
+		pFactory->SetDeferTargetCreation(iDefer != 0);
+
+		runner.PrintHeader(iDefer ?
+			"CreateInstance, target creation deferred" :
+			"CreateInstance, target created with the APP");
+		for (unsigned cThreads = 1; cThreads <= cMaxThreads; cThreads *= 2)
+		{
+			sprintf(szName, "%u thread%s", cThreads, cThreads > 1 ? "s" : "");
+			runner.Run(szName, 1000000, 0, [&](unsigned long cCalls)
+			{
+				bOk &= CreateInstancesOn(spCF, cCalls, cThreads);
+			});
+		}
+
+		// SetTargetClassFactory waits for the readers of the factory it
+		// replaces
+		sprintf(szName, "%u threads, target CF replaced", cMaxThreads);
+		runner.Run(szName, 1000000, 0, [&](unsigned long cCalls)
+		{
+			std::atomic<bool> bStop(false);
+			std::thread writer([&]()
+			{
+				for (unsigned long i = 0; !bStop; ++i)
+				{
+					pFactory->SetTargetClassFactory(
+						i & 1 ? spTargetCF : spOtherTargetCF);
+					std::this_thread::yield();
+				}
+			});
+			bOk &= CreateInstancesOn(spCF, cCalls, cMaxThreads);
+			bStop = true;
+			writer.join();
+		});
+	}
+
+	CComClassFactoryProtocol* pFactory = 0;
+	MetaFactory::CreateInstance(&pFactory);
+	CComPtr<IClassFactory> spCF = pFactory;
+	runner.PrintHeader("SetTargetClassFactory, no readers");
+	runner.Run("replace", 1000000, 0, [&](unsigned long cCalls)
+	{
+		for (unsigned long i = 0; i < cCalls; ++i)
+		{
+			pFactory->SetTargetClassFactory(
+				i & 1 ? spTargetCF : spOtherTargetCF);
+		}
+	});
+
+	if (!bOk)
+	{
+		printf("\nCreateInstance failed\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,216 @@
+// CHttpHeaderView over header blocks modelled on captures of what urlmon
+// hands to BeginningTransaction and OnResponse: indexing them, and
+// indexing them and looking up what a sink typically asks for, against
+// splitting them into a map of strings keyed by lower case names, the
+// way sinks did before. HttpHeadersBenchScalar is the same program built
+// with PASSTHROUGHAPP_NO_SIMD.
+
+#include <atlbase.h>
+
+#include <wctype.h>
+
+#include <map>
+#include <string>
+
+#include "HttpHeaders.h"
+#include "bench/BenchUtil.h"
+
+using namespace PassthroughAPP;
+using namespace PassthroughAPP::Bench;
+
+namespace
+{
+
+// The headers of captured requests and responses, with made up hosts,
+// dates and cookies
+const struct
+{
+	const char* szName;
+	LPCWSTR szHeaders;
+} g_headerSets[] =
+{
+	{"request",
+		L"Accept: text/html, application/xhtml+xml, image/jxr, */*\r\n"
+		L"Accept-Language: en-US,en;q=0.7,de;q=0.3\r\n"
+		L"User-Agent: Mozilla/5.0 (Windows NT 10.0; WOW64; Trident/7.0; "
+		L"rv:11.0) like Gecko\r\n"
+		L"Accept-Encoding: gzip, deflate\r\n"
+		L"Host: www.example.com\r\n"
+		L"Connection: Keep-Alive\r\n"
+		L"Cookie: session=9f3ac2d1e4b5; prefs=lang%3Den%26theme%3Ddark; "
+		L"_ga=GA1.2.1034567890.1590000000\r\n"
+		L"\r\n"},
+	{"HTML page response",
+		L"HTTP/1.1 200 OK\r\n"
+		L"Date: Tue, 12 May 2020 09:31:07 GMT\r\n"
+		L"Content-Type: text/html; charset=UTF-8\r\n"
+		L"Transfer-Encoding: chunked\r\n"
+		L"Connection: keep-alive\r\n"
+		L"Cache-Control: private, max-age=0\r\n"
+		L"Expires: -1\r\n"
+		L"Strict-Transport-Security: max-age=31536000; includeSubDomains\r\n"
+		L"Content-Security-Policy: default-src 'self'; script-src 'self' "
+		L"'unsafe-inline' https://cdn.example.com https://www.example-"
+		L"analytics.com; img-src * data:; style-src 'self' "
+		L"'unsafe-inline' https://cdn.example.com; frame-ancestors "
+		L"'self'\r\n"
+		L"X-Content-Type-Options: nosniff\r\n"
+		L"X-Frame-Options: SAMEORIGIN\r\n"
+		L"X-XSS-Protection: 1; mode=block\r\n"
+		L"Set-Cookie: session=9f3ac2d1e4b5; path=/; secure; HttpOnly\r\n"
+		L"Set-Cookie: region=eu-west; expires=Wed, 12-May-2021 09:31:07 "
+		L"GMT; path=/; domain=.example.com\r\n"
+		L"Set-Cookie: ab=variant-7; path=/\r\n"
+		L"Vary: Accept-Encoding\r\n"
+		L"Content-Encoding: gzip\r\n"
+		L"Server: nginx\r\n"
+		L"Alt-Svc: h3-27=\":443\"; ma=86400\r\n"
+		L"\r\n"},
+	{"image response",
+		L"HTTP/1.1 200 OK\r\n"
+		L"Content-Type: image/png\r\n"
+		L"Content-Length: 48213\r\n"
+		L"Connection: keep-alive\r\n"
+		L"Last-Modified: Thu, 02 Apr 2020 14:02:51 GMT\r\n"
+		L"ETag: \"5e85f04b-bc55\"\r\n"
+		L"Cache-Control: public, max-age=31536000, immutable\r\n"
+		L"Accept-Ranges: bytes\r\n"
+		L"Date: Tue, 12 May 2020 09:31:08 GMT\r\n"
+		L"Age: 120583\r\n"
+		L"X-Cache: HIT\r\n"
+		L"Via: 1.1 varnish\r\n"
+		L"\r\n"},
+	{"304 response",
+		L"HTTP/1.1 304 Not Modified\r\n"
+		L"Date: Tue, 12 May 2020 09:31:09 GMT\r\n"
+		L"ETag: \"5e85f04b-2a9f\"\r\n"
+		L"Cache-Control: max-age=600\r\n"
+		L"\r\n"}
+};
+const size_t cHeaderSets = sizeof(g_headerSets) / sizeof(g_headerSets[0]);
+
+// What a sink asks for: the type, caching, the cookies, and a header
+// that usually isn't there
+const HttpHeaderId g_lookups[] = {HttpHeaderContentType,
+	HttpHeaderCacheControl, HttpHeaderSetCookie, HttpHeaderLocation};
+const size_t cLookups = sizeof(g_lookups) / sizeof(g_lookups[0]);
+
+typedef std::multimap<std::wstring, std::wstring> HeaderMap;
+
+// Splits the headers into the map, with names in lower case
+void SplitHeaders(LPCWSTR szHeaders, HeaderMap* pMap)
+{
+	pMap->clear();
+	std::wstring headers(szHeaders);
+	size_t ichLine = 0;
+	for (;;)
+	{
+		size_t ichEnd = headers.find(L"\r\n", ichLine);
+		if (ichEnd == std::wstring::npos || ichEnd == ichLine)
+		{
+			break;
+		}
+		std::wstring line = headers.substr(ichLine, ichEnd - ichLine);
+		size_t ichColon = line.find(L':');
+		if (ichColon != std::wstring::npos)
+		{
+			std::wstring name = line.substr(0, ichColon);
+			for (size_t i = 0; i < name.size(); ++i)
+			{
+				name[i] = towlower(name[i]);
+			}
+			size_t ichValue = line.find_first_not_of(L" \t", ichColon + 1);
+			pMap->insert(HeaderMap::value_type(name,
+				ichValue == std::wstring::npos ? std::wstring() :
+				line.substr(ichValue)));
+		}
+		ichLine = ichEnd + 2;
+	}
+}
+
+} // end anonymous namespace
+
+int main(int argc, char** argv)
+{
+	CBenchRunner runner(argc, argv);
+
+	// The lower case names the map is looked up with
+	std::wstring lookupNames[cLookups];
+	for (size_t i = 0; i < cLookups; ++i)
+	{
+		CHttpHeaderName name(g_lookups[i]);
+		lookupNames[i].assign(name.GetName(), name.GetLength());
+		for (size_t j = 0; j < lookupNames[i].size(); ++j)
+		{
+			lookupNames[i][j] = towlower(lookupNames[i][j]);
+		}
+	}
+
+	bool bOk = true;
+	for (size_t iSet = 0; iSet < cHeaderSets; ++iSet)
+	{
+		LPCWSTR szHeaders = g_headerSets[iSet].szHeaders;
+		ULONG cbHeaders = static_cast<ULONG>(wcslen(szHeaders) *
+			sizeof(WCHAR));
+		char szTitle[80];
+		sprintf(szTitle, "%s, %lu bytes", g_headerSets[iSet].szName,
+			static_cast<unsigned long>(cbHeaders));
+		runner.PrintHeader(szTitle);
+
+		CHttpHeaderView view;
+		runner.Run("CHttpHeaderView::Parse", 1000000, cbHeaders,
+			[&](unsigned long cCalls)
+			{
+				for (unsigned long i = 0; i < cCalls; ++i)
+				{
+					bOk &= view.Parse(szHeaders) == S_OK;
+				}
+			});
+
+		ULONG cViewFound = 0;
+		runner.Run("CHttpHeaderView, Parse and lookups", 1000000, cbHeaders,
+			[&](unsigned long cCalls)
+			{
+				for (unsigned long i = 0; i < cCalls; ++i)
+				{
+					cViewFound = 0;
+					bOk &= view.Parse(szHeaders) == S_OK;
+					for (size_t j = 0; j < cLookups; ++j)
+					{
+						CHttpHeaderName name(g_lookups[j]);
+						for (ULONG iField = view.Find(name);
+							iField < view.GetCount();
+							iField = view.Find(name, iField + 1))
+						{
+							++cViewFound;
+						}
+					}
+				}
+			});
+
+		HeaderMap map;
+		size_t cMapFound = 0;
+		runner.Run("std::multimap, split and lookups", 100000, cbHeaders,
+			[&](unsigned long cCalls)
+			{
+				for (unsigned long i = 0; i < cCalls; ++i)
+				{
+					cMapFound = 0;
+					SplitHeaders(szHeaders, &map);
+					for (size_t j = 0; j < cLookups; ++j)
+					{
+						cMapFound += map.count(lookupNames[j]);
+					}
+				}
+			});
+		// Both find the same fields
+		bOk &= cViewFound == cMapFound;
+	}
+
+	if (!bOk)
+	{
+		printf("\nParsing failed or found different fields\n");
+		return 1;
+	}
+	return 0;
+}
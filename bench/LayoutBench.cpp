@@ -0,0 +1,166 @@
+// Forwarded calls through a CComObjectProtSink while another thread
+// keeps taking and dropping references to the same object, as urlmon's
+// worker thread and the thread that started the binding do. Compares
+// CompactLayout, where the reference counts share cache lines with the
+// pointers every forwarded call reads, with CacheLineLayout. Meaningful
+// only on a machine with more than one core.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include <atomic>
+#include <thread>
+
+#include "ProtocolImpl.h"
+#include "ProtocolCF.h"
+#include "Portable/FakeProtocol.h"
+#include "bench/BenchUtil.h"
+
+using namespace PassthroughAPP;
+using namespace PassthroughAPP::Bench;
+
+namespace
+{
+
+class CBenchSink :
+	public CInternetProtocolSinkWithSP<CBenchSink>
+{
+};
+
+class CCompactAPP :
+	public CInternetProtocol<CustomSinkStartPolicy<CCompactAPP, CBenchSink> >
+{
+};
+
+class CCacheLineAPP :
+	public CInternetProtocol<
+		CustomSinkStartPolicy<CCacheLineAPP, CBenchSink> >
+{
+public:
+	DECLARE_AGGREGATABLE_PROTSINK_EX(CCacheLineAPP, CBenchSink,
+		PassthroughAPP::HeapAllocPolicy, PassthroughAPP::CacheLineLayout)
+};
+
+BYTE g_readBuffer[64];
+
+// Takes and drops references to punk until *pbStop is set
+void Hammer(IUnknown* punk, const std::atomic<bool>* pbStop)
+{
+	while (!pbStop->load(std::memory_order_relaxed))
+	{
+		for (int i = 0; i < 256; ++i)
+		{
+			punk->AddRef();
+			punk->Release();
+		}
+	}
+}
+
+// Runs fn, if bHammer is set while another thread hammers the reference
+// count of punk
+template <class Fn>
+void WithHammering(IUnknown* punk, bool bHammer, Fn fn)
+{
+	std::atomic<bool> bStop(false);
+	std::thread thread;
+	if (bHammer)
+	{
+		thread = std::thread(Hammer, punk, &bStop);
+	}
+	fn();
+	bStop = true;
+	if (bHammer)
+	{
+		thread.join();
+	}
+}
+
+template <class APP>
+bool BenchLayout(const CBenchRunner& runner, const char* szName,
+	IClassFactory* pTargetCF, CFakeClientSink* pClient)
+{
+	typedef CMetaFactory<CComClassFactoryProtocol, APP> MetaFactory;
+	CComPtr<IClassFactory> spCF;
+	CComPtr<IInternetProtocol> spProtocol;
+	CComQIPtr<IInternetBindInfo> spBindInfo(pClient->GetUnknown());
+	if (FAILED(MetaFactory::CreateInstance(pTargetCF, &spCF)) ||
+		FAILED(spCF->CreateInstance(0, IID_IInternetProtocol,
+			reinterpret_cast<void**>(&spProtocol))) ||
+		FAILED(spProtocol->Start(L"http://example.com/", pClient,
+			spBindInfo, 0, 0)))
+	{
+		return false;
+	}
+	APP* pApp = static_cast<APP*>(
+		static_cast<IInternetProtocol*>(spProtocol));
+	CComQIPtr<IInternetProtocolSink> spSink(pApp->GetSink()->GetUnknown());
+	if (!spSink)
+	{
+		return false;
+	}
+
+	char szRunName[64];
+	for (int iHammer = 0; iHammer < 2; ++iHammer)
+	{
+		bool bHammer = (iHammer != 0);
+		sprintf(szRunName, "%s, Read, %s", szName,
+			bHammer ? "hammered" : "alone");
+		runner.Run(szRunName, 5000000, 0, [&](unsigned long cCalls)
+		{
+			WithHammering(spProtocol, bHammer, [&]()
+			{
+				for (unsigned long i = 0; i < cCalls; ++i)
+				{
+					ULONG cbRead = 0;
+					spProtocol->Read(g_readBuffer, sizeof(g_readBuffer),
+						&cbRead);
+				}
+			});
+		});
+		sprintf(szRunName, "%s, ReportProgress, %s", szName,
+			bHammer ? "hammered" : "alone");
+		runner.Run(szRunName, 5000000, 0, [&](unsigned long cCalls)
+		{
+			WithHammering(spSink, bHammer, [&]()
+			{
+				for (unsigned long i = 0; i < cCalls; ++i)
+				{
+					spSink->ReportProgress(BINDSTATUS_DOWNLOADINGDATA, 0);
+				}
+			});
+		});
+	}
+	spProtocol->Terminate(0);
+	return true;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char** argv)
+{
+	CBenchRunner runner(argc, argv);
+	printf("%u hardware threads\n", std::thread::hardware_concurrency());
+
+	// Reads past the end of an empty body, which the APP still forwards
+	FakeResponse response;
+	response.bDeliverOnStart = false;
+	CComObject<CFakeTargetClassFactory>* pTargetCF = 0;
+	CFakeTargetClassFactory::Create(response, &pTargetCF);
+	CComPtr<IClassFactory> spTargetCF = pTargetCF;
+
+	CComObject<CFakeClientSink>* pClient = 0;
+	CComObject<CFakeClientSink>::CreateInstance(&pClient);
+	CComPtr<IInternetProtocolSink> spClient = pClient;
+
+	runner.PrintHeader("Forwarded calls, with AddRef/Release on another thread");
+	bool bOk = BenchLayout<CCompactAPP>(runner, "CompactLayout", spTargetCF,
+		pClient);
+	bOk &= BenchLayout<CCacheLineAPP>(runner, "CacheLineLayout", spTargetCF,
+		pClient);
+	if (!bOk)
+	{
+		printf("\nCreating or starting a protocol failed\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,311 @@
+// What forwarding through a passthrough APP costs per call, against
+// calling the fake target protocol (see Portable/FakeProtocol.h) directly.
+// Covers CInternetProtocol with NoSinkStartPolicy and with
+// CustomSinkStartPolicy, whose sink sits between the target and the
+// client.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include <vector>
+
+#include "ProtocolImpl.h"
+#include "ProtocolCF.h"
+#include "Portable/FakeProtocol.h"
+#include "bench/BenchUtil.h"
+
+using namespace PassthroughAPP;
+using namespace PassthroughAPP::Bench;
+
+namespace
+{
+
+class CBenchSink :
+	public CInternetProtocolSinkWithSP<CBenchSink>
+{
+};
+
+class CBenchSinkAPP;
+typedef CustomSinkStartPolicy<CBenchSinkAPP, CBenchSink> BenchStartPolicy;
+
+class CBenchSinkAPP :
+	public CInternetProtocol<BenchStartPolicy>
+{
+};
+
+class CBenchNoSinkAPP :
+	public CInternetProtocol<NoSinkStartPolicy>
+{
+};
+
+const ULONG cbBody = 4 * 1024 * 1024;
+const ULONG cbSmallBody = 16 * 1024;
+std::vector<BYTE> g_body(cbBody, 'x');
+BYTE g_readBuffer[65536];
+
+HRESULT CreateFactories(const FakeResponse& response,
+	IClassFactory** ppTargetCF, IClassFactory** ppNoSinkCF,
+	IClassFactory** ppSinkCF)
+{
+	CComObject<CFakeTargetClassFactory>* pTargetCF = 0;
+	HRESULT hr = CFakeTargetClassFactory::Create(response, &pTargetCF);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+	pTargetCF->AddRef();
+	*ppTargetCF = pTargetCF;
+	hr = CMetaFactory<CComClassFactoryProtocol, CBenchNoSinkAPP>::
+		CreateInstance(pTargetCF, ppNoSinkCF);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+	return CMetaFactory<CComClassFactoryProtocol, CBenchSinkAPP>::
+		CreateInstance(pTargetCF, ppSinkCF);
+}
+
+HRESULT Start(IInternetProtocol* pProtocol, CFakeClientSink* pClient)
+{
+	CComQIPtr<IInternetBindInfo> spBindInfo(pClient->GetUnknown());
+	return pProtocol->Start(L"http://example.com/", pClient, spBindInfo, 0,
+		0);
+}
+
+void Terminate(std::vector<CComPtr<IInternetProtocol> >* pProtocols)
+{
+	for (size_t i = 0; i < pProtocols->size(); ++i)
+	{
+		if ((*pProtocols)[i])
+		{
+			(*pProtocols)[i]->Terminate(0);
+		}
+	}
+	pProtocols->clear();
+}
+
+// Reads the whole body cb bytes at a time, over and over, until cCalls
+// Read calls are made
+bool BenchRead(IClassFactory* pCF, CFakeClientSink* pClient, ULONG cb,
+	unsigned long cCalls)
+{
+	unsigned long cDone = 0;
+	while (cDone < cCalls)
+	{
+		CComPtr<IInternetProtocol> spProtocol;
+		if (FAILED(pCF->CreateInstance(0, IID_IInternetProtocol,
+				reinterpret_cast<void**>(&spProtocol))) ||
+			FAILED(Start(spProtocol, pClient)))
+		{
+			return false;
+		}
+		HRESULT hr = S_OK;
+		while (hr == S_OK && cDone < cCalls)
+		{
+			ULONG cbRead = 0;
+			hr = spProtocol->Read(g_readBuffer, cb, &cbRead);
+			++cDone;
+		}
+		spProtocol->Terminate(0);
+		if (FAILED(hr))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Creates, starts, reads and terminates whole requests
+bool BenchRequest(IClassFactory* pCF, unsigned long cCalls)
+{
+	for (unsigned long i = 0; i < cCalls; ++i)
+	{
+		CComObject<CFakeClientSink>* pClient = 0;
+		CComObject<CFakeClientSink>::CreateInstance(&pClient);
+		CComPtr<IInternetProtocolSink> spClient = pClient;
+		CComPtr<IInternetProtocol> spProtocol;
+		if (FAILED(pCF->CreateInstance(0, IID_IInternetProtocol,
+				reinterpret_cast<void**>(&spProtocol))))
+		{
+			return false;
+		}
+		pClient->SetProtocol(spProtocol);
+		pClient->SetReadSize(4096);
+		HRESULT hr = Start(spProtocol, pClient);
+		spProtocol->Terminate(0);
+		pClient->SetProtocol(0);
+		if (FAILED(hr) || pClient->m_hrResult != S_OK)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Times Start alone, on protocols created beforehand
+bool BenchStart(const CBenchRunner& runner, const char* szName,
+	IClassFactory* pCF, CFakeClientSink* pClient, unsigned long cCalls)
+{
+	std::vector<CComPtr<IInternetProtocol> > protocols;
+	bool bOk = true;
+	runner.Run(szName, cCalls, 0,
+		[&](unsigned long cRunCalls)
+		{
+			Terminate(&protocols);
+			protocols.resize(cRunCalls);
+			for (unsigned long i = 0; i < cRunCalls; ++i)
+			{
+				bOk &= SUCCEEDED(pCF->CreateInstance(0, IID_IInternetProtocol,
+					reinterpret_cast<void**>(&protocols[i])));
+			}
+		},
+		[&](unsigned long cRunCalls)
+		{
+			for (unsigned long i = 0; i < cRunCalls; ++i)
+			{
+				bOk &= SUCCEEDED(Start(protocols[i], pClient));
+			}
+		});
+	Terminate(&protocols);
+	return bOk;
+}
+
+// Calls the sink the target reports to. For a protocol without a sink of
+// its own, that is the client's
+bool BenchReport(const CBenchRunner& runner, const char* szName,
+	IInternetProtocolSink* pSink, unsigned long cCalls, bool bData)
+{
+	runner.Run(szName, cCalls, 0, [&](unsigned long cRunCalls)
+	{
+		for (unsigned long i = 0; i < cRunCalls; ++i)
+		{
+			if (bData)
+			{
+				pSink->ReportData(BSCF_INTERMEDIATEDATANOTIFICATION, i, 0);
+			}
+			else
+			{
+				pSink->ReportProgress(BINDSTATUS_DOWNLOADINGDATA, 0);
+			}
+		}
+	});
+	return true;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char** argv)
+{
+	CBenchRunner runner(argc, argv);
+
+	FakeResponse response;
+	response.pbBody = &g_body[0];
+	response.cbBody = cbBody;
+	CComPtr<IClassFactory> spTargetCF;
+	CComPtr<IClassFactory> spNoSinkCF;
+	CComPtr<IClassFactory> spSinkCF;
+	if (FAILED(CreateFactories(response, &spTargetCF, &spNoSinkCF,
+		&spSinkCF)))
+	{
+		printf("Creating the factories failed\n");
+		return 1;
+	}
+
+	// Doesn't read by itself, so that the benchmark does
+	CComObject<CFakeClientSink>* pClient = 0;
+	CComObject<CFakeClientSink>::CreateInstance(&pClient);
+	CComPtr<IInternetProtocolSink> spClient = pClient;
+
+	struct
+	{
+		const char* szName;
+		IClassFactory* pCF;
+	} const targets[] =
+	{
+		{"direct", spTargetCF},
+		{"NoSinkStartPolicy", spNoSinkCF},
+		{"CustomSinkStartPolicy", spSinkCF}
+	};
+	const size_t cTargets = sizeof(targets) / sizeof(targets[0]);
+	char szName[64];
+	bool bOk = true;
+
+	static const ULONG reads[] = {64, 4096};
+	for (size_t iRead = 0; iRead < sizeof(reads) / sizeof(reads[0]);
+		++iRead)
+	{
+		ULONG cb = reads[iRead];
+		sprintf(szName, "Read, %lu bytes per call",
+			static_cast<unsigned long>(cb));
+		runner.PrintHeader(szName);
+		for (size_t i = 0; i < cTargets; ++i)
+		{
+			IClassFactory* pCF = targets[i].pCF;
+			runner.Run(targets[i].szName, 2000000, cb,
+				[&](unsigned long cCalls)
+				{
+					bOk &= BenchRead(pCF, pClient, cb, cCalls);
+				});
+		}
+	}
+
+	runner.PrintHeader("Start, body delivered from Read later");
+	FakeResponse pending = response;
+	pending.bDeliverOnStart = false;
+	static_cast<CComObject<CFakeTargetClassFactory>*>(
+		spTargetCF.p)->SetResponse(pending);
+	for (size_t i = 0; i < cTargets; ++i)
+	{
+		bOk &= BenchStart(runner, targets[i].szName, targets[i].pCF,
+			pClient, 20000);
+	}
+
+	runner.PrintHeader("ReportData from the target");
+	for (int iReport = 0; iReport < 2; ++iReport)
+	{
+		if (iReport)
+		{
+			runner.PrintHeader("ReportProgress from the target");
+		}
+		bOk &= BenchReport(runner, "direct, and NoSinkStartPolicy",
+			pClient, 10000000, !iReport);
+
+		CComPtr<IInternetProtocol> spProtocol;
+		bOk &= SUCCEEDED(spSinkCF->CreateInstance(0, IID_IInternetProtocol,
+			reinterpret_cast<void**>(&spProtocol))) &&
+			SUCCEEDED(Start(spProtocol, pClient));
+		if (spProtocol)
+		{
+			CBenchSinkAPP* pApp = static_cast<CBenchSinkAPP*>(
+				static_cast<IInternetProtocol*>(spProtocol));
+			CComQIPtr<IInternetProtocolSink> spSink(
+				pApp->GetSink()->GetUnknown());
+			bOk &= spSink != 0 && BenchReport(runner,
+				"CustomSinkStartPolicy", spSink, 10000000, !iReport);
+			spProtocol->Terminate(0);
+		}
+	}
+
+	runner.PrintHeader("Request: create, start, read 16 KB, terminate");
+	FakeResponse small = response;
+	small.cbBody = cbSmallBody;
+	small.cbChunk = 4096;
+	static_cast<CComObject<CFakeTargetClassFactory>*>(
+		spTargetCF.p)->SetResponse(small);
+	for (size_t i = 0; i < cTargets; ++i)
+	{
+		IClassFactory* pCF = targets[i].pCF;
+		runner.Run(targets[i].szName, 10000, cbSmallBody,
+			[&](unsigned long cCalls)
+			{
+				bOk &= BenchRequest(pCF, cCalls);
+			});
+	}
+
+	if (!bOk)
+	{
+		printf("\nA call failed\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,218 @@
+// Creating and releasing the protocol/sink object of a CustomSinkStartPolicy
+// APP, allocated from the heap (DECLARE_NOT_AGGREGATABLE_PROTSINK) and from
+// PooledAllocPolicy (DECLARE_NOT_AGGREGATABLE_PROTSINK_POOLED): with target
+// creation deferred, so that CreateInstance does little but allocate, from
+// one thread and from several at once, and whole requests.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include <thread>
+#include <vector>
+
+#include "ProtocolImpl.h"
+#include "ProtocolCF.h"
+#include "Portable/FakeProtocol.h"
+#include "bench/BenchUtil.h"
+
+using namespace PassthroughAPP;
+using namespace PassthroughAPP::Bench;
+
+namespace
+{
+
+class CBenchSink :
+	public CInternetProtocolSinkWithSP<CBenchSink>
+{
+};
+
+class CHeapAPP;
+typedef CustomSinkStartPolicy<CHeapAPP, CBenchSink> HeapStartPolicy;
+
+class CHeapAPP :
+	public CInternetProtocol<HeapStartPolicy>
+{
+public:
+	DECLARE_NOT_AGGREGATABLE_PROTSINK(CHeapAPP, CBenchSink)
+};
+
+class CPooledAPP;
+typedef CustomSinkStartPolicy<CPooledAPP, CBenchSink> PooledStartPolicy;
+
+class CPooledAPP :
+	public CInternetProtocol<PooledStartPolicy>
+{
+public:
+	DECLARE_NOT_AGGREGATABLE_PROTSINK_POOLED(CPooledAPP, CBenchSink)
+};
+
+BYTE g_body[1024];
+
+template <class APP>
+HRESULT CreateFactory(IClassFactory* pTargetCF, bool bDefer,
+	IClassFactory** ppCF)
+{
+	CComClassFactoryProtocol* pFactory = 0;
+	HRESULT hr = CMetaFactory<CComClassFactoryProtocol, APP>::CreateInstance(
+		&pFactory);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+	CComPtr<IClassFactory> spCF = pFactory;
+	pFactory->SetTargetClassFactory(pTargetCF);
+	pFactory->SetDeferTargetCreation(bDefer);
+	*ppCF = spCF.Detach();
+	return S_OK;
+}
+
+void CreateInstances(IClassFactory* pCF, unsigned long cCalls, bool* pbOk)
+{
+	for (unsigned long i = 0; i < cCalls; ++i)
+	{
+		IInternetProtocol* pProtocol = 0;
+		if (FAILED(pCF->CreateInstance(0, IID_IInternetProtocol,
+			reinterpret_cast<void**>(&pProtocol))))
+		{
+			*pbOk = false;
+			return;
+		}
+		pProtocol->Release();
+	}
+}
+
+// Splits cCalls between cThreads threads, the calling one included
+bool CreateInstancesOn(IClassFactory* pCF, unsigned long cCalls,
+	unsigned cThreads)
+{
+	std::vector<std::thread> threads;
+	// Not vector<bool>, each thread writes its own
+	std::vector<char> results(cThreads, 1);
+	for (unsigned i = 1; i < cThreads; ++i)
+	{
+		threads.push_back(std::thread([&, i]()
+		{
+			bool bOk = true;
+			CreateInstances(pCF, cCalls / cThreads, &bOk);
+			results[i] = bOk;
+		}));
+	}
+	bool bOk = true;
+	CreateInstances(pCF, cCalls / cThreads, &bOk);
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		threads[i].join();
+	}
+	for (unsigned i = 1; i < cThreads; ++i)
+	{
+		bOk &= (results[i] != 0);
+	}
+	return bOk;
+}
+
+bool RunRequests(IClassFactory* pCF, unsigned long cCalls)
+{
+	for (unsigned long i = 0; i < cCalls; ++i)
+	{
+		CComObject<CFakeClientSink>* pClient = 0;
+		CComObject<CFakeClientSink>::CreateInstance(&pClient);
+		CComPtr<IInternetProtocolSink> spClient = pClient;
+		CComPtr<IInternetProtocol> spProtocol;
+		if (FAILED(pCF->CreateInstance(0, IID_IInternetProtocol,
+			reinterpret_cast<void**>(&spProtocol))))
+		{
+			return false;
+		}
+		pClient->SetProtocol(spProtocol);
+		pClient->SetReadSize(4096);
+		CComQIPtr<IInternetBindInfo> spBindInfo(spClient);
+		HRESULT hr = spProtocol->Start(L"http://example.com/", spClient,
+			spBindInfo, 0, 0);
+		spProtocol->Terminate(0);
+		pClient->SetProtocol(0);
+		if (FAILED(hr) || pClient->m_hrResult != S_OK)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+template <class APP>
+bool BenchAllocator(const CBenchRunner& runner, const char* szName,
+	IClassFactory* pTargetCF, unsigned cThreads)
+{
+	CComPtr<IClassFactory> spDeferredCF;
+	CComPtr<IClassFactory> spCF;
+	if (FAILED(CreateFactory<APP>(pTargetCF, true, &spDeferredCF)) ||
+		FAILED(CreateFactory<APP>(pTargetCF, false, &spCF)))
+	{
+		return false;
+	}
+
+	bool bOk = true;
+	char szTitle[80];
+	sprintf(szTitle, "%s, protocol/sink object of %lu bytes", szName,
+		static_cast<unsigned long>(sizeof(typename APP::ComObjectClass)));
+	runner.PrintHeader(szTitle);
+	runner.Run("CreateInstance and Release, 1 thread", 2000000, 0,
+		[&](unsigned long cCalls)
+		{
+			CreateInstances(spDeferredCF, cCalls, &bOk);
+		});
+	char szRun[64];
+	sprintf(szRun, "CreateInstance and Release, %u threads", cThreads);
+	runner.Run(szRun, 2000000, 0, [&](unsigned long cCalls)
+	{
+		bOk &= CreateInstancesOn(spDeferredCF, cCalls, cThreads);
+	});
+	runner.Run("Whole request", 200000, sizeof(g_body),
+		[&](unsigned long cCalls)
+		{
+			bOk &= RunRequests(spCF, cCalls);
+		});
+	return bOk;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char** argv)
+{
+	CBenchRunner runner(argc, argv);
+	unsigned cThreads = std::thread::hardware_concurrency();
+	if (cThreads < 2)
+	{
+		cThreads = 2;
+	}
+	else if (cThreads > 8)
+	{
+		cThreads = 8;
+	}
+
+	FakeResponse response;
+	response.pbBody = g_body;
+	response.cbBody = sizeof(g_body);
+	CComObject<CFakeTargetClassFactory>* pTargetCF = 0;
+	CFakeTargetClassFactory::Create(response, &pTargetCF);
+	CComPtr<IClassFactory> spTargetCF = pTargetCF;
+
+	bool bOk = BenchAllocator<CHeapAPP>(runner, "HeapAllocPolicy",
+		spTargetCF, cThreads);
+	bOk &= BenchAllocator<CPooledAPP>(runner, "PooledAllocPolicy",
+		spTargetCF, cThreads);
+
+	PoolStatistics stats;
+	PooledAllocPolicy<CPooledAPP>::GetStatistics(&stats);
+	printf("\n%-44s %10ld\n%-44s %10ld\n%-44s %10ld\n", "Pool hits",
+		static_cast<long>(stats.cHits), "Pool misses",
+		static_cast<long>(stats.cMisses), "Most blocks in use at once",
+		static_cast<long>(stats.cHighWater));
+	PooledAllocPolicy<CPooledAPP>::Trim();
+
+	if (!bOk)
+	{
+		printf("\nCreating an object or a request failed\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,214 @@
+// What the ReportProgress status mask of CInternetProtocolSinkWithSP saves
+// a sink that handles 3 of the 16 status codes a download reports: the
+// target calls the sink's ReportProgress, which forwards every code to
+// the client. Sinks that override ReportProgress and pick out their codes
+// with a switch are compared with sinks that name them in the mask and
+// implement OnReportProgress, with no work besides the switch, and with
+// the lock on the sink's state most such sinks take first. A sink that
+// doesn't look at progress at all is the baseline.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include "ProtocolImpl.h"
+#include "ProtocolCF.h"
+#include "Portable/FakeProtocol.h"
+#include "bench/BenchUtil.h"
+
+using namespace PassthroughAPP;
+using namespace PassthroughAPP::Bench;
+
+namespace
+{
+
+// The codes of a download from a server, in order
+const ULONG g_rgulStatusCodes[] =
+{
+	BINDSTATUS_FINDINGRESOURCE,
+	BINDSTATUS_CONNECTING,
+	BINDSTATUS_SENDINGREQUEST,
+	BINDSTATUS_COOKIE_SENT,
+	BINDSTATUS_MIMETYPEAVAILABLE,
+	BINDSTATUS_ACCEPTRANGES,
+	BINDSTATUS_CACHEFILENAMEAVAILABLE,
+	BINDSTATUS_BEGINDOWNLOADDATA,
+	BINDSTATUS_DOWNLOADINGDATA,
+	BINDSTATUS_DOWNLOADINGDATA,
+	BINDSTATUS_REDIRECTING,
+	BINDSTATUS_DOWNLOADINGDATA,
+	BINDSTATUS_DOWNLOADINGDATA,
+	BINDSTATUS_DOWNLOADINGDATA,
+	BINDSTATUS_ENDDOWNLOADDATA,
+	BINDSTATUS_DECODING
+};
+const ULONG cStatusCodes =
+	sizeof(g_rgulStatusCodes) / sizeof(g_rgulStatusCodes[0]);
+
+const ULONGLONG ullHandled = BINDSTATUS_BIT(BINDSTATUS_MIMETYPEAVAILABLE) |
+	BINDSTATUS_BIT(BINDSTATUS_CACHEFILENAMEAVAILABLE) |
+	BINDSTATUS_BIT(BINDSTATUS_REDIRECTING);
+
+class CPlainSink :
+	public CInternetProtocolSinkWithSP<CPlainSink>
+{
+};
+
+// What the sinks do with the codes they handle
+class CHandledCodes
+{
+public:
+	CHandledCodes() : m_cHandled(0), m_szLast(0) {}
+
+	void Handle(LPCWSTR szStatusText)
+	{
+		++m_cHandled;
+		m_szLast = szStatusText;
+	}
+
+	CComAutoCriticalSection m_cs;
+	ULONG m_cHandled;
+	LPCWSTR m_szLast;
+};
+
+template <bool t_bLock>
+class CSwitchSink :
+	public CInternetProtocolSinkWithSP<CSwitchSink<t_bLock> >,
+	public CHandledCodes
+{
+	typedef CInternetProtocolSinkWithSP<CSwitchSink<t_bLock> > BaseClass;
+public:
+	STDMETHODIMP ReportProgress(ULONG ulStatusCode, LPCWSTR szStatusText)
+	{
+		if (t_bLock)
+		{
+			CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+			Pick(ulStatusCode, szStatusText);
+		}
+		else
+		{
+			Pick(ulStatusCode, szStatusText);
+		}
+		return BaseClass::ReportProgress(ulStatusCode, szStatusText);
+	}
+
+private:
+	void Pick(ULONG ulStatusCode, LPCWSTR szStatusText)
+	{
+		switch (ulStatusCode)
+		{
+		case BINDSTATUS_MIMETYPEAVAILABLE:
+		case BINDSTATUS_CACHEFILENAMEAVAILABLE:
+		case BINDSTATUS_REDIRECTING:
+			Handle(szStatusText);
+			break;
+		}
+	}
+};
+
+template <bool t_bLock>
+class CMaskSink :
+	public CInternetProtocolSinkWithSP<CMaskSink<t_bLock>,
+		CComMultiThreadModel, ullHandled>,
+	public CHandledCodes
+{
+	typedef CInternetProtocolSinkWithSP<CMaskSink<t_bLock>,
+		CComMultiThreadModel, ullHandled> BaseClass;
+public:
+	HRESULT OnReportProgress(ULONG ulStatusCode, LPCWSTR szStatusText)
+	{
+		if (t_bLock)
+		{
+			CComCritSecLock<CComAutoCriticalSection> lock(m_cs);
+			Handle(szStatusText);
+		}
+		else
+		{
+			Handle(szStatusText);
+		}
+		return BaseClass::OnReportProgress(ulStatusCode, szStatusText);
+	}
+};
+
+template <class Sink>
+class CBenchAPP :
+	public CInternetProtocol<CustomSinkStartPolicy<CBenchAPP<Sink>, Sink> >
+{
+};
+
+// Reports the codes in turn to a started request's sink
+template <class Sink>
+bool BenchSink(const CBenchRunner& runner, const char* szName,
+	IClassFactory* pTargetCF)
+{
+	typedef CBenchAPP<Sink> APP;
+	typedef CMetaFactory<CComClassFactoryProtocol, APP> MetaFactory;
+	CComPtr<IClassFactory> spCF;
+	CComObject<CFakeClientSink>* pClient = 0;
+	CComObject<CFakeClientSink>::CreateInstance(&pClient);
+	CComPtr<IInternetProtocolSink> spClient = pClient;
+	CComQIPtr<IInternetBindInfo> spBindInfo(spClient);
+	CComPtr<IInternetProtocol> spProtocol;
+	if (FAILED(MetaFactory::CreateInstance(pTargetCF, &spCF)) ||
+		FAILED(spCF->CreateInstance(0, IID_IInternetProtocol,
+			reinterpret_cast<void**>(&spProtocol))) ||
+		FAILED(spProtocol->Start(L"http://example.com/", spClient,
+			spBindInfo, 0, 0)))
+	{
+		return false;
+	}
+	APP* pApp = static_cast<APP*>(
+		static_cast<IInternetProtocol*>(spProtocol));
+	CComPtr<IInternetProtocolSink> spSink;
+	if (FAILED(pApp->GetSink()->GetUnknown()->QueryInterface(&spSink)))
+	{
+		return false;
+	}
+
+	runner.Run(szName, 10000000, 0, [&](unsigned long cCalls)
+	{
+		for (unsigned long i = 0; i < cCalls; ++i)
+		{
+			spSink->ReportProgress(g_rgulStatusCodes[i % cStatusCodes], 0);
+		}
+	});
+	spProtocol->Terminate(0);
+	return true;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char** argv)
+{
+	CBenchRunner runner(argc, argv);
+
+	// A target that reports nothing by itself
+	FakeResponse response;
+	response.bDeliverOnStart = false;
+	CComObject<CFakeTargetClassFactory>* pTargetCF = 0;
+	CFakeTargetClassFactory::Create(response, &pTargetCF);
+	CComPtr<IClassFactory> spTargetCF = pTargetCF;
+	if (!spTargetCF)
+	{
+		printf("Creating the target factory failed\n");
+		return 1;
+	}
+
+	bool bOk = true;
+	runner.PrintHeader("ReportProgress, 3 of 16 codes handled");
+	bOk &= BenchSink<CPlainSink>(runner, "No override", spTargetCF);
+	bOk &= BenchSink<CSwitchSink<false> >(runner, "ReportProgress, switch",
+		spTargetCF);
+	bOk &= BenchSink<CMaskSink<false> >(runner, "Mask, OnReportProgress",
+		spTargetCF);
+	bOk &= BenchSink<CSwitchSink<true> >(runner,
+		"ReportProgress, lock and switch", spTargetCF);
+	bOk &= BenchSink<CMaskSink<true> >(runner,
+		"Mask, OnReportProgress with lock", spTargetCF);
+
+	if (!bOk)
+	{
+		printf("\nStarting a request failed\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,158 @@
+// QueryInterface through DECLARE_HASHED_COM_MAP() against ATL's linear
+// walk of the same COM map, and through the passthrough objects, which
+// use it.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include "ProtocolImpl.h"
+#include "ProtocolCF.h"
+#include "Portable/FakeProtocol.h"
+#include "bench/BenchUtil.h"
+
+using namespace PassthroughAPP;
+using namespace PassthroughAPP::Bench;
+
+namespace
+{
+
+// Implements one interface, and answers the IIDs of the passthrough APP's
+// map with it, in the same order, so that the two maps below cost what
+// that map costs to search. The blind entry at the end finds nothing, as
+// delegating to a target without the interface would
+class ATL_NO_VTABLE CBenchObjectBase :
+	public CComObjectRootEx<CComMultiThreadModel>,
+	public IInternetProtocolSink
+{
+public:
+	static HRESULT WINAPI Blind(void* pv, REFIID iid, void** ppvObject,
+		DWORD_PTR dw)
+	{
+		return E_NOINTERFACE;
+	}
+
+	// IInternetProtocolSink
+	STDMETHODIMP Switch(PROTOCOLDATA*)
+	{
+		return S_OK;
+	}
+	STDMETHODIMP ReportProgress(ULONG, LPCWSTR)
+	{
+		return S_OK;
+	}
+	STDMETHODIMP ReportData(DWORD, ULONG, ULONG)
+	{
+		return S_OK;
+	}
+	STDMETHODIMP ReportResult(HRESULT, DWORD, LPCWSTR)
+	{
+		return S_OK;
+	}
+};
+
+#define BENCH_COM_MAP_ENTRIES() \
+	COM_INTERFACE_ENTRY_IID(IID_IPassthroughObject, IInternetProtocolSink) \
+	COM_INTERFACE_ENTRY_IID(IID_IInternetProtocolRoot, IInternetProtocolSink) \
+	COM_INTERFACE_ENTRY_IID(IID_IInternetProtocol, IInternetProtocolSink) \
+	COM_INTERFACE_ENTRY_IID(IID_IInternetProtocolEx, IInternetProtocolSink) \
+	COM_INTERFACE_ENTRY_IID(IID_IInternetProtocolInfo, IInternetProtocolSink) \
+	COM_INTERFACE_ENTRY_IID(IID_IInternetPriority, IInternetProtocolSink) \
+	COM_INTERFACE_ENTRY_IID(IID_IInternetThreadSwitch, IInternetProtocolSink) \
+	COM_INTERFACE_ENTRY_IID(IID_IWinInetInfo, IInternetProtocolSink) \
+	COM_INTERFACE_ENTRY_IID(IID_IWinInetHttpInfo, IInternetProtocolSink) \
+	COM_INTERFACE_ENTRY_IID(IID_IWinInetCacheHints, IInternetProtocolSink) \
+	COM_INTERFACE_ENTRY_IID(IID_IWinInetCacheHints2, IInternetProtocolSink) \
+	COM_INTERFACE_ENTRY_FUNC_BLIND(0, Blind)
+
+class ATL_NO_VTABLE CLinearObject :
+	public CBenchObjectBase
+{
+public:
+	BEGIN_COM_MAP(CLinearObject)
+		BENCH_COM_MAP_ENTRIES()
+	END_COM_MAP()
+};
+
+class ATL_NO_VTABLE CHashedObject :
+	public CBenchObjectBase
+{
+public:
+	DECLARE_HASHED_COM_MAP()
+	BEGIN_COM_MAP(CHashedObject)
+		BENCH_COM_MAP_ENTRIES()
+	END_COM_MAP()
+};
+
+class CBenchAPP :
+	public CInternetProtocol<NoSinkStartPolicy>
+{
+};
+
+void BenchQueryInterface(const CBenchRunner& runner, const char* szName,
+	IUnknown* punk, REFIID iid)
+{
+	runner.Run(szName, 10000000, 0, [&](unsigned long cCalls)
+	{
+		for (unsigned long i = 0; i < cCalls; ++i)
+		{
+			IUnknown* punkItf = 0;
+			if (SUCCEEDED(punk->QueryInterface(iid,
+				reinterpret_cast<void**>(&punkItf))))
+			{
+				punkItf->Release();
+			}
+		}
+	});
+}
+
+} // end anonymous namespace
+
+int main(int argc, char** argv)
+{
+	CBenchRunner runner(argc, argv);
+
+	CComObject<CLinearObject>* pLinear = 0;
+	CComObject<CLinearObject>::CreateInstance(&pLinear);
+	CComPtr<IUnknown> spLinear = pLinear->GetUnknown();
+	CComObject<CHashedObject>* pHashed = 0;
+	CComObject<CHashedObject>::CreateInstance(&pHashed);
+	CComPtr<IUnknown> spHashed = pHashed->GetUnknown();
+
+	FakeResponse response;
+	CComObject<CFakeTargetClassFactory>* pTargetCF = 0;
+	CFakeTargetClassFactory::Create(response, &pTargetCF);
+	CComPtr<IClassFactory> spTargetCF = pTargetCF;
+	CComPtr<IClassFactory> spCF;
+	CComPtr<IUnknown> spAPP;
+	typedef CMetaFactory<CComClassFactoryProtocol, CBenchAPP> MetaFactory;
+	if (FAILED(MetaFactory::CreateInstance(spTargetCF, &spCF)) ||
+		FAILED(spCF->CreateInstance(0, IID_IUnknown,
+			reinterpret_cast<void**>(&spAPP))))
+	{
+		printf("Creating the APP failed\n");
+		return 1;
+	}
+
+	struct
+	{
+		const char* szName;
+		const IID* piid;
+	} const queries[] =
+	{
+		{"first entry", &IID_IPassthroughObject},
+		{"middle entry", &IID_IInternetPriority},
+		{"last entry", &IID_IWinInetCacheHints2},
+		{"not in the map", &IID_IHttpNegotiate}
+	};
+	for (size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); ++i)
+	{
+		runner.PrintHeader(queries[i].szName);
+		BenchQueryInterface(runner, "ATL map", spLinear, *queries[i].piid);
+		BenchQueryInterface(runner, "hashed map", spHashed,
+			*queries[i].piid);
+		// Includes asking the target for what the APP passes through
+		BenchQueryInterface(runner, "CInternetProtocol", spAPP,
+			*queries[i].piid);
+	}
+	return 0;
+}
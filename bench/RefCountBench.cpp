@@ -0,0 +1,147 @@
+// What AddRef and Release cost on the protocol and the sink of a
+// passthrough APP, and what they add up to over a request. Built twice,
+// as RefCountBench with separate counts per part and as
+// RefCountBenchSingle with PASSTHROUGHAPP_SINGLE_REFCOUNT defined.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include <thread>
+
+#include "ProtocolImpl.h"
+#include "ProtocolCF.h"
+#include "Portable/FakeProtocol.h"
+#include "bench/BenchUtil.h"
+
+using namespace PassthroughAPP;
+using namespace PassthroughAPP::Bench;
+
+namespace
+{
+
+class CBenchSink :
+	public CInternetProtocolSinkWithSP<CBenchSink>
+{
+};
+
+class CBenchAPP;
+typedef CustomSinkStartPolicy<CBenchAPP, CBenchSink> BenchStartPolicy;
+
+class CBenchAPP :
+	public CInternetProtocol<BenchStartPolicy>
+{
+};
+
+BYTE g_body[1024];
+
+void AddRefRelease(IUnknown* punk, unsigned long cCalls)
+{
+	for (unsigned long i = 0; i < cCalls; ++i)
+	{
+		punk->AddRef();
+		punk->Release();
+	}
+}
+
+// Two threads at once on the same object, as urlmon's worker thread and
+// the thread that started the binding do
+void AddRefReleaseShared(IUnknown* punk1, IUnknown* punk2,
+	unsigned long cCalls)
+{
+	std::thread thread(AddRefRelease, punk2, cCalls);
+	AddRefRelease(punk1, cCalls);
+	thread.join();
+}
+
+bool RunRequests(IClassFactory* pCF, unsigned long cCalls)
+{
+	for (unsigned long i = 0; i < cCalls; ++i)
+	{
+		CComObject<CFakeClientSink>* pClient = 0;
+		CComObject<CFakeClientSink>::CreateInstance(&pClient);
+		CComPtr<IInternetProtocolSink> spClient = pClient;
+		CComPtr<IInternetProtocol> spProtocol;
+		if (FAILED(pCF->CreateInstance(0, IID_IInternetProtocol,
+			reinterpret_cast<void**>(&spProtocol))))
+		{
+			return false;
+		}
+		pClient->SetProtocol(spProtocol);
+		pClient->SetReadSize(4096);
+		CComQIPtr<IInternetBindInfo> spBindInfo(spClient);
+		HRESULT hr = spProtocol->Start(L"http://example.com/", spClient,
+			spBindInfo, 0, 0);
+		spProtocol->Terminate(0);
+		pClient->SetProtocol(0);
+		if (FAILED(hr) || pClient->m_hrResult != S_OK)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char** argv)
+{
+	CBenchRunner runner(argc, argv);
+#ifdef PASSTHROUGHAPP_SINGLE_REFCOUNT
+	printf("PASSTHROUGHAPP_SINGLE_REFCOUNT: one count for all parts\n");
+#else
+	printf("Default: a count per part and one for the object\n");
+#endif
+
+	FakeResponse response;
+	response.pbBody = g_body;
+	response.cbBody = sizeof(g_body);
+	CComObject<CFakeTargetClassFactory>* pTargetCF = 0;
+	CFakeTargetClassFactory::Create(response, &pTargetCF);
+	CComPtr<IClassFactory> spTargetCF = pTargetCF;
+	CComPtr<IClassFactory> spCF;
+	CComPtr<IInternetProtocol> spProtocol;
+	typedef CMetaFactory<CComClassFactoryProtocol, CBenchAPP> MetaFactory;
+	if (FAILED(MetaFactory::CreateInstance(spTargetCF, &spCF)) ||
+		FAILED(spCF->CreateInstance(0, IID_IInternetProtocol,
+			reinterpret_cast<void**>(&spProtocol))))
+	{
+		printf("Creating the APP failed\n");
+		return 1;
+	}
+	CBenchAPP* pApp = static_cast<CBenchAPP*>(spProtocol.p);
+	CComQIPtr<IInternetProtocolSink> spSink(pApp->GetSink()->GetUnknown());
+
+	runner.PrintHeader("AddRef and Release, one thread");
+	runner.Run("protocol", 10000000, 0, [&](unsigned long cCalls)
+	{
+		AddRefRelease(spProtocol, cCalls);
+	});
+	runner.Run("sink", 10000000, 0, [&](unsigned long cCalls)
+	{
+		AddRefRelease(spSink, cCalls);
+	});
+
+	runner.PrintHeader("AddRef and Release, two threads, per pair");
+	runner.Run("protocol and protocol", 5000000, 0,
+		[&](unsigned long cCalls)
+		{
+			AddRefReleaseShared(spProtocol, spProtocol, cCalls);
+		});
+	runner.Run("protocol and sink", 5000000, 0, [&](unsigned long cCalls)
+	{
+		AddRefReleaseShared(spProtocol, spSink, cCalls);
+	});
+
+	runner.PrintHeader("Request: create, start, read 1 KB, terminate");
+	bool bOk = true;
+	runner.Run("CustomSinkStartPolicy", 200000, 0, [&](unsigned long cCalls)
+	{
+		bOk &= RunRequests(spCF, cCalls);
+	});
+	if (!bOk)
+	{
+		printf("\nA request failed\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,209 @@
+// What ReportData coalescing (see ReportDataCoalescer.h) saves the client:
+// a 4 MB body reported a network packet at a time, read by a client that
+// reads whatever is there on every notification, with coalescing off and
+// with byte and time thresholds. Prints the time per request, what each
+// ReportData from the target costs, and the ReportData and Read calls the
+// client gets per request.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include <vector>
+
+#include "ProtocolImpl.h"
+#include "ProtocolCF.h"
+#include "Portable/FakeProtocol.h"
+#include "bench/BenchUtil.h"
+
+using namespace PassthroughAPP;
+using namespace PassthroughAPP::Bench;
+
+namespace
+{
+
+ULONG g_cbMinProgress = 0;
+DWORD g_dwMaxDelay = 0;
+
+class CBenchSink :
+	public CReportDataCoalescingSink<CInternetProtocolSinkWithSP<CBenchSink> >
+{
+	typedef CReportDataCoalescingSink<CInternetProtocolSinkWithSP<CBenchSink> >
+		BaseClass;
+public:
+	HRESULT OnStart(LPCWSTR szUrl, IInternetProtocolSink *pOIProtSink,
+		IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved,
+		IInternetProtocol* pTargetProtocol)
+	{
+		SetReportDataCoalescing(g_cbMinProgress, g_dwMaxDelay);
+		return BaseClass::OnStart(szUrl, pOIProtSink, pOIBindInfo, grfPI,
+			dwReserved, pTargetProtocol);
+	}
+};
+
+class CBenchAPP;
+typedef ReportDataCoalescingStartPolicy<CBenchAPP, CBenchSink>
+	BenchStartPolicy;
+
+class CBenchAPP :
+	public CInternetProtocol<BenchStartPolicy>
+{
+};
+
+typedef CMetaFactory<CComClassFactoryProtocol, CBenchAPP> MetaFactory;
+
+const ULONG cbBody = 4 * 1024 * 1024;
+// A TCP segment on Ethernet
+const ULONG cbPacket = 1460;
+std::vector<BYTE> g_body(cbBody, 'x');
+
+// What the client was called for in the last request
+struct ClientCalls
+{
+	LONG cReportData;
+	LONG cRead;
+};
+
+bool BenchRequest(IClassFactory* pCF, unsigned long cCalls,
+	ClientCalls* pCalls)
+{
+	for (unsigned long i = 0; i < cCalls; ++i)
+	{
+		CComObject<CFakeClientSink>* pClient = 0;
+		CComObject<CFakeClientSink>::CreateInstance(&pClient);
+		CComPtr<IInternetProtocolSink> spClient = pClient;
+		CComPtr<IInternetProtocol> spProtocol;
+		if (FAILED(pCF->CreateInstance(0, IID_IInternetProtocol,
+				reinterpret_cast<void**>(&spProtocol))))
+		{
+			return false;
+		}
+		pClient->SetProtocol(spProtocol);
+		CComQIPtr<IInternetBindInfo> spBindInfo(spClient);
+		HRESULT hr = spProtocol->Start(L"http://example.com/", spClient,
+			spBindInfo, 0, 0);
+		spProtocol->Terminate(0);
+		pClient->SetProtocol(0);
+		if (FAILED(hr) || pClient->m_hrResult != S_OK ||
+			pClient->m_cbReceived != cbBody)
+		{
+			return false;
+		}
+		pCalls->cReportData = pClient->m_cReportData;
+		pCalls->cRead = pClient->m_cRead;
+	}
+	return true;
+}
+
+// Calls the sink the target reports to, which forwards what it doesn't
+// hold back to a client that doesn't read
+bool BenchReport(const CBenchRunner& runner, const char* szName,
+	IClassFactory* pCF, unsigned long cCalls)
+{
+	CComObject<CFakeClientSink>* pClient = 0;
+	CComObject<CFakeClientSink>::CreateInstance(&pClient);
+	CComPtr<IInternetProtocolSink> spClient = pClient;
+	pClient->SetReadSize(0);
+	CComPtr<IInternetProtocol> spProtocol;
+	CComQIPtr<IInternetBindInfo> spBindInfo(spClient);
+	if (FAILED(pCF->CreateInstance(0, IID_IInternetProtocol,
+			reinterpret_cast<void**>(&spProtocol))) ||
+		FAILED(spProtocol->Start(L"http://example.com/", spClient,
+			spBindInfo, 0, 0)))
+	{
+		return false;
+	}
+	CBenchAPP* pApp = static_cast<CBenchAPP*>(
+		static_cast<IInternetProtocol*>(spProtocol));
+	CComQIPtr<IInternetProtocolSink> spSink(pApp->GetSink()->GetUnknown());
+	runner.Run(szName, cCalls, cbPacket, [&](unsigned long cRunCalls)
+	{
+		for (unsigned long i = 0; i < cRunCalls; ++i)
+		{
+			spSink->ReportData(BSCF_INTERMEDIATEDATANOTIFICATION,
+				i * cbPacket, 0);
+		}
+	});
+	spProtocol->Terminate(0);
+	return true;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char** argv)
+{
+	CBenchRunner runner(argc, argv);
+
+	FakeResponse response;
+	response.pbBody = &g_body[0];
+	response.cbBody = cbBody;
+	response.cbChunk = cbPacket;
+	CComObject<CFakeTargetClassFactory>* pTargetCF = 0;
+	CFakeTargetClassFactory::Create(response, &pTargetCF);
+	CComPtr<IClassFactory> spTargetCF = pTargetCF;
+	CComPtr<IClassFactory> spCF;
+	if (!spTargetCF ||
+		FAILED(MetaFactory::CreateInstance(spTargetCF, &spCF)))
+	{
+		printf("Creating the factories failed\n");
+		return 1;
+	}
+
+	struct
+	{
+		const char* szName;
+		ULONG cbMinProgress;
+		DWORD dwMaxDelay;
+	} const settings[] =
+	{
+		{"off", 0, 0},
+		{"16 KB", 16 * 1024, 0},
+		{"64 KB", 64 * 1024, 0},
+		{"256 KB", 256 * 1024, 0},
+		{"16 KB or 5 ms", 16 * 1024, 5},
+		{"5 ms", 0, 5}
+	};
+	const size_t cSettings = sizeof(settings) / sizeof(settings[0]);
+	ClientCalls calls[cSettings];
+	bool bOk = true;
+
+	runner.PrintHeader("Request: 4 MB reported 1460 bytes at a time");
+	for (size_t i = 0; i < cSettings; ++i)
+	{
+		g_cbMinProgress = settings[i].cbMinProgress;
+		g_dwMaxDelay = settings[i].dwMaxDelay;
+		ClientCalls* pCalls = &calls[i];
+		runner.Run(settings[i].szName, 200, cbBody,
+			[&](unsigned long cCalls)
+			{
+				bOk &= BenchRequest(spCF, cCalls, pCalls);
+			});
+	}
+
+	// Not delivered on Start, so that the benchmark reports instead
+	FakeResponse pending = response;
+	pending.bDeliverOnStart = false;
+	pTargetCF->SetResponse(pending);
+	runner.PrintHeader("ReportData from the target, per packet");
+	for (size_t i = 0; i < cSettings; ++i)
+	{
+		g_cbMinProgress = settings[i].cbMinProgress;
+		g_dwMaxDelay = settings[i].dwMaxDelay;
+		bOk &= BenchReport(runner, settings[i].szName, spCF, 10000000);
+	}
+
+	printf("\n%-44s %12s %12s\n", "Client calls per request", "ReportData",
+		"Read");
+	for (size_t i = 0; i < cSettings; ++i)
+	{
+		printf("%-44s %12ld %12ld\n", settings[i].szName,
+			static_cast<long>(calls[i].cReportData),
+			static_cast<long>(calls[i].cRead));
+	}
+
+	if (!bOk)
+	{
+		printf("\nA call failed\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,251 @@
+// What CRequestHeaderRules::Render costs a request: rules adding headers
+// to every request, to 100 hosts and to 20 URL prefixes, rendered for URLs
+// on 64 origins, with every origin's block kept, after headers from the
+// client, and with too few blocks kept for the origins, so that they are
+// rendered again. For comparison, the same rules are checked and their
+// headers concatenated into a string for each request, then copied into
+// memory from CoTaskMemAlloc, the way sinks did before. Both have to give
+// the same headers.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include <string>
+#include <vector>
+
+#include "RequestHeaders.h"
+#include "bench/BenchUtil.h"
+
+using namespace PassthroughAPP;
+using namespace PassthroughAPP::Bench;
+
+namespace
+{
+
+const ULONG cHosts = 100;
+const ULONG cPrefixes = 20;
+const ULONG cOrigins = 64;
+const ULONG cUrls = 1024;
+
+struct Rule
+{
+	Detail::RequestHeaderScope scope;
+	std::wstring pattern;
+	std::wstring name;
+	std::wstring value;
+};
+
+std::wstring GetHost(ULONG iHost)
+{
+	WCHAR szHost[32];
+	swprintf(szHost, sizeof(szHost) / sizeof(szHost[0]), L"site%lu.com",
+		static_cast<unsigned long>(iHost));
+	return szHost;
+}
+
+std::vector<Rule> MakeRules()
+{
+	std::vector<Rule> rules;
+	Rule rule = {Detail::RequestHeaderAll, L"", L"DNT", L"1"};
+	rules.push_back(rule);
+	rule.name = L"X-Requested-With";
+	rule.value = L"PassthroughAPP";
+	rules.push_back(rule);
+	rule.name = L"Save-Data";
+	rule.value = L"on";
+	rules.push_back(rule);
+	for (ULONG i = 0; i < cHosts; ++i)
+	{
+		WCHAR szValue[32];
+		swprintf(szValue, sizeof(szValue) / sizeof(szValue[0]),
+			L"token-%08lx", static_cast<unsigned long>(i * 2654435761u));
+		Rule host = {Detail::RequestHeaderHost, GetHost(i),
+			L"X-Api-Token", szValue};
+		rules.push_back(host);
+	}
+	// After the others, which is the order Render puts their lines in
+	for (ULONG i = 0; i < cPrefixes; ++i)
+	{
+		Rule prefix = {Detail::RequestHeaderUrlPrefix,
+			L"https://www." + GetHost(i * 3) + L"/api/", L"X-Api-Version",
+			L"2"};
+		rules.push_back(prefix);
+	}
+	return rules;
+}
+
+// Every other origin is one of the rules' hosts, and every fourth URL
+// is under a prefix when its host has one
+std::vector<std::wstring> MakeUrls()
+{
+	std::vector<std::wstring> urls;
+	for (ULONG i = 0; i < cUrls; ++i)
+	{
+		ULONG iOrigin = (i * 37) % cOrigins;
+		std::wstring url = L"https://www." + GetHost(iOrigin % 2 ?
+			cHosts + iOrigin : iOrigin);
+		WCHAR szPath[48];
+		swprintf(szPath, sizeof(szPath) / sizeof(szPath[0]),
+			i % 4 ? L"/static/img/%lu.png" : L"/api/items/%lu",
+			static_cast<unsigned long>(i));
+		urls.push_back(url + szPath);
+	}
+	return urls;
+}
+
+HRESULT AddRules(const std::vector<Rule>& rules, CRequestHeaderRules* pRules)
+{
+	for (size_t i = 0; i < rules.size(); ++i)
+	{
+		const Rule& rule = rules[i];
+		HRESULT hr = rule.scope == Detail::RequestHeaderAll ?
+			pRules->AddHeader(rule.name.c_str(), rule.value.c_str()) :
+			rule.scope == Detail::RequestHeaderHost ?
+			pRules->AddHostHeader(rule.pattern.c_str(), rule.name.c_str(),
+				rule.value.c_str()) :
+			pRules->AddUrlPrefixHeader(rule.pattern.c_str(),
+				rule.name.c_str(), rule.value.c_str());
+		if (FAILED(hr))
+		{
+			return hr;
+		}
+	}
+	return S_OK;
+}
+
+// Checks every rule and concatenates the headers of those that apply
+HRESULT Concatenate(const std::vector<Rule>& rules, LPCWSTR szUrl,
+	LPCWSTR szHeaders, LPWSTR* pszAdditionalHeaders)
+{
+	ULONG cchOrigin = 0;
+	ULONG ichHost = 0;
+	ULONG cchHost = 0;
+	Detail::GetRequestHeaderOrigin(szUrl, &cchOrigin, &ichHost, &cchHost);
+	ULONG cchUrl = static_cast<ULONG>(wcslen(szUrl));
+	std::wstring headers(szHeaders ? szHeaders : L"");
+	bool bAdded = false;
+	for (size_t i = 0; i < rules.size(); ++i)
+	{
+		const Rule& rule = rules[i];
+		ULONG cchPattern = static_cast<ULONG>(rule.pattern.size());
+		if (rule.scope == Detail::RequestHeaderHost ?
+			!Detail::MatchRequestHeaderHost(szUrl + ichHost, cchHost,
+				rule.pattern.c_str(), cchPattern) :
+			rule.scope == Detail::RequestHeaderUrlPrefix &&
+			(cchPattern > cchUrl || !Detail::EqualRequestHeaderText(szUrl,
+				rule.pattern.c_str(), cchPattern)))
+		{
+			continue;
+		}
+		headers += rule.name + L": " + rule.value + L"\r\n";
+		bAdded = true;
+	}
+	*pszAdditionalHeaders = 0;
+	if (!bAdded)
+	{
+		return S_FALSE;
+	}
+	size_t cb = (headers.size() + 1) * sizeof(WCHAR);
+	*pszAdditionalHeaders = static_cast<LPWSTR>(CoTaskMemAlloc(cb));
+	if (!*pszAdditionalHeaders)
+	{
+		return E_OUTOFMEMORY;
+	}
+	memcpy(*pszAdditionalHeaders, headers.c_str(), cb);
+	return S_OK;
+}
+
+bool SameHeaders(LPCWSTR sz1, LPCWSTR sz2)
+{
+	return (!sz1 && !sz2) || (sz1 && sz2 && !wcscmp(sz1, sz2));
+}
+
+// Renders the headers of every URL in turn
+void BenchRender(const CBenchRunner& runner, const char* szName,
+	CRequestHeaderRules* pRules, const std::vector<std::wstring>& urls,
+	LPCWSTR szHeaders, bool* pbOk)
+{
+	RequestHeaderStatistics before;
+	pRules->GetStatistics(&before);
+	runner.Run(szName, 1000000, 0, [&](unsigned long cCalls)
+	{
+		for (unsigned long i = 0; i < cCalls; ++i)
+		{
+			LPWSTR szAdditionalHeaders = 0;
+			*pbOk &= SUCCEEDED(pRules->Render(urls[i % cUrls].c_str(),
+				szHeaders, &szAdditionalHeaders));
+			CoTaskMemFree(szAdditionalHeaders);
+		}
+	});
+	RequestHeaderStatistics after;
+	pRules->GetStatistics(&after);
+	LONG cRenders = after.cRenders - before.cRenders;
+	printf("%-44s %9.1f%%\n", "  origin blocks found", cRenders ?
+		100.0 * (after.cOriginHits - before.cOriginHits) / cRenders : 0.0);
+}
+
+} // end anonymous namespace
+
+int main(int argc, char** argv)
+{
+	CBenchRunner runner(argc, argv);
+	std::vector<Rule> rules = MakeRules();
+	std::vector<std::wstring> urls = MakeUrls();
+	LPCWSTR szClientHeaders = L"Accept-Language: en-US\r\n"
+		L"Referer: https://www.site0.com/\r\n";
+	bool bOk = true;
+
+	CRequestHeaderRules kept;
+	CRequestHeaderRules dropped;
+	// Fewer than the origins, which are used in turn
+	dropped.SetMaxOrigins(cOrigins / 4);
+	if (FAILED(AddRules(rules, &kept)) || FAILED(AddRules(rules, &dropped)))
+	{
+		printf("Adding the rules failed\n");
+		return 1;
+	}
+
+	// Both give the same headers for every URL, with and without the
+	// client's
+	for (ULONG i = 0; i < cUrls * 2; ++i)
+	{
+		LPCWSTR szHeaders = i < cUrls ? 0 : szClientHeaders;
+		LPWSTR szRendered = 0;
+		LPWSTR szConcatenated = 0;
+		bOk &= SUCCEEDED(kept.Render(urls[i % cUrls].c_str(), szHeaders,
+			&szRendered)) && SUCCEEDED(Concatenate(rules,
+			urls[i % cUrls].c_str(), szHeaders, &szConcatenated)) &&
+			SameHeaders(szRendered, szConcatenated);
+		CoTaskMemFree(szRendered);
+		CoTaskMemFree(szConcatenated);
+	}
+
+	char szTitle[80];
+	sprintf(szTitle, "Headers for a request, %lu rules, %lu origins",
+		static_cast<unsigned long>(rules.size()),
+		static_cast<unsigned long>(cOrigins));
+	runner.PrintHeader(szTitle);
+	BenchRender(runner, "Render, origin blocks kept", &kept, urls, 0, &bOk);
+	BenchRender(runner, "Render, after the client's headers", &kept, urls,
+		szClientHeaders, &bOk);
+	BenchRender(runner, "Render, 16 origin blocks kept", &dropped, urls, 0,
+		&bOk);
+	runner.Run("Rules checked and headers concatenated", 1000000, 0,
+		[&](unsigned long cCalls)
+		{
+			for (unsigned long i = 0; i < cCalls; ++i)
+			{
+				LPWSTR szAdditionalHeaders = 0;
+				bOk &= SUCCEEDED(Concatenate(rules, urls[i % cUrls].c_str(),
+					0, &szAdditionalHeaders));
+				CoTaskMemFree(szAdditionalHeaders);
+			}
+		});
+
+	if (!bOk)
+	{
+		printf("\nA render failed or gave different headers\n");
+		return 1;
+	}
+	return 0;
+}
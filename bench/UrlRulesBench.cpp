@@ -0,0 +1,381 @@
+// CUrlRuleSet against a list of 50,000 rules of the size of common filter
+// lists, matched over a synthetic corpus of URLs: building the image,
+// matching URLs that hit a rule and URLs that don't, with and without the
+// host prefilter, from several threads, through CUrlRuleStore, and a plain
+// scan of the same rules for comparison. Rules and URLs are generated from
+// a fixed seed, so that runs compare.
+
+#include <atlbase.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "UrlRules.h"
+#include "bench/BenchUtil.h"
+
+using namespace PassthroughAPP;
+using namespace PassthroughAPP::Bench;
+
+namespace
+{
+
+const DWORD cRules = 50000;
+// The mixed list has cRules - cSubstringRules host rules, as lists that
+// mostly block hosts do
+const DWORD cSubstringRules = 5000;
+const DWORD cMixedHosts = cRules - cSubstringRules;
+const DWORD cUrls = 4096;
+
+class CRandom
+{
+public:
+	explicit CRandom(DWORD dwSeed) : m_dwState(dwSeed) {}
+
+	DWORD Next(DWORD dwBound)
+	{
+		m_dwState = m_dwState * 1664525 + 1013904223;
+		return (m_dwState >> 8) % dwBound;
+	}
+
+	// Words with a digit can't be any of the rules, which have none
+	std::wstring Word(DWORD cchMin, DWORD cchMax, bool bDigit = false)
+	{
+		std::wstring word;
+		for (DWORD cch = cchMin + Next(cchMax - cchMin + 1); cch; --cch)
+		{
+			word += static_cast<wchar_t>(L'a' + Next(26));
+		}
+		if (bDigit)
+		{
+			word += static_cast<wchar_t>(L'0' + Next(10));
+		}
+		return word;
+	}
+
+private:
+	DWORD m_dwState;
+};
+
+const wchar_t* const g_rgszTlds[] = {L"com", L"net", L"org", L"io", L"de",
+	L"co.uk"};
+const DWORD cTlds = sizeof(g_rgszTlds) / sizeof(g_rgszTlds[0]);
+
+struct Corpus
+{
+	std::vector<std::wstring> hosts;
+	std::vector<std::wstring> patterns;
+	std::vector<std::wstring> hitUrls;
+	std::vector<std::wstring> missUrls;
+};
+
+std::wstring MakeHost(CRandom& random, bool bMiss = false)
+{
+	std::wstring host = random.Word(3, 12, bMiss);
+	if (random.Next(2))
+	{
+		host = random.Word(2, 8) + L"." + host;
+	}
+	return host + L"." + g_rgszTlds[random.Next(cTlds)];
+}
+
+// The segments of a miss can't start a substring rule
+std::wstring MakePath(CRandom& random, bool bMiss = false)
+{
+	std::wstring path;
+	for (DWORD cSegments = 1 + random.Next(4); cSegments; --cSegments)
+	{
+		path += L"/" + random.Word(2, 10, bMiss);
+	}
+	if (random.Next(2))
+	{
+		path += L"?" + random.Word(1, 6) + L"=" + random.Word(4, 16);
+	}
+	return path;
+}
+
+void MakeCorpus(Corpus* pCorpus)
+{
+	CRandom random(0x5eed);
+	for (DWORD i = 0; i < cRules; ++i)
+	{
+		pCorpus->hosts.push_back(MakeHost(random));
+	}
+	for (DWORD i = 0; i < cSubstringRules; ++i)
+	{
+		pCorpus->patterns.push_back(L"/" + random.Word(4, 10) + L"/" +
+			random.Word(3, 8));
+	}
+
+	// Hits are split between a rule host, a subdomain of one, and a
+	// substring rule in the path of an unlisted host, all within the
+	// mixed list. Misses share the
+	// rules' top level domains and alphabet, but not a whole label
+	for (DWORD i = 0; i < cUrls; ++i)
+	{
+		std::wstring host = pCorpus->hosts[random.Next(cMixedHosts)];
+		std::wstring path = MakePath(random);
+		switch (i % 3)
+		{
+		case 1:
+			host = random.Word(2, 6) + L"." + host;
+			break;
+		case 2:
+			host = MakeHost(random, true);
+			path += pCorpus->patterns[random.Next(cSubstringRules)];
+			break;
+		}
+		pCorpus->hitUrls.push_back(L"http://" + host + path);
+		pCorpus->missUrls.push_back(L"http://" + MakeHost(random, true) +
+			MakePath(random, true));
+	}
+}
+
+// The first cHosts host rules and cSubstrings substring rules
+HRESULT BuildRules(const Corpus& corpus, DWORD cHosts, DWORD cSubstrings,
+	bool bPrefilter, CUrlRuleSet* pRuleSet)
+{
+	CUrlRuleSetBuilder builder;
+	if (!bPrefilter)
+	{
+		builder.SetPrefilterFalsePositiveRate(0);
+	}
+	for (DWORD i = 0; i < cHosts; ++i)
+	{
+		builder.AddHostRule(corpus.hosts[i].c_str(), UrlRuleBlock, i);
+	}
+	for (DWORD i = 0; i < cSubstrings; ++i)
+	{
+		builder.AddSubstringRule(corpus.patterns[i].c_str(), UrlRuleBlock, i);
+	}
+	return builder.Build(pRuleSet);
+}
+
+unsigned long AverageLength(const std::vector<std::wstring>& urls)
+{
+	size_t cch = 0;
+	for (size_t i = 0; i < urls.size(); ++i)
+	{
+		cch += urls[i].size();
+	}
+	return static_cast<unsigned long>(cch / urls.size());
+}
+
+// Matches cCalls URLs, cycling through urls. Returns the number of matches
+template <class Matcher>
+unsigned long MatchUrls(Matcher& matcher,
+	const std::vector<std::wstring>& urls, unsigned long cCalls)
+{
+	unsigned long cMatches = 0;
+	for (unsigned long i = 0; i < cCalls; ++i)
+	{
+		UrlRuleMatch match;
+		if (matcher.Match(urls[i % cUrls].c_str(), &match) == S_OK)
+		{
+			++cMatches;
+		}
+	}
+	return cMatches;
+}
+
+// What the rule set saves: every rule tried against every URL
+class CLinearScan
+{
+public:
+	CLinearScan(const Corpus& corpus, DWORD cHosts, DWORD cSubstrings) :
+		m_corpus(corpus), m_cHosts(cHosts), m_cSubstrings(cSubstrings)
+	{
+	}
+
+	HRESULT Match(LPCWSTR szUrl, UrlRuleMatch* pMatch) const
+	{
+		LPCWSTR pHost = wcsstr(szUrl, L"://") + 3;
+		LPCWSTR pHostEnd = wcschr(pHost, L'/');
+		size_t cchHost = pHostEnd ? pHostEnd - pHost : wcslen(pHost);
+		for (DWORD i = 0; i < m_cHosts; ++i)
+		{
+			const std::wstring& host = m_corpus.hosts[i];
+			if (host.size() <= cchHost &&
+				!wcsncmp(pHost + cchHost - host.size(), host.c_str(),
+					host.size()) &&
+				(host.size() == cchHost ||
+					pHost[cchHost - host.size() - 1] == L'.'))
+			{
+				pMatch->dwAction = UrlRuleBlock;
+				pMatch->dwData = i;
+				return S_OK;
+			}
+		}
+		for (DWORD i = 0; i < m_cSubstrings; ++i)
+		{
+			if (wcsstr(szUrl, m_corpus.patterns[i].c_str()))
+			{
+				pMatch->dwAction = UrlRuleBlock;
+				pMatch->dwData = i;
+				return S_OK;
+			}
+		}
+		return S_FALSE;
+	}
+
+private:
+	const Corpus& m_corpus;
+	DWORD m_cHosts;
+	DWORD m_cSubstrings;
+};
+
+} // end anonymous namespace
+
+int main(int argc, char** argv)
+{
+	CBenchRunner runner(argc, argv);
+	Corpus corpus;
+	MakeCorpus(&corpus);
+	unsigned long cchHit = AverageLength(corpus.hitUrls);
+	unsigned long cchMiss = AverageLength(corpus.missUrls);
+	printf("%lu host rules, %lu substring rules, %lu URLs of %lu and %lu "
+		"characters on average\n", static_cast<unsigned long>(cMixedHosts),
+		static_cast<unsigned long>(cSubstringRules),
+		static_cast<unsigned long>(cUrls), cchHit, cchMiss);
+
+	bool bOk = true;
+	runner.PrintHeader("Build");
+	runner.Run("50,000 rules", 10, 0, [&](unsigned long cCalls)
+	{
+		for (unsigned long i = 0; i < cCalls; ++i)
+		{
+			CUrlRuleSet ruleSet;
+			bOk &= SUCCEEDED(BuildRules(corpus, cMixedHosts, cSubstringRules,
+				true, &ruleSet));
+		}
+	});
+	runner.Run("1,000 rules", 500, 0, [&](unsigned long cCalls)
+	{
+		for (unsigned long i = 0; i < cCalls; ++i)
+		{
+			CUrlRuleSet ruleSet;
+			bOk &= SUCCEEDED(BuildRules(corpus, 900, 100, true, &ruleSet));
+		}
+	});
+
+	// Host rules alone let the prefilter turn misses away on the host
+	struct RuleSetCase
+	{
+		const char* szTitle;
+		DWORD cHosts;
+		DWORD cSubstrings;
+		bool bPrefilter;
+	};
+	const RuleSetCase rgCases[] =
+	{
+		{"50,000 host rules, prefilter", cRules, 0, true},
+		{"50,000 host rules, no prefilter", cRules, 0, false},
+		{"45,000 host and 5,000 substring rules, prefilter", cMixedHosts,
+			cSubstringRules, true},
+		{"45,000 host and 5,000 substring rules, no prefilter", cMixedHosts,
+			cSubstringRules, false},
+		{"900 host and 100 substring rules, prefilter", 900, 100, true}
+	};
+	for (size_t iCase = 0; iCase < sizeof(rgCases) / sizeof(rgCases[0]);
+		++iCase)
+	{
+		const RuleSetCase& c = rgCases[iCase];
+		CUrlRuleSet ruleSet;
+		if (FAILED(BuildRules(corpus, c.cHosts, c.cSubstrings, c.bPrefilter,
+			&ruleSet)))
+		{
+			printf("Building the rules failed\n");
+			return 1;
+		}
+		runner.PrintHeader(c.szTitle);
+		printf("%-44s %10lu\n", "image bytes",
+			static_cast<unsigned long>(ruleSet.GetImageSize()));
+		runner.Run("Match, hits", 200000, cchHit * sizeof(wchar_t),
+			[&](unsigned long cCalls)
+		{
+			// Only the whole mixed list matches all of them
+			unsigned long cMatches =
+				MatchUrls(ruleSet, corpus.hitUrls, cCalls);
+			bOk &= c.cHosts != cMixedHosts || cMatches == cCalls;
+		});
+		runner.Run("Match, misses", 200000, cchMiss * sizeof(wchar_t),
+			[&](unsigned long cCalls)
+		{
+			bOk &= !MatchUrls(ruleSet, corpus.missUrls, cCalls);
+		});
+	}
+
+	// Misses from several threads at once, as urlmon's binding threads
+	// match them, which is where counting prefilter statistics costs most
+	unsigned cMaxThreads = std::thread::hardware_concurrency();
+	if (cMaxThreads < 2)
+	{
+		cMaxThreads = 2;
+	}
+	{
+		CUrlRuleSet ruleSet;
+		BuildRules(corpus, cRules, 0, true, &ruleSet);
+		runner.PrintHeader("50,000 host rules, prefilter, misses on threads");
+		char szName[64];
+		for (unsigned cThreads = 1; cThreads <= cMaxThreads; cThreads *= 2)
+		{
+			sprintf(szName, "%u thread%s", cThreads, cThreads > 1 ? "s" : "");
+			runner.Run(szName, 200000, cchMiss * sizeof(wchar_t),
+				[&](unsigned long cCalls)
+			{
+				std::vector<std::thread> threads;
+				for (unsigned i = 1; i < cThreads; ++i)
+				{
+					threads.push_back(std::thread([&]()
+					{
+						MatchUrls(ruleSet, corpus.missUrls,
+							cCalls / cThreads);
+					}));
+				}
+				bOk &= !MatchUrls(ruleSet, corpus.missUrls,
+					cCalls / cThreads);
+				for (size_t i = 0; i < threads.size(); ++i)
+				{
+					threads[i].join();
+				}
+			});
+		}
+	}
+
+	// The whole list, as start policies use it
+	CUrlRuleSet* pRuleSet = new CUrlRuleSet;
+	BuildRules(corpus, cMixedHosts, cSubstringRules, true, pRuleSet);
+	CUrlRuleStore store;
+	store.Publish(pRuleSet);
+	runner.PrintHeader("CUrlRuleStore, 50,000 rules");
+	runner.Run("Match, hits", 200000, cchHit * sizeof(wchar_t),
+		[&](unsigned long cCalls)
+	{
+		bOk &= MatchUrls(store, corpus.hitUrls, cCalls) == cCalls;
+	});
+	runner.Run("Match, misses", 200000, cchMiss * sizeof(wchar_t),
+		[&](unsigned long cCalls)
+	{
+		bOk &= !MatchUrls(store, corpus.missUrls, cCalls);
+	});
+
+	CLinearScan scan(corpus, cMixedHosts, cSubstringRules);
+	runner.PrintHeader("Every rule tried in turn, 50,000 rules");
+	runner.Run("Match, hits", 200, cchHit * sizeof(wchar_t),
+		[&](unsigned long cCalls)
+	{
+		bOk &= MatchUrls(scan, corpus.hitUrls, cCalls) == cCalls;
+	});
+	runner.Run("Match, misses", 200, cchMiss * sizeof(wchar_t),
+		[&](unsigned long cCalls)
+	{
+		bOk &= !MatchUrls(scan, corpus.missUrls, cCalls);
+	});
+
+	if (!bOk)
+	{
+		printf("\nBuilding or matching went wrong\n");
+		return 1;
+	}
+	return 0;
+}
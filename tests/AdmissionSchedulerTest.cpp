@@ -0,0 +1,458 @@
+// AdmissionStartPolicy over targets that report their response only when
+// told to: the per-host and overall limits, the order waiting requests
+// start in by kind of resource and by priority, set before Start or while
+// waiting, and the slot freed when the client reads the end of the data,
+// on Abort, on Terminate and when the request is released. The scheduler
+// counts no running or waiting request once they are all gone.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include "ProtocolImpl.h"
+#include "ProtocolCF.h"
+#include "SinkPolicy.h"
+#include "Portable/FakeProtocol.h"
+#include "tests/TestUtil.h"
+
+using namespace PassthroughAPP;
+
+namespace
+{
+
+// Each check uses a scheduler of its own
+CAdmissionScheduler* g_pScheduler = 0;
+
+class CAdmissionAPP;
+typedef AdmissionStartPolicy<CAdmissionAPP> AdmissionPolicy;
+
+class CAdmissionAPP :
+	public CInternetProtocol<AdmissionPolicy>
+{
+public:
+	CAdmissionScheduler* GetAdmissionScheduler() const
+	{
+		return g_pScheduler;
+	}
+};
+
+typedef CMetaFactory<CComClassFactoryProtocol, CAdmissionAPP> MetaFactory;
+
+BYTE g_body[2000];
+
+// The target class factory, and the APP's in front of it
+class CFactories
+{
+public:
+	CFactories() :
+		m_pTargetCF(0)
+	{
+		FakeResponse response;
+		response.pbBody = g_body;
+		response.cbBody = sizeof(g_body);
+		response.bDeliverOnStart = false;
+		CHECK(SUCCEEDED(CFakeTargetClassFactory::Create(response,
+			&m_pTargetCF)));
+		m_spTargetCF = m_pTargetCF;
+		CComClassFactoryProtocol* pFactory = 0;
+		CHECK(SUCCEEDED(MetaFactory::CreateInstance(&pFactory)));
+		m_spCF = pFactory;
+		if (pFactory)
+		{
+			pFactory->SetTargetClassFactory(m_spTargetCF);
+		}
+	}
+
+	CComObject<CFakeTargetClassFactory>* m_pTargetCF;
+	CComPtr<IClassFactory> m_spTargetCF;
+	CComPtr<IClassFactory> m_spCF;
+};
+
+// A request, with the target created along with the APP
+struct Request
+{
+	CComPtr<IInternetProtocol> spProtocol;
+	CComObject<CFakeClientSink>* pClient;
+	CComPtr<IInternetProtocolSink> spClient;
+	// Owned by the APP
+	CFakeTargetProtocol* pTarget;
+	bool bFinished;
+};
+
+void Create(const CFactories& factories, Request* pRequest)
+{
+	pRequest->pClient = 0;
+	pRequest->pTarget = 0;
+	pRequest->bFinished = false;
+	CHECK(SUCCEEDED(factories.m_spCF->CreateInstance(0,
+		IID_IInternetProtocol,
+		reinterpret_cast<void**>(&pRequest->spProtocol))));
+	pRequest->pTarget = factories.m_pTargetCF->m_pLastProtocol;
+	CComObject<CFakeClientSink>::CreateInstance(&pRequest->pClient);
+	pRequest->spClient = pRequest->pClient;
+	pRequest->pClient->SetProtocol(pRequest->spProtocol);
+}
+
+void Start(Request* pRequest, LPCWSTR szUrl)
+{
+	CComQIPtr<IInternetBindInfo> spBindInfo(pRequest->spClient);
+	CHECK(pRequest->spProtocol->Start(szUrl, pRequest->spClient,
+		spBindInfo, 0, 0) == S_OK);
+}
+
+void SetPriority(Request* pRequest, LONG nPriority)
+{
+	CComQIPtr<IInternetPriority> spPriority(pRequest->spProtocol);
+	CHECK(spPriority != 0 && spPriority->SetPriority(nPriority) == S_OK);
+}
+
+bool IsStarted(const Request& request)
+{
+	return request.pTarget && request.pTarget->m_cStart != 0;
+}
+
+// Has the target report its response, which the client reads to the end
+void Finish(Request* pRequest)
+{
+	CHECK(IsStarted(*pRequest));
+	CHECK(pRequest->pTarget->DeliverResponse() == S_OK);
+	CHECK(pRequest->pClient->m_hrResult == S_OK);
+	CHECK(pRequest->pClient->m_cbReceived == sizeof(g_body));
+	pRequest->bFinished = true;
+}
+
+// Releases the request without terminating it
+void Release(Request* pRequest)
+{
+	pRequest->pClient->SetProtocol(0);
+	pRequest->spProtocol.Release();
+	pRequest->pTarget = 0;
+}
+
+void Close(Request* pRequest)
+{
+	if (pRequest->spProtocol)
+	{
+		pRequest->spProtocol->Terminate(0);
+		Release(pRequest);
+	}
+}
+
+void CloseAll(Request* pRequests, size_t cRequests)
+{
+	for (size_t i = 0; i < cRequests; ++i)
+	{
+		Close(&pRequests[i]);
+	}
+}
+
+// The one request started and not finished
+size_t FindRunning(const Request* pRequests, size_t cRequests)
+{
+	size_t iRunning = cRequests;
+	for (size_t i = 0; i < cRequests; ++i)
+	{
+		if (IsStarted(pRequests[i]) && !pRequests[i].bFinished)
+		{
+			CHECK(iRunning == cRequests);
+			iRunning = i;
+		}
+	}
+	CHECK(iRunning < cRequests);
+	return iRunning;
+}
+
+void CheckStatistics(const CAdmissionScheduler& scheduler, LONG cActive,
+	LONG cWaiting)
+{
+	AdmissionSchedulerStatistics stats;
+	scheduler.GetStatistics(&stats);
+	CHECK(stats.cActive == cActive);
+	CHECK(stats.cWaiting == cWaiting);
+}
+
+void CheckPerHostLimit()
+{
+	CAdmissionScheduler scheduler;
+	scheduler.SetMaxActive(0);
+	scheduler.SetMaxActivePerHost(2);
+	g_pScheduler = &scheduler;
+	CFactories factories;
+
+	Request requests[4];
+	for (size_t i = 0; i < 4; ++i)
+	{
+		Create(factories, &requests[i]);
+	}
+	Start(&requests[0], L"http://a.example.com/1.png");
+	Start(&requests[1], L"http://A.example.com/2.png");
+	Start(&requests[2], L"http://a.example.com/3.png");
+	// Another host isn't held back by the first
+	Start(&requests[3], L"http://b.example.com/1.png");
+	CHECK(IsStarted(requests[0]) && IsStarted(requests[1]));
+	CHECK(!IsStarted(requests[2]));
+	CHECK(requests[2].pClient->m_cSwitch == 0);
+	CHECK(IsStarted(requests[3]));
+	AdmissionSchedulerStatistics stats;
+	scheduler.GetStatistics(&stats);
+	CHECK(stats.cAdmitted == 3);
+	CHECK(stats.cQueued == 1);
+	CheckStatistics(scheduler, 3, 1);
+
+	// Nothing was reported to the waiting request's client yet
+	BYTE b;
+	ULONG cbRead = 1;
+	CHECK(requests[2].spProtocol->Read(&b, sizeof(b), &cbRead) ==
+		E_PENDING);
+	CHECK(cbRead == 0);
+
+	// The other host's slot doesn't help
+	Finish(&requests[3]);
+	CHECK(!IsStarted(requests[2]));
+	CheckStatistics(scheduler, 2, 1);
+
+	// Reading the end of the data frees a slot. The waiting request is
+	// started from the Continue its client sink is asked to Switch to
+	Finish(&requests[0]);
+	CHECK(requests[2].pClient->m_cSwitch == 1);
+	CHECK(IsStarted(requests[2]));
+	CheckStatistics(scheduler, 2, 0);
+	Finish(&requests[1]);
+	Finish(&requests[2]);
+	CheckStatistics(scheduler, 0, 0);
+	CloseAll(requests, 4);
+	CheckStatistics(scheduler, 0, 0);
+}
+
+void CheckOverallLimit()
+{
+	CAdmissionScheduler scheduler;
+	scheduler.SetMaxActive(2);
+	scheduler.SetMaxActivePerHost(0);
+	g_pScheduler = &scheduler;
+	CFactories factories;
+
+	Request requests[3];
+	for (size_t i = 0; i < 3; ++i)
+	{
+		Create(factories, &requests[i]);
+	}
+	Start(&requests[0], L"http://a.example.com/");
+	Start(&requests[1], L"http://b.example.com/");
+	Start(&requests[2], L"http://c.example.com/");
+	CHECK(IsStarted(requests[0]) && IsStarted(requests[1]));
+	CHECK(!IsStarted(requests[2]));
+	CheckStatistics(scheduler, 2, 1);
+
+	Finish(&requests[1]);
+	CHECK(IsStarted(requests[2]));
+	CheckStatistics(scheduler, 2, 0);
+	Finish(&requests[0]);
+	Finish(&requests[2]);
+	CloseAll(requests, 3);
+	CheckStatistics(scheduler, 0, 0);
+}
+
+// Waiting requests start by kind of resource, whatever order they came in
+void CheckClassOrder()
+{
+	CAdmissionScheduler scheduler;
+	scheduler.SetMaxActive(1);
+	g_pScheduler = &scheduler;
+	CFactories factories;
+
+	static const LPCWSTR rgszUrls[] =
+	{
+		L"http://example.com/",
+		L"http://example.com/img/logo.png",
+		L"http://example.com/data.json",
+		L"http://example.com/app.js?v=2",
+		L"http://example.com/site.CSS",
+		L"http://example.com/frame.html#top"
+	};
+	// By index in rgszUrls
+	static const size_t rgiOrder[] = {0, 5, 4, 3, 2, 1};
+	const size_t cRequests = sizeof(rgszUrls) / sizeof(rgszUrls[0]);
+	Request requests[cRequests];
+	for (size_t i = 0; i < cRequests; ++i)
+	{
+		Create(factories, &requests[i]);
+		Start(&requests[i], rgszUrls[i]);
+	}
+	CheckStatistics(scheduler, 1, cRequests - 1);
+	for (size_t i = 0; i < cRequests; ++i)
+	{
+		size_t iRunning = FindRunning(requests, cRequests);
+		CHECK(iRunning == rgiOrder[i]);
+		if (iRunning == cRequests)
+		{
+			break;
+		}
+		Finish(&requests[iRunning]);
+	}
+	CloseAll(requests, cRequests);
+	CheckStatistics(scheduler, 0, 0);
+}
+
+// Priority goes before the kind of resource, set before Start or while
+// waiting
+void CheckPriority()
+{
+	CAdmissionScheduler scheduler;
+	scheduler.SetMaxActive(1);
+	g_pScheduler = &scheduler;
+	CFactories factories;
+
+	const size_t cRequests = 5;
+	Request requests[cRequests];
+	for (size_t i = 0; i < cRequests; ++i)
+	{
+		Create(factories, &requests[i]);
+	}
+	Start(&requests[0], L"http://example.com/");
+	SetPriority(&requests[1], THREAD_PRIORITY_LOWEST);
+	Start(&requests[1], L"http://example.com/page.html");
+	Start(&requests[2], L"http://example.com/1.png");
+	Start(&requests[3], L"http://example.com/2.png");
+	Start(&requests[4], L"http://example.com/3.png");
+	CheckStatistics(scheduler, 1, 4);
+
+	SetPriority(&requests[4], THREAD_PRIORITY_HIGHEST);
+	AdmissionSchedulerStatistics stats;
+	scheduler.GetStatistics(&stats);
+	CHECK(stats.cPromoted == 1);
+	// The target keeps it, for when it runs
+	CComQIPtr<IInternetPriority> spPriority(
+		requests[4].pTarget->GetUnknown());
+	LONG nPriority = 0;
+	CHECK(spPriority != 0 && spPriority->GetPriority(&nPriority) == S_OK &&
+		nPriority == THREAD_PRIORITY_HIGHEST);
+
+	static const size_t rgiOrder[] = {0, 4, 2, 3, 1};
+	for (size_t i = 0; i < cRequests; ++i)
+	{
+		size_t iRunning = FindRunning(requests, cRequests);
+		CHECK(iRunning == rgiOrder[i]);
+		if (iRunning == cRequests)
+		{
+			break;
+		}
+		Finish(&requests[iRunning]);
+	}
+	CloseAll(requests, cRequests);
+	CheckStatistics(scheduler, 0, 0);
+}
+
+// A running request gives up its slot however it ends, and a waiting one
+// its place in the queue
+void CheckRelease()
+{
+	CAdmissionScheduler scheduler;
+	scheduler.SetMaxActive(1);
+	g_pScheduler = &scheduler;
+	CFactories factories;
+
+	const size_t cRequests = 7;
+	Request requests[cRequests];
+	for (size_t i = 0; i < cRequests; ++i)
+	{
+		Create(factories, &requests[i]);
+		Start(&requests[i], L"http://example.com/");
+	}
+	CheckStatistics(scheduler, 1, cRequests - 1);
+
+	CHECK(requests[0].spProtocol->Abort(E_ABORT, 0) == S_OK);
+	CHECK(requests[0].pTarget->m_cAbort == 1);
+	CHECK(IsStarted(requests[1]));
+	CheckStatistics(scheduler, 1, cRequests - 2);
+
+	CHECK(requests[1].spProtocol->Terminate(0) == S_OK);
+	CHECK(requests[1].pTarget->m_cTerminate == 1);
+	CHECK(IsStarted(requests[2]));
+	CheckStatistics(scheduler, 1, cRequests - 3);
+
+	Release(&requests[2]);
+	CHECK(IsStarted(requests[3]));
+	CheckStatistics(scheduler, 1, cRequests - 4);
+
+	// Waiting requests that are aborted, terminated or released never
+	// start their target
+	CHECK(requests[4].spProtocol->Abort(E_ABORT, 0) == S_OK);
+	CHECK(requests[4].pClient->m_cReportResult == 1);
+	CHECK(requests[4].pClient->m_hrResult == E_ABORT);
+	CHECK(requests[5].spProtocol->Terminate(0) == S_OK);
+	Release(&requests[6]);
+	CheckStatistics(scheduler, 1, 0);
+	CHECK(requests[4].pTarget->m_cStart == 0);
+	CHECK(requests[5].pTarget->m_cStart == 0);
+
+	Finish(&requests[3]);
+	CHECK(!IsStarted(requests[4]) && !IsStarted(requests[5]));
+	CHECK(requests[4].pClient->m_cSwitch == 0);
+	CHECK(requests[5].pClient->m_cSwitch == 0);
+	CloseAll(requests, cRequests);
+	AdmissionSchedulerStatistics stats;
+	scheduler.GetStatistics(&stats);
+	CHECK(stats.cAdmitted == 1);
+	CHECK(stats.cQueued == cRequests - 1);
+	CheckStatistics(scheduler, 0, 0);
+}
+
+// 40 images to a host, 6 of them running, and then a style sheet and a
+// script to it: the style sheet starts once the first image is done, and
+// the script once the second is. In arrival order, they would have waited
+// for 35 and 36 images
+void CheckImagesAhead()
+{
+	CAdmissionScheduler scheduler;
+	g_pScheduler = &scheduler;
+	CFactories factories;
+
+	const size_t cImages = 40;
+	const size_t cRequests = cImages + 2;
+	Request requests[cRequests];
+	for (size_t i = 0; i < cImages; ++i)
+	{
+		WCHAR szUrl[64];
+		swprintf(szUrl, sizeof(szUrl) / sizeof(szUrl[0]),
+			L"http://example.com/img/%lu.png", static_cast<unsigned long>(i));
+		Create(factories, &requests[i]);
+		Start(&requests[i], szUrl);
+	}
+	Create(factories, &requests[cImages]);
+	Start(&requests[cImages], L"http://example.com/site.css");
+	Create(factories, &requests[cImages + 1]);
+	Start(&requests[cImages + 1], L"http://example.com/app.js");
+	CheckStatistics(scheduler, 6, cRequests - 6);
+
+	Finish(&requests[0]);
+	CHECK(IsStarted(requests[cImages]));
+	CHECK(!IsStarted(requests[cImages + 1]));
+	Finish(&requests[1]);
+	CHECK(IsStarted(requests[cImages + 1]));
+	CHECK(!IsStarted(requests[6]));
+
+	for (size_t i = 2; i < cRequests; ++i)
+	{
+		Finish(&requests[i]);
+	}
+	CloseAll(requests, cRequests);
+	CheckStatistics(scheduler, 0, 0);
+}
+
+} // end anonymous namespace
+
+int main()
+{
+	for (ULONG i = 0; i < sizeof(g_body); ++i)
+	{
+		g_body[i] = static_cast<BYTE>(i * 13);
+	}
+	CheckPerHostLimit();
+	CheckOverallLimit();
+	CheckClassOrder();
+	CheckPriority();
+	CheckRelease();
+	CheckImagesAhead();
+	g_pScheduler = 0;
+	return TEST_RESULT();
+}
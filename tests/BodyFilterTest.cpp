@@ -0,0 +1,373 @@
+// BodyFilterStartPolicy and CBodyFilterSinkTM over the fake target: a
+// chain of inspectors shown the data in the client's buffer, a filter
+// doubling the body read a few bytes at a time, filters that fail, and
+// the progress the client is told about never going backwards.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include <vector>
+
+#include "ProtocolImpl.h"
+#include "ProtocolCF.h"
+#include "SinkPolicy.h"
+#include "Portable/FakeProtocol.h"
+#include "tests/TestUtil.h"
+
+using namespace PassthroughAPP;
+
+namespace
+{
+
+const ULONG cbBody = 5000;
+BYTE g_body[cbBody];
+
+// What the inspectors of a request were shown
+struct Inspection
+{
+	ULONG cb;
+	DWORD dwHash;
+	LONG cEnd;
+	// Set if some data lay outside the client's buffer
+	bool bCopied;
+};
+
+Inspection g_inspection;
+// The buffer the test reads into, if any
+const BYTE* g_pbClientBuffer;
+ULONG g_cbClientBuffer;
+
+class CInspector :
+	public CBodyFilter
+{
+public:
+	bool IsInspectOnly() const
+	{
+		return true;
+	}
+
+	HRESULT Inspect(const BYTE* pb, ULONG cb, bool bEnd)
+	{
+		if (cb && g_pbClientBuffer && (pb < g_pbClientBuffer ||
+			pb + cb > g_pbClientBuffer + g_cbClientBuffer))
+		{
+			g_inspection.bCopied = true;
+		}
+		g_inspection.cb += cb;
+		g_inspection.dwHash = CFakeClientSink::HashBytes(pb, cb,
+			g_inspection.dwHash);
+		g_inspection.cEnd += bEnd;
+		return S_OK;
+	}
+};
+
+// Writes every byte twice, so it can't use the last byte of an output
+// buffer
+class CDoubler :
+	public CBodyFilter
+{
+public:
+	HRESULT Process(const BYTE* pbIn, ULONG cbIn, ULONG* pcbUsed,
+		BYTE* pbOut, ULONG cbOut, ULONG* pcbWritten, bool bEnd)
+	{
+		ULONG cb = (cbIn < cbOut / 2) ? cbIn : cbOut / 2;
+		for (ULONG i = 0; i < cb; ++i)
+		{
+			pbOut[i * 2] = pbOut[i * 2 + 1] = pbIn[i];
+		}
+		*pcbUsed = cb;
+		*pcbWritten = cb * 2;
+		return (bEnd && cb == cbIn) ? S_FALSE : S_OK;
+	}
+};
+
+// Copies the first cbFail bytes, then fails
+class CFailingFilter :
+	public CBodyFilter
+{
+public:
+	explicit CFailingFilter(ULONG cbFail) : m_cbLeft(cbFail) {}
+
+	HRESULT Process(const BYTE* pbIn, ULONG cbIn, ULONG* pcbUsed,
+		BYTE* pbOut, ULONG cbOut, ULONG* pcbWritten, bool bEnd)
+	{
+		if (!m_cbLeft)
+		{
+			return E_FAIL;
+		}
+		ULONG cb = (cbIn < cbOut) ? cbIn : cbOut;
+		if (cb > m_cbLeft)
+		{
+			cb = m_cbLeft;
+		}
+		memcpy(pbOut, pbIn, cb);
+		m_cbLeft -= cb;
+		*pcbUsed = cb;
+		*pcbWritten = cb;
+		return (bEnd && cb == cbIn) ? S_FALSE : S_OK;
+	}
+
+private:
+	ULONG m_cbLeft;
+};
+
+// Adds the filters of the running check
+HRESULT (*g_pfnAddFilters)(CBodyFilterChain* pChain);
+
+class CFilterAPP;
+typedef CBodyFilterSinkTM<CFilterAPP> CFilterSink;
+typedef BodyFilterStartPolicy<CFilterAPP,
+	CustomSinkStartPolicy<CFilterAPP, CFilterSink> > FilterPolicy;
+
+class CFilterAPP :
+	public CInternetProtocol<FilterPolicy>
+{
+public:
+	HRESULT AddBodyFilters(LPCWSTR /*szUrl*/, IUri* /*pUri*/,
+		CBodyFilterChain* pChain) const
+	{
+		return g_pfnAddFilters ? g_pfnAddFilters(pChain) : S_OK;
+	}
+};
+
+typedef CMetaFactory<CComClassFactoryProtocol, CFilterAPP> MetaFactory;
+
+// A client that checks the progress it is told about
+class ATL_NO_VTABLE CProgressClientSink :
+	public CFakeClientSink
+{
+public:
+	CProgressClientSink() :
+		m_ulLastProgress(0), m_bBackwards(false), m_bOverMax(false)
+	{
+	}
+
+	STDMETHODIMP ReportData(DWORD grfBSCF, ULONG ulProgress,
+		ULONG ulProgressMax)
+	{
+		m_bBackwards |= ulProgress < m_ulLastProgress;
+		m_bOverMax |= ulProgressMax && ulProgress > ulProgressMax;
+		m_ulLastProgress = ulProgress;
+		return CFakeClientSink::ReportData(grfBSCF, ulProgress,
+			ulProgressMax);
+	}
+
+	ULONG m_ulLastProgress;
+	bool m_bBackwards;
+	bool m_bOverMax;
+};
+
+// A request through a CFilterAPP, started with the filters pfnAddFilters
+// adds. With cbClientRead 0 the client doesn't read, and the test reads
+// the body with Read
+class Request
+{
+public:
+	Request(HRESULT (*pfnAddFilters)(CBodyFilterChain*), ULONG cbChunk,
+		ULONG cbClientRead) :
+		m_pClient(0), m_hrStart(E_UNEXPECTED)
+	{
+		g_pfnAddFilters = pfnAddFilters;
+		Inspection inspection = {0, 2166136261u, 0, false};
+		g_inspection = inspection;
+
+		FakeResponse response;
+		response.pbBody = g_body;
+		response.cbBody = cbBody;
+		response.cbChunk = cbChunk;
+		CComObject<CFakeTargetClassFactory>* pTargetCF = 0;
+		CHECK(SUCCEEDED(CFakeTargetClassFactory::Create(response,
+			&pTargetCF)));
+		m_spTargetCF = pTargetCF;
+		CHECK(SUCCEEDED(MetaFactory::CreateInstance(m_spTargetCF, &m_spCF)));
+		CHECK(SUCCEEDED(m_spCF->CreateInstance(0, IID_IInternetProtocol,
+			reinterpret_cast<void**>(&m_spProtocol))));
+
+		CComObject<CProgressClientSink>::CreateInstance(&m_pClient);
+		m_spClient = m_pClient;
+		m_pClient->SetProtocol(m_spProtocol);
+		m_pClient->SetReadSize(cbClientRead);
+		CComQIPtr<IInternetBindInfo> spBindInfo(m_spClient);
+		m_hrStart = m_spProtocol->Start(L"http://x.com/", m_spClient,
+			spBindInfo, 0, 0);
+	}
+
+	~Request()
+	{
+		m_spProtocol->Terminate(0);
+		m_pClient->SetProtocol(0);
+		g_pbClientBuffer = 0;
+	}
+
+	// Reads cbRead bytes at a time into pBody until Read fails or returns
+	// S_FALSE, and returns what it did
+	HRESULT ReadAll(ULONG cbRead, std::vector<BYTE>* pBody)
+	{
+		std::vector<BYTE> buffer(cbRead);
+		g_pbClientBuffer = &buffer[0];
+		g_cbClientBuffer = cbRead;
+		for (;;)
+		{
+			ULONG cbDone = 0;
+			HRESULT hr = m_spProtocol->Read(&buffer[0], cbRead, &cbDone);
+			CHECK(cbDone <= cbRead);
+			pBody->insert(pBody->end(), buffer.begin(),
+				buffer.begin() + cbDone);
+			if (hr != S_OK)
+			{
+				return hr;
+			}
+			// All of the body is available, so every Read gives some
+			CHECK(cbDone != 0);
+			if (!cbDone)
+			{
+				return E_UNEXPECTED;
+			}
+		}
+	}
+
+	CComPtr<IInternetProtocol> m_spProtocol;
+	CComObject<CProgressClientSink>* m_pClient;
+	HRESULT m_hrStart;
+
+private:
+	CComPtr<IClassFactory> m_spTargetCF;
+	CComPtr<IClassFactory> m_spCF;
+	CComPtr<IInternetProtocolSink> m_spClient;
+};
+
+std::vector<BYTE> GetDoubledBody()
+{
+	std::vector<BYTE> doubled;
+	for (ULONG i = 0; i < cbBody; ++i)
+	{
+		doubled.push_back(g_body[i]);
+		doubled.push_back(g_body[i]);
+	}
+	return doubled;
+}
+
+HRESULT AddInspectors(CBodyFilterChain* pChain)
+{
+	HRESULT hr = pChain->Add(new CInspector);
+	return SUCCEEDED(hr) ? pChain->Add(new CInspector) : hr;
+}
+
+HRESULT AddDoubler(CBodyFilterChain* pChain)
+{
+	return pChain->Add(new CDoubler);
+}
+
+// Inspectors on both sides of the doubler
+HRESULT AddDoublerBetweenInspectors(CBodyFilterChain* pChain)
+{
+	HRESULT hr = pChain->Add(new CInspector);
+	if (SUCCEEDED(hr))
+	{
+		hr = pChain->Add(new CDoubler);
+	}
+	return SUCCEEDED(hr) ? pChain->Add(new CInspector) : hr;
+}
+
+HRESULT AddFailingFilter(CBodyFilterChain* pChain)
+{
+	return pChain->Add(new CFailingFilter(1000));
+}
+
+HRESULT FailToAdd(CBodyFilterChain* /*pChain*/)
+{
+	return E_ACCESSDENIED;
+}
+
+void CheckInspectors()
+{
+	Request request(AddInspectors, 0, 0);
+	CHECK(request.m_hrStart == S_OK);
+	std::vector<BYTE> body;
+	CHECK(request.ReadAll(1024, &body) == S_FALSE);
+	CHECK(body.size() == cbBody && !memcmp(&body[0], g_body, cbBody));
+	// Both were shown the body, in the client's buffer, and its end
+	CHECK(g_inspection.cb == cbBody * 2);
+	CHECK(!g_inspection.bCopied);
+	CHECK(g_inspection.cEnd == 2);
+}
+
+void CheckDoubler()
+{
+	std::vector<BYTE> doubled = GetDoubledBody();
+	// Reads of an odd number of bytes leave the doubler one byte it can't
+	// fill
+	static const ULONG rgcbRead[] = {3, 7, 4096};
+	for (size_t i = 0; i < sizeof(rgcbRead) / sizeof(rgcbRead[0]); ++i)
+	{
+		Request request(AddDoubler, 0, 0);
+		CHECK(request.m_hrStart == S_OK);
+		std::vector<BYTE> body;
+		CHECK(request.ReadAll(rgcbRead[i], &body) == S_FALSE);
+		CHECK(body == doubled);
+	}
+
+	Request request(AddDoublerBetweenInspectors, 0, 0);
+	CHECK(request.m_hrStart == S_OK);
+	std::vector<BYTE> body;
+	CHECK(request.ReadAll(3, &body) == S_FALSE);
+	CHECK(body == doubled);
+	DWORD dwHash = CFakeClientSink::HashBytes(g_body, cbBody);
+	CHECK(g_inspection.cb == cbBody * 3);
+	CHECK(g_inspection.dwHash == CFakeClientSink::HashBytes(&doubled[0],
+		cbBody * 2, dwHash));
+	CHECK(g_inspection.cEnd == 2);
+}
+
+void CheckFailures()
+{
+	{
+		// What the filter produced is handed out before its error
+		Request request(AddFailingFilter, 0, 0);
+		CHECK(request.m_hrStart == S_OK);
+		std::vector<BYTE> body;
+		CHECK(request.ReadAll(4096, &body) == E_FAIL);
+		CHECK(body.size() == 1000 && !memcmp(&body[0], g_body, 1000));
+		ULONG cbRead = 1;
+		BYTE b = 0;
+		CHECK(request.m_spProtocol->Read(&b, 1, &cbRead) == E_FAIL);
+		CHECK(cbRead == 0);
+	}
+	{
+		// The request fails when the filters can't be added
+		Request request(FailToAdd, 0, 0);
+		CHECK(request.m_hrStart == E_ACCESSDENIED);
+		CHECK(request.m_pClient->m_cReportData == 0);
+	}
+}
+
+void CheckProgress()
+{
+	std::vector<BYTE> doubled = GetDoubledBody();
+	// The client reads every chunk as it is reported, 300 bytes at a time
+	Request request(AddDoubler, 700, 300);
+	CHECK(request.m_hrStart == S_OK);
+	CHECK(request.m_pClient->m_cReportData == 8);
+	CHECK(!request.m_pClient->m_bBackwards);
+	CHECK(!request.m_pClient->m_bOverMax);
+	CHECK(request.m_pClient->m_cbReceived == cbBody * 2);
+	CHECK(request.m_pClient->m_dwBodyHash ==
+		CFakeClientSink::HashBytes(&doubled[0], cbBody * 2));
+	// More than the body itself once the doubler went over some of it
+	CHECK(request.m_pClient->m_ulLastProgress > cbBody);
+}
+
+} // end anonymous namespace
+
+int main()
+{
+	for (ULONG i = 0; i < cbBody; ++i)
+	{
+		g_body[i] = static_cast<BYTE>(i * 7 + i / 251);
+	}
+	CheckInspectors();
+	CheckDoubler();
+	CheckFailures();
+	CheckProgress();
+	return TEST_RESULT();
+}
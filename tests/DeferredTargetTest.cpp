@@ -0,0 +1,161 @@
+// With deferred target creation, querying for IInternetPriority and
+// setting the priority before Start, as urlmon does, must not create the
+// target. The priority must reach the target once it is created.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include "ProtocolImpl.h"
+#include "ProtocolCF.h"
+#include "Portable/FakeProtocol.h"
+#include "tests/TestUtil.h"
+
+using namespace PassthroughAPP;
+
+namespace
+{
+
+class CPlainAPP :
+	public CInternetProtocol<NoSinkStartPolicy>
+{
+};
+
+class CSink :
+	public CInternetProtocolSinkWithSP<CSink>
+{
+};
+
+class CSinkAPP;
+typedef CustomSinkStartPolicy<CSinkAPP, CSink> SinkStartPolicy;
+
+class CSinkAPP :
+	public CInternetProtocol<SinkStartPolicy>
+{
+};
+
+template <class APP>
+HRESULT CreateFactory(IClassFactory* pTargetCF, bool bDefer,
+	IClassFactory** ppCF)
+{
+	CComClassFactoryProtocol* pFactory = 0;
+	HRESULT hr = CMetaFactory<CComClassFactoryProtocol, APP>::CreateInstance(
+		&pFactory);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+	CComPtr<IClassFactory> spCF = pFactory;
+	hr = pFactory->SetTargetClassFactory(pTargetCF);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+	pFactory->SetDeferTargetCreation(bDefer);
+	*ppCF = spCF.Detach();
+	return S_OK;
+}
+
+LONG GetPriority(IUnknown* punk)
+{
+	CComQIPtr<IInternetPriority> spPriority(punk);
+	LONG nPriority = -100;
+	CHECK(spPriority != 0 && spPriority->GetPriority(&nPriority) == S_OK);
+	return nPriority;
+}
+
+template <class APP>
+void CheckDeferred(IClassFactory* pTargetCF)
+{
+	CComObject<CFakeTargetClassFactory>* pFakeCF =
+		static_cast<CComObject<CFakeTargetClassFactory>*>(pTargetCF);
+	CComPtr<IClassFactory> spCF;
+	CHECK(SUCCEEDED(CreateFactory<APP>(pTargetCF, true, &spCF)));
+	if (!spCF)
+	{
+		return;
+	}
+	LONG cCreated = pFakeCF->m_cCreateInstance;
+
+	CComPtr<IInternetProtocol> spProtocol;
+	CHECK(SUCCEEDED(spCF->CreateInstance(0, IID_IInternetProtocol,
+		reinterpret_cast<void**>(&spProtocol))));
+	if (!spProtocol)
+	{
+		return;
+	}
+
+	CComPtr<IInternetPriority> spPriority;
+	CHECK(spProtocol->QueryInterface(&spPriority) == S_OK);
+	if (!spPriority)
+	{
+		return;
+	}
+	CHECK(GetPriority(spProtocol) == THREAD_PRIORITY_NORMAL);
+	CHECK(spPriority->SetPriority(THREAD_PRIORITY_HIGHEST) == S_OK);
+	CHECK(GetPriority(spProtocol) == THREAD_PRIORITY_HIGHEST);
+	CHECK(pFakeCF->m_cCreateInstance == cCreated);
+
+	CComObject<CFakeClientSink>* pClient = 0;
+	CComObject<CFakeClientSink>::CreateInstance(&pClient);
+	CComPtr<IInternetProtocolSink> spClient = pClient;
+	pClient->SetProtocol(spProtocol);
+	CComQIPtr<IInternetBindInfo> spBindInfo(spClient);
+	CHECK(SUCCEEDED(spProtocol->Start(L"http://example.com/", spClient,
+		spBindInfo, 0, 0)));
+	CHECK(pFakeCF->m_cCreateInstance == cCreated + 1);
+	CHECK(pClient->m_hrResult == S_OK);
+
+	// The target got the priority set before it existed
+	CFakeTargetProtocol* pTarget = pFakeCF->m_pLastProtocol;
+	CHECK(GetPriority(pTarget->GetUnknown()) == THREAD_PRIORITY_HIGHEST);
+
+	// And is reached through the interface handed out before it existed
+	CHECK(spPriority->SetPriority(THREAD_PRIORITY_LOWEST) == S_OK);
+	CHECK(GetPriority(pTarget->GetUnknown()) == THREAD_PRIORITY_LOWEST);
+	CHECK(GetPriority(spProtocol) == THREAD_PRIORITY_LOWEST);
+
+	spProtocol->Terminate(0);
+	pClient->SetProtocol(0);
+}
+
+void CheckNotDeferred(IClassFactory* pTargetCF)
+{
+	CComObject<CFakeTargetClassFactory>* pFakeCF =
+		static_cast<CComObject<CFakeTargetClassFactory>*>(pTargetCF);
+	CComPtr<IClassFactory> spCF;
+	CHECK(SUCCEEDED(CreateFactory<CPlainAPP>(pTargetCF, false, &spCF)));
+	CComPtr<IInternetProtocol> spProtocol;
+	if (spCF)
+	{
+		CHECK(SUCCEEDED(spCF->CreateInstance(0, IID_IInternetProtocol,
+			reinterpret_cast<void**>(&spProtocol))));
+	}
+	if (!spProtocol)
+	{
+		return;
+	}
+	CFakeTargetProtocol* pTarget = pFakeCF->m_pLastProtocol;
+	CComQIPtr<IInternetPriority> spPriority(spProtocol);
+	CHECK(spPriority != 0 &&
+		spPriority->SetPriority(THREAD_PRIORITY_ABOVE_NORMAL) == S_OK);
+	CHECK(GetPriority(pTarget->GetUnknown()) == THREAD_PRIORITY_ABOVE_NORMAL);
+	CHECK(GetPriority(spProtocol) == THREAD_PRIORITY_ABOVE_NORMAL);
+}
+
+} // end anonymous namespace
+
+int main()
+{
+	static BYTE body[256];
+	FakeResponse response;
+	response.pbBody = body;
+	response.cbBody = sizeof(body);
+	CComObject<CFakeTargetClassFactory>* pTargetCF = 0;
+	CHECK(SUCCEEDED(CFakeTargetClassFactory::Create(response, &pTargetCF)));
+	CComPtr<IClassFactory> spTargetCF = pTargetCF;
+
+	CheckDeferred<CPlainAPP>(spTargetCF);
+	CheckDeferred<CSinkAPP>(spTargetCF);
+	CheckNotDeferred(spTargetCF);
+	return TEST_RESULT();
+}
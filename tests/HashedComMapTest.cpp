@@ -0,0 +1,233 @@
+// Classes with COM maps of their own, deriving from classes that use
+// DECLARE_HASHED_COM_MAP() without declaring it themselves, share their
+// base's InternalQueryInterface. Each map must still be looked up in its
+// own table.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include "ProtocolImpl.h"
+#include "ProtocolCF.h"
+#include "Portable/FakeProtocol.h"
+#include "tests/TestUtil.h"
+
+using namespace PassthroughAPP;
+
+namespace
+{
+
+// Gets the shared InternalQueryInterface to index CInternetProtocol's own
+// map, which is longer than those of the classes below
+class CPlainAPP :
+	public CInternetProtocol<NoSinkStartPolicy>
+{
+};
+
+class CNegotiateAPP :
+	public CInternetProtocol<NoSinkStartPolicy>,
+	public IHttpNegotiate
+{
+	typedef CInternetProtocol<NoSinkStartPolicy> BaseClass;
+public:
+	BEGIN_COM_MAP(CNegotiateAPP)
+		COM_INTERFACE_ENTRY(IHttpNegotiate)
+		COM_INTERFACE_ENTRY_CHAIN(BaseClass)
+	END_COM_MAP()
+
+	STDMETHODIMP BeginningTransaction(LPCWSTR, LPCWSTR, DWORD, LPWSTR*)
+	{
+		return S_OK;
+	}
+	STDMETHODIMP OnResponse(DWORD, LPCWSTR, LPCWSTR, LPWSTR*)
+	{
+		return S_OK;
+	}
+};
+
+// Puts its own interface in front of, and after, different entries than
+// CNegotiateAPP
+class CServiceAPP :
+	public CInternetProtocol<NoSinkStartPolicy>,
+	public IServiceProvider
+{
+	typedef CInternetProtocol<NoSinkStartPolicy> BaseClass;
+public:
+	BEGIN_COM_MAP(CServiceAPP)
+		COM_INTERFACE_ENTRY(IInternetProtocolRoot)
+		COM_INTERFACE_ENTRY(IServiceProvider)
+		COM_INTERFACE_ENTRY_CHAIN(BaseClass)
+	END_COM_MAP()
+
+	STDMETHODIMP QueryService(REFGUID, REFIID, void** ppv)
+	{
+		*ppv = 0;
+		return E_NOINTERFACE;
+	}
+};
+
+class CNegotiateSink :
+	public CInternetProtocolSinkWithSP<CNegotiateSink>,
+	public IHttpNegotiate
+{
+	typedef CInternetProtocolSinkWithSP<CNegotiateSink> BaseClass;
+public:
+	BEGIN_COM_MAP(CNegotiateSink)
+		COM_INTERFACE_ENTRY(IHttpNegotiate)
+		COM_INTERFACE_ENTRY_CHAIN(BaseClass)
+	END_COM_MAP()
+
+	BEGIN_SERVICE_MAP(CNegotiateSink)
+		SERVICE_ENTRY(IID_IHttpNegotiate)
+	END_SERVICE_MAP()
+
+	STDMETHODIMP BeginningTransaction(LPCWSTR, LPCWSTR, DWORD, LPWSTR*)
+	{
+		return S_OK;
+	}
+	STDMETHODIMP OnResponse(DWORD, LPCWSTR, LPCWSTR, LPWSTR*)
+	{
+		return S_OK;
+	}
+};
+
+class CSinkAPP;
+typedef CustomSinkStartPolicy<CSinkAPP, CNegotiateSink> SinkStartPolicy;
+
+class CSinkAPP :
+	public CInternetProtocol<SinkStartPolicy>
+{
+};
+
+template <class APP>
+HRESULT CreateProtocol(IClassFactory* pTargetCF, IInternetProtocol** ppProtocol)
+{
+	CComPtr<IClassFactory> spCF;
+	HRESULT hr = CMetaFactory<CComClassFactoryProtocol, APP>::CreateInstance(
+		pTargetCF, &spCF);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+	return spCF->CreateInstance(0, IID_IInternetProtocol,
+		reinterpret_cast<void**>(ppProtocol));
+}
+
+HRESULT QueryFor(IUnknown* punk, REFIID iid, IUnknown** ppunk)
+{
+	*ppunk = 0;
+	return punk->QueryInterface(iid, reinterpret_cast<void**>(ppunk));
+}
+
+void CheckNegotiateAPP(IInternetProtocol* pProtocol)
+{
+	CNegotiateAPP* pApp = static_cast<CNegotiateAPP*>(pProtocol);
+	CComPtr<IUnknown> spUnk;
+	CHECK(QueryFor(pProtocol, IID_IHttpNegotiate, &spUnk) == S_OK);
+	CHECK(spUnk == static_cast<IHttpNegotiate*>(pApp));
+	spUnk.Release();
+	CHECK(QueryFor(pProtocol, IID_IServiceProvider, &spUnk) ==
+		E_NOINTERFACE);
+	spUnk.Release();
+	CHECK(QueryFor(pProtocol, IID_IInternetProtocolEx, &spUnk) == S_OK);
+	CHECK(spUnk == static_cast<IInternetProtocolEx*>(pApp));
+	spUnk.Release();
+	// Passed through to the target
+	CHECK(QueryFor(pProtocol, IID_IWinInetHttpInfo, &spUnk) == S_OK);
+}
+
+void CheckServiceAPP(IInternetProtocol* pProtocol)
+{
+	CServiceAPP* pApp = static_cast<CServiceAPP*>(pProtocol);
+	CComPtr<IUnknown> spUnk;
+	CHECK(QueryFor(pProtocol, IID_IServiceProvider, &spUnk) == S_OK);
+	CHECK(spUnk == static_cast<IServiceProvider*>(pApp));
+	spUnk.Release();
+	CHECK(QueryFor(pProtocol, IID_IHttpNegotiate, &spUnk) == E_NOINTERFACE);
+	spUnk.Release();
+	CHECK(QueryFor(pProtocol, IID_IInternetProtocolRoot, &spUnk) == S_OK);
+	CHECK(spUnk == static_cast<IInternetProtocolRoot*>(pApp));
+	spUnk.Release();
+	CHECK(QueryFor(pProtocol, IID_IInternetPriority, &spUnk) == S_OK);
+}
+
+void CheckPlainAPP(IInternetProtocol* pProtocol)
+{
+	CComPtr<IUnknown> spUnk;
+	CHECK(QueryFor(pProtocol, IID_IWinInetHttpInfo, &spUnk) == S_OK);
+	spUnk.Release();
+	CHECK(QueryFor(pProtocol, IID_IWinInetCacheHints2, &spUnk) ==
+		E_NOINTERFACE);
+	spUnk.Release();
+	CHECK(QueryFor(pProtocol, IID_IHttpNegotiate, &spUnk) == E_NOINTERFACE);
+}
+
+void CheckSink(IInternetProtocol* pProtocol)
+{
+	CNegotiateSink* pSink = static_cast<CSinkAPP*>(pProtocol)->GetSink();
+	IUnknown* punkSink = pSink->GetUnknown();
+	CComPtr<IUnknown> spUnk;
+	CHECK(QueryFor(punkSink, IID_IHttpNegotiate, &spUnk) == S_OK);
+	CHECK(spUnk == static_cast<IHttpNegotiate*>(pSink));
+	spUnk.Release();
+	// From CInternetProtocolSinkWithSP's map
+	CHECK(QueryFor(punkSink, IID_IServiceProvider, &spUnk) == S_OK);
+	CHECK(spUnk == static_cast<IServiceProvider*>(pSink));
+	spUnk.Release();
+	// From CInternetProtocolSinkTM's
+	CHECK(QueryFor(punkSink, IID_IInternetProtocolSink, &spUnk) == S_OK);
+	CHECK(spUnk == static_cast<IInternetProtocolSink*>(pSink));
+	spUnk.Release();
+	CHECK(QueryFor(punkSink, IID_IInternetBindInfo, &spUnk) == S_OK);
+	spUnk.Release();
+	CHECK(QueryFor(punkSink, IID_IWinInetInfo, &spUnk) == E_NOINTERFACE);
+}
+
+} // end anonymous namespace
+
+int main()
+{
+	FakeResponse response;
+	CComObject<CFakeTargetClassFactory>* pTargetCF = 0;
+	CHECK(SUCCEEDED(CFakeTargetClassFactory::Create(response, &pTargetCF)));
+	CComPtr<IClassFactory> spTargetCF = pTargetCF;
+
+	CComPtr<IInternetProtocol> spPlain;
+	CComPtr<IInternetProtocol> spNegotiate;
+	CComPtr<IInternetProtocol> spService;
+	CComPtr<IInternetProtocol> spSinkAPP;
+	CHECK(SUCCEEDED(CreateProtocol<CPlainAPP>(spTargetCF, &spPlain)));
+	CHECK(SUCCEEDED(CreateProtocol<CNegotiateAPP>(spTargetCF, &spNegotiate)));
+	CHECK(SUCCEEDED(CreateProtocol<CServiceAPP>(spTargetCF, &spService)));
+	CHECK(SUCCEEDED(CreateProtocol<CSinkAPP>(spTargetCF, &spSinkAPP)));
+	if (!spPlain || !spNegotiate || !spService || !spSinkAPP)
+	{
+		return TEST_RESULT();
+	}
+
+	CComObject<CFakeClientSink>* pClient = 0;
+	CComObject<CFakeClientSink>::CreateInstance(&pClient);
+	CComPtr<IInternetProtocolSink> spClient = pClient;
+	CComQIPtr<IInternetBindInfo> spBindInfo(spClient);
+	CHECK(SUCCEEDED(spSinkAPP->Start(L"http://example.com/", spClient,
+		spBindInfo, 0, 0)));
+
+	// Every order, more than once, so that each map is looked up both
+	// before and after the others got their tables
+	for (int i = 0; i < 3; ++i)
+	{
+		CheckPlainAPP(spPlain);
+		CheckNegotiateAPP(spNegotiate);
+		CheckServiceAPP(spService);
+		CheckSink(spSinkAPP);
+	}
+	for (int i = 0; i < 3; ++i)
+	{
+		CheckSink(spSinkAPP);
+		CheckServiceAPP(spService);
+		CheckNegotiateAPP(spNegotiate);
+		CheckPlainAPP(spPlain);
+	}
+
+	spSinkAPP->Terminate(0);
+	return TEST_RESULT();
+}
@@ -0,0 +1,235 @@
+// Requests LocalResponseStartPolicy answers itself, with deferred target
+// creation: the transparent GIF, no content and a redirect reach the
+// client without the target being created, and the requests the APP
+// declines fall through to the target. Both on its own and in front of a
+// custom sink.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include "ProtocolImpl.h"
+#include "ProtocolCF.h"
+#include "SinkPolicy.h"
+#include "Portable/FakeProtocol.h"
+#include "tests/TestUtil.h"
+
+using namespace PassthroughAPP;
+
+namespace
+{
+
+LPCWSTR const szGifUrl = L"http://ads.example.com/pixel.gif";
+LPCWSTR const szNoContentUrl = L"http://ads.example.com/beacon";
+LPCWSTR const szRedirectUrl = L"http://ads.example.com/click";
+LPCWSTR const szRedirectTarget = L"http://example.com/landing";
+LPCWSTR const szTargetUrl = L"http://example.com/index.html";
+
+BYTE g_body[3000];
+
+HRESULT GetTestResponse(LPCWSTR szUrl, LocalResponse* pResponse)
+{
+	CHECK(szUrl != 0);
+	if (!wcscmp(szUrl, szGifUrl))
+	{
+		*pResponse = LocalResponse::TransparentGif();
+		return S_OK;
+	}
+	if (!wcscmp(szUrl, szNoContentUrl))
+	{
+		*pResponse = LocalResponse::NoContent();
+		return S_OK;
+	}
+	if (!wcscmp(szUrl, szRedirectUrl))
+	{
+		*pResponse = LocalResponse::Redirect(szRedirectTarget);
+		return S_OK;
+	}
+	return S_FALSE;
+}
+
+class CLocalAPP;
+typedef LocalResponseStartPolicy<CLocalAPP> LocalPolicy;
+
+class CLocalAPP :
+	public CInternetProtocol<LocalPolicy>
+{
+public:
+	HRESULT GetLocalResponse(LPCWSTR szUrl, IUri* pUri,
+		LocalResponse* pResponse) const
+	{
+		return GetTestResponse(szUrl, pResponse);
+	}
+};
+
+class CSink :
+	public CInternetProtocolSinkWithSP<CSink>
+{
+};
+
+class CLocalSinkAPP;
+typedef LocalResponseStartPolicy<CLocalSinkAPP,
+	CustomSinkStartPolicy<CLocalSinkAPP, CSink> > LocalSinkPolicy;
+
+class CLocalSinkAPP :
+	public CInternetProtocol<LocalSinkPolicy>
+{
+public:
+	HRESULT GetLocalResponse(LPCWSTR szUrl, IUri* pUri,
+		LocalResponse* pResponse) const
+	{
+		return GetTestResponse(szUrl, pResponse);
+	}
+};
+
+// The outcome of a request started with deferred target creation, on a
+// target class factory of its own
+struct Outcome
+{
+	LONG cCreateInstance;
+	LONG cTargetStart;
+	LONG cReportProgress;
+	LONG cReportData;
+	LONG cReportResult;
+	ULONG ulLastStatusCode;
+	HRESULT hrResult;
+	ULONG cbReceived;
+	DWORD dwBodyHash;
+	// What Read returns once the client has read everything
+	HRESULT hrReadAfter;
+};
+
+template <class APP>
+Outcome Request(LPCWSTR szUrl)
+{
+	Outcome outcome = {-1, -1, -1, -1, -1, 0, E_FAIL, 0, 0, E_FAIL};
+	FakeResponse response;
+	response.pbBody = g_body;
+	response.cbBody = sizeof(g_body);
+	response.cbChunk = 1000;
+	CComObject<CFakeTargetClassFactory>* pTargetCF = 0;
+	CHECK(SUCCEEDED(CFakeTargetClassFactory::Create(response, &pTargetCF)));
+	CComPtr<IClassFactory> spTargetCF = pTargetCF;
+
+	typedef CMetaFactory<CComClassFactoryProtocol, APP> MetaFactory;
+	CComClassFactoryProtocol* pFactory = 0;
+	CHECK(SUCCEEDED(MetaFactory::CreateInstance(&pFactory)));
+	CComPtr<IClassFactory> spCF = pFactory;
+	if (!pTargetCF || !pFactory)
+	{
+		return outcome;
+	}
+	pFactory->SetTargetClassFactory(spTargetCF);
+	pFactory->SetDeferTargetCreation(true);
+
+	CComPtr<IInternetProtocol> spProtocol;
+	CHECK(SUCCEEDED(spCF->CreateInstance(0, IID_IInternetProtocol,
+		reinterpret_cast<void**>(&spProtocol))));
+	if (!spProtocol)
+	{
+		return outcome;
+	}
+	CComObject<CFakeClientSink>* pClient = 0;
+	CComObject<CFakeClientSink>::CreateInstance(&pClient);
+	CComPtr<IInternetProtocolSink> spClient = pClient;
+	pClient->SetProtocol(spProtocol);
+	CComQIPtr<IInternetBindInfo> spBindInfo(spClient);
+	CHECK(spProtocol->Start(szUrl, spClient, spBindInfo, 0, 0) == S_OK);
+
+	BYTE b;
+	ULONG cbRead = 1;
+	outcome.hrReadAfter = spProtocol->Read(&b, sizeof(b), &cbRead);
+	CHECK(cbRead == 0);
+	CHECK(spProtocol->Terminate(0) == S_OK);
+	pClient->SetProtocol(0);
+
+	outcome.cCreateInstance = pTargetCF->m_cCreateInstance;
+	outcome.cTargetStart = pTargetCF->m_pLastProtocol ?
+		pTargetCF->m_pLastProtocol->m_cStart : 0;
+	outcome.cReportProgress = pClient->m_cReportProgress;
+	outcome.cReportData = pClient->m_cReportData;
+	outcome.cReportResult = pClient->m_cReportResult;
+	outcome.ulLastStatusCode = pClient->m_ulLastStatusCode;
+	outcome.hrResult = pClient->m_hrResult;
+	outcome.cbReceived = pClient->m_cbReceived;
+	outcome.dwBodyHash = pClient->m_dwBodyHash;
+	return outcome;
+}
+
+template <class APP>
+void CheckGif()
+{
+	LocalResponse gif = LocalResponse::TransparentGif();
+	Outcome outcome = Request<APP>(szGifUrl);
+	CHECK(outcome.cCreateInstance == 0);
+	CHECK(outcome.cReportProgress == 1);
+	CHECK(outcome.ulLastStatusCode == BINDSTATUS_MIMETYPEAVAILABLE);
+	CHECK(outcome.cReportData == 1);
+	CHECK(outcome.cReportResult == 1);
+	CHECK(outcome.hrResult == S_OK);
+	CHECK(outcome.cbReceived == gif.cbBody);
+	CHECK(outcome.dwBodyHash ==
+		CFakeClientSink::HashBytes(gif.pbBody, gif.cbBody));
+	CHECK(outcome.hrReadAfter == S_FALSE);
+}
+
+template <class APP>
+void CheckNoContent()
+{
+	Outcome outcome = Request<APP>(szNoContentUrl);
+	CHECK(outcome.cCreateInstance == 0);
+	// No MIME type, and a single notification of no data
+	CHECK(outcome.cReportProgress == 0);
+	CHECK(outcome.cReportData == 1);
+	CHECK(outcome.cReportResult == 1);
+	CHECK(outcome.hrResult == S_OK);
+	CHECK(outcome.cbReceived == 0);
+	CHECK(outcome.hrReadAfter == S_FALSE);
+}
+
+template <class APP>
+void CheckRedirect()
+{
+	Outcome outcome = Request<APP>(szRedirectUrl);
+	CHECK(outcome.cCreateInstance == 0);
+	CHECK(outcome.cReportProgress == 0);
+	CHECK(outcome.cReportData == 0);
+	CHECK(outcome.cReportResult == 1);
+	CHECK(outcome.hrResult == INET_E_REDIRECTING);
+	CHECK(outcome.cbReceived == 0);
+}
+
+template <class APP>
+void CheckFallThrough()
+{
+	Outcome outcome = Request<APP>(szTargetUrl);
+	CHECK(outcome.cCreateInstance == 1);
+	CHECK(outcome.cTargetStart == 1);
+	CHECK(outcome.cReportData == 3);
+	CHECK(outcome.hrResult == S_OK);
+	CHECK(outcome.cbReceived == sizeof(g_body));
+	CHECK(outcome.dwBodyHash ==
+		CFakeClientSink::HashBytes(g_body, sizeof(g_body)));
+	CHECK(outcome.hrReadAfter == S_FALSE);
+}
+
+template <class APP>
+void CheckAll()
+{
+	CheckGif<APP>();
+	CheckNoContent<APP>();
+	CheckRedirect<APP>();
+	CheckFallThrough<APP>();
+}
+
+} // end anonymous namespace
+
+int main()
+{
+	for (ULONG i = 0; i < sizeof(g_body); ++i)
+	{
+		g_body[i] = static_cast<BYTE>(i * 7);
+	}
+	CheckAll<CLocalAPP>();
+	CheckAll<CLocalSinkAPP>();
+	return TEST_RESULT();
+}
@@ -0,0 +1,170 @@
+// Protocol/sink objects declared with the DECLARE_*_PROTSINK_POOLED
+// macros come from PooledAllocPolicy: a released object's block is reused
+// by the next one, blocks freed beyond SetMaxFree go back to the heap, and
+// Trim empties the free list. Each APP has a pool of its own.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include "ProtocolImpl.h"
+#include "ProtocolCF.h"
+#include "SinkPolicy.h"
+#include "Portable/FakeProtocol.h"
+#include "tests/TestUtil.h"
+
+using namespace PassthroughAPP;
+
+namespace
+{
+
+class CPooledSink :
+	public CInternetProtocolSinkWithSP<CPooledSink>
+{
+};
+
+class CPooledAPP;
+typedef CustomSinkStartPolicy<CPooledAPP, CPooledSink> PooledStartPolicy;
+
+class CPooledAPP :
+	public CInternetProtocol<PooledStartPolicy>
+{
+public:
+	DECLARE_NOT_AGGREGATABLE_PROTSINK_POOLED(CPooledAPP, CPooledSink)
+};
+
+class CAggregatableAPP;
+typedef CustomSinkStartPolicy<CAggregatableAPP, CPooledSink>
+	AggregatableStartPolicy;
+
+class CAggregatableAPP :
+	public CInternetProtocol<AggregatableStartPolicy>
+{
+public:
+	DECLARE_AGGREGATABLE_PROTSINK_POOLED(CAggregatableAPP, CPooledSink)
+};
+
+BYTE g_body[1000];
+
+void CheckStatistics(const PoolStatistics& stats, LONG cHits, LONG cMisses,
+	LONG cOutstanding, LONG cHighWater, LONG cFree)
+{
+	CHECK(stats.cHits == cHits);
+	CHECK(stats.cMisses == cMisses);
+	CHECK(stats.cOutstanding == cOutstanding);
+	CHECK(stats.cHighWater == cHighWater);
+	CHECK(stats.cFree == cFree);
+}
+
+template <class APP>
+void CheckPool(IClassFactory* pTargetCF)
+{
+	typedef PooledAllocPolicy<APP> Pool;
+	typedef CMetaFactory<CComClassFactoryProtocol, APP> MetaFactory;
+	CComPtr<IClassFactory> spCF;
+	CHECK(SUCCEEDED(MetaFactory::CreateInstance(pTargetCF, &spCF)));
+	if (!spCF)
+	{
+		return;
+	}
+	PoolStatistics stats;
+	Pool::GetStatistics(&stats);
+	CheckStatistics(stats, 0, 0, 0, 0, 0);
+
+	// A request through an object from the heap
+	CComPtr<IInternetProtocol> spProtocol;
+	CHECK(SUCCEEDED(spCF->CreateInstance(0, IID_IInternetProtocol,
+		reinterpret_cast<void**>(&spProtocol))));
+	if (!spProtocol)
+	{
+		return;
+	}
+	Pool::GetStatistics(&stats);
+	CheckStatistics(stats, 0, 1, 1, 1, 0);
+	CComObject<CFakeClientSink>* pClient = 0;
+	CComObject<CFakeClientSink>::CreateInstance(&pClient);
+	CComPtr<IInternetProtocolSink> spClient = pClient;
+	pClient->SetProtocol(spProtocol);
+	CComQIPtr<IInternetBindInfo> spBindInfo(spClient);
+	CHECK(spProtocol->Start(L"http://example.com/", spClient, spBindInfo, 0,
+		0) == S_OK);
+	CHECK(pClient->m_hrResult == S_OK);
+	CHECK(pClient->m_cbReceived == sizeof(g_body));
+	spProtocol->Terminate(0);
+	pClient->SetProtocol(0);
+	void* pvFirst = spProtocol.p;
+	spProtocol.Release();
+	Pool::GetStatistics(&stats);
+	CheckStatistics(stats, 0, 1, 0, 1, 1);
+
+	// The next object reuses its block
+	CHECK(SUCCEEDED(spCF->CreateInstance(0, IID_IInternetProtocol,
+		reinterpret_cast<void**>(&spProtocol))));
+	CHECK(spProtocol.p == pvFirst);
+	Pool::GetStatistics(&stats);
+	CheckStatistics(stats, 1, 1, 1, 1, 0);
+
+	// Only 2 of the 5 blocks freed are kept
+	Pool::SetMaxFree(2);
+	const size_t cObjects = 4;
+	CComPtr<IInternetProtocol> rgspProtocols[cObjects];
+	for (size_t i = 0; i < cObjects; ++i)
+	{
+		CHECK(SUCCEEDED(spCF->CreateInstance(0, IID_IInternetProtocol,
+			reinterpret_cast<void**>(&rgspProtocols[i]))));
+	}
+	Pool::GetStatistics(&stats);
+	CheckStatistics(stats, 1, 5, 5, 5, 0);
+	spProtocol.Release();
+	for (size_t i = 0; i < cObjects; ++i)
+	{
+		rgspProtocols[i].Release();
+	}
+	Pool::GetStatistics(&stats);
+	CheckStatistics(stats, 1, 5, 0, 5, 2);
+
+	// The kept blocks serve the next 2 objects, the heap the third
+	for (size_t i = 0; i < 3; ++i)
+	{
+		CHECK(SUCCEEDED(spCF->CreateInstance(0, IID_IInternetProtocol,
+			reinterpret_cast<void**>(&rgspProtocols[i]))));
+	}
+	Pool::GetStatistics(&stats);
+	CheckStatistics(stats, 3, 6, 3, 5, 0);
+	for (size_t i = 0; i < 3; ++i)
+	{
+		rgspProtocols[i].Release();
+	}
+	Pool::GetStatistics(&stats);
+	CheckStatistics(stats, 3, 6, 0, 5, 2);
+
+	// Trim returns them to the heap
+	Pool::Trim();
+	Pool::GetStatistics(&stats);
+	CheckStatistics(stats, 3, 6, 0, 5, 0);
+	CHECK(SUCCEEDED(spCF->CreateInstance(0, IID_IInternetProtocol,
+		reinterpret_cast<void**>(&spProtocol))));
+	spProtocol.Release();
+	Pool::GetStatistics(&stats);
+	CheckStatistics(stats, 3, 7, 0, 5, 1);
+	Pool::Trim();
+}
+
+} // end anonymous namespace
+
+int main()
+{
+	FakeResponse response;
+	response.pbBody = g_body;
+	response.cbBody = sizeof(g_body);
+	CComObject<CFakeTargetClassFactory>* pTargetCF = 0;
+	CHECK(SUCCEEDED(CFakeTargetClassFactory::Create(response, &pTargetCF)));
+	CComPtr<IClassFactory> spTargetCF = pTargetCF;
+
+	CheckPool<CPooledAPP>(spTargetCF);
+	CheckPool<CAggregatableAPP>(spTargetCF);
+	// The first APP's pool wasn't touched by the second's objects
+	PoolStatistics stats;
+	PooledAllocPolicy<CPooledAPP>::GetStatistics(&stats);
+	CheckStatistics(stats, 3, 7, 0, 5, 0);
+	return TEST_RESULT();
+}
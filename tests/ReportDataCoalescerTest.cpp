@@ -0,0 +1,190 @@
+// ReportData coalescing with a time threshold: a notification held back
+// for the whole delay is forwarded through Switch and Continue even when
+// the target reports nothing more, and the timer is cancelled when the
+// request reports its result or is terminated.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include <chrono>
+#include <thread>
+
+#include "ProtocolImpl.h"
+#include "ProtocolCF.h"
+#include "Portable/FakeProtocol.h"
+#include "tests/TestUtil.h"
+
+using namespace PassthroughAPP;
+
+namespace
+{
+
+const DWORD dwMaxDelay = 50;
+
+class CCoalescingSink :
+	public CReportDataCoalescingSink<CInternetProtocolSinkWithSP<CCoalescingSink> >
+{
+	typedef CReportDataCoalescingSink<CInternetProtocolSinkWithSP<CCoalescingSink> >
+		BaseClass;
+public:
+	HRESULT OnStart(LPCWSTR szUrl, IInternetProtocolSink *pOIProtSink,
+		IInternetBindInfo *pOIBindInfo, DWORD grfPI, HANDLE_PTR dwReserved,
+		IInternetProtocol* pTargetProtocol)
+	{
+		SetReportDataCoalescing(0, dwMaxDelay);
+		return BaseClass::OnStart(szUrl, pOIProtSink, pOIBindInfo, grfPI,
+			dwReserved, pTargetProtocol);
+	}
+};
+
+class CCoalescingAPP;
+typedef ReportDataCoalescingStartPolicy<CCoalescingAPP, CCoalescingSink>
+	CoalescingPolicy;
+
+class CCoalescingAPP :
+	public CInternetProtocol<CoalescingPolicy>
+{
+};
+
+typedef CMetaFactory<CComClassFactoryProtocol, CCoalescingAPP> MetaFactory;
+
+const ULONG cbBody = 5000;
+BYTE g_body[cbBody];
+
+// A request through a CCoalescingAPP whose target reports nothing until the
+// test calls its sink, to a client that doesn't read
+class Request
+{
+public:
+	Request() :
+		m_pClient(0)
+	{
+		FakeResponse response;
+		response.pbBody = g_body;
+		response.cbBody = cbBody;
+		response.bDeliverOnStart = false;
+		CComObject<CFakeTargetClassFactory>* pTargetCF = 0;
+		CHECK(SUCCEEDED(CFakeTargetClassFactory::Create(response,
+			&pTargetCF)));
+		m_spTargetCF = pTargetCF;
+		CHECK(SUCCEEDED(MetaFactory::CreateInstance(m_spTargetCF, &m_spCF)));
+		CHECK(SUCCEEDED(m_spCF->CreateInstance(0, IID_IInternetProtocol,
+			reinterpret_cast<void**>(&m_spProtocol))));
+
+		CComObject<CFakeClientSink>::CreateInstance(&m_pClient);
+		m_spClient = m_pClient;
+		m_pClient->SetProtocol(m_spProtocol);
+		m_pClient->SetReadSize(0);
+		CComQIPtr<IInternetBindInfo> spBindInfo(m_spClient);
+		CHECK(m_spProtocol->Start(L"http://x.com/", m_spClient, spBindInfo,
+			0, 0) == S_OK);
+		CCoalescingAPP* pApp = static_cast<CCoalescingAPP*>(
+			static_cast<IInternetProtocol*>(m_spProtocol));
+		CHECK(SUCCEEDED(pApp->GetSink()->GetUnknown()->QueryInterface(
+			&m_spSink)));
+	}
+
+	~Request()
+	{
+		Terminate();
+	}
+
+	void Terminate()
+	{
+		if (m_spProtocol)
+		{
+			m_spProtocol->Terminate(0);
+			m_pClient->SetProtocol(0);
+			m_spSink.Release();
+			m_spProtocol.Release();
+		}
+	}
+
+	// Reports cbProgress bytes, the first time as the first notification
+	void ReportData(ULONG cbProgress)
+	{
+		DWORD grfBSCF = cbProgress == 1000 ?
+			BSCF_FIRSTDATANOTIFICATION : BSCF_INTERMEDIATEDATANOTIFICATION;
+		CHECK(m_spSink->ReportData(grfBSCF, cbProgress, cbBody) == S_OK);
+	}
+
+	// Waits up to 2 seconds for the client to be asked to Switch cSwitch
+	// times
+	bool WaitForSwitch(LONG cSwitch) const
+	{
+		for (int i = 0; i < 200; ++i)
+		{
+			if (m_pClient->m_cSwitch >= cSwitch)
+			{
+				return true;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		return false;
+	}
+
+	CComPtr<IInternetProtocol> m_spProtocol;
+	CComPtr<IInternetProtocolSink> m_spSink;
+	CComObject<CFakeClientSink>* m_pClient;
+
+private:
+	CComPtr<IClassFactory> m_spTargetCF;
+	CComPtr<IClassFactory> m_spCF;
+	CComPtr<IInternetProtocolSink> m_spClient;
+};
+
+void CheckDelayExpires()
+{
+	Request request;
+	request.ReportData(1000);
+	request.ReportData(2000);
+	request.ReportData(3000);
+	CHECK(request.m_pClient->m_cReportData == 1);
+
+	// Forwarded from Continue, on the thread the client continues on
+	CHECK(request.WaitForSwitch(1));
+	CHECK(request.m_pClient->m_cReportData == 1);
+	CHECK(request.m_pClient->ContinuePending() == 1);
+	CHECK(request.m_pClient->m_cReportData == 2);
+
+	// Held back again, and forwarded the same way
+	request.ReportData(4000);
+	CHECK(request.m_pClient->m_cReportData == 2);
+	CHECK(request.WaitForSwitch(2));
+	CHECK(request.m_pClient->ContinuePending() == 1);
+	CHECK(request.m_pClient->m_cReportData == 3);
+}
+
+void CheckResult()
+{
+	Request request;
+	request.ReportData(1000);
+	request.ReportData(2000);
+	CHECK(request.m_spSink->ReportResult(S_OK, 0, 0) == S_OK);
+	CHECK(request.m_pClient->m_cReportData == 2);
+	CHECK(request.m_pClient->m_cReportResult == 1);
+	std::this_thread::sleep_for(std::chrono::milliseconds(dwMaxDelay * 2));
+	CHECK(request.m_pClient->m_cSwitch == 0);
+}
+
+void CheckTerminate()
+{
+	Request request;
+	request.ReportData(1000);
+	request.ReportData(2000);
+	CComObject<CFakeClientSink>* pClient = request.m_pClient;
+	request.Terminate();
+	std::this_thread::sleep_for(std::chrono::milliseconds(dwMaxDelay * 2));
+	CHECK(pClient->m_cSwitch == 0);
+	CHECK(pClient->m_cReportData == 1);
+}
+
+} // end anonymous namespace
+
+int main()
+{
+	CheckDelayExpires();
+	CheckResult();
+	CheckTerminate();
+	return TEST_RESULT();
+}
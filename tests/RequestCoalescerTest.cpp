@@ -0,0 +1,279 @@
+// CoalescingStartPolicy and CRequestCoalescer: followers get the leader's
+// response without starting their target, restart when the leader goes
+// away before its first Read or gets a response that isn't shared, fail
+// when it goes away part way, and can be aborted while they wait.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include "ProtocolImpl.h"
+#include "ProtocolCF.h"
+#include "SinkPolicy.h"
+#include "Portable/FakeProtocol.h"
+#include "tests/TestUtil.h"
+
+using namespace PassthroughAPP;
+
+namespace
+{
+
+CRequestCoalescer g_coalescer;
+
+class CCoalescingAPP;
+typedef CoalescingStartPolicy<CCoalescingAPP> CoalescingPolicy;
+
+class CCoalescingAPP :
+	public CInternetProtocol<CoalescingPolicy>
+{
+public:
+	CRequestCoalescer* GetRequestCoalescer() const
+	{
+		return &g_coalescer;
+	}
+};
+
+typedef CMetaFactory<CComClassFactoryProtocol, CCoalescingAPP> MetaFactory;
+
+const ULONG cbBody = 5000;
+BYTE g_body[cbBody];
+
+LPCWSTR const szSharedHeaders = L"Content-Type: image/png\r\n";
+
+// A request through a CCoalescingAPP whose target the test drives
+class Request
+{
+public:
+	Request() :
+		m_pClient(0), m_pTargetCF(0)
+	{
+	}
+
+	~Request()
+	{
+		Terminate();
+	}
+
+	// Starts szUrl, with the client reading cbRead bytes per Read, or not
+	// reading at all if 0
+	void Start(LPCWSTR szUrl, LPCWSTR szHeaders = szSharedHeaders,
+		ULONG cbRead = 700)
+	{
+		FakeResponse response;
+		response.pbBody = g_body;
+		response.cbBody = cbBody;
+		response.cbChunk = 1000;
+		response.szMimeType = L"image/png";
+		response.szHeaders = szHeaders;
+		response.bDeliverOnStart = false;
+		CHECK(SUCCEEDED(CFakeTargetClassFactory::Create(response,
+			&m_pTargetCF)));
+		m_spTargetCF = m_pTargetCF;
+
+		CComClassFactoryProtocol* pFactory = 0;
+		CHECK(SUCCEEDED(MetaFactory::CreateInstance(&pFactory)));
+		m_spCF = pFactory;
+		pFactory->SetTargetClassFactory(m_spTargetCF);
+		CHECK(SUCCEEDED(m_spCF->CreateInstance(0, IID_IInternetProtocol,
+			reinterpret_cast<void**>(&m_spProtocol))));
+
+		CComObject<CFakeClientSink>::CreateInstance(&m_pClient);
+		m_spClient = m_pClient;
+		m_pClient->SetProtocol(m_spProtocol);
+		m_pClient->SetBindInfo(BINDF_ASYNCHRONOUS, BINDVERB_GET);
+		m_pClient->SetReadSize(cbRead);
+		CComQIPtr<IInternetBindInfo> spBindInfo(m_spClient);
+		CHECK(m_spProtocol->Start(szUrl, m_spClient, spBindInfo, 0, 0) ==
+			S_OK);
+	}
+
+	void Terminate()
+	{
+		if (m_spProtocol)
+		{
+			m_spProtocol->Terminate(0);
+			m_pClient->SetProtocol(0);
+			m_spProtocol.Release();
+		}
+	}
+
+	CFakeTargetProtocol* GetTarget() const
+	{
+		return m_pTargetCF->m_pLastProtocol;
+	}
+
+	bool IsStarted() const
+	{
+		return GetTarget()->m_cStart + GetTarget()->m_cStartEx != 0;
+	}
+
+	HRESULT Read(ULONG cb)
+	{
+		BYTE buffer[cbBody];
+		ULONG cbRead = 0;
+		HRESULT hr = m_spProtocol->Read(buffer, cb, &cbRead);
+		m_pClient->m_dwBodyHash = CFakeClientSink::HashBytes(buffer, cbRead,
+			m_pClient->m_dwBodyHash);
+		m_pClient->m_cbReceived += cbRead;
+		return hr;
+	}
+
+	bool GotBody() const
+	{
+		return m_pClient->m_hrResult == S_OK &&
+			m_pClient->m_cbReceived == cbBody &&
+			m_pClient->m_dwBodyHash ==
+			CFakeClientSink::HashBytes(g_body, cbBody);
+	}
+
+	CComPtr<IInternetProtocol> m_spProtocol;
+	CComObject<CFakeClientSink>* m_pClient;
+
+private:
+	CComObject<CFakeTargetClassFactory>* m_pTargetCF;
+	CComPtr<IClassFactory> m_spTargetCF;
+	CComPtr<IClassFactory> m_spCF;
+	CComPtr<IInternetProtocolSink> m_spClient;
+};
+
+void CheckShared()
+{
+	RequestCoalescerStatistics before;
+	g_coalescer.GetStatistics(&before);
+	Request leader, follower, other;
+	leader.Start(L"http://x.com/a.png");
+	follower.Start(L"http://x.com/a.png");
+	other.Start(L"http://x.com/b.png");
+	CHECK(leader.IsStarted());
+	CHECK(!follower.IsStarted());
+	CHECK(other.IsStarted());
+
+	leader.GetTarget()->DeliverResponse();
+	CHECK(leader.GotBody());
+	CHECK(follower.GotBody());
+	CHECK(follower.m_pClient->m_cReportResult == 1);
+	CHECK(!follower.IsStarted());
+	other.GetTarget()->DeliverResponse();
+	CHECK(other.GotBody());
+
+	RequestCoalescerStatistics after;
+	g_coalescer.GetStatistics(&after);
+	CHECK(after.cLeaders == before.cLeaders + 2);
+	CHECK(after.cFollowers == before.cFollowers + 1);
+}
+
+// The leader is aborted, or terminated, before its first Read
+void CheckLeaderGone(bool bAbort)
+{
+	RequestCoalescerStatistics before;
+	g_coalescer.GetStatistics(&before);
+	Request leader, follower1, follower2;
+	leader.Start(L"http://x.com/c.png");
+	follower1.Start(L"http://x.com/c.png");
+	follower2.Start(L"http://x.com/c.png");
+	if (bAbort)
+	{
+		leader.m_spProtocol->Abort(E_ABORT, 0);
+		CHECK(leader.m_pClient->m_hrResult == E_ABORT);
+	}
+	leader.Terminate();
+
+	CHECK(follower1.IsStarted());
+	CHECK(follower2.IsStarted());
+	follower1.GetTarget()->DeliverResponse();
+	follower2.GetTarget()->DeliverResponse();
+	CHECK(follower1.GotBody());
+	CHECK(follower2.GotBody());
+
+	RequestCoalescerStatistics after;
+	g_coalescer.GetStatistics(&after);
+	CHECK(after.cRestarts == before.cRestarts + 2);
+	CHECK(after.cFailures == before.cFailures);
+}
+
+void CheckLeaderAbortedPartWay()
+{
+	RequestCoalescerStatistics before;
+	g_coalescer.GetStatistics(&before);
+	Request leader, follower1, follower2;
+	leader.Start(L"http://x.com/d.png", szSharedHeaders, 0);
+	follower1.Start(L"http://x.com/d.png");
+	leader.GetTarget()->DeliverResponse();
+	CHECK(leader.Read(700) == S_OK);
+	CHECK(follower1.m_pClient->m_cbReceived == 700);
+	// Joins after the first Read, and is sent the data but doesn't read it
+	follower2.Start(L"http://x.com/d.png", szSharedHeaders, 0);
+	CHECK(follower2.m_pClient->m_cReportData != 0);
+
+	leader.m_spProtocol->Abort(E_ABORT, 0);
+	CHECK(follower1.m_pClient->m_hrResult == INET_E_DOWNLOAD_FAILURE);
+	CHECK(follower2.m_pClient->m_hrResult == INET_E_DOWNLOAD_FAILURE);
+	CHECK(!follower1.IsStarted());
+	CHECK(!follower2.IsStarted());
+	CHECK(follower1.Read(700) == INET_E_DOWNLOAD_FAILURE);
+
+	RequestCoalescerStatistics after;
+	g_coalescer.GetStatistics(&after);
+	CHECK(after.cFailures == before.cFailures + 2);
+	CHECK(after.cRestarts == before.cRestarts);
+}
+
+void CheckFollowerAborted()
+{
+	Request leader, follower1, follower2;
+	leader.Start(L"http://x.com/e.png");
+	follower1.Start(L"http://x.com/e.png");
+	follower2.Start(L"http://x.com/e.png");
+	follower1.m_spProtocol->Abort(E_ABORT, 0);
+	CHECK(follower1.m_pClient->m_hrResult == E_ABORT);
+	CHECK(follower1.m_pClient->m_cReportResult == 1);
+	CHECK(!follower1.IsStarted());
+	follower1.Terminate();
+
+	leader.GetTarget()->DeliverResponse();
+	CHECK(leader.GotBody());
+	CHECK(follower2.GotBody());
+	CHECK(follower1.m_pClient->m_cReportData == 0);
+	CHECK(follower1.m_pClient->m_cReportResult == 1);
+}
+
+// Responses the response cache wouldn't store aren't shared either
+void CheckUnsharable()
+{
+	static const LPCWSTR aszHeaders[] =
+	{
+		L"Cache-Control: no-store\r\n",
+		L"Cache-Control: private\r\n",
+		L"Vary: Cookie\r\n",
+		L"Set-Cookie: id=1\r\n"
+	};
+	for (size_t i = 0; i < sizeof(aszHeaders) / sizeof(aszHeaders[0]); ++i)
+	{
+		Request leader, follower;
+		leader.Start(L"http://x.com/f.png", aszHeaders[i]);
+		follower.Start(L"http://x.com/f.png", aszHeaders[i]);
+		CHECK(!follower.IsStarted());
+		leader.GetTarget()->DeliverResponse();
+		CHECK(leader.GotBody());
+		CHECK(follower.IsStarted());
+		CHECK(follower.m_pClient->m_cReportData == 0);
+		follower.GetTarget()->DeliverResponse();
+		CHECK(follower.GotBody());
+	}
+}
+
+} // end anonymous namespace
+
+int main()
+{
+	for (ULONG i = 0; i < cbBody; ++i)
+	{
+		g_body[i] = static_cast<BYTE>(i * 7 + 3);
+	}
+	CheckShared();
+	CheckLeaderGone(true);
+	CheckLeaderGone(false);
+	CheckLeaderAbortedPartWay();
+	CheckFollowerAborted();
+	CheckUnsharable();
+	return TEST_RESULT();
+}
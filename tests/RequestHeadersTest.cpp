@@ -0,0 +1,271 @@
+// CRequestHeaderSinkWithSP, reached the way the target reaches it, through
+// QueryService(IID_IHttpNegotiate) on the sink: BeginningTransaction adds
+// the headers of the rules that apply after those of the client's
+// IHttpNegotiate, leaves the client's alone when no rule applies or
+// GetRequestHeaderRules returns 0, and passes the client's failures on.
+// A client without an IHttpNegotiate of its own gets the rules' headers
+// alone.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include <string>
+
+#include "ProtocolImpl.h"
+#include "ProtocolCF.h"
+#include "SinkPolicy.h"
+#include "RequestHeaders.h"
+#include "Portable/FakeProtocol.h"
+#include "tests/TestUtil.h"
+
+using namespace PassthroughAPP;
+
+namespace
+{
+
+CRequestHeaderRules* g_pRules = 0;
+
+class CHeaderSink :
+	public CRequestHeaderSinkWithSP<CHeaderSink>
+{
+public:
+	CRequestHeaderRules* GetRequestHeaderRules()
+	{
+		return g_pRules;
+	}
+};
+
+class CHeaderAPP;
+typedef CustomSinkStartPolicy<CHeaderAPP, CHeaderSink> HeaderStartPolicy;
+
+class CHeaderAPP :
+	public CInternetProtocol<HeaderStartPolicy>
+{
+};
+
+// A client that also offers IHttpNegotiate as a service, adding headers
+// of its own
+class ATL_NO_VTABLE CNegotiateClient :
+	public CFakeClientSink,
+	public IHttpNegotiate
+{
+public:
+	CNegotiateClient() :
+		m_szHeaders(0), m_hrBeginning(S_OK), m_cBeginning(0)
+	{
+	}
+
+BEGIN_COM_MAP(CNegotiateClient)
+	COM_INTERFACE_ENTRY(IHttpNegotiate)
+	COM_INTERFACE_ENTRY_CHAIN(CFakeClientSink)
+END_COM_MAP()
+
+	// IServiceProvider
+	STDMETHODIMP QueryService(REFGUID guidService, REFIID riid,
+		void** ppvObject)
+	{
+		if (InlineIsEqualGUID(guidService, IID_IHttpNegotiate))
+		{
+			return _InternalQueryInterface(riid, ppvObject);
+		}
+		return CFakeClientSink::QueryService(guidService, riid, ppvObject);
+	}
+
+	// IHttpNegotiate
+	STDMETHODIMP BeginningTransaction(LPCWSTR szURL, LPCWSTR szHeaders,
+		DWORD, LPWSTR* pszAdditionalHeaders)
+	{
+		++m_cBeginning;
+		m_url = szURL ? szURL : L"";
+		m_requestHeaders = szHeaders ? szHeaders : L"";
+		*pszAdditionalHeaders = 0;
+		if (m_szHeaders)
+		{
+			size_t cb = (wcslen(m_szHeaders) + 1) * sizeof(WCHAR);
+			*pszAdditionalHeaders = static_cast<LPWSTR>(CoTaskMemAlloc(cb));
+			memcpy(*pszAdditionalHeaders, m_szHeaders, cb);
+		}
+		return m_hrBeginning;
+	}
+
+	STDMETHODIMP OnResponse(DWORD, LPCWSTR, LPCWSTR,
+		LPWSTR* pszAdditionalRequestHeaders)
+	{
+		*pszAdditionalRequestHeaders = 0;
+		return S_OK;
+	}
+
+	// What BeginningTransaction adds, 0 for nothing, and returns
+	LPCWSTR m_szHeaders;
+	HRESULT m_hrBeginning;
+
+	LONG m_cBeginning;
+	std::wstring m_url;
+	std::wstring m_requestHeaders;
+};
+
+LPCWSTR const szRequestHeaders = L"Accept: */*\r\n";
+
+// The outcome of BeginningTransaction on the sink of a request to szUrl
+struct Transaction
+{
+	HRESULT hrQueryService;
+	HRESULT hr;
+	bool bHeaders;
+	std::wstring headers;
+};
+
+Transaction Begin(IClassFactory* pCF, IInternetProtocolSink* pClient,
+	LPCWSTR szUrl)
+{
+	Transaction transaction = {E_FAIL, E_FAIL, false, std::wstring()};
+	CComPtr<IInternetProtocol> spProtocol;
+	CHECK(SUCCEEDED(pCF->CreateInstance(0, IID_IInternetProtocol,
+		reinterpret_cast<void**>(&spProtocol))));
+	if (!spProtocol)
+	{
+		return transaction;
+	}
+	CComQIPtr<IInternetBindInfo> spBindInfo(pClient);
+	CHECK(SUCCEEDED(spProtocol->Start(szUrl, pClient, spBindInfo, 0, 0)));
+
+	CHeaderSink* pSink = static_cast<CHeaderAPP*>(spProtocol.p)->GetSink();
+	CComQIPtr<IServiceProvider> spProvider(pSink->GetUnknown());
+	CHECK(spProvider != 0);
+	CComPtr<IHttpNegotiate> spNegotiate;
+	transaction.hrQueryService = spProvider ?
+		spProvider->QueryService(IID_IHttpNegotiate, IID_IHttpNegotiate,
+			reinterpret_cast<void**>(&spNegotiate)) :
+		E_NOINTERFACE;
+	if (spNegotiate)
+	{
+		CHECK(spNegotiate == static_cast<IHttpNegotiate*>(pSink));
+		LPWSTR szHeaders = 0;
+		transaction.hr = spNegotiate->BeginningTransaction(szUrl,
+			szRequestHeaders, 0, &szHeaders);
+		transaction.bHeaders = szHeaders != 0;
+		if (szHeaders)
+		{
+			transaction.headers = szHeaders;
+			CoTaskMemFree(szHeaders);
+		}
+	}
+	spProtocol->Terminate(0);
+	return transaction;
+}
+
+void CheckHeaders(const Transaction& transaction, LPCWSTR szHeaders)
+{
+	CHECK(transaction.hrQueryService == S_OK);
+	CHECK(transaction.hr == S_OK);
+	CHECK(transaction.bHeaders == (szHeaders != 0));
+	CHECK(transaction.headers == (szHeaders ? szHeaders : L""));
+}
+
+void CheckRules(IClassFactory* pCF)
+{
+	CRequestHeaderRules rules;
+	CHECK(rules.AddHeader(L"DNT", L"1") == S_OK);
+	CHECK(rules.AddHostHeader(L"example.com", L"X-Client-Id", L"1234") ==
+		S_OK);
+	CHECK(rules.AddUrlPrefixHeader(L"http://example.com/api/",
+		L"X-Api-Version", L"2") == S_OK);
+	g_pRules = &rules;
+
+	CComObject<CNegotiateClient>* pClient = 0;
+	CComObject<CNegotiateClient>::CreateInstance(&pClient);
+	CComPtr<IInternetProtocolSink> spClient = pClient;
+
+	// After the client's, which gets the request as it was
+	pClient->m_szHeaders = L"X-Client: a\r\n";
+	CheckHeaders(Begin(pCF, spClient, L"http://www.example.com/"),
+		L"X-Client: a\r\nDNT: 1\r\nX-Client-Id: 1234\r\n");
+	CHECK(pClient->m_cBeginning == 1);
+	CHECK(pClient->m_url == L"http://www.example.com/");
+	CHECK(pClient->m_requestHeaders == szRequestHeaders);
+	CheckHeaders(Begin(pCF, spClient, L"http://example.com/api/list"),
+		L"X-Client: a\r\nDNT: 1\r\nX-Client-Id: 1234\r\n"
+		L"X-Api-Version: 2\r\n");
+	CheckHeaders(Begin(pCF, spClient, L"http://other.com/api/"),
+		L"X-Client: a\r\nDNT: 1\r\n");
+
+	// The client's line gets its line break
+	pClient->m_szHeaders = L"X-Client: a";
+	CheckHeaders(Begin(pCF, spClient, L"http://other.com/"),
+		L"X-Client: a\r\nDNT: 1\r\n");
+
+	// Only ours
+	pClient->m_szHeaders = 0;
+	CheckHeaders(Begin(pCF, spClient, L"http://other.com/"), L"DNT: 1\r\n");
+
+	// No rules, the client's headers as they were, or none
+	g_pRules = 0;
+	CheckHeaders(Begin(pCF, spClient, L"http://example.com/api/"), 0);
+	pClient->m_szHeaders = L"X-Client: a";
+	CheckHeaders(Begin(pCF, spClient, L"http://example.com/api/"),
+		L"X-Client: a");
+	CHECK(pClient->m_cBeginning == 7);
+
+	// A client failing fails the transaction
+	g_pRules = &rules;
+	pClient->m_hrBeginning = E_ABORT;
+	Transaction transaction = Begin(pCF, spClient, L"http://example.com/");
+	CHECK(transaction.hrQueryService == S_OK);
+	CHECK(transaction.hr == E_ABORT);
+	CHECK(!transaction.bHeaders);
+	CHECK(pClient->m_cBeginning == 8);
+
+	RequestHeaderStatistics stats;
+	rules.GetStatistics(&stats);
+	CHECK(stats.cRenders == 5);
+	CHECK(stats.cOriginHits == 2);
+	CHECK(stats.cOrigins == 3);
+	g_pRules = 0;
+}
+
+void CheckRulesOnly(IClassFactory* pCF)
+{
+	CRequestHeaderRules rules;
+	CHECK(rules.AddHostHeader(L"example.com", L"X-Client-Id", L"1234") ==
+		S_OK);
+	g_pRules = &rules;
+
+	CComObject<CNegotiateClient>* pClient = 0;
+	CComObject<CNegotiateClient>::CreateInstance(&pClient);
+	CComPtr<IInternetProtocolSink> spClient = pClient;
+	CheckHeaders(Begin(pCF, spClient, L"http://example.com/"),
+		L"X-Client-Id: 1234\r\n");
+	// No rule applies
+	CheckHeaders(Begin(pCF, spClient, L"http://other.com/"), 0);
+
+	// A client without IHttpNegotiate
+	CComObject<CFakeClientSink>* pPlainClient = 0;
+	CComObject<CFakeClientSink>::CreateInstance(&pPlainClient);
+	CComPtr<IInternetProtocolSink> spPlainClient = pPlainClient;
+	CheckHeaders(Begin(pCF, spPlainClient, L"http://example.com/"),
+		L"X-Client-Id: 1234\r\n");
+	CheckHeaders(Begin(pCF, spPlainClient, L"http://other.com/"), 0);
+	g_pRules = 0;
+	CheckHeaders(Begin(pCF, spPlainClient, L"http://example.com/"), 0);
+}
+
+} // end anonymous namespace
+
+int main()
+{
+	FakeResponse response;
+	CComObject<CFakeTargetClassFactory>* pTargetCF = 0;
+	CHECK(SUCCEEDED(CFakeTargetClassFactory::Create(response, &pTargetCF)));
+	CComPtr<IClassFactory> spTargetCF = pTargetCF;
+	typedef CMetaFactory<CComClassFactoryProtocol, CHeaderAPP> MetaFactory;
+	CComPtr<IClassFactory> spCF;
+	CHECK(SUCCEEDED(MetaFactory::CreateInstance(spTargetCF, &spCF)));
+	if (!spCF)
+	{
+		return TEST_RESULT();
+	}
+
+	CheckRules(spCF);
+	CheckRulesOnly(spCF);
+	return TEST_RESULT();
+}
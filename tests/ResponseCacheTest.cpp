@@ -0,0 +1,266 @@
+// What ResponseCacheStartPolicy stores, and for how long: Cache-Control,
+// Expires and date parsing, the responses the cache refuses, requests that
+// skip the lookup, and entries that expire.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include <chrono>
+#include <thread>
+
+#include "ProtocolImpl.h"
+#include "ProtocolCF.h"
+#include "SinkPolicy.h"
+#include "Portable/FakeProtocol.h"
+#include "tests/TestUtil.h"
+
+using namespace PassthroughAPP;
+
+namespace
+{
+
+CResponseCache g_cache;
+
+class CCacheAPP;
+typedef ResponseCacheStartPolicy<CCacheAPP> CachePolicy;
+
+class CCacheAPP :
+	public CInternetProtocol<CachePolicy>
+{
+public:
+	CResponseCache* GetResponseCache() const
+	{
+		return &g_cache;
+	}
+};
+
+typedef CMetaFactory<CComClassFactoryProtocol, CCacheAPP> MetaFactory;
+
+const ULONGLONG ullSecond = 10000000;
+
+BYTE g_body[1000];
+
+Detail::CacheControl ParseCacheControl(LPCWSTR sz)
+{
+	Detail::CacheControl cacheControl = {0, 0};
+	Detail::ParseCacheControl(sz, static_cast<ULONG>(wcslen(sz)),
+		&cacheControl);
+	return cacheControl;
+}
+
+ULONGLONG ParseDate(LPCWSTR sz)
+{
+	ULONGLONG ullTime = 0;
+	CHECK(Detail::ParseHttpDate(sz, static_cast<ULONG>(wcslen(sz)),
+		&ullTime));
+	return ullTime;
+}
+
+ULONG GetLifetime(LPCWSTR szHeaders, ULONGLONG ullNow)
+{
+	CHttpHeaderView headers;
+	CHECK(headers.Parse(szHeaders) == S_OK);
+	return Detail::GetFreshnessLifetime(headers, ullNow);
+}
+
+bool IsSharable(LPCWSTR szHeaders)
+{
+	CHttpHeaderView headers;
+	CHECK(headers.Parse(szHeaders) == S_OK);
+	return Detail::IsSharableResponse(headers);
+}
+
+void CheckCacheControl()
+{
+	Detail::CacheControl cacheControl =
+		ParseCacheControl(L"No-Cache=\"Set-Cookie, X\", max-age=60");
+	CHECK(cacheControl.grfDirectives ==
+		(Detail::cacheControlNoCache | Detail::cacheControlMaxAge));
+	CHECK(cacheControl.nMaxAge == 60);
+
+	cacheControl = ParseCacheControl(L"max-age=600 , MAX-AGE=\"60\"");
+	CHECK(cacheControl.grfDirectives == Detail::cacheControlMaxAge);
+	CHECK(cacheControl.nMaxAge == 60);
+
+	cacheControl = ParseCacheControl(L"max-age=soon");
+	CHECK(cacheControl.grfDirectives == Detail::cacheControlMaxAge);
+	CHECK(cacheControl.nMaxAge == 0);
+
+	// Directives for shared caches, and unknown ones, are skipped
+	cacheControl = ParseCacheControl(L"public, s-maxage=5, x-no-store");
+	CHECK(cacheControl.grfDirectives == 0);
+
+	cacheControl = ParseCacheControl(L"private,no-store");
+	CHECK(cacheControl.grfDirectives ==
+		(Detail::cacheControlPrivate | Detail::cacheControlNoStore));
+}
+
+void CheckDates()
+{
+	ULONGLONG ullTime = ParseDate(L"Sun, 06 Nov 1994 08:49:37 GMT");
+	CHECK(ullTime != 0);
+	CHECK(ParseDate(L"Sunday, 06-Nov-94 08:49:37 GMT") == ullTime);
+	CHECK(ParseDate(L"Sun Nov  6 08:49:37 1994") == ullTime);
+	CHECK(ParseDate(L"Sun, 06 Nov 1994 08:49:38 GMT") == ullTime + ullSecond);
+	CHECK(ParseDate(L"Mon, 07 Nov 1994 08:49:37 GMT") ==
+		ullTime + 24 * 60 * 60 * ullSecond);
+
+	ULONGLONG ullUnused = 0;
+	CHECK(!Detail::ParseHttpDate(L"0", 1, &ullUnused));
+	CHECK(!Detail::ParseHttpDate(L"-1", 2, &ullUnused));
+	CHECK(!Detail::ParseHttpDate(L"Sun, 31 Feb 1994 08:49:37 GMT", 29,
+		&ullUnused));
+	CHECK(!Detail::ParseHttpDate(L"Thu, 29 Feb 1900 08:49:37 GMT", 29,
+		&ullUnused));
+	CHECK(Detail::ParseHttpDate(L"Tue, 29 Feb 2000 08:49:37 GMT", 29,
+		&ullUnused));
+}
+
+void CheckFreshness()
+{
+	ULONGLONG ullDate = ParseDate(L"Sun, 06 Nov 1994 08:49:37 GMT");
+	ULONGLONG ullNow = ullDate + 100 * ullSecond;
+
+	// max-age wins over Expires, and the time since Date counts as age
+	CHECK(GetLifetime(L"Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+		L"Cache-Control: max-age=600\r\n"
+		L"Expires: Sun, 06 Nov 1994 09:49:37 GMT\r\n", ullNow) == 500);
+	CHECK(GetLifetime(L"Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+		L"Expires: Sun, 06 Nov 1994 09:49:37 GMT\r\n", ullNow) == 3500);
+	// An Age larger than the time since Date counts instead
+	CHECK(GetLifetime(L"Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+		L"Age: 1000\r\n"
+		L"Expires: Sun, 06 Nov 1994 09:49:37 GMT\r\n", ullNow) == 2600);
+	CHECK(GetLifetime(L"Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+		L"Expires: 0\r\n", ullNow) == 0);
+	// A tenth of the time since Last-Modified
+	CHECK(GetLifetime(L"Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+		L"Last-Modified: Sat, 05 Nov 1994 08:49:37 GMT\r\n", ullNow) ==
+		8640 - 100);
+	CHECK(GetLifetime(L"Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+		L"Last-Modified: Sun, 06 Nov 1984 08:49:37 GMT\r\n", ullNow) ==
+		86400 - 100);
+	CHECK(GetLifetime(L"Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+		L"Content-Type: text/css\r\n", ullNow) == 0);
+}
+
+void CheckSharable()
+{
+	CHECK(IsSharable(L"Cache-Control: public, max-age=60\r\n"));
+	CHECK(!IsSharable(L"Cache-Control: max-age=60\r\n"
+		L"Vary: Accept-Encoding\r\n"));
+	CHECK(!IsSharable(L"Cache-Control: max-age=60\r\n"
+		L"Set-Cookie: a=b\r\n"));
+	CHECK(!IsSharable(L"Cache-Control: private, max-age=60\r\n"));
+	CHECK(!IsSharable(L"Cache-Control: no-cache\r\n"));
+	CHECK(!IsSharable(L"Pragma: no-cache\r\n"));
+	// Pragma only counts without Cache-Control
+	CHECK(IsSharable(L"Cache-Control: max-age=60\r\n"
+		L"Pragma: no-cache\r\n"));
+}
+
+// Reads szUrl through a CCacheAPP whose target answers with szHeaders.
+// Returns the number of targets created, 0 if the cache answered
+LONG Request(LPCWSTR szUrl, LPCWSTR szHeaders, DWORD grfBINDF = 0)
+{
+	FakeResponse response;
+	response.pbBody = g_body;
+	response.cbBody = sizeof(g_body);
+	response.szHeaders = szHeaders;
+	CComObject<CFakeTargetClassFactory>* pTargetCF = 0;
+	CHECK(SUCCEEDED(CFakeTargetClassFactory::Create(response, &pTargetCF)));
+	CComPtr<IClassFactory> spTargetCF = pTargetCF;
+
+	CComClassFactoryProtocol* pFactory = 0;
+	CHECK(SUCCEEDED(MetaFactory::CreateInstance(&pFactory)));
+	CComPtr<IClassFactory> spCF = pFactory;
+	pFactory->SetTargetClassFactory(spTargetCF);
+	pFactory->SetDeferTargetCreation(true);
+
+	CComPtr<IInternetProtocol> spProtocol;
+	CHECK(SUCCEEDED(spCF->CreateInstance(0, IID_IInternetProtocol,
+		reinterpret_cast<void**>(&spProtocol))));
+	if (!spProtocol)
+	{
+		return -1;
+	}
+	CComObject<CFakeClientSink>* pClient = 0;
+	CComObject<CFakeClientSink>::CreateInstance(&pClient);
+	CComPtr<IInternetProtocolSink> spClient = pClient;
+	pClient->SetProtocol(spProtocol);
+	pClient->SetBindInfo(BINDF_ASYNCHRONOUS | grfBINDF, BINDVERB_GET);
+	CComQIPtr<IInternetBindInfo> spBindInfo(spClient);
+	CHECK(spProtocol->Start(szUrl, spClient, spBindInfo, 0, 0) == S_OK);
+	CHECK(pClient->m_hrResult == S_OK);
+	CHECK(pClient->m_cbReceived == sizeof(g_body));
+	CHECK(pClient->m_dwBodyHash ==
+		CFakeClientSink::HashBytes(g_body, sizeof(g_body)));
+	spProtocol->Terminate(0);
+	pClient->SetProtocol(0);
+	return pTargetCF->m_cCreateInstance;
+}
+
+void CheckStored()
+{
+	g_cache.Clear();
+	CHECK(Request(L"http://x.com/a", L"Cache-Control: max-age=3600\r\n") == 1);
+	CHECK(Request(L"http://x.com/a", 0) == 0);
+
+	// A request that needs a file skips the lookup, but refreshes the entry
+	CHECK(Request(L"http://x.com/a", L"Cache-Control: max-age=3600\r\n",
+		BINDF_NEEDFILE) == 1);
+	CHECK(Request(L"http://x.com/a", 0) == 0);
+
+	static const LPCWSTR aszRefused[] =
+	{
+		L"Cache-Control: private, max-age=3600\r\n",
+		L"Cache-Control: max-age=3600\r\nVary: Cookie\r\n",
+		L"Cache-Control: max-age=3600\r\nSet-Cookie: id=1\r\n",
+		L"Cache-Control: no-cache, max-age=3600\r\n",
+		L"Cache-Control: max-age=0\r\n",
+		L"Content-Type: text/css\r\n"
+	};
+	for (size_t i = 0; i < sizeof(aszRefused) / sizeof(aszRefused[0]); ++i)
+	{
+		CHECK(Request(L"http://x.com/b", aszRefused[i]) == 1);
+		CHECK(Request(L"http://x.com/b", aszRefused[i]) == 1);
+	}
+}
+
+void CheckExpiry()
+{
+	g_cache.Clear();
+	ResponseCacheStatistics before;
+	g_cache.GetStatistics(&before);
+	CHECK(g_cache.Insert(L"http://x.com/c", L"text/css", L"", g_body,
+		sizeof(g_body), 0) == S_FALSE);
+	CHECK(g_cache.Insert(L"http://x.com/c", L"text/css", L"", g_body,
+		sizeof(g_body), 1) == S_OK);
+	CComPtr<CResponseCacheEntry> spEntry;
+	CHECK(g_cache.Lookup(L"http://x.com/c", &spEntry) == S_OK);
+	spEntry.Release();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+	CHECK(g_cache.Lookup(L"http://x.com/c", &spEntry) == S_FALSE);
+	ResponseCacheStatistics after;
+	g_cache.GetStatistics(&after);
+	CHECK(after.cExpirations == before.cExpirations + 1);
+	CHECK(after.cEntries == 0);
+}
+
+} // end anonymous namespace
+
+int main()
+{
+	for (size_t i = 0; i < sizeof(g_body); ++i)
+	{
+		g_body[i] = static_cast<BYTE>(i * 7 + 3);
+	}
+	CheckCacheControl();
+	CheckDates();
+	CheckFreshness();
+	CheckSharable();
+	CheckStored();
+	CheckExpiry();
+	return TEST_RESULT();
+}
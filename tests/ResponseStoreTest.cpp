@@ -0,0 +1,218 @@
+// CResponseStore compacts segments and saves its index in the background:
+// Insert returns without doing either, compaction keeps every record
+// readable, the index saved after enough insertions is found by another
+// store, and Close waits for work still queued.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include <dirent.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "ResponseCache.h"
+#include "tests/TestUtil.h"
+
+using namespace PassthroughAPP;
+
+namespace
+{
+
+const int cUrls = 10;
+const ULONG cbBody = 500;
+
+std::wstring GetUrl(int iUrl)
+{
+	WCHAR szUrl[32];
+	swprintf(szUrl, sizeof(szUrl) / sizeof(szUrl[0]), L"http://x.com/%d",
+		iUrl);
+	return szUrl;
+}
+
+void FillBody(BYTE* pbBody, int iUrl, int iVersion)
+{
+	for (ULONG i = 0; i < cbBody; ++i)
+	{
+		pbBody[i] = static_cast<BYTE>(iUrl * 31 + iVersion * 7 + i);
+	}
+}
+
+bool Insert(CResponseStore* pStore, int iUrl, int iVersion)
+{
+	BYTE body[cbBody];
+	FillBody(body, iUrl, iVersion);
+	return pStore->Insert(GetUrl(iUrl).c_str(), L"text/css", 0, body,
+		cbBody, ~0ULL) == S_OK;
+}
+
+bool IsStored(CResponseStore* pStore, int iUrl, int iVersion)
+{
+	CComPtr<CResponseCacheEntry> spEntry;
+	if (pStore->Lookup(GetUrl(iUrl).c_str(), &spEntry) != S_OK)
+	{
+		return false;
+	}
+	BYTE body[cbBody];
+	FillBody(body, iUrl, iVersion);
+	return spEntry->GetBodySize() == cbBody &&
+		memcmp(spEntry->GetBody(), body, cbBody) == 0;
+}
+
+// Waits up to 5 seconds for fn to return true
+template <class Fn>
+bool WaitFor(Fn fn)
+{
+	for (int i = 0; i < 500; ++i)
+	{
+		if (fn())
+		{
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return false;
+}
+
+LONG GetCompactions(CResponseStore* pStore)
+{
+	ResponseStoreStatistics stats;
+	pStore->GetStatistics(&stats);
+	return stats.cCompactions;
+}
+
+void CheckCompaction(LPCWSTR szDirectory)
+{
+	CResponseStore store;
+	CHECK(store.Open(szDirectory) == S_OK);
+	store.SetMaxSegmentSize(8 * 1024);
+	store.SetFlushThreshold(0);
+
+	// Replacing the records leaves the sealed segments mostly dead
+	for (int iVersion = 0; iVersion < 8; ++iVersion)
+	{
+		for (int iUrl = 0; iUrl < cUrls; ++iUrl)
+		{
+			CHECK(Insert(&store, iUrl, iVersion));
+		}
+	}
+	CHECK(WaitFor([&]() {return GetCompactions(&store) > 0;}));
+
+	// Lookups and insertions go on while segments are compacted
+	for (int iVersion = 8; iVersion < 40; ++iVersion)
+	{
+		for (int iUrl = 0; iUrl < cUrls; ++iUrl)
+		{
+			CHECK(Insert(&store, iUrl, iVersion));
+			CHECK(IsStored(&store, iUrl, iVersion));
+		}
+	}
+	CHECK(store.Compact() == S_OK);
+	for (int iUrl = 0; iUrl < cUrls; ++iUrl)
+	{
+		CHECK(IsStored(&store, iUrl, 39));
+	}
+	ResponseStoreStatistics stats;
+	store.GetStatistics(&stats);
+	CHECK(stats.cEntries == cUrls);
+	CHECK(stats.cbLive * 2 + 8 * 1024 >= stats.cbUsed);
+	store.Close();
+
+	CHECK(store.Open(szDirectory) == S_OK);
+	for (int iUrl = 0; iUrl < cUrls; ++iUrl)
+	{
+		CHECK(IsStored(&store, iUrl, 39));
+	}
+}
+
+void CheckFlush(LPCWSTR szDirectory)
+{
+	CResponseStore store;
+	CHECK(store.Open(szDirectory) == S_OK);
+	store.SetFlushThreshold(cUrls);
+	for (int iUrl = 0; iUrl < cUrls; ++iUrl)
+	{
+		CHECK(Insert(&store, iUrl, 100));
+	}
+
+	// Another store finds the records without Flush being called
+	CHECK(WaitFor([&]()
+	{
+		CResponseStore other;
+		if (other.Open(szDirectory) != S_OK)
+		{
+			return false;
+		}
+		for (int iUrl = 0; iUrl < cUrls; ++iUrl)
+		{
+			if (!IsStored(&other, iUrl, 100))
+			{
+				return false;
+			}
+		}
+		return true;
+	}));
+}
+
+void CheckClose(LPCWSTR szDirectory)
+{
+	// Closed and destroyed with maintenance queued
+	for (int i = 0; i < 20; ++i)
+	{
+		CResponseStore store;
+		CHECK(store.Open(szDirectory) == S_OK);
+		store.SetMaxSegmentSize(4 * 1024);
+		store.SetFlushThreshold(1);
+		for (int iUrl = 0; iUrl < cUrls; ++iUrl)
+		{
+			CHECK(Insert(&store, iUrl, i));
+		}
+	}
+
+	CResponseStore store;
+	CHECK(store.Open(szDirectory) == S_OK);
+	for (int iUrl = 0; iUrl < cUrls; ++iUrl)
+	{
+		CHECK(IsStored(&store, iUrl, 19));
+	}
+}
+
+void RemoveDirectory(const char* szDirectory)
+{
+	DIR* pDir = opendir(szDirectory);
+	if (!pDir)
+	{
+		return;
+	}
+	while (dirent* pEntry = readdir(pDir))
+	{
+		if (pEntry->d_name[0] != '.')
+		{
+			std::string path = std::string(szDirectory) + "/" +
+				pEntry->d_name;
+			unlink(path.c_str());
+		}
+	}
+	closedir(pDir);
+	rmdir(szDirectory);
+}
+
+} // end anonymous namespace
+
+int main()
+{
+	char szCompaction[] = "/tmp/ResponseStoreTestXXXXXX";
+	char szFlush[] = "/tmp/ResponseStoreTestXXXXXX";
+	CHECK(mkdtemp(szCompaction) != 0 && mkdtemp(szFlush) != 0);
+
+	std::wstring directory(szCompaction, szCompaction + strlen(szCompaction));
+	CheckCompaction(directory.c_str());
+	directory.assign(szFlush, szFlush + strlen(szFlush));
+	CheckFlush(directory.c_str());
+	CheckClose(directory.c_str());
+
+	RemoveDirectory(szCompaction);
+	RemoveDirectory(szFlush);
+	return TEST_RESULT();
+}
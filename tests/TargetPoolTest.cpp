@@ -0,0 +1,97 @@
+// CComClassFactoryProtocol's target pool refills itself on a work item,
+// which keeps the module locked while it runs, and tops the pool up
+// again after targets are taken, however that interleaves with the
+// refill.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include <chrono>
+#include <thread>
+
+#include "ProtocolImpl.h"
+#include "ProtocolCF.h"
+#include "Portable/FakeProtocol.h"
+#include "tests/TestUtil.h"
+
+using namespace PassthroughAPP;
+
+namespace
+{
+
+class CPlainAPP :
+	public CInternetProtocol<NoSinkStartPolicy>
+{
+};
+
+const LONG cPoolSize = 4;
+
+// Waits up to a few seconds for the pool to fill up and the work item to
+// finish, which it does once the module lock count is back to lLocks plus
+// those of the pooled targets
+bool WaitForRefill(CComClassFactoryProtocol* pFactory, LONG lLocks)
+{
+	for (int i = 0; i < 5000; ++i)
+	{
+		TargetPoolStatistics stats;
+		pFactory->GetTargetPoolStatistics(&stats);
+		if (stats.cPooled == cPoolSize &&
+			_pAtlModule->GetLockCount() == lLocks + cPoolSize)
+		{
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return false;
+}
+
+} // end anonymous namespace
+
+int main()
+{
+	FakeResponse response;
+	CComObject<CFakeTargetClassFactory>* pTargetCF = 0;
+	CHECK(SUCCEEDED(CFakeTargetClassFactory::Create(response, &pTargetCF)));
+	CComPtr<IClassFactory> spTargetCF = pTargetCF;
+
+	CComClassFactoryProtocol* pFactory = 0;
+	CHECK(SUCCEEDED((CMetaFactory<CComClassFactoryProtocol, CPlainAPP>::
+		CreateInstance(&pFactory))));
+	if (!pFactory)
+	{
+		return TEST_RESULT();
+	}
+	CComPtr<IClassFactory> spCF = pFactory;
+	CHECK(SUCCEEDED(pFactory->SetTargetClassFactory(spTargetCF)));
+
+	LONG lLocks = _pAtlModule->GetLockCount();
+	CHECK(SUCCEEDED(pFactory->SetTargetPoolSize(cPoolSize)));
+	CHECK(WaitForRefill(pFactory, lLocks));
+	CHECK(pTargetCF->m_cCreateInstance == cPoolSize);
+
+	// Every target taken gets replaced, including those taken while a
+	// refill is finishing
+	for (int i = 0; i < 200; ++i)
+	{
+		CComPtr<IInternetProtocol> spProtocol;
+		CHECK(SUCCEEDED(spCF->CreateInstance(0, IID_IInternetProtocol,
+			reinterpret_cast<void**>(&spProtocol))));
+		if (i % 10 == 0)
+		{
+			spProtocol.Release();
+			CHECK(WaitForRefill(pFactory, lLocks));
+		}
+	}
+	CHECK(WaitForRefill(pFactory, lLocks));
+
+	TargetPoolStatistics stats;
+	pFactory->GetTargetPoolStatistics(&stats);
+	CHECK(stats.cHits + stats.cMisses == 200);
+	CHECK(pTargetCF->m_cCreateInstance ==
+		cPoolSize + stats.cHits + stats.cMisses);
+
+	CHECK(SUCCEEDED(pFactory->SetTargetPoolSize(0)));
+	pFactory->GetTargetPoolStatistics(&stats);
+	CHECK(stats.cPooled == 0);
+	return TEST_RESULT();
+}
@@ -0,0 +1,46 @@
+#ifndef PASSTHROUGHAPP_TESTS_TESTUTIL_H
+#define PASSTHROUGHAPP_TESTS_TESTUTIL_H
+
+#if _MSC_VER > 1000
+	#pragma once
+#endif // _MSC_VER > 1000
+
+// A test reports each failed CHECK and returns TEST_RESULT() from main,
+// which is non-zero if any failed
+
+#include <stdio.h>
+
+namespace PassthroughAPP
+{
+
+namespace Test
+{
+
+inline int& GetFailureCount()
+{
+	static int cFailures = 0;
+	return cFailures;
+}
+
+} // end namespace PassthroughAPP::Test
+
+} // end namespace PassthroughAPP
+
+#define CHECK(expr) \
+	do \
+	{ \
+		if (!(expr)) \
+		{ \
+			printf("%s(%d): CHECK(%s) failed\n", __FILE__, __LINE__, #expr); \
+			++::PassthroughAPP::Test::GetFailureCount(); \
+		} \
+	} \
+	while (0)
+
+#define TEST_RESULT() \
+	(printf(::PassthroughAPP::Test::GetFailureCount() ? \
+		"%d check(s) failed\n" : "OK\n", \
+		::PassthroughAPP::Test::GetFailureCount()), \
+	::PassthroughAPP::Test::GetFailureCount() != 0)
+
+#endif // PASSTHROUGHAPP_TESTS_TESTUTIL_H
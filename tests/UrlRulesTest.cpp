@@ -0,0 +1,782 @@
+// CUrlRuleSet matching: host rules match the host and its subdomains on
+// label boundaries, substring rules match anywhere in the URL, including
+// patterns that end inside longer ones, and when several rules match, the
+// strongest action wins, then the rule added first, whatever their kind.
+// Matching a URL and matching its IUri agree.
+//
+// Images: a saved image maps back and matches the same, and images with a
+// damaged header, sections out of range or a truncated file are refused.
+// Damaged nodes and edges within a valid header only change what matches.
+//
+// CUrlRuleStore: a snapshot keeps matching against the rule set it was
+// taken of after a newer one is published, and a replaced rule set is
+// reclaimed once its last snapshot is released, also while other threads
+// take and release snapshots throughout.
+//
+// The host prefilter never turns away a host a rule matches, at any false
+// positive rate, and doesn't change what matches. UrlRulesTestStatistics
+// is the same program built with PASSTHROUGHAPP_URLRULE_STATISTICS, and
+// also checks the counts of lookups it avoided.
+
+#include <atlbase.h>
+#include <atlcom.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "UrlRules.h"
+#include "tests/TestUtil.h"
+
+using namespace PassthroughAPP;
+
+namespace
+{
+
+// Checks that szUrl matches dwAction with dwData, through both overloads
+void CheckMatch(const CUrlRuleSet& ruleSet, LPCWSTR szUrl, DWORD dwAction,
+	DWORD dwData)
+{
+	UrlRuleMatch match = {0, 0};
+	CHECK(ruleSet.Match(szUrl, &match) == S_OK);
+	CHECK(match.dwAction == dwAction);
+	CHECK(match.dwData == dwData);
+
+	CComPtr<IUri> spUri;
+	CHECK(SUCCEEDED(CreateUri(szUrl, 0, 0, &spUri)));
+	if (!spUri)
+	{
+		return;
+	}
+	UrlRuleMatch uriMatch = {0, 0};
+	CHECK(ruleSet.Match(spUri, &uriMatch) == S_OK);
+	CHECK(uriMatch.dwAction == dwAction);
+	CHECK(uriMatch.dwData == dwData);
+}
+
+void CheckNoMatch(const CUrlRuleSet& ruleSet, LPCWSTR szUrl)
+{
+	UrlRuleMatch match = {0, 0};
+	CHECK(ruleSet.Match(szUrl, &match) == S_FALSE);
+
+	CComPtr<IUri> spUri;
+	CHECK(SUCCEEDED(CreateUri(szUrl, 0, 0, &spUri)));
+	if (spUri)
+	{
+		CHECK(ruleSet.Match(spUri, &match) == S_FALSE);
+	}
+}
+
+void CheckHostRules()
+{
+	CUrlRuleSetBuilder builder;
+	CHECK(builder.AddHostRule(L"example.com", UrlRuleBlock, 1) == S_OK);
+	CHECK(builder.AddHostRule(L"*.Tracker.NET", UrlRuleBlock, 2) == S_OK);
+	CHECK(builder.AddHostRule(L".cdn.org", UrlRuleRedirect, 3) == S_OK);
+	CUrlRuleSet ruleSet;
+	CHECK(builder.Build(&ruleSet) == S_OK);
+
+	// The host itself and its subdomains, in any case, whatever the port
+	// or user info
+	CheckMatch(ruleSet, L"http://example.com/", UrlRuleBlock, 1);
+	CheckMatch(ruleSet, L"https://ads.EXAMPLE.com/a.js", UrlRuleBlock, 1);
+	CheckMatch(ruleSet, L"http://user@a.b.example.com:8080/", UrlRuleBlock,
+		1);
+	CheckMatch(ruleSet, L"http://tracker.net/pixel", UrlRuleBlock, 2);
+	CheckMatch(ruleSet, L"http://x.tracker.net", UrlRuleBlock, 2);
+	CheckMatch(ruleSet, L"http://img.cdn.org/a.png", UrlRuleRedirect, 3);
+
+	// Only on label boundaries, and only in the host
+	CheckNoMatch(ruleSet, L"http://badexample.com/");
+	CheckNoMatch(ruleSet, L"http://example.com.evil.net/");
+	CheckNoMatch(ruleSet, L"http://example.co/");
+	CheckNoMatch(ruleSet, L"http://other.net/example.com");
+	CheckNoMatch(ruleSet, L"http://other.net/?u=http://example.com/");
+}
+
+void CheckSubstringRules()
+{
+	CUrlRuleSetBuilder builder;
+	CHECK(builder.AddSubstringRule(L"/banner/", UrlRuleBlock, 1) == S_OK);
+	// Ends inside the next one, found through a failure link
+	CHECK(builder.AddSubstringRule(L"ad.js", UrlRuleBlock, 2) == S_OK);
+	CHECK(builder.AddSubstringRule(L"/load.json", UrlRuleAllow, 3) == S_OK);
+	CHECK(builder.AddSubstringRule(L"?UTM_", UrlRuleRedirect, 4) == S_OK);
+	CUrlRuleSet ruleSet;
+	CHECK(builder.Build(&ruleSet) == S_OK);
+
+	CheckMatch(ruleSet, L"http://a.com/x/banner/1.gif", UrlRuleBlock, 1);
+	CheckMatch(ruleSet, L"http://a.com/lib/ad.js", UrlRuleBlock, 2);
+	CheckMatch(ruleSet, L"http://a.com/lib/bad.jsx", UrlRuleBlock, 2);
+	CheckMatch(ruleSet, L"http://a.com/p?utm_source=x", UrlRuleRedirect, 4);
+	// "/load.json" contains "ad.js", the allow rule wins
+	CheckMatch(ruleSet, L"http://a.com/load.json", UrlRuleAllow, 3);
+	// Patterns can match in the host too
+	CheckMatch(ruleSet, L"http://ad.jsdelivr.net/", UrlRuleBlock, 2);
+
+	CheckNoMatch(ruleSet, L"http://a.com/banner");
+	CheckNoMatch(ruleSet, L"http://a.com/ad_js");
+	CheckNoMatch(ruleSet, L"http://a.com/loa/d.json");
+}
+
+// The strongest action wins regardless of which rule is more specific or
+// which kind it is; between equal actions, the rule added first
+void CheckPrecedence()
+{
+	CUrlRuleSetBuilder builder;
+	CHECK(builder.AddHostRule(L"ads.example.com", UrlRuleBlock, 1) == S_OK);
+	CHECK(builder.AddHostRule(L"example.com", UrlRuleAllow, 2) == S_OK);
+	CHECK(builder.AddHostRule(L"tracker.net", UrlRuleBlock, 3) == S_OK);
+	CHECK(builder.AddHostRule(L"pixel.tracker.net", UrlRuleBlock, 4) ==
+		S_OK);
+	CHECK(builder.AddHostRule(L"cdn.org", UrlRuleBlock, 5) == S_OK);
+	CHECK(builder.AddSubstringRule(L"/redirect/", UrlRuleRedirect, 6) ==
+		S_OK);
+	CHECK(builder.AddSubstringRule(L"/track", UrlRuleBlock, 7) == S_OK);
+	CHECK(builder.AddSubstringRule(L"/whitelisted/", UrlRuleAllow, 8) ==
+		S_OK);
+	CHECK(builder.AddHostRule(L"redirect.com", UrlRuleRedirect, 9) == S_OK);
+	CUrlRuleSet ruleSet;
+	CHECK(builder.Build(&ruleSet) == S_OK);
+
+	// A parent host's allow beats a subdomain's block
+	CheckMatch(ruleSet, L"http://ads.example.com/", UrlRuleAllow, 2);
+	// Two blocks, the parent host was added first
+	CheckMatch(ruleSet, L"http://pixel.tracker.net/", UrlRuleBlock, 3);
+	// Host and substring rules compete on the same terms
+	CheckMatch(ruleSet, L"http://cdn.org/redirect/x", UrlRuleRedirect, 6);
+	CheckMatch(ruleSet, L"http://cdn.org/whitelisted/x", UrlRuleAllow, 8);
+	CheckMatch(ruleSet, L"http://example.com/track", UrlRuleAllow, 2);
+	CheckMatch(ruleSet, L"http://other.com/track", UrlRuleBlock, 7);
+	CheckMatch(ruleSet, L"http://cdn.org/track", UrlRuleBlock, 5);
+	CheckMatch(ruleSet, L"http://redirect.com/redirect/", UrlRuleRedirect, 6);
+	CheckMatch(ruleSet, L"http://redirect.com/track", UrlRuleRedirect, 9);
+}
+
+void CheckInvalidRules()
+{
+	CUrlRuleSetBuilder builder;
+	CHECK(builder.AddHostRule(L"", UrlRuleBlock) == E_INVALIDARG);
+	CHECK(builder.AddHostRule(L"*.", UrlRuleBlock) == E_INVALIDARG);
+	CHECK(builder.AddHostRule(L"b\x00fccher.de", UrlRuleBlock) ==
+		E_INVALIDARG);
+	CHECK(builder.AddSubstringRule(L"", UrlRuleBlock) == E_INVALIDARG);
+	CHECK(builder.AddSubstringRule(L"/ads/", 0) == E_INVALIDARG);
+	CHECK(builder.AddSubstringRule(L"/ads/", UrlRuleAllow + 1) ==
+		E_INVALIDARG);
+
+	// Nothing was added, nothing matches
+	CUrlRuleSet ruleSet;
+	CHECK(builder.Build(&ruleSet) == S_OK);
+	CheckNoMatch(ruleSet, L"http://example.com/ads/");
+
+	CUrlRuleSet emptyRuleSet;
+	CHECK(emptyRuleSet.IsEmpty());
+	UrlRuleMatch match;
+	CHECK(emptyRuleSet.Match(L"http://example.com/", &match) == S_FALSE);
+}
+
+void BuildImageRules(CUrlRuleSet* pRuleSet)
+{
+	CUrlRuleSetBuilder builder;
+	CHECK(builder.AddHostRule(L"example.com", UrlRuleBlock, 1) == S_OK);
+	CHECK(builder.AddHostRule(L"ok.example.com", UrlRuleAllow, 2) == S_OK);
+	CHECK(builder.AddSubstringRule(L"/ads/", UrlRuleRedirect, 3) == S_OK);
+	CHECK(builder.Build(pRuleSet) == S_OK);
+}
+
+void CheckImageRules(const CUrlRuleSet& ruleSet)
+{
+	CheckMatch(ruleSet, L"http://a.example.com/", UrlRuleBlock, 1);
+	CheckMatch(ruleSet, L"http://ok.example.com/", UrlRuleAllow, 2);
+	CheckMatch(ruleSet, L"http://other.com/ads/", UrlRuleRedirect, 3);
+	CheckNoMatch(ruleSet, L"http://other.com/");
+}
+
+BYTE* CopyImage(const CUrlRuleSet& ruleSet)
+{
+	BYTE* pbImage = new BYTE[ruleSet.GetImageSize()];
+	memcpy(pbImage, ruleSet.GetImage(), ruleSet.GetImageSize());
+	return pbImage;
+}
+
+Detail::UrlRuleImageHeader* GetHeader(BYTE* pbImage)
+{
+	return reinterpret_cast<Detail::UrlRuleImageHeader*>(pbImage);
+}
+
+// Attaching a copy of the image, damaged by pfnDamage, fails and leaves
+// the image to the caller
+void CheckRefused(const CUrlRuleSet& ruleSet,
+	void (*pfnDamage)(Detail::UrlRuleImageHeader* pHeader))
+{
+	BYTE* pbImage = CopyImage(ruleSet);
+	pfnDamage(GetHeader(pbImage));
+	CUrlRuleSet damaged;
+	CHECK(damaged.AttachImage(pbImage, ruleSet.GetImageSize()) ==
+		E_INVALIDARG);
+	CHECK(damaged.IsEmpty());
+	delete [] pbImage;
+}
+
+void DamageMagic(Detail::UrlRuleImageHeader* pHeader)
+{
+	pHeader->dwMagic ^= 0xFF000000;
+}
+
+void DamageVersion(Detail::UrlRuleImageHeader* pHeader)
+{
+	++pHeader->dwVersion;
+}
+
+void DamageSize(Detail::UrlRuleImageHeader* pHeader)
+{
+	pHeader->cbImage += sizeof(DWORD);
+}
+
+void DamageHostNodes(Detail::UrlRuleImageHeader* pHeader)
+{
+	pHeader->cHostNodes = 0;
+}
+
+void DamageRulesOffset(Detail::UrlRuleImageHeader* pHeader)
+{
+	pHeader->offRules = pHeader->cbImage;
+}
+
+void DamageTextEdgesOffset(Detail::UrlRuleImageHeader* pHeader)
+{
+	pHeader->offTextEdges += 2;
+}
+
+void DamageTextNodesOffset(Detail::UrlRuleImageHeader* pHeader)
+{
+	pHeader->offTextNodes = 0;
+}
+
+void DamageHostEdgeCount(Detail::UrlRuleImageHeader* pHeader)
+{
+	// Would wrap around in 32 bits
+	pHeader->cHostEdges = 0x20000000;
+}
+
+void DamageBloomBlocks(Detail::UrlRuleImageHeader* pHeader)
+{
+	pHeader->cBloomBlocks = pHeader->cbImage / Detail::cbUrlRuleBloomBlock;
+}
+
+void DamageBloomHashes(Detail::UrlRuleImageHeader* pHeader)
+{
+	pHeader->cBloomHashes = Detail::maxUrlRuleBloomHashes + 1;
+}
+
+void CheckDamagedHeaders()
+{
+	CUrlRuleSet ruleSet;
+	BuildImageRules(&ruleSet);
+
+	CheckRefused(ruleSet, DamageMagic);
+	CheckRefused(ruleSet, DamageVersion);
+	CheckRefused(ruleSet, DamageSize);
+	CheckRefused(ruleSet, DamageHostNodes);
+	CheckRefused(ruleSet, DamageRulesOffset);
+	CheckRefused(ruleSet, DamageTextEdgesOffset);
+	CheckRefused(ruleSet, DamageTextNodesOffset);
+	CheckRefused(ruleSet, DamageHostEdgeCount);
+	CheckRefused(ruleSet, DamageBloomBlocks);
+	CheckRefused(ruleSet, DamageBloomHashes);
+
+	// Truncated, even by the padding after the last section
+	BYTE* pbImage = CopyImage(ruleSet);
+	CUrlRuleSet truncated;
+	CHECK(truncated.AttachImage(pbImage, ruleSet.GetImageSize() - 1) ==
+		E_INVALIDARG);
+	CHECK(truncated.AttachImage(pbImage,
+		sizeof(Detail::UrlRuleImageHeader) - 1) == E_INVALIDARG);
+	CHECK(truncated.IsEmpty());
+
+	// The undamaged copy is taken
+	CHECK(truncated.AttachImage(pbImage, ruleSet.GetImageSize()) == S_OK);
+	CheckImageRules(truncated);
+}
+
+// Overwrites the nodes and edges of a valid image with garbage, so that
+// the indices in them point anywhere
+void CheckDamagedNodes()
+{
+	CUrlRuleSet ruleSet;
+	BuildImageRules(&ruleSet);
+	const Detail::UrlRuleImageHeader* pHeader =
+		reinterpret_cast<const Detail::UrlRuleImageHeader*>(
+			ruleSet.GetImage());
+	const DWORD offNodes = pHeader->offHostNodes;
+	const DWORD offBloom = pHeader->offBloom;
+
+	DWORD dwState = 1;
+	for (int iRound = 0; iRound < 200; ++iRound)
+	{
+		BYTE* pbImage = CopyImage(ruleSet);
+		DWORD* pdw = reinterpret_cast<DWORD*>(pbImage + offNodes);
+		DWORD* pdwEnd = reinterpret_cast<DWORD*>(pbImage + offBloom);
+		for (; pdw < pdwEnd; ++pdw)
+		{
+			dwState = dwState * 1664525 + 1013904223;
+			// Small values, valid or just out of range, and wild ones
+			*pdw = (iRound % 2) ? dwState : (dwState >> 28);
+		}
+		CUrlRuleSet damaged;
+		CHECK(damaged.AttachImage(pbImage, ruleSet.GetImageSize()) == S_OK);
+
+		LPCWSTR const rgszUrls[] = {L"http://a.example.com/ads/",
+			L"http://ok.example.com/", L"http://other.com/x/ads/ads/"};
+		for (size_t i = 0; i < sizeof(rgszUrls) / sizeof(rgszUrls[0]); ++i)
+		{
+			UrlRuleMatch match;
+			HRESULT hr = damaged.Match(rgszUrls[i], &match);
+			CHECK(hr == S_OK || hr == S_FALSE);
+		}
+	}
+}
+
+HRESULT WriteImageFile(LPCWSTR szFileName, const BYTE* pbImage,
+	DWORD cbImage)
+{
+	HANDLE hFile = CreateFileW(szFileName, GENERIC_WRITE, 0, 0,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	DWORD cbWritten = 0;
+	BOOL bOk = WriteFile(hFile, pbImage, cbImage, &cbWritten, 0);
+	CloseHandle(hFile);
+	return bOk && cbWritten == cbImage ? S_OK : E_FAIL;
+}
+
+void CheckMappedImages(const std::wstring& directory)
+{
+	CUrlRuleSet ruleSet;
+	BuildImageRules(&ruleSet);
+	std::wstring fileName = directory + L"/rules.bin";
+	CHECK(ruleSet.SaveImage(fileName.c_str()) == S_OK);
+
+	// Used in place, and the same as the image saved
+	CUrlRuleSet mapped;
+	CHECK(mapped.MapImage(fileName.c_str()) == S_OK);
+	CHECK(mapped.GetImage() != ruleSet.GetImage());
+	CHECK(mapped.GetImageSize() == ruleSet.GetImageSize());
+	CHECK(!memcmp(mapped.GetImage(), ruleSet.GetImage(),
+		ruleSet.GetImageSize()));
+	CheckImageRules(mapped);
+
+	// Another mapping of the same file
+	CUrlRuleSet mappedAgain;
+	CHECK(mappedAgain.MapImage(fileName.c_str()) == S_OK);
+	CheckImageRules(mappedAgain);
+	mapped.Free();
+	CHECK(mapped.IsEmpty());
+	CheckImageRules(mappedAgain);
+	mappedAgain.Free();
+	DeleteFileW(fileName.c_str());
+
+	// Truncated files, and a file that isn't there
+	std::wstring truncatedName = directory + L"/truncated.bin";
+	const DWORD rgcbTruncated[] = {ruleSet.GetImageSize() / 2,
+		sizeof(Detail::UrlRuleImageHeader),
+		sizeof(Detail::UrlRuleImageHeader) - 1};
+	for (size_t i = 0; i < sizeof(rgcbTruncated) / sizeof(DWORD); ++i)
+	{
+		CHECK(WriteImageFile(truncatedName.c_str(), ruleSet.GetImage(),
+			rgcbTruncated[i]) == S_OK);
+		CUrlRuleSet truncated;
+		CHECK(truncated.MapImage(truncatedName.c_str()) == E_INVALIDARG);
+		CHECK(truncated.IsEmpty());
+	}
+	DeleteFileW(truncatedName.c_str());
+	CUrlRuleSet missing;
+	CHECK(FAILED(missing.MapImage(truncatedName.c_str())));
+	CHECK(missing.IsEmpty());
+
+	// A failed MapImage keeps the rules already loaded
+	CHECK(mapped.AttachImage(CopyImage(ruleSet), ruleSet.GetImageSize()) ==
+		S_OK);
+	CHECK(FAILED(mapped.MapImage(truncatedName.c_str())));
+	CheckImageRules(mapped);
+}
+
+// A rule set blocking example.com, with dwData telling them apart
+CUrlRuleSet* NewGeneration(DWORD dwGeneration)
+{
+	CUrlRuleSetBuilder builder;
+	CHECK(builder.AddHostRule(L"example.com", UrlRuleBlock, dwGeneration) ==
+		S_OK);
+	CUrlRuleSet* pRuleSet = new CUrlRuleSet;
+	CHECK(builder.Build(pRuleSet) == S_OK);
+	return pRuleSet;
+}
+
+DWORD GetGeneration(const CUrlRuleSet* pRuleSet)
+{
+	UrlRuleMatch match = {0, 0};
+	CHECK(pRuleSet->Match(L"http://example.com/", &match) == S_OK);
+	return match.dwData;
+}
+
+// Publishes rule sets, holding a snapshot of each, until all slots are in
+// use, and returns how many it published. Each slot still holding a rule
+// set that should have been reclaimed makes one less
+DWORD CountFreeSlots(CUrlRuleStore* pStore)
+{
+	CUrlRuleSnapshot rgSnapshots[CUrlRuleStore::cSlots];
+	DWORD cPublished = 0;
+	for (;;)
+	{
+		CUrlRuleSet* pRuleSet = NewGeneration(1000 + cPublished);
+		if (pStore->Publish(pRuleSet) != S_OK)
+		{
+			delete pRuleSet;
+			break;
+		}
+		CHECK(cPublished < CUrlRuleStore::cSlots);
+		pStore->GetSnapshot(&rgSnapshots[cPublished++]);
+	}
+	return cPublished;
+}
+
+void CheckSnapshots()
+{
+	CUrlRuleStore store;
+	UrlRuleMatch match;
+	CHECK(store.Match(L"http://example.com/", &match) == S_FALSE);
+	CUrlRuleSnapshot none;
+	store.GetSnapshot(&none);
+	CHECK(none.Get() == 0);
+
+	CHECK(store.Publish(NewGeneration(1)) == S_OK);
+	CUrlRuleSnapshot first;
+	store.GetSnapshot(&first);
+	CHECK(store.Publish(NewGeneration(2)) == S_OK);
+
+	// The snapshot still sees the first rule set, the store the second
+	CHECK(first.Get() != 0 && GetGeneration(first.Get()) == 1);
+	CHECK(store.Match(L"http://example.com/", &match) == S_OK);
+	CHECK(match.dwData == 2);
+	CUrlRuleSnapshot second;
+	store.GetSnapshot(&second);
+	CHECK(second.Get() != 0 && GetGeneration(second.Get()) == 2);
+
+	// Taking another snapshot into one releases what it held
+	store.GetSnapshot(&first);
+	CHECK(GetGeneration(first.Get()) == 2);
+	first.Release();
+	second.Release();
+
+	// Removing the rule set
+	CHECK(store.Publish(0) == S_OK);
+	CHECK(store.Match(L"http://example.com/", &match) == S_FALSE);
+	store.GetSnapshot(&first);
+	CHECK(first.Get() == 0);
+}
+
+void CheckReclaim()
+{
+	const DWORD cUsableSlots = CUrlRuleStore::cSlots - 1;
+	CUrlRuleStore store;
+	CHECK(CountFreeSlots(&store) == cUsableSlots);
+
+	// Every slot holds a rule set with a snapshot
+	CUrlRuleSnapshot rgSnapshots[CUrlRuleStore::cSlots];
+	for (DWORD i = 0; i < cUsableSlots; ++i)
+	{
+		CHECK(store.Publish(NewGeneration(i)) == S_OK);
+		store.GetSnapshot(&rgSnapshots[i]);
+	}
+	CUrlRuleSet* pRuleSet = NewGeneration(100);
+	CHECK(store.Publish(pRuleSet) == E_PENDING);
+
+	// Releasing the snapshot of the current rule set frees nothing
+	rgSnapshots[cUsableSlots - 1].Release();
+	CHECK(store.Publish(pRuleSet) == E_PENDING);
+
+	// Releasing the last snapshot of a replaced one frees its slot at
+	// once, while the others still match against theirs
+	CUrlRuleSnapshot extra;
+	store.GetSnapshot(&extra);
+	rgSnapshots[5].Release();
+	CHECK(store.Publish(pRuleSet) == S_OK);
+	for (DWORD i = 0; i < cUsableSlots - 1; ++i)
+	{
+		if (i != 5)
+		{
+			CHECK(GetGeneration(rgSnapshots[i].Get()) == i);
+		}
+	}
+
+	// The rule set just replaced is kept for its snapshot, and freed with
+	// it
+	CHECK(GetGeneration(extra.Get()) == cUsableSlots - 1);
+	pRuleSet = NewGeneration(101);
+	CHECK(store.Publish(pRuleSet) == E_PENDING);
+	extra.Release();
+	CHECK(store.Publish(pRuleSet) == S_OK);
+
+	for (DWORD i = 0; i < cUsableSlots; ++i)
+	{
+		rgSnapshots[i].Release();
+	}
+	CHECK(CountFreeSlots(&store) == cUsableSlots);
+}
+
+// Readers take snapshots and match in a loop while rule sets are
+// published. Each sees the generations in order, and a snapshot keeps
+// seeing the same one
+void CheckConcurrentPublish()
+{
+	const DWORD cGenerations = 2000;
+	const unsigned cReaders = 3;
+	CUrlRuleStore store;
+	CHECK(store.Publish(NewGeneration(0)) == S_OK);
+
+	LONG volatile cStarted = 0;
+	LONG volatile bDone = 0;
+	std::vector<std::thread> readers;
+	std::vector<char> results(cReaders, 1);
+	for (unsigned i = 0; i < cReaders; ++i)
+	{
+		readers.push_back(std::thread([&, i]()
+		{
+			InterlockedIncrement(&cStarted);
+			DWORD dwLast = 0;
+			while (!bDone)
+			{
+				CUrlRuleSnapshot snapshot;
+				store.GetSnapshot(&snapshot);
+				DWORD dwGeneration = GetGeneration(snapshot.Get());
+				std::this_thread::yield();
+				if (dwGeneration < dwLast ||
+					GetGeneration(snapshot.Get()) != dwGeneration)
+				{
+					results[i] = 0;
+				}
+				dwLast = dwGeneration;
+			}
+		}));
+	}
+
+	while (cStarted < static_cast<LONG>(cReaders))
+	{
+		std::this_thread::yield();
+	}
+	for (DWORD i = 1; i <= cGenerations; ++i)
+	{
+		CUrlRuleSet* pRuleSet = NewGeneration(i);
+		HRESULT hr;
+		while ((hr = store.Publish(pRuleSet)) == E_PENDING)
+		{
+			std::this_thread::yield();
+		}
+		CHECK(hr == S_OK);
+		if ((i & 63) == 0)
+		{
+			std::this_thread::yield();
+		}
+	}
+	InterlockedExchange(&bDone, 1);
+	for (size_t i = 0; i < readers.size(); ++i)
+	{
+		readers[i].join();
+		CHECK(results[i] != 0);
+	}
+
+	// Every replaced rule set was reclaimed
+	UrlRuleMatch match;
+	CHECK(store.Match(L"http://example.com/", &match) == S_OK);
+	CHECK(match.dwData == cGenerations);
+	CHECK(CountFreeSlots(&store) == CUrlRuleStore::cSlots - 1);
+}
+
+class CRandom
+{
+public:
+	explicit CRandom(DWORD dwSeed) : m_dwState(dwSeed) {}
+
+	DWORD Next(DWORD dwBound)
+	{
+		m_dwState = m_dwState * 1664525 + 1013904223;
+		return (m_dwState >> 8) % dwBound;
+	}
+
+	// Words with a digit can't be any of the rules, which have none
+	std::wstring Word(DWORD cchMin, DWORD cchMax, bool bDigit = false)
+	{
+		std::wstring word;
+		for (DWORD cch = cchMin + Next(cchMax - cchMin + 1); cch; --cch)
+		{
+			word += static_cast<wchar_t>(L'a' + Next(26));
+		}
+		if (bDigit)
+		{
+			word += static_cast<wchar_t>(L'0' + Next(10));
+		}
+		return word;
+	}
+
+private:
+	DWORD m_dwState;
+};
+
+const DWORD cPrefilterHosts = 20000;
+const DWORD cPrefilterMisses = 4000;
+
+struct PrefilterCorpus
+{
+	std::vector<std::wstring> hosts;
+	std::vector<std::wstring> missUrls;
+};
+
+void MakePrefilterCorpus(PrefilterCorpus* pCorpus)
+{
+	LPCWSTR const rgszTlds[] = {L"com", L"net", L"org", L"co.uk"};
+	const DWORD cTlds = sizeof(rgszTlds) / sizeof(rgszTlds[0]);
+	CRandom random(0x5eed);
+	for (DWORD i = 0; i < cPrefilterHosts; ++i)
+	{
+		// Made unique by the index, after a hyphen no miss has
+		std::wstring host = random.Word(3, 10) + L"-";
+		for (DWORD n = i + 1; n; n /= 26)
+		{
+			host += static_cast<wchar_t>(L'a' + n % 26);
+		}
+		if (random.Next(2))
+		{
+			host = random.Word(2, 6) + L"." + host;
+		}
+		pCorpus->hosts.push_back(host + L"." + rgszTlds[random.Next(cTlds)]);
+	}
+	for (DWORD i = 0; i < cPrefilterMisses; ++i)
+	{
+		std::wstring host = random.Word(3, 10, true) + L"." +
+			rgszTlds[random.Next(cTlds)];
+		if (random.Next(2))
+		{
+			host = random.Word(2, 6) + L"." + host;
+		}
+		pCorpus->missUrls.push_back(L"http://" + host + L"/" +
+			random.Word(2, 10));
+	}
+}
+
+void BuildPrefilterRules(const PrefilterCorpus& corpus, double dRate,
+	CUrlRuleSet* pRuleSet)
+{
+	CUrlRuleSetBuilder builder;
+	CHECK(builder.SetPrefilterFalsePositiveRate(dRate) == S_OK);
+	for (DWORD i = 0; i < cPrefilterHosts; ++i)
+	{
+		CHECK(builder.AddHostRule(corpus.hosts[i].c_str(), UrlRuleBlock, i) ==
+			S_OK);
+	}
+	CHECK(builder.Build(pRuleSet) == S_OK);
+}
+
+void CheckStatistics(const CUrlRuleSet& ruleSet, LONG cLookups,
+	LONG cAvoidedMin, LONG cAvoidedMax)
+{
+	UrlRulePrefilterStatistics stats;
+#ifdef PASSTHROUGHAPP_URLRULE_STATISTICS
+	CHECK(ruleSet.GetPrefilterStatistics(&stats) == S_OK);
+	CHECK(stats.cLookups == cLookups);
+	CHECK(stats.cAvoided >= cAvoidedMin && stats.cAvoided <= cAvoidedMax);
+#else
+	CHECK(ruleSet.GetPrefilterStatistics(&stats) == E_NOTIMPL);
+	CHECK(stats.cLookups == 0 && stats.cAvoided == 0);
+#endif
+}
+
+void CheckPrefilter(const PrefilterCorpus& corpus,
+	const CUrlRuleSet& unfiltered, double dRate)
+{
+	CUrlRuleSet ruleSet;
+	BuildPrefilterRules(corpus, dRate, &ruleSet);
+	const Detail::UrlRuleImageHeader* pHeader =
+		reinterpret_cast<const Detail::UrlRuleImageHeader*>(
+			ruleSet.GetImage());
+	CHECK(pHeader->cBloomBlocks > 0);
+	CHECK(pHeader->cBloomHashes > 0);
+
+	// Every rule host, and a subdomain of it, gets through: each lookup
+	// counts, none is avoided
+	for (DWORD i = 0; i < cPrefilterHosts; ++i)
+	{
+		std::wstring url = L"http://" + corpus.hosts[i] + L"/";
+		UrlRuleMatch match = {0, 0};
+		CHECK(ruleSet.Match(url.c_str(), &match) == S_OK);
+		CHECK(match.dwData == i);
+		url = L"http://sub." + corpus.hosts[i] + L":81/x";
+		CHECK(ruleSet.Match(url.c_str(), &match) == S_OK);
+		CHECK(match.dwData == i);
+	}
+	CheckStatistics(ruleSet, 2 * cPrefilterHosts, 0, 0);
+
+	// Misses still miss, as they do without the prefilter, which turns
+	// most of them away; at 1%, at least nine in ten with up to three
+	// labels
+	for (DWORD i = 0; i < cPrefilterMisses; ++i)
+	{
+		UrlRuleMatch match;
+		CHECK(ruleSet.Match(corpus.missUrls[i].c_str(), &match) == S_FALSE);
+		CHECK(unfiltered.Match(corpus.missUrls[i].c_str(), &match) ==
+			S_FALSE);
+	}
+	LONG cAvoidedMin = dRate <= 0.01 ? cPrefilterMisses * 9 / 10 : 1;
+	CheckStatistics(ruleSet, 2 * cPrefilterHosts + cPrefilterMisses,
+		cAvoidedMin, cPrefilterMisses);
+}
+
+void CheckPrefilters()
+{
+	PrefilterCorpus corpus;
+	MakePrefilterCorpus(&corpus);
+	CUrlRuleSet unfiltered;
+	BuildPrefilterRules(corpus, 0, &unfiltered);
+	const Detail::UrlRuleImageHeader* pHeader =
+		reinterpret_cast<const Detail::UrlRuleImageHeader*>(
+			unfiltered.GetImage());
+	CHECK(pHeader->cBloomBlocks == 0);
+
+	const double rgdRates[] = {0.5, 0.1, 0.01, 0.0001};
+	for (size_t i = 0; i < sizeof(rgdRates) / sizeof(rgdRates[0]); ++i)
+	{
+		CheckPrefilter(corpus, unfiltered, rgdRates[i]);
+	}
+
+	// Without a prefilter, nothing is counted
+	UrlRuleMatch match;
+	CHECK(unfiltered.Match(corpus.missUrls[0].c_str(), &match) == S_FALSE);
+	CheckStatistics(unfiltered, 0, 0, 0);
+}
+
+} // end anonymous namespace
+
+int main()
+{
+	CheckHostRules();
+	CheckSubstringRules();
+	CheckPrecedence();
+	CheckInvalidRules();
+
+	CheckDamagedHeaders();
+	CheckDamagedNodes();
+	char szDirectory[] = "/tmp/UrlRulesTestXXXXXX";
+	CHECK(mkdtemp(szDirectory) != 0);
+	CheckMappedImages(std::wstring(szDirectory,
+		szDirectory + strlen(szDirectory)));
+	rmdir(szDirectory);
+
+	CheckSnapshots();
+	CheckReclaim();
+	CheckConcurrentPublish();
+
+	CheckPrefilters();
+	return TEST_RESULT();
+}